@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * block_if throughput: 4K random reads at several queue depths, on
+ * each engine, from an image made by bench_image().
+ * blockif_open() warns when it has to fall back from an engine to the
+ * thread pool, and the numbers under that engine are then the pool's.
+ */
+
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "mevent.h"
+#include "block_if.h"
+#include "bench.h"
+
+#define	BENCH_BLKSZ	4096
+#define	BENCH_IMGSZ	(64 * 1024 * 1024)
+#define	BENCH_MAXQD	32
+
+struct bench_io {
+	struct blockif_req req;
+	struct bench_io *next;
+};
+
+static struct bench_io ios[BENCH_MAXQD];
+static struct bench_io *freeios;	/* completed, ready to resubmit */
+static uint64_t ndone;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+
+static void
+bench_blockif_done(struct blockif_req *req, int err)
+{
+	struct bench_io *io = req->param;
+
+	assert(err == 0);
+	pthread_mutex_lock(&mtx);
+	io->next = freeios;
+	freeios = io;
+	ndone++;
+	pthread_cond_signal(&cv);
+	pthread_mutex_unlock(&mtx);
+}
+
+/* aio completions are reaped on the default mevent loop */
+static void *
+bench_mevent_thr(void *arg)
+{
+	mevent_dispatch();
+	return NULL;
+}
+
+static void
+bench_blockif_run(const char *path, const char *engine, int qd,
+		  uint64_t iters)
+{
+	struct blockif_ctxt *bc;
+	struct bench_io *io;
+	char opts[PATH_MAX + 64], name[64];
+	uint64_t nsent, t, seed;
+	int i, err;
+
+	snprintf(opts, sizeof(opts), "%s,engine=%s", path, engine);
+	bc = blockif_open(opts, "bench");
+	assert(bc != NULL);
+
+	freeios = NULL;
+	for (i = 0; i < qd; i++) {
+		ios[i].next = freeios;
+		freeios = &ios[i];
+	}
+	ndone = 0;
+	nsent = 0;
+	seed = 88172645463325252UL;
+
+	t = bench_now();
+	pthread_mutex_lock(&mtx);
+	while (ndone < iters) {
+		if (freeios == NULL || nsent == iters) {
+			pthread_cond_wait(&cv, &mtx);
+			continue;
+		}
+		io = freeios;
+		freeios = io->next;
+		pthread_mutex_unlock(&mtx);
+
+		/* xorshift64 */
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		io->req.iov = io->req.iov_buf;
+		io->req.iovcnt = 1;
+		io->req.offset = (seed % (BENCH_IMGSZ / BENCH_BLKSZ)) *
+				 BENCH_BLKSZ;
+		io->req.resid = BENCH_BLKSZ;
+		err = blockif_read(bc, &io->req);
+		assert(err == 0);
+		nsent++;
+
+		pthread_mutex_lock(&mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+	t = bench_now() - t;
+
+	snprintf(name, sizeof(name), "blockif 4K randread %s, qd %d",
+		 engine, qd);
+	bench_report_bw(name, iters, iters * BENCH_BLKSZ, t);
+	blockif_close(bc);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *engines[] = { "thread", "aio", "io_uring" };
+	static const int qds[] = { 1, 4, 16, BENCH_MAXQD };
+	pthread_t tid;
+	char path[PATH_MAX];
+	void *buf;
+	int i, j, err;
+
+	if (bench_image(path, sizeof(path), "blockif", BENCH_IMGSZ) < 0)
+		return 1;
+
+	for (i = 0; i < BENCH_MAXQD; i++) {
+		ios[i].req.callback = bench_blockif_done;
+		ios[i].req.param = &ios[i];
+		err = posix_memalign(&buf, BENCH_BLKSZ, BENCH_BLKSZ);
+		assert(err == 0);
+		ios[i].req.iov_buf[0].iov_base = buf;
+		ios[i].req.iov_buf[0].iov_len = BENCH_BLKSZ;
+	}
+
+	err = pthread_create(&tid, NULL, bench_mevent_thr, NULL);
+	assert(err == 0);
+
+	for (i = 0; i < nitems(engines); i++)
+		for (j = 0; j < nitems(qds); j++)
+			bench_blockif_run(path, engines[i], qds[j],
+					  bench_iters(20000));
+
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * MMIO and port I/O dispatch: emulate_mem() with N BARs registered,
+ * hitting one BAR over and over (the per-vCPU cache) or each BAR in
+ * turn (a search of the range table every time), and emulate_inout()
+ * on a registered port.
+ */
+
+#include <sys/param.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "vmm.h"
+#include "vmmapi.h"
+#include "mem.h"
+#include "inout.h"
+#include "bench.h"
+
+#define	BENCH_MMIO_BASE	0xc0000000UL
+#define	BENCH_MMIO_STEP	0x10000UL	/* one 4K BAR every 64K */
+#define	BENCH_MMIO_MAX	512
+#define	BENCH_PORT	0x5000
+
+static struct mem_range ranges[BENCH_MMIO_MAX];
+
+static int
+bench_mmio_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
+		   int size, uint64_t *val, void *arg1, long arg2)
+{
+	if (dir == MEM_F_READ)
+		*val = addr;
+	return 0;
+}
+
+static int
+bench_port_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
+		   uint32_t *eax, void *arg)
+{
+	if (in)
+		*eax = port;
+	return 0;
+}
+
+static void
+bench_mmio_run(struct vmctx *ctx, int nbars, int stride, uint64_t iters)
+{
+	struct mmio_request req;
+	char name[64];
+	uint64_t t, i;
+	int bar = 0, err;
+
+	memset(&req, 0, sizeof(req));
+	req.direction = REQUEST_READ;
+	req.size = 4;
+
+	t = bench_now();
+	for (i = 0; i < iters; i++) {
+		req.address = BENCH_MMIO_BASE + bar * BENCH_MMIO_STEP + 0x10;
+		err = emulate_mem(ctx, 0, &req);
+		assert(err == 0);
+		bar += stride;
+		if (bar >= nbars)
+			bar -= nbars;
+	}
+	t = bench_now() - t;
+
+	snprintf(name, sizeof(name), "emulate_mem %d BARs, %s", nbars,
+		 stride ? "each in turn" : "same BAR");
+	bench_report(name, iters, t);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int counts[] = { 8, 64, 512 };
+	struct inout_port iop;
+	struct pio_request pio;
+	struct vmctx *ctx;
+	uint64_t iters = bench_iters(4000000), t, i;
+	int n, k, err, vcpu = 0;
+
+	ctx = bench_vm_create(BENCH_MEMSIZE);
+	init_mem();
+	init_inout(ctx);
+
+	for (n = 0, k = 0; k < nitems(counts); k++) {
+		for (; n < counts[k]; n++) {
+			ranges[n].name = "bench";
+			ranges[n].flags = MEM_F_RW;
+			ranges[n].handler = bench_mmio_handler;
+			ranges[n].base = BENCH_MMIO_BASE + n * BENCH_MMIO_STEP;
+			ranges[n].size = 4096;
+			err = register_mem(&ranges[n]);
+			assert(err == 0);
+		}
+		bench_mmio_run(ctx, n, 0, iters);
+		/* odd, so coprime to n: every BAR, never twice in a row */
+		bench_mmio_run(ctx, n, n / 2 + 1, iters);
+	}
+
+	memset(&iop, 0, sizeof(iop));
+	iop.name = "bench";
+	iop.port = BENCH_PORT;
+	iop.size = 4;
+	iop.flags = IOPORT_F_INOUT;
+	iop.handler = bench_port_handler;
+	err = register_inout(ctx, &iop);
+	assert(err == 0);
+
+	memset(&pio, 0, sizeof(pio));
+	pio.direction = REQUEST_READ;
+	pio.address = BENCH_PORT;
+	pio.size = 4;
+	t = bench_now();
+	for (i = 0; i < iters; i++) {
+		err = emulate_inout(ctx, &vcpu, &pio, 1);
+		assert(err == 0);
+	}
+	bench_report("emulate_inout", iters, bench_now() - t);
+
+	return 0;
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Guest-less virtio load: a fake guest driver that finds its devices
+ * on the emulated PCI bus, sets them up the way a legacy virtio driver
+ * does and keeps a queue depth of requests in flight, kicking through
+ * the QNOTIFY register and reaping the used ring; nothing else of the
+ * VM runs. Interrupts are suppressed with VRING_AVAIL_F_NO_INTERRUPT,
+ * the driver polls instead.
+ *
+ * - virtio-blk: 4K random reads from a raw image in $BENCH_DIR
+ *   (default /var/tmp), one device per block_if engine.
+ * - virtio-net: 1500 byte frames through the tx thread, when $BENCH_TAP
+ *   names a tap device to create. The tap is never brought up; what is
+ *   measured is the tx thread and virtio_net_proctx(), not a network.
+ */
+
+#include <sys/param.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "vmm.h"
+#include "vmmapi.h"
+#include "mem.h"
+#include "inout.h"
+#include "irq.h"
+#include "ioapic.h"
+#include "mevent.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "bench.h"
+
+#define	BENCH_BLKSZ	4096
+#define	BENCH_IMGSZ	(64 * 1024 * 1024)
+#define	BENCH_FRAMESZ	1500
+#define	BENCH_MAXQD	64
+
+#define	BENCH_SLOT_BLK	3	/* first of the virtio-blk slots */
+#define	BENCH_SLOT_NET	8
+
+/* the legacy header, without VIRTIO_NET_F_MRG_RXBUF */
+#define	BENCH_NETHDR	10
+
+struct bench_blkhdr {
+	uint32_t	type;
+	uint32_t	ioprio;
+	uint64_t	sector;
+} __attribute__((packed));
+
+/* One virtqueue as the guest driver sees it. */
+struct bench_vring {
+	uint16_t	iobase;		/* BAR0 */
+	uint16_t	qnum;
+	uint16_t	qsize;
+	uint16_t	last_used;
+	volatile struct virtio_desc *desc;
+	volatile struct vring_avail *avail;
+	volatile struct vring_used *used;
+};
+
+static struct vmctx *ctx;
+static int vcpu;
+
+static uint32_t
+bench_pio(int port, int size, int in, uint32_t val)
+{
+	struct pio_request pio;
+	int err;
+
+	memset(&pio, 0, sizeof(pio));
+	pio.direction = in ? REQUEST_READ : REQUEST_WRITE;
+	pio.address = port;
+	pio.size = size;
+	pio.value = val;
+	err = emulate_inout(ctx, &vcpu, &pio, 1);
+	assert(err == 0);
+	return pio.value;
+}
+
+/* Configuration mechanism #1, as the guest's PCI code uses it. */
+static uint32_t
+bench_cfgread(int slot, int reg, int size)
+{
+	bench_pio(0xcf8, 4, 0, 0x80000000 | (slot << 11) | (reg & ~3));
+	return bench_pio(0xcfc + (reg & 3), size, 1, 0);
+}
+
+static void
+bench_cfgwrite(int slot, int reg, int size, uint32_t val)
+{
+	bench_pio(0xcf8, 4, 0, 0x80000000 | (slot << 11) | (reg & ~3));
+	bench_pio(0xcfc + (reg & 3), size, 0, val);
+}
+
+/*
+ * Reset the device in slot, take indirect descriptors and no other
+ * optional feature, and set up queue qnum; the device is live on
+ * return.
+ */
+static void
+bench_vring_init(struct bench_vring *vr, int slot, int qnum)
+{
+	uint64_t gpa;
+	uint8_t *ring;
+	int st;
+
+	assert(bench_cfgread(slot, PCIR_VENDOR, 2) == VIRTIO_VENDOR);
+	vr->iobase = bench_cfgread(slot, PCIR_BAR(0), 4) & ~3;
+	bench_cfgwrite(slot, PCIR_COMMAND, 2,
+		       PCIM_CMD_PORTEN | PCIM_CMD_MEMEN);
+
+	bench_pio(vr->iobase + VIRTIO_CR_STATUS, 1, 0, 0);
+	st = VIRTIO_CR_STATUS_ACK | VIRTIO_CR_STATUS_DRIVER;
+	bench_pio(vr->iobase + VIRTIO_CR_STATUS, 1, 0, st);
+	assert(bench_pio(vr->iobase + VIRTIO_CR_HOSTCAP, 4, 1, 0) &
+	       VIRTIO_RING_F_INDIRECT_DESC);
+	bench_pio(vr->iobase + VIRTIO_CR_GUESTCAP, 4, 0,
+		  VIRTIO_RING_F_INDIRECT_DESC);
+
+	bench_pio(vr->iobase + VIRTIO_CR_QSEL, 2, 0, qnum);
+	vr->qnum = qnum;
+	vr->qsize = bench_pio(vr->iobase + VIRTIO_CR_QNUM, 2, 1, 0);
+	assert(vr->qsize >= BENCH_MAXQD);		/* one head per chain */
+	gpa = bench_galloc(ctx, vring_size(vr->qsize), VRING_ALIGN);
+	ring = bench_gpa(ctx, gpa);
+	vr->desc = (struct virtio_desc *)ring;
+	vr->avail = (struct vring_avail *)(ring +
+		    vr->qsize * sizeof(struct virtio_desc));
+	vr->used = (struct vring_used *)(ring +
+		   roundup2((uintptr_t)&vr->avail->ring[vr->qsize + 1] -
+			    (uintptr_t)ring, VRING_ALIGN));
+	vr->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	vr->last_used = 0;
+	bench_pio(vr->iobase + VIRTIO_CR_PFN, 4, 0, gpa >> VRING_PAGE_BITS);
+
+	st |= VIRTIO_CR_STATUS_DRIVER_OK;
+	bench_pio(vr->iobase + VIRTIO_CR_STATUS, 1, 0, st);
+}
+
+static void
+bench_vring_post(struct bench_vring *vr, uint16_t head)
+{
+	uint16_t idx = vr->avail->idx;
+
+	vr->avail->ring[idx & (vr->qsize - 1)] = head;
+	__atomic_store_n(&vr->avail->idx, idx + 1, __ATOMIC_RELEASE);
+}
+
+static void
+bench_vring_kick(struct bench_vring *vr)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!(vr->used->flags & VRING_USED_F_NO_NOTIFY))
+		bench_pio(vr->iobase + VIRTIO_CR_QNOTIFY, 2, 0, vr->qnum);
+}
+
+/* Next completed head, or -1 when the device hasn't caught up. */
+static int
+bench_vring_reap(struct bench_vring *vr)
+{
+	uint16_t head;
+
+	if (__atomic_load_n(&vr->used->idx, __ATOMIC_ACQUIRE) ==
+	    vr->last_used)
+		return -1;
+	head = vr->used->ring[vr->last_used & (vr->qsize - 1)].idx;
+	vr->last_used++;
+	return head;
+}
+
+/*
+ * Make head an indirect chain of the nseg descriptors at gpa tgpa,
+ * which are filled in with bench_desc().
+ */
+static void
+bench_chain(struct bench_vring *vr, uint16_t head, uint64_t tgpa, int nseg)
+{
+	vr->desc[head].addr = tgpa;
+	vr->desc[head].len = nseg * sizeof(struct virtio_desc);
+	vr->desc[head].flags = VRING_DESC_F_INDIRECT;
+}
+
+static void
+bench_desc(volatile struct virtio_desc *tbl, int i, uint64_t gpa,
+	   uint32_t len, uint16_t flags)
+{
+	tbl[i].addr = gpa;
+	tbl[i].len = len;
+	tbl[i].flags = flags;
+	tbl[i].next = i + 1;
+}
+
+/*
+ * Keep the chains at heads 0 to qd - 1 in flight until iters complete.
+ * refill, if set, rewrites a chain before it is posted again. Returns
+ * the elapsed ns.
+ */
+static uint64_t
+bench_vring_run(struct bench_vring *vr, int qd, uint64_t iters,
+		void (*refill)(struct bench_vring *, uint16_t))
+{
+	uint64_t done, t;
+	int k, head, got, posted;
+
+	t = bench_now();
+	for (k = 0; k < qd; k++) {
+		if (refill)
+			refill(vr, k);
+		bench_vring_post(vr, k);
+	}
+	bench_vring_kick(vr);
+
+	/* exactly iters are posted: qd now, one per completion after */
+	for (done = 0; done < iters; ) {
+		for (got = posted = 0; (head = bench_vring_reap(vr)) >= 0;
+		     got++) {
+			if (++done + qd > iters)
+				continue;
+			if (refill)
+				refill(vr, head);
+			bench_vring_post(vr, head);
+			posted++;
+		}
+		if (posted)
+			bench_vring_kick(vr);
+		else if (got == 0)
+			sched_yield();
+	}
+	return bench_now() - t;
+}
+
+static uint64_t blk_seed = 88172645463325252UL;
+
+static void
+bench_blk_refill(struct bench_vring *vr, uint16_t head)
+{
+	volatile struct virtio_desc *tbl;
+	volatile struct bench_blkhdr *hdr;
+
+	/* xorshift64 */
+	blk_seed ^= blk_seed << 13;
+	blk_seed ^= blk_seed >> 7;
+	blk_seed ^= blk_seed << 17;
+	tbl = bench_gpa(ctx, vr->desc[head].addr);
+	hdr = bench_gpa(ctx, tbl[0].addr);
+	hdr->sector = (blk_seed % (BENCH_IMGSZ / BENCH_BLKSZ)) *
+		      (BENCH_BLKSZ / 512);
+}
+
+static void
+bench_blk(int slot, const char *engine)
+{
+	static const int qds[] = { 1, 4, 16, 32 };
+	struct bench_vring vr;
+	volatile struct virtio_desc *tbl;
+	volatile struct bench_blkhdr *hdr;
+	uint64_t gpa, iters = bench_iters(20000), t;
+	char name[64];
+	int i, k;
+
+	bench_vring_init(&vr, slot, 0);
+	/* header, data, status */
+	for (k = 0; k < BENCH_MAXQD; k++) {
+		gpa = bench_galloc(ctx, 3 * sizeof(*tbl), 16);
+		tbl = bench_gpa(ctx, gpa);
+		bench_chain(&vr, k, gpa, 3);
+		gpa = bench_galloc(ctx, sizeof(*hdr), 16);
+		hdr = bench_gpa(ctx, gpa);
+		hdr->type = 0;		/* VBH_OP_READ */
+		hdr->ioprio = 0;
+		bench_desc(tbl, 0, gpa, sizeof(*hdr), VRING_DESC_F_NEXT);
+		bench_desc(tbl, 1, bench_galloc(ctx, BENCH_BLKSZ, BENCH_BLKSZ),
+			   BENCH_BLKSZ, VRING_DESC_F_WRITE | VRING_DESC_F_NEXT);
+		bench_desc(tbl, 2, bench_galloc(ctx, 1, 1), 1,
+			   VRING_DESC_F_WRITE);
+	}
+
+	for (i = 0; i < nitems(qds); i++) {
+		t = bench_vring_run(&vr, qds[i], iters, bench_blk_refill);
+		snprintf(name, sizeof(name), "virtio-blk 4K randread %s, qd %d",
+			 engine, qds[i]);
+		bench_report_bw(name, iters, iters * BENCH_BLKSZ, t);
+	}
+}
+
+static void
+bench_net(int slot)
+{
+	struct bench_vring vr;
+	volatile struct virtio_desc *tbl;
+	uint64_t gpa, iters = bench_iters(200000), t;
+	uint8_t *frame;
+	int k;
+
+	bench_vring_init(&vr, slot, 1);		/* the first tx queue */
+	for (k = 0; k < BENCH_MAXQD; k++) {
+		gpa = bench_galloc(ctx, 2 * sizeof(*tbl), 16);
+		tbl = bench_gpa(ctx, gpa);
+		bench_chain(&vr, k, gpa, 2);
+		bench_desc(tbl, 0, bench_galloc(ctx, BENCH_NETHDR, 16),
+			   BENCH_NETHDR, VRING_DESC_F_NEXT);
+		gpa = bench_galloc(ctx, BENCH_FRAMESZ, 64);
+		frame = bench_gpa(ctx, gpa);
+		memset(frame, 0xff, 6);		/* broadcast */
+		frame[12] = 0x08;		/* IPv4 */
+		bench_desc(tbl, 1, gpa, BENCH_FRAMESZ, 0);
+	}
+
+	t = bench_vring_run(&vr, BENCH_MAXQD / 2, iters, NULL);
+	bench_report_bw("virtio-net tx 1500B, qd 32", iters,
+			iters * BENCH_FRAMESZ, t);
+}
+
+/* aio completions are reaped on the default mevent loop */
+static void *
+bench_mevent_thr(void *arg)
+{
+	mevent_dispatch();
+	return NULL;
+}
+
+static void
+bench_slot(const char *fmt, ...)
+{
+	char opt[PATH_MAX + 64];
+	va_list ap;
+	int err;
+
+	va_start(ap, fmt);
+	vsnprintf(opt, sizeof(opt), fmt, ap);
+	va_end(ap);
+	err = pci_parse_slot(opt);
+	assert(err == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *engines[] = { "thread", "aio", "io_uring" };
+	char path[PATH_MAX];
+	const char *tap;
+	pthread_t tid;
+	int i, err;
+
+	if (bench_image(path, sizeof(path), "virtio", BENCH_IMGSZ) < 0)
+		return 1;
+
+	ctx = bench_vm_create(BENCH_MEMSIZE);
+	init_mem();
+	init_inout(ctx);
+	pci_irq_init(ctx);
+	ioapic_init(ctx);
+
+	bench_slot("0:0,hostbridge");
+	for (i = 0; i < nitems(engines); i++)
+		bench_slot("%d,virtio-blk,%s,engine=%s", BENCH_SLOT_BLK + i,
+			   path, engines[i]);
+	tap = getenv("BENCH_TAP");
+	if (tap != NULL)
+		bench_slot("%d,virtio-net,%s", BENCH_SLOT_NET, tap);
+
+	err = pthread_create(&tid, NULL, bench_mevent_thr, NULL);
+	assert(err == 0);
+	err = init_pci(ctx);
+	assert(err == 0);
+
+	for (i = 0; i < nitems(engines); i++)
+		bench_blk(BENCH_SLOT_BLK + i, engines[i]);
+	if (tap != NULL)
+		bench_net(BENCH_SLOT_NET);
+	else
+		printf("virtio-net: skipped, set BENCH_TAP to a tap name\n");
+
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Descriptor chain parsing: vq_getchain() over direct and indirect
+ * chains of several lengths, and vq_getchains() in bursts. The guest
+ * side posts a full ring of the same chain; only the parsing is timed,
+ * handing the chains back is not.
+ */
+
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "bench.h"
+
+#define	BENCH_QSIZE	256
+#define	BENCH_MAXSEG	64
+#define	BENCH_BURST	16
+
+struct bench_vq {
+	struct virtio_base base;
+	struct virtio_vq_info vq;
+};
+
+static struct virtio_ops bench_vq_ops = {
+	.name = "bench-vq",
+	.nvq = 1,
+	.hv_caps = VIRTIO_RING_F_INDIRECT_DESC,
+};
+
+static struct vmctx *ctx;
+static struct pci_vdev dev;
+static struct bench_vq bvq;
+
+static void
+bench_vq_setup(void)
+{
+	uint64_t ring;
+
+	ctx = bench_vm_create(BENCH_MEMSIZE);
+	dev.vmctx = ctx;
+	snprintf(dev.name, sizeof(dev.name), "bench-vq");
+	virtio_linkup(&bvq.base, &bench_vq_ops, &bvq, &dev, &bvq.vq);
+	bvq.vq.qsize = BENCH_QSIZE;
+
+	/* what a legacy driver does: select the queue and give its pfn */
+	ring = bench_galloc(ctx, vring_size(BENCH_QSIZE), 4096);
+	virtio_pci_write(ctx, 0, &dev, 0, VIRTIO_CR_QSEL, 2, 0);
+	virtio_pci_write(ctx, 0, &dev, 0, VIRTIO_CR_PFN, 4,
+			 ring >> VRING_PAGE_BITS);
+	assert(bvq.vq.flags & VQ_ALLOC);
+}
+
+/* Fill descs[0..nseg) with one chain of 4K buffers, device-writable. */
+static void
+bench_vq_chain(volatile struct virtio_desc *descs, int nseg)
+{
+	int i;
+
+	for (i = 0; i < nseg; i++) {
+		descs[i].addr = bench_galloc(ctx, 4096, 4096);
+		descs[i].len = 4096;
+		descs[i].flags = VRING_DESC_F_WRITE |
+			(i < nseg - 1 ? VRING_DESC_F_NEXT : 0);
+		descs[i].next = i + 1;
+	}
+}
+
+/*
+ * Post the chain at head BENCH_QSIZE times, i.e. a full ring, and
+ * parse them all; repeated for iters rings.
+ */
+static void
+bench_vq_run(const char *name, uint16_t head, int nseg, int burst,
+	     uint64_t iters)
+{
+	struct virtio_vq_info *vq = &bvq.vq;
+	struct iovec iov[BENCH_MAXSEG * BENCH_BURST];
+	uint16_t idx[BENCH_QSIZE], fl[BENCH_MAXSEG * BENCH_BURST];
+	uint32_t len[BENCH_QSIZE];
+	int n[BENCH_BURST];
+	uint64_t t, ns = 0, ops = 0;
+	int i, k, got;
+
+	memset(len, 0, sizeof(len));
+	for (; iters > 0; iters--) {
+		for (i = 0; i < BENCH_QSIZE; i++)
+			vq->avail->ring[(vq->avail->idx + i) &
+					(BENCH_QSIZE - 1)] = head;
+		vq->avail->idx += BENCH_QSIZE;
+
+		t = bench_now();
+		for (i = 0; i < BENCH_QSIZE; i += got) {
+			if (burst == 1) {
+				k = vq_getchain(vq, &idx[i], iov,
+						BENCH_MAXSEG, fl);
+				assert(k == nseg);
+				got = 1;
+			} else {
+				got = vq_getchains(vq, &idx[i], iov,
+						   nseg * burst, fl, n,
+						   MIN(burst,
+						       BENCH_QSIZE - i));
+				assert(got > 0 && n[0] == nseg);
+			}
+		}
+		ns += bench_now() - t;
+		ops += BENCH_QSIZE;
+
+		vq_relchains(vq, idx, len, BENCH_QSIZE);
+	}
+	bench_report(name, ops, ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+	volatile struct virtio_desc *tbl;
+	uint64_t iters = bench_iters(4000);
+	uint64_t gpa;
+	char name[64];
+	static const int segs[] = { 1, 3, 18 };
+	int i;
+
+	bench_vq_setup();
+
+	/* direct chains start at descriptor 0 */
+	for (i = 0; i < nitems(segs); i++) {
+		bench_vq_chain(bvq.vq.desc, segs[i]);
+		snprintf(name, sizeof(name), "vq_getchain direct %d", segs[i]);
+		bench_vq_run(name, 0, segs[i], 1, iters);
+	}
+	bench_vq_chain(bvq.vq.desc, 3);
+	snprintf(name, sizeof(name), "vq_getchains direct 3, burst %d",
+		 BENCH_BURST);
+	bench_vq_run(name, 0, 3, BENCH_BURST, iters);
+
+	/* an indirect chain is descriptor 0 pointing at a table */
+	gpa = bench_galloc(ctx, BENCH_MAXSEG * sizeof(struct virtio_desc),
+			   16);
+	tbl = bench_gpa(ctx, gpa);
+	bvq.vq.desc[0].addr = gpa;
+	bvq.vq.desc[0].flags = VRING_DESC_F_INDIRECT;
+	for (i = 0; i < nitems(segs); i++) {
+		bench_vq_chain(tbl, segs[i]);
+		bvq.vq.desc[0].len = segs[i] * sizeof(struct virtio_desc);
+		snprintf(name, sizeof(name), "vq_getchain indirect %d",
+			 segs[i]);
+		bench_vq_run(name, 0, segs[i], 1, iters);
+	}
+	bench_vq_chain(tbl, BENCH_MAXSEG);
+	bvq.vq.desc[0].len = BENCH_MAXSEG * sizeof(struct virtio_desc);
+	bench_vq_run("vq_getchain indirect 64", 0, BENCH_MAXSEG, 1,
+		     iters / 4);
+
+	bench_vm_destroy(ctx);
+	return 0;
+}
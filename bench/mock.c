@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Mock VM for the benchmarks, and the few symbols the device model
+ * otherwise gets from core/main.c.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "vmmapi.h"
+#include "bench.h"
+
+int guest_ncpus = 1;
+char *guest_uuid_str;
+bool stdio_in_use;
+
+static uint64_t bench_gnext;	/* bump pointer of bench_galloc() */
+
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t gaddr, size_t len)
+{
+	return vm_map_gpa(ctx, gaddr, len);
+}
+
+int
+fbsdrun_virtio_msix(void)
+{
+	return 1;
+}
+
+/*
+ * A VM with memsize bytes of guest memory at gpa 0. Nothing reaches a
+ * hypervisor: ioctls on the -1 fd fail, as interrupt injection does.
+ */
+struct vmctx *
+bench_vm_create(size_t memsize)
+{
+	struct vmctx *ctx;
+	void *mem;
+
+	ctx = calloc(1, sizeof(struct vmctx));
+	assert(ctx != NULL);
+	mem = mmap(NULL, memsize, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(mem != MAP_FAILED);
+
+	ctx->fd = -1;
+	ctx->lowmem_limit = memsize;
+	ctx->lowmem = memsize;
+	ctx->lowmem_fd = -1;
+	ctx->highmem_fd = -1;
+	ctx->snap_fd = -1;
+	ctx->baseaddr = ctx->mmap_lowmem = mem;
+	ctx->name = "bench";
+	bench_gnext = 0;
+	return ctx;
+}
+
+void
+bench_vm_destroy(struct vmctx *ctx)
+{
+	munmap(ctx->baseaddr, ctx->lowmem);
+	free(ctx);
+}
+
+/* Carve len bytes of zeroed guest memory; returns its gpa. */
+uint64_t
+bench_galloc(struct vmctx *ctx, size_t len, size_t align)
+{
+	uint64_t gpa;
+
+	gpa = roundup2(bench_gnext, align);
+	assert(gpa + len <= ctx->lowmem);
+	bench_gnext = gpa + len;
+	return gpa;
+}
+
+void *
+bench_gpa(struct vmctx *ctx, uint64_t gpa)
+{
+	return ctx->baseaddr + gpa;
+}
+
+/*
+ * Create a raw image of size bytes in $BENCH_DIR (default /var/tmp),
+ * which must take O_DIRECT opens; tmpfs does not. It is filled, so
+ * that reads don't just hit holes. Returns 0 with its name in path.
+ */
+int
+bench_image(char *path, size_t len, const char *tag, size_t size)
+{
+	const char *dir;
+	void *buf;
+	size_t off;
+	int fd;
+
+	dir = getenv("BENCH_DIR");
+	if (dir == NULL)
+		dir = "/var/tmp";
+	snprintf(path, len, "%s/bench-%s.XXXXXX", dir, tag);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	buf = calloc(1, 1024 * 1024);
+	assert(buf != NULL);
+	for (off = 0; off < size; off += 1024 * 1024)
+		if (write(fd, buf, 1024 * 1024) != 1024 * 1024) {
+			perror(path);
+			close(fd);
+			unlink(path);
+			free(buf);
+			return -1;
+		}
+	free(buf);
+	fsync(fd);
+	close(fd);
+	return 0;
+}
+
+/* Iteration counts scale with BENCH_SCALE, e.g. 0.01 for a smoke run. */
+uint64_t
+bench_iters(uint64_t n)
+{
+	static double scale = -1;
+	char *s;
+
+	if (scale < 0) {
+		s = getenv("BENCH_SCALE");
+		scale = s != NULL ? atof(s) : 1.0;
+		if (scale <= 0)
+			scale = 1.0;
+	}
+	n *= scale;
+	return n > 0 ? n : 1;
+}
+
+void
+bench_report(const char *name, uint64_t ops, uint64_t ns)
+{
+	printf("%-44s %10.1f ns/op %12.0f ops/s\n", name,
+	       (double)ns / ops, ops * 1e9 / ns);
+}
+
+void
+bench_report_bw(const char *name, uint64_t ops, uint64_t bytes, uint64_t ns)
+{
+	printf("%-44s %10.1f ns/op %12.0f ops/s %9.1f MB/s\n", name,
+	       (double)ns / ops, ops * 1e9 / ns, bytes * 1e3 / ns);
+}
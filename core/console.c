@@ -57,6 +57,18 @@ console_set_fbaddr(void *fbaddr)
 	gc_set_fbaddr(console.gc, fbaddr);
 }
 
+int
+console_import_dmabuf(int fd, int w, int h, int stride)
+{
+	return gc_import_dmabuf(console.gc, fd, w, h, stride);
+}
+
+void
+console_mark_dirty(int x, int y, int w, int h)
+{
+	gc_mark_dirty(console.gc, x, y, w, h);
+}
+
 struct gfx_ctx_image *
 console_get_image(void)
 {
@@ -77,8 +89,11 @@ console_fb_register(fb_render_func_t render_cb, void *arg)
 void
 console_refresh(void)
 {
-	if (console.fb_render_cb)
+	if (console.fb_render_cb) {
+		gc_begin_access(console.gc);
 		(*console.fb_render_cb)(console.gc, console.fb_arg);
+		gc_end_access(console.gc);
+	}
 }
 
 void
@@ -101,6 +116,30 @@ console_ptr_register(ptr_event_func_t event_cb, void *arg, int pri)
 	}
 }
 
+/*
+ * Drop a handler going away.  Whoever it displaced can't be restored,
+ * input goes nowhere until something registers again.
+ */
+void
+console_kbd_unregister(void *arg)
+{
+	if (console.kbd_arg == arg) {
+		console.kbd_event_cb = NULL;
+		console.kbd_arg = NULL;
+		console.kbd_priority = 0;
+	}
+}
+
+void
+console_ptr_unregister(void *arg)
+{
+	if (console.ptr_arg == arg) {
+		console.ptr_event_cb = NULL;
+		console.ptr_arg = NULL;
+		console.ptr_priority = 0;
+	}
+}
+
 void
 console_key_event(int down, uint32_t keysym)
 {
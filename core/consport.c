@@ -144,7 +144,7 @@ static struct inout_port consport = {
 };
 
 void
-init_bvmcons(void)
+init_bvmcons(struct vmctx *ctx)
 {
-	register_inout(&consport);
+	register_inout(ctx, &consport);
 }
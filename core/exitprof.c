@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm.h"
+#include "vhm_ioctl_defs.h"
+#include "exitprof.h"
+#include "monitor.h"
+
+#define EXITPROF_HIST	32	/* bucket n: [2^n, 2^(n+1)) cycles */
+#define EXITPROF_NDEV	128	/* device slots per vCPU, power of 2 */
+#define EXITPROF_PROBE	8
+
+/*
+ * Each vCPU has at most one request in flight, so every vcpu's block has
+ * a single writer and is updated with plain relaxed stores; the
+ * monitor reads it concurrently without locking.
+ */
+struct exitprof_dev {
+	uint32_t	type;		/* exit code + 1, 0 if the slot is free */
+	uint32_t	key;
+	uint64_t	count;
+	uint64_t	cycles;
+};
+
+struct exitprof_vcpu {
+	uint64_t	count[VM_EXITCODE_MAX];
+	uint64_t	cycles[VM_EXITCODE_MAX];
+	uint64_t	hist[VM_EXITCODE_MAX][EXITPROF_HIST];
+	struct exitprof_dev dev[EXITPROF_NDEV];
+	uint64_t	dev_overflow;
+} __aligned(64);
+
+/* probes run on any thread, so these are updated with atomic adds */
+struct exitprof_hot {
+	uint64_t	count;
+	uint64_t	cycles;
+	uint64_t	hist[EXITPROF_HIST];
+} __aligned(64);
+
+int exitprof_enabled;
+
+static struct exitprof_hot exitprof_hot[EXITPROF_NPROBE];
+static struct exitprof_vcpu *exitprof_vcpus;
+
+static const char *const exitprof_names[VM_EXITCODE_MAX] = {
+	[VM_EXITCODE_INOUT]	= "inout",
+	[VM_EXITCODE_MMIO_EMUL]	= "mmio",
+	[VM_EXITCODE_PCI_CFG]	= "pci_cfg",
+	[VM_EXITCODE_BOGUS]	= "bogus",
+	[VM_EXITCODE_HLT]	= "hlt",
+	[VM_EXITCODE_MTRAP]	= "mtrap",
+	[VM_EXITCODE_PAUSE]	= "pause",
+	[VM_EXITCODE_REQIDLE]	= "reqidle",
+};
+
+static const char *const exitprof_probe_names[EXITPROF_NPROBE] = {
+	[EXITPROF_VQ_GETCHAIN]	= "vq_getchain",
+	[EXITPROF_BLOCKIF_PROC]	= "blockif_proc",
+	[EXITPROF_MEVENT]	= "mevent",
+};
+
+static inline int
+exitprof_bucket(uint64_t cycles)
+{
+	if (cycles <= 1)
+		return 0;
+	return MIN(63 - __builtin_clzll(cycles), EXITPROF_HIST - 1);
+}
+
+static inline void
+exitprof_add(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+static uint32_t
+exitprof_key(struct vhm_request *req)
+{
+	switch (req->type) {
+	case VM_EXITCODE_INOUT:
+		return req->reqs.pio_request.address;
+	case VM_EXITCODE_MMIO_EMUL:
+		return req->reqs.mmio_request.address >> 12;
+	case VM_EXITCODE_PCI_CFG:
+		return (req->reqs.pci_request.bus << 8) |
+		       (req->reqs.pci_request.dev << 3) |
+		       req->reqs.pci_request.func;
+	default:
+		return 0;
+	}
+}
+
+void
+exitprof_record(int vcpu, struct vhm_request *req, uint64_t cycles)
+{
+	struct exitprof_vcpu *vp;
+	struct exitprof_dev *d;
+	uint32_t type = req->type, key, h;
+	int b, i;
+
+	if (vcpu < 0 || vcpu >= VM_MAXCPU || type >= VM_EXITCODE_MAX)
+		return;
+	vp = &exitprof_vcpus[vcpu];
+
+	b = exitprof_bucket(cycles);
+	exitprof_add(&vp->count[type], 1);
+	exitprof_add(&vp->cycles[type], cycles);
+	exitprof_add(&vp->hist[type][b], 1);
+
+	key = exitprof_key(req);
+	h = (key * 0x9e3779b1U) ^ type;
+	for (i = 0; i < EXITPROF_PROBE; i++) {
+		d = &vp->dev[(h + i) & (EXITPROF_NDEV - 1)];
+		if (d->type == 0) {
+			d->key = key;
+			__atomic_store_n(&d->type, type + 1, __ATOMIC_RELEASE);
+		} else if (d->type != type + 1 || d->key != key)
+			continue;
+		exitprof_add(&d->count, 1);
+		exitprof_add(&d->cycles, cycles);
+		return;
+	}
+	exitprof_add(&vp->dev_overflow, 1);
+}
+
+void
+exitprof_probe(enum exitprof_probe probe, uint64_t cycles)
+{
+	struct exitprof_hot *hp = &exitprof_hot[probe];
+
+	__atomic_add_fetch(&hp->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hp->cycles, cycles, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hp->hist[exitprof_bucket(cycles)], 1,
+			   __ATOMIC_RELAXED);
+}
+
+struct exitprof_line {
+	int			vcpu;
+	struct exitprof_dev	*dev;
+};
+
+static int
+exitprof_line_cmp(const void *a, const void *b)
+{
+	uint64_t ca = ((const struct exitprof_line *)a)->dev->cycles;
+	uint64_t cb = ((const struct exitprof_line *)b)->dev->cycles;
+
+	return (ca < cb) - (ca > cb);
+}
+
+/*
+ * A text snapshot, per-type histograms first, then the hot-path probes
+ * and devices by total time, e.g.
+ * "echo stats exitprof | socat - UNIX-CONNECT:<monitor path>".
+ */
+static void
+exitprof_dump(int fd, void *arg)
+{
+	struct exitprof_line *lines;
+	struct exitprof_vcpu *vp;
+	struct exitprof_hot *hp;
+	struct exitprof_dev *d;
+	uint64_t n;
+	int vcpu, t, i, nlines = 0;
+
+	for (vcpu = 0; vcpu < VM_MAXCPU; vcpu++) {
+		vp = &exitprof_vcpus[vcpu];
+		for (t = 0; t < VM_EXITCODE_MAX; t++) {
+			n = __atomic_load_n(&vp->count[t], __ATOMIC_RELAXED);
+			if (n == 0)
+				continue;
+			dprintf(fd, "vcpu %d exit %s count %lu avg_cycles %lu\n",
+				vcpu, exitprof_names[t] ? exitprof_names[t] :
+				"unknown", n, vp->cycles[t] / n);
+			for (i = 0; i < EXITPROF_HIST; i++) {
+				if (vp->hist[t][i])
+					dprintf(fd, "  <%lu %lu\n",
+						1UL << (i + 1), vp->hist[t][i]);
+			}
+		}
+		if (vp->dev_overflow)
+			dprintf(fd, "vcpu %d untracked devices %lu\n", vcpu,
+				vp->dev_overflow);
+	}
+
+	for (t = 0; t < EXITPROF_NPROBE; t++) {
+		hp = &exitprof_hot[t];
+		n = __atomic_load_n(&hp->count, __ATOMIC_RELAXED);
+		if (n == 0)
+			continue;
+		dprintf(fd, "probe %s count %lu avg_cycles %lu\n",
+			exitprof_probe_names[t], n,
+			__atomic_load_n(&hp->cycles, __ATOMIC_RELAXED) / n);
+		for (i = 0; i < EXITPROF_HIST; i++) {
+			if (hp->hist[i])
+				dprintf(fd, "  <%lu %lu\n",
+					1UL << (i + 1), hp->hist[i]);
+		}
+	}
+
+	lines = calloc(VM_MAXCPU * EXITPROF_NDEV, sizeof(*lines));
+	if (lines == NULL)
+		return;
+	for (vcpu = 0; vcpu < VM_MAXCPU; vcpu++) {
+		for (i = 0; i < EXITPROF_NDEV; i++) {
+			d = &exitprof_vcpus[vcpu].dev[i];
+			if (__atomic_load_n(&d->type, __ATOMIC_ACQUIRE) == 0)
+				continue;
+			lines[nlines].vcpu = vcpu;
+			lines[nlines++].dev = d;
+		}
+	}
+	qsort(lines, nlines, sizeof(*lines), exitprof_line_cmp);
+
+	dprintf(fd, "vcpu exit key count cycles avg_cycles\n");
+	for (i = 0; i < nlines; i++) {
+		d = lines[i].dev;
+		n = d->count ? d->count : 1;
+		t = d->type - 1;
+		dprintf(fd, "%d %s 0x%x %lu %lu %lu\n", lines[i].vcpu,
+			exitprof_names[t] ? exitprof_names[t] : "unknown",
+			t == VM_EXITCODE_MMIO_EMUL ? d->key << 12 : d->key,
+			d->count, d->cycles, d->cycles / n);
+	}
+	free(lines);
+}
+
+/* the profile is read as the monitor's "exitprof" source */
+int
+exitprof_init(void)
+{
+	/* already profiling, e.g. after a guest reset */
+	if (exitprof_vcpus != NULL)
+		return 0;
+
+	if (posix_memalign((void **)&exitprof_vcpus, 64,
+			   VM_MAXCPU * sizeof(struct exitprof_vcpu)) != 0) {
+		exitprof_vcpus = NULL;
+		return -1;
+	}
+	memset(exitprof_vcpus, 0, VM_MAXCPU * sizeof(struct exitprof_vcpu));
+
+	if (monitor_register("exitprof", exitprof_dump, NULL) < 0) {
+		free(exitprof_vcpus);
+		exitprof_vcpus = NULL;
+		return -1;
+	}
+	exitprof_enabled = 1;
+	return 0;
+}
@@ -1,17 +1,119 @@
 #include <sys/cdefs.h>
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "gc.h"
 
+/* beyond this many rectangles a dirty list collapses to their union */
+#define	GC_MAX_DIRTY	16
+
+struct gc_dirty {
+	int			n;
+	struct gfx_ctx_rect	r[GC_MAX_DIRTY];
+};
+
 struct gfx_ctx {
 	struct gfx_ctx_image	*gc_image;
 	int raw;
+
+	/* imported dmabuf the image data maps, zero-copy */
+	int			dmabuf_fd;
+	size_t			dmabuf_len;
+
+	/* double buffering: producers draw into back, consumers see front */
+	uint32_t		*back;
+
+	struct gc_dirty		drawn;		/* in back, not yet swapped */
+	struct gc_dirty		dirty;		/* in front, not yet taken */
 };
 
+static void
+gc_rect_union(struct gfx_ctx_rect *a, const struct gfx_ctx_rect *b)
+{
+	int x1, y1;
+
+	x1 = MAX(a->x + a->width, b->x + b->width);
+	y1 = MAX(a->y + a->height, b->y + b->height);
+	a->x = MIN(a->x, b->x);
+	a->y = MIN(a->y, b->y);
+	a->width = x1 - a->x;
+	a->height = y1 - a->y;
+}
+
+/* overlapping or edge to edge */
+static int
+gc_rect_touch(const struct gfx_ctx_rect *a, const struct gfx_ctx_rect *b)
+{
+	return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+	       a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static void
+gc_dirty_add(struct gc_dirty *d, const struct gfx_ctx_rect *r)
+{
+	int i;
+
+	for (i = 0; i < d->n; i++) {
+		if (gc_rect_touch(&d->r[i], r)) {
+			gc_rect_union(&d->r[i], r);
+			return;
+		}
+	}
+
+	if (d->n == GC_MAX_DIRTY) {
+		for (i = 1; i < d->n; i++)
+			gc_rect_union(&d->r[0], &d->r[i]);
+		gc_rect_union(&d->r[0], r);
+		d->n = 1;
+		return;
+	}
+
+	d->r[d->n++] = *r;
+}
+
+static void
+gc_mark_all(struct gfx_ctx *gc)
+{
+	gc->drawn.n = 0;
+	gc->dirty.n = 0;
+	gc_mark_dirty(gc, 0, 0, gc->gc_image->width, gc->gc_image->height);
+}
+
+static void
+gc_release_dmabuf(struct gfx_ctx *gc)
+{
+	if (gc->dmabuf_fd < 0)
+		return;
+
+	munmap(gc->gc_image->data, gc->dmabuf_len);
+	close(gc->dmabuf_fd);
+	gc->gc_image->data = NULL;
+	gc->dmabuf_fd = -1;
+	gc->dmabuf_len = 0;
+}
+
+static void
+gc_release_data(struct gfx_ctx *gc, void *keep)
+{
+	if (gc->dmabuf_fd >= 0)
+		gc_release_dmabuf(gc);
+	else if (!gc->raw && gc->gc_image->data &&
+		 gc->gc_image->data != keep)
+		free(gc->gc_image->data);
+
+	/* back buffers only pair with buffers we own */
+	free(gc->back);
+	gc->back = NULL;
+}
+
 struct gfx_ctx *
 gc_init(int width, int height, void *fbaddr)
 {
@@ -26,6 +128,7 @@ gc_init(int width, int height, void *fbaddr)
 
 	gc_image->width = width;
 	gc_image->height = height;
+	gc_image->stride = width;
 	if (fbaddr) {
 		gc_image->data = fbaddr;
 		gc->raw = 1;
@@ -34,7 +137,9 @@ gc_init(int width, int height, void *fbaddr)
 		gc->raw = 0;
 	}
 
+	gc->dmabuf_fd = -1;
 	gc->gc_image = gc_image;
+	gc_mark_all(gc);
 
 	return gc;
 }
@@ -42,10 +147,10 @@ gc_init(int width, int height, void *fbaddr)
 void
 gc_set_fbaddr(struct gfx_ctx *gc, void *fbaddr)
 {
+	gc_release_data(gc, fbaddr);
 	gc->raw = 1;
-	if (gc->gc_image->data && gc->gc_image->data != fbaddr)
-		free(gc->gc_image->data);
 	gc->gc_image->data = fbaddr;
+	gc_mark_all(gc);
 }
 
 void
@@ -55,15 +160,29 @@ gc_resize(struct gfx_ctx *gc, int width, int height)
 
 	gc_image = gc->gc_image;
 
-	gc_image->width = width;
-	gc_image->height = height;
-	if (!gc->raw) {
-		gc_image->data = realloc(gc_image->data,
-			   width * height * sizeof(uint32_t));
-		if (gc_image->data != NULL)
-			memset(gc_image->data, 0, width * height *
-			    sizeof(uint32_t));
+	/* an imported buffer has the size it was exported with */
+	if (gc->dmabuf_fd >= 0)
+		return;
+
+	if (gc->raw || gc_image->width != width ||
+	    gc_image->height != height) {
+		gc_image->width = width;
+		gc_image->height = height;
+		gc_image->stride = width;
+		if (!gc->raw) {
+			gc_image->data = realloc(gc_image->data,
+				   width * height * sizeof(uint32_t));
+			if (gc_image->data != NULL)
+				memset(gc_image->data, 0, width * height *
+				    sizeof(uint32_t));
+			if (gc->back != NULL) {
+				free(gc->back);
+				gc->back = calloc(width * height,
+						  sizeof(uint32_t));
+			}
+		}
 	}
+	gc_mark_all(gc);
 }
 
 struct gfx_ctx_image *
@@ -74,3 +193,185 @@ gc_get_image(struct gfx_ctx *gc)
 
 	return gc->gc_image;
 }
+
+/*
+ * Present a dmabuf (e.g. a guest surface the hyper_dmabuf driver
+ * exported to us) as the image by mapping it; nothing is copied.
+ * The gc takes ownership of fd.  stride is in pixels.
+ */
+int
+gc_import_dmabuf(struct gfx_ctx *gc, int fd, int width, int height,
+		 int stride)
+{
+	struct gfx_ctx_image *gc_image;
+	void *data;
+	size_t len;
+
+	if (fd < 0 || width <= 0 || height <= 0 || stride < width)
+		return -1;
+
+	len = (size_t)stride * height * sizeof(uint32_t);
+	data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("gc: dmabuf mmap");
+		return -1;
+	}
+
+	gc_image = gc->gc_image;
+	gc_release_data(gc, NULL);
+
+	gc->raw = 1;
+	gc->dmabuf_fd = fd;
+	gc->dmabuf_len = len;
+	gc_image->data = data;
+	gc_image->width = width;
+	gc_image->height = height;
+	gc_image->stride = stride;
+	gc_mark_all(gc);
+
+	return 0;
+}
+
+/*
+ * Note a changed area.  With double buffering it becomes visible to
+ * consumers at the next gc_swap().
+ */
+void
+gc_mark_dirty(struct gfx_ctx *gc, int x, int y, int width, int height)
+{
+	struct gfx_ctx_rect r;
+
+	if (x < 0) {
+		width += x;
+		x = 0;
+	}
+	if (y < 0) {
+		height += y;
+		y = 0;
+	}
+	if (x + width > gc->gc_image->width)
+		width = gc->gc_image->width - x;
+	if (y + height > gc->gc_image->height)
+		height = gc->gc_image->height - y;
+	if (width <= 0 || height <= 0)
+		return;
+
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+	gc_dirty_add(gc->back ? &gc->drawn : &gc->dirty, &r);
+}
+
+/*
+ * Hand the areas changed since the last call to a consumer and forget
+ * them.  A list longer than max is folded into its last entry.
+ * Returns the number of rectangles, 0 if nothing changed.
+ */
+int
+gc_get_dirty(struct gfx_ctx *gc, struct gfx_ctx_rect *rects, int max)
+{
+	int i, n;
+
+	n = gc->dirty.n;
+	if (n == 0 || max <= 0)
+		return 0;
+
+	if (n > max) {
+		for (i = max; i < n; i++)
+			gc_rect_union(&gc->dirty.r[max - 1], &gc->dirty.r[i]);
+		n = max;
+	}
+
+	memcpy(rects, gc->dirty.r, n * sizeof(struct gfx_ctx_rect));
+	gc->dirty.n = 0;
+	return n;
+}
+
+/*
+ * Double buffering, for a buffer the gc owns: producers draw into
+ * gc_get_drawbuf() and publish with gc_swap(), so a consumer never
+ * reads a half drawn frame.
+ */
+int
+gc_enable_double_buffer(struct gfx_ctx *gc)
+{
+	struct gfx_ctx_image *gc_image;
+
+	gc_image = gc->gc_image;
+	if (gc->raw || gc_image->data == NULL)
+		return -1;
+	if (gc->back != NULL)
+		return 0;
+
+	gc->back = malloc(gc_image->width * gc_image->height *
+			  sizeof(uint32_t));
+	if (gc->back == NULL)
+		return -1;
+
+	memcpy(gc->back, gc_image->data,
+	       gc_image->width * gc_image->height * sizeof(uint32_t));
+	return 0;
+}
+
+uint32_t *
+gc_get_drawbuf(struct gfx_ctx *gc)
+{
+	return gc->back ? gc->back : gc->gc_image->data;
+}
+
+/*
+ * Publish the back buffer.  Only the areas drawn since the last swap
+ * are copied forward to keep the new back buffer current.
+ */
+void
+gc_swap(struct gfx_ctx *gc)
+{
+	struct gfx_ctx_image *gc_image;
+	struct gfx_ctx_rect *r;
+	uint32_t *front;
+	int i, y;
+
+	if (gc->back == NULL)
+		return;
+
+	gc_image = gc->gc_image;
+	front = gc_image->data;
+	gc_image->data = gc->back;
+	gc->back = front;
+
+	for (i = 0; i < gc->drawn.n; i++) {
+		r = &gc->drawn.r[i];
+		for (y = r->y; y < r->y + r->height; y++)
+			memcpy(gc->back + y * gc_image->width + r->x,
+			       gc_image->data + y * gc_image->width + r->x,
+			       r->width * sizeof(uint32_t));
+		gc_dirty_add(&gc->dirty, r);
+	}
+	gc->drawn.n = 0;
+}
+
+/* bracket CPU reads of an imported buffer for cache coherency */
+void
+gc_begin_access(struct gfx_ctx *gc)
+{
+	struct dma_buf_sync sync;
+
+	if (gc->dmabuf_fd < 0)
+		return;
+
+	sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+	ioctl(gc->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+void
+gc_end_access(struct gfx_ctx *gc)
+{
+	struct dma_buf_sync sync;
+
+	if (gc->dmabuf_fd < 0)
+		return;
+
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+	ioctl(gc->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
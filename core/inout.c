@@ -31,6 +31,7 @@
 #include <sys/mman.h>
 #include <linux/uio.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
@@ -39,6 +40,8 @@
 #include "vmmapi.h"
 #include "dm.h"
 #include "inout.h"
+#include "exitprof.h"
+#include "monitor.h"
 
 SET_DECLARE(inout_port_set, struct inout_port);
 
@@ -47,12 +50,25 @@ SET_DECLARE(inout_port_set, struct inout_port);
 #define	VERIFY_IOPORT(port, size) \
 	assert((port) >= 0 && (size) > 0 && ((port) + (size)) <= MAX_IOPORTS)
 
-static struct {
+/* One per port, in the table each VM gets from init_inout() */
+struct inout_handler {
 	const char	*name;
 	int		flags;
 	inout_func_t	handler;
 	void		*arg;
-} inout_handlers[MAX_IOPORTS];
+};
+
+/*
+ * Optional per-port accounting, ctx->ioport_stats, allocated by
+ * inout_stats_init(). Counters are updated with relaxed atomics so the
+ * monitor can read them at any time; cycles are TSC ticks spent in the
+ * handler.
+ */
+struct inout_stats {
+	uint64_t	reads;
+	uint64_t	writes;
+	uint64_t	cycles;
+};
 
 static int
 default_inout(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
@@ -76,7 +92,7 @@ default_inout(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 }
 
 static void
-register_default_iohandler(int start, int size)
+register_default_iohandler(struct vmctx *ctx, int start, int size)
 {
 	struct inout_port iop;
 
@@ -89,15 +105,18 @@ register_default_iohandler(int start, int size)
 	iop.flags = IOPORT_F_INOUT | IOPORT_F_DEFAULT;
 	iop.handler = default_inout;
 
-	register_inout(&iop);
+	register_inout(ctx, &iop);
 }
 
 int
 emulate_inout(struct vmctx *ctx, int *pvcpu, struct pio_request *pio_request,
 	      int strict)
 {
+	struct inout_handler *h;
 	int bytes, flags, in, port;
 	inout_func_t handler;
+	struct inout_stats *st;
+	uint64_t start;
 	void *arg;
 	int retval;
 
@@ -108,13 +127,14 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct pio_request *pio_request,
 	assert(port < MAX_IOPORTS);
 	assert(bytes == 1 || bytes == 2 || bytes == 4);
 
-	handler = inout_handlers[port].handler;
+	h = &ctx->ioports[port];
+	handler = h->handler;
 
 	if (strict && handler == default_inout)
 		return -1;
 
-	flags = inout_handlers[port].flags;
-	arg = inout_handlers[port].arg;
+	flags = h->flags;
+	arg = h->arg;
 
 	if (pio_request->direction == REQUEST_READ) {
 		if (!(flags & IOPORT_F_IN))
@@ -123,20 +143,35 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct pio_request *pio_request,
 		if (!(flags & IOPORT_F_OUT))
 			return -1;
 	}
+	if (ctx->ioport_stats == NULL)
+		return handler(ctx, *pvcpu, in, port, bytes,
+			(uint32_t *)&(pio_request->value), arg);
+
+	start = exitprof_rdtsc();
 	retval = handler(ctx, *pvcpu, in, port, bytes,
 		(uint32_t *)&(pio_request->value), arg);
+	st = &ctx->ioport_stats[port];
+	__atomic_fetch_add(&st->cycles, exitprof_rdtsc() - start,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(in ? &st->reads : &st->writes, 1,
+			   __ATOMIC_RELAXED);
 	return retval;
 }
 
 void
-init_inout(void)
+init_inout(struct vmctx *ctx)
 {
 	struct inout_port **iopp, *iop;
+	struct inout_handler *h;
+
+	/* freed by vm_close() */
+	ctx->ioports = calloc(MAX_IOPORTS, sizeof(struct inout_handler));
+	assert(ctx->ioports != NULL);
 
 	/*
 	 * Set up the default handler for all ports
 	 */
-	register_default_iohandler(0, MAX_IOPORTS);
+	register_default_iohandler(ctx, 0, MAX_IOPORTS);
 
 	/*
 	 * Overwrite with specified handlers
@@ -144,16 +179,18 @@ init_inout(void)
 	SET_FOREACH(iopp, inout_port_set) {
 		iop = *iopp;
 		assert(iop->port < MAX_IOPORTS);
-		inout_handlers[iop->port].name = iop->name;
-		inout_handlers[iop->port].flags = iop->flags;
-		inout_handlers[iop->port].handler = iop->handler;
-		inout_handlers[iop->port].arg = NULL;
+		h = &ctx->ioports[iop->port];
+		h->name = iop->name;
+		h->flags = iop->flags;
+		h->handler = iop->handler;
+		h->arg = NULL;
 	}
 }
 
 int
-register_inout(struct inout_port *iop)
+register_inout(struct vmctx *ctx, struct inout_port *iop)
 {
+	struct inout_handler *h = ctx->ioports;
 	int i;
 
 	VERIFY_IOPORT(iop->port, iop->size);
@@ -164,29 +201,84 @@ register_inout(struct inout_port *iop)
 	 */
 	if ((iop->flags & IOPORT_F_DEFAULT) == 0) {
 		for (i = iop->port; i < iop->port + iop->size; i++) {
-			if ((inout_handlers[i].flags & IOPORT_F_DEFAULT) == 0)
+			if ((h[i].flags & IOPORT_F_DEFAULT) == 0)
 				return -1;
 		}
 	}
 
 	for (i = iop->port; i < iop->port + iop->size; i++) {
-		inout_handlers[i].name = iop->name;
-		inout_handlers[i].flags = iop->flags;
-		inout_handlers[i].handler = iop->handler;
-		inout_handlers[i].arg = iop->arg;
+		h[i].name = iop->name;
+		h[i].flags = iop->flags;
+		h[i].handler = iop->handler;
+		h[i].arg = iop->arg;
 	}
 
 	return 0;
 }
 
 int
-unregister_inout(struct inout_port *iop)
+unregister_inout(struct vmctx *ctx, struct inout_port *iop)
 {
 
 	VERIFY_IOPORT(iop->port, iop->size);
-	assert(inout_handlers[iop->port].name == iop->name);
+	assert(ctx->ioports[iop->port].name == iop->name);
 
-	register_default_iohandler(iop->port, iop->size);
+	register_default_iohandler(ctx, iop->port, iop->size);
 
 	return 0;
 }
+
+/*
+ * The monitor's "ioport" source: one line per port that has seen
+ * accesses, busiest first.
+ */
+static int
+inout_stats_cmp(const void *a, const void *b, void *arg)
+{
+	struct inout_stats *stats = arg;
+	uint64_t ca = stats[*(const int *)a].cycles;
+	uint64_t cb = stats[*(const int *)b].cycles;
+
+	return (ca < cb) - (ca > cb);
+}
+
+static void
+inout_stats_dump(int fd, void *arg)
+{
+	struct vmctx *ctx = arg;
+	struct inout_stats *stats = ctx->ioport_stats, *st;
+	uint64_t n;
+	int *ports;
+	int i, nports;
+
+	ports = malloc(MAX_IOPORTS * sizeof(int));
+	if (ports == NULL)
+		return;
+
+	for (i = 0, nports = 0; i < MAX_IOPORTS; i++) {
+		if (__atomic_load_n(&stats[i].reads, __ATOMIC_RELAXED) ||
+		    __atomic_load_n(&stats[i].writes, __ATOMIC_RELAXED))
+			ports[nports++] = i;
+	}
+	qsort_r(ports, nports, sizeof(int), inout_stats_cmp, stats);
+
+	dprintf(fd, "port reads writes cycles avg_cycles handler\n");
+	for (i = 0; i < nports; i++) {
+		st = &stats[ports[i]];
+		n = st->reads + st->writes;
+		dprintf(fd, "0x%04x %lu %lu %lu %lu %s\n",
+			ports[i], st->reads, st->writes, st->cycles,
+			st->cycles / n, ctx->ioports[ports[i]].name);
+	}
+	free(ports);
+}
+
+int
+inout_stats_init(struct vmctx *ctx)
+{
+	/* freed by vm_close() */
+	ctx->ioport_stats = calloc(MAX_IOPORTS, sizeof(struct inout_stats));
+	if (ctx->ioport_stats == NULL)
+		return -1;
+	return monitor_register("ioport", inout_stats_dump, ctx);
+}
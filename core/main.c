@@ -31,6 +31,7 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
@@ -60,6 +61,11 @@
 #include "smbiostbl.h"
 #include "rtc.h"
 #include "version.h"
+#include "exitprof.h"
+#include "monitor.h"
+#include "snapshot.h"
+#include "dm_trace.h"
+#include "numa.h"
 
 #define GUEST_NIO_PORT		0x488	/* guest upcalls via i/o port */
 
@@ -84,6 +90,14 @@ static int strictmsr = 1;
 
 static int acpi;
 
+static int ioreq_threads;	/* dispatch requests on per-vCPU threads */
+static uint64_t ioreq_poll_max;	/* max busy-poll window in ns, 0: off */
+static bool ioport_stats;	/* count per-port I/O for the monitor */
+static bool exitprof;		/* profile VM exits for the monitor */
+static char *monitor_path;	/* runtime monitor socket, or NULL */
+static char *snapshot_path;	/* -o snapshot to save, or NULL */
+static char *restore_path;	/* -R snapshot to start from, or NULL */
+
 static char *progname;
 static const int BSP;
 
@@ -91,15 +105,15 @@ static cpuset_t cpumask;
 
 static void do_close_pre(struct vmctx *ctx);
 static void do_close_post(struct vmctx *ctx);
+static int build_guest_tables(struct vmctx *ctx, int mptgen);
 static void vm_loop(struct vmctx *ctx);
 
 static int quit_vm_loop;
 
-static char vhm_request_page[4096] __attribute__ ((aligned(4096)));
-
-static struct vhm_request *vhm_req_buf =
-				(struct vhm_request *)&vhm_request_page;
-
+/*
+ * The vmexit counters are bumped by every ioreq worker, so with relaxed
+ * atomics; ioreq_poll_* only ever by vm_loop.
+ */
 struct dmstats {
 	uint64_t	vmexit_bogus;
 	uint64_t	vmexit_reqidle;
@@ -109,8 +123,27 @@ struct dmstats {
 	uint64_t	cpu_switch_rotate;
 	uint64_t	cpu_switch_direct;
 	uint64_t	vmexit_mmio_emul;
+	uint64_t	vmexit_inout;
+	uint64_t	vmexit_pci_cfg;
+	uint64_t	ioreq_poll_hit;
+	uint64_t	ioreq_poll_miss;
 } stats;
 
+static void
+dmstats_dump(int fd, void *arg)
+{
+	dprintf(fd, "vmexit_inout %lu\n", stats.vmexit_inout);
+	dprintf(fd, "vmexit_mmio_emul %lu\n", stats.vmexit_mmio_emul);
+	dprintf(fd, "vmexit_pci_cfg %lu\n", stats.vmexit_pci_cfg);
+	dprintf(fd, "vmexit_bogus %lu\n", stats.vmexit_bogus);
+	dprintf(fd, "vmexit_reqidle %lu\n", stats.vmexit_reqidle);
+	dprintf(fd, "vmexit_hlt %lu\n", stats.vmexit_hlt);
+	dprintf(fd, "vmexit_pause %lu\n", stats.vmexit_pause);
+	dprintf(fd, "vmexit_mtrap %lu\n", stats.vmexit_mtrap);
+	dprintf(fd, "ioreq_poll_hit %lu\n", stats.ioreq_poll_hit);
+	dprintf(fd, "ioreq_poll_miss %lu\n", stats.ioreq_poll_miss);
+}
+
 struct mt_vmm_info {
 	pthread_t	mt_thr;
 	struct vmctx	*mt_ctx;
@@ -119,40 +152,68 @@ struct mt_vmm_info {
 
 static cpuset_t *vcpumap[VM_MAXCPU] = { NULL };
 
+/*
+ * Per-vCPU I/O request worker. When ioreq_threads is set, vm_loop only
+ * scans the shared request page and hands each pending slot to the worker
+ * owning that vCPU, so a slow exit on one vCPU doesn't stall the others.
+ */
+struct ioreq_worker {
+	pthread_t	thr;
+	struct vmctx	*ctx;
+	int		vcpu;
+	bool		pending;
+	bool		quit;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+} ioreq_workers[VM_MAXCPU];
+
 static struct vmctx *_ctx;
 
 static void
 usage(int code)
 {
 	fprintf(stderr,
-		"Usage: %s [-abehuwxACHPSWY] [-c vcpus] [-g <gdb port>] [-l <lpc>]\n"
-		"       %*s [-m mem] [-p vcpu:hostcpu] [-s <pci>] [-U uuid] <vm>\n"
+		"Usage: %s [-abehiuwxACEHPSTWYZ] [-c vcpus] [-g <gdb port>] [-l <lpc>]\n"
+		"       %*s [-D <path>] [-m mem] [-O usec] [-p vcpu:hostcpu] [-s <pci>]\n"
+		"       %*s [-N node|auto|bus/slot/func] [-o|-R <snapshot>] [-U uuid]\n"
+		"       %*s [-z 2M|1G] <vm>\n"
 		"       -a: local apic is in xAPIC mode (deprecated)\n"
 		"       -A: create ACPI tables\n"
 		"       -c: # cpus (default 1)\n"
 		"       -C: include guest memory in core file\n"
+		"       -D: serve runtime statistics and debug switches on a unix socket\n"
 		"       -e: exit on unhandled I/O access\n"
+		"       -E: profile VM exits and hot paths, as monitor source exitprof\n"
 		"       -g: gdb port\n"
 		"       -h: help\n"
 		"       -H: vmexit from the guest on hlt\n"
+		"       -i: count per-port I/O, as monitor source ioport\n"
 		"       -l: LPC device configuration\n"
 		"       -m: memory size in MB\n"
 		"       -M: do not hide INTx link for MSI&INTx capable ptdev\n"
+		"       -N: bind guest memory and DM threads to a host NUMA node\n"
+		"       -o: save a boot-ready snapshot of the VM and exit\n"
+		"       -O: busy-poll for I/O requests up to usec before sleeping\n"
 		"       -p: pin 'vcpu' to 'hostcpu'\n"
 		"       -P: vmexit from the guest on pause\n"
+		"       -R: start from an -o snapshot, with the same -s devices\n"
 		"       -s: <slot,driver,configinfo> PCI slot config\n"
-		"       -S: guest memory cannot be swapped\n"
+		"       -S: prefault guest memory and lock it in RAM\n"
+		"       -T: dispatch I/O requests on per-vCPU threads\n"
 		"       -u: RTC keeps UTC time\n"
 		"       -U: uuid\n"
 		"       -w: ignore unimplemented MSRs\n"
 		"       -W: force virtio to use single-vector MSI\n"
 		"       -x: local apic is in x2APIC mode\n"
 		"       -Y: disable MPtable generation\n"
+		"       -z: back guest memory with 2M or 1G hugepages\n"
+		"       -Z: populate guest memory on first touch\n"
 		"       -k: kernel image path\n"
 		"       -r: ramdisk image path\n"
 		"       -B: bootargs for kernel\n"
 		"       -v: version\n",
-		progname, (int)strlen(progname), "");
+		progname, (int)strlen(progname), "",
+		(int)strlen(progname), "", (int)strlen(progname), "");
 
 	exit(code);
 }
@@ -306,6 +367,7 @@ vmexit_inout(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 	bytes = vhm_req->reqs.pio_request.size;
 	in = (vhm_req->reqs.pio_request.direction == REQUEST_READ);
 
+	__atomic_fetch_add(&stats.vmexit_inout, 1, __ATOMIC_RELAXED);
 	error = emulate_inout(ctx, pvcpu, &vhm_req->reqs.pio_request, strictio);
 	if (error) {
 		fprintf(stderr, "Unhandled %s%c 0x%04x\n",
@@ -323,8 +385,8 @@ vmexit_mmio_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
 	int err;
 
-	stats.vmexit_mmio_emul++;
-	err = emulate_mem(ctx, &vhm_req->reqs.mmio_request);
+	__atomic_fetch_add(&stats.vmexit_mmio_emul, 1, __ATOMIC_RELAXED);
+	err = emulate_mem(ctx, *pvcpu, &vhm_req->reqs.mmio_request);
 
 	if (err) {
 		if (err == -ESRCH)
@@ -347,6 +409,7 @@ vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
 	int err, in = (vhm_req->reqs.pci_request.direction == REQUEST_READ);
 
+	__atomic_fetch_add(&stats.vmexit_pci_cfg, 1, __ATOMIC_RELAXED);
 	err = emulate_pci_cfgrw(ctx, *pvcpu, in,
 			vhm_req->reqs.pci_request.bus,
 			vhm_req->reqs.pci_request.dev,
@@ -380,7 +443,7 @@ vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_bogus(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_bogus++;
+	__atomic_fetch_add(&stats.vmexit_bogus, 1, __ATOMIC_RELAXED);
 
 	return VMEXIT_CONTINUE;
 }
@@ -388,7 +451,7 @@ vmexit_bogus(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_reqidle(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_reqidle++;
+	__atomic_fetch_add(&stats.vmexit_reqidle, 1, __ATOMIC_RELAXED);
 
 	return VMEXIT_CONTINUE;
 }
@@ -396,7 +459,7 @@ vmexit_reqidle(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_hlt(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_hlt++;
+	__atomic_fetch_add(&stats.vmexit_hlt, 1, __ATOMIC_RELAXED);
 
 	/*
 	 * Just continue execution with the next instruction. We use
@@ -409,7 +472,7 @@ vmexit_hlt(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_pause(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_pause++;
+	__atomic_fetch_add(&stats.vmexit_pause, 1, __ATOMIC_RELAXED);
 
 	return VMEXIT_CONTINUE;
 }
@@ -417,7 +480,7 @@ vmexit_pause(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_mtrap(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_mtrap++;
+	__atomic_fetch_add(&stats.vmexit_mtrap, 1, __ATOMIC_RELAXED);
 
 	return VMEXIT_CONTINUE;
 }
@@ -436,8 +499,9 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 static void
 handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 {
-	int rc;
+	int rc, req_vcpu = vcpu;
 	enum vm_exitcode exitcode;
+	uint64_t start = 0;
 
 	exitcode = vhm_req->type;
 	if (exitcode >= VM_EXITCODE_MAX || handler[exitcode] == NULL) {
@@ -446,7 +510,13 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 		exit(1);
 	}
 
+	DM_TRACE2(vmexit_entry, req_vcpu, exitcode);
+	if (exitprof_enabled)
+		start = exitprof_rdtsc();
 	rc = (*handler[exitcode])(ctx, vhm_req, &vcpu);
+	if (exitprof_enabled)
+		exitprof_record(req_vcpu, vhm_req, exitprof_rdtsc() - start);
+	DM_TRACE3(vmexit_return, req_vcpu, exitcode, rc);
 	switch (rc) {
 	case VMEXIT_CONTINUE:
 		vhm_req->processed = REQ_STATE_SUCCESS;
@@ -457,7 +527,173 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 	default:
 		exit(1);
 	}
-	vm_notify_request_done(ctx, vcpu);
+}
+
+static void *
+ioreq_worker_thread(void *param)
+{
+	struct ioreq_worker *w = param;
+	char tname[MAXCOMLEN + 1];
+
+	snprintf(tname, sizeof(tname), "ioreq %d", w->vcpu);
+	pthread_setname_np(w->thr, tname);
+
+	pthread_mutex_lock(&w->mtx);
+	for (;;) {
+		while (!w->pending && !w->quit)
+			pthread_cond_wait(&w->cond, &w->mtx);
+		if (w->quit)
+			break;
+		pthread_mutex_unlock(&w->mtx);
+
+		vm_intr_batch_begin();
+		handle_vmexit(w->ctx, &w->ctx->ioreq_buf[w->vcpu], w->vcpu);
+		vm_intr_batch_end();
+
+		/*
+		 * The slot is no longer REQ_STATE_PROCESSING at this point,
+		 * so clear pending before completing the request: the next
+		 * request on this vCPU may be dispatched as soon as the
+		 * hypervisor sees the notification.
+		 */
+		pthread_mutex_lock(&w->mtx);
+		w->pending = false;
+		pthread_mutex_unlock(&w->mtx);
+
+		vm_notify_request_done(w->ctx, w->vcpu);
+		pthread_mutex_lock(&w->mtx);
+	}
+	pthread_mutex_unlock(&w->mtx);
+
+	return NULL;
+}
+
+static void
+ioreq_workers_start(struct vmctx *ctx)
+{
+	struct ioreq_worker *w;
+	int vcpu, error;
+
+	for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
+		w = &ioreq_workers[vcpu];
+		w->ctx = ctx;
+		w->vcpu = vcpu;
+		w->pending = false;
+		w->quit = false;
+		pthread_mutex_init(&w->mtx, NULL);
+		pthread_cond_init(&w->cond, NULL);
+
+		error = pthread_create(&w->thr, NULL, ioreq_worker_thread, w);
+		assert(error == 0);
+
+		if (vcpumap[vcpu] != NULL)
+			pthread_setaffinity_np(w->thr, sizeof(cpuset_t),
+					vcpumap[vcpu]);
+	}
+}
+
+static void
+ioreq_workers_stop(void)
+{
+	struct ioreq_worker *w;
+	int vcpu;
+
+	for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
+		w = &ioreq_workers[vcpu];
+		pthread_mutex_lock(&w->mtx);
+		w->quit = true;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mtx);
+		pthread_join(w->thr, NULL);
+
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mtx);
+	}
+}
+
+static void
+ioreq_worker_kick(int vcpu)
+{
+	struct ioreq_worker *w = &ioreq_workers[vcpu];
+
+	pthread_mutex_lock(&w->mtx);
+	if (!w->pending) {
+		w->pending = true;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mtx);
+}
+
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static bool
+ioreq_pending(struct vmctx *ctx)
+{
+	volatile struct vhm_request *vhm_req;
+	int vcpu;
+
+	for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
+		/* with -T, a slot stays PROCESSING while its worker runs */
+		if (ioreq_threads && __atomic_load_n(
+		    &ioreq_workers[vcpu].pending, __ATOMIC_ACQUIRE))
+			continue;
+		vhm_req = &ctx->ioreq_buf[vcpu];
+		if (vhm_req->valid
+			&& (vhm_req->processed == REQ_STATE_PROCESSING)
+			&& (vhm_req->client == ctx->ioreq_client))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Wait for the next I/O request. With -O, spin on the shared request
+ * page for up to poll_ns before blocking in the kernel. Like KVM halt
+ * polling the window adapts: it grows when we had to sleep but were
+ * woken within the maximum window, and shrinks when the sleep was long
+ * enough that spinning would have been wasted.
+ */
+static int
+ioreq_wait(struct vmctx *ctx)
+{
+	static uint64_t poll_ns;
+	uint64_t start, slept;
+	int error;
+
+	if (ioreq_poll_max == 0)
+		return vm_attach_ioreq_client(ctx);
+
+	start = now_ns();
+	if (poll_ns) {
+		do {
+			if (ioreq_pending(ctx)) {
+				stats.ioreq_poll_hit++;
+				return 0;
+			}
+			__builtin_ia32_pause();
+		} while (!quit_vm_loop && now_ns() - start < poll_ns);
+		stats.ioreq_poll_miss++;
+		start = now_ns();
+	}
+
+	error = vm_attach_ioreq_client(ctx);
+	slept = now_ns() - start;
+
+	if (slept <= ioreq_poll_max) {
+		poll_ns = poll_ns ? poll_ns * 2 : 10000;
+		if (poll_ns > ioreq_poll_max)
+			poll_ns = ioreq_poll_max;
+	} else
+		poll_ns /= 2;
+
+	return error;
 }
 
 static void
@@ -468,25 +704,51 @@ vm_loop(struct vmctx *ctx)
 	ctx->ioreq_client = vm_create_ioreq_client(ctx);
 	assert(ctx->ioreq_client > 0);
 
+	if (ioreq_threads)
+		ioreq_workers_start(ctx);
+
 	error = vm_run(ctx);
 	assert(error == 0);
 
 	while (1) {
 		int vcpu;
+		uint64_t done;
 		struct vhm_request *vhm_req;
 
-		error = vm_attach_ioreq_client(ctx);
+		error = ioreq_wait(ctx);
 		if (error)
 			break;
 
-		for (vcpu = 0; vcpu < 4; vcpu++) {
-			vhm_req = &vhm_req_buf[vcpu];
+		/*
+		 * Complete the whole sweep with a single notification, and
+		 * the MSIs it raised with a single injection before that.
+		 */
+		done = 0;
+		vm_intr_batch_begin();
+		for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
+			vhm_req = &ctx->ioreq_buf[vcpu];
 			if (vhm_req->valid
 				&& (vhm_req->processed == REQ_STATE_PROCESSING)
-				&& (vhm_req->client == ctx->ioreq_client))
-				handle_vmexit(ctx, vhm_req, vcpu);
+				&& (vhm_req->client == ctx->ioreq_client)) {
+				if (ioreq_threads)
+					ioreq_worker_kick(vcpu);
+				else {
+					handle_vmexit(ctx, vhm_req, vcpu);
+					done |= 1UL << vcpu;
+				}
+			}
 		}
+		vm_intr_batch_end();
+		vm_notify_request_done_batch(ctx, done);
 	}
+
+	if (ioreq_threads)
+		ioreq_workers_stop();
+
+	if (ioreq_poll_max)
+		printf("ioreq poll: %lu hits, %lu misses\n",
+			stats.ioreq_poll_hit, stats.ioreq_poll_miss);
+
 	quit_vm_loop = 0;
 	printf("VM loop exit\n");
 }
@@ -522,9 +784,59 @@ do_open(const char *vmname)
 	return ctx;
 }
 
+/*
+ * The MP, SMBIOS and ACPI tables all live in the BIOS area below 1MB and
+ * only depend on the command line. Keep a copy of the first build and
+ * put it back on guest reset instead of generating them (and compiling
+ * the DSDT) again.
+ */
+#define	GUEST_TABLES_BASE	0xF0000
+#define	GUEST_TABLES_SIZE	0x10000
+
+static void *guest_tables;
+
+static int
+build_guest_tables(struct vmctx *ctx, int mptgen)
+{
+	void *gaddr;
+	int error;
+
+	gaddr = paddr_guest2host(ctx, GUEST_TABLES_BASE, GUEST_TABLES_SIZE);
+	if (gaddr == NULL)
+		return -1;
+
+	if (guest_tables != NULL) {
+		memcpy(gaddr, guest_tables, GUEST_TABLES_SIZE);
+		return 0;
+	}
+
+	if (mptgen) {
+		error = mptable_build(ctx, guest_ncpus);
+		if (error)
+			return error;
+	}
+
+	error = smbios_build(ctx);
+	if (error)
+		return error;
+
+	if (acpi) {
+		error = acpi_build(ctx, guest_ncpus);
+		if (error)
+			return error;
+	}
+
+	guest_tables = malloc(GUEST_TABLES_SIZE);
+	if (guest_tables != NULL)
+		memcpy(guest_tables, gaddr, GUEST_TABLES_SIZE);
+
+	return 0;
+}
+
 static void
 do_close_pre(struct vmctx *ctx)
 {
+	monitor_unregister(ctx);
 	vm_destroy(ctx);
 	vm_close(ctx);
 }
@@ -534,6 +846,7 @@ do_close_post(struct vmctx *ctx)
 {
 	pci_irq_deinit(ctx);
 	deinit_pci(ctx);
+	monitor_unregister(ctx);
 	vm_destroy(ctx);
 	vm_close(ctx);
 }
@@ -554,7 +867,7 @@ main(int argc, char *argv[])
 	int rtc_localtime;
 	struct vmctx *ctx;
 	size_t memsize;
-	char *optstr;
+	char *optstr, *endp;
 
 	bvmcons = 0;
 	progname = basename(argv[0]);
@@ -569,7 +882,7 @@ main(int argc, char *argv[])
 	if (signal(SIGINT, sig_handler_term) == SIG_ERR)
 		fprintf(stderr, "cannot register handler for SIGINT\n");
 
-	optstr = "abehuwxACHIMPSWYvk:r:B:p:g:c:s:m:l:U:G:";
+	optstr = "abehiuwxACEHIMPSTWYvk:r:B:p:g:c:s:m:l:o:O:R:U:G:D:z:N:Z";
 	while ((c = getopt(argc, argv, optstr)) != -1) {
 		switch (c) {
 		case 'a':
@@ -612,6 +925,27 @@ main(int argc, char *argv[])
 		case 'S':
 			memflags |= VM_MEM_F_WIRED;
 			break;
+		case 'T':
+			ioreq_threads = 1;
+			break;
+		case 'z':
+			if (strcasecmp(optarg, "2M") == 0)
+				memflags |= VM_MEM_F_HUGE_2M;
+			else if (strcasecmp(optarg, "1G") == 0)
+				memflags |= VM_MEM_F_HUGE_1G;
+			else
+				errx(EX_USAGE, "invalid hugepage size '%s'",
+					optarg);
+			break;
+		case 'Z':
+			memflags |= VM_MEM_F_LAZY;
+			break;
+		case 'O':
+			ioreq_poll_max = strtoul(optarg, &endp, 10);
+			if (*optarg == '\0' || *endp != '\0')
+				errx(EX_USAGE, "invalid poll window '%s'", optarg);
+			ioreq_poll_max *= 1000;
+			break;
 		case 'm':
 			error = vm_parse_memsize(optarg, &memsize);
 			if (error)
@@ -620,6 +954,9 @@ main(int argc, char *argv[])
 		case 'H':
 			guest_vmexit_on_hlt = 1;
 			break;
+		case 'i':
+			ioport_stats = true;
+			break;
 		case 'I':
 			/*
 			 * The "-I" option was used to add an ioapic to the
@@ -635,6 +972,18 @@ main(int argc, char *argv[])
 		case 'e':
 			strictio = 1;
 			break;
+		case 'D':
+			monitor_path = optarg;
+			break;
+		case 'o':
+			snapshot_path = optarg;
+			break;
+		case 'R':
+			restore_path = optarg;
+			break;
+		case 'E':
+			exitprof = true;
+			break;
 		case 'u':
 			rtc_localtime = 0;
 			break;
@@ -672,6 +1021,10 @@ main(int argc, char *argv[])
 		case 'M':
 			ptdev_prefer_msi(false);
 			break;
+		case 'N':
+			if (numa_policy_parse(optarg) != 0)
+				exit(1);
+			break;
 		case 'v':
 			print_version();
 			break;
@@ -684,20 +1037,43 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if ((memflags & VM_MEM_F_WIRED) && (memflags & VM_MEM_F_LAZY))
+		errx(EX_USAGE, "-S and -Z cannot be used together");
+
+	/* a restore maps guest memory from the file, populated lazily */
+	if (restore_path && (memflags & (VM_MEM_F_WIRED | VM_MEM_F_HUGE_2M |
+	    VM_MEM_F_HUGE_1G)))
+		errx(EX_USAGE, "-R cannot be used with -S or -z");
+
 	if (argc != 1)
 		usage(1);
 
 	vmname = argv[0];
 
+	if (numa_policy_apply(vcpumap, VM_MAXCPU) != 0)
+		exit(1);
+
+	monitor_register("vm", dmstats_dump, &stats);
+
 	for (;;) {
 		ctx = do_open(vmname);
 
 		/* set IOReq buffer page */
-		error = vm_set_shared_io_page(ctx, (unsigned long)vhm_req_buf);
+		error = vm_set_shared_io_page(ctx,
+					      (unsigned long)ctx->ioreq_buf);
 		if (error)
 			do_close_pre(ctx);
 		assert(error == 0);
 
+		/* the snapshot's memory size and vCPUs, the tables use them */
+		if (restore_path && snapshot_open(ctx, restore_path, &memsize,
+						  &guest_ncpus)) {
+			fprintf(stderr, "cannot restore snapshot %s: %s\n",
+				restore_path, strerror(errno));
+			do_close_pre(ctx);
+			exit(1);
+		}
+
 		if (guest_ncpus < 1) {
 			fprintf(stderr, "Invalid guest vCPUs (%d)\n",
 				guest_ncpus);
@@ -722,7 +1098,14 @@ main(int argc, char *argv[])
 		}
 
 		init_mem();
-		init_inout();
+		init_inout(ctx);
+		if (ioport_stats && inout_stats_init(ctx))
+			fprintf(stderr, "cannot count per-port I/O\n");
+		if (exitprof && exitprof_init())
+			fprintf(stderr, "cannot profile VM exits\n");
+		if (monitor_path && monitor_init(monitor_path))
+			fprintf(stderr, "cannot open monitor socket %s\n",
+				monitor_path);
 		pci_irq_init(ctx);
 		atkbdc_init(ctx);
 		ioapic_init(ctx);
@@ -739,39 +1122,42 @@ main(int argc, char *argv[])
 			exit(1);
 		}
 
+		if (restore_path && snapshot_restore_devices(ctx) != 0) {
+			fprintf(stderr, "cannot restore devices from %s\n",
+				restore_path);
+			do_close_post(ctx);
+			exit(1);
+		}
+
 		if (gdb_port != 0)
 			fprintf(stderr, "dbgport not supported\n");
 
 		if (bvmcons)
-			init_bvmcons();
+			init_bvmcons(ctx);
 
 		/*
-		 * build the guest tables, MP etc.
+		 * build the guest tables, MP etc; a snapshot has them and
+		 * the loaded images in guest memory already
 		 */
-		if (mptgen) {
-			error = mptable_build(ctx, guest_ncpus);
-			if (error) {
-				do_close_post(ctx);
-				exit(1);
-			}
+		error = restore_path ? 0 : build_guest_tables(ctx, mptgen);
+		if (error) {
+			do_close_post(ctx);
+			exit(1);
 		}
 
-		error = smbios_build(ctx);
+		error = restore_path ? 0 : acrn_sw_load(ctx);
 		if (error)
 			do_close_post(ctx);
 		assert(error == 0);
 
-		if (acpi) {
-			error = acpi_build(ctx, guest_ncpus);
+		if (snapshot_path) {
+			error = snapshot_save(ctx, snapshot_path, guest_ncpus);
 			if (error)
-				do_close_post(ctx);
-			assert(error == 0);
-		}
-
-		error = acrn_sw_load(ctx);
-		if (error)
+				fprintf(stderr, "cannot save snapshot %s: %s\n",
+					snapshot_path, strerror(errno));
 			do_close_post(ctx);
-		assert(error == 0);
+			exit(error ? 1 : 0);
+		}
 
 		/*
 		 * Change the proc title to include the VM name.
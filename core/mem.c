@@ -30,6 +30,11 @@
  * Memory ranges are represented with an RB tree. On insertion, the range
  * is checked for overlaps. On lookup, the key has the same base and limit
  * so it can be searched within the range.
+ *
+ * The tree is only used by writers. Every change publishes a new sorted
+ * array of the ranges, which vCPUs binary search without taking a lock;
+ * the old array, and any range taken out, is freed once every vCPU has
+ * left the MMIO handler it may have been running.
  */
 
 #include <sys/cdefs.h>
@@ -39,6 +44,7 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include "vmm.h"
 #include "types.h"
@@ -58,13 +64,36 @@ RB_PROTOTYPE(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 RB_HEAD(mmio_rb_tree, mmio_rb_range) mmio_rb_root, mmio_rb_fallback;
 
 /*
- * Per-VM cache. Since most accesses from a vCPU will be to
+ * Read-only snapshot of both trees, each sorted by base.
+ */
+struct mmio_table {
+	uint64_t		gen;	/* bumped by every publish */
+	int			nroot;
+	int			nfallback;
+	struct mmio_rb_range	*v[];	/* root ranges, then fallback */
+};
+
+static struct mmio_table	*mmio_table;
+
+/*
+ * Per-vCPU cache. Since most accesses from a vCPU will be to
  * consecutive addresses in a range, it makes sense to cache the
- * result of a lookup.
+ * result of a lookup; it is only good for the snapshot it came from.
  */
-static struct mmio_rb_range	*mmio_hint;
+static struct {
+	uint64_t		gen;
+	struct mmio_rb_range	*entry;
+} __aligned(64) mmio_hint[VM_MAXCPU];
+
+/* Odd while the vCPU is inside emulate_mem() */
+static struct {
+	uint64_t		seq;
+} __aligned(64) mmio_vcpu_seq[VM_MAXCPU];
+
+/* The vCPU this thread emulates, so updates from a handler don't wait */
+static __thread int mmio_self = -1;
 
-static pthread_rwlock_t mmio_rwlock;
+static pthread_mutex_t mmio_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static int
 mmio_rb_range_compare(struct mmio_rb_range *a, struct mmio_rb_range *b)
@@ -121,17 +150,108 @@ mmio_rb_dump(struct mmio_rb_tree *rbt)
 {
 	struct mmio_rb_range *np;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	RB_FOREACH(np, mmio_rb_tree, rbt) {
 		printf(" %lx:%lx, %s\n", np->mr_base, np->mr_end,
 		       np->mr_param.name);
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
 }
 #endif
 
 RB_GENERATE(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
+static struct mmio_rb_range *
+mmio_table_find(struct mmio_rb_range **v, int n, uint64_t addr)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = n - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (addr < v[mid]->mr_base)
+			hi = mid - 1;
+		else if (addr > v[mid]->mr_end)
+			lo = mid + 1;
+		else
+			return v[mid];
+	}
+	return NULL;
+}
+
+/*
+ * Wait until no vCPU can still be using what the previous snapshot
+ * pointed to: each one is either out of emulate_mem() or has come
+ * back in since, and so sees the new one.
+ */
+static void
+mmio_synchronize(void)
+{
+	uint64_t seq[VM_MAXCPU];
+	int i;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < VM_MAXCPU; i++)
+		seq[i] = __atomic_load_n(&mmio_vcpu_seq[i].seq,
+					 __ATOMIC_ACQUIRE);
+	for (i = 0; i < VM_MAXCPU; i++) {
+		if (i == mmio_self || !(seq[i] & 1))
+			continue;
+		while (__atomic_load_n(&mmio_vcpu_seq[i].seq,
+				       __ATOMIC_ACQUIRE) == seq[i])
+			sched_yield();
+	}
+}
+
+/*
+ * Publish a snapshot of the trees and return the one it replaces, or
+ * NULL if there is no memory for it.  Called with mmio_mtx.
+ */
+static struct mmio_table *
+mmio_table_publish(void)
+{
+	struct mmio_table *new, *old;
+	struct mmio_rb_range *np;
+	int n;
+
+	n = 0;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_root)
+		n++;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_fallback)
+		n++;
+
+	new = malloc(sizeof(*new) + n * sizeof(new->v[0]));
+	if (new == NULL)
+		return NULL;
+
+	n = 0;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_root)
+		new->v[n++] = np;
+	new->nroot = n;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_fallback)
+		new->v[n++] = np;
+	new->nfallback = n - new->nroot;
+
+	old = mmio_table;
+	new->gen = old->gen + 1;
+	__atomic_store_n(&mmio_table, new, __ATOMIC_RELEASE);
+	return old;
+}
+
+/*
+ * Free a replaced snapshot and the range taken out, if any, once no
+ * vCPU can see them.  Called without mmio_mtx, so that a handler
+ * registering memory on another vCPU can finish.
+ */
+static void
+mmio_table_retire(struct mmio_table *old, struct mmio_rb_range *removed)
+{
+	mmio_synchronize();
+	free(old);
+	free(removed);
+}
+
 __attribute__((unused))
 static int
 mem_read(void *ctx, int vcpu, uint64_t gpa, uint64_t *rval, int size, void *arg)
@@ -157,41 +277,55 @@ mem_write(void *ctx, int vcpu, uint64_t gpa, uint64_t wval, int size, void *arg)
 }
 
 int
-emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
+emulate_mem(struct vmctx *ctx, int vcpu, struct mmio_request *mmio_req)
 {
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_table *table;
 	int err;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	assert(vcpu >= 0 && vcpu < VM_MAXCPU);
+	mmio_self = vcpu;
+
+	/* enter before loading the snapshot, see mmio_synchronize() */
+	__atomic_fetch_add(&mmio_vcpu_seq[vcpu].seq, 1, __ATOMIC_SEQ_CST);
+	table = __atomic_load_n(&mmio_table, __ATOMIC_ACQUIRE);
+
 	/*
-	 * First check the per-VM cache
+	 * First check the per-vCPU cache
 	 */
-	if (mmio_hint && paddr >= mmio_hint->mr_base &&
-			paddr <= mmio_hint->mr_end)
-		entry = mmio_hint;
+	if (mmio_hint[vcpu].gen == table->gen) {
+		entry = mmio_hint[vcpu].entry;
+		if (paddr < entry->mr_base || paddr > entry->mr_end)
+			entry = NULL;
+	}
 
 	if (entry == NULL) {
-		if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-			/* Update the per-VMU cache */
-			mmio_hint = entry;
-		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
-			pthread_rwlock_unlock(&mmio_rwlock);
-			return -ESRCH;
+		entry = mmio_table_find(table->v, table->nroot, paddr);
+		if (entry != NULL) {
+			/* Update the per-vCPU cache */
+			mmio_hint[vcpu].gen = table->gen;
+			mmio_hint[vcpu].entry = entry;
+		} else {
+			entry = mmio_table_find(table->v + table->nroot,
+						table->nfallback, paddr);
+			if (entry == NULL) {
+				__atomic_fetch_add(&mmio_vcpu_seq[vcpu].seq, 1,
+						   __ATOMIC_RELEASE);
+				return -ESRCH;
+			}
 		}
 	}
 
-	assert(entry != NULL);
-
 	if (mmio_req->direction == REQUEST_READ)
-		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
+		err = mem_read(ctx, vcpu, paddr, (uint64_t *)&mmio_req->value,
 				size, &entry->mr_param);
 	else
-		err = mem_write(ctx, 0, paddr, mmio_req->value,
+		err = mem_write(ctx, vcpu, paddr, mmio_req->value,
 				size, &entry->mr_param);
 
-	pthread_rwlock_unlock(&mmio_rwlock);
+	__atomic_fetch_add(&mmio_vcpu_seq[vcpu].seq, 1, __ATOMIC_RELEASE);
 
 	return err;
 }
@@ -200,6 +334,7 @@ static int
 register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
 	struct mmio_rb_range *entry, *mrp;
+	struct mmio_table *old = NULL;
 	int err;
 
 	err = 0;
@@ -210,12 +345,18 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		mrp->mr_param = *memp;
 		mrp->mr_base = memp->base;
 		mrp->mr_end = memp->base + memp->size - 1;
-		pthread_rwlock_wrlock(&mmio_rwlock);
+		pthread_mutex_lock(&mmio_mtx);
 		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0)
 			err = mmio_rb_add(rbt, mrp);
-		pthread_rwlock_unlock(&mmio_rwlock);
+		if (err == 0 && (old = mmio_table_publish()) == NULL) {
+			RB_REMOVE(mmio_rb_tree, rbt, mrp);
+			err = -1;
+		}
+		pthread_mutex_unlock(&mmio_mtx);
 		if (err)
 			free(mrp);
+		else
+			mmio_table_retire(old, NULL);
 	} else
 		err = -1;
 
@@ -239,9 +380,10 @@ unregister_mem(struct mem_range *memp)
 {
 	struct mem_range *mr;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_table *old = NULL;
 	int err;
 
-	pthread_rwlock_wrlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	err = mmio_rb_lookup(&mmio_rb_root, memp->base, &entry);
 	if (err == 0) {
 		mr = &entry->mr_param;
@@ -250,14 +392,20 @@ unregister_mem(struct mem_range *memp)
 		assert((mr->flags & MEM_F_IMMUTABLE) == 0);
 		RB_REMOVE(mmio_rb_tree, &mmio_rb_root, entry);
 
-		/* flush Per-VM cache */
-		if (mmio_hint == entry)
-			mmio_hint = NULL;
+		/*
+		 * The per-vCPU caches go stale with the snapshot. If no
+		 * new one can be made, the range can't be taken out.
+		 */
+		old = mmio_table_publish();
+		if (old == NULL) {
+			mmio_rb_add(&mmio_rb_root, entry);
+			err = -1;
+		}
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
 
-	if (entry)
-		free(entry);
+	if (old != NULL)
+		mmio_table_retire(old, entry);
 
 	return err;
 }
@@ -267,5 +415,8 @@ init_mem(void)
 {
 	RB_INIT(&mmio_rb_root);
 	RB_INIT(&mmio_rb_fallback);
-	pthread_rwlock_init(&mmio_rwlock, NULL);
+	/* generation 0 never matches a cache entry */
+	mmio_table = calloc(1, sizeof(*mmio_table));
+	assert(mmio_table != NULL);
+	mmio_table->gen = 1;
 }
@@ -44,12 +44,15 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
 #include <pthread.h>
 
 #include "mevent.h"
 #include "vmm.h"
 #include "vmmapi.h"
+#include "exitprof.h"
+#include "monitor.h"
 
 #define	MEVENT_MAX	64
 
@@ -58,9 +61,6 @@
 #define	MEV_DISABLE	3
 #define	MEV_DEL_PENDING	4
 
-static pthread_t mevent_tid;
-static int mevent_pipefd[2];
-static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct mevent {
 	void	(*me_func)(int, enum ev_type, void *);
@@ -70,6 +70,10 @@ struct mevent {
 	int	me_cq;
 	int	me_state;
 	int	me_closefd;
+	int	me_disabled;
+	int	me_flags;	/* MEVENT_F_* */
+	uint32_t me_kevents;	/* event mask last given to epoll */
+	struct mevent_loop *me_loop;
 
 	LIST_ENTRY(mevent) me_list;
 };
@@ -80,46 +84,82 @@ struct ctl_event {
 	struct epoll_event ee;
 };
 
-static LIST_HEAD(listhead, mevent) global_head, change_head;
+/*
+ * An event loop: one epoll instance served by one thread. The default
+ * loop runs in mevent_dispatch(); mevent_loop_create() adds more, each
+ * on its own thread, for devices that shouldn't share it.
+ */
+struct mevent_loop {
+	const char *name;
+	pthread_t tid;
+	pthread_mutex_t lmutex;
+	int	wakefd;
+	int	wake_pending;
+	int	mfd;
+	int	cpu;		/* host cpu the thread is pinned to, or -1 */
+	volatile int stopping;
+	int	monitored;	/* registered with the runtime monitor */
+	uint64_t iterations;	/* epoll_wait returns */
+	uint64_t events;	/* events handled */
+	LIST_HEAD(listhead, mevent) global_head, change_head;
+};
+
+static struct mevent_loop mevent_default = {
+	.name = "mevent",
+	.lmutex = PTHREAD_MUTEX_INITIALIZER,
+	.wakefd = -1,
+	.mfd = -1,
+	.cpu = -1,
+};
 
 static void
-mevent_qlock(void)
+mevent_qlock(struct mevent_loop *loop)
 {
-	pthread_mutex_lock(&mevent_lmutex);
+	pthread_mutex_lock(&loop->lmutex);
 }
 
 static void
-mevent_qunlock(void)
+mevent_qunlock(struct mevent_loop *loop)
 {
-	pthread_mutex_unlock(&mevent_lmutex);
+	pthread_mutex_unlock(&loop->lmutex);
 }
 
 static void
-mevent_pipe_read(int fd, enum ev_type type, void *param)
+mevent_wake_read(int fd, enum ev_type type, void *param)
 {
-	char buf[MEVENT_MAX];
-	int status;
+	struct mevent_loop *loop = param;
+	uint64_t cnt;
 
 	/*
-	 * Drain the pipe read side. The fd is non-blocking so this is
-	 * safe to do.
+	 * Drain before clearing: a write that lands after the clear must
+	 * stay in the eventfd, or wake_pending is left set with nothing
+	 * to wake us. A notifier in between sees wake_pending still set
+	 * and doesn't write, but its change is on change_head, which
+	 * mevent_build() rescans before the loop blocks again.
 	 */
-	do {
-		status = read(fd, buf, sizeof(buf));
-	} while (status == MEVENT_MAX);
+	(void) read(fd, &cnt, sizeof(cnt));
+	__atomic_store_n(&loop->wake_pending, 0, __ATOMIC_SEQ_CST);
 }
 
-void
-mevent_notify(void)
+static void
+mevent_loop_notify(struct mevent_loop *loop)
 {
-	char c;
+	uint64_t one = 1;
 
 	/*
-	 * If calling from outside the i/o thread, write a byte on the
-	 * pipe to force the i/o thread to exit the blocking epoll call.
+	 * If calling from outside the i/o thread, bump the eventfd to force
+	 * the i/o thread to exit the blocking epoll call. Only the first
+	 * notifier since the last wakeup pays for the write.
 	 */
-	if (mevent_pipefd[1] != 0 && pthread_self() != mevent_tid)
-		write(mevent_pipefd[1], &c, 1);
+	if (loop->wakefd >= 0 && pthread_self() != loop->tid &&
+	    !__atomic_exchange_n(&loop->wake_pending, 1, __ATOMIC_SEQ_CST))
+		(void) write(loop->wakefd, &one, sizeof(one));
+}
+
+void
+mevent_notify(void)
+{
+	mevent_loop_notify(&mevent_default);
 }
 
 static int
@@ -129,11 +169,14 @@ mevent_kq_filter(struct mevent *mevp)
 
 	retval = 0;
 
-	if (mevp->me_type == EVF_READ)
+	if (mevp->me_type == EVF_READ || mevp->me_type == EVF_TIMER)
 		retval = EPOLLIN;
 
 	if (mevp->me_type == EVF_WRITE)
 		retval = EPOLLOUT;
+
+	if (mevp->me_flags & MEVENT_F_EDGE)
+		retval |= EPOLLET;
 	return retval;
 }
 
@@ -146,6 +189,10 @@ mevent_kq_flags(struct mevent *mevp)
 	case MEV_ADD:
 		ret = EPOLL_CTL_ADD;		/* implicitly enabled */
 		break;
+	case MEV_ENABLE:
+	case MEV_DISABLE:
+		ret = EPOLL_CTL_MOD;
+		break;
 	case MEV_DEL_PENDING:
 		ret = EPOLL_CTL_DEL;
 		break;
@@ -158,54 +205,90 @@ mevent_kq_flags(struct mevent *mevp)
 }
 
 static int
-mevent_build(int mfd, struct ctl_event *kev)
+mevent_build_one(struct mevent *mevp, struct ctl_event *kev)
+{
+	uint32_t events;
+	int op, n = 0;
+
+	if (mevp->me_closefd) {
+		/*
+		 * A close of the file descriptor will remove the
+		 * event
+		 */
+		close(mevp->me_fd);
+	} else {
+		events = mevp->me_disabled ? 0 : mevent_kq_filter(mevp);
+		op = mevent_kq_flags(mevp);
+		/* an enable/disable pair that cancelled out */
+		if (op != EPOLL_CTL_MOD || events != mevp->me_kevents) {
+			kev->fd = mevp->me_fd;
+			kev->ee.events = events;
+			kev->op = op;
+			kev->ee.data.ptr = mevp;
+			n = 1;
+		}
+		mevp->me_kevents = events;
+	}
+
+	mevp->me_cq = 0;
+	LIST_REMOVE(mevp, me_list);
+
+	if (mevp->me_state == MEV_DEL_PENDING)
+		free(mevp);
+	else
+		LIST_INSERT_HEAD(&mevp->me_loop->global_head, mevp, me_list);
+
+	return n;
+}
+
+static int
+mevent_build(struct mevent_loop *loop, struct ctl_event *kev)
 {
 	struct mevent *mevp, *tmpp;
 	int i;
 
 	i = 0;
 
-	mevent_qlock();
-
-	list_foreach_safe(mevp, &change_head, me_list, tmpp) {
-		if (mevp->me_closefd) {
-			/*
-			 * A close of the file descriptor will remove the
-			 * event
-			 */
-			close(mevp->me_fd);
-		} else {
-			kev[i].fd = mevp->me_fd;
-			kev[i].ee.events = mevent_kq_filter(mevp);
-			kev[i].op = mevent_kq_flags(mevp);
-			kev[i].ee.data.ptr = mevp;
-			i++;
-		}
-
-		mevp->me_cq = 0;
-		LIST_REMOVE(mevp, me_list);
+	mevent_qlock(loop);
 
+	/*
+	 * Deletes go first, so that a fd deleted and then re-added (or
+	 * closed and reused) is registered afresh.
+	 */
+	list_foreach_safe(mevp, &loop->change_head, me_list, tmpp) {
 		if (mevp->me_state == MEV_DEL_PENDING)
-			free(mevp);
-		else
-			LIST_INSERT_HEAD(&global_head, mevp, me_list);
-
+			i += mevent_build_one(mevp, &kev[i]);
+		assert(i < MEVENT_MAX);
+	}
+	list_foreach_safe(mevp, &loop->change_head, me_list, tmpp) {
+		i += mevent_build_one(mevp, &kev[i]);
 		assert(i < MEVENT_MAX);
 	}
 
-	mevent_qunlock();
+	mevent_qunlock(loop);
 
 	return i;
 }
 
 static void
-mevent_destroy()
+mevent_destroy(struct mevent_loop *loop)
 {
 	struct mevent *mevp, *tmpp;
 
-	mevent_qlock();
+	mevent_qlock(loop);
 
-	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
+	list_foreach_safe(mevp, &loop->global_head, me_list, tmpp) {
+		/*
+		 * Timers outlive a dispatch loop (e.g. across a guest
+		 * reset); re-add them to the next one.
+		 */
+		if (mevp->me_type == EVF_TIMER) {
+			LIST_REMOVE(mevp, me_list);
+			LIST_INSERT_HEAD(&loop->change_head, mevp, me_list);
+			mevp->me_cq = 1;
+			mevp->me_state = MEV_ADD;
+			continue;
+		}
 		if ((mevp->me_type == EVF_READ ||
 			mevp->me_type == EVF_WRITE)
 			&& mevp->me_fd != STDIN_FILENO)
@@ -214,7 +297,7 @@ mevent_destroy()
 		free(mevp);
 	}
 
-	mevent_qunlock();
+	mevent_qunlock(loop);
 }
 
 static void
@@ -222,41 +305,54 @@ mevent_handle(struct epoll_event *kev, int numev)
 {
 	int i;
 	struct mevent *mevp;
+	uint64_t nexp, start = 0;
 
+	vm_intr_batch_begin();
 	for (i = 0; i < numev; i++) {
 		mevp = kev[i].data.ptr;
 		/* XXX check for EV_ERROR ? */
 
+		/* drain the timerfd; nothing to do if it was re-armed since */
+		if (mevp->me_type == EVF_TIMER &&
+		    read(mevp->me_fd, &nexp, sizeof(nexp)) != sizeof(nexp))
+			continue;
+
+		if (exitprof_enabled)
+			start = exitprof_rdtsc();
 		(*mevp->me_func)(mevp->me_fd, mevp->me_type, mevp->me_param);
+		if (exitprof_enabled)
+			exitprof_probe(EXITPROF_MEVENT, exitprof_rdtsc() - start);
 	}
+	vm_intr_batch_end();
 }
 
 struct mevent *
-mevent_add(int tfd, enum ev_type type,
-	   void (*func)(int, enum ev_type, void *), void *param)
+mevent_add_on(struct mevent_loop *loop, int tfd, enum ev_type type,
+	      int flags, void (*func)(int, enum ev_type, void *), void *param)
 {
 	struct mevent *lp, *mevp;
 
 	if (tfd < 0 || func == NULL)
 		return NULL;
 
-	if (type == EVF_TIMER)
-		return NULL;
+	if (loop == NULL)
+		loop = &mevent_default;
 
 	mevp = NULL;
 
-	mevent_qlock();
+	mevent_qlock(loop);
 
 	/*
 	 * Verify that the fd/type tuple is not present in any list
 	 */
-	LIST_FOREACH(lp, &global_head, me_list) {
+	LIST_FOREACH(lp, &loop->global_head, me_list) {
 		if (lp->me_fd == tfd && lp->me_type == type)
 			goto exit;
 	}
 
-	LIST_FOREACH(lp, &change_head, me_list) {
-		if (lp->me_fd == tfd && lp->me_type == type)
+	LIST_FOREACH(lp, &loop->change_head, me_list) {
+		if (lp->me_fd == tfd && lp->me_type == type &&
+		    lp->me_state != MEV_DEL_PENDING)
 			goto exit;
 	}
 
@@ -271,34 +367,96 @@ mevent_add(int tfd, enum ev_type type,
 	mevp->me_type = type;
 	mevp->me_func = func;
 	mevp->me_param = param;
+	mevp->me_flags = flags;
+	mevp->me_loop = loop;
 
-	LIST_INSERT_HEAD(&change_head, mevp, me_list);
+	LIST_INSERT_HEAD(&loop->change_head, mevp, me_list);
 	mevp->me_cq = 1;
 	mevp->me_state = MEV_ADD;
-	mevent_notify();
+	mevent_loop_notify(loop);
 
 exit:
-	mevent_qunlock();
+	mevent_qunlock(loop);
 
 	return mevp;
 }
 
+struct mevent *
+mevent_add_flags(int tfd, enum ev_type type, int flags,
+		 void (*func)(int, enum ev_type, void *), void *param)
+{
+	return mevent_add_on(NULL, tfd, type, flags, func, param);
+}
+
+struct mevent *
+mevent_add(int tfd, enum ev_type type,
+	   void (*func)(int, enum ev_type, void *), void *param)
+{
+	return mevent_add_on(NULL, tfd, type, 0, func, param);
+}
+
+/*
+ * Disabling keeps the fd registered with an empty event mask, so a
+ * level-triggered fd that isn't being drained doesn't spin the loop.
+ * An event already reported may still be dispatched once.
+ */
+static int
+mevent_update(struct mevent *evp, int disable)
+{
+	struct mevent_loop *loop = evp->me_loop;
+
+	mevent_qlock(loop);
+
+	if (evp->me_state == MEV_DEL_PENDING || evp->me_disabled == disable) {
+		mevent_qunlock(loop);
+		return 0;
+	}
+	evp->me_disabled = disable;
+
+	/* an add not applied yet just picks up the new mask */
+	if (evp->me_cq == 0 || evp->me_state != MEV_ADD) {
+		evp->me_state = disable ? MEV_DISABLE : MEV_ENABLE;
+		if (evp->me_cq == 0) {
+			evp->me_cq = 1;
+			LIST_REMOVE(evp, me_list);
+			LIST_INSERT_HEAD(&loop->change_head, evp, me_list);
+			mevent_loop_notify(loop);
+		}
+	}
+
+	mevent_qunlock(loop);
+
+	return 0;
+}
+
 int
 mevent_enable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, 0);
 }
 
 int
 mevent_disable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, 1);
 }
 
 static int
 mevent_delete_event(struct mevent *evp, int closefd)
 {
-	mevent_qlock();
+	struct mevent_loop *loop = evp->me_loop;
+
+	mevent_qlock(loop);
+
+	/* an add that never reached epoll just goes away */
+	if (evp->me_cq && evp->me_state == MEV_ADD) {
+		LIST_REMOVE(evp, me_list);
+		if (closefd)
+			close(evp->me_fd);
+		free(evp);
+		mevent_qunlock(loop);
+		return 0;
+	}
 
 	/*
 	 * Place the entry onto the changed list if not already there, and
@@ -307,15 +465,15 @@ mevent_delete_event(struct mevent *evp, int closefd)
 	if (evp->me_cq == 0) {
 		evp->me_cq = 1;
 		LIST_REMOVE(evp, me_list);
-		LIST_INSERT_HEAD(&change_head, evp, me_list);
-		mevent_notify();
+		LIST_INSERT_HEAD(&loop->change_head, evp, me_list);
+		mevent_loop_notify(loop);
 	}
 	evp->me_state = MEV_DEL_PENDING;
 
 	if (closefd)
 		evp->me_closefd = 1;
 
-	mevent_qunlock();
+	mevent_qunlock(loop);
 
 	return 0;
 }
@@ -332,46 +490,69 @@ mevent_delete_close(struct mevent *evp)
 	return mevent_delete_event(evp, 1);
 }
 
-static void
-mevent_set_name(void)
-{
-	pthread_setname_np(mevent_tid, "mevent");
-}
-
-void
-mevent_dispatch(void)
+static int
+mevent_loop_open(struct mevent_loop *loop)
 {
-	struct ctl_event clist[MEVENT_MAX];
-	struct epoll_event eventlist[MEVENT_MAX];
+	struct mevent *wakev;
 
-	struct mevent *pipev;
-	int mfd;
-	int numev;
-	int ret;
-
-	mevent_tid = pthread_self();
-	mevent_set_name();
-
-	mfd = epoll_create1(0);
-	assert(mfd > 0);
+	loop->mfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->mfd < 0)
+		return -1;
 
 	/*
-	 * Open the pipe that will be used for other threads to force
-	 * the blocking kqueue call to exit by writing to it. Set the
-	 * descriptor to non-blocking.
+	 * Open the eventfd that other threads use to force the blocking
+	 * epoll call to exit.
 	 */
-	ret = pipe(mevent_pipefd);
-	if (ret < 0) {
-		perror("pipe");
-		exit(0);
+	loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakefd < 0) {
+		close(loop->mfd);
+		loop->mfd = -1;
+		return -1;
 	}
 
 	/*
-	 * Add internal event handler for the pipe write fd
+	 * Add internal event handler for the eventfd
 	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL);
-	assert(pipev != NULL);
+	wakev = mevent_add_on(loop, loop->wakefd, EVF_READ, 0,
+			      mevent_wake_read, loop);
+	assert(wakev != NULL);
 
+	return 0;
+}
+
+static void
+mevent_loop_dump(int fd, void *arg)
+{
+	struct mevent_loop *loop = arg;
+
+	dprintf(fd, "iterations %lu\n", loop->iterations);
+	dprintf(fd, "events %lu\n", loop->events);
+}
+
+static void
+mevent_loop_monitor(struct mevent_loop *loop)
+{
+	char name[64];
+
+	/* the default loop is dispatched again after a guest reset */
+	if (loop->monitored)
+		return;
+	if (loop == &mevent_default)
+		snprintf(name, sizeof(name), "%s", loop->name);
+	else
+		snprintf(name, sizeof(name), "mevent.%s", loop->name);
+	loop->monitored = !monitor_register(name, mevent_loop_dump, loop);
+}
+
+static void
+mevent_loop_run(struct mevent_loop *loop)
+{
+	struct ctl_event clist[MEVENT_MAX];
+	struct epoll_event eventlist[MEVENT_MAX];
+	int numev;
+	int ret;
+
+	mevent_loop_monitor(loop);
 	for (;;) {
 		/*
 		 * Build changelist if required.
@@ -382,11 +563,11 @@ mevent_dispatch(void)
 		int i;
 		struct epoll_event *e;
 
-		numev = mevent_build(mfd, clist);
+		numev = mevent_build(loop, clist);
 
 		for (i = 0; i < numev; i++) {
 			e = &clist[i].ee;
-			ret = epoll_ctl(mfd, clist[i].op, clist[i].fd, e);
+			ret = epoll_ctl(loop->mfd, clist[i].op, clist[i].fd, e);
 			if (ret == -1)
 				perror("Error return from epoll_ctl");
 		}
@@ -394,19 +575,123 @@ mevent_dispatch(void)
 		/*
 		 * Block awaiting events
 		 */
-		ret = epoll_wait(mfd, eventlist, MEVENT_MAX, -1);
+		ret = epoll_wait(loop->mfd, eventlist, MEVENT_MAX, -1);
 		if (ret == -1 && errno != EINTR)
 			perror("Error return from epoll_wait");
+		loop->iterations++;
+		if (ret > 0)
+			loop->events += ret;
 
 		/*
 		 * Handle reported events
 		 */
 		mevent_handle(eventlist, ret);
 
-		if (vm_get_suspend_mode() != VM_SUSPEND_NONE)
+		if (loop->stopping ||
+		    (loop == &mevent_default &&
+		     vm_get_suspend_mode() != VM_SUSPEND_NONE))
 			break;
 	}
-	mevent_build(mfd, clist);
-	mevent_destroy();
-	close(mfd);
+	mevent_build(loop, clist);
+	/* closes the eventfd along with the other fds */
+	loop->wakefd = -1;
+	mevent_destroy(loop);
+	close(loop->mfd);
+	loop->mfd = -1;
+}
+
+static void *
+mevent_loop_thread(void *arg)
+{
+	struct mevent_loop *loop = arg;
+	cpu_set_t cpus;
+
+	loop->tid = pthread_self();
+	if (loop->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(loop->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+					   &cpus) != 0)
+			fprintf(stderr, "%s: cannot pin to cpu %d\n",
+				loop->name, loop->cpu);
+	}
+
+	mevent_loop_run(loop);
+	return NULL;
+}
+
+/*
+ * Start an event loop on its own thread, pinned to host 'cpu' unless it
+ * is negative. Events go onto it with mevent_add_on().
+ */
+struct mevent_loop *
+mevent_loop_create(const char *name, int cpu)
+{
+	struct mevent_loop *loop;
+
+	loop = calloc(1, sizeof(struct mevent_loop));
+	if (loop == NULL)
+		return NULL;
+
+	loop->name = name;
+	loop->cpu = cpu;
+	loop->wakefd = -1;
+	pthread_mutex_init(&loop->lmutex, NULL);
+	LIST_INIT(&loop->global_head);
+	LIST_INIT(&loop->change_head);
+
+	if (mevent_loop_open(loop) != 0)
+		goto fail;
+
+	if (pthread_create(&loop->tid, NULL, mevent_loop_thread, loop) != 0) {
+		/* only the wakeup event, never applied */
+		free(LIST_FIRST(&loop->change_head));
+		close(loop->wakefd);
+		close(loop->mfd);
+		goto fail;
+	}
+	pthread_setname_np(loop->tid, name);
+
+	return loop;
+
+fail:
+	pthread_mutex_destroy(&loop->lmutex);
+	free(loop);
+	return NULL;
+}
+
+/*
+ * Stop the loop and free it. Events still on it are deleted, and their
+ * fds closed as on a guest reset; delete the ones whose fds are closed
+ * elsewhere beforehand.
+ */
+void
+mevent_loop_destroy(struct mevent_loop *loop)
+{
+	if (loop == NULL || loop == &mevent_default)
+		return;
+
+	loop->stopping = 1;
+	mevent_loop_notify(loop);
+	pthread_join(loop->tid, NULL);
+	monitor_unregister(loop);
+
+	pthread_mutex_destroy(&loop->lmutex);
+	free(loop);
+}
+
+void
+mevent_dispatch(void)
+{
+	struct mevent_loop *loop = &mevent_default;
+
+	loop->tid = pthread_self();
+	pthread_setname_np(loop->tid, loop->name);
+
+	if (mevent_loop_open(loop) != 0) {
+		perror("mevent");
+		exit(0);
+	}
+
+	mevent_loop_run(loop);
 }
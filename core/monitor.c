@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Each connection sends one command line and gets the answer before
+ * the socket is closed, e.g. "echo stats | socat - UNIX-CONNECT:<path>":
+ *
+ *   stats [prefix]		"[name]" and then the counters of every
+ *				source, or of those whose name starts
+ *				with prefix; also sent for an empty line
+ *   debug			"name 0|1" for every debug switch
+ *   debug <name> on|off	flip one switch
+ *   <cmd> [args]		whatever a subsystem registered as cmd
+ *
+ * The answer is put together in memory and then sent as the client
+ * takes it, so that a client that doesn't read holds up nobody.
+ */
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mevent.h"
+#include "monitor.h"
+
+#define	MONITOR_CMD_MAX	128
+
+struct monitor_src {
+	char			*name;
+	monitor_dump_t		dump;
+	void			*arg;
+	TAILQ_ENTRY(monitor_src)	link;
+};
+
+struct monitor_cmd {
+	char			*name;
+	monitor_cmd_t		fn;
+	void			*arg;
+	TAILQ_ENTRY(monitor_cmd)	link;
+};
+
+struct monitor_conn {
+	int			fd;
+	int			out;	/* memfd holding the answer */
+	off_t			off;	/* how much of it is sent */
+	off_t			len;
+	struct mevent		*mevp;
+};
+
+SET_DECLARE(monitor_debug_set, struct monitor_debug);
+
+static TAILQ_HEAD(, monitor_src) monitor_srcs =
+	TAILQ_HEAD_INITIALIZER(monitor_srcs);
+static TAILQ_HEAD(, monitor_cmd) monitor_cmds =
+	TAILQ_HEAD_INITIALIZER(monitor_cmds);
+static pthread_mutex_t monitor_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int monitor_fd = -1;
+static struct mevent *monitor_mevp;
+
+/* registering name again for the same arg replaces its dump function */
+int
+monitor_register(const char *name, monitor_dump_t dump, void *arg)
+{
+	struct monitor_src *src, *old;
+
+	src = calloc(1, sizeof(*src));
+	if (src == NULL)
+		return -1;
+	src->name = strdup(name);
+	if (src->name == NULL) {
+		free(src);
+		return -1;
+	}
+	src->dump = dump;
+	src->arg = arg;
+
+	pthread_mutex_lock(&monitor_mtx);
+	TAILQ_FOREACH(old, &monitor_srcs, link) {
+		if (old->arg == arg && !strcmp(old->name, name))
+			break;
+	}
+	if (old != NULL) {
+		old->dump = dump;
+		free(src->name);
+		free(src);
+	} else
+		TAILQ_INSERT_TAIL(&monitor_srcs, src, link);
+	pthread_mutex_unlock(&monitor_mtx);
+	return 0;
+}
+
+/* the first command registered under a name is the one that runs */
+int
+monitor_register_cmd(const char *name, monitor_cmd_t fn, void *arg)
+{
+	struct monitor_cmd *cmd;
+
+	cmd = calloc(1, sizeof(*cmd));
+	if (cmd == NULL)
+		return -1;
+	cmd->name = strdup(name);
+	if (cmd->name == NULL) {
+		free(cmd);
+		return -1;
+	}
+	cmd->fn = fn;
+	cmd->arg = arg;
+
+	pthread_mutex_lock(&monitor_mtx);
+	TAILQ_INSERT_TAIL(&monitor_cmds, cmd, link);
+	pthread_mutex_unlock(&monitor_mtx);
+	return 0;
+}
+
+/*
+ * Drop every source and command registered with arg; none of them runs
+ * on it afterwards.
+ */
+void
+monitor_unregister(void *arg)
+{
+	struct monitor_src *src, *next;
+	struct monitor_cmd *cmd, *cnext;
+
+	pthread_mutex_lock(&monitor_mtx);
+	for (src = TAILQ_FIRST(&monitor_srcs); src != NULL; src = next) {
+		next = TAILQ_NEXT(src, link);
+		if (src->arg != arg)
+			continue;
+		TAILQ_REMOVE(&monitor_srcs, src, link);
+		free(src->name);
+		free(src);
+	}
+	for (cmd = TAILQ_FIRST(&monitor_cmds); cmd != NULL; cmd = cnext) {
+		cnext = TAILQ_NEXT(cmd, link);
+		if (cmd->arg != arg)
+			continue;
+		TAILQ_REMOVE(&monitor_cmds, cmd, link);
+		free(cmd->name);
+		free(cmd);
+	}
+	pthread_mutex_unlock(&monitor_mtx);
+}
+
+/*
+ * A nonblocking unix socket listening at path, which replaces whatever
+ * was there; returns its fd, or -1 with errno set.
+ */
+int
+unix_listen(const char *path, int backlog)
+{
+	struct sockaddr_un addr;
+	int fd, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, backlog) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/* a client of a unix_listen() socket; it is nonblocking too */
+int
+unix_accept(int fd)
+{
+	return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+static void
+monitor_stats(int fd, const char *prefix)
+{
+	struct monitor_src *src;
+	size_t len = prefix ? strlen(prefix) : 0;
+
+	pthread_mutex_lock(&monitor_mtx);
+	TAILQ_FOREACH(src, &monitor_srcs, link) {
+		if (len && strncmp(src->name, prefix, len))
+			continue;
+		dprintf(fd, "[%s]\n", src->name);
+		(*src->dump)(fd, src->arg);
+	}
+	pthread_mutex_unlock(&monitor_mtx);
+}
+
+static void
+monitor_debug(int fd, const char *name, const char *val)
+{
+	struct monitor_debug **dpp, *dp;
+
+	SET_FOREACH(dpp, monitor_debug_set) {
+		dp = *dpp;
+		if (name == NULL) {
+			dprintf(fd, "%s %d\n", dp->name, *dp->flag);
+			continue;
+		}
+		if (strcmp(dp->name, name))
+			continue;
+		if (val && !strcmp(val, "on"))
+			*dp->flag = 1;
+		else if (val && !strcmp(val, "off"))
+			*dp->flag = 0;
+		else {
+			dprintf(fd, "error: expected on or off\n");
+			return;
+		}
+		dprintf(fd, "%s %d\n", dp->name, *dp->flag);
+		return;
+	}
+	if (name)
+		dprintf(fd, "error: no debug switch %s\n", name);
+}
+
+static void
+monitor_command(int fd, char *line)
+{
+	struct monitor_cmd *c;
+	char *cmd, *arg1, *arg2, *save;
+
+	cmd = strtok_r(line, " \t\r\n", &save);
+	if (cmd == NULL || !strcmp(cmd, "stats")) {
+		arg1 = strtok_r(NULL, " \t\r\n", &save);
+		monitor_stats(fd, arg1);
+		return;
+	}
+	if (!strcmp(cmd, "debug")) {
+		arg1 = strtok_r(NULL, " \t\r\n", &save);
+		arg2 = strtok_r(NULL, " \t\r\n", &save);
+		monitor_debug(fd, arg1, arg2);
+		return;
+	}
+
+	pthread_mutex_lock(&monitor_mtx);
+	TAILQ_FOREACH(c, &monitor_cmds, link) {
+		if (!strcmp(c->name, cmd))
+			break;
+	}
+	if (c != NULL)
+		(*c->fn)(fd, c->arg, strtok_r(NULL, "\r\n", &save));
+	else
+		dprintf(fd, "error: unknown command %s\n", cmd);
+	pthread_mutex_unlock(&monitor_mtx);
+}
+
+static void
+monitor_conn_close(struct monitor_conn *conn)
+{
+	if (conn->mevp != NULL)
+		mevent_delete_close(conn->mevp);
+	else
+		close(conn->fd);
+	if (conn->out >= 0)
+		close(conn->out);
+	free(conn);
+}
+
+/* Send what the client takes; 1 once all is out or the client is gone. */
+static int
+monitor_send(struct monitor_conn *conn)
+{
+	ssize_t n;
+
+	while (conn->off < conn->len) {
+		n = sendfile(conn->fd, conn->out, &conn->off,
+			     conn->len - conn->off);
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n <= 0)
+			return 1;
+	}
+	return 1;
+}
+
+static void
+monitor_write(int fd, enum ev_type type, void *arg)
+{
+	struct monitor_conn *conn = arg;
+
+	if (monitor_send(conn))
+		monitor_conn_close(conn);
+}
+
+static void
+monitor_read(int fd, enum ev_type type, void *arg)
+{
+	struct monitor_conn *conn = arg;
+	char line[MONITOR_CMD_MAX];
+	ssize_t n;
+
+	n = read(fd, line, sizeof(line) - 1);
+	if (n < 0 && errno == EAGAIN)
+		return;
+	if (n < 0)
+		n = 0;
+	line[n] = '\0';
+
+	conn->out = memfd_create("monitor", MFD_CLOEXEC);
+	if (conn->out < 0) {
+		monitor_conn_close(conn);
+		return;
+	}
+	monitor_command(conn->out, line);
+	conn->len = lseek(conn->out, 0, SEEK_CUR);
+
+	if (monitor_send(conn)) {
+		monitor_conn_close(conn);
+		return;
+	}
+
+	/* the client is slow to take it: wait for room, not for input */
+	mevent_delete(conn->mevp);
+	conn->mevp = mevent_add(fd, EVF_WRITE, monitor_write, conn);
+	if (conn->mevp == NULL)
+		monitor_conn_close(conn);
+}
+
+static void
+monitor_accept(int fd, enum ev_type type, void *arg)
+{
+	struct monitor_conn *conn;
+	int cfd;
+
+	cfd = unix_accept(fd);
+	if (cfd < 0)
+		return;
+
+	conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		close(cfd);
+		return;
+	}
+	conn->fd = cfd;
+	conn->out = -1;
+	conn->mevp = mevent_add(cfd, EVF_READ, monitor_read, conn);
+	if (conn->mevp == NULL) {
+		close(cfd);
+		free(conn);
+	}
+}
+
+int
+monitor_init(const char *path)
+{
+	/* already serving, e.g. after a guest reset */
+	if (monitor_fd >= 0)
+		return 0;
+
+	monitor_fd = unix_listen(path, 4);
+	if (monitor_fd < 0)
+		return -1;
+
+	monitor_mevp = mevent_add(monitor_fd, EVF_READ, monitor_accept, NULL);
+	if (monitor_mevp == NULL) {
+		unlink(path);
+		close(monitor_fd);
+		monitor_fd = -1;
+		return -1;
+	}
+	return 0;
+}
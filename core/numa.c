@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "numa.h"
+
+#define	NUMA_SYSFS_NODE	"/sys/devices/system/node"
+#define	NUMA_SYSFS_CPU	"/sys/devices/system/cpu"
+#define	NUMA_SYSFS_PCI	"/sys/bus/pci/devices"
+
+#define	NUMA_MAX_NODES	64
+#define	MPOL_BIND	2
+
+enum numa_mode {
+	NUMA_NONE,
+	NUMA_NODE,		/* explicit node number */
+	NUMA_AUTO,		/* node of the pinned vCPUs */
+	NUMA_PCI,		/* node of a host PCI function */
+};
+
+static enum numa_mode numa_mode = NUMA_NONE;
+static int numa_node;
+static int numa_bus, numa_slot, numa_func;
+
+/*
+ * -N <node>|auto|<bus>/<slot>/<func>
+ *
+ * The PCI form takes the same notation as the passthru slot option.
+ */
+int
+numa_policy_parse(const char *opt)
+{
+	char *endp;
+	long node;
+
+	if (strcmp(opt, "auto") == 0) {
+		numa_mode = NUMA_AUTO;
+		return 0;
+	}
+
+	if (sscanf(opt, "%x/%x/%x", &numa_bus, &numa_slot, &numa_func) == 3) {
+		numa_mode = NUMA_PCI;
+		return 0;
+	}
+
+	node = strtol(opt, &endp, 10);
+	if (*opt == '\0' || *endp != '\0' || node < 0 ||
+	    node >= NUMA_MAX_NODES) {
+		fprintf(stderr, "numa: invalid node '%s'\n", opt);
+		return -1;
+	}
+
+	numa_mode = NUMA_NODE;
+	numa_node = node;
+	return 0;
+}
+
+static int
+numa_node_of_cpu(int cpu)
+{
+	char path[64];
+	struct dirent *d;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), NUMA_SYSFS_CPU "/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+
+	while ((d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, "node", 4) == 0 &&
+		    sscanf(d->d_name + 4, "%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+static int
+numa_node_of_pci(int bus, int slot, int func)
+{
+	char path[80];
+	FILE *fp;
+	int node = -1;
+
+	snprintf(path, sizeof(path),
+		NUMA_SYSFS_PCI "/0000:%02x:%02x.%x/numa_node", bus, slot, func);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+	fclose(fp);
+
+	return node;
+}
+
+static int
+numa_resolve_node(cpuset_t **vcpumap, int nvcpus)
+{
+	int vcpu, cpu, node;
+
+	switch (numa_mode) {
+	case NUMA_NODE:
+		return numa_node;
+	case NUMA_PCI:
+		node = numa_node_of_pci(numa_bus, numa_slot, numa_func);
+		if (node < 0)
+			fprintf(stderr, "numa: no node for PCI %x/%x/%x\n",
+				numa_bus, numa_slot, numa_func);
+		return node;
+	case NUMA_AUTO:
+		for (vcpu = 0; vcpu < nvcpus; vcpu++) {
+			if (vcpumap[vcpu] == NULL)
+				continue;
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, vcpumap[vcpu]))
+					return numa_node_of_cpu(cpu);
+			}
+		}
+		fprintf(stderr, "numa: 'auto' needs vCPUs pinned with -p\n");
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+/* parse a sysfs cpulist such as "0-7,16-23" */
+static int
+numa_node_cpus(int node, cpuset_t *set)
+{
+	char path[64], buf[1024], *p, *endp;
+	long first, last;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), NUMA_SYSFS_NODE "/node%d/cpulist", node);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (p == NULL)
+		return -1;
+
+	CPU_ZERO(set);
+	while (*p != '\0' && *p != '\n') {
+		first = strtol(p, &endp, 10);
+		if (endp == p)
+			return -1;
+		last = first;
+		if (*endp == '-') {
+			p = endp + 1;
+			last = strtol(p, &endp, 10);
+			if (endp == p)
+				return -1;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		p = (*endp == ',') ? endp + 1 : endp;
+	}
+
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/*
+ * Called from the main thread before guest memory is set up and before
+ * any worker thread is created. The memory policy covers the guest
+ * segments, which VHM allocates in the context of this thread, as well
+ * as backend buffers; the CPU mask is inherited by the mevent, virtio,
+ * blockif and ioreq threads. vCPU-pinned ioreq workers re-pin
+ * themselves afterwards.
+ */
+int
+numa_policy_apply(cpuset_t **vcpumap, int nvcpus)
+{
+	unsigned long nodemask;
+	cpuset_t cpus;
+	int node;
+
+	if (numa_mode == NUMA_NONE)
+		return 0;
+
+	node = numa_resolve_node(vcpumap, nvcpus);
+	if (node < 0 || node >= NUMA_MAX_NODES)
+		return -1;
+
+	if (numa_node_cpus(node, &cpus) != 0) {
+		fprintf(stderr, "numa: cannot read cpus of node %d\n", node);
+		return -1;
+	}
+
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+		perror("numa: sched_setaffinity");
+		return -1;
+	}
+
+	nodemask = 1UL << node;
+	if (syscall(SYS_set_mempolicy, MPOL_BIND, &nodemask,
+		    sizeof(nodemask) * 8) != 0) {
+		perror("numa: set_mempolicy");
+		return -1;
+	}
+
+	fprintf(stdout, "numa: guest memory and DM threads bound to node %d\n",
+		node);
+	return 0;
+}
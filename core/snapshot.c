@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Snapshot file layout, see snapshot.h for what it holds:
+ *
+ *   0			struct snapshot_hdr
+ *   SNAPSHOT_MEMOFF	lowmem, then highmem (vm_snapshot_memory())
+ *   devoff		devlen bytes of device state (pci_snapshot_save())
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "snapshot.h"
+
+#define	SNAPSHOT_MAGIC		"ACRNSNAP"
+#define	SNAPSHOT_VERSION	1
+#define	SNAPSHOT_MEMOFF		4096	/* page aligned, for mmap() */
+
+struct snapshot_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	ncpus;
+	uint64_t	lowmem;
+	uint64_t	highmem;
+	uint64_t	memoff;
+	uint64_t	devoff;
+	uint64_t	devlen;
+};
+
+int
+snapshot_write(struct vm_snapshot *s, const void *data, size_t len)
+{
+	size_t size;
+	uint8_t *buf;
+
+	if (s->len + len > s->size) {
+		size = MAX(s->size * 2, s->len + len);
+		buf = realloc(s->buf, size);
+		if (buf == NULL)
+			return -1;
+		s->buf = buf;
+		s->size = size;
+	}
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
+	return 0;
+}
+
+int
+snapshot_read(struct vm_snapshot *s, void *data, size_t len)
+{
+	if (len > s->len - s->off)
+		return -1;
+	memcpy(data, s->buf + s->off, len);
+	s->off += len;
+	return 0;
+}
+
+static int
+snapshot_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+snapshot_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EINVAL;	/* truncated snapshot */
+			return -1;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Save the VM, which must not have run yet, to a new file at path. */
+int
+snapshot_save(struct vmctx *ctx, const char *path, int ncpus)
+{
+	struct snapshot_hdr hdr;
+	struct vm_snapshot s;
+	int fd, error;
+
+	memset(&s, 0, sizeof(s));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.ncpus = ncpus;
+	hdr.lowmem = ctx->lowmem;
+	hdr.highmem = ctx->highmem;
+	hdr.memoff = SNAPSHOT_MEMOFF;
+	hdr.devoff = hdr.memoff + ctx->lowmem + ctx->highmem;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+
+	if (vm_snapshot_memory(ctx, fd, hdr.memoff) < 0 ||
+	    pci_snapshot_save(ctx, &s) < 0)
+		goto fail;
+	hdr.devlen = s.len;
+	if (snapshot_pwrite(fd, s.buf, s.len, hdr.devoff) < 0 ||
+	    snapshot_pwrite(fd, &hdr, sizeof(hdr), 0) < 0)
+		goto fail;
+	free(s.buf);
+	if (close(fd) < 0) {
+		unlink(path);
+		return -1;
+	}
+	return 0;
+
+fail:
+	error = errno;
+	free(s.buf);
+	close(fd);
+	unlink(path);
+	errno = error;
+	return -1;
+}
+
+/*
+ * Check the snapshot at path and have vm_setup_memory() map guest RAM
+ * from it; the guest's memory size and vCPU count are the snapshot's.
+ */
+int
+snapshot_open(struct vmctx *ctx, const char *path, size_t *memsize,
+	      int *ncpus)
+{
+	struct snapshot_hdr hdr;
+	struct stat st;
+	int fd, error;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (snapshot_pread(fd, &hdr, sizeof(hdr), 0) < 0 ||
+	    fstat(fd, &st) < 0)
+		goto fail;
+
+	/* the lowmem/highmem split must come out the same as it was */
+	errno = EINVAL;
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SNAPSHOT_VERSION ||
+	    hdr.memoff != SNAPSHOT_MEMOFF ||
+	    hdr.devoff != hdr.memoff + hdr.lowmem + hdr.highmem ||
+	    hdr.devoff + hdr.devlen > (uint64_t)st.st_size ||
+	    hdr.lowmem != MIN(hdr.lowmem + hdr.highmem, ctx->lowmem_limit) ||
+	    hdr.ncpus == 0)
+		goto fail;
+
+	*memsize = hdr.lowmem + hdr.highmem;
+	*ncpus = hdr.ncpus;
+	vm_restore_memory(ctx, fd, hdr.memoff);
+	return 0;
+
+fail:
+	error = errno;
+	close(fd);
+	errno = error;
+	return -1;
+}
+
+/* Bring the devices, after init_pci(), to their state in the snapshot. */
+int
+snapshot_restore_devices(struct vmctx *ctx)
+{
+	struct snapshot_hdr hdr;
+	struct vm_snapshot s;
+	int error;
+
+	if (snapshot_pread(ctx->snap_fd, &hdr, sizeof(hdr), 0) < 0)
+		return -1;
+
+	memset(&s, 0, sizeof(s));
+	s.buf = malloc(hdr.devlen);
+	if (s.buf == NULL && hdr.devlen != 0)
+		return -1;
+	s.len = s.size = hdr.devlen;
+	error = snapshot_pread(ctx->snap_fd, s.buf, s.len, hdr.devoff);
+	if (error == 0)
+		error = pci_snapshot_restore(ctx, &s);
+	free(s.buf);
+	return error;
+}
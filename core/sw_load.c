@@ -25,12 +25,18 @@
  *
  */
 
+#include <sys/param.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "acrn_common.h"
 #include "vmmapi.h"
@@ -43,6 +49,8 @@
 #define	MB	(1024 * 1024UL)
 #define	GB	(1024 * 1024 * 1024UL)
 
+#define	IMAGE_READ_CHUNK	(2 * MB)
+
 /* E820 memory types */
 #define E820_TYPE_RAM           1   /* EFI 1, 2, 3, 4, 5, 6, 7 */
 /* EFI 0, 11, 12, 13 (everything not used elsewhere) */
@@ -238,40 +246,79 @@ acrn_parse_bootargs(char *arg)
 		return -1;
 }
 
+/*
+ * Open an image for loading and return its size in *len. Readahead is
+ * told the whole file is about to be read sequentially.
+ */
+static int
+acrn_open_image(const char *path, size_t *len)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return -1;
+	}
+	*len = sb.st_size;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return fd;
+}
+
+/* Read len bytes into guest memory in large chunks, return bytes read */
+static size_t
+acrn_read_image(int fd, char *dst, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, dst + done, MIN(IMAGE_READ_CHUNK, len - done));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+
+	return done;
+}
+
 static int
 acrn_prepare_ramdisk(struct vmctx *ctx)
 {
-	FILE *fp;
-	int len, read;
+	size_t len, read;
+	int fd;
 
-	fp = fopen(ramdisk_path, "r");
-	if (fp == NULL) {
+	fd = acrn_open_image(ramdisk_path, &len);
+	if (fd < 0) {
 		printf("SW_LOAD ERR: could not open ramdisk file %s\n",
 				ramdisk_path);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
 	if (len > (BOOTARGS_LOAD_OFF(ctx) - RAMDISK_LOAD_OFF(ctx))) {
 		printf("SW_LOAD ERR: the size of ramdisk file is too big"
-				" file len=0x%x, limit is 0x%lx\n", len,
+				" file len=0x%zx, limit is 0x%lx\n", len,
 				BOOTARGS_LOAD_OFF(ctx) - RAMDISK_LOAD_OFF(ctx));
-		fclose(fp);
+		close(fd);
 		return -1;
 	}
 	ramdisk_size = len;
 
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + RAMDISK_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
+	read = acrn_read_image(fd, ctx->baseaddr + RAMDISK_LOAD_OFF(ctx), len);
 	if (read < len) {
 		printf("SW_LOAD ERR: could not read the whole ramdisk file,"
-				" file len=%d, read %d\n", len, read);
-		fclose(fp);
+				" file len=%zu, read %zu\n", len, read);
+		close(fd);
 		return -1;
 	}
-	fclose(fp);
+	close(fd);
 	printf("SW_LOAD: ramdisk %s size %d copied to guest 0x%lx\n",
 			ramdisk_path, ramdisk_size, RAMDISK_LOAD_OFF(ctx));
 
@@ -281,41 +328,52 @@ acrn_prepare_ramdisk(struct vmctx *ctx)
 static int
 acrn_prepare_kernel(struct vmctx *ctx)
 {
-	FILE *fp;
-	int len, read;
+	size_t len, read;
+	int fd;
 
-	fp = fopen(kernel_path, "r");
-	if (fp == NULL) {
+	fd = acrn_open_image(kernel_path, &len);
+	if (fd < 0) {
 		printf("SW_LOAD ERR: could not open kernel file %s\n",
 				kernel_path);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
 	if ((len + KERNEL_LOAD_OFF(ctx)) > RAMDISK_LOAD_OFF(ctx)) {
 		printf("SW_LOAD ERR: need big system memory to fit image\n");
-		fclose(fp);
+		close(fd);
 		return -1;
 	}
 	kernel_size = len;
 
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + KERNEL_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
+	read = acrn_read_image(fd, ctx->baseaddr + KERNEL_LOAD_OFF(ctx), len);
 	if (read < len) {
 		printf("SW_LOAD ERR: could not read the whole kernel file,"
-				" file len=%d, read %d\n", len, read);
-		fclose(fp);
+				" file len=%zu, read %zu\n", len, read);
+		close(fd);
 		return -1;
 	}
-	fclose(fp);
+	close(fd);
 	printf("SW_LOAD: kernel %s size %d copied to guest 0x%lx\n",
 			kernel_path, kernel_size, KERNEL_LOAD_OFF(ctx));
 
 	return 0;
 }
 
+/* The ramdisk is loaded next to the kernel, from its own thread */
+struct ramdisk_loader {
+	struct vmctx	*ctx;
+	int		ret;
+};
+
+static void *
+acrn_ramdisk_thread(void *arg)
+{
+	struct ramdisk_loader *rl = arg;
+
+	rl->ret = acrn_prepare_ramdisk(rl->ctx);
+	return NULL;
+}
+
 static uint32_t
 acrn_create_e820_table(struct vmctx *ctx, struct e820_entry *e820)
 {
@@ -394,6 +452,9 @@ acrn_sw_load(struct vmctx *ctx)
 {
 	int ret, setup_size;
 	uint64_t *cfg_offset = (uint64_t *)(ctx->baseaddr + GUEST_CFG_OFFSET);
+	struct ramdisk_loader rl;
+	bool ramdisk_async = false;
+	pthread_t rtid;
 
 	*cfg_offset = ctx->lowmem;
 
@@ -404,18 +465,26 @@ acrn_sw_load(struct vmctx *ctx)
 	}
 
 	if (with_ramdisk) {
-		ret = acrn_prepare_ramdisk(ctx);
-		if (ret)
-			return ret;
+		rl.ctx = ctx;
+		rl.ret = -1;
+		if (pthread_create(&rtid, NULL, acrn_ramdisk_thread, &rl) == 0)
+			ramdisk_async = true;
+		else
+			rl.ret = acrn_prepare_ramdisk(ctx);
 	}
 
+	ret = with_kernel ? acrn_prepare_kernel(ctx) : 0;
+	if (ramdisk_async)
+		pthread_join(rtid, NULL);
+	if (with_ramdisk && rl.ret)
+		return rl.ret;
+	if (ret)
+		return ret;
+
 	if (with_kernel) {
 		uint64_t *kernel_entry_addr =
 			(uint64_t *)(ctx->baseaddr + KERNEL_ENTRY_OFF(ctx));
 
-		ret = acrn_prepare_kernel(ctx);
-		if (ret)
-			return ret;
 		setup_size = acrn_get_bzimage_setup_size(ctx);
 		if (setup_size <= 0)
 			return -1;
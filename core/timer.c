@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Timer wheel with TIMER_WHEEL_LEVELS levels of 64 slots. Level n slots
+ * are 64^n ticks wide; timers move down a level when the wheel reaches
+ * their slot, and fire from level 0. The timerfd is only armed for the
+ * next occupied level 0 slot or the next cascade, so an idle wheel does
+ * not wake the mevent thread.
+ */
+
+#include <sys/param.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mevent.h"
+#include "timer.h"
+
+#define	TIMER_TICK_NS		50000UL		/* 50us */
+#define	TIMER_WHEEL_BITS	6
+#define	TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define	TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define	TIMER_WHEEL_LEVELS	4
+/* ~838s at 50us; later timers are parked in the last slot and requeued */
+#define	TIMER_WHEEL_SPAN	(1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+#define	TIMER_LEVEL_SHIFT(l)	((l) * TIMER_WHEEL_BITS)
+#define	TIMER_NO_TICK		(~0UL)
+
+LIST_HEAD(timer_slot, acrn_timer);
+
+static struct {
+	pthread_mutex_t mtx;
+	pthread_cond_t done;	/* running's callback returned */
+	struct acrn_timer *running;	/* in its callback, or NULL */
+	pthread_t runner;	/* the thread running it */
+	int fd;
+	struct mevent *mevp;
+	uint64_t cur;		/* next tick to process */
+	uint64_t armed;		/* tick the timerfd is armed for */
+	int count;		/* queued timers */
+	uint64_t occupied[TIMER_WHEEL_LEVELS];
+	struct timer_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+} wheel = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+	.armed = TIMER_NO_TICK,
+};
+
+static uint64_t
+timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+timer_enqueue(struct acrn_timer *timer)
+{
+	uint64_t expires, delta;
+	int level, slot;
+
+	expires = timer->expires;
+	if (expires < wheel.cur)
+		expires = wheel.cur;
+	delta = expires - wheel.cur;
+	if (delta >= TIMER_WHEEL_SPAN) {
+		delta = TIMER_WHEEL_SPAN - 1;
+		expires = wheel.cur + delta;
+	}
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1UL << TIMER_LEVEL_SHIFT(level + 1)))
+			break;
+	}
+	slot = (expires >> TIMER_LEVEL_SHIFT(level)) & TIMER_WHEEL_MASK;
+
+	LIST_INSERT_HEAD(&wheel.slots[level][slot], timer, list);
+	wheel.occupied[level] |= 1UL << slot;
+	timer->level = level;
+	timer->slot = slot;
+	wheel.count++;
+}
+
+static void
+timer_dequeue(struct acrn_timer *timer)
+{
+	int level = timer->level;
+	int slot = timer->slot;
+
+	if (level < 0)
+		return;
+
+	LIST_REMOVE(timer, list);
+	if (LIST_EMPTY(&wheel.slots[level][slot]))
+		wheel.occupied[level] &= ~(1UL << slot);
+	timer->level = -1;
+	wheel.count--;
+}
+
+/* the next tick that has timers to fire or to cascade */
+static uint64_t
+timer_next_tick(void)
+{
+	uint64_t occ, next, tick;
+	int level, idx;
+
+	if (wheel.count == 0)
+		return TIMER_NO_TICK;
+
+	next = TIMER_NO_TICK;
+	occ = wheel.occupied[0];
+	if (occ != 0) {
+		idx = wheel.cur & TIMER_WHEEL_MASK;
+		if (idx != 0)
+			occ = (occ >> idx) | (occ << (TIMER_WHEEL_SIZE - idx));
+		next = wheel.cur + __builtin_ctzl(occ);
+	}
+
+	/* the first boundary at which an occupied upper level cascades */
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		if (wheel.occupied[level] == 0)
+			continue;
+		tick = roundup2(wheel.cur, 1UL << TIMER_LEVEL_SHIFT(level));
+		if (tick < next)
+			next = tick;
+		break;
+	}
+
+	return next;
+}
+
+static void
+timer_arm(uint64_t tick)
+{
+	struct itimerspec its;
+	uint64_t ns;
+
+	if (tick == wheel.armed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (tick != TIMER_NO_TICK) {
+		ns = tick * TIMER_TICK_NS;
+		its.it_value.tv_sec = ns / 1000000000UL;
+		its.it_value.tv_nsec = ns % 1000000000UL;
+		/* an all-zero it_value would disarm */
+		if (ns == 0)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(wheel.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timer: timerfd_settime");
+	wheel.armed = tick;
+}
+
+/* move the timers of the upper level slots the wheel just reached down */
+static void
+timer_cascade(void)
+{
+	struct timer_slot *head;
+	struct acrn_timer *timer;
+	int level, slot;
+
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		slot = (wheel.cur >> TIMER_LEVEL_SHIFT(level)) & TIMER_WHEEL_MASK;
+		head = &wheel.slots[level][slot];
+		while ((timer = LIST_FIRST(head)) != NULL) {
+			timer_dequeue(timer);
+			timer_enqueue(timer);
+		}
+		if (slot != 0)
+			break;
+	}
+}
+
+/* fire the level 0 slot at wheel.cur; drops the lock around callbacks */
+static void
+timer_run_slot(uint64_t now)
+{
+	struct timer_slot *head;
+	struct acrn_timer *timer;
+	void (*cb)(void *, uint64_t);
+	void *param;
+	uint64_t nexp;
+
+	head = &wheel.slots[0][wheel.cur & TIMER_WHEEL_MASK];
+	while ((timer = LIST_FIRST(head)) != NULL) {
+		timer_dequeue(timer);
+
+		/* parked beyond the wheel span, not due yet */
+		if (timer->expires > wheel.cur) {
+			timer_enqueue(timer);
+			continue;
+		}
+
+		nexp = 1;
+		if (timer->period != 0) {
+			if (now >= timer->deadline + timer->period)
+				nexp += (now - timer->deadline) /
+					timer->period;
+			timer->deadline += nexp * timer->period;
+			timer->expires = howmany(timer->deadline,
+						 TIMER_TICK_NS);
+			timer_enqueue(timer);
+		}
+
+		cb = timer->callback;
+		param = timer->callback_param;
+		wheel.running = timer;
+		wheel.runner = pthread_self();
+		pthread_mutex_unlock(&wheel.mtx);
+		(*cb)(param, nexp);
+		pthread_mutex_lock(&wheel.mtx);
+		wheel.running = NULL;
+		pthread_cond_broadcast(&wheel.done);
+	}
+}
+
+static void
+timer_handler(int fd, enum ev_type t, void *arg)
+{
+	uint64_t now, now_tick, next;
+
+	pthread_mutex_lock(&wheel.mtx);
+	now = timer_now();
+	now_tick = now / TIMER_TICK_NS;
+	wheel.armed = TIMER_NO_TICK;
+
+	while (wheel.cur <= now_tick) {
+		if ((wheel.cur & TIMER_WHEEL_MASK) == 0)
+			timer_cascade();
+		timer_run_slot(now);
+		wheel.cur++;
+
+		/* skip the ticks that have nothing to fire or cascade */
+		next = timer_next_tick();
+		if (next > wheel.cur)
+			wheel.cur = (next <= now_tick) ? next : now_tick + 1;
+	}
+
+	timer_arm(timer_next_tick());
+	pthread_mutex_unlock(&wheel.mtx);
+}
+
+/* the first timer starts the service; it then lives as long as the DM */
+static int
+timer_service_start(void)
+{
+	if (wheel.fd >= 0)
+		return 0;
+
+	wheel.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel.fd < 0) {
+		perror("timer: timerfd_create");
+		return -1;
+	}
+
+	wheel.cur = timer_now() / TIMER_TICK_NS;
+	wheel.mevp = mevent_add(wheel.fd, EVF_TIMER, timer_handler, NULL);
+	if (wheel.mevp == NULL) {
+		close(wheel.fd);
+		wheel.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t),
+		void *param)
+{
+	int error;
+
+	memset(timer, 0, sizeof(*timer));
+	timer->callback = cb;
+	timer->callback_param = param;
+	timer->level = -1;
+
+	pthread_mutex_lock(&wheel.mtx);
+	error = timer_service_start();
+	pthread_mutex_unlock(&wheel.mtx);
+
+	return error;
+}
+
+/*
+ * Once this returns the callback is not running and won't be called
+ * again, so the timer and its param can be freed; the caller must not
+ * hold a lock the callback takes. From the callback itself it can't
+ * wait, and only stops further calls.
+ */
+void
+acrn_timer_deinit(struct acrn_timer *timer)
+{
+	pthread_mutex_lock(&wheel.mtx);
+	timer_dequeue(timer);
+	while (wheel.running == timer &&
+	       !pthread_equal(wheel.runner, pthread_self())) {
+		pthread_cond_wait(&wheel.done, &wheel.mtx);
+		/* the callback may have re-armed it */
+		timer_dequeue(timer);
+	}
+	pthread_mutex_unlock(&wheel.mtx);
+}
+
+/* relative it_value as with timer_settime(); a zero it_value disarms */
+int
+acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value)
+{
+	uint64_t value, now, next;
+
+	value = new_value->it_value.tv_sec * 1000000000UL +
+		new_value->it_value.tv_nsec;
+
+	pthread_mutex_lock(&wheel.mtx);
+	timer_dequeue(timer);
+
+	if (value != 0) {
+		/* an idle wheel may lag far behind; catch it up */
+		now = timer_now();
+		if (wheel.count == 0 && now / TIMER_TICK_NS > wheel.cur)
+			wheel.cur = now / TIMER_TICK_NS;
+
+		timer->deadline = now + value;
+		timer->period = new_value->it_interval.tv_sec * 1000000000UL +
+			new_value->it_interval.tv_nsec;
+		timer->expires = howmany(timer->deadline, TIMER_TICK_NS);
+		timer_enqueue(timer);
+
+		next = timer_next_tick();
+		if (next < wheel.armed)
+			timer_arm(next);
+	}
+	pthread_mutex_unlock(&wheel.mtx);
+
+	return 0;
+}
@@ -43,6 +43,9 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <emmintrin.h>
 
 #include "types.h"
 #include "cpuset.h"
@@ -68,6 +71,30 @@
  */
 #define	VM_MMAP_GUARD_SIZE	(4 * MB)
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC	0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB	0x0004U
+#endif
+#define	VM_MFD_HUGE_SHIFT	26
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+#define	VM_PREFAULT_THREADS	16		/* at most, per segment */
+#define	VM_PREFAULT_CHUNK	(256 * MB)	/* at least, per thread */
+
+static size_t
+vm_hugepage_size(struct vmctx *ctx)
+{
+	if (ctx->memflags & VM_MEM_F_HUGE_1G)
+		return 1 * GB;
+	if (ctx->memflags & VM_MEM_F_HUGE_2M)
+		return 2 * MB;
+	return 0;
+}
+
 #define	PROT_RW		(PROT_READ | PROT_WRITE)
 #define	PROT_ALL	(PROT_READ | PROT_WRITE | PROT_EXEC)
 
@@ -105,8 +132,10 @@ check_api(int fd)
 	return 0;
 }
 
-static int devfd = -1;
-
+/*
+ * Every VM gets its own VHM file and I/O request page, so several can
+ * be opened by the same process.
+ */
 struct vmctx *
 vm_open(const char *name)
 {
@@ -114,21 +143,28 @@ vm_open(const char *name)
 	struct acrn_create_vm create_vm;
 	int error, retry = 10;
 
-	ctx = malloc(sizeof(struct vmctx) + strlen(name) + 1);
+	ctx = calloc(1, sizeof(struct vmctx) + strlen(name) + 1);
 	assert(ctx != NULL);
-	assert(devfd == -1);
 
-	devfd = open("/dev/acrn_vhm", O_RDWR|O_CLOEXEC);
-	if (devfd == -1) {
+	ctx->fd = open("/dev/acrn_vhm", O_RDWR|O_CLOEXEC);
+	if (ctx->fd == -1) {
 		fprintf(stderr, "Could not open /dev/acrn_vhm\n");
 		goto err;
 	}
 
-	if (check_api(devfd) < 0)
+	if (check_api(ctx->fd) < 0)
 		goto err;
 
-	ctx->fd = devfd;
+	if (posix_memalign((void **)&ctx->ioreq_buf, 4096, 4096) != 0) {
+		ctx->ioreq_buf = NULL;
+		goto err;
+	}
+	memset(ctx->ioreq_buf, 0, 4096);
+
 	ctx->memflags = 0;
+	ctx->lowmem_fd = -1;
+	ctx->highmem_fd = -1;
+	ctx->snap_fd = -1;
 	ctx->lowmem_limit = 2 * GB;
 	ctx->name = (char *)(ctx + 1);
 	strcpy(ctx->name, name);
@@ -151,6 +187,9 @@ vm_open(const char *name)
 	return ctx;
 
 err:
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+	free(ctx->ioreq_buf);
 	free(ctx);
 	return NULL;
 }
@@ -162,8 +201,17 @@ vm_close(struct vmctx *ctx)
 		return;
 
 	close(ctx->fd);
+	if (ctx->lowmem_fd >= 0)
+		close(ctx->lowmem_fd);
+	if (ctx->highmem_fd >= 0)
+		close(ctx->highmem_fd);
+	if (ctx->snap_fd >= 0)
+		close(ctx->snap_fd);
+	free(ctx->dirty_log);
+	free(ctx->ioports);
+	free(ctx->ioport_stats);
+	free(ctx->ioreq_buf);
 	free(ctx);
-	devfd = -1;
 }
 
 int
@@ -231,6 +279,57 @@ vm_notify_request_done(struct vmctx *ctx, int vcpu)
 	return 0;
 }
 
+int
+vm_notify_request_done_batch(struct vmctx *ctx, uint64_t vcpu_mask)
+{
+	static bool no_batch;
+	struct ioreq_notify_batch notify;
+	int vcpu, error = 0;
+
+	if (!vcpu_mask)
+		return 0;
+
+	if (!no_batch) {
+		bzero(&notify, sizeof(notify));
+		notify.client_id = ctx->ioreq_client;
+		notify.vcpu_mask = vcpu_mask;
+
+		if (ioctl(ctx->fd, IC_NOTIFY_REQUEST_FINISH_BATCH,
+				&notify) == 0)
+			return 0;
+		if (errno != ENOTTY && errno != EINVAL) {
+			fprintf(stderr, "failed: notify request finish batch\n");
+			return -1;
+		}
+		/* older VHM, fall back to one ioctl per request */
+		no_batch = true;
+	}
+
+	for (vcpu = 0; vcpu_mask; vcpu++, vcpu_mask >>= 1)
+		if ((vcpu_mask & 1) && vm_notify_request_done(ctx, vcpu))
+			error = -1;
+
+	return error;
+}
+
+int
+vm_ioeventfd(struct vmctx *ctx, struct acrn_ioeventfd *args)
+{
+	if (!args)
+		return -1;
+
+	return ioctl(ctx->fd, IC_SET_IOEVENTFD, args);
+}
+
+int
+vm_pio_shadow(struct vmctx *ctx, struct acrn_pio_shadow *args)
+{
+	if (!args)
+		return -1;
+
+	return ioctl(ctx->fd, IC_SET_PIO_SHADOW, args);
+}
+
 void
 vm_destroy(struct vmctx *ctx)
 {
@@ -297,14 +396,151 @@ vm_get_memflags(struct vmctx *ctx)
 	return ctx->memflags;
 }
 
+/*
+ * Back [gpa, gpa + len) with a memfd owned by the DM rather than
+ * VHM-allocated memory. With hugetlb the DM's own accesses to guest RAM
+ * go through 2MB/1GB TLB entries; the pages are faulted in up front and
+ * VHM pins them for the lifetime of the VM. With VM_MEM_F_LAZY nothing
+ * is populated here: the kernel hands out zeroed pages as the guest or
+ * the DM first touch them, and vm_discard_memory() can give them back.
+ * The memfd is kept in *fdp, so the memory can be shared with other
+ * processes, e.g. a vhost-user backend.
+ */
+static int
+vm_alloc_set_memfd(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+		char *base, char **ptr, int *fdp)
+{
+	struct vm_memmap_vma memmap;
+	size_t pgsz;
+	unsigned int mfd_flags;
+	char *addr;
+	int fd, error, flags;
+
+	mfd_flags = MFD_CLOEXEC;
+	pgsz = vm_hugepage_size(ctx);
+	if (pgsz != 0) {
+		if ((len & (pgsz - 1)) != 0 || (gpa & (pgsz - 1)) != 0) {
+			fprintf(stderr, "vm: memory segment 0x%lx@0x%lx is not "
+				"%luMB aligned\n", len, gpa, pgsz / MB);
+			errno = EINVAL;
+			return -1;
+		}
+		mfd_flags |= MFD_HUGETLB |
+			((unsigned int)(ffsl(pgsz) - 1) << VM_MFD_HUGE_SHIFT);
+	}
+
+	fd = syscall(SYS_memfd_create, "acrn-guest-mem", mfd_flags);
+	if (fd < 0) {
+		perror("vm: memfd_create");
+		return -1;
+	}
+
+	if (ftruncate(fd, len) < 0) {
+		perror("vm: memfd ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 * MAP_POPULATE pre-faults every page, and hugetlb mmap fails
+	 * with ENOMEM up front if the pool cannot cover the segment.
+	 * Wired memory is faulted in by vm_wire_memory() instead.
+	 */
+	flags = MAP_SHARED | MAP_FIXED;
+	if ((ctx->memflags & (VM_MEM_F_LAZY | VM_MEM_F_WIRED)) == 0)
+		flags |= MAP_POPULATE;
+	addr = mmap(base + gpa, len, PROT_RW, flags, fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "vm: cannot map %luMB of guest memory: %s%s\n",
+			len / MB, strerror(errno), pgsz != 0 ?
+			" (check /sys/kernel/mm/hugepages)" : "");
+		close(fd);
+		return -1;
+	}
+
+	bzero(&memmap, sizeof(struct vm_memmap_vma));
+	memmap.type = VM_SYSMEM;
+	if (ctx->memflags & VM_MEM_F_LAZY)
+		memmap.flags = VM_MEMMAP_VMA_F_LAZY;
+	memmap.gpa = gpa;
+	memmap.vma_base = (uint64_t)addr;
+	memmap.len = len;
+	memmap.prot = PROT_ALL;
+	error = ioctl(ctx->fd, IC_SET_MEMSEG_VMA, &memmap);
+	if (error) {
+		perror("vm: IC_SET_MEMSEG_VMA");
+		munmap(addr, len);
+		close(fd);
+		return error;
+	}
+
+	*ptr = addr;
+	*fdp = fd;
+	return 0;
+}
+
+/*
+ * Map [gpa, gpa + len) copy-on-write from the snapshot given to
+ * vm_restore_memory(): a page is read in from the file when first
+ * touched, and the first write to it gives the guest its own copy. VHM
+ * must not pin such a range, since pinning it for write copies every
+ * page up front, so it is always mapped lazily.
+ */
+static int
+vm_map_snapshot(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+		char *base, char **ptr)
+{
+	struct vm_memmap_vma memmap;
+	char *addr;
+	off_t off;
+	int error;
+
+	off = ctx->snap_memoff + (gpa == 0 ? 0 : ctx->lowmem);
+	if ((off & (PAGE_SIZE - 1)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	addr = mmap(base + gpa, len, PROT_RW, MAP_PRIVATE | MAP_FIXED,
+		    ctx->snap_fd, off);
+	if (addr == MAP_FAILED) {
+		perror("vm: cannot map snapshot memory");
+		return -1;
+	}
+
+	bzero(&memmap, sizeof(struct vm_memmap_vma));
+	memmap.type = VM_SYSMEM;
+	memmap.flags = VM_MEMMAP_VMA_F_LAZY;
+	memmap.gpa = gpa;
+	memmap.vma_base = (uint64_t)addr;
+	memmap.len = len;
+	memmap.prot = PROT_ALL;
+	error = ioctl(ctx->fd, IC_SET_MEMSEG_VMA, &memmap);
+	if (error) {
+		perror("vm: IC_SET_MEMSEG_VMA");
+		munmap(addr, len);
+		return error;
+	}
+
+	*ptr = addr;
+	return 0;
+}
+
 static int
 vm_alloc_set_memseg(struct vmctx *ctx, int segid, size_t len,
-		vm_paddr_t gpa, int prot, char *base, char **ptr)
+		vm_paddr_t gpa, int prot, char *base, char **ptr, int *fdp)
 {
 	struct vm_memseg memseg;
 	struct vm_memmap memmap;
 	int error, flags;
 
+	if (segid == VM_SYSMEM && ctx->snap_fd >= 0)
+		return vm_map_snapshot(ctx, len, gpa, base, ptr);
+
+	if (segid == VM_SYSMEM && (vm_hugepage_size(ctx) != 0 ||
+	    (ctx->memflags & VM_MEM_F_LAZY)))
+		return vm_alloc_set_memfd(ctx, len, gpa, base, ptr, fdp);
+
 	if (segid == VM_SYSMEM) {
 		bzero(&memseg, sizeof(struct vm_memseg));
 		memseg.len = len;
@@ -339,10 +575,95 @@ vm_alloc_set_memseg(struct vmctx *ctx, int segid, size_t len,
 	return error;
 }
 
+struct vm_prefault {
+	pthread_t	tid;
+	char		*addr;
+	size_t		len;
+	size_t		pgsz;
+	int		error;
+};
+
+static void *
+vm_prefault_thr(void *arg)
+{
+	struct vm_prefault *pf = arg;
+	volatile char *p;
+
+	if (madvise(pf->addr, pf->len, MADV_POPULATE_WRITE) == 0)
+		return NULL;
+	if (errno != EINVAL) {
+		pf->error = errno;
+		return NULL;
+	}
+
+	/* no MADV_POPULATE_WRITE before Linux 5.14; the guest isn't up */
+	for (p = pf->addr; p < pf->addr + pf->len; p += pf->pgsz)
+		*p = *p;
+	return NULL;
+}
+
+/*
+ * For VM_MEM_F_WIRED: fault a segment in from several threads, so that
+ * startup doesn't grow with one thread touching every page, and lock it
+ * so that neither the DM nor the guest takes a fault on it later.
+ */
+static int
+vm_wire_memory(struct vmctx *ctx, char *addr, size_t len)
+{
+	struct vm_prefault pf[VM_PREFAULT_THREADS];
+	size_t pgsz, per, off;
+	long ncpu;
+	int i, n;
+
+	pgsz = vm_hugepage_size(ctx);
+	if (pgsz == 0)
+		pgsz = getpagesize();
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = len / VM_PREFAULT_CHUNK;
+	if (n > ncpu)
+		n = ncpu;
+	if (n > VM_PREFAULT_THREADS)
+		n = VM_PREFAULT_THREADS;
+	if (n < 1)
+		n = 1;
+	per = roundup(len / n, pgsz);
+
+	for (i = 0, off = 0; i < n && off < len; i++, off += per) {
+		pf[i].addr = addr + off;
+		pf[i].len = (len - off < per) ? len - off : per;
+		pf[i].pgsz = pgsz;
+		pf[i].error = 0;
+		if (pthread_create(&pf[i].tid, NULL, vm_prefault_thr,
+				   &pf[i]) != 0) {
+			pf[i].tid = 0;
+			vm_prefault_thr(&pf[i]);
+		}
+	}
+	n = i;
+
+	for (i = 0; i < n; i++) {
+		if (pf[i].tid != 0)
+			pthread_join(pf[i].tid, NULL);
+		if (pf[i].error) {
+			fprintf(stderr, "vm: cannot prefault guest memory: "
+				"%s\n", strerror(pf[i].error));
+			return -1;
+		}
+	}
+
+	if (mlock(addr, len) < 0) {
+		fprintf(stderr, "vm: cannot lock %luMB of guest memory: %s\n",
+			len / MB, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 int
 vm_setup_memory(struct vmctx *ctx, size_t memsize, enum vm_mmap_style vms)
 {
-	size_t objsize, len;
+	size_t objsize, len, pgsz;
 	vm_paddr_t gpa;
 	int prot;
 	char *baseaddr, *ptr;
@@ -369,12 +690,17 @@ vm_setup_memory(struct vmctx *ctx, size_t memsize, enum vm_mmap_style vms)
 	 * and the adjoining guard regions.
 	 */
 	len = VM_MMAP_GUARD_SIZE + objsize + VM_MMAP_GUARD_SIZE;
+	/* leave room to align the guest base to the hugepage size */
+	pgsz = vm_hugepage_size(ctx);
+	len += pgsz;
 	flags = MAP_PRIVATE | MAP_ANON | MAP_NOCORE | MAP_ALIGNED_SUPER;
 	ptr = mmap(NULL, len, PROT_NONE, flags, -1, 0);
 	if (ptr == MAP_FAILED)
 		return -1;
 
 	baseaddr = ptr + VM_MMAP_GUARD_SIZE;
+	if (pgsz != 0)
+		baseaddr = (char *)roundup2((uintptr_t)baseaddr, pgsz);
 
 	/* TODO: need add error handling */
 	/* alloc & map for lowmem */
@@ -383,9 +709,12 @@ vm_setup_memory(struct vmctx *ctx, size_t memsize, enum vm_mmap_style vms)
 		len = ctx->lowmem;
 		prot = PROT_ALL;
 		error = vm_alloc_set_memseg(ctx, VM_SYSMEM, len, gpa, prot,
-				baseaddr, &ctx->mmap_lowmem);
+				baseaddr, &ctx->mmap_lowmem, &ctx->lowmem_fd);
 		if (error)
 			return error;
+		if ((ctx->memflags & VM_MEM_F_WIRED) &&
+		    vm_wire_memory(ctx, ctx->mmap_lowmem, len) < 0)
+			return -1;
 	}
 
 	/* alloc & map for highmem */
@@ -394,9 +723,12 @@ vm_setup_memory(struct vmctx *ctx, size_t memsize, enum vm_mmap_style vms)
 		len = ctx->highmem;
 		prot = PROT_ALL;
 		error = vm_alloc_set_memseg(ctx, VM_SYSMEM, len, gpa, prot,
-				baseaddr, &ctx->mmap_highmem);
+				baseaddr, &ctx->mmap_highmem, &ctx->highmem_fd);
 		if (error)
 			return error;
+		if ((ctx->memflags & VM_MEM_F_WIRED) &&
+		    vm_wire_memory(ctx, ctx->mmap_highmem, len) < 0)
+			return -1;
 	}
 
 	ctx->baseaddr = baseaddr;
@@ -414,6 +746,102 @@ vm_unsetup_memory(struct vmctx *ctx)
 		munmap(ctx->mmap_highmem, ctx->highmem);
 }
 
+/*
+ * Return the guest pages backing [hva, hva + len) to the host. Only the
+ * whole pages (hugepages with -z) inside the range are released; the
+ * guest sees zeroes there on its next access. This is only possible for
+ * VM_MEM_F_LAZY memory, which VHM does not keep pinned.
+ */
+int
+vm_discard_memory(struct vmctx *ctx, void *hva, size_t len)
+{
+	uintptr_t start, end, pgsz;
+
+	if ((ctx->memflags & VM_MEM_F_LAZY) == 0)
+		return -1;
+
+	start = (uintptr_t)hva;
+	end = start + len;
+	if (!(ctx->lowmem > 0 && start >= (uintptr_t)ctx->mmap_lowmem &&
+	      end <= (uintptr_t)ctx->mmap_lowmem + ctx->lowmem) &&
+	    !(ctx->highmem > 0 && start >= (uintptr_t)ctx->mmap_highmem &&
+	      end <= (uintptr_t)ctx->mmap_highmem + ctx->highmem))
+		return -1;
+
+	pgsz = vm_hugepage_size(ctx);
+	if (pgsz == 0)
+		pgsz = 4096;
+	start = roundup2(start, pgsz);
+	end &= ~(pgsz - 1);
+	if (start >= end)
+		return 0;
+
+	return madvise((void *)start, end - start, MADV_REMOVE);
+}
+
+/*
+ * Write one segment at off. Holes in a memfd, i.e. pages nobody has
+ * touched yet with VM_MEM_F_LAZY, stay holes in the file.
+ */
+static int
+vm_snapshot_seg(int memfd, char *addr, size_t len, int fd, off_t off)
+{
+	off_t pos, end;
+	ssize_t n;
+
+	for (pos = 0; pos < (off_t)len; pos = end) {
+		end = len;
+		if (memfd >= 0) {
+			/* ENXIO: nothing but holes from pos on */
+			pos = lseek(memfd, pos, SEEK_DATA);
+			if (pos < 0)
+				return (errno == ENXIO) ? 0 : -1;
+			end = lseek(memfd, pos, SEEK_HOLE);
+			if (end < 0)
+				return -1;
+			end = MIN(end, (off_t)len);
+		}
+		while (pos < end) {
+			n = pwrite(fd, addr + pos, end - pos, off + pos);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			pos += n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Save guest RAM to fd at off, lowmem first and highmem right after it,
+ * in the layout vm_restore_memory() maps back.
+ */
+int
+vm_snapshot_memory(struct vmctx *ctx, int fd, off_t off)
+{
+	if (ftruncate(fd, off + ctx->lowmem + ctx->highmem) < 0)
+		return -1;
+	if (ctx->lowmem > 0 && vm_snapshot_seg(ctx->lowmem_fd,
+	    ctx->mmap_lowmem, ctx->lowmem, fd, off) < 0)
+		return -1;
+	if (ctx->highmem > 0 && vm_snapshot_seg(ctx->highmem_fd,
+	    ctx->mmap_highmem, ctx->highmem, fd, off + ctx->lowmem) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Have vm_setup_memory() map guest RAM from a vm_snapshot_memory() file
+ * instead of allocating it. The vmctx keeps fd and closes it.
+ */
+void
+vm_restore_memory(struct vmctx *ctx, int fd, off_t off)
+{
+	ctx->snap_fd = fd;
+	ctx->snap_memoff = off;
+}
+
 /*
  * Returns a non-NULL pointer if [gaddr, gaddr+len) is entirely contained in
  * the lowmem or highmem regions.
@@ -443,6 +871,294 @@ vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 	return NULL;
 }
 
+/*
+ * Copies at least this long go to the destination with non-temporal
+ * stores: a DMA-sized buffer would otherwise push the device model's
+ * working set out of the cache on its way through.
+ */
+#define	VM_GPA_NT_MIN	(256 * 1024UL)
+
+/*
+ * Number of bytes from gaddr, up to len, that lie in one RAM region.
+ * Zero if gaddr is not backed by guest memory.
+ */
+static size_t
+vm_gpa_extent(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
+{
+	vm_paddr_t end;
+
+	if (gaddr < ctx->lowmem)
+		end = ctx->lowmem;
+	else if (gaddr >= 4*GB && gaddr - 4*GB < ctx->highmem)
+		end = 4*GB + ctx->highmem;
+	else
+		return 0;
+
+	return MIN(len, end - gaddr);
+}
+
+/*
+ * Fail unless all of [gaddr, gaddr+len) is guest memory, so that the
+ * copy routines never leave a request half done.
+ */
+static int
+vm_gpa_check(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = vm_gpa_extent(ctx, gaddr, len);
+		if (n == 0) {
+			errno = EFAULT;
+			return -1;
+		}
+		gaddr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+vm_gpa_memcpy(void *dst, const void *src, size_t len)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head;
+
+	if (len < VM_GPA_NT_MIN) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	head = -(uintptr_t)d & 15;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+	for (; len >= 64; d += 64, s += 64, len -= 64) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)s);
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)d, x0);
+		_mm_stream_si128((__m128i *)(d + 16), x1);
+		_mm_stream_si128((__m128i *)(d + 32), x2);
+		_mm_stream_si128((__m128i *)(d + 48), x3);
+	}
+	_mm_sfence();
+	memcpy(d, s, len);
+}
+
+/*
+ * Copy len bytes of guest memory at gaddr into buf.  Returns 0, or -1
+ * with errno set to EFAULT and nothing copied if the range is not all
+ * guest memory.
+ */
+int
+dm_gpa_copy_in(struct vmctx *ctx, vm_paddr_t gaddr, void *buf, size_t len)
+{
+	uint8_t *to = buf;
+	size_t n;
+
+	if (vm_gpa_check(ctx, gaddr, len) != 0)
+		return -1;
+
+	for (; len > 0; gaddr += n, to += n, len -= n) {
+		n = vm_gpa_extent(ctx, gaddr, len);
+		vm_gpa_memcpy(to, ctx->baseaddr + gaddr, n);
+	}
+	return 0;
+}
+
+/*
+ * Copy len bytes from buf to guest memory at gaddr and mark the pages
+ * dirty.  Fails like dm_gpa_copy_in().
+ */
+int
+dm_gpa_copy_out(struct vmctx *ctx, vm_paddr_t gaddr, const void *buf,
+		size_t len)
+{
+	const uint8_t *from = buf;
+	size_t n;
+
+	if (vm_gpa_check(ctx, gaddr, len) != 0)
+		return -1;
+
+	for (; len > 0; gaddr += n, from += n, len -= n) {
+		n = vm_gpa_extent(ctx, gaddr, len);
+		vm_gpa_memcpy(ctx->baseaddr + gaddr, from, n);
+		vm_dirty_mark(ctx, ctx->baseaddr + gaddr, n);
+	}
+	return 0;
+}
+
+/*
+ * Describe [gaddr, gaddr+len) as host iovecs, one per RAM region it
+ * covers.  Returns the number of entries used, or -1 with errno set to
+ * EFAULT if part of the range is not guest memory or E2BIG if it needs
+ * more than niov entries.
+ */
+int
+dm_gpa_to_iov(struct vmctx *ctx, vm_paddr_t gaddr, size_t len,
+	      struct iovec *iov, int niov)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; len > 0; i++, gaddr += n, len -= n) {
+		n = vm_gpa_extent(ctx, gaddr, len);
+		if (n == 0) {
+			errno = EFAULT;
+			return -1;
+		}
+		if (i >= niov) {
+			errno = E2BIG;
+			return -1;
+		}
+		iov[i].iov_base = ctx->baseaddr + gaddr;
+		iov[i].iov_len = n;
+	}
+	return i;
+}
+
+/*
+ * Dirty page log: a bit per 4K page of guest memory, lowmem pages
+ * first and highmem pages after them, starting on a word boundary.
+ * The device model's own writes are set here by vm_dirty_mark(); the
+ * guest's are merged in from VHM when it keeps a log.
+ */
+#define	DIRTY_PAGE_SHIFT	12
+
+static size_t
+vm_dirty_hi_base(struct vmctx *ctx)
+{
+	return roundup2(ctx->lowmem >> DIRTY_PAGE_SHIFT, 64);
+}
+
+size_t
+vm_dirty_log_words(struct vmctx *ctx)
+{
+	return (vm_dirty_hi_base(ctx) +
+		(ctx->highmem >> DIRTY_PAGE_SHIFT) + 63) / 64;
+}
+
+static int
+vm_dirty_log_hv(struct vmctx *ctx, uint32_t op, uint64_t *bitmap)
+{
+	struct acrn_dirty_log log;
+	int err;
+
+	bzero(&log, sizeof(log));
+	log.op = op;
+	if (ctx->lowmem > 0) {
+		log.gpa = 0;
+		log.size = ctx->lowmem;
+		log.bitmap = (uint64_t)bitmap;
+		if (ioctl(ctx->fd, IC_DIRTY_LOG, &log))
+			return -1;
+	}
+	if (ctx->highmem > 0) {
+		log.gpa = 4 * GB;
+		log.size = ctx->highmem;
+		log.bitmap = bitmap ?
+			(uint64_t)(bitmap + vm_dirty_hi_base(ctx) / 64) : 0;
+		if (ioctl(ctx->fd, IC_DIRTY_LOG, &log) == 0)
+			return 0;
+		/* don't leave lowmem logging on behind a failed start */
+		if (op == ACRN_DIRTY_LOG_START && ctx->lowmem > 0) {
+			err = errno;
+			log.op = ACRN_DIRTY_LOG_STOP;
+			log.gpa = 0;
+			log.size = ctx->lowmem;
+			ioctl(ctx->fd, IC_DIRTY_LOG, &log);
+			errno = err;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Start logging.  Returns 1 if the log covers all of guest memory, 0 if
+ * VHM has no dirty log and only the device model's writes are seen, or
+ * -1 on error.
+ */
+int
+vm_dirty_log_start(struct vmctx *ctx)
+{
+	size_t words = vm_dirty_log_words(ctx);
+
+	/* kept until vm_close(): backends may still be marking */
+	if (ctx->dirty_log == NULL) {
+		ctx->dirty_log = calloc(words, sizeof(uint64_t));
+		if (ctx->dirty_log == NULL)
+			return -1;
+	} else
+		memset(ctx->dirty_log, 0, words * sizeof(uint64_t));
+
+	ctx->dirty_hv = 0;
+	if (vm_dirty_log_hv(ctx, ACRN_DIRTY_LOG_START, NULL) == 0)
+		ctx->dirty_hv = 1;
+	else if (errno != ENOTTY && errno != EINVAL)
+		return -1;
+
+	__atomic_store_n(&ctx->dirty_on, 1, __ATOMIC_RELEASE);
+	return ctx->dirty_hv;
+}
+
+void
+vm_dirty_log_stop(struct vmctx *ctx)
+{
+	__atomic_store_n(&ctx->dirty_on, 0, __ATOMIC_RELEASE);
+	if (ctx->dirty_hv)
+		vm_dirty_log_hv(ctx, ACRN_DIRTY_LOG_STOP, NULL);
+	ctx->dirty_hv = 0;
+}
+
+/*
+ * Move the pages written since the last call into bitmap, which holds
+ * vm_dirty_log_words() words.  Returns as vm_dirty_log_start() does.
+ */
+int
+vm_dirty_log_get(struct vmctx *ctx, uint64_t *bitmap)
+{
+	size_t i, words = vm_dirty_log_words(ctx);
+
+	if (!ctx->dirty_on)
+		return -1;
+
+	for (i = 0; i < words; i++)
+		bitmap[i] = __atomic_exchange_n(&ctx->dirty_log[i], 0,
+						__ATOMIC_RELAXED);
+	if (ctx->dirty_hv &&
+	    vm_dirty_log_hv(ctx, ACRN_DIRTY_LOG_GET, bitmap) != 0)
+		return -1;
+	return ctx->dirty_hv;
+}
+
+void
+vm_dirty_mark_range(struct vmctx *ctx, void *hva, size_t len)
+{
+	uint64_t gpa = (char *)hva - ctx->baseaddr;
+	size_t bit, last;
+
+	if (gpa + len <= ctx->lowmem) {
+		bit = gpa >> DIRTY_PAGE_SHIFT;
+		last = (gpa + len - 1) >> DIRTY_PAGE_SHIFT;
+	} else if (gpa >= 4 * GB && gpa + len <= 4 * GB + ctx->highmem) {
+		bit = vm_dirty_hi_base(ctx) +
+			((gpa - 4 * GB) >> DIRTY_PAGE_SHIFT);
+		last = vm_dirty_hi_base(ctx) +
+			((gpa - 4 * GB + len - 1) >> DIRTY_PAGE_SHIFT);
+	} else
+		return;
+
+	for (; bit <= last; bit++)
+		__atomic_fetch_or(&ctx->dirty_log[bit / 64],
+				  1UL << (bit % 64), __ATOMIC_RELAXED);
+}
+
 size_t
 vm_get_lowmem_size(struct vmctx *ctx)
 {
@@ -510,16 +1226,99 @@ vm_apicid2vcpu(struct vmctx *ctx, int apicid)
 	return apicid;
 }
 
+/*
+ * MSIs raised by a thread between vm_intr_batch_begin() and
+ * vm_intr_batch_end() are collected here and injected together, so a
+ * pass that completes requests on several devices costs one ioctl.
+ */
+#define	MSI_BATCH_MAX	32
+
+static __thread struct {
+	int			depth;
+	int			count;
+	struct vmctx		*ctx;
+	struct acrn_msi_entry	msis[MSI_BATCH_MAX];
+} msi_batch;
+
+static void
+vm_lapic_msi_flush(void)
+{
+	static bool no_batch;
+	struct acrn_msi_batch batch;
+	struct vmctx *ctx = msi_batch.ctx;
+	int i, count = msi_batch.count;
+
+	msi_batch.count = 0;
+	if (count == 0)
+		return;
+
+	if (count > 1 && !no_batch) {
+		bzero(&batch, sizeof(batch));
+		batch.count = count;
+		batch.msis = (uint64_t)msi_batch.msis;
+
+		if (ioctl(ctx->fd, IC_INJECT_MSI_BATCH, &batch) == 0)
+			return;
+		if (errno != ENOTTY && errno != EINVAL) {
+			fprintf(stderr, "failed: inject msi batch\n");
+			return;
+		}
+		/* older VHM, fall back to one ioctl per MSI */
+		no_batch = true;
+	}
+
+	for (i = 0; i < count; i++)
+		ioctl(ctx->fd, IC_INJECT_MSI, &msi_batch.msis[i]);
+}
+
+void
+vm_intr_batch_begin(void)
+{
+	msi_batch.depth++;
+}
+
+void
+vm_intr_batch_end(void)
+{
+	assert(msi_batch.depth > 0);
+	if (--msi_batch.depth == 0)
+		vm_lapic_msi_flush();
+}
+
 int
 vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg)
 {
-	struct acrn_msi_entry msi;
+	struct acrn_msi_entry msi, *e;
+	int i;
 
 	bzero(&msi, sizeof(msi));
 	msi.msi_addr = addr;
 	msi.msi_data = msg;
 
-	return ioctl(ctx->fd, IC_INJECT_MSI, &msi);
+	if (msi_batch.depth == 0)
+		return ioctl(ctx->fd, IC_INJECT_MSI, &msi);
+
+	/* the same edge twice in one batch is delivered once anyway */
+	for (i = 0; i < msi_batch.count; i++) {
+		e = &msi_batch.msis[i];
+		if (e->msi_addr == addr && e->msi_data == msg)
+			return 0;
+	}
+
+	if (msi_batch.count == MSI_BATCH_MAX)
+		vm_lapic_msi_flush();
+	msi_batch.ctx = ctx;
+	msi_batch.msis[msi_batch.count++] = msi;
+	return 0;
+}
+
+int
+vm_irqfd(struct vmctx *ctx, struct acrn_irqfd *args)
+{
+	if (!args)
+		return -1;
+
+	return ioctl(ctx->fd, IC_SET_IRQFD, args);
 }
 
 int
@@ -631,6 +1430,42 @@ vm_setup_ptdev_msi(struct vmctx *ctx, struct acrn_vm_pci_msix_remap *msi_remap)
 	return ioctl(ctx->fd, IC_VM_PCI_MSIX_REMAP, msi_remap);
 }
 
+int
+vm_setup_ptdev_msi_batch(struct vmctx *ctx,
+			 struct acrn_vm_pci_msix_remap *remaps, int count)
+{
+	static bool no_batch;
+	struct acrn_vm_pci_msix_remap_batch batch;
+	int i;
+
+	if (!remaps || count < 0)
+		return -1;
+
+	if (!no_batch) {
+		bzero(&batch, sizeof(batch));
+		batch.count = count;
+		batch.remaps = (uint64_t)remaps;
+
+		if (ioctl(ctx->fd, IC_VM_PCI_MSIX_REMAP_BATCH, &batch) == 0)
+			return 0;
+		if (errno != ENOTTY && errno != EINVAL)
+			return -1;
+		/*
+		 * ENOTTY is an older VHM, which will never take a batch.
+		 * EINVAL only says this batch wasn't taken (too many
+		 * vectors, say), so just this call goes one by one.
+		 */
+		if (errno == ENOTTY)
+			no_batch = true;
+	}
+
+	for (i = 0; i < count; i++)
+		if (ioctl(ctx->fd, IC_VM_PCI_MSIX_REMAP, &remaps[i]))
+			return -1;
+
+	return 0;
+}
+
 int
 vm_set_ptdev_msix_info(struct vmctx *ctx, struct ic_ptdev_irq *ptirq)
 {
@@ -30,9 +30,11 @@
  * dm ACPI table generator.
  *
  * Create the minimal set of ACPI tables required to boot FreeBSD (and
- * hopefully other o/s's) by writing out ASL template files for each of
- * the tables and the compiling them to AML with the Intel iasl compiler.
- * The AML files are then read into guest memory.
+ * hopefully other o/s's). The fixed-layout tables are built directly in
+ * memory; the DSDT is written out as an ASL file and compiled to AML with
+ * the Intel iasl compiler. Setting ACPI_USE_IASL compiles every table
+ * from its ASL template instead. The tables are then copied into guest
+ * memory.
  *
  *  The tables are placed in the guest's ROM area just below 1MB physical,
  * above the MPTable.
@@ -90,6 +92,7 @@
 
 static int basl_keep_temps;
 static int basl_verbose_iasl;
+static int basl_use_iasl;
 static int basl_ncpu;
 static uint32_t basl_acpi_base = ACPI_BASE;
 
@@ -658,6 +661,418 @@ basl_fwrite_facs(FILE *fp)
 	return 0;
 }
 
+/*
+ * In-process emitters for the fixed-layout tables. They produce the same
+ * tables as the templates above without a round trip through iasl; the
+ * templates are still used when ACPI_USE_IASL is set.
+ */
+struct acpi_table_hdr {
+	char		signature[4];
+	uint32_t	length;
+	uint8_t		revision;
+	uint8_t		checksum;
+	char		oem_id[6];
+	char		oem_table_id[8];
+	uint32_t	oem_revision;
+	char		asl_compiler_id[4];
+	uint32_t	asl_compiler_revision;
+} __attribute__((packed));
+
+struct acpi_gas {
+	uint8_t		space_id;
+	uint8_t		bit_width;
+	uint8_t		bit_offset;
+	uint8_t		access_width;
+	uint64_t	address;
+} __attribute__((packed));
+
+struct acpi_rsdp {
+	char		signature[8];
+	uint8_t		checksum;
+	char		oem_id[6];
+	uint8_t		revision;
+	uint32_t	rsdt_address;
+	uint32_t	length;
+	uint64_t	xsdt_address;
+	uint8_t		ext_checksum;
+	uint8_t		reserved[3];
+} __attribute__((packed));
+
+struct acpi_fadt {
+	struct acpi_table_hdr hdr;
+	uint32_t	facs;
+	uint32_t	dsdt;
+	uint8_t		model;
+	uint8_t		pm_profile;
+	uint16_t	sci_int;
+	uint32_t	smi_cmd;
+	uint8_t		acpi_enable;
+	uint8_t		acpi_disable;
+	uint8_t		s4bios_req;
+	uint8_t		pstate_cnt;
+	uint32_t	pm1a_evt_blk;
+	uint32_t	pm1b_evt_blk;
+	uint32_t	pm1a_cnt_blk;
+	uint32_t	pm1b_cnt_blk;
+	uint32_t	pm2_cnt_blk;
+	uint32_t	pm_tmr_blk;
+	uint32_t	gpe0_blk;
+	uint32_t	gpe1_blk;
+	uint8_t		pm1_evt_len;
+	uint8_t		pm1_cnt_len;
+	uint8_t		pm2_cnt_len;
+	uint8_t		pm_tmr_len;
+	uint8_t		gpe0_blk_len;
+	uint8_t		gpe1_blk_len;
+	uint8_t		gpe1_base;
+	uint8_t		cst_cnt;
+	uint16_t	p_lvl2_lat;
+	uint16_t	p_lvl3_lat;
+	uint16_t	flush_size;
+	uint16_t	flush_stride;
+	uint8_t		duty_offset;
+	uint8_t		duty_width;
+	uint8_t		day_alrm;
+	uint8_t		mon_alrm;
+	uint8_t		century;
+	uint16_t	iapc_boot_arch;
+	uint8_t		reserved;
+	uint32_t	flags;
+	struct acpi_gas	reset_reg;
+	uint8_t		reset_value;
+	uint16_t	arm_boot_arch;
+	uint8_t		minor_version;
+	uint64_t	x_facs;
+	uint64_t	x_dsdt;
+	struct acpi_gas	x_pm1a_evt_blk;
+	struct acpi_gas	x_pm1b_evt_blk;
+	struct acpi_gas	x_pm1a_cnt_blk;
+	struct acpi_gas	x_pm1b_cnt_blk;
+	struct acpi_gas	x_pm2_cnt_blk;
+	struct acpi_gas	x_pm_tmr_blk;
+	struct acpi_gas	x_gpe0_blk;
+	struct acpi_gas	x_gpe1_blk;
+	struct acpi_gas	sleep_control;
+	struct acpi_gas	sleep_status;
+} __attribute__((packed));
+
+struct acpi_facs {
+	char		signature[4];
+	uint32_t	length;
+	uint32_t	hw_signature;
+	uint32_t	fw_waking_vector;
+	uint32_t	global_lock;
+	uint32_t	flags;
+	uint64_t	x_fw_waking_vector;
+	uint8_t		version;
+	uint8_t		reserved[3];
+	uint32_t	ospm_flags;
+	uint8_t		reserved1[24];
+} __attribute__((packed));
+
+#define	ACPI_GAS_IO(w, aw, addr) \
+	((struct acpi_gas){ 1, (w), 0, (aw), (addr) })
+
+/* FADT boot architecture and feature flags, as decoded in the template */
+#define	FADT_BOOT_VGA_NOT_PRESENT	(1 << 2)
+#define	FADT_BOOT_ASPM_NOT_SUPPORTED	(1 << 4)
+#define	FADT_F_WBINVD			(1 << 0)
+#define	FADT_F_PROC_C1			(1 << 2)
+#define	FADT_F_SLP_BUTTON		(1 << 5)
+#define	FADT_F_TMR_VAL_EXT		(1 << 8)
+#define	FADT_F_RESET_REG_SUP		(1 << 10)
+#define	FADT_F_HEADLESS			(1 << 12)
+
+/* MADT interrupt source override / NMI flags */
+#define	MADT_INT_ACTIVE_HIGH		0x1
+#define	MADT_INT_ACTIVE_LOW		0x3
+#define	MADT_INT_EDGE			(0x1 << 2)
+#define	MADT_INT_LEVEL			(0x3 << 2)
+
+static uint8_t
+acpi_checksum(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint8_t sum = 0;
+
+	while (len-- > 0)
+		sum += *p++;
+	return -sum;
+}
+
+static void
+acpi_hdr_init(struct acpi_table_hdr *hdr, const char *sig, uint8_t rev,
+	      const char *oem_table_id)
+{
+	memcpy(hdr->signature, sig, 4);
+	hdr->revision = rev;
+	memcpy(hdr->oem_id, "DM    ", 6);
+	memcpy(hdr->oem_table_id, oem_table_id, 8);
+	hdr->oem_revision = 1;
+	memcpy(hdr->asl_compiler_id, "DM  ", 4);
+	hdr->asl_compiler_revision = 1;
+}
+
+static int
+acpi_hdr_finish(struct acpi_table_hdr *hdr, size_t len)
+{
+	hdr->length = len;
+	hdr->checksum = 0;
+	hdr->checksum = acpi_checksum(hdr, len);
+	return len;
+}
+
+static int
+acpi_emit_rsdp(uint8_t *buf, size_t size)
+{
+	struct acpi_rsdp *rsdp = (struct acpi_rsdp *)buf;
+
+	memcpy(rsdp->signature, "RSD PTR ", 8);
+	memcpy(rsdp->oem_id, "DM    ", 6);
+	rsdp->revision = 2;
+	rsdp->rsdt_address = basl_acpi_base + RSDT_OFFSET;
+	rsdp->length = sizeof(*rsdp);
+	rsdp->xsdt_address = basl_acpi_base + XSDT_OFFSET;
+	rsdp->checksum = acpi_checksum(rsdp, 20);
+	rsdp->ext_checksum = acpi_checksum(rsdp, sizeof(*rsdp));
+
+	return sizeof(*rsdp);
+}
+
+static const uint32_t acpi_sdt_offsets[] = {
+	MADT_OFFSET, FADT_OFFSET, HPET_OFFSET, MCFG_OFFSET
+};
+
+static int
+acpi_emit_rsdt(uint8_t *buf, size_t size)
+{
+	struct acpi_table_hdr *hdr = (struct acpi_table_hdr *)buf;
+	uint32_t *entry = (uint32_t *)(hdr + 1);
+	int i;
+
+	acpi_hdr_init(hdr, "RSDT", 1, "DMRSDT  ");
+	for (i = 0; i < ARRAY_SIZE(acpi_sdt_offsets); i++)
+		entry[i] = basl_acpi_base + acpi_sdt_offsets[i];
+
+	return acpi_hdr_finish(hdr, (uint8_t *)&entry[i] - buf);
+}
+
+static int
+acpi_emit_xsdt(uint8_t *buf, size_t size)
+{
+	struct acpi_table_hdr *hdr = (struct acpi_table_hdr *)buf;
+	uint8_t *p = (uint8_t *)(hdr + 1);
+	uint64_t addr;
+	int i;
+
+	acpi_hdr_init(hdr, "XSDT", 1, "DMXSDT  ");
+	/* 64-bit entries are only 4-byte aligned here */
+	for (i = 0; i < ARRAY_SIZE(acpi_sdt_offsets); i++, p += 8) {
+		addr = basl_acpi_base + acpi_sdt_offsets[i];
+		memcpy(p, &addr, 8);
+	}
+
+	return acpi_hdr_finish(hdr, p - buf);
+}
+
+static int
+acpi_emit_madt(uint8_t *buf, size_t size)
+{
+	struct acpi_table_hdr *hdr = (struct acpi_table_hdr *)buf;
+	uint8_t *p = (uint8_t *)(hdr + 1);
+	uint32_t u32;
+	uint16_t u16;
+	int i;
+
+	if (sizeof(*hdr) + 8 + basl_ncpu * 8 + 12 + 2 * 10 + 6 > size)
+		return -1;
+
+	acpi_hdr_init(hdr, "APIC", 1, "DMMADT  ");
+	u32 = 0xFEE00000;		/* Local APIC address */
+	memcpy(p, &u32, 4);
+	u32 = 1;			/* PC-AT compatible */
+	memcpy(p + 4, &u32, 4);
+	p += 8;
+
+	/* Processor Local APIC for each CPU, enabled */
+	for (i = 0; i < basl_ncpu; i++, p += 8) {
+		p[0] = 0;
+		p[1] = 8;
+		p[2] = i;
+		p[3] = i;
+		u32 = 1;
+		memcpy(p + 4, &u32, 4);
+	}
+
+	/* A single IOAPIC with ID 0 */
+	p[0] = 1;
+	p[1] = 12;
+	p[2] = 0;
+	p[3] = 0;
+	u32 = 0xFEC00000;
+	memcpy(p + 4, &u32, 4);
+	u32 = 0;
+	memcpy(p + 8, &u32, 4);
+	p += 12;
+
+	/* Legacy IRQ0 is connected to pin 2 of the IOAPIC */
+	p[0] = 2;
+	p[1] = 10;
+	p[2] = 0;
+	p[3] = 0;
+	u32 = 2;
+	memcpy(p + 4, &u32, 4);
+	u16 = MADT_INT_ACTIVE_HIGH | MADT_INT_EDGE;
+	memcpy(p + 8, &u16, 2);
+	p += 10;
+
+	p[0] = 2;
+	p[1] = 10;
+	p[2] = 0;
+	p[3] = SCI_INT;
+	u32 = SCI_INT;
+	memcpy(p + 4, &u32, 4);
+	u16 = MADT_INT_ACTIVE_LOW | MADT_INT_LEVEL;
+	memcpy(p + 8, &u16, 2);
+	p += 10;
+
+	/* Local APIC NMI is connected to LINT 1 on all CPUs */
+	p[0] = 4;
+	p[1] = 6;
+	p[2] = 0xFF;
+	u16 = MADT_INT_ACTIVE_HIGH | MADT_INT_EDGE;
+	memcpy(p + 3, &u16, 2);
+	p[5] = 1;
+	p += 6;
+
+	return acpi_hdr_finish(hdr, p - buf);
+}
+
+static int
+acpi_emit_fadt(uint8_t *buf, size_t size)
+{
+	struct acpi_fadt *fadt = (struct acpi_fadt *)buf;
+
+	acpi_hdr_init(&fadt->hdr, "FACP", 5, "DMFACP  ");
+	fadt->facs = basl_acpi_base + FACS_OFFSET;
+	fadt->dsdt = basl_acpi_base + DSDT_OFFSET;
+	fadt->model = 1;
+	fadt->sci_int = SCI_INT;
+	fadt->smi_cmd = SMI_CMD;
+	fadt->acpi_enable = ACPI_ENABLE;
+	fadt->acpi_disable = ACPI_DISABLE;
+	fadt->pm1a_evt_blk = PM1A_EVT_ADDR;
+	fadt->pm1a_cnt_blk = PM1A_CNT_ADDR;
+	fadt->pm_tmr_blk = IO_PMTMR;
+	fadt->pm1_evt_len = 4;
+	fadt->pm1_cnt_len = 2;
+	fadt->pm_tmr_len = 4;
+	fadt->century = 0x32;
+	fadt->iapc_boot_arch = FADT_BOOT_VGA_NOT_PRESENT |
+			       FADT_BOOT_ASPM_NOT_SUPPORTED;
+	fadt->flags = FADT_F_WBINVD | FADT_F_PROC_C1 | FADT_F_SLP_BUTTON |
+		      FADT_F_TMR_VAL_EXT | FADT_F_RESET_REG_SUP |
+		      FADT_F_HEADLESS;
+	fadt->reset_reg = ACPI_GAS_IO(8, 1, 0xCF9);
+	fadt->reset_value = 6;
+	fadt->minor_version = 1;
+	fadt->x_facs = basl_acpi_base + FACS_OFFSET;
+	fadt->x_dsdt = basl_acpi_base + DSDT_OFFSET;
+	fadt->x_pm1a_evt_blk = ACPI_GAS_IO(0x20, 2, PM1A_EVT_ADDR);
+	fadt->x_pm1b_evt_blk = ACPI_GAS_IO(0, 0, 0);
+	fadt->x_pm1a_cnt_blk = ACPI_GAS_IO(0x10, 2, PM1A_CNT_ADDR);
+	fadt->x_pm1b_cnt_blk = ACPI_GAS_IO(0, 0, 0);
+	fadt->x_pm2_cnt_blk = ACPI_GAS_IO(8, 0, 0);
+	fadt->x_pm_tmr_blk = ACPI_GAS_IO(0x20, 3, IO_PMTMR);
+	fadt->x_gpe0_blk = ACPI_GAS_IO(0, 1, 0);
+	fadt->x_gpe1_blk = ACPI_GAS_IO(0, 0, 0);
+	fadt->sleep_control = ACPI_GAS_IO(8, 1, 0);
+	fadt->sleep_status = ACPI_GAS_IO(8, 1, 0);
+
+	return acpi_hdr_finish(&fadt->hdr, sizeof(*fadt));
+}
+
+static int
+acpi_emit_hpet(uint8_t *buf, size_t size)
+{
+	struct acpi_table_hdr *hdr = (struct acpi_table_hdr *)buf;
+	uint8_t *p = (uint8_t *)(hdr + 1);
+	struct acpi_gas gas = { 0, 0, 0, 0, 0xFED00000 };
+
+	acpi_hdr_init(hdr, "HPET", 1, "DMHPET  ");
+	memset(p, 0, 4);		/* Timer Block ID */
+	memcpy(p + 4, &gas, sizeof(gas));
+	p[16] = 0;			/* HPET number */
+	memset(p + 17, 0, 2);		/* minimum clock ticks */
+	p[19] = 1;			/* 4K page protect */
+
+	return acpi_hdr_finish(hdr, sizeof(*hdr) + 20);
+}
+
+static int
+acpi_emit_mcfg(uint8_t *buf, size_t size)
+{
+	struct acpi_table_hdr *hdr = (struct acpi_table_hdr *)buf;
+	uint8_t *p = (uint8_t *)(hdr + 1);
+	uint64_t base = pci_ecfg_base();
+
+	acpi_hdr_init(hdr, "MCFG", 1, "DMMCFG  ");
+	memset(p, 0, 8);		/* reserved */
+	memcpy(p + 8, &base, 8);
+	memset(p + 16, 0, 2);		/* segment group */
+	p[18] = 0;			/* start bus */
+	p[19] = 0xFF;			/* end bus */
+	memset(p + 20, 0, 4);
+
+	return acpi_hdr_finish(hdr, sizeof(*hdr) + 24);
+}
+
+static int
+acpi_emit_nhlt(uint8_t *buf, size_t size)
+{
+	struct acpi_table_hdr *hdr = (struct acpi_table_hdr *)buf;
+	ssize_t len;
+	int fd = open("/sys/firmware/acpi/tables/NHLT", O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Open host NHLT fail! %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* check if file size exceeds reserved room */
+	if (lseek(fd, 0, SEEK_END) > size) {
+		fprintf(stderr, "Host NHLT exceeds reserved room!\n");
+		close(fd);
+		return -1;
+	}
+
+	/* keep the host body, behind our own header */
+	len = pread(fd, hdr + 1, size - sizeof(*hdr), sizeof(*hdr));
+	close(fd);
+	if (len < 0) {
+		fprintf(stderr, "Read host NHLT fail! %s\n", strerror(errno));
+		return -1;
+	}
+
+	acpi_hdr_init(hdr, "NHLT", 0, "NHLT-GPA");
+	memcpy(hdr->oem_id, "INTEL ", 6);
+	hdr->oem_revision = 8;
+
+	return acpi_hdr_finish(hdr, sizeof(*hdr) + len);
+}
+
+static int
+acpi_emit_facs(uint8_t *buf, size_t size)
+{
+	struct acpi_facs *facs = (struct acpi_facs *)buf;
+
+	memcpy(facs->signature, "FACS", 4);
+	facs->length = sizeof(*facs);
+	facs->version = 2;
+
+	return sizeof(*facs);
+}
+
 /*
  * Helper routines for writing to the DSDT from other modules.
  */
@@ -945,21 +1360,173 @@ basl_make_templates(void)
 	return err;
 }
 
+/*
+ * Write a table produced by one of the acpi_emit_*() functions into
+ * guest memory. 'size' is the room up to the next table.
+ */
+static int
+basl_emit(struct vmctx *ctx, int (*emit)(uint8_t *, size_t),
+	  uint64_t offset, size_t size)
+{
+	uint8_t buf[4096];
+	void *gaddr;
+	int len;
+
+	assert(size <= sizeof(buf));
+	memset(buf, 0, size);
+	len = (*emit)(buf, size);
+	if (len < 0 || len > size)
+		return -1;
+
+	gaddr = paddr_guest2host(ctx, basl_acpi_base + offset, len);
+	if (gaddr == NULL)
+		return -1;
+	memcpy(gaddr, buf, len);
+
+	return 0;
+}
+
+/*
+ * The DSDT is assembled by device models as ASL text, so it still goes
+ * through iasl. If ACPI_CACHEDIR names a private directory, the AML is
+ * kept there keyed by a hash of the ASL and reused while the VM
+ * configuration is unchanged.
+ */
+static char *dsdt_text;
+static size_t dsdt_text_len;
+
+static int
+basl_fwrite_dsdt_text(FILE *fp)
+{
+	if (fwrite(dsdt_text, 1, dsdt_text_len, fp) != dsdt_text_len)
+		return -1;
+	EFFLUSH(fp);
+	return 0;
+}
+
+static int
+basl_cache_path(char *path, size_t len)
+{
+	const char *dir = getenv("ACPI_CACHEDIR");
+	uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	struct stat sb;
+	size_t i;
+
+	if (dir == NULL || *dir == '\0')
+		return -1;
+
+	/* A shared directory would let others feed AML to the guest */
+	if (stat(dir, &sb) < 0 || !S_ISDIR(sb.st_mode) ||
+	    sb.st_uid != geteuid() || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+		fprintf(stderr, "ACPI_CACHEDIR %s is not a private directory\n",
+			dir);
+		return -1;
+	}
+
+	for (i = 0; i < dsdt_text_len; i++) {
+		hash ^= (uint8_t)dsdt_text[i];
+		hash *= 0x100000001b3ULL;
+	}
+	if (snprintf(path, len, "%s/dsdt-%016lx.aml", dir, hash) >= len)
+		return -1;
+	return 0;
+}
+
+static int
+basl_cache_load(struct vmctx *ctx, const char *path, uint64_t offset)
+{
+	int fd, err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	err = basl_load(ctx, fd, offset);
+	close(fd);
+	return err;
+}
+
+static void
+basl_cache_store(struct vmctx *ctx, const char *path, uint64_t offset)
+{
+	char tmp[MAXPATHLEN];
+	uint32_t *hdr;
+	ssize_t len;
+	int fd;
+
+	/* the AML length is in the table header */
+	hdr = paddr_guest2host(ctx, basl_acpi_base + offset, 8);
+	if (hdr == NULL)
+		return;
+	len = hdr[1];
+	hdr = paddr_guest2host(ctx, basl_acpi_base + offset, len);
+	if (hdr == NULL)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp))
+		return;
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	if (write(fd, hdr, len) != len || rename(tmp, path) < 0)
+		unlink(tmp);
+	close(fd);
+}
+
+static int
+basl_compile_dsdt(struct vmctx *ctx, uint64_t offset)
+{
+	char path[MAXPATHLEN];
+	FILE *fp;
+	int cached, err;
+
+	fp = open_memstream(&dsdt_text, &dsdt_text_len);
+	if (fp == NULL)
+		return -1;
+	err = basl_fwrite_dsdt(fp);
+	fclose(fp);
+	if (err)
+		goto out;
+
+	cached = (basl_cache_path(path, sizeof(path)) == 0);
+	if (cached && basl_cache_load(ctx, path, offset) == 0)
+		goto out;
+
+	err = basl_compile(ctx, basl_fwrite_dsdt_text, offset);
+	if (!err && cached)
+		basl_cache_store(ctx, path, offset);
+
+out:
+	free(dsdt_text);
+	dsdt_text = NULL;
+	return err;
+}
+
 static struct {
 	int	(*wsect)(FILE *fp);
+	int	(*emit)(uint8_t *buf, size_t size);
 	uint64_t  offset;
+	uint64_t  size;
 	bool	valid;
 } basl_ftables[] = {
-	{ basl_fwrite_rsdp, 0,		 true  },
-	{ basl_fwrite_rsdt, RSDT_OFFSET, true  },
-	{ basl_fwrite_xsdt, XSDT_OFFSET, true  },
-	{ basl_fwrite_madt, MADT_OFFSET, true  },
-	{ basl_fwrite_fadt, FADT_OFFSET, true  },
-	{ basl_fwrite_hpet, HPET_OFFSET, true  },
-	{ basl_fwrite_mcfg, MCFG_OFFSET, true  },
-	{ basl_fwrite_facs, FACS_OFFSET, true  },
-	{ basl_fwrite_nhlt, NHLT_OFFSET, false }, /*valid with audio ptdev*/
-	{ basl_fwrite_dsdt, DSDT_OFFSET, true  }
+	{ basl_fwrite_rsdp, acpi_emit_rsdp, 0, RSDT_OFFSET, true },
+	{ basl_fwrite_rsdt, acpi_emit_rsdt, RSDT_OFFSET,
+	  XSDT_OFFSET - RSDT_OFFSET, true },
+	{ basl_fwrite_xsdt, acpi_emit_xsdt, XSDT_OFFSET,
+	  MADT_OFFSET - XSDT_OFFSET, true },
+	{ basl_fwrite_madt, acpi_emit_madt, MADT_OFFSET,
+	  FADT_OFFSET - MADT_OFFSET, true },
+	{ basl_fwrite_fadt, acpi_emit_fadt, FADT_OFFSET,
+	  HPET_OFFSET - FADT_OFFSET, true },
+	{ basl_fwrite_hpet, acpi_emit_hpet, HPET_OFFSET,
+	  MCFG_OFFSET - HPET_OFFSET, true },
+	{ basl_fwrite_mcfg, acpi_emit_mcfg, MCFG_OFFSET,
+	  FACS_OFFSET - MCFG_OFFSET, true },
+	{ basl_fwrite_facs, acpi_emit_facs, FACS_OFFSET,
+	  NHLT_OFFSET - FACS_OFFSET, true },
+	/* valid with audio ptdev */
+	{ basl_fwrite_nhlt, acpi_emit_nhlt, NHLT_OFFSET,
+	  DSDT_OFFSET - NHLT_OFFSET, false },
+	{ basl_fwrite_dsdt, NULL, DSDT_OFFSET, 0, true }
 };
 
 void
@@ -995,17 +1562,32 @@ acpi_build(struct vmctx *ctx, int ncpu)
 	if (getenv("ACPI_KEEPTMPS"))
 		basl_keep_temps = 1;
 
+	/*
+	 * For debug, compile every table from its ASL template with iasl
+	 * instead of emitting the fixed-layout ones directly
+	 */
+	if (getenv("ACPI_USE_IASL"))
+		basl_use_iasl = 1;
+
 	i = 0;
 	err = basl_make_templates();
 
 	/*
-	 * Run through all the ASL files, compiling them and
+	 * Run through all the tables, emitting or compiling them and
 	 * copying them into guest memory
 	 */
 	while (!err && (i < ARRAY_SIZE(basl_ftables))) {
-		if (basl_ftables[i].valid)
+		if (!basl_ftables[i].valid)
+			;
+		else if (basl_use_iasl)
 			err = basl_compile(ctx, basl_ftables[i].wsect,
 					basl_ftables[i].offset);
+		else if (basl_ftables[i].emit != NULL)
+			err = basl_emit(ctx, basl_ftables[i].emit,
+					basl_ftables[i].offset,
+					basl_ftables[i].size);
+		else
+			err = basl_compile_dsdt(ctx, basl_ftables[i].offset);
 		i++;
 	}
 
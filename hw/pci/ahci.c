@@ -45,10 +45,12 @@
 #include <openssl/md5.h>
 
 #include "dm.h"
+#include "vmmapi.h"
 #include "pci_core.h"
 #include "ahci.h"
 #include "block_if.h"
 #include "ata.h"
+#include "timer.h"
 
 #define	DEF_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
 #define	MAX_PORTS	32	/* AHCI supports 32 ports */
@@ -122,11 +124,25 @@ struct ahci_ioreq {
 	uint32_t done;
 	int slot;
 	int more;
+	int readop;		/* data moves into guest memory */
+	struct iovec *ext_iov;	/* BLOCKIF_IOV_EXT_MAX, for long PRDTs */
 };
 
 struct ahci_port {
 	struct blockif_ctxt *bctx;
 	struct pci_ahci_vdev *ahci_dev;
+
+	/*
+	 * Port state is under the port's own lock.  Command slots are
+	 * processed by the port worker, kicked from PxCI/PxCMD writes,
+	 * so the vcpu doesn't walk FISes and PRDTs itself.  Lock order
+	 * is port mtx, then the HBA mtx.
+	 */
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_t tid;
+	int worker;		/* tid is running */
+	int kick;
 	uint8_t *cmd_lst;
 	uint8_t *rfis;
 	char ident[20 + 1];
@@ -187,7 +203,7 @@ struct ahci_prdt_entry {
 
 struct pci_ahci_vdev {
 	struct pci_vdev *dev;
-	pthread_mutex_t	mtx;
+	pthread_mutex_t	mtx;	/* HBA registers: ghc, is, lintr */
 	int ports;
 	uint32_t cap;
 	uint32_t ghc;
@@ -201,6 +217,16 @@ struct pci_ahci_vdev {
 	uint32_t cap2;
 	uint32_t bohc;
 	uint32_t lintr;
+
+	/*
+	 * Command completion coalescing: completions on CCC_PORTS count
+	 * towards one interrupt on IS bit CCC_CTL.INT, raised after
+	 * CCC_CTL.CC of them or CCC_CTL.TV ms after the first.
+	 */
+	struct acrn_timer ccc_timer;
+	int ccc_done;
+	int ccc_armed;
+
 	struct ahci_port port[MAX_PORTS];
 };
 #define	ahci_ctx(ahci_dev)	((ahci_dev)->dev->vmctx)
@@ -227,7 +253,10 @@ ahci_generate_intr(struct pci_ahci_vdev *ahci_dev, uint32_t mask)
 	int i, nmsg;
 	uint32_t mmask;
 
-	/* Update global IS from PxIS/PxIE. */
+	/*
+	 * Update global IS from PxIS/PxIE.  This holds only the HBA lock;
+	 * a port raising PxIS meanwhile sets its IS bit itself.
+	 */
 	for (i = 0; i < ahci_dev->ports; i++) {
 		p = &ahci_dev->port[i];
 		if (p->is & p->ie)
@@ -263,6 +292,97 @@ ahci_generate_intr(struct pci_ahci_vdev *ahci_dev, uint32_t mask)
 		if (ahci_dev->is & mask && mmask & mask)
 			pci_generate_msi(dev, i);
 	}
+
+	/* The CCC bit sits above the ports; see ahci_ccc_intr(). */
+	if (ahci_dev->ccc_ctl & AHCI_CCCC_EN) {
+		i = (ahci_dev->ccc_ctl & AHCI_CCCC_INT_MASK) >>
+		    AHCI_CCCC_INT_SHIFT;
+		if (ahci_dev->is & mask & (1 << i) && i >= nmsg &&
+		    ahci_dev->ports <= nmsg)
+			pci_generate_msi(dev, nmsg - 1);
+	}
+}
+
+/*
+ * Drop pending coalesced completions; with the HBA lock held.
+ */
+static void
+ahci_ccc_intr_cancel(struct pci_ahci_vdev *ahci_dev)
+{
+	struct itimerspec ts;
+
+	ahci_dev->ccc_done = 0;
+	if (ahci_dev->ccc_armed) {
+		memset(&ts, 0, sizeof(ts));
+		acrn_timer_settime(&ahci_dev->ccc_timer, &ts);
+		ahci_dev->ccc_armed = 0;
+	}
+}
+
+/*
+ * Raise the coalesced interrupt; with the HBA lock held.
+ */
+static void
+ahci_ccc_intr(struct pci_ahci_vdev *ahci_dev)
+{
+	int bit, nmsg;
+
+	ahci_ccc_intr_cancel(ahci_dev);
+
+	bit = (ahci_dev->ccc_ctl & AHCI_CCCC_INT_MASK) >> AHCI_CCCC_INT_SHIFT;
+	ahci_dev->is |= (1 << bit);
+	if ((ahci_dev->ghc & AHCI_GHC_IE) == 0)
+		return;
+	nmsg = pci_msi_maxmsgnum(ahci_dev->dev);
+	if (nmsg > 0)
+		pci_generate_msi(ahci_dev->dev, MIN(bit, nmsg - 1));
+	else if (!ahci_dev->lintr) {
+		ahci_dev->lintr = 1;
+		pci_lintr_assert(ahci_dev->dev);
+	}
+}
+
+static void
+ahci_ccc_timeout(void *arg, uint64_t nexp)
+{
+	struct pci_ahci_vdev *ahci_dev = arg;
+
+	pthread_mutex_lock(&ahci_dev->mtx);
+	ahci_dev->ccc_armed = 0;
+	if ((ahci_dev->ccc_ctl & AHCI_CCCC_EN) && ahci_dev->ccc_done > 0)
+		ahci_ccc_intr(ahci_dev);
+	pthread_mutex_unlock(&ahci_dev->mtx);
+}
+
+/*
+ * Count a command completion on port p towards the coalesced interrupt.
+ */
+static void
+ahci_ccc_complete(struct ahci_port *p)
+{
+	struct pci_ahci_vdev *ahci_dev = p->ahci_dev;
+	struct itimerspec ts;
+	uint32_t cc, tv;
+
+	pthread_mutex_lock(&ahci_dev->mtx);
+	if ((ahci_dev->ccc_ctl & AHCI_CCCC_EN) == 0 ||
+	    (ahci_dev->ccc_pts & (1 << p->port)) == 0)
+		goto out;
+
+	cc = (ahci_dev->ccc_ctl & AHCI_CCCC_CC_MASK) >> AHCI_CCCC_CC_SHIFT;
+	tv = (ahci_dev->ccc_ctl & AHCI_CCCC_TV_MASK) >> AHCI_CCCC_TV_SHIFT;
+	ahci_dev->ccc_done++;
+	if (cc != 0 && ahci_dev->ccc_done >= cc)
+		ahci_ccc_intr(ahci_dev);
+	else if (tv != 0 && !ahci_dev->ccc_armed) {
+		memset(&ts, 0, sizeof(ts));
+		ts.it_value.tv_sec = tv / 1000;
+		ts.it_value.tv_nsec = (tv % 1000) * 1000000;
+		if (acrn_timer_settime(&ahci_dev->ccc_timer, &ts) == 0)
+			ahci_dev->ccc_armed = 1;
+	}
+out:
+	pthread_mutex_unlock(&ahci_dev->mtx);
 }
 
 /*
@@ -282,31 +402,34 @@ ahci_port_intr(struct ahci_port *p)
 	if ((p->is & p->ie) == 0)
 		return;
 
+	pthread_mutex_lock(&ahci_dev->mtx);
+
 	/* In case of non-shared MSI always generate interrupt. */
 	nmsg = pci_msi_maxmsgnum(dev);
 	if (ahci_dev->ports <= nmsg || p->port < nmsg - 1) {
 		ahci_dev->is |= (1 << p->port);
-		if ((ahci_dev->ghc & AHCI_GHC_IE) == 0)
-			return;
-		pci_generate_msi(dev, p->port);
-		return;
+		if ((ahci_dev->ghc & AHCI_GHC_IE) != 0)
+			pci_generate_msi(dev, p->port);
+		goto out;
 	}
 
 	/* If IS for this port is already set -- do nothing. */
 	if (ahci_dev->is & (1 << p->port))
-		return;
+		goto out;
 
 	ahci_dev->is |= (1 << p->port);
 
 	/* If interrupts are enabled -- generate one. */
 	if ((ahci_dev->ghc & AHCI_GHC_IE) == 0)
-		return;
+		goto out;
 	if (nmsg > 0) {
 		pci_generate_msi(dev, nmsg - 1);
 	} else if (!ahci_dev->lintr) {
 		ahci_dev->lintr = 1;
 		pci_lintr_assert(dev);
 	}
+out:
+	pthread_mutex_unlock(&ahci_dev->mtx);
 }
 
 static void
@@ -342,6 +465,9 @@ ahci_write_fis(struct ahci_port *p, enum sata_fis_type ft, uint8_t *fis)
 		irq |= AHCI_P_IX_TFE;
 	}
 	memcpy(p->rfis + offset, fis, len);
+	vm_dirty_mark(ahci_ctx(p->ahci_dev), p->rfis + offset, len);
+	if (irq & (AHCI_P_IX_DHR | AHCI_P_IX_SDB))
+		ahci_ccc_complete(p);
 	if (irq) {
 		if (~p->is & irq) {
 			p->is |= irq;
@@ -479,7 +605,7 @@ ahci_port_stop(struct ahci_port *p)
 	int slot;
 	int error;
 
-	/*assert(pthread_mutex_isowned_np(&p->ahci_dev->mtx)); */
+	/*assert(pthread_mutex_isowned_np(&p->mtx)); */
 
 	TAILQ_FOREACH(aior, &p->iobhd, io_blist) {
 		/*
@@ -545,27 +671,42 @@ ahci_port_reset(struct ahci_port *pr)
 	ahci_write_reset_fis_d2h(pr);
 }
 
+/*
+ * Called without any lock held; takes the HBA lock and then each port's.
+ */
 static void
 ahci_reset(struct pci_ahci_vdev *ahci_dev)
 {
+	struct ahci_port *p;
 	int i;
 
+	pthread_mutex_lock(&ahci_dev->mtx);
 	ahci_dev->ghc = AHCI_GHC_AE;
 	ahci_dev->is = 0;
+	ahci_dev->ccc_ctl = 0;
+	ahci_dev->ccc_pts = 0;
+	if (ahci_dev->cap & AHCI_CAP_CCCS)
+		ahci_dev->ccc_ctl = ahci_dev->ports << AHCI_CCCC_INT_SHIFT;
+	if (ahci_dev->ccc_done || ahci_dev->ccc_armed)
+		ahci_ccc_intr_cancel(ahci_dev);
 
 	if (ahci_dev->lintr) {
 		pci_lintr_deassert(ahci_dev->dev);
 		ahci_dev->lintr = 0;
 	}
+	pthread_mutex_unlock(&ahci_dev->mtx);
 
 	for (i = 0; i < ahci_dev->ports; i++) {
-		ahci_dev->port[i].ie = 0;
-		ahci_dev->port[i].is = 0;
-		ahci_dev->port[i].cmd = (AHCI_P_CMD_SUD | AHCI_P_CMD_POD);
-		if (ahci_dev->port[i].bctx)
-			ahci_dev->port[i].cmd |= AHCI_P_CMD_CPS;
-		ahci_dev->port[i].sctl = 0;
-		ahci_port_reset(&ahci_dev->port[i]);
+		p = &ahci_dev->port[i];
+		pthread_mutex_lock(&p->mtx);
+		p->ie = 0;
+		p->is = 0;
+		p->cmd = (AHCI_P_CMD_SUD | AHCI_P_CMD_POD);
+		if (p->bctx)
+			p->cmd |= AHCI_P_CMD_CPS;
+		p->sctl = 0;
+		ahci_port_reset(p);
+		pthread_mutex_unlock(&p->mtx);
 	}
 }
 
@@ -603,15 +744,32 @@ ahci_build_iov(struct ahci_port *p, struct ahci_ioreq *aior,
 	       struct ahci_prdt_entry *prdt, uint16_t prdtl)
 {
 	struct blockif_req *breq = &aior->io_req;
-	int i, j, skip, todo, left, extra;
+	struct vmctx *ctx = ahci_ctx(p->ahci_dev);
+	struct iovec *iov, seg[2];
+	int i, j, k, n, max, skip, todo, left, extra;
 	uint32_t dbcsz;
 
+	/*
+	 * Give a long PRDT the request's bigger array, so the command
+	 * still goes to blockif in one piece.
+	 */
+	if (prdtl > BLOCKIF_IOV_MAX && aior->ext_iov == NULL)
+		aior->ext_iov = calloc(BLOCKIF_IOV_EXT_MAX,
+				       sizeof(struct iovec));
+	if (prdtl > BLOCKIF_IOV_MAX && aior->ext_iov != NULL) {
+		breq->iov = aior->ext_iov;
+		max = BLOCKIF_IOV_EXT_MAX;
+	} else {
+		breq->iov = breq->iov_buf;
+		max = BLOCKIF_IOV_MAX;
+	}
+	iov = breq->iov;
+
 	/* Copy part of PRDT between 'done' and 'len' bytes into the iov. */
 	skip = aior->done;
 	left = aior->len - aior->done;
 	todo = 0;
-	for (i = 0, j = 0; i < prdtl && j < BLOCKIF_IOV_MAX && left > 0;
-	    i++, prdt++) {
+	for (i = 0, j = 0; i < prdtl && left > 0; i++, prdt++) {
 		dbcsz = (prdt->dbc & DBCMASK) + 1;
 		/* Skip already done part of the PRDT */
 		if (dbcsz <= skip) {
@@ -621,26 +779,46 @@ ahci_build_iov(struct ahci_port *p, struct ahci_ioreq *aior,
 		dbcsz -= skip;
 		if (dbcsz > left)
 			dbcsz = left;
-		breq->iov[j].iov_base = paddr_guest2host(ahci_ctx(p->ahci_dev),
-		    prdt->dba + skip, dbcsz);
-		breq->iov[j].iov_len = dbcsz;
-		todo += dbcsz;
-		left -= dbcsz;
+		/*
+		 * An entry of at most 4MB crosses at most one RAM region
+		 * boundary.  One outside guest RAM gets a NULL base, which
+		 * blockif fails with EFAULT.
+		 */
+		n = dm_gpa_to_iov(ctx, prdt->dba + skip, dbcsz, seg, 2);
+		if (n < 0) {
+			seg[0].iov_base = NULL;
+			seg[0].iov_len = dbcsz;
+			n = 1;
+		}
 		skip = 0;
-		j++;
+		for (k = 0; k < n; k++) {
+			/* Pieces that continue the last iovec extend it. */
+			if (j > 0 && seg[k].iov_base != NULL &&
+			    (uint8_t *)iov[j - 1].iov_base +
+			    iov[j - 1].iov_len == seg[k].iov_base)
+				iov[j - 1].iov_len += seg[k].iov_len;
+			else if (j < max)
+				iov[j++] = seg[k];
+			else
+				break;
+			todo += seg[k].iov_len;
+			left -= seg[k].iov_len;
+		}
+		if (k < n)
+			break;
 	}
 
 	/* If we got limited by IOV length, round I/O down to sector size. */
-	if (j == BLOCKIF_IOV_MAX) {
+	if (i < prdtl && left > 0) {
 		extra = todo % blockif_sectsz(p->bctx);
 		todo -= extra;
 		assert(todo > 0);
 		while (extra > 0) {
-			if (breq->iov[j - 1].iov_len > extra) {
-				breq->iov[j - 1].iov_len -= extra;
+			if (iov[j - 1].iov_len > extra) {
+				iov[j - 1].iov_len -= extra;
 				break;
 			}
-			extra -= breq->iov[j - 1].iov_len;
+			extra -= iov[j - 1].iov_len;
 			j--;
 		}
 	}
@@ -717,6 +895,7 @@ ahci_handle_rw(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t done)
 	aior->slot = slot;
 	aior->len = len;
 	aior->done = done;
+	aior->readop = readop;
 	breq = &aior->io_req;
 	breq->offset = lba + done;
 	ahci_build_iov(p, aior, prdt, hdr->prdtl);
@@ -755,6 +934,7 @@ ahci_handle_flush(struct ahci_port *p, int slot, uint8_t *cfis)
 	aior->len = 0;
 	aior->done = 0;
 	aior->more = 0;
+	aior->readop = 0;
 	breq = &aior->io_req;
 
 	/*
@@ -771,7 +951,7 @@ ahci_handle_flush(struct ahci_port *p, int slot, uint8_t *cfis)
 	assert(err == 0);
 }
 
-static inline void
+static inline int
 read_prdt(struct ahci_port *p, int slot, uint8_t *cfis,
 	  void *buf, int size)
 {
@@ -785,18 +965,24 @@ read_prdt(struct ahci_port *p, int slot, uint8_t *cfis,
 	to = buf;
 	prdt = (struct ahci_prdt_entry *)(cfis + 0x80);
 	for (i = 0; i < hdr->prdtl && len; i++) {
-		uint8_t *ptr;
 		uint32_t dbcsz;
 		int sublen;
 
 		dbcsz = (prdt->dbc & DBCMASK) + 1;
-		ptr = paddr_guest2host(ahci_ctx(p->ahci_dev), prdt->dba, dbcsz);
 		sublen = MIN(len, dbcsz);
-		memcpy(to, ptr, sublen);
+		if (dm_gpa_copy_in(ahci_ctx(p->ahci_dev), prdt->dba, to,
+		    sublen) != 0) {
+			memset(to, 0, len);
+			return -1;
+		}
 		len -= sublen;
 		to += sublen;
 		prdt++;
 	}
+
+	/* a PRDT shorter than the buffer leaves the rest zeroed */
+	memset(to, 0, len);
+	return 0;
 }
 
 static void
@@ -809,6 +995,7 @@ ahci_handle_dsm_trim(struct ahci_port *p, int slot, uint8_t *cfis,
 	uint64_t elba;
 	uint32_t len, elen;
 	int err, first, ncq;
+	uint32_t tfd;
 	uint8_t buf[512];
 
 	first = (done == 0);
@@ -821,7 +1008,11 @@ ahci_handle_dsm_trim(struct ahci_port *p, int slot, uint8_t *cfis,
 		len *= 512;
 		ncq = 1;
 	}
-	read_prdt(p, slot, cfis, buf, sizeof(buf));
+	if (read_prdt(p, slot, cfis, buf, sizeof(buf)) != 0) {
+		/* the range list isn't in guest RAM */
+		tfd = (ATA_E_ABORT << 8) | ATA_S_READY | ATA_S_ERROR;
+		goto complete;
+	}
 
 next:
 	entry = &buf[done];
@@ -835,20 +1026,8 @@ next:
 	done += 8;
 	if (elen == 0) {
 		if (done >= len) {
-			if (ncq) {
-				if (first)
-					ahci_write_fis_d2h_ncq(p, slot);
-				ahci_write_fis_sdb(p, slot, cfis,
-				    ATA_S_READY | ATA_S_DSC);
-			} else {
-				ahci_write_fis_d2h(p, slot, cfis,
-				    ATA_S_READY | ATA_S_DSC);
-			}
-			p->pending &= ~(1 << slot);
-			ahci_check_stopped(p);
-			if (!first)
-				ahci_handle_port(p);
-			return;
+			tfd = ATA_S_READY | ATA_S_DSC;
+			goto complete;
 		}
 		goto next;
 	}
@@ -864,6 +1043,7 @@ next:
 	aior->len = len;
 	aior->done = done;
 	aior->more = (len != done);
+	aior->readop = 0;
 
 	breq = &aior->io_req;
 	breq->offset = elba * blockif_sectsz(p->bctx);
@@ -884,6 +1064,20 @@ next:
 
 	err = blockif_delete(p->bctx, breq);
 	assert(err == 0);
+	return;
+
+complete:
+	if (ncq) {
+		if (first)
+			ahci_write_fis_d2h_ncq(p, slot);
+		ahci_write_fis_sdb(p, slot, cfis, tfd);
+	} else {
+		ahci_write_fis_d2h(p, slot, cfis, tfd);
+	}
+	p->pending &= ~(1 << slot);
+	ahci_check_stopped(p);
+	if (!first)
+		ahci_handle_port(p);
 }
 
 static inline void
@@ -900,19 +1094,20 @@ write_prdt(struct ahci_port *p, int slot, uint8_t *cfis,
 	from = buf;
 	prdt = (struct ahci_prdt_entry *)(cfis + 0x80);
 	for (i = 0; i < hdr->prdtl && len; i++) {
-		uint8_t *ptr;
 		uint32_t dbcsz;
 		int sublen;
 
 		dbcsz = (prdt->dbc & DBCMASK) + 1;
-		ptr = paddr_guest2host(ahci_ctx(p->ahci_dev), prdt->dba, dbcsz);
 		sublen = MIN(len, dbcsz);
-		memcpy(ptr, from, sublen);
+		if (dm_gpa_copy_out(ahci_ctx(p->ahci_dev), prdt->dba, from,
+		    sublen) != 0)
+			break;
 		len -= sublen;
 		from += sublen;
 		prdt++;
 	}
 	hdr->prdbc = size - len;
+	vm_dirty_mark(ahci_ctx(p->ahci_dev), &hdr->prdbc, sizeof(hdr->prdbc));
 }
 
 static void
@@ -1415,6 +1610,7 @@ atapi_read(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t done)
 	aior->slot = slot;
 	aior->len = len;
 	aior->done = done;
+	aior->readop = 1;
 	breq = &aior->io_req;
 	breq->offset = lba + done;
 	ahci_build_iov(p, aior, prdt, hdr->prdtl);
@@ -1867,9 +2063,62 @@ ahci_handle_port(struct ahci_port *p)
 	}
 }
 
+/*
+ * Hand newly issued slots to the port worker; with the port lock held.
+ */
+static void
+ahci_kick_port(struct ahci_port *p)
+{
+	if (!p->worker) {
+		ahci_handle_port(p);
+		return;
+	}
+	p->kick = 1;
+	pthread_cond_signal(&p->cond);
+}
+
+static void *
+ahci_port_thr(void *arg)
+{
+	struct ahci_port *p = arg;
+
+	pthread_mutex_lock(&p->mtx);
+	for (;;) {
+		while (!p->kick && p->worker)
+			pthread_cond_wait(&p->cond, &p->mtx);
+		if (!p->worker)
+			break;
+		p->kick = 0;
+		ahci_handle_port(p);
+	}
+	pthread_mutex_unlock(&p->mtx);
+	return NULL;
+}
+
+/*
+ * A completed read wrote the guest buffers behind its iovecs, and every
+ * completion writes the byte count back into the command header.
+ */
+static void
+ahci_dirty_ioreq(struct ahci_port *p, struct ahci_ioreq *aior,
+		 struct ahci_cmd_hdr *hdr)
+{
+	struct vmctx *ctx = ahci_ctx(p->ahci_dev);
+	struct blockif_req *breq = &aior->io_req;
+	int i;
+
+	if (!ctx->dirty_on)
+		return;
+	if (aior->readop)
+		for (i = 0; i < breq->iovcnt; i++)
+			vm_dirty_mark(ctx, breq->iov[i].iov_base,
+				      breq->iov[i].iov_len);
+	vm_dirty_mark(ctx, &hdr->prdbc, sizeof(hdr->prdbc));
+}
+
 /*
  * blockif callback routine - this runs in the context of the blockif
- * i/o thread, so the mutex needs to be acquired.
+ * i/o thread, so the port mutex needs to be acquired.
  */
 static void
 ata_ioreq_cb(struct blockif_req *br, int err)
@@ -1877,7 +2126,6 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	struct ahci_cmd_hdr *hdr;
 	struct ahci_ioreq *aior;
 	struct ahci_port *p;
-	struct pci_ahci_vdev *ahci_dev;
 	uint32_t tfd;
 	uint8_t *cfis;
 	int slot, ncq, dsm;
@@ -1889,7 +2137,6 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	p = aior->io_pr;
 	cfis = aior->cfis;
 	slot = aior->slot;
-	ahci_dev = p->ahci_dev;
 	hdr = (struct ahci_cmd_hdr *)(p->cmd_lst + slot * AHCI_CL_SIZE);
 
 	if (cfis[2] == ATA_WRITE_FPDMA_QUEUED ||
@@ -1901,7 +2148,7 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	     (cfis[13] & 0x1f) == ATA_SFPDMA_DSM))
 		dsm = 1;
 
-	pthread_mutex_lock(&ahci_dev->mtx);
+	pthread_mutex_lock(&p->mtx);
 
 	/*
 	 * Delete the blockif request from the busy list
@@ -1913,8 +2160,10 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	 */
 	STAILQ_INSERT_TAIL(&p->iofhd, aior, io_flist);
 
-	if (!err)
+	if (!err) {
 		hdr->prdbc = aior->done;
+		ahci_dirty_ioreq(p, aior, hdr);
+	}
 
 	if (!err && aior->more) {
 		if (dsm)
@@ -1941,7 +2190,7 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	ahci_check_stopped(p);
 	ahci_handle_port(p);
 out:
-	pthread_mutex_unlock(&ahci_dev->mtx);
+	pthread_mutex_unlock(&p->mtx);
 	DPRINTF("%s exit\n", __func__);
 }
 
@@ -1951,7 +2200,6 @@ atapi_ioreq_cb(struct blockif_req *br, int err)
 	struct ahci_cmd_hdr *hdr;
 	struct ahci_ioreq *aior;
 	struct ahci_port *p;
-	struct pci_ahci_vdev *ahci_dev;
 	uint8_t *cfis;
 	uint32_t tfd;
 	int slot;
@@ -1962,10 +2210,9 @@ atapi_ioreq_cb(struct blockif_req *br, int err)
 	p = aior->io_pr;
 	cfis = aior->cfis;
 	slot = aior->slot;
-	ahci_dev = p->ahci_dev;
 	hdr = (struct ahci_cmd_hdr *)(p->cmd_lst + aior->slot * AHCI_CL_SIZE);
 
-	pthread_mutex_lock(&ahci_dev->mtx);
+	pthread_mutex_lock(&p->mtx);
 
 	/*
 	 * Delete the blockif request from the busy list
@@ -1977,8 +2224,10 @@ atapi_ioreq_cb(struct blockif_req *br, int err)
 	 */
 	STAILQ_INSERT_TAIL(&p->iofhd, aior, io_flist);
 
-	if (!err)
+	if (!err) {
 		hdr->prdbc = aior->done;
+		ahci_dirty_ioreq(p, aior, hdr);
+	}
 
 	if (!err && aior->more) {
 		atapi_read(p, slot, cfis, aior->done);
@@ -2003,7 +2252,7 @@ atapi_ioreq_cb(struct blockif_req *br, int err)
 	ahci_check_stopped(p);
 	ahci_handle_port(p);
 out:
-	pthread_mutex_unlock(&ahci_dev->mtx);
+	pthread_mutex_unlock(&p->mtx);
 	DPRINTF("%s exit\n", __func__);
 }
 
@@ -2026,6 +2275,7 @@ pci_ahci_ioreq_init(struct ahci_port *pr)
 	for (i = 0; i < pr->ioqsz; i++) {
 		vr = &pr->ioreq[i];
 		vr->io_pr = pr;
+		vr->io_req.iov = vr->io_req.iov_buf;
 		if (!pr->atapi)
 			vr->io_req.callback = ata_ioreq_cb;
 		else
@@ -2038,16 +2288,12 @@ pci_ahci_ioreq_init(struct ahci_port *pr)
 }
 
 static void
-pci_ahci_port_write(struct pci_ahci_vdev *ahci_dev, uint64_t offset,
-		    uint64_t value)
+pci_ahci_port_write(struct ahci_port *p, uint64_t offset, uint64_t value)
 {
-	int port = (offset - AHCI_OFFSET) / AHCI_STEP;
-
-	offset = (offset - AHCI_OFFSET) % AHCI_STEP;
-	struct ahci_port *p = &ahci_dev->port[port];
+	struct pci_ahci_vdev *ahci_dev = p->ahci_dev;
 
 	DPRINTF("pci_ahci_port %d: write offset 0x%"PRIx64" value "
-			"0x%"PRIx64"\n", port, offset, value);
+			"0x%"PRIx64"\n", p->port, offset, value);
 
 	switch (offset) {
 	case AHCI_P_CLB:
@@ -2111,7 +2357,7 @@ pci_ahci_port_write(struct pci_ahci_vdev *ahci_dev, uint64_t offset,
 		if (value & AHCI_P_CMD_ICC_MASK)
 			p->cmd &= ~AHCI_P_CMD_ICC_MASK;
 
-		ahci_handle_port(p);
+		ahci_kick_port(p);
 		break;
 	}
 	case AHCI_P_TFD:
@@ -2135,7 +2381,7 @@ pci_ahci_port_write(struct pci_ahci_vdev *ahci_dev, uint64_t offset,
 		break;
 	case AHCI_P_CI:
 		p->ci |= value;
-		ahci_handle_port(p);
+		ahci_kick_port(p);
 		break;
 	case AHCI_P_SNTF:
 	case AHCI_P_FBS:
@@ -2160,10 +2406,7 @@ pci_ahci_host_write(struct pci_ahci_vdev *ahci_dev, uint64_t offset,
 				offset);
 		break;
 	case AHCI_GHC:
-		if (value & AHCI_GHC_HR) {
-			ahci_reset(ahci_dev);
-			break;
-		}
+		/* GHC.HR is handled by pci_ahci_write() */
 		if (value & AHCI_GHC_IE)
 			ahci_dev->ghc |= AHCI_GHC_IE;
 		else
@@ -2174,6 +2417,20 @@ pci_ahci_host_write(struct pci_ahci_vdev *ahci_dev, uint64_t offset,
 		ahci_dev->is &= ~value;
 		ahci_generate_intr(ahci_dev, value);
 		break;
+	case AHCI_CCCC:
+		if ((ahci_dev->cap & AHCI_CAP_CCCS) == 0)
+			break;
+		/* INT is ours */
+		ahci_dev->ccc_ctl = (ahci_dev->ccc_ctl & AHCI_CCCC_INT_MASK) |
+		    (value & (AHCI_CCCC_TV_MASK | AHCI_CCCC_CC_MASK |
+			      AHCI_CCCC_EN));
+		if ((value & AHCI_CCCC_EN) == 0)
+			ahci_ccc_intr_cancel(ahci_dev);
+		break;
+	case AHCI_CCCP:
+		if (ahci_dev->cap & AHCI_CAP_CCCS)
+			ahci_dev->ccc_pts = value & ahci_dev->pi;
+		break;
 	default:
 		break;
 	}
@@ -2184,21 +2441,29 @@ pci_ahci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		int baridx, uint64_t offset, int size, uint64_t value)
 {
 	struct pci_ahci_vdev *ahci_dev = dev->arg;
+	struct ahci_port *p;
 
 	assert(baridx == 5);
 	assert((offset % 4) == 0 && size == 4);
 
-	pthread_mutex_lock(&ahci_dev->mtx);
-
-	if (offset < AHCI_OFFSET)
+	if (offset < AHCI_OFFSET) {
+		/* a reset needs the port locks, which come first */
+		if (offset == AHCI_GHC && (value & AHCI_GHC_HR)) {
+			ahci_reset(ahci_dev);
+			return;
+		}
+		pthread_mutex_lock(&ahci_dev->mtx);
 		pci_ahci_host_write(ahci_dev, offset, value);
-	else if (offset < AHCI_OFFSET + ahci_dev->ports * AHCI_STEP)
-		pci_ahci_port_write(ahci_dev, offset, value);
-	else
+		pthread_mutex_unlock(&ahci_dev->mtx);
+	} else if (offset < AHCI_OFFSET + ahci_dev->ports * AHCI_STEP) {
+		p = &ahci_dev->port[(offset - AHCI_OFFSET) / AHCI_STEP];
+		pthread_mutex_lock(&p->mtx);
+		pci_ahci_port_write(p, (offset - AHCI_OFFSET) % AHCI_STEP,
+				    value);
+		pthread_mutex_unlock(&p->mtx);
+	} else
 		WPRINTF("pci_ahci: unknown i/o write offset 0x%"PRIx64"\n",
 			offset);
-
-	pthread_mutex_unlock(&ahci_dev->mtx);
 }
 
 static uint64_t
@@ -2283,6 +2548,7 @@ pci_ahci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev, int baridx,
 	      uint64_t regoff, int size)
 {
 	struct pci_ahci_vdev *ahci_dev = dev->arg;
+	struct ahci_port *p;
 	uint64_t offset;
 	uint32_t value;
 
@@ -2290,22 +2556,23 @@ pci_ahci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev, int baridx,
 	assert(size == 1 || size == 2 || size == 4);
 	assert((regoff & (size - 1)) == 0);
 
-	pthread_mutex_lock(&ahci_dev->mtx);
-
 	offset = regoff & ~0x3;	    /* round down to a multiple of 4 bytes */
-	if (offset < AHCI_OFFSET)
+	if (offset < AHCI_OFFSET) {
+		pthread_mutex_lock(&ahci_dev->mtx);
 		value = pci_ahci_host_read(ahci_dev, offset);
-	else if (offset < AHCI_OFFSET + ahci_dev->ports * AHCI_STEP)
+		pthread_mutex_unlock(&ahci_dev->mtx);
+	} else if (offset < AHCI_OFFSET + ahci_dev->ports * AHCI_STEP) {
+		p = &ahci_dev->port[(offset - AHCI_OFFSET) / AHCI_STEP];
+		pthread_mutex_lock(&p->mtx);
 		value = pci_ahci_port_read(ahci_dev, offset);
-	else {
+		pthread_mutex_unlock(&p->mtx);
+	} else {
 		value = 0;
 		WPRINTF("pci_ahci: unknown i/o read offset 0x%"PRIx64"\n",
 		    regoff);
 	}
 	value >>= 8 * (regoff & 0x3);
 
-	pthread_mutex_unlock(&ahci_dev->mtx);
-
 	return value;
 }
 
@@ -2338,6 +2605,13 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 	ahci_dev->pi = 0;
 	slots = 32;
 
+	for (p = 0; p < MAX_PORTS; p++) {
+		ahci_dev->port[p].ahci_dev = ahci_dev;
+		ahci_dev->port[p].port = p;
+		pthread_mutex_init(&ahci_dev->port[p].mtx, NULL);
+		pthread_cond_init(&ahci_dev->port[p].cond, NULL);
+	}
+
 	for (p = 0; p < MAX_PORTS && opts != NULL; p++, opts = next) {
 		/* Identify and cut off type of present port. */
 		if (strncmp(opts, "hd:", 3) == 0) {
@@ -2374,8 +2648,6 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 			goto open_fail;
 		}
 		ahci_dev->port[p].bctx = bctxt;
-		ahci_dev->port[p].ahci_dev = ahci_dev;
-		ahci_dev->port[p].port = p;
 		ahci_dev->port[p].atapi = atapi;
 
 		/*
@@ -2411,6 +2683,11 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 		AHCI_CAP_PMD | AHCI_CAP_SSC | AHCI_CAP_PSC |
 		(slots << AHCI_CAP_NCS_SHIFT) | AHCI_CAP_SXS |
 		(ahci_dev->ports - 1);
+	/* CCC needs a free IS bit above the ports */
+	if (ahci_dev->ports < MAX_PORTS &&
+	    acrn_timer_init(&ahci_dev->ccc_timer, ahci_ccc_timeout,
+			    ahci_dev) == 0)
+		ahci_dev->cap |= AHCI_CAP_CCCS;
 
 	ahci_dev->vs = 0x10300;
 	ahci_dev->cap2 = AHCI_CAP2_APST;
@@ -2429,6 +2706,24 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 
 	pci_lintr_request(dev);
 
+	/* a worker per backed port; the others never get commands */
+	for (p = 0; p < ahci_dev->ports; p++) {
+		struct ahci_port *pr = &ahci_dev->port[p];
+		char tname[MAXCOMLEN + 1];
+
+		if (pr->bctx == NULL)
+			continue;
+		pr->worker = 1;
+		if (pthread_create(&pr->tid, NULL, ahci_port_thr, pr) != 0) {
+			WPRINTF("%s: no worker for port %d\n", __func__, p);
+			pr->worker = 0;
+			continue;
+		}
+		snprintf(tname, sizeof(tname), "ahci-%u:%u.%u", dev->slot,
+			 dev->func, (uint8_t)p);
+		pthread_setname_np(pr->tid, tname);
+	}
+
 open_fail:
 	if (ret) {
 		for (p = 0; p < ahci_dev->ports; p++) {
@@ -2441,6 +2736,43 @@ open_fail:
 	return ret;
 }
 
+static void
+pci_ahci_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct pci_ahci_vdev *ahci_dev = dev->arg;
+	struct ahci_port *p;
+	int i, j;
+
+	if (ahci_dev == NULL)
+		return;
+
+	/* completions on the ports below mustn't re-arm it */
+	if (ahci_dev->cap & AHCI_CAP_CCCS) {
+		pthread_mutex_lock(&ahci_dev->mtx);
+		ahci_dev->ccc_ctl &= ~AHCI_CCCC_EN;
+		pthread_mutex_unlock(&ahci_dev->mtx);
+		acrn_timer_deinit(&ahci_dev->ccc_timer);
+	}
+	for (i = 0; i < ahci_dev->ports; i++) {
+		p = &ahci_dev->port[i];
+		if (p->worker) {
+			pthread_mutex_lock(&p->mtx);
+			p->worker = 0;
+			pthread_cond_signal(&p->cond);
+			pthread_mutex_unlock(&p->mtx);
+			pthread_join(p->tid, NULL);
+		}
+		if (p->bctx == NULL)
+			continue;
+		blockif_close(p->bctx);
+		for (j = 0; j < p->ioqsz; j++)
+			free(p->ioreq[j].ext_iov);
+		free(p->ioreq);
+	}
+	free(ahci_dev);
+	dev->arg = NULL;
+}
+
 static int
 pci_ahci_hd_init(struct vmctx *ctx, struct pci_vdev *pi, char *opts)
 {
@@ -2459,6 +2791,7 @@ pci_ahci_atapi_init(struct vmctx *ctx, struct pci_vdev *pi, char *opts)
 struct pci_vdev_ops pci_ops_ahci = {
 	.class_name	= "ahci",
 	.vdev_init	= pci_ahci_hd_init,
+	.vdev_deinit	= pci_ahci_deinit,
 	.vdev_barwrite	= pci_ahci_write,
 	.vdev_barread	= pci_ahci_read
 };
@@ -2467,6 +2800,7 @@ DEFINE_PCI_DEVTYPE(pci_ops_ahci);
 struct pci_vdev_ops pci_ops_ahci_hd = {
 	.class_name	= "ahci-hd",
 	.vdev_init	= pci_ahci_hd_init,
+	.vdev_deinit	= pci_ahci_deinit,
 	.vdev_barwrite	= pci_ahci_write,
 	.vdev_barread	= pci_ahci_read
 };
@@ -2475,6 +2809,7 @@ DEFINE_PCI_DEVTYPE(pci_ops_ahci_hd);
 struct pci_vdev_ops pci_ops_ahci_cd = {
 	.class_name	= "ahci-cd",
 	.vdev_init	= pci_ahci_atapi_init,
+	.vdev_deinit	= pci_ahci_deinit,
 	.vdev_barwrite	= pci_ahci_write,
 	.vdev_barread	= pci_ahci_read
 };
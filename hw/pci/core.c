@@ -48,6 +48,8 @@
 #include "pci_core.h"
 #include "irq.h"
 #include "lpc.h"
+#include "monitor.h"
+#include "snapshot.h"
 
 #define CONF1_ADDR_PORT    0x0cf8
 #define CONF1_DATA_PORT    0x0cfc
@@ -63,6 +65,9 @@ struct funcinfo {
 	char	*fi_param;
 	char	*fi_param_saved; /* save for reboot */
 	struct pci_vdev *fi_devi;
+	struct pci_vdev *fi_prep;	/* allocated and being prepared */
+	int	fi_prep_err;
+	pthread_t fi_prep_tid;
 };
 
 struct intxinfo {
@@ -106,6 +111,8 @@ SYSRES_MEM(PCI_EMUL_ECFG_BASE, PCI_EMUL_ECFG_SIZE);
 static struct pci_vdev_ops *pci_emul_finddev(char *name);
 static void pci_lintr_route(struct pci_vdev *dev);
 static void pci_lintr_update(struct pci_vdev *dev);
+static bool pci_lintr_hold(struct pci_vdev *dev);
+static void pci_lintr_release(struct pci_vdev *dev);
 static void pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot,
 		      int func, int coff, int bytes, uint32_t *val);
 
@@ -246,6 +253,37 @@ pci_valid_pba_offset(struct pci_vdev *dev, uint64_t offset)
 	return 1;
 }
 
+static bool
+pci_msix_masked(struct pci_vdev *dev, int index)
+{
+	return dev->msix.function_mask ||
+	       (dev->msix.table[index].vector_control &
+		PCIM_MSIX_VCTRL_MASK) != 0;
+}
+
+/*
+ * Deliver a vector that is pending and no longer masked.  Clearing the
+ * pending bit atomically makes exactly one of unmask and a racing
+ * pci_generate_msix() send it.
+ */
+static void
+pci_msix_unmasked(struct pci_vdev *dev, int index)
+{
+	struct msix_table_entry *mte;
+	uint64_t bit, old;
+
+	if (dev->msix.pba == NULL || pci_msix_masked(dev, index))
+		return;
+
+	bit = 1UL << (index % 64);
+	old = __atomic_fetch_and(&dev->msix.pba[index / 64], ~bit,
+				 __ATOMIC_SEQ_CST);
+	if (old & bit) {
+		mte = &dev->msix.table[index];
+		vm_lapic_msi(dev->vmctx, mte->addr, mte->msg_data);
+	}
+}
+
 int
 pci_emul_msix_twrite(struct pci_vdev *dev, uint64_t offset, int size,
 		     uint64_t value)
@@ -279,6 +317,12 @@ pci_emul_msix_twrite(struct pci_vdev *dev, uint64_t offset, int size,
 	else
 		*((uint64_t *)dest) = value;
 
+	/* an unmask delivers what was held back while masked */
+	if (msix_entry_offset + size > 12) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		pci_msix_unmasked(dev, tab_index);
+	}
+
 	return 0;
 }
 
@@ -318,8 +362,20 @@ pci_emul_msix_tread(struct pci_vdev *dev, uint64_t offset, int size)
 		else
 			retval = *((uint64_t *)dest);
 	} else if (pci_valid_pba_offset(dev, offset)) {
-		/* return 0 for PBA access */
 		retval = 0;
+		if (dev->msix.pba != NULL) {
+			dest = (char *)dev->msix.pba +
+				(offset - dev->msix.pba_offset);
+			if (size == 1)
+				retval = __atomic_load_n((uint8_t *)dest,
+							 __ATOMIC_RELAXED);
+			else if (size == 4)
+				retval = __atomic_load_n((uint32_t *)dest,
+							 __ATOMIC_RELAXED);
+			else
+				retval = __atomic_load_n((uint64_t *)dest,
+							 __ATOMIC_RELAXED);
+		}
 	}
 
 	return retval;
@@ -347,26 +403,30 @@ static int
 pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		    uint32_t *eax, void *arg)
 {
-	struct pci_vdev *pdi = arg;
+	struct pci_iobar *iob = arg;
+	struct pci_vdev *pdi = iob->dev;
 	struct pci_vdev_ops *ops = pdi->dev_ops;
+	struct pcibar *bar = &pdi->bar[iob->idx];
 	uint64_t offset;
-	int i;
+	bool held;
 
-	for (i = 0; i <= PCI_BARMAX; i++) {
-		if (pdi->bar[i].type == PCIBAR_IO &&
-		    port >= pdi->bar[i].addr &&
-		    port + bytes <= pdi->bar[i].addr + pdi->bar[i].size) {
-			offset = port - pdi->bar[i].addr;
-			if (in)
-				*eax = (*ops->vdev_barread)(ctx, vcpu, pdi, i,
-							 offset, bytes);
-			else
-				(*ops->vdev_barwrite)(ctx, vcpu, pdi, i, offset,
-						   bytes, *eax);
-			return 0;
-		}
-	}
-	return -1;
+	assert(bar->type == PCIBAR_IO);
+
+	/* an access straddling the end of the BAR */
+	if (port + bytes > bar->addr + bar->size)
+		return -1;
+
+	offset = port - bar->addr;
+	held = pci_lintr_hold(pdi);
+	if (in)
+		*eax = (*ops->vdev_barread)(ctx, vcpu, pdi, iob->idx,
+					 offset, bytes);
+	else
+		(*ops->vdev_barwrite)(ctx, vcpu, pdi, iob->idx, offset,
+				   bytes, *eax);
+	if (held)
+		pci_lintr_release(pdi);
+	return 0;
 }
 
 static int
@@ -377,6 +437,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 	struct pci_vdev_ops *ops = pdi->dev_ops;
 	uint64_t offset;
 	int bidx = (int) arg2;
+	bool held;
 
 	assert(bidx <= PCI_BARMAX);
 	assert(pdi->bar[bidx].type == PCIBAR_MEM32 ||
@@ -386,8 +447,12 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 
 	offset = addr - pdi->bar[bidx].addr;
 
+	held = pci_lintr_hold(pdi);
 	if (dir == MEM_F_WRITE) {
-		if (size == 8) {
+		if (size == 8 && ops->vdev_barwrite64) {
+			(*ops->vdev_barwrite64)(ctx, vcpu, pdi, bidx, offset,
+					     *val);
+		} else if (size == 8) {
 			(*ops->vdev_barwrite)(ctx, vcpu, pdi, bidx, offset,
 					   4, *val & 0xffffffff);
 			(*ops->vdev_barwrite)(ctx, vcpu, pdi, bidx, offset + 4,
@@ -397,7 +462,10 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 					   size, *val);
 		}
 	} else {
-		if (size == 8) {
+		if (size == 8 && ops->vdev_barread64) {
+			*val = (*ops->vdev_barread64)(ctx, vcpu, pdi, bidx,
+						   offset);
+		} else if (size == 8) {
 			*val = (*ops->vdev_barread)(ctx, vcpu, pdi, bidx,
 						 offset, 4);
 			*val |= (*ops->vdev_barread)(ctx, vcpu, pdi, bidx,
@@ -407,6 +475,8 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 						 offset, size);
 		}
 	}
+	if (held)
+		pci_lintr_release(pdi);
 
 	return 0;
 }
@@ -457,10 +527,12 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 		if (registration) {
 			iop.flags = IOPORT_F_INOUT;
 			iop.handler = pci_emul_io_handler;
-			iop.arg = dev;
-			error = register_inout(&iop);
+			dev->iobar[idx].dev = dev;
+			dev->iobar[idx].idx = idx;
+			iop.arg = &dev->iobar[idx];
+			error = register_inout(dev->vmctx, &iop);
 		} else
-			error = unregister_inout(&iop);
+			error = unregister_inout(dev->vmctx, &iop);
 		break;
 	case PCIBAR_MEM32:
 	case PCIBAR_MEM64:
@@ -527,6 +599,7 @@ memen(struct pci_vdev *dev)
 static void
 update_bar_address(struct  pci_vdev *dev, uint64_t addr, int idx, int type)
 {
+	uint64_t orig_addr = dev->bar[idx].addr;
 	int decode;
 
 	if (dev->bar[idx].type == PCIBAR_IO)
@@ -556,6 +629,11 @@ update_bar_address(struct  pci_vdev *dev, uint64_t addr, int idx, int type)
 
 	if (decode)
 		register_bar(dev, idx);
+
+	if (dev->dev_ops->vdev_update_bar_map &&
+	    dev->bar[idx].addr != orig_addr)
+		(*dev->dev_ops->vdev_update_bar_map)(dev->vmctx, dev, idx,
+						     orig_addr);
 }
 
 int
@@ -654,7 +732,7 @@ pci_emul_alloc_pbar(struct pci_vdev *pdi, int idx, uint64_t hostbase,
 }
 
 #define	CAP_START_OFFSET	0x40
-static int
+int
 pci_emul_add_capability(struct pci_vdev *dev, u_char *capdata, int caplen)
 {
 	int i, capoff, reallen;
@@ -707,17 +785,16 @@ pci_emul_finddev(char *name)
 	return NULL;
 }
 
-static int
-pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
-	      int func, struct funcinfo *fi)
+static struct pci_vdev *
+pci_emul_alloc(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
+	       int func, struct funcinfo *fi)
 {
 	struct pci_vdev *pdi;
-	int err;
 
 	pdi = calloc(1, sizeof(struct pci_vdev));
 	if (!pdi) {
 		fprintf(stderr, "%s: calloc returns NULL\n", __func__);
-		return -1;
+		return NULL;
 	}
 
 	pdi->vmctx = ctx;
@@ -729,8 +806,12 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	pdi->lintr.state = IDLE;
 	pdi->lintr.pirq_pin = 0;
 	pdi->lintr.ioapic_irq = 0;
+	pdi->lintr.line = 0;
+	pdi->lintr.hold = 0;
 	pdi->dev_ops = ops;
 	snprintf(pdi->name, PI_NAMESZ, "%s-pci-%d", ops->class_name, slot);
+	/* decided once here rather than on every config access */
+	pdi->ext_cfg = !strcmp("passthru", ops->class_name);
 
 	/* Disable legacy interrupts */
 	pci_set_cfgdata8(pdi, PCIR_INTLINE, 255);
@@ -743,7 +824,135 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		fi->fi_param = strdup(fi->fi_param_saved);
 	else
 		fi->fi_param = NULL;
-	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
+	return pdi;
+}
+
+static void
+pci_emul_unprepare(struct vmctx *ctx, struct pci_vdev *pdi)
+{
+	if (pdi->prep != NULL && pdi->dev_ops->vdev_unprepare)
+		(*pdi->dev_ops->vdev_unprepare)(ctx, pdi);
+	pdi->prep = NULL;
+}
+
+static void *
+pci_emul_prepare_thread(void *arg)
+{
+	struct funcinfo *fi = arg;
+	struct pci_vdev *pdi = fi->fi_prep;
+
+	fi->fi_prep_err = (*pdi->dev_ops->vdev_prepare)(pdi->vmctx, pdi,
+							fi->fi_param);
+	return NULL;
+}
+
+/*
+ * Start the vdev_prepare of every device that has one, each on its own
+ * thread, and wait for all of them.  Nothing here allocates guest
+ * resources, so the later serialized pass still places BARs in slot
+ * order whatever order the backends finish in.
+ */
+static int
+pci_emul_prepare_all(struct vmctx *ctx)
+{
+	struct pci_vdev_ops *ops;
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		if ((bi = pci_businfo[bus]) == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				if (fi->fi_name == NULL)
+					continue;
+				ops = pci_emul_finddev(fi->fi_name);
+				assert(ops != NULL);
+				if (ops->vdev_prepare == NULL)
+					continue;
+				fi->fi_prep = pci_emul_alloc(ctx, ops, bus,
+							     slot, func, fi);
+				if (fi->fi_prep == NULL)
+					return -1;
+				fi->fi_prep_err = 0;
+				if (pthread_create(&fi->fi_prep_tid, NULL,
+				    pci_emul_prepare_thread, fi) != 0) {
+					/* no thread; do it in line */
+					pci_emul_prepare_thread(fi);
+					fi->fi_prep_tid = 0;
+				}
+			}
+		}
+	}
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		if ((bi = pci_businfo[bus]) == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				if (fi->fi_prep == NULL || fi->fi_prep_tid == 0)
+					continue;
+				pthread_join(fi->fi_prep_tid, NULL);
+				fi->fi_prep_tid = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Release prepared devices that never reached vdev_init, when an
+ * earlier one failed.
+ */
+static void
+pci_emul_drop_prepared(struct vmctx *ctx)
+{
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		if ((bi = pci_businfo[bus]) == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				if (fi->fi_prep == NULL)
+					continue;
+				if (fi->fi_prep_tid != 0)
+					pthread_join(fi->fi_prep_tid, NULL);
+				fi->fi_prep_tid = 0;
+				pci_emul_unprepare(ctx, fi->fi_prep);
+				free(fi->fi_prep);
+				fi->fi_prep = NULL;
+			}
+		}
+	}
+}
+
+static int
+pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
+	      int func, struct funcinfo *fi)
+{
+	struct pci_vdev *pdi;
+	int err;
+
+	pdi = fi->fi_prep;
+	fi->fi_prep = NULL;
+	if (pdi == NULL) {
+		pdi = pci_emul_alloc(ctx, ops, bus, slot, func, fi);
+		if (pdi == NULL)
+			return -1;
+		err = 0;
+	} else
+		err = fi->fi_prep_err;
+
+	if (err == 0)
+		err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
+	pci_emul_unprepare(ctx, pdi);
 	if (err == 0)
 		fi->fi_devi = pdi;
 	else
@@ -756,6 +965,9 @@ static void
 pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		int func, struct funcinfo *fi)
 {
+	/* counters a device registered under its pci_vdev */
+	if (fi->fi_devi)
+		monitor_unregister(fi->fi_devi);
 	if (ops->vdev_deinit)
 		(*ops->vdev_deinit)(ctx, fi->fi_devi, fi->fi_param);
 	if (fi->fi_param)
@@ -828,6 +1040,9 @@ pci_msix_table_init(struct pci_vdev *dev, int table_entries)
 
 	assert(dev->msix.table != NULL);
 
+	dev->msix.pba = calloc(1, PBA_SIZE(table_entries));
+	assert(dev->msix.pba != NULL);
+
 	/* set mask bit of vector control register */
 	for (i = 0; i < table_entries; i++)
 		dev->msix.table[i].vector_control |= PCIM_MSIX_VCTRL_MASK;
@@ -871,7 +1086,7 @@ msixcap_cfgwrite(struct pci_vdev *dev, int capoff, int offset,
 		 int bytes, uint32_t val)
 {
 	uint16_t msgctrl, rwmask;
-	int off;
+	int off, was_masked, i;
 
 	off = offset - capoff;
 	/* Message Control Register */
@@ -883,9 +1098,17 @@ msixcap_cfgwrite(struct pci_vdev *dev, int capoff, int offset,
 		msgctrl |= val & rwmask;
 		val = msgctrl;
 
+		was_masked = dev->msix.function_mask;
 		dev->msix.enabled = val & PCIM_MSIXCTRL_MSIX_ENABLE;
 		dev->msix.function_mask = val & PCIM_MSIXCTRL_FUNCTION_MASK;
 		pci_lintr_update(dev);
+
+		if (was_masked && !dev->msix.function_mask &&
+		    dev->msix.pba != NULL) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			for (i = 0; i < dev->msix.table_count; i++)
+				pci_msix_unmasked(dev, i);
+		}
 	}
 
 	CFGWRITE(dev, offset, val, bytes);
@@ -1086,6 +1309,11 @@ init_pci(struct vmctx *ctx)
 	pci_emul_membase32 = vm_get_lowmem_limit(ctx);
 	pci_emul_membase64 = PCI_EMUL_MEMBASE64;
 
+	if (pci_emul_prepare_all(ctx) != 0) {
+		pci_emul_drop_prepared(ctx);
+		return -1;
+	}
+
 	for (bus = 0; bus < MAXBUSES; bus++) {
 		bi = pci_businfo[bus];
 		if (bi == NULL)
@@ -1108,8 +1336,10 @@ init_pci(struct vmctx *ctx)
 				assert(ops != NULL);
 				error = pci_emul_init(ctx, ops, bus, slot,
 				    func, fi);
-				if (error)
+				if (error) {
+					pci_emul_drop_prepared(ctx);
 					return error;
+				}
 			}
 		}
 
@@ -1225,6 +1455,121 @@ deinit_pci(struct vmctx *ctx)
 	}
 }
 
+/*
+ * A device's snapshot record: the header below, then its config space
+ * header, then whatever its vdev_save wrote. Records are in the order
+ * deinit_pci() walks the devices, and restore expects exactly the same
+ * devices in the same slots.
+ */
+struct pci_snapshot_dev {
+	uint8_t		bus, slot, func;
+	uint8_t		pad;
+	uint32_t	len;		/* of what follows */
+	char		name[PI_NAMESZ];	/* emulation, as for -s */
+};
+
+#define	PCI_SNAPSHOT_CFGSZ	0x40	/* the type 0/1 header */
+
+int
+pci_snapshot_save(struct vmctx *ctx, struct vm_snapshot *s)
+{
+	struct pci_snapshot_dev rec;
+	struct pci_vdev *dev;
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func;
+	size_t start;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				dev = fi->fi_devi;
+				if (fi->fi_name == NULL || dev == NULL)
+					continue;
+
+				memset(&rec, 0, sizeof(rec));
+				rec.bus = bus;
+				rec.slot = slot;
+				rec.func = func;
+				strncpy(rec.name, fi->fi_name,
+					sizeof(rec.name) - 1);
+				start = s->len;
+				if (snapshot_write(s, &rec, sizeof(rec)) ||
+				    snapshot_write(s, dev->cfgdata,
+						   PCI_SNAPSHOT_CFGSZ))
+					return -1;
+				if (dev->dev_ops->vdev_save != NULL &&
+				    (*dev->dev_ops->vdev_save)(ctx, dev, s))
+					return -1;
+				rec.len = s->len - start - sizeof(rec);
+				memcpy(s->buf + start, &rec, sizeof(rec));
+			}
+		}
+	}
+	return 0;
+}
+
+int
+pci_snapshot_restore(struct vmctx *ctx, struct vm_snapshot *s)
+{
+	struct pci_snapshot_dev rec;
+	struct vm_snapshot sub;
+	uint8_t cfg[PCI_SNAPSHOT_CFGSZ];
+	struct pci_vdev *dev;
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				dev = fi->fi_devi;
+				if (fi->fi_name == NULL || dev == NULL)
+					continue;
+
+				if (snapshot_read(s, &rec, sizeof(rec)) ||
+				    rec.bus != bus || rec.slot != slot ||
+				    rec.func != func ||
+				    strncmp(rec.name, fi->fi_name,
+					    sizeof(rec.name) - 1) ||
+				    rec.len > s->len - s->off)
+					goto mismatch;
+
+				sub.buf = s->buf + s->off;
+				sub.len = sub.size = rec.len;
+				sub.off = 0;
+				s->off += rec.len;
+				if (snapshot_read(&sub, cfg, sizeof(cfg)) ||
+				    memcmp(cfg, dev->cfgdata, sizeof(cfg)))
+					goto mismatch;
+				if (dev->dev_ops->vdev_restore != NULL &&
+				    (*dev->dev_ops->vdev_restore)(ctx, dev,
+								  &sub))
+					goto mismatch;
+			}
+		}
+	}
+	if (s->off == s->len)
+		return 0;
+	fprintf(stderr, "snapshot: has devices that are not configured\n");
+	return -1;
+
+mismatch:
+	fprintf(stderr, "snapshot: no matching state for %d:%d.%d %s\n",
+		bus, slot, func, fi->fi_name);
+	return -1;
+}
+
 static void
 pci_apic_prt_entry(int bus, int slot, int pin, int pirq_pin, int ioapic_irq,
 		   void *arg)
@@ -1468,17 +1813,23 @@ pci_generate_msix(struct pci_vdev *dev, int index)
 	if (!pci_msix_enabled(dev))
 		return;
 
-	if (dev->msix.function_mask)
-		return;
-
 	if (index >= dev->msix.table_count)
 		return;
 
 	mte = &dev->msix.table[index];
-	if ((mte->vector_control & PCIM_MSIX_VCTRL_MASK) == 0) {
-		/* XXX Set PBA bit if interrupt is disabled */
+	if (!pci_msix_masked(dev, index)) {
 		vm_lapic_msi(dev->vmctx, mte->addr, mte->msg_data);
+		return;
 	}
+
+	/* hold it in the PBA until the guest unmasks the vector */
+	if (dev->msix.pba == NULL)
+		return;
+	__atomic_fetch_or(&dev->msix.pba[index / 64], 1UL << (index % 64),
+			  __ATOMIC_SEQ_CST);
+
+	/* it may have been unmasked before the bit was visible */
+	pci_msix_unmasked(dev, index);
 }
 
 void
@@ -1563,6 +1914,28 @@ pci_lintr_route(struct pci_vdev *dev)
 	pci_set_cfgdata8(dev, PCIR_INTLINE, pirq_irq(ii->ii_pirq_pin));
 }
 
+/*
+ * Drive the line to the level the state asks for, unless it is there
+ * already or a BAR access in progress defers it to its end, so a
+ * deassert/assert pair within one access costs nothing.
+ * Called with lintr.lock held.
+ */
+static void
+pci_lintr_sync(struct pci_vdev *dev)
+{
+	bool level;
+
+	level = dev->lintr.state == ASSERTED;
+	if (dev->lintr.hold > 0 || dev->lintr.line == level)
+		return;
+
+	dev->lintr.line = level;
+	if (level)
+		pci_irq_assert(dev);
+	else
+		pci_irq_deassert(dev);
+}
+
 void
 pci_lintr_assert(struct pci_vdev *dev)
 {
@@ -1570,12 +1943,12 @@ pci_lintr_assert(struct pci_vdev *dev)
 
 	pthread_mutex_lock(&dev->lintr.lock);
 	if (dev->lintr.state == IDLE) {
-		if (pci_lintr_permitted(dev)) {
+		if (pci_lintr_permitted(dev))
 			dev->lintr.state = ASSERTED;
-			pci_irq_assert(dev);
-		} else
+		else
 			dev->lintr.state = PENDING;
 	}
+	pci_lintr_sync(dev);
 	pthread_mutex_unlock(&dev->lintr.lock);
 }
 
@@ -1585,11 +1958,8 @@ pci_lintr_deassert(struct pci_vdev *dev)
 	assert(dev->lintr.pin > 0);
 
 	pthread_mutex_lock(&dev->lintr.lock);
-	if (dev->lintr.state == ASSERTED) {
-		dev->lintr.state = IDLE;
-		pci_irq_deassert(dev);
-	} else if (dev->lintr.state == PENDING)
-		dev->lintr.state = IDLE;
+	dev->lintr.state = IDLE;
+	pci_lintr_sync(dev);
 	pthread_mutex_unlock(&dev->lintr.lock);
 }
 
@@ -1597,13 +1967,33 @@ static void
 pci_lintr_update(struct pci_vdev *dev)
 {
 	pthread_mutex_lock(&dev->lintr.lock);
-	if (dev->lintr.state == ASSERTED && !pci_lintr_permitted(dev)) {
-		pci_irq_deassert(dev);
+	if (dev->lintr.state == ASSERTED && !pci_lintr_permitted(dev))
 		dev->lintr.state = PENDING;
-	} else if (dev->lintr.state == PENDING && pci_lintr_permitted(dev)) {
+	else if (dev->lintr.state == PENDING && pci_lintr_permitted(dev))
 		dev->lintr.state = ASSERTED;
-		pci_irq_assert(dev);
-	}
+	pci_lintr_sync(dev);
+	pthread_mutex_unlock(&dev->lintr.lock);
+}
+
+/* INTx changes made during a BAR access are flushed when it ends */
+static bool
+pci_lintr_hold(struct pci_vdev *dev)
+{
+	if (dev->lintr.pin <= 0 || dev->msi.enabled || dev->msix.enabled)
+		return false;
+
+	pthread_mutex_lock(&dev->lintr.lock);
+	dev->lintr.hold++;
+	pthread_mutex_unlock(&dev->lintr.lock);
+	return true;
+}
+
+static void
+pci_lintr_release(struct pci_vdev *dev)
+{
+	pthread_mutex_lock(&dev->lintr.lock);
+	if (--dev->lintr.hold == 0)
+		pci_lintr_sync(dev);
 	pthread_mutex_unlock(&dev->lintr.lock);
 }
 
@@ -1804,7 +2194,7 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 	 * For passthru device, extended config space is supported.
 	 * Access to extended config space is implemented via libpciaccess.
 	 */
-	if (strcmp("passthru", ops->class_name)) {
+	if (!dev->ext_cfg) {
 		if (coff >= PCI_REGMAX + 1) {
 			if (in) {
 				*eax = 0xffffffff;
@@ -33,6 +33,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "types.h"
 #include "acpi.h"
@@ -69,6 +70,16 @@ static struct pirq {
 static u_char irq_counts[16];
 static int pirq_cold = 1;
 
+/*
+ * INTx sources asserting each I/O APIC pin.  A pin shared by several
+ * functions only changes level for the first assert and the last
+ * deassert; the lock keeps those ioctls in the order of the counts.
+ */
+#define	IOAPIC_MAX_PINS	256
+
+static int ioapic_counts[IOAPIC_MAX_PINS];
+static pthread_mutex_t ioapic_counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Returns true if this pin is enabled with a valid IRQ.  Setting the
  * register to a reserved IRQ causes interrupts to not be asserted as
@@ -147,13 +158,34 @@ pci_irq_init(struct vmctx *ctx)
 void pci_irq_deinit(struct vmctx *ctx)
 {
 	pirq_cold = 1;
+	memset(ioapic_counts, 0, sizeof(ioapic_counts));
+}
+
+/*
+ * Count one more (delta 1) or one fewer (delta -1) source on the pin.
+ * Returns the pin to drive, or -1 if its level stays as it is.
+ * Called with ioapic_counts_lock held.
+ */
+static int
+ioapic_count(int irq, int delta)
+{
+	if (irq < 0 || irq >= IOAPIC_MAX_PINS)
+		return irq;
+
+	ioapic_counts[irq] += delta;
+	if (delta > 0)
+		return ioapic_counts[irq] == 1 ? irq : -1;
+	return ioapic_counts[irq] == 0 ? irq : -1;
 }
 
 void
 pci_irq_assert(struct pci_vdev *dev)
 {
 	struct pirq *pirq;
+	int irq;
 
+	pthread_mutex_lock(&ioapic_counts_lock);
+	irq = ioapic_count(dev->lintr.ioapic_irq, 1);
 	if (dev->lintr.pirq_pin > 0) {
 		assert(dev->lintr.pirq_pin <= nitems(pirqs));
 		pirq = &pirqs[dev->lintr.pirq_pin - 1];
@@ -161,20 +193,26 @@ pci_irq_assert(struct pci_vdev *dev)
 		pirq->active_count++;
 		if (pirq->active_count == 1 && pirq_valid_irq(pirq->reg)) {
 			vm_isa_assert_irq(dev->vmctx, pirq->reg & PIRQ_IRQ,
-			    dev->lintr.ioapic_irq);
+			    irq);
 			pthread_mutex_unlock(&pirq->lock);
+			pthread_mutex_unlock(&ioapic_counts_lock);
 			return;
 		}
 		pthread_mutex_unlock(&pirq->lock);
 	}
-	vm_ioapic_assert_irq(dev->vmctx, dev->lintr.ioapic_irq);
+	if (irq >= 0)
+		vm_ioapic_assert_irq(dev->vmctx, irq);
+	pthread_mutex_unlock(&ioapic_counts_lock);
 }
 
 void
 pci_irq_deassert(struct pci_vdev *dev)
 {
 	struct pirq *pirq;
+	int irq;
 
+	pthread_mutex_lock(&ioapic_counts_lock);
+	irq = ioapic_count(dev->lintr.ioapic_irq, -1);
 	if (dev->lintr.pirq_pin > 0) {
 		assert(dev->lintr.pirq_pin <= nitems(pirqs));
 		pirq = &pirqs[dev->lintr.pirq_pin - 1];
@@ -182,13 +220,16 @@ pci_irq_deassert(struct pci_vdev *dev)
 		pirq->active_count--;
 		if (pirq->active_count == 0 && pirq_valid_irq(pirq->reg)) {
 			vm_isa_deassert_irq(dev->vmctx, pirq->reg & PIRQ_IRQ,
-			    dev->lintr.ioapic_irq);
+			    irq);
 			pthread_mutex_unlock(&pirq->lock);
+			pthread_mutex_unlock(&ioapic_counts_lock);
 			return;
 		}
 		pthread_mutex_unlock(&pirq->lock);
 	}
-	vm_ioapic_deassert_irq(dev->vmctx, dev->lintr.ioapic_irq);
+	if (irq >= 0)
+		vm_ioapic_deassert_irq(dev->vmctx, irq);
+	pthread_mutex_unlock(&ioapic_counts_lock);
 }
 
 int
@@ -194,7 +194,7 @@ lpc_init(struct vmctx *ctx)
 		iop.handler = lpc_uart_io_handler;
 		iop.arg = lpc_uart;
 
-		error = register_inout(&iop);
+		error = register_inout(ctx, &iop);
 		assert(error == 0);
 		lpc_uart->enabled = 1;
 	}
@@ -90,9 +90,30 @@ static pthread_mutex_t ref_cnt_mtx = PTHREAD_MUTEX_INITIALIZER;
 /* Prefer MSI over INTx for ptdev */
 static bool prefer_msi = true;
 
+#define PT_CFGSPACE_SIZE	4096	/* PCIe extended config space */
+
+/* What the hypervisor was last told for an MSI-X table entry */
+struct ptdev_msix_remapped {
+	uint64_t	addr;
+	uint32_t	msg_data;
+	int		valid;
+};
+
 struct passthru_dev {
 	struct pci_vdev *dev;
 	struct pcibar bar[PCI_BARMAX + 1];
+
+	/*
+	 * Shadow of the read-only registers a guest walks while probing:
+	 * IDs, class, the capability chains.  cfg_ro marks the bytes that
+	 * are safe to cache, cfg_valid those read from the device since
+	 * the last reset.
+	 */
+	uint8_t		cfg_shadow[PT_CFGSPACE_SIZE];
+	uint8_t		cfg_ro[PT_CFGSPACE_SIZE / 8];
+	uint8_t		cfg_valid[PT_CFGSPACE_SIZE / 8];
+	int		pm_capoff;
+	int		pcie_capoff;
 	struct {
 		int		capoff;
 		int		msgctrl;
@@ -101,6 +122,8 @@ struct passthru_dev {
 	struct {
 		int		capoff;
 		int		table_size;
+		int		lazy_mask;	/* "msix_lazy" option */
+		struct ptdev_msix_remapped *remapped;	/* per entry */
 	} msix;
 	struct pcisel sel;
 	int phys_pin;
@@ -180,6 +203,119 @@ write_config(struct pci_device *phys_dev, long reg, int width, uint32_t data)
 	return temp;
 }
 
+static bool
+cfg_bits_set(const uint8_t *map, int coff, int bytes)
+{
+	int i;
+
+	for (i = coff; i < coff + bytes; i++)
+		if (!(map[i / 8] & (1 << (i % 8))))
+			return false;
+	return true;
+}
+
+static void
+cfg_bits_mod(uint8_t *map, int coff, int bytes, bool set)
+{
+	int i;
+
+	for (i = coff; i < coff + bytes && i < PT_CFGSPACE_SIZE; i++) {
+		if (set)
+			map[i / 8] |= 1 << (i % 8);
+		else
+			map[i / 8] &= ~(1 << (i % 8));
+	}
+}
+
+/*
+ * Find what can be shadowed: the ID registers and the ID/next pointer
+ * of every standard and extended capability.  Other capability bytes
+ * (and anything a driver can write) always go to the device.
+ */
+static void
+cfg_shadow_init(struct passthru_dev *ptdev)
+{
+	struct pci_device *phys_dev = ptdev->phys_dev;
+	uint32_t hdr;
+	int ptr, cap, n;
+
+	cfg_bits_mod(ptdev->cfg_ro, PCIR_VENDOR, 4, true);
+	cfg_bits_mod(ptdev->cfg_ro, PCIR_REVID, 4, true);
+	cfg_bits_mod(ptdev->cfg_ro, PCIR_HDRTYPE, 1, true);
+	cfg_bits_mod(ptdev->cfg_ro, PCIR_SUBVEND_0, 4, true);
+	cfg_bits_mod(ptdev->cfg_ro, PCIR_CAP_PTR, 1, true);
+
+	if (read_config(phys_dev, PCIR_STATUS, 2) & PCIM_STATUS_CAPPRESENT) {
+		ptr = read_config(phys_dev, PCIR_CAP_PTR, 1);
+		/* n bounds a malformed, looping chain */
+		for (n = 0; ptr >= 0x40 && ptr < 0xff && n < 48; n++) {
+			cap = read_config(phys_dev, ptr + PCICAP_ID, 1);
+			if (cap == PCIY_PMG)
+				ptdev->pm_capoff = ptr;
+			else if (cap == PCIY_EXPRESS)
+				ptdev->pcie_capoff = ptr;
+			cfg_bits_mod(ptdev->cfg_ro, ptr, 2, true);
+			ptr = read_config(phys_dev, ptr + PCICAP_NEXTPTR, 1);
+		}
+	}
+
+	if (ptdev->pcie_capoff == 0)
+		return;
+
+	ptr = PCIR_EXTCAP;
+	for (n = 0; ptr >= PCIR_EXTCAP && ptr < PT_CFGSPACE_SIZE && n < 960;
+	     n++) {
+		hdr = read_config(phys_dev, ptr, 4);
+		if (hdr == 0 || hdr == 0xffffffff)
+			break;
+		cfg_bits_mod(ptdev->cfg_ro, ptr, 4, true);
+		ptr = PCI_EXTCAP_NEXTPTR(hdr) & ~3;
+	}
+}
+
+/*
+ * Serve a read of shadowed registers, from the device the first time.
+ * Returns false if any byte of it isn't one we shadow.
+ */
+static bool
+cfg_shadow_read(struct passthru_dev *ptdev, int coff, int bytes, uint32_t *rv)
+{
+	if (coff + bytes > PT_CFGSPACE_SIZE ||
+	    !cfg_bits_set(ptdev->cfg_ro, coff, bytes))
+		return false;
+
+	if (!cfg_bits_set(ptdev->cfg_valid, coff, bytes)) {
+		*rv = read_config(ptdev->phys_dev, coff, bytes);
+		memcpy(&ptdev->cfg_shadow[coff], rv, bytes);
+		cfg_bits_mod(ptdev->cfg_valid, coff, bytes, true);
+		return true;
+	}
+
+	*rv = 0;
+	memcpy(rv, &ptdev->cfg_shadow[coff], bytes);
+	return true;
+}
+
+/*
+ * Called before a write goes to the device.  Writes to shadowed bytes are
+ * ignored by the device, but drop them anyway; a function level reset
+ * or power state change may reload the whole space.
+ */
+static void
+cfg_shadow_invalidate(struct passthru_dev *ptdev, int coff, int bytes)
+{
+	int pm = ptdev->pm_capoff, pcie = ptdev->pcie_capoff;
+
+	if ((pm && coff < pm + PCIR_POWER_STATUS + 2 &&
+	     coff + bytes > pm + PCIR_POWER_STATUS) ||
+	    (pcie && coff < pcie + PCIER_DEVICE_CTL + 2 &&
+	     coff + bytes > pcie + PCIER_DEVICE_CTL)) {
+		memset(ptdev->cfg_valid, 0, sizeof(ptdev->cfg_valid));
+		return;
+	}
+	cfg_bits_mod(ptdev->cfg_valid, coff, bytes, false);
+}
+
 static int
 ptdev_msi_remap(struct vmctx *ctx, struct passthru_dev *ptdev,
 		uint64_t addr, uint16_t msg, int maxmsgnum)
@@ -305,6 +441,113 @@ ptdev_msix_remap(struct vmctx *ctx, const struct passthru_dev *ptdev,
 	return 0;
 }
 
+/*
+ * Remap a table entry and remember what the hypervisor now has for it.
+ */
+static int
+ptdev_msix_entry_remap(struct vmctx *ctx, struct passthru_dev *ptdev,
+		       int index)
+{
+	struct msix_table_entry *entry = &ptdev->dev->msix.table[index];
+	struct ptdev_msix_remapped *r = &ptdev->msix.remapped[index];
+	int error;
+
+	error = ptdev_msix_remap(ctx, ptdev, index, entry->addr,
+				 entry->msg_data, entry->vector_control);
+	r->valid = (error == 0);
+	r->addr = entry->addr;
+	r->msg_data = entry->msg_data;
+	return error;
+}
+
+/*
+ * With lazy masking the mask bit lives only in the emulated table: the
+ * remap hypercall never carried it, so masking and unmasking a vector
+ * whose address/data pair the hypervisor already has costs nothing.
+ * Only an unmasked entry with a new pair is remapped.
+ */
+static int
+ptdev_msix_entry_update(struct vmctx *ctx, struct passthru_dev *ptdev,
+			int index)
+{
+	struct msix_table_entry *entry = &ptdev->dev->msix.table[index];
+	struct ptdev_msix_remapped *r = &ptdev->msix.remapped[index];
+
+	if (entry->vector_control & PCIM_MSIX_VCTRL_MASK)
+		return 0;
+	if (r->valid && r->addr == entry->addr &&
+	    r->msg_data == entry->msg_data)
+		return 0;
+	return ptdev_msix_entry_remap(ctx, ptdev, index);
+}
+
+/*
+ * Remap every table entry, as when the guest enables MSI-X: the
+ * device is disabled and re-enabled once, and the vectors go to the
+ * hypervisor in a single call.
+ */
+static int
+ptdev_msix_remap_all(struct vmctx *ctx, struct passthru_dev *ptdev)
+{
+	struct pci_device *phys_dev = ptdev->phys_dev;
+	struct pci_vdev *dev = ptdev->dev;
+	struct acrn_vm_pci_msix_remap *remaps;
+	uint16_t msgctl, pci_command, new_command;
+	uint16_t virt_bdf = PCI_BDF(dev->bus, dev->slot, dev->func);
+	int msix_capoff, n, i, error;
+
+	if (!ptdev->msix.capoff)
+		return -1;
+
+	msix_capoff = ptdev->msix.capoff;
+	n = dev->msix.table_count;
+
+	/* disable MSI-X during configuration */
+	msgctl = read_config(phys_dev, msix_capoff + PCIR_MSIX_CTRL, 2);
+	msgctl &= ~PCIM_MSIXCTRL_MSIX_ENABLE;
+	msgctl |= PCIM_MSIXCTRL_FUNCTION_MASK;
+	write_config(phys_dev, msix_capoff + PCIR_MSIX_CTRL, 2, msgctl);
+
+	if (!dev->msix.enabled)
+		return 0;
+
+	remaps = calloc(n, sizeof(*remaps));
+	if (remaps == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		remaps[i].phys_bdf = ptdev->phys_bdf;
+		remaps[i].virt_bdf = virt_bdf;
+		remaps[i].msi_data = dev->msix.table[i].msg_data;
+		remaps[i].msi_addr = dev->msix.table[i].addr;
+		remaps[i].msix = 1;
+		remaps[i].msix_entry_index = i;
+	}
+	error = vm_setup_ptdev_msi_batch(ctx, remaps, n);
+	free(remaps);
+
+	for (i = 0; i < n; i++) {
+		ptdev->msix.remapped[i].valid = (error == 0);
+		ptdev->msix.remapped[i].addr = dev->msix.table[i].addr;
+		ptdev->msix.remapped[i].msg_data = dev->msix.table[i].msg_data;
+	}
+	if (error)
+		return -1;
+
+	/* disable INTx */
+	pci_command = read_config(phys_dev, PCIR_COMMAND, 2);
+	new_command = pci_command | PCI_COMMAND_INTX_DISABLE;
+	if (new_command != pci_command)
+		write_config(phys_dev, PCIR_COMMAND, 2, new_command);
+
+	/* Enable MSI-X & unmask function */
+	msgctl &= ~PCIM_MSIXCTRL_FUNCTION_MASK;
+	msgctl |= PCIM_MSIXCTRL_MSIX_ENABLE;
+	write_config(phys_dev, msix_capoff + PCIR_MSIX_CTRL, 2, msgctl);
+
+	return 0;
+}
+
 #ifdef FORCE_MSI_SINGLE_VECTOR
 /* Temporarily set mmc & mme to 0.
  * Remove it when multiple vectors for MSI ready.
@@ -420,6 +663,12 @@ cfginitmsi(struct vmctx *ctx, struct passthru_dev *ptdev)
 			warnx("%s: calloc FAIL!", __func__);
 			return -1;
 		}
+		ptdev->msix.remapped = calloc(dev->msix.table_count,
+					      sizeof(*ptdev->msix.remapped));
+		if (ptdev->msix.remapped == NULL) {
+			warnx("%s: calloc FAIL!", __func__);
+			return -1;
+		}
 
 		/* Mask all table entries */
 		for (i = 0; i < dev->msix.table_count; i++) {
@@ -588,14 +837,58 @@ msix_table_write(struct vmctx *ctx, int vcpu, struct passthru_dev *ptdev,
 	*dest32 = data;
 	/* If MSI-X hasn't been enabled, do nothing */
 	if (dev->msix.enabled) {
+		if (ptdev->msix.lazy_mask)
+			(void)ptdev_msix_entry_update(ctx, ptdev, index);
 		/* If the entry is masked, don't set it up */
-		if ((entry->vector_control & PCIM_MSIX_VCTRL_MASK) == 0 ||
-		    (vector_control & PCIM_MSIX_VCTRL_MASK) == 0) {
-			(void)ptdev_msix_remap(ctx, ptdev, index,
-				entry->addr, entry->msg_data,
-				entry->vector_control);
+		else if ((entry->vector_control & PCIM_MSIX_VCTRL_MASK) == 0 ||
+		    (vector_control & PCIM_MSIX_VCTRL_MASK) == 0)
+			(void)ptdev_msix_entry_remap(ctx, ptdev, index);
+	}
+}
+
+#define PT_EPT_PAGE_2M	(2UL * 1024 * 1024)
+#define PT_EPT_PAGE_1G	(1024UL * 1024 * 1024)
+
+/*
+ * Map [hpa, hpa + len) at gpa, split at 2MB/1GB boundaries so that each
+ * request is either a run of large pages or the 4K-page edge around it.
+ * Large pages are only possible when gpa and hpa agree in the low bits;
+ * otherwise the range goes down in a single request.
+ */
+static int
+passthru_map_mmio(struct vmctx *ctx, struct passthru_dev *ptdev,
+		  vm_paddr_t gpa, size_t len, vm_paddr_t hpa)
+{
+	static const uint64_t pgsz[] = { PT_EPT_PAGE_1G, PT_EPT_PAGE_2M };
+	uint64_t end, lo, hi, chunk;
+	int i, error;
+
+	while (len > 0) {
+		chunk = len;
+		for (i = 0; i < nitems(pgsz); i++) {
+			if (((gpa ^ hpa) & (pgsz[i] - 1)) != 0)
+				continue;
+			lo = roundup2(gpa, pgsz[i]);
+			end = gpa + len;
+			hi = rounddown2(end, pgsz[i]);
+			if (lo >= hi)
+				continue;
+			/* 4K-mapped head up to the first large page */
+			chunk = (lo > gpa) ? lo - gpa : hi - lo;
+			break;
 		}
+
+		error = vm_map_ptdev_mmio(ctx, ptdev->sel.bus, ptdev->sel.dev,
+					  ptdev->sel.func, gpa, chunk, hpa);
+		if (error)
+			return error;
+
+		gpa += chunk;
+		hpa += chunk;
+		len -= chunk;
 	}
+
+	return 0;
 }
 
 static int
@@ -670,7 +963,7 @@ init_msix_table(struct vmctx *ctx, struct passthru_dev *ptdev, uint64_t base)
 	/* Map everything before the MSI-X table */
 	if (table_offset > 0) {
 		len = table_offset;
-		error = vm_map_ptdev_mmio(ctx, b, s, f, start, len, base);
+		error = passthru_map_mmio(ctx, ptdev, start, len, base);
 		if (error)
 			return error;
 
@@ -701,7 +994,7 @@ init_msix_table(struct vmctx *ctx, struct passthru_dev *ptdev, uint64_t base)
 	/* Map everything beyond the end of the MSI-X table */
 	if (remaining > 0) {
 		len = remaining;
-		error = vm_map_ptdev_mmio(ctx, b, s, f, start, len, base);
+		error = passthru_map_mmio(ctx, ptdev, start, len, base);
 		if (error)
 			return error;
 	}
@@ -778,8 +1071,7 @@ cfginitbar(struct vmctx *ctx, struct passthru_dev *ptdev)
 				return -1;
 		} else if (bartype != PCIBAR_IO) {
 			/* Map the physical BAR in the guest MMIO space */
-			error = vm_map_ptdev_mmio(ctx, ptdev->sel.bus,
-				ptdev->sel.dev, ptdev->sel.func,
+			error = passthru_map_mmio(ctx, ptdev,
 				dev->bar[i].addr, dev->bar[i].size, base);
 			if (error)
 				return -1;
@@ -815,6 +1107,8 @@ cfginit(struct vmctx *ctx, struct passthru_dev *ptdev, int bus,
 	ptdev->sel.dev = slot;
 	ptdev->sel.func = func;
 
+	cfg_shadow_init(ptdev);
+
 	if (cfginitmsi(ctx, ptdev) != 0) {
 		warnx("MSI not supported for PCI %x/%x/%x",
 		    bus, slot, func);
@@ -872,6 +1166,8 @@ passthru_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	struct passthru_dev *ptdev;
 	struct pci_device_iterator *iter;
 	struct pci_device *phys_dev;
+	int msix_lazy = 0;
+	char *opt;
 
 	ptdev = NULL;
 	error = 1;
@@ -881,6 +1177,14 @@ passthru_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		warnx("invalid passthru options, %s", opts);
 		return error;
 	}
+	for (opt = strchr(opts, ','); opt != NULL; opt = strchr(opt, ',')) {
+		opt++;
+		if (!strncmp(opt, "msix_lazy", 9) &&
+		    (opt[9] == ',' || opt[9] == '\0'))
+			msix_lazy = 1;
+		else
+			warnx("ignoring passthru option %s", opt);
+	}
 
 	if (vm_assign_ptdev(ctx, bus, slot, func) != 0) {
 		warnx("PCI device at %x/%x/%x is not using the pt(4) driver",
@@ -895,6 +1199,7 @@ passthru_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 
 	ptdev->phys_bdf = PCI_BDF(bus, slot, func);
+	ptdev->msix.lazy_mask = msix_lazy;
 
 	error = pciaccess_init();
 	if (error)
@@ -1013,6 +1318,7 @@ passthru_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		if (ptdev->msix.capoff)
 			free(dev->msix.table);
 	}
+	free(ptdev->msix.remapped);
 
 	free(ptdev);
 	vm_unassign_ptdev(ctx, bus, slot, func);
@@ -1095,7 +1401,8 @@ passthru_cfgread(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		return -1;
 
 	/* Everything else just read from the device's config space */
-	*rv = read_config(ptdev->phys_dev, coff, bytes);
+	if (!cfg_shadow_read(ptdev, coff, bytes, rv))
+		*rv = read_config(ptdev->phys_dev, coff, bytes);
 
 	return 0;
 }
@@ -1104,7 +1411,7 @@ static int
 passthru_cfgwrite(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		  int coff, int bytes, uint32_t val)
 {
-	int error, msix_table_entries, i;
+	int error;
 	struct passthru_dev *ptdev;
 
 	ptdev = dev->arg;
@@ -1150,21 +1457,13 @@ passthru_cfgwrite(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 
 	if (msixcap_access(ptdev, coff)) {
 		msixcap_cfgwrite(dev, ptdev->msix.capoff, coff, bytes, val);
-		if (dev->msix.enabled) {
-			msix_table_entries = dev->msix.table_count;
-			for (i = 0; i < msix_table_entries; i++) {
-				error = ptdev_msix_remap(ctx, ptdev, i,
-					dev->msix.table[i].addr,
-					dev->msix.table[i].msg_data,
-					dev->msix.table[i].vector_control);
-
-				if (error)
-					err(1, "ptdev_msix_remap");
-			}
-		}
+		if (dev->msix.enabled &&
+		    ptdev_msix_remap_all(ctx, ptdev) != 0)
+			err(1, "ptdev_msix_remap");
 		return 0;
 	}
 
+	cfg_shadow_invalidate(ptdev, coff, bytes);
 	write_config(ptdev->phys_dev, coff, bytes, val);
 
 	return 0;
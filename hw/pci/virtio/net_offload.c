@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Software transmit offloads for virtio-net backends without a vnet
+ * header. Partial checksums are completed, and TSO frames are cut into
+ * gso_size segments, each sent as its rewritten headers followed by a
+ * slice of the guest's buffers, so the payload is only read to sum it.
+ *
+ * Sums are accumulated in host order, 32 bits at a time, into 64-bit
+ * lanes with SSE2, or AVX2 where the CPU has it, and folded at the end.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <immintrin.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "net_offload.h"
+
+#define TH_FIN	0x01
+#define TH_PSH	0x08
+#define TH_CWR	0x80
+
+static inline uint64_t
+net_csum_add64(uint64_t a, uint64_t b)
+{
+	a += b;
+	return a + (a < b);
+}
+
+static inline uint32_t
+net_csum_fold64(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return (uint32_t)sum;
+}
+
+static uint64_t
+net_csum_generic(const uint8_t *p, size_t len, uint64_t sum)
+{
+	uint32_t w;
+	uint16_t h;
+
+	while (len >= 4) {
+		memcpy(&w, p, 4);
+		sum += w;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&h, p, 2);
+		sum += h;
+		p += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += *p;
+	return sum;
+}
+
+static uint64_t
+net_csum_sse2(const uint8_t *p, size_t len, uint64_t sum)
+{
+	__m128i acc, zero, v;
+	uint64_t lane[2];
+
+	acc = zero = _mm_setzero_si128();
+	while (len >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+		p += 16;
+		len -= 16;
+	}
+	_mm_storeu_si128((__m128i *)lane, acc);
+	sum = net_csum_add64(sum, lane[0]);
+	sum = net_csum_add64(sum, lane[1]);
+	return net_csum_generic(p, len, net_csum_fold64(sum));
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+net_csum_avx2(const uint8_t *p, size_t len, uint64_t sum)
+{
+	__m256i acc, zero, v;
+	uint64_t lane[4];
+	int i;
+
+	acc = zero = _mm256_setzero_si256();
+	while (len >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+		p += 32;
+		len -= 32;
+	}
+	_mm256_storeu_si256((__m256i *)lane, acc);
+	for (i = 0; i < 4; i++)
+		sum = net_csum_add64(sum, lane[i]);
+	return net_csum_sse2(p, len, net_csum_fold64(sum));
+}
+
+/*
+ * Add len bytes at buf to a partial sum, as if they started at an even
+ * offset. The result is still to be folded with net_csum_fold().
+ */
+uint32_t
+net_csum_add(uint32_t sum, const void *buf, size_t len)
+{
+	uint64_t s;
+
+	if (len >= 128 && __builtin_cpu_supports("avx2"))
+		s = net_csum_avx2(buf, len, sum);
+	else
+		s = net_csum_sse2(buf, len, sum);
+	return net_csum_fold64(s);
+}
+
+/* The complemented 16-bit checksum, as stored in a header */
+uint16_t
+net_csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+static inline uint32_t
+net_csum_add32(uint32_t a, uint32_t b)
+{
+	a += b;
+	return a + (a < b);
+}
+
+/*
+ * Sum len bytes of the frame from off on. odd says the bytes before
+ * them in the checksummed range add up to an odd count, in which case
+ * every 16-bit word straddles and the partial sum is byte swapped.
+ */
+static uint32_t
+net_csum_iov(uint32_t sum, int odd, const struct iovec *iov, int iovcnt,
+	     size_t off, size_t len)
+{
+	uint32_t part;
+	size_t chunk;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		chunk = iov[i].iov_len - off;
+		if (chunk > len)
+			chunk = len;
+		part = net_csum_add(0, (uint8_t *)iov[i].iov_base + off,
+				    chunk);
+		if (odd) {
+			part = (part & 0xffff) + (part >> 16);
+			part = (part & 0xffff) + (part >> 16);
+			part = ((part << 8) | (part >> 8)) & 0xffff;
+		}
+		sum = net_csum_add32(sum, part);
+		odd ^= chunk & 1;
+		len -= chunk;
+		off = 0;
+	}
+	return sum;
+}
+
+static size_t
+net_iov_copyout(const struct iovec *iov, int iovcnt, size_t off, void *buf,
+		size_t len)
+{
+	size_t chunk, done;
+	int i;
+
+	for (i = 0, done = 0; i < iovcnt && done < len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		chunk = iov[i].iov_len - off;
+		if (chunk > len - done)
+			chunk = len - done;
+		memcpy((uint8_t *)buf + done, (uint8_t *)iov[i].iov_base + off,
+		       chunk);
+		done += chunk;
+		off = 0;
+	}
+	return done;
+}
+
+/* Point out[] at len bytes of the frame from off on, return the count */
+static int
+net_iov_slice(const struct iovec *iov, int iovcnt, size_t off, size_t len,
+	      struct iovec *out)
+{
+	size_t chunk;
+	int i, n;
+
+	for (i = 0, n = 0; i < iovcnt && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		chunk = iov[i].iov_len - off;
+		if (chunk > len)
+			chunk = len;
+		out[n].iov_base = (uint8_t *)iov[i].iov_base + off;
+		out[n].iov_len = chunk;
+		n++;
+		len -= chunk;
+		off = 0;
+	}
+	return n;
+}
+
+static inline void
+net_put16(uint8_t *p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, 2);
+}
+
+static inline void
+net_put32(uint8_t *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static inline uint16_t
+net_get16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, 2);
+	return ntohs(v);
+}
+
+static inline uint32_t
+net_get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+/*
+ * Complete the checksum at csum_start + csum_offset, where the guest
+ * left the pseudo header sum, over everything from csum_start on.
+ */
+static int
+net_offload_csum(const struct net_offload_hdr *vh, struct iovec *iov,
+		 int iovcnt, int len, net_offload_xmit_t *xmit, void *arg)
+{
+	struct iovec out[NET_OFFLOAD_MAXSEGS + 1];
+	uint8_t hdr[NET_OFFLOAD_HDRMAX];
+	uint32_t sum;
+	uint16_t csum;
+	size_t hl;
+
+	hl = vh->csum_start + vh->csum_offset + 2;
+	if (hl > sizeof(hdr) || hl > (size_t)len ||
+	    net_iov_copyout(iov, iovcnt, 0, hdr, hl) != hl)
+		return -1;
+
+	sum = net_csum_add(0, hdr + vh->csum_start, hl - vh->csum_start);
+	sum = net_csum_iov(sum, (hl - vh->csum_start) & 1, iov, iovcnt, hl,
+			   len - hl);
+	csum = net_csum_fold(sum);
+	/* a UDP checksum of 0 means none */
+	if (csum == 0 && vh->csum_offset == 6)
+		csum = 0xffff;
+	memcpy(hdr + vh->csum_start + vh->csum_offset, &csum, 2);
+
+	out[0].iov_base = hdr;
+	out[0].iov_len = hl;
+	(*xmit)(arg, out, 1 + net_iov_slice(iov, iovcnt, hl, len - hl,
+					      &out[1]), len);
+	return 0;
+}
+
+/*
+ * Cut a TSO frame into gso_size segments. Every segment gets its own
+ * copy of the headers, with the IP length, IPv4 id and checksum, the
+ * TCP sequence number, flags and checksum fixed up, just as the host
+ * stack would have done.
+ */
+static int
+net_offload_tso(const struct net_offload_hdr *vh, struct iovec *iov,
+		int iovcnt, int len, net_offload_xmit_t *xmit, void *arg)
+{
+	struct iovec out[NET_OFFLOAD_MAXSEGS + 1];
+	uint8_t hdr[NET_OFFLOAD_HDRMAX];
+	uint8_t *ip, *tcp, tflags;
+	uint16_t pseudo[2], csum, id;
+	size_t l3, l4, thl, hlen, off, seglen, alen;
+	uint32_t sum, seq;
+	int v4, ihl;
+
+	v4 = (vh->gso_type & ~NET_OFFLOAD_GSO_ECN) == NET_OFFLOAD_GSO_TCPV4;
+	l4 = vh->csum_start;
+	if (vh->gso_size == 0 || l4 + 20 > sizeof(hdr) ||
+	    net_iov_copyout(iov, iovcnt, 0, hdr, l4 + 20) != l4 + 20)
+		return -1;
+
+	l3 = (net_get16(hdr + 12) == 0x8100) ? 18 : 14;
+	if (net_get16(hdr + l3 - 2) != (v4 ? 0x0800 : 0x86dd) ||
+	    l4 < l3 + (v4 ? 20 : 40))
+		return -1;
+	ip = hdr + l3;
+	ihl = (ip[0] & 0xf) * 4;
+	if ((ip[0] >> 4) != (v4 ? 4 : 6) || (v4 && l3 + ihl != l4) ||
+	    (!v4 && ip[6] != IPPROTO_TCP) || (v4 && ip[9] != IPPROTO_TCP))
+		return -1;
+
+	tcp = hdr + l4;
+	thl = (tcp[12] >> 4) * 4;
+	hlen = l4 + thl;
+	if (thl < 20 || hlen > sizeof(hdr) || hlen >= (size_t)len ||
+	    net_iov_copyout(iov, iovcnt, 0, hdr, hlen) != hlen)
+		return -1;
+
+	id = v4 ? net_get16(ip + 4) : 0;
+	seq = net_get32(tcp + 4);
+	tflags = tcp[13];
+	alen = v4 ? 8 : 32;
+
+	for (off = hlen; off < (size_t)len; off += seglen) {
+		seglen = len - off;
+		if (seglen > vh->gso_size)
+			seglen = vh->gso_size;
+
+		if (v4) {
+			net_put16(ip + 2, hlen - l3 + seglen);
+			net_put16(ip + 4, id++);
+			ip[10] = ip[11] = 0;
+			csum = net_csum_fold(net_csum_add(0, ip, ihl));
+			memcpy(ip + 10, &csum, 2);
+		} else
+			net_put16(ip + 4, hlen - l3 - 40 + seglen);
+
+		net_put32(tcp + 4, seq + (off - hlen));
+		tcp[13] = tflags;
+		if (off + seglen < (size_t)len)
+			tcp[13] &= ~(TH_FIN | TH_PSH);
+		if (off > hlen)
+			tcp[13] &= ~TH_CWR;
+
+		tcp[16] = tcp[17] = 0;
+		pseudo[0] = htons(IPPROTO_TCP);
+		pseudo[1] = htons(thl + seglen);
+		sum = net_csum_add(0, ip + (v4 ? 12 : 8), alen);
+		sum = net_csum_add(sum, pseudo, sizeof(pseudo));
+		sum = net_csum_add(sum, tcp, thl);
+		sum = net_csum_iov(sum, 0, iov, iovcnt, off, seglen);
+		csum = net_csum_fold(sum);
+		memcpy(tcp + 16, &csum, 2);
+
+		out[0].iov_base = hdr;
+		out[0].iov_len = hlen;
+		(*xmit)(arg, out, 1 + net_iov_slice(iov, iovcnt, off, seglen,
+						      &out[1]),
+			hlen + seglen);
+	}
+	return 0;
+}
+
+/*
+ * Send a frame of len bytes with the offloads in vh done, through xmit.
+ * The iovecs passed to xmit only live until it returns. Returns -1,
+ * having sent nothing, if the frame doesn't parse as what vh says.
+ */
+int
+net_offload_tx(const struct net_offload_hdr *vh, struct iovec *iov,
+	       int iovcnt, int len, net_offload_xmit_t *xmit, void *arg)
+{
+	if (iovcnt > NET_OFFLOAD_MAXSEGS)
+		return -1;
+
+	switch (vh->gso_type & ~NET_OFFLOAD_GSO_ECN) {
+	case NET_OFFLOAD_GSO_NONE:
+		if (!(vh->flags & NET_OFFLOAD_F_NEEDS_CSUM)) {
+			(*xmit)(arg, iov, iovcnt, len);
+			return 0;
+		}
+		return net_offload_csum(vh, iov, iovcnt, len, xmit, arg);
+	case NET_OFFLOAD_GSO_TCPV4:
+	case NET_OFFLOAD_GSO_TCPV6:
+		return net_offload_tso(vh, iov, iovcnt, len, xmit, arg);
+	default:
+		return -1;
+	}
+}
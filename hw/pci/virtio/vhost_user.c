@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * vhost-user master. The backend gets guest memory as the memfds
+ * behind it, and the rings at the addresses we have them mapped at,
+ * so its addresses and ours agree; once the driver is ready, the device
+ * model is only left with config space and the lifecycle.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "dm.h"
+#include "pci_core.h"
+#include "vmmapi.h"
+#include "mevent.h"
+#include "virtio.h"
+#include "vhost_user.h"
+#include "monitor.h"
+
+static int vhost_user_debug;
+MONITOR_DEBUG(vhost_user, vhost_user_debug);
+#define DPRINTF(params) do { if (vhost_user_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+#define VHOST_USER_GET_FEATURES		1
+#define VHOST_USER_SET_FEATURES		2
+#define VHOST_USER_SET_OWNER		3
+#define VHOST_USER_SET_MEM_TABLE	5
+#define VHOST_USER_SET_VRING_NUM	8
+#define VHOST_USER_SET_VRING_ADDR	9
+#define VHOST_USER_SET_VRING_BASE	10
+#define VHOST_USER_GET_VRING_BASE	11
+#define VHOST_USER_SET_VRING_KICK	12
+#define VHOST_USER_SET_VRING_CALL	13
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_GET_QUEUE_NUM	17
+#define VHOST_USER_SET_VRING_ENABLE	18
+#define VHOST_USER_GET_CONFIG		24
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_REPLY		(1 << 2)
+
+#define VHOST_USER_MAX_REGIONS		8
+#define VHOST_USER_MAX_CONFIG		256
+
+#define	GB	(1024 * 1024 * 1024UL)
+
+struct vhost_user_region {
+	uint64_t	gpa;
+	uint64_t	size;
+	uint64_t	uaddr;		/* where we have it mapped */
+	uint64_t	mmap_offset;
+};
+
+struct vhost_user_msg {
+	uint32_t	request;
+	uint32_t	flags;
+	uint32_t	size;		/* of the payload */
+	union {
+		uint64_t	u64;
+		struct {
+			uint32_t	index;
+			uint32_t	num;
+		} state;
+		struct {
+			uint32_t	index;
+			uint32_t	flags;
+			uint64_t	desc;
+			uint64_t	used;
+			uint64_t	avail;
+			uint64_t	log;
+		} addr;
+		struct {
+			uint32_t	nregions;
+			uint32_t	padding;
+			struct vhost_user_region
+					regions[VHOST_USER_MAX_REGIONS];
+		} mem;
+		struct {
+			uint32_t	offset;
+			uint32_t	size;
+			uint32_t	flags;
+			uint8_t		region[VHOST_USER_MAX_CONFIG];
+		} config;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDRSZ	offsetof(struct vhost_user_msg, payload)
+
+/*
+ * The backend went away or broke the protocol. There is no reconnect;
+ * every later request fails and the device is left to the caller.
+ */
+static void
+vhost_user_lost(struct vhost_user *vu)
+{
+	if (vu->fd < 0)
+		return;
+	WPRINTF(("vhost-user: backend lost\n"));
+	close(vu->fd);
+	vu->fd = -1;
+	vu->started = 0;
+}
+
+static int
+vhost_user_send(struct vhost_user *vu, uint32_t request,
+		struct vhost_user_msg *msg, uint32_t size, int *fds, int nfds)
+{
+	char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_REGIONS)];
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t rc;
+
+	if (vu->fd < 0)
+		return -1;
+
+	msg->request = request;
+	msg->flags = VHOST_USER_VERSION;
+	msg->size = size;
+	iov.iov_base = msg;
+	iov.iov_len = VHOST_USER_HDRSZ + size;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (nfds > 0) {
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	do {
+		rc = sendmsg(vu->fd, &mh, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc != (ssize_t)iov.iov_len) {
+		vhost_user_lost(vu);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+vhost_user_recv(struct vhost_user *vu, uint32_t request,
+		struct vhost_user_msg *msg)
+{
+	ssize_t rc;
+
+	rc = recv(vu->fd, msg, VHOST_USER_HDRSZ, MSG_WAITALL);
+	if (rc != VHOST_USER_HDRSZ || msg->request != request ||
+	    !(msg->flags & VHOST_USER_REPLY) ||
+	    msg->size > sizeof(msg->payload))
+		goto lost;
+
+	rc = recv(vu->fd, &msg->payload, msg->size, MSG_WAITALL);
+	if (rc != msg->size)
+		goto lost;
+	return 0;
+
+lost:
+	vhost_user_lost(vu);
+	return -1;
+}
+
+static int
+vhost_user_get(struct vhost_user *vu, uint32_t request, uint64_t *val)
+{
+	struct vhost_user_msg msg;
+
+	if (vhost_user_send(vu, request, &msg, 0, NULL, 0) < 0 ||
+	    vhost_user_recv(vu, request, &msg) < 0)
+		return -1;
+	if (msg.size != sizeof(msg.payload.u64)) {
+		vhost_user_lost(vu);
+		return -1;
+	}
+
+	*val = msg.payload.u64;
+	return 0;
+}
+
+static int
+vhost_user_set(struct vhost_user *vu, uint32_t request, uint64_t val)
+{
+	struct vhost_user_msg msg;
+
+	msg.payload.u64 = val;
+	return vhost_user_send(vu, request, &msg, sizeof(msg.payload.u64),
+			       NULL, 0);
+}
+
+static int
+vhost_user_set_state(struct vhost_user *vu, uint32_t request,
+		     uint32_t index, uint32_t num)
+{
+	struct vhost_user_msg msg;
+
+	msg.payload.state.index = index;
+	msg.payload.state.num = num;
+	return vhost_user_send(vu, request, &msg, sizeof(msg.payload.state),
+			       NULL, 0);
+}
+
+static int
+vhost_user_set_fd(struct vhost_user *vu, uint32_t request, uint32_t index,
+		  int fd)
+{
+	struct vhost_user_msg msg;
+
+	msg.payload.u64 = index;
+	return vhost_user_send(vu, request, &msg, sizeof(msg.payload.u64),
+			       &fd, 1);
+}
+
+/*
+ * Connect to the backend at path and agree on the protocol features
+ * wanted, of which the backend may support fewer. Guest memory has to
+ * be memfd-backed for it to be shared.
+ */
+struct vhost_user *
+vhost_user_open(struct vmctx *ctx, const char *path, uint64_t protocol)
+{
+	struct vhost_user *vu;
+	struct vhost_user_msg msg;
+	struct sockaddr_un addr;
+	int i;
+
+	if (ctx->lowmem_fd < 0 || (ctx->highmem > 0 && ctx->highmem_fd < 0)) {
+		WPRINTF(("vhost-user: guest memory has to come from -z or "
+			"-Z, to share it with the backend\n"));
+		return NULL;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		WPRINTF(("vhost-user: path %s is too long\n", path));
+		return NULL;
+	}
+
+	vu = calloc(1, sizeof(*vu));
+	if (vu == NULL)
+		return NULL;
+	vu->ctx = ctx;
+	for (i = 0; i < VHOST_USER_MAXQ; i++)
+		vu->kickfd[i] = vu->callfd[i] = -1;
+
+	vu->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (vu->fd < 0)
+		goto fail;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(vu->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto fail;
+
+	if (vhost_user_send(vu, VHOST_USER_SET_OWNER, &msg, 0, NULL, 0) < 0 ||
+	    vhost_user_get(vu, VHOST_USER_GET_FEATURES, &vu->features) < 0)
+		goto proto;
+	if (vu->features & VHOST_USER_F_PROTOCOL_FEATURES) {
+		if (vhost_user_get(vu, VHOST_USER_GET_PROTOCOL_FEATURES,
+		    &vu->protocol) < 0)
+			goto proto;
+		vu->protocol &= protocol;
+		if (vhost_user_set(vu, VHOST_USER_SET_PROTOCOL_FEATURES,
+		    vu->protocol) < 0)
+			goto proto;
+	}
+	DPRINTF(("vhost-user: %s features 0x%lx protocol 0x%lx\n\r", path,
+		vu->features, vu->protocol));
+	return vu;
+
+proto:
+	WPRINTF(("vhost-user: handshake on %s failed\n", path));
+	vhost_user_close(vu);
+	return NULL;
+fail:
+	WPRINTF(("vhost-user: cannot connect to %s: %s\n", path,
+		strerror(errno)));
+	vhost_user_close(vu);
+	return NULL;
+}
+
+void
+vhost_user_close(struct vhost_user *vu)
+{
+	int i;
+
+	for (i = 0; i < VHOST_USER_MAXQ; i++) {
+		if (vu->callev[i] != NULL)
+			mevent_delete_close(vu->callev[i]);
+		else if (vu->callfd[i] >= 0)
+			close(vu->callfd[i]);
+		if (vu->kickfd[i] >= 0)
+			close(vu->kickfd[i]);
+	}
+	if (vu->fd >= 0)
+		close(vu->fd);
+	free(vu);
+}
+
+/*
+ * Queues the backend can serve: queue pairs for net, queues for blk.
+ */
+int
+vhost_user_get_queue_num(struct vhost_user *vu, uint64_t *num)
+{
+	if (!(vu->protocol & VHOST_USER_PROTOCOL_F_MQ)) {
+		*num = 1;
+		return 0;
+	}
+	return vhost_user_get(vu, VHOST_USER_GET_QUEUE_NUM, num);
+}
+
+/*
+ * Read the first size bytes of the device config space the backend
+ * keeps, e.g. the capacity of a disk.
+ */
+int
+vhost_user_get_config(struct vhost_user *vu, void *cfg, uint32_t size)
+{
+	struct vhost_user_msg msg;
+	uint32_t len;
+
+	if (!(vu->protocol & VHOST_USER_PROTOCOL_F_CONFIG) ||
+	    size > VHOST_USER_MAX_CONFIG)
+		return -1;
+
+	len = offsetof(struct vhost_user_msg, payload.config.region) -
+	      VHOST_USER_HDRSZ + size;
+	memset(&msg.payload.config, 0, sizeof(msg.payload.config));
+	msg.payload.config.size = size;
+	if (vhost_user_send(vu, VHOST_USER_GET_CONFIG, &msg, len,
+	    NULL, 0) < 0 ||
+	    vhost_user_recv(vu, VHOST_USER_GET_CONFIG, &msg) < 0)
+		return -1;
+	if (msg.size != len || msg.payload.config.size != size)
+		return -1;
+
+	memcpy(cfg, msg.payload.config.region, size);
+	return 0;
+}
+
+static void
+vhost_user_call(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+		vq_interrupt(vq->base, vq);
+}
+
+/*
+ * Set up the eventfds of the first nvq of queues. The call eventfds
+ * are watched on loop, NULL for the default one.
+ */
+int
+vhost_user_init_queues(struct vhost_user *vu, struct virtio_vq_info *queues,
+		       int nvq, struct mevent_loop *loop)
+{
+	int i;
+
+	if (nvq > VHOST_USER_MAXQ)
+		return -1;
+
+	vu->queues = queues;
+	vu->nvq = nvq;
+	for (i = 0; i < nvq; i++) {
+		vu->kickfd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		vu->callfd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (vu->kickfd[i] < 0 || vu->callfd[i] < 0)
+			return -1;
+		vu->callev[i] = mevent_add_on(loop, vu->callfd[i], EVF_READ,
+					      0, vhost_user_call, &queues[i]);
+		if (vu->callev[i] == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * DRIVER_OK: hand guest memory and the queues the driver set up to the
+ * backend, with features as negotiated. Rings start enabled unless
+ * protocol features are in use; see vhost_user_enable().
+ */
+int
+vhost_user_start(struct vhost_user *vu, uint64_t features)
+{
+	struct vmctx *ctx = vu->ctx;
+	struct vhost_user_region r;
+	struct vhost_user_msg msg;
+	struct virtio_vq_info *vq;
+	uint64_t cnt = 1;
+	int fds[2], n, i;
+
+	if (vu->fd < 0)
+		return -1;
+	if (vu->started)
+		return 0;
+
+	features &= vu->features;
+	features |= vu->features & VHOST_USER_F_PROTOCOL_FEATURES;
+	if (vhost_user_set(vu, VHOST_USER_SET_FEATURES, features) < 0)
+		return -1;
+
+	memset(&msg.payload.mem, 0, sizeof(msg.payload.mem));
+	n = 0;
+	if (ctx->lowmem > 0) {
+		memset(&r, 0, sizeof(r));
+		r.gpa = 0;
+		r.size = ctx->lowmem;
+		r.uaddr = (uintptr_t)ctx->mmap_lowmem;
+		memcpy(&msg.payload.mem.regions[n], &r, sizeof(r));
+		fds[n++] = ctx->lowmem_fd;
+	}
+	if (ctx->highmem > 0) {
+		memset(&r, 0, sizeof(r));
+		r.gpa = 4 * GB;
+		r.size = ctx->highmem;
+		r.uaddr = (uintptr_t)ctx->mmap_highmem;
+		memcpy(&msg.payload.mem.regions[n], &r, sizeof(r));
+		fds[n++] = ctx->highmem_fd;
+	}
+	msg.payload.mem.nregions = n;
+	if (vhost_user_send(vu, VHOST_USER_SET_MEM_TABLE, &msg,
+	    2 * sizeof(uint32_t) + n * sizeof(r), fds, n) < 0)
+		return -1;
+
+	for (i = 0; i < vu->nvq; i++) {
+		vq = &vu->queues[i];
+		if (!(vq->flags & VQ_ALLOC))
+			continue;
+
+		msg.payload.addr.index = i;
+		msg.payload.addr.flags = 0;
+		msg.payload.addr.desc = (uintptr_t)vq->desc;
+		msg.payload.addr.used = (uintptr_t)vq->used;
+		msg.payload.addr.avail = (uintptr_t)vq->avail;
+		msg.payload.addr.log = 0;
+		if (vhost_user_set_state(vu, VHOST_USER_SET_VRING_NUM, i,
+		    vq->qsize) < 0 ||
+		    vhost_user_set_state(vu, VHOST_USER_SET_VRING_BASE, i,
+		    vq->last_avail) < 0 ||
+		    vhost_user_send(vu, VHOST_USER_SET_VRING_ADDR, &msg,
+		    sizeof(msg.payload.addr), NULL, 0) < 0)
+			return -1;
+
+		/* QNOTIFY stops waking the mevent thread */
+		if (vq->ioeventfd >= 0) {
+			vu->kick[i] = vq->ioeventfd;
+			mevent_disable(vq->ioevent);
+		} else
+			vu->kick[i] = vu->kickfd[i];
+		if (vhost_user_set_fd(vu, VHOST_USER_SET_VRING_CALL, i,
+		    vu->callfd[i]) < 0 ||
+		    vhost_user_set_fd(vu, VHOST_USER_SET_VRING_KICK, i,
+		    vu->kick[i]) < 0)
+			return -1;
+	}
+	vu->started = 1;
+
+	/* buffers the guest posted before DRIVER_OK */
+	for (i = 0; i < vu->nvq; i++)
+		if (vu->queues[i].flags & VQ_ALLOC)
+			if (write(vu->kick[i], &cnt, sizeof(cnt)) < 0)
+				DPRINTF(("vhost-user: kick %d failed\n\r", i));
+	return 0;
+}
+
+/*
+ * With protocol features the backend keeps the rings disabled until
+ * it's told otherwise. A no-op without them.
+ */
+int
+vhost_user_enable(struct vhost_user *vu, int idx, int enable)
+{
+	if (!vu->started || !(vu->features & VHOST_USER_F_PROTOCOL_FEATURES))
+		return 0;
+	if (idx >= vu->nvq || !(vu->queues[idx].flags & VQ_ALLOC))
+		return 0;
+	return vhost_user_set_state(vu, VHOST_USER_SET_VRING_ENABLE, idx,
+				    enable != 0);
+}
+
+/*
+ * Take the rings back. GET_VRING_BASE makes the backend stop a queue
+ * before it answers, so the guest memory is ours to reset afterwards.
+ */
+int
+vhost_user_stop(struct vhost_user *vu)
+{
+	struct vhost_user_msg msg;
+	struct virtio_vq_info *vq;
+	int i;
+
+	if (!vu->started)
+		return 0;
+	vu->started = 0;
+
+	for (i = 0; i < vu->nvq; i++) {
+		vq = &vu->queues[i];
+		if (!(vq->flags & VQ_ALLOC))
+			continue;
+		if (vq->ioeventfd >= 0 && vu->kick[i] == vq->ioeventfd)
+			mevent_enable(vq->ioevent);
+
+		msg.payload.state.index = i;
+		msg.payload.state.num = 0;
+		if (vhost_user_send(vu, VHOST_USER_GET_VRING_BASE, &msg,
+		    sizeof(msg.payload.state), NULL, 0) < 0 ||
+		    vhost_user_recv(vu, VHOST_USER_GET_VRING_BASE, &msg) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Only reached for kicks VHM didn't signal on the eventfd the backend
+ * has, or that came in before DRIVER_OK.
+ */
+void
+vhost_user_kick(struct vhost_user *vu, struct virtio_vq_info *vq)
+{
+	uint64_t cnt = 1;
+	int fd;
+
+	if (vq->num >= vu->nvq)
+		return;
+	fd = vu->started ? vu->kick[vq->num] : vu->kickfd[vq->num];
+	if (write(fd, &cnt, sizeof(cnt)) < 0)
+		DPRINTF(("vhost-user: kick %d failed\n\r", vq->num));
+}
@@ -27,13 +27,24 @@
 #include <sys/cdefs.h>
 #include <sys/param.h>
 #include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "dm.h"
+#include "vmmapi.h"
+#include "mevent.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "exitprof.h"
+#include "monitor.h"
+#include "dm_trace.h"
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -47,6 +58,24 @@
  */
 #define DEV_STRUCT(vs) ((void *)(vs))
 
+#define	GB	(1024 * 1024 * 1024UL)
+
+static void
+virtio_monitor_dump(int fd, void *arg)
+{
+	struct pci_vdev *dev = arg;
+	struct virtio_base *base = dev->arg;
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		dprintf(fd, "queue %d kicks %lu interrupts %lu\n", i,
+			__atomic_load_n(&vq->kicks, __ATOMIC_RELAXED),
+			__atomic_load_n(&vq->intrs, __ATOMIC_RELAXED));
+	}
+}
+
 /*
  * Link a virtio_base to its constants, the virtio device, and
  * the PCI emulation.
@@ -68,7 +97,644 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	for (i = 0; i < vops->nvq; i++) {
 		queues[i].base = base;
 		queues[i].num = i;
+		queues[i].ioeventfd = -1;
+		queues[i].irqfd = -1;
+		queues[i].coal_fd = -1;
+	}
+
+	/* dropped by the PCI core when the device goes away */
+	monitor_register(dev->name, virtio_monitor_dump, dev);
+}
+
+/*
+ * An iothread drains the queues of the devices attached to it, in
+ * the order they were kicked.  Each queue is on the list at most
+ * once; a kick while its handler runs queues it again.
+ *
+ * With poll_ns set, a queue that has been handled goes on the polled
+ * list with its kicks turned off, and the thread spins on the polled
+ * avail rings while it has nothing else to do.  Going poll_ns without
+ * finding a chain turns their kicks back on before it sleeps.
+ */
+struct virtio_iothread {
+	pthread_t tid;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;		/* kicked queues or stop */
+	pthread_cond_t idle;		/* cur handler done */
+	struct virtio_vq_info *head;
+	struct virtio_vq_info **tail;
+	struct virtio_vq_info *cur;	/* handler running for this queue */
+	int id;				/* -1 if private to one device */
+	int refcnt;
+	int stop;
+	uint64_t poll_ns;		/* 0: sleep as soon as idle */
+	struct virtio_vq_info *polled;	/* queues with kicks off */
+};
+
+static struct virtio_iothread *virtio_iothreads[VIRTIO_IOTHREAD_MAX];
+static pthread_mutex_t virtio_iothreads_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void virtio_vq_handle(struct virtio_base *, struct virtio_vq_info *);
+
+static uint64_t
+virtio_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Called with iot->mtx held */
+static void
+virtio_iothread_queue(struct virtio_iothread *iot, struct virtio_vq_info *vq)
+{
+	if (vq->iot_queued)
+		return;
+	vq->iot_queued = 1;
+	vq->iot_next = NULL;
+	*iot->tail = vq;
+	iot->tail = &vq->iot_next;
+}
+
+/*
+ * Called with iot->mtx held and nothing queued: spin on the polled
+ * queues until one has chains, returning 1, or poll_ns passes, when
+ * kicks are turned back on and 0 is returned unless that found some.
+ * avail->idx is only peeked at, vq_has_descs() caches it unlocked.
+ */
+static int
+virtio_iothread_poll(struct virtio_iothread *iot)
+{
+	struct virtio_vq_info *vq;
+	uint64_t deadline;
+	int pending;
+
+	deadline = virtio_now() + iot->poll_ns;
+	do {
+		for (vq = iot->polled; vq != NULL; vq = vq->iot_poll_next) {
+			if (vq_ring_ready(vq) && vq->last_avail !=
+			    *(volatile uint16_t *)&vq->avail->idx)
+				virtio_iothread_queue(iot, vq);
+		}
+		if (iot->head != NULL || iot->stop)
+			return 1;
+		pthread_mutex_unlock(&iot->mtx);
+		__builtin_ia32_pause();
+		pthread_mutex_lock(&iot->mtx);
+	} while (iot->head == NULL && virtio_now() < deadline);
+
+	while (iot->head == NULL && (vq = iot->polled) != NULL) {
+		iot->polled = vq->iot_poll_next;
+		vq->iot_polled = 0;
+
+		/* as for a handler, detach waits while it is cur */
+		iot->cur = vq;
+		pthread_mutex_unlock(&iot->mtx);
+		VIRTIO_BASE_LOCK(vq->base);
+		pending = vq_kick_enable(vq);
+		VIRTIO_BASE_UNLOCK(vq->base);
+		pthread_mutex_lock(&iot->mtx);
+		iot->cur = NULL;
+		pthread_cond_broadcast(&iot->idle);
+
+		if (pending)
+			virtio_iothread_queue(iot, vq);
+	}
+	return iot->head != NULL;
+}
+
+static void *
+virtio_iothread_loop(void *arg)
+{
+	struct virtio_iothread *iot = arg;
+	struct virtio_vq_info *vq;
+	struct virtio_base *base;
+	int poll;
+
+	pthread_mutex_lock(&iot->mtx);
+	for (;;) {
+		while (iot->head == NULL && !iot->stop) {
+			if (iot->polled != NULL && virtio_iothread_poll(iot))
+				continue;
+			pthread_cond_wait(&iot->cond, &iot->mtx);
+		}
+		if (iot->stop)
+			break;
+
+		vq = iot->head;
+		iot->head = vq->iot_next;
+		if (iot->head == NULL)
+			iot->tail = &iot->head;
+		vq->iot_queued = 0;
+		iot->cur = vq;
+		pthread_mutex_unlock(&iot->mtx);
+
+		base = vq->base;
+		poll = 0;
+		VIRTIO_BASE_LOCK(base);
+		virtio_vq_handle(base, vq);
+		/*
+		 * A handler that left chains behind waits on something
+		 * else, e.g. rx buffers for frames yet to come, and
+		 * keeps its own kick state.
+		 */
+		if (iot->poll_ns && vq_ring_ready(vq) && !vq_has_descs(vq)) {
+			/* the handler let the guest kick again */
+			vq_kick_disable(vq);
+			poll = 1;
+		}
+		VIRTIO_BASE_UNLOCK(base);
+
+		pthread_mutex_lock(&iot->mtx);
+		if (poll && !vq->iot_polled) {
+			vq->iot_polled = 1;
+			vq->iot_poll_next = iot->polled;
+			iot->polled = vq;
+		}
+		iot->cur = NULL;
+		pthread_cond_broadcast(&iot->idle);
+	}
+	pthread_mutex_unlock(&iot->mtx);
+	return NULL;
+}
+
+static struct virtio_iothread *
+virtio_iothread_create(int id, const char *name)
+{
+	struct virtio_iothread *iot;
+	char tname[MAXCOMLEN + 1];
+
+	iot = calloc(1, sizeof(*iot));
+	if (iot == NULL)
+		return NULL;
+	pthread_mutex_init(&iot->mtx, NULL);
+	pthread_cond_init(&iot->cond, NULL);
+	pthread_cond_init(&iot->idle, NULL);
+	iot->tail = &iot->head;
+	iot->id = id;
+	if (pthread_create(&iot->tid, NULL, virtio_iothread_loop, iot)) {
+		pthread_cond_destroy(&iot->idle);
+		pthread_cond_destroy(&iot->cond);
+		pthread_mutex_destroy(&iot->mtx);
+		free(iot);
+		return NULL;
+	}
+	if (id >= 0)
+		snprintf(tname, sizeof(tname), "virtio-io%d", id);
+	else
+		snprintf(tname, sizeof(tname), "%.12s-io", name);
+	pthread_setname_np(iot->tid, tname);
+	return iot;
+}
+
+static void
+virtio_iothread_destroy(struct virtio_iothread *iot)
+{
+	pthread_mutex_lock(&iot->mtx);
+	iot->stop = 1;
+	pthread_cond_signal(&iot->cond);
+	pthread_mutex_unlock(&iot->mtx);
+	pthread_join(iot->tid, NULL);
+
+	pthread_cond_destroy(&iot->idle);
+	pthread_cond_destroy(&iot->cond);
+	pthread_mutex_destroy(&iot->mtx);
+	free(iot);
+}
+
+int
+virtio_iothread_attach(struct virtio_base *base, int id)
+{
+	struct virtio_iothread *iot;
+
+	if (id < -1 || id >= VIRTIO_IOTHREAD_MAX || base->iothread != NULL)
+		return -1;
+
+	pthread_mutex_lock(&virtio_iothreads_mtx);
+	iot = id >= 0 ? virtio_iothreads[id] : NULL;
+	if (iot == NULL) {
+		iot = virtio_iothread_create(id, base->vops->name);
+		if (iot == NULL) {
+			pthread_mutex_unlock(&virtio_iothreads_mtx);
+			return -1;
+		}
+		if (id >= 0)
+			virtio_iothreads[id] = iot;
+	}
+	iot->refcnt++;
+	pthread_mutex_unlock(&virtio_iothreads_mtx);
+
+	base->iothread = iot;
+	return 0;
+}
+
+void
+virtio_iothread_detach(struct virtio_base *base)
+{
+	struct virtio_iothread *iot = base->iothread;
+	struct virtio_vq_info **vqp;
+
+	if (iot == NULL)
+		return;
+
+	pthread_mutex_lock(&iot->mtx);
+	for (vqp = &iot->head; *vqp != NULL; ) {
+		if ((*vqp)->base == base) {
+			(*vqp)->iot_queued = 0;
+			*vqp = (*vqp)->iot_next;
+		} else
+			vqp = &(*vqp)->iot_next;
+	}
+	iot->tail = vqp;
+	for (vqp = &iot->polled; *vqp != NULL; ) {
+		if ((*vqp)->base == base) {
+			(*vqp)->iot_polled = 0;
+			*vqp = (*vqp)->iot_poll_next;
+		} else
+			vqp = &(*vqp)->iot_poll_next;
+	}
+	while (iot->cur != NULL && iot->cur->base == base)
+		pthread_cond_wait(&iot->idle, &iot->mtx);
+	base->iothread = NULL;
+	pthread_mutex_unlock(&iot->mtx);
+
+	pthread_mutex_lock(&virtio_iothreads_mtx);
+	if (--iot->refcnt == 0) {
+		if (iot->id >= 0)
+			virtio_iothreads[iot->id] = NULL;
+		virtio_iothread_destroy(iot);
+	}
+	pthread_mutex_unlock(&virtio_iothreads_mtx);
+}
+
+int
+virtio_iothread_set_poll(struct virtio_base *base, int usec, int cpu)
+{
+	struct virtio_iothread *iot = base->iothread;
+	cpu_set_t set;
+
+	if (iot == NULL)
+		return -1;
+
+	pthread_mutex_lock(&iot->mtx);
+	iot->poll_ns = MAX(iot->poll_ns, usec * 1000UL);
+	pthread_mutex_unlock(&iot->mtx);
+
+	if (cpu < 0)
+		return 0;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(iot->tid, sizeof(set), &set) ? -1 : 0;
+}
+
+int
+virtio_parse_poll(const char *val, int *usec, int *cpu)
+{
+	char *end;
+
+	*usec = strtol(val, &end, 10);
+	if (end == val || *usec < 1 || *usec > 1000000)
+		return -1;
+	*cpu = -1;
+	if (*end == '@') {
+		val = end + 1;
+		*cpu = strtol(val, &end, 10);
+		if (end == val || *cpu < 0 || *cpu >= CPU_SETSIZE)
+			return -1;
 	}
+	return *end == '\0' ? 0 : -1;
+}
+
+int
+virtio_parse_iothread(const char *opt, int *id)
+{
+	char *end;
+
+	if (strncmp(opt, "iothread", 8))
+		return 0;
+	if (opt[8] == '\0') {
+		*id = -1;
+		return 1;
+	}
+	if (opt[8] != '=')
+		return 0;
+	*id = strtol(opt + 9, &end, 10);
+	if (end == opt + 9 || *end != '\0' || *id < 0 ||
+	    *id >= VIRTIO_IOTHREAD_MAX)
+		return -1;
+	return 1;
+}
+
+static void
+virtio_iothread_kick(struct virtio_iothread *iot, struct virtio_vq_info *vq)
+{
+	pthread_mutex_lock(&iot->mtx);
+	if (!vq->iot_queued) {
+		virtio_iothread_queue(iot, vq);
+		pthread_cond_signal(&iot->cond);
+	}
+	pthread_mutex_unlock(&iot->mtx);
+}
+
+static void
+virtio_vq_handle(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (base->vops->qnotify)
+		(*base->vops->qnotify)(DEV_STRUCT(base), vq);
+	else
+		fprintf(stderr,
+		    "%s: qnotify queue %d: missing vq/vops notify\r\n",
+			base->vops->name, vq->num);
+}
+
+static void
+virtio_vq_notify(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	__atomic_add_fetch(&vq->kicks, 1, __ATOMIC_RELAXED);
+	if (base->iothread)
+		virtio_iothread_kick(base->iothread, vq);
+	else
+		virtio_vq_handle(base, vq);
+}
+
+/*
+ * Called on the mevent thread when the guest kicked a queue whose
+ * QNOTIFY write was absorbed by VHM and signalled on the eventfd.
+ */
+static void
+virtio_ioeventfd_handler(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	struct virtio_base *base = vq->base;
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	VIRTIO_BASE_LOCK(base);
+	virtio_vq_notify(base, vq);
+	VIRTIO_BASE_UNLOCK(base);
+}
+
+static int
+virtio_ioeventfd_assign(struct virtio_base *base, struct virtio_vq_info *vq,
+			uint64_t bar, int deassign)
+{
+	struct acrn_ioeventfd ioeventfd;
+
+	bzero(&ioeventfd, sizeof(ioeventfd));
+	ioeventfd.fd = vq->ioeventfd;
+	ioeventfd.flags = ACRN_IOEVENTFD_FLAG_PIO |
+			  ACRN_IOEVENTFD_FLAG_DATAMATCH;
+	if (deassign)
+		ioeventfd.flags |= ACRN_IOEVENTFD_FLAG_DEASSIGN;
+	ioeventfd.addr = bar + VIRTIO_CR_QNOTIFY;
+	ioeventfd.len = 2;
+	ioeventfd.data = vq->num;
+
+	return vm_ioeventfd(base->dev->vmctx, &ioeventfd);
+}
+
+/*
+ * Bind the QNOTIFY register of a queue to an eventfd once the queue
+ * is set up, so kicks go straight to the mevent thread.
+ */
+static void
+virtio_ioeventfd_bind(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (!(base->flags & VIRTIO_USE_IOEVENTFD) || vq->ioeventfd >= 0)
+		return;
+
+	vq->ioeventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (vq->ioeventfd < 0)
+		return;
+
+	if (virtio_ioeventfd_assign(base, vq, base->dev->bar[0].addr, 0) < 0) {
+		/* Not supported by VHM, keep trapping QNOTIFY */
+		close(vq->ioeventfd);
+		vq->ioeventfd = -1;
+		return;
+	}
+
+	vq->ioevent = mevent_add(vq->ioeventfd, EVF_READ,
+				 virtio_ioeventfd_handler, vq);
+	if (vq->ioevent == NULL) {
+		virtio_ioeventfd_assign(base, vq, base->dev->bar[0].addr, 1);
+		close(vq->ioeventfd);
+		vq->ioeventfd = -1;
+	}
+}
+
+static void
+virtio_ioeventfd_unbind(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq->ioeventfd < 0)
+		return;
+
+	virtio_ioeventfd_assign(base, vq, base->dev->bar[0].addr, 1);
+	mevent_delete_close(vq->ioevent);
+	vq->ioevent = NULL;
+	vq->ioeventfd = -1;
+}
+
+/*
+ * The guest moved BAR0: move the QNOTIFY bindings along with it. A
+ * queue the new address can't be bound for traps QNOTIFY again.
+ */
+void
+virtio_pci_update_bar_map(struct vmctx *ctx, struct pci_vdev *dev,
+			  int baridx, uint64_t orig_addr)
+{
+	struct virtio_base *base = dev->arg;
+	struct virtio_vq_info *vq;
+	int i;
+
+	if (baridx != 0 || base == NULL)
+		return;
+
+	VIRTIO_BASE_LOCK(base);
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (vq->ioeventfd < 0)
+			continue;
+		virtio_ioeventfd_assign(base, vq, orig_addr, 1);
+		if (virtio_ioeventfd_assign(base, vq, dev->bar[0].addr,
+					    0) == 0)
+			continue;
+		mevent_delete_close(vq->ioevent);
+		vq->ioevent = NULL;
+		vq->ioeventfd = -1;
+		/* for a kick still sitting in the eventfd */
+		virtio_vq_notify(base, vq);
+	}
+	VIRTIO_BASE_UNLOCK(base);
+}
+
+static int
+virtio_irqfd_assign(struct virtio_base *base, struct virtio_vq_info *vq,
+		    uint64_t addr, uint32_t data, int deassign)
+{
+	struct acrn_irqfd irqfd;
+
+	bzero(&irqfd, sizeof(irqfd));
+	irqfd.fd = vq->irqfd;
+	if (deassign)
+		irqfd.flags = ACRN_IRQFD_FLAG_DEASSIGN;
+	irqfd.msi.msi_addr = addr;
+	irqfd.msi.msi_data = data;
+
+	return vm_irqfd(base->dev->vmctx, &irqfd);
+}
+
+static void
+virtio_irqfd_unbind(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq->irqfd < 0)
+		return;
+
+	virtio_irqfd_assign(base, vq, vq->irqfd_addr, vq->irqfd_data, 1);
+	close(vq->irqfd);
+	vq->irqfd = -1;
+}
+
+int
+vq_irqfd_interrupt(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct pci_vdev *dev = base->dev;
+	struct msix_table_entry *mte;
+	uint64_t cnt = 1;
+
+	if (!(base->flags & VIRTIO_USE_IRQFD))
+		return -1;
+
+	/* Let pci_generate_msix() sort out masked and invalid vectors */
+	if (dev->msix.function_mask || vq->msix_idx >= dev->msix.table_count)
+		return -1;
+	mte = &dev->msix.table[vq->msix_idx];
+	if (mte->vector_control & PCIM_MSIX_VCTRL_MASK)
+		return -1;
+
+	if (vq->irqfd >= 0 && (vq->irqfd_addr != mte->addr ||
+	    vq->irqfd_data != mte->msg_data))
+		virtio_irqfd_unbind(base, vq);
+
+	if (vq->irqfd < 0) {
+		vq->irqfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (vq->irqfd < 0)
+			return -1;
+		if (virtio_irqfd_assign(base, vq, mte->addr,
+		    mte->msg_data, 0) < 0) {
+			/* Not supported by VHM, stop trying */
+			close(vq->irqfd);
+			vq->irqfd = -1;
+			base->flags &= ~VIRTIO_USE_IRQFD;
+			return -1;
+		}
+		vq->irqfd_addr = mte->addr;
+		vq->irqfd_data = mte->msg_data;
+	}
+
+	return write(vq->irqfd, &cnt, sizeof(cnt)) == sizeof(cnt) ? 0 : -1;
+}
+
+/*
+ * Runs on the mevent thread when an interrupt held back by
+ * vq_endchains() has waited coal_usec.
+ */
+static void
+virtio_coalesce_handler(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	uint64_t cnt;
+	int intr;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	pthread_mutex_lock(&vq->coal_mtx);
+	intr = vq->coal_armed && vq_ring_ready(vq);
+	vq->coal_armed = 0;
+	if (intr)
+		vq->save_used = vq->coal_idx;
+	pthread_mutex_unlock(&vq->coal_mtx);
+
+	if (intr)
+		vq_interrupt(vq->base, vq);
+}
+
+static void
+virtio_coalesce_bind(struct virtio_vq_info *vq)
+{
+	if (vq->coal_max == 0 || vq->coal_fd >= 0)
+		return;
+
+	vq->coal_armed = 0;
+	vq->coal_idx = 0;
+	vq->coal_fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (vq->coal_fd < 0)
+		return;
+
+	vq->coal_ev = mevent_add(vq->coal_fd, EVF_READ,
+				 virtio_coalesce_handler, vq);
+	if (vq->coal_ev == NULL) {
+		fprintf(stderr, "%s: queue %d: no coalescing timer\r\n",
+			vq->base->vops->name, vq->num);
+		close(vq->coal_fd);
+		vq->coal_fd = -1;
+	}
+}
+
+static void
+virtio_coalesce_unbind(struct virtio_vq_info *vq)
+{
+	if (vq->coal_fd < 0)
+		return;
+
+	pthread_mutex_lock(&vq->coal_mtx);
+	vq->coal_armed = 0;
+	pthread_mutex_unlock(&vq->coal_mtx);
+	mevent_delete_close(vq->coal_ev);
+	vq->coal_ev = NULL;
+	vq->coal_fd = -1;
+}
+
+int
+vq_set_coalesce(struct virtio_vq_info *vq, int max, int usec)
+{
+	if (max < 0 || max > UINT16_MAX || usec < 0 || usec > 1000000 ||
+	    (max > 1 && usec == 0))
+		return -1;
+
+	if (max <= 1) {
+		vq->coal_max = 0;
+		return 0;
+	}
+	if (vq->coal_max == 0)
+		pthread_mutex_init(&vq->coal_mtx, NULL);
+	vq->coal_max = max;
+	vq->coal_usec = usec;
+	return 0;
+}
+
+int
+virtio_parse_coalesce(const char *val, int *max, int *usec)
+{
+	char *end;
+
+	*max = strtol(val, &end, 10);
+	if (end == val || *end != ':')
+		return -1;
+	val = end + 1;
+	*usec = strtol(val, &end, 10);
+	if (end == val || *end != '\0')
+		return -1;
+	if (*max < 0 || *max > UINT16_MAX || *usec < 1 || *usec > 1000000)
+		return -1;
+	return 0;
 }
 
 /*
@@ -91,14 +757,24 @@ virtio_reset_dev(struct virtio_base *base)
 
 	nvq = base->vops->nvq;
 	for (vq = base->queues, i = 0; i < nvq; vq++, i++) {
+		virtio_ioeventfd_unbind(base, vq);
+		virtio_irqfd_unbind(base, vq);
+		virtio_coalesce_unbind(vq);
 		vq->flags = 0;
 		vq->last_avail = 0;
+		vq->avail_idx = 0;
+		vq->used_idx = 0;
 		vq->save_used = 0;
 		vq->pfn = 0;
+		vq->gpa_desc = 0;
+		vq->gpa_avail = 0;
+		vq->gpa_used = 0;
 		vq->msix_idx = VIRTIO_MSI_NO_VECTOR;
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
+	base->dfselect = 0;
+	base->gfselect = 0;
 	/* base->status = 0; -- redundant */
 	if (base->isr)
 		pci_lintr_deassert(base->dev);
@@ -122,6 +798,66 @@ virtio_set_io_bar(struct virtio_base *base, int barnum)
 	pci_emul_alloc_bar(base->dev, barnum, PCIBAR_IO, size);
 }
 
+static int
+virtio_add_modern_cap(struct virtio_base *base, int barnum, int type,
+		      uint32_t offset, uint32_t length)
+{
+	struct virtio_pci_notify_cap ncap;
+	struct virtio_pci_cap *cap = &ncap.cap;
+	int caplen;
+
+	memset(&ncap, 0, sizeof(ncap));
+	caplen = sizeof(*cap);
+	if (type == VIRTIO_PCI_CAP_NOTIFY_CFG) {
+		ncap.notify_off_multiplier = VIRTIO_MODERN_NOTIFY_MUL;
+		caplen = sizeof(ncap);
+	}
+	cap->cap_vndr = PCIY_VENDOR;
+	cap->cap_len = caplen;
+	cap->cfg_type = type;
+	cap->bar = barnum;
+	cap->offset = offset;
+	cap->length = length;
+
+	return pci_emul_add_capability(base->dev, (u_char *)&ncap, caplen);
+}
+
+/*
+ * Set a memory BAR for the modern registers, see virtio.h for the
+ * layout.  The device config is offered whole; a zero cfgsize still
+ * gets a page so the capability is not empty.
+ */
+int
+virtio_set_modern_bar(struct virtio_base *base, int barnum)
+{
+	struct virtio_ops *vops = base->vops;
+	uint32_t cfglen;
+
+	assert(vops->nvq * VIRTIO_MODERN_NOTIFY_MUL <=
+	       VIRTIO_MODERN_BARSZ - VIRTIO_MODERN_NOTIFY);
+	assert(vops->cfgsize <= VIRTIO_MODERN_NOTIFY - VIRTIO_MODERN_DEVICE);
+
+	cfglen = vops->cfgsize ? vops->cfgsize :
+		 VIRTIO_MODERN_NOTIFY - VIRTIO_MODERN_DEVICE;
+	if (pci_emul_alloc_bar(base->dev, barnum, PCIBAR_MEM32,
+			       VIRTIO_MODERN_BARSZ) ||
+	    virtio_add_modern_cap(base, barnum, VIRTIO_PCI_CAP_COMMON_CFG,
+				  VIRTIO_MODERN_COMMON,
+				  VIRTIO_COMMON_Q_USEDHI + 4) ||
+	    virtio_add_modern_cap(base, barnum, VIRTIO_PCI_CAP_ISR_CFG,
+				  VIRTIO_MODERN_ISR, 1) ||
+	    virtio_add_modern_cap(base, barnum, VIRTIO_PCI_CAP_DEVICE_CFG,
+				  VIRTIO_MODERN_DEVICE, cfglen) ||
+	    virtio_add_modern_cap(base, barnum, VIRTIO_PCI_CAP_NOTIFY_CFG,
+				  VIRTIO_MODERN_NOTIFY,
+				  vops->nvq * VIRTIO_MODERN_NOTIFY_MUL))
+		return -1;
+
+	base->modern_bar = barnum;
+	base->flags |= VIRTIO_USE_MODERN;
+	return 0;
+}
+
 /*
  * Initialize MSI-X vector capabilities if we're to use MSI-X,
  * or MSI capabilities if not.
@@ -167,6 +903,47 @@ virtio_interrupt_init(struct virtio_base *base, int use_msix)
 	return virtio_intr_init(base, 1, use_msix);
 }
 
+/*
+ * Guest memory is one mapping at ctx->baseaddr with a hole between
+ * lowmem and 4GB, so a descriptor can be translated with a base add
+ * and a bounds check against limits taken from the vmctx once, here,
+ * rather than going through vm_map_gpa() for each one.
+ */
+static void
+virtio_vq_map_init(struct virtio_vq_info *vq, struct vmctx *ctx)
+{
+	vq->gpa_base = ctx->baseaddr;
+	vq->lowmem_end = ctx->lowmem;
+	vq->highmem_end = ctx->highmem ? 4 * GB + ctx->highmem : 0;
+}
+
+static inline void *
+vq_gpa2hva(struct virtio_vq_info *vq, uint64_t gpa, uint64_t len)
+{
+	if (gpa < vq->lowmem_end) {
+		if (len <= vq->lowmem_end - gpa)
+			return vq->gpa_base + gpa;
+	} else if (gpa >= 4 * GB && gpa < vq->highmem_end) {
+		if (len <= vq->highmem_end - gpa)
+			return vq->gpa_base + gpa;
+	}
+	return NULL;
+}
+
+/* Mark queue as allocated, and start at 0 when we use it. */
+static void
+virtio_vq_start(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	vq->flags = VQ_ALLOC;
+	vq->last_avail = 0;
+	vq->avail_idx = 0;
+	vq->used_idx = 0;
+	vq->save_used = 0;
+
+	virtio_vq_map_init(vq, base->dev->vmctx);
+	virtio_coalesce_bind(vq);
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us a page frame number, from which we can
@@ -197,13 +974,34 @@ virtio_vq_init(struct virtio_base *base, uint32_t pfn)
 	/* Then it's rounded up to the next page... */
 	vb = (char *)roundup2((uintptr_t)vb, VRING_ALIGN);
 
-	/* ... and the last page(s) are the used ring. */
-	vq->used = (struct vring_used *)vb;
+	/* ... and the last page(s) are the used ring. */
+	vq->used = (struct vring_used *)vb;
+
+	virtio_vq_start(base, vq);
+	virtio_ioeventfd_bind(base, vq);
+}
+
+/*
+ * Modern guests place the three parts of the ring independently and
+ * then set queue_enable.
+ */
+static int
+virtio_vq_enable(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct vmctx *ctx = base->dev->vmctx;
+
+	vq->desc = paddr_guest2host(ctx, vq->gpa_desc,
+				    vq->qsize * sizeof(struct virtio_desc));
+	vq->avail = paddr_guest2host(ctx, vq->gpa_avail,
+				     (3 + vq->qsize) * sizeof(uint16_t));
+	vq->used = paddr_guest2host(ctx, vq->gpa_used,
+				    3 * sizeof(uint16_t) +
+				    vq->qsize * sizeof(struct virtio_used));
+	if (vq->desc == NULL || vq->avail == NULL || vq->used == NULL)
+		return -1;
 
-	/* Mark queue as allocated, and start at 0 when we use it. */
-	vq->flags = VQ_ALLOC;
-	vq->last_avail = 0;
-	vq->save_used = 0;
+	virtio_vq_start(base, vq);
+	return 0;
 }
 
 /*
@@ -211,12 +1009,12 @@ virtio_vq_init(struct virtio_base *base, uint32_t pfn)
  * descriptor.
  */
 static inline void
-_vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
+_vq_record(int i, volatile struct virtio_desc *vd, struct virtio_vq_info *vq,
 	   struct iovec *iov, int n_iov, uint16_t *flags) {
 
 	if (i >= n_iov)
 		return;
-	iov[i].iov_base = paddr_guest2host(ctx, vd->addr, vd->len);
+	iov[i].iov_base = vq_gpa2hva(vq, vd->addr, vd->len);
 	iov[i].iov_len = vd->len;
 	if (flags != NULL)
 		flags[i] = vd->flags;
@@ -262,16 +1060,15 @@ _vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
  * You are assumed to have done a vq_ring_ready() if needed (note
  * that vq_has_descs() does one).
  */
-int
-vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
-	    struct iovec *iov, int n_iov, uint16_t *flags)
+static int
+vq_getchain_one(struct virtio_vq_info *vq, uint16_t *pidx,
+		struct iovec *iov, int n_iov, uint16_t *flags)
 {
 	int i;
 	u_int ndesc, n_indir;
 	u_int idx, next;
 
 	volatile struct virtio_desc *vdir, *vindir, *vp;
-	struct vmctx *ctx;
 	struct virtio_base *base;
 	const char *name;
 
@@ -290,9 +1087,14 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	 *
 	 * We just need to do the subtraction as an unsigned int,
 	 * then trim off excess bits.
+	 *
+	 * avail->idx sits in a cache line the guest keeps writing, so
+	 * it's only re-read once the chains we already know of are used.
 	 */
 	idx = vq->last_avail;
-	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
+	if (idx == vq->avail_idx)
+		vq->avail_idx = vq->avail->idx;
+	ndesc = (uint16_t)((u_int)vq->avail_idx - idx);
 	if (ndesc == 0)
 		return 0;
 	if (ndesc > vq->qsize) {
@@ -311,7 +1113,6 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	 * check whether we're re-visiting a previously visited
 	 * index, but we just abort if the count gets excessive.
 	 */
-	ctx = base->dev->vmctx;
 	*pidx = next = vq->avail->ring[idx & (vq->qsize - 1)];
 	vq->last_avail++;
 	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir->next) {
@@ -324,7 +1125,7 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		}
 		vdir = &vq->desc[next];
 		if ((vdir->flags & VRING_DESC_F_INDIRECT) == 0) {
-			_vq_record(i, vdir, ctx, iov, n_iov, flags);
+			_vq_record(i, vdir, vq, iov, n_iov, flags);
 			i++;
 		} else if ((base->vops->hv_caps &
 		    VIRTIO_RING_F_INDIRECT_DESC) == 0) {
@@ -342,8 +1143,14 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 				    name, (u_int)vdir->len);
 				return -1;
 			}
-			vindir = paddr_guest2host(ctx,
-			    vdir->addr, vdir->len);
+			vindir = vq_gpa2hva(vq, vdir->addr, vdir->len);
+			if (vindir == NULL) {
+				fprintf(stderr,
+				    "%s: invalid indir addr 0x%lx, "
+				    "driver confused?\r\n",
+				    name, (u_long)vdir->addr);
+				return -1;
+			}
 			/*
 			 * Indirects start at the 0th, then follow
 			 * their own embedded "next"s until those run
@@ -361,7 +1168,7 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 					    name);
 					return -1;
 				}
-				_vq_record(i, vp, ctx, iov, n_iov, flags);
+				_vq_record(i, vp, vq, iov, n_iov, flags);
 				if (++i > VQ_MAX_DESCRIPTORS)
 					goto loopy;
 				if ((vp->flags & VRING_DESC_F_NEXT) == 0)
@@ -386,6 +1193,77 @@ loopy:
 	return -1;
 }
 
+int
+vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
+	    struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	uint64_t start = 0;
+	int n;
+
+	if (exitprof_enabled)
+		start = exitprof_rdtsc();
+	n = vq_getchain_one(vq, pidx, iov, n_iov, flags);
+	if (exitprof_enabled && n > 0)
+		exitprof_probe(EXITPROF_VQ_GETCHAIN, exitprof_rdtsc() - start);
+	DM_TRACE3(vq_getchain, vq, vq->num, n);
+	return n;
+}
+
+/*
+ * Fetch up to nchains chains in one pass.  avail->idx is read once,
+ * and the head descriptor of every chain it covers is prefetched
+ * before the chains are walked one by one.
+ *
+ * The chains are packed back to back into the n_iov entries of iov[]
+ * (and flags[], if not NULL): n[k] is the descriptor count of the
+ * k'th chain and idx[k] its head.  A chain that no longer fits in
+ * what is left of iov[] is put back for the next call, unless it is
+ * the first one, which is returned as vq_getchain() would.
+ *
+ * Returns the number of chains fetched, or -1 if the first one is
+ * invalid.  An invalid chain after the first ends the batch and is
+ * left in the ring, so the next call reports it.
+ */
+int
+vq_getchains(struct virtio_vq_info *vq, uint16_t *idx,
+	     struct iovec *iov, int n_iov, uint16_t *flags,
+	     int *n, int nchains)
+{
+	uint16_t last, mask, navail;
+	int k, used;
+
+	last = vq->last_avail;
+	mask = vq->qsize - 1;
+	vq->avail_idx = vq->avail->idx;
+	navail = (uint16_t)(vq->avail_idx - last);
+	if (navail <= vq->qsize) {
+		if (nchains > navail)
+			nchains = navail;
+		for (k = 0; k < nchains; k++)
+			__builtin_prefetch((const void *)&vq->desc[
+			    vq->avail->ring[(last + k) & mask] & mask]);
+	}
+
+	used = 0;
+	for (k = 0; k < nchains && used < n_iov; k++) {
+		last = vq->last_avail;
+		n[k] = vq_getchain(vq, &idx[k], &iov[used], n_iov - used,
+				   flags ? &flags[used] : NULL);
+		if (n[k] <= 0) {
+			if (k == 0)
+				return n[k];
+			vq->last_avail = last;
+			break;
+		}
+		if (k > 0 && n[k] > n_iov - used) {
+			vq_retchain(vq);
+			break;
+		}
+		used += n[k];
+	}
+	return k;
+}
+
 /*
  * Return the currently-first request chain back to the available queue.
  *
@@ -398,6 +1276,70 @@ vq_retchain(struct virtio_vq_info *vq)
 	vq->last_avail--;
 }
 
+/*
+ * With a dirty log running, record what returning a chain wrote: the
+ * device-writable buffers, as far as iolen reaches, and the used ring.
+ * The chain was validated by vq_getchain(), so this only has to stay
+ * in bounds if the guest rewrote it since.
+ */
+static void
+vq_dirty_used(struct virtio_vq_info *vq)
+{
+	vm_dirty_mark(vq->base->dev->vmctx, (void *)vq->used,
+		      sizeof(*vq->used) +
+		      vq->qsize * sizeof(struct virtio_used) + 2);
+}
+
+static void
+vq_dirty_desc(struct vmctx *ctx, struct virtio_vq_info *vq,
+	      volatile struct virtio_desc *vd, uint32_t *iolen)
+{
+	uint32_t len;
+	void *hva;
+
+	if ((vd->flags & VRING_DESC_F_WRITE) == 0 || *iolen == 0)
+		return;
+	len = MIN(vd->len, *iolen);
+	hva = vq_gpa2hva(vq, vd->addr, len);
+	if (hva != NULL)
+		vm_dirty_mark(ctx, hva, len);
+	*iolen -= len;
+}
+
+static void
+vq_dirty_chain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
+{
+	struct vmctx *ctx = vq->base->dev->vmctx;
+	volatile struct virtio_desc *vd, *vindir;
+	uint16_t next;
+	u_int n_indir;
+	int i, j;
+
+	if (!ctx->dirty_on)
+		return;
+	vq_dirty_used(vq);
+
+	for (i = 0, next = idx; i < VQ_MAX_DESCRIPTORS && iolen > 0 &&
+	     next < vq->qsize; i++, next = vd->next) {
+		vd = &vq->desc[next];
+		if (vd->flags & VRING_DESC_F_INDIRECT) {
+			n_indir = vd->len / 16;
+			vindir = vq_gpa2hva(vq, vd->addr, vd->len);
+			if (vindir == NULL)
+				return;
+			for (j = 0, next = 0; j < n_indir && next < n_indir &&
+			     iolen > 0; j++, next = vindir[next].next) {
+				vq_dirty_desc(ctx, vq, &vindir[next], &iolen);
+				if ((vindir[next].flags & VRING_DESC_F_NEXT) == 0)
+					break;
+			}
+		} else
+			vq_dirty_desc(ctx, vq, vd, &iolen);
+		if ((vd->flags & VRING_DESC_F_NEXT) == 0)
+			return;
+	}
+}
+
 /*
  * Return specified request chain to the guest, setting its I/O length
  * to the provided value.
@@ -425,33 +1367,56 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	mask = vq->qsize - 1;
 	vuh = vq->used;
 
-	uidx = vuh->idx;
+	/* used->idx is only ever written by us: never read it back */
+	uidx = vq->used_idx;
 	vue = &vuh->ring[uidx++ & mask];
 	vue->idx = idx;
 	vue->tlen = iolen;
-	vuh->idx = uidx;
+	vuh->idx = vq->used_idx = uidx;
+	vq_dirty_chain(vq, idx, iolen);
+	DM_TRACE4(vq_relchain, vq, vq->num, idx, iolen);
 }
 
 /*
- * Driver has finished processing "available" chains and calling
- * vq_relchain on each one.  If driver used all the available
- * chains, used_all should be set.
- *
- * If the "used" index moved we may need to inform the guest, i.e.,
- * deliver an interrupt.  Even if the used index did NOT move we
- * may need to deliver an interrupt, if the avail ring is empty and
- * we are supposed to interrupt on empty.
- *
- * Note that used_all_avail is provided by the caller because it's
- * a snapshot of the ring state when he decided to finish interrupt
- * processing -- it's possible that descriptors became available after
- * that point.  (It's also typically a constant 1/True as well.)
+ * Return several chains to the guest, publishing them with a single
+ * update of the used index.
  */
 void
-vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
+vq_relchains(struct virtio_vq_info *vq, uint16_t *idx, uint32_t *iolen,
+	     int n)
+{
+	uint16_t uidx, mask;
+	volatile struct vring_used *vuh;
+	volatile struct virtio_used *vue;
+	int i;
+
+	mask = vq->qsize - 1;
+	vuh = vq->used;
+
+	uidx = vq->used_idx;
+	for (i = 0; i < n; i++) {
+		vue = &vuh->ring[uidx++ & mask];
+		vue->idx = idx[i];
+		vue->tlen = iolen[i];
+	}
+	/* entries must be visible before the index moves */
+	mb();
+	vuh->idx = vq->used_idx = uidx;
+	for (i = 0; i < n; i++)
+		vq_dirty_chain(vq, idx[i], iolen[i]);
+	DM_TRACE3(vq_relchains, vq, vq->num, n);
+}
+
+/*
+ * Does moving the used index from old_idx to new_idx call for an
+ * interrupt?
+ */
+static int
+vq_need_intr(struct virtio_vq_info *vq, uint16_t old_idx, uint16_t new_idx,
+	     int used_all_avail)
 {
 	struct virtio_base *base;
-	uint16_t event_idx, new_idx, old_idx;
+	uint16_t event_idx;
 	int intr;
 
 	/*
@@ -464,8 +1429,6 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	 * entire avail was processed, we need to interrupt always.
 	 */
 	base = vq->base;
-	old_idx = vq->save_used;
-	vq->save_used = new_idx = vq->used->idx;
 	if (used_all_avail &&
 	    (base->negotiated_caps & VIRTIO_F_NOTIFY_ON_EMPTY))
 		intr = 1;
@@ -481,8 +1444,117 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 		intr = new_idx != old_idx &&
 		    !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
 	}
+	return intr;
+}
+
+/*
+ * With coalescing, an interrupt that's due is held back until
+ * coal_max used entries have built up since the last one sent, or
+ * until the timer armed when it was first held back expires.
+ * save_used only moves when an interrupt is sent, so the EVENT_IDX
+ * test covers everything that was held back.
+ */
+static void
+vq_endchains_coalesced(struct virtio_vq_info *vq, int used_all_avail)
+{
+	struct itimerspec its;
+	uint16_t new_idx, old_idx;
+	int intr;
+
+	memset(&its, 0, sizeof(its));
+	pthread_mutex_lock(&vq->coal_mtx);
+	old_idx = vq->save_used;
+	vq->coal_idx = new_idx = vq->used_idx;
+	intr = vq_need_intr(vq, old_idx, new_idx, used_all_avail);
+	DM_TRACE4(vq_endchains, vq, vq->num, (uint16_t)(new_idx - old_idx),
+		  intr);
+	if (intr && (uint16_t)(new_idx - old_idx) < vq->coal_max) {
+		DM_TRACE2(vq_intr_held, vq, vq->num);
+		if (!vq->coal_armed) {
+			its.it_value.tv_sec = vq->coal_usec / 1000000;
+			its.it_value.tv_nsec = (vq->coal_usec % 1000000) * 1000;
+			timerfd_settime(vq->coal_fd, 0, &its, NULL);
+			vq->coal_armed = 1;
+		}
+		pthread_mutex_unlock(&vq->coal_mtx);
+		return;
+	}
+	vq->save_used = new_idx;
+	if (intr && vq->coal_armed) {
+		timerfd_settime(vq->coal_fd, 0, &its, NULL);
+		vq->coal_armed = 0;
+	}
+	pthread_mutex_unlock(&vq->coal_mtx);
+
+	if (intr)
+		vq_interrupt(vq->base, vq);
+}
+
+/*
+ * Driver has finished processing "available" chains and calling
+ * vq_relchain on each one.  If driver used all the available
+ * chains, used_all should be set.
+ *
+ * If the "used" index moved we may need to inform the guest, i.e.,
+ * deliver an interrupt.  Even if the used index did NOT move we
+ * may need to deliver an interrupt, if the avail ring is empty and
+ * we are supposed to interrupt on empty.
+ *
+ * Note that used_all_avail is provided by the caller because it's
+ * a snapshot of the ring state when he decided to finish interrupt
+ * processing -- it's possible that descriptors became available after
+ * that point.  (It's also typically a constant 1/True as well.)
+ */
+void
+vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
+{
+	uint16_t new_idx, old_idx;
+	int intr;
+
+	if (vq->coal_fd >= 0) {
+		vq_endchains_coalesced(vq, used_all_avail);
+		return;
+	}
+
+	old_idx = vq->save_used;
+	vq->save_used = new_idx = vq->used_idx;
+	intr = vq_need_intr(vq, old_idx, new_idx, used_all_avail);
+	DM_TRACE4(vq_endchains, vq, vq->num, (uint16_t)(new_idx - old_idx),
+		  intr);
 	if (intr)
-		vq_interrupt(base, vq);
+		vq_interrupt(vq->base, vq);
+}
+
+/*
+ * Kick suppression, the guest-to-host half of what vq_endchains()
+ * does for interrupts.  With EVENT_IDX the guest only kicks when
+ * avail->idx moves past avail_event, so publishing last_avail there
+ * re-arms exactly one kick, and a stale value suppresses them.
+ */
+void
+vq_kick_disable(struct virtio_vq_info *vq)
+{
+	if (!vq_ring_ready(vq))
+		return;
+	if ((vq->base->negotiated_caps & VIRTIO_RING_F_EVENT_IDX) == 0)
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	vq_dirty_used(vq);
+}
+
+int
+vq_kick_enable(struct virtio_vq_info *vq)
+{
+	if (!vq_ring_ready(vq))
+		return 0;
+	if (vq->base->negotiated_caps & VIRTIO_RING_F_EVENT_IDX)
+		VQ_AVAIL_EVENT_IDX(vq) = vq->last_avail;
+	else
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	vq_dirty_used(vq);
+
+	/* the guest must see this before we look at avail->idx again */
+	mb();
+	return vq_has_descs(vq);
 }
 
 /* Note: these are in sorted order to make for a fast search */
@@ -504,16 +1576,38 @@ static struct config_reg {
 	{ VIRTIO_CR_QVEC,	2, 0, "QVEC" },
 };
 
+static struct config_reg common_regs[] = {
+	{ VIRTIO_COMMON_DFSELECT,	4, 0, "DFSELECT" },
+	{ VIRTIO_COMMON_DF,		4, 1, "DF" },
+	{ VIRTIO_COMMON_GFSELECT,	4, 0, "GFSELECT" },
+	{ VIRTIO_COMMON_GF,		4, 0, "GF" },
+	{ VIRTIO_COMMON_MSIX,		2, 0, "MSIX" },
+	{ VIRTIO_COMMON_NUMQ,		2, 1, "NUMQ" },
+	{ VIRTIO_COMMON_STATUS,		1, 0, "STATUS" },
+	{ VIRTIO_COMMON_CFGGEN,		1, 1, "CFGGEN" },
+	{ VIRTIO_COMMON_Q_SELECT,	2, 0, "Q_SELECT" },
+	{ VIRTIO_COMMON_Q_SIZE,		2, 0, "Q_SIZE" },
+	{ VIRTIO_COMMON_Q_MSIX,		2, 0, "Q_MSIX" },
+	{ VIRTIO_COMMON_Q_ENABLE,	2, 0, "Q_ENABLE" },
+	{ VIRTIO_COMMON_Q_NOFF,		2, 1, "Q_NOFF" },
+	{ VIRTIO_COMMON_Q_DESCLO,	4, 0, "Q_DESCLO" },
+	{ VIRTIO_COMMON_Q_DESCHI,	4, 0, "Q_DESCHI" },
+	{ VIRTIO_COMMON_Q_AVAILLO,	4, 0, "Q_AVAILLO" },
+	{ VIRTIO_COMMON_Q_AVAILHI,	4, 0, "Q_AVAILHI" },
+	{ VIRTIO_COMMON_Q_USEDLO,	4, 0, "Q_USEDLO" },
+	{ VIRTIO_COMMON_Q_USEDHI,	4, 0, "Q_USEDHI" },
+};
+
 static inline struct config_reg *
-virtio_find_cr(int offset) {
+virtio_find_reg(struct config_reg *regs, u_int nregs, int offset) {
 	u_int hi, lo, mid;
 	struct config_reg *cr;
 
 	lo = 0;
-	hi = sizeof(config_regs) / sizeof(*config_regs) - 1;
+	hi = nregs - 1;
 	while (hi >= lo) {
 		mid = (hi + lo) >> 1;
-		cr = &config_regs[mid];
+		cr = &regs[mid];
 		if (cr->offset == offset)
 			return cr;
 		if (cr->offset < offset)
@@ -524,6 +1618,237 @@ virtio_find_cr(int offset) {
 	return NULL;
 }
 
+static inline struct config_reg *
+virtio_find_cr(int offset) {
+	return virtio_find_reg(config_regs,
+			       sizeof(config_regs) / sizeof(*config_regs),
+			       offset);
+}
+
+/*
+ * The modern registers.  Only the 32-bit halves of the feature words
+ * and ring addresses are visible at a time, by select register or by
+ * offset; 64-bit accesses are split by virtio_pci_read64/write64.
+ * VIRTIO_F_RING_PACKED is never offered: vq_getchain(), vq_relchain()
+ * and the ioeventfd and event-index code only know the split ring.
+ */
+static uint32_t
+virtio_common_read(struct virtio_base *base, struct virtio_vq_info *vq,
+		   int offset)
+{
+	struct virtio_ops *vops = base->vops;
+	uint64_t caps = vops->hv_caps | VIRTIO_F_VERSION_1;
+
+	switch (offset) {
+	case VIRTIO_COMMON_DFSELECT:
+		return base->dfselect;
+	case VIRTIO_COMMON_DF:
+		return base->dfselect < 2 ? caps >> (32 * base->dfselect) : 0;
+	case VIRTIO_COMMON_GFSELECT:
+		return base->gfselect;
+	case VIRTIO_COMMON_GF:
+		return base->gfselect < 2 ?
+		       base->negotiated_caps >> (32 * base->gfselect) : 0;
+	case VIRTIO_COMMON_MSIX:
+		return base->msix_cfg_idx;
+	case VIRTIO_COMMON_NUMQ:
+		return vops->nvq;
+	case VIRTIO_COMMON_STATUS:
+		return base->status;
+	case VIRTIO_COMMON_CFGGEN:
+		return 0;
+	case VIRTIO_COMMON_Q_SELECT:
+		return base->curq;
+	}
+
+	if (vq == NULL)
+		return offset == VIRTIO_COMMON_Q_MSIX ?
+		       VIRTIO_MSI_NO_VECTOR : 0;
+
+	switch (offset) {
+	case VIRTIO_COMMON_Q_SIZE:
+		return vq->qsize;
+	case VIRTIO_COMMON_Q_MSIX:
+		return vq->msix_idx;
+	case VIRTIO_COMMON_Q_ENABLE:
+		return (vq->flags & VQ_ALLOC) != 0;
+	case VIRTIO_COMMON_Q_NOFF:
+		return vq->num;
+	case VIRTIO_COMMON_Q_DESCLO:
+		return vq->gpa_desc;
+	case VIRTIO_COMMON_Q_DESCHI:
+		return vq->gpa_desc >> 32;
+	case VIRTIO_COMMON_Q_AVAILLO:
+		return vq->gpa_avail;
+	case VIRTIO_COMMON_Q_AVAILHI:
+		return vq->gpa_avail >> 32;
+	case VIRTIO_COMMON_Q_USEDLO:
+		return vq->gpa_used;
+	case VIRTIO_COMMON_Q_USEDHI:
+		return vq->gpa_used >> 32;
+	}
+	return 0;
+}
+
+static inline void
+virtio_set_half(uint64_t *val, int hi, uint32_t half)
+{
+	if (hi)
+		*val = (*val & 0xffffffff) | (uint64_t)half << 32;
+	else
+		*val = (*val & ~0xffffffffULL) | half;
+}
+
+static void
+virtio_common_write(struct virtio_base *base, struct virtio_vq_info *vq,
+		    int offset, uint32_t value)
+{
+	struct virtio_ops *vops = base->vops;
+	uint64_t caps = vops->hv_caps | VIRTIO_F_VERSION_1;
+	const char *name = vops->name;
+
+	switch (offset) {
+	case VIRTIO_COMMON_DFSELECT:
+		base->dfselect = value;
+		return;
+	case VIRTIO_COMMON_GFSELECT:
+		base->gfselect = value;
+		return;
+	case VIRTIO_COMMON_GF:
+		if (base->gfselect < 2) {
+			virtio_set_half(&base->negotiated_caps,
+					base->gfselect, value);
+			base->negotiated_caps &= caps;
+		}
+		return;
+	case VIRTIO_COMMON_MSIX:
+		base->msix_cfg_idx = value;
+		return;
+	case VIRTIO_COMMON_STATUS:
+		/* features are complete once the guest says FEATURES_OK */
+		if ((value & VIRTIO_CR_STATUS_FEATURES_OK) &&
+		    !(base->status & VIRTIO_CR_STATUS_FEATURES_OK) &&
+		    vops->apply_features)
+			(*vops->apply_features)(DEV_STRUCT(base),
+			    base->negotiated_caps);
+		base->status = value;
+		if (vops->set_status)
+			(*vops->set_status)(DEV_STRUCT(base), value);
+		if (value == 0)
+			(*vops->reset)(DEV_STRUCT(base));
+		return;
+	case VIRTIO_COMMON_Q_SELECT:
+		base->curq = value;
+		return;
+	}
+
+	if (vq == NULL) {
+		fprintf(stderr, "%s: write to queue reg at %d: curq %d >= "
+			"max %d\r\n", name, offset, base->curq, vops->nvq);
+		return;
+	}
+
+	switch (offset) {
+	case VIRTIO_COMMON_Q_SIZE:
+		/* we don't shrink queues, the guest gets what it reads */
+		if (value != vq->qsize)
+			fprintf(stderr, "%s: queue %d size %u != %u\r\n",
+				name, vq->num, value, vq->qsize);
+		break;
+	case VIRTIO_COMMON_Q_MSIX:
+		vq->msix_idx = value;
+		break;
+	case VIRTIO_COMMON_Q_ENABLE:
+		if (value != 1 || (vq->flags & VQ_ALLOC))
+			break;
+		if (virtio_vq_enable(base, vq))
+			fprintf(stderr, "%s: queue %d is outside guest "
+				"memory\r\n", name, vq->num);
+		break;
+	case VIRTIO_COMMON_Q_DESCLO:
+	case VIRTIO_COMMON_Q_DESCHI:
+		virtio_set_half(&vq->gpa_desc,
+				offset == VIRTIO_COMMON_Q_DESCHI, value);
+		break;
+	case VIRTIO_COMMON_Q_AVAILLO:
+	case VIRTIO_COMMON_Q_AVAILHI:
+		virtio_set_half(&vq->gpa_avail,
+				offset == VIRTIO_COMMON_Q_AVAILHI, value);
+		break;
+	case VIRTIO_COMMON_Q_USEDLO:
+	case VIRTIO_COMMON_Q_USEDHI:
+		virtio_set_half(&vq->gpa_used,
+				offset == VIRTIO_COMMON_Q_USEDHI, value);
+		break;
+	}
+}
+
+static uint32_t
+virtio_modern_access(struct virtio_base *base, uint64_t offset, int size,
+		     uint32_t value, int write)
+{
+	struct virtio_ops *vops = base->vops;
+	struct virtio_vq_info *vq;
+	struct config_reg *cr;
+	uint64_t max;
+	uint32_t ret = 0;
+	int error, idx;
+
+	if (size != 1 && size != 2 && size != 4)
+		goto bad;
+
+	if (offset >= VIRTIO_MODERN_NOTIFY) {
+		idx = (offset - VIRTIO_MODERN_NOTIFY) /
+		      VIRTIO_MODERN_NOTIFY_MUL;
+		if (write && idx < vops->nvq)
+			virtio_vq_notify(base, &base->queues[idx]);
+		return 0;
+	}
+
+	if (offset >= VIRTIO_MODERN_DEVICE) {
+		offset -= VIRTIO_MODERN_DEVICE;
+		max = vops->cfgsize ? vops->cfgsize : 0x100000000;
+		if (offset + size > max)
+			goto bad;
+		if (write)
+			error = vops->cfgwrite ? (*vops->cfgwrite)(
+				DEV_STRUCT(base), offset, size, value) : -1;
+		else
+			error = vops->cfgread ? (*vops->cfgread)(
+				DEV_STRUCT(base), offset, size, &ret) : -1;
+		if (error)
+			goto bad;
+		return ret;
+	}
+
+	if (offset >= VIRTIO_MODERN_ISR) {
+		if (offset != VIRTIO_MODERN_ISR || size != 1 || write)
+			goto bad;
+		ret = base->isr;
+		base->isr = 0;		/* a read clears this flag */
+		if (ret)
+			pci_lintr_deassert(base->dev);
+		return ret;
+	}
+
+	cr = virtio_find_reg(common_regs,
+			     sizeof(common_regs) / sizeof(*common_regs),
+			     offset);
+	if (cr == NULL || cr->size != size || (write && cr->ro))
+		goto bad;
+	vq = base->curq < vops->nvq ? &base->queues[base->curq] : NULL;
+	if (write)
+		virtio_common_write(base, vq, offset, value);
+	else
+		ret = virtio_common_read(base, vq, offset);
+	return ret;
+
+bad:
+	fprintf(stderr, "%s: bad modern %s at %jd/%d\r\n", vops->name,
+		write ? "write" : "read", (uintmax_t)offset, size);
+	return size == 1 ? 0xff : size == 2 ? 0xffff : 0xffffffff;
+}
+
 /*
  * Handle pci config space reads.
  * If it's to the MSI-X info, do that.
@@ -550,6 +1875,13 @@ virtio_pci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		}
 	}
 
+	if ((base->flags & VIRTIO_USE_MODERN) && baridx == base->modern_bar) {
+		VIRTIO_BASE_LOCK(base);
+		value = virtio_modern_access(base, offset, size, 0, 0);
+		VIRTIO_BASE_UNLOCK(base);
+		return value;
+	}
+
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == 0);
 
@@ -672,6 +2004,13 @@ virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		}
 	}
 
+	if ((base->flags & VIRTIO_USE_MODERN) && baridx == base->modern_bar) {
+		VIRTIO_BASE_LOCK(base);
+		virtio_modern_access(base, offset, size, value, 1);
+		VIRTIO_BASE_UNLOCK(base);
+		return;
+	}
+
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == 0);
 
@@ -752,14 +2091,7 @@ bad:
 			goto done;
 		}
 		vq = &base->queues[value];
-		if (vq->notify)
-			(*vq->notify)(DEV_STRUCT(base), vq);
-		else if (vops->qnotify)
-			(*vops->qnotify)(DEV_STRUCT(base), vq);
-		else
-			fprintf(stderr,
-			    "%s: qnotify queue %d: missing vq/vops notify\r\n",
-				name, (int)value);
+		virtio_vq_notify(base, vq);
 		break;
 	case VIRTIO_CR_STATUS:
 		base->status = value;
@@ -788,3 +2120,37 @@ done:
 	if (base->mtx)
 		pthread_mutex_unlock(base->mtx);
 }
+
+static bool
+virtio_pci_msix_bar(struct pci_vdev *dev, int baridx)
+{
+	struct virtio_base *base = dev->arg;
+
+	return (base->flags & VIRTIO_USE_MSIX) &&
+	       (baridx == pci_msix_table_bar(dev) ||
+		baridx == pci_msix_pba_bar(dev));
+}
+
+uint64_t
+virtio_pci_read64(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+		  int baridx, uint64_t offset)
+{
+	if (virtio_pci_msix_bar(dev, baridx))
+		return pci_emul_msix_tread(dev, offset, 8);
+
+	return virtio_pci_read(ctx, vcpu, dev, baridx, offset, 4) |
+	       virtio_pci_read(ctx, vcpu, dev, baridx, offset + 4, 4) << 32;
+}
+
+void
+virtio_pci_write64(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+		   int baridx, uint64_t offset, uint64_t value)
+{
+	if (virtio_pci_msix_bar(dev, baridx)) {
+		pci_emul_msix_twrite(dev, offset, 8, value);
+		return;
+	}
+
+	virtio_pci_write(ctx, vcpu, dev, baridx, offset, 4, value & 0xffffffff);
+	virtio_pci_write(ctx, vcpu, dev, baridx, offset + 4, 4, value >> 32);
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * virtio balloon with free page reporting
+ *
+ * Pages the guest inflates into the balloon or reports as free are
+ * handed back to the host with vm_discard_memory(); the guest gets
+ * zeroed pages when it touches them again. That only frees host memory
+ * when guest RAM is populated lazily (-Z); otherwise the device still
+ * works but nothing is released.
+ *
+ * -s <slot>,virtio-balloon
+ *
+ * The monitor (-D) command "balloon <MB>" sets the balloon target, and
+ * monitor source "balloon" shows the current state.
+ */
+
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "monitor.h"
+
+#define	VIRTIO_BALLOON_RINGSZ		64
+#define	VIRTIO_BALLOON_MAXSEGS		32
+#define	VIRTIO_BALLOON_PFN_SHIFT	12
+#define	VIRTIO_BALLOON_PAGE_SIZE	(1 << VIRTIO_BALLOON_PFN_SHIFT)
+
+#define	VIRTIO_BALLOON_F_DEFLATE_ON_OOM	(1 << 2)
+#define	VIRTIO_BALLOON_F_REPORTING	(1 << 5)
+
+#define	VIRTIO_BALLOON_S_HOSTCAPS	(VIRTIO_BALLOON_F_DEFLATE_ON_OOM | \
+					 VIRTIO_BALLOON_F_REPORTING)
+
+/*
+ * Without the stats and free page hinting features the reporting queue
+ * directly follows deflate.
+ */
+enum {
+	VIRTIO_BALLOON_INFLATEQ,
+	VIRTIO_BALLOON_DEFLATEQ,
+	VIRTIO_BALLOON_REPORTQ,
+	VIRTIO_BALLOON_MAXQ
+};
+
+struct virtio_balloon_config {
+	uint32_t num_pages;	/* target, set by the host */
+	uint32_t actual;	/* current size, set by the guest */
+} __attribute__((packed));
+
+struct virtio_balloon {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_BALLOON_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_balloon_config cfg;
+	uint64_t reported;	/* bytes returned through reporting */
+	bool discard_warned;
+};
+
+static int virtio_balloon_debug;
+MONITOR_DEBUG(virtio_balloon, virtio_balloon_debug);
+#define DPRINTF(params) do { if (virtio_balloon_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_balloon_reset(void *);
+static void virtio_balloon_notify(void *, struct virtio_vq_info *);
+static int virtio_balloon_cfgread(void *, int, int, uint32_t *);
+static int virtio_balloon_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_balloon_ops = {
+	"virtio_balloon",		/* our name */
+	VIRTIO_BALLOON_MAXQ,		/* we support 3 virtqueues */
+	sizeof(struct virtio_balloon_config), /* config reg size */
+	virtio_balloon_reset,		/* reset */
+	virtio_balloon_notify,		/* device-wide qnotify */
+	virtio_balloon_cfgread,		/* read virtio config */
+	virtio_balloon_cfgwrite,	/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_BALLOON_S_HOSTCAPS,	/* our capabilities */
+};
+
+static void
+virtio_balloon_reset(void *vdev)
+{
+	struct virtio_balloon *vb = vdev;
+
+	DPRINTF(("virtio_balloon: device reset requested !\n"));
+	virtio_reset_dev(&vb->base);
+	/* the guest starts over with an empty balloon */
+	vb->cfg.actual = 0;
+}
+
+static void
+virtio_balloon_discard(struct virtio_balloon *vb, void *hva, size_t len)
+{
+	if (vm_discard_memory(vb->base.dev->vmctx, hva, len) == 0)
+		return;
+
+	if (!vb->discard_warned) {
+		WPRINTF(("virtio_balloon: guest memory is not lazily "
+			"populated (-Z), pages are not returned to the host\n"));
+		vb->discard_warned = true;
+	}
+}
+
+/* inflate: each buffer is an array of 32-bit guest PFNs */
+static void
+virtio_balloon_inflate(struct virtio_balloon *vb, struct iovec *iov, int n)
+{
+	struct vmctx *ctx = vb->base.dev->vmctx;
+	uint32_t *pfns;
+	size_t i, npfns;
+	void *hva;
+	int j;
+
+	for (j = 0; j < n; j++) {
+		pfns = iov[j].iov_base;
+		npfns = iov[j].iov_len / sizeof(uint32_t);
+		for (i = 0; i < npfns; i++) {
+			hva = paddr_guest2host(ctx,
+				(uint64_t)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT,
+				VIRTIO_BALLOON_PAGE_SIZE);
+			if (hva != NULL)
+				virtio_balloon_discard(vb, hva,
+					VIRTIO_BALLOON_PAGE_SIZE);
+		}
+	}
+}
+
+/* reporting: each descriptor covers a free guest page range */
+static void
+virtio_balloon_report(struct virtio_balloon *vb, struct iovec *iov, int n)
+{
+	int j;
+
+	for (j = 0; j < n; j++) {
+		virtio_balloon_discard(vb, iov[j].iov_base, iov[j].iov_len);
+		vb->reported += iov[j].iov_len;
+	}
+}
+
+static void
+virtio_balloon_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon *vb = vdev;
+	struct iovec iov[VIRTIO_BALLOON_MAXSEGS];
+	int n, qidx;
+	uint16_t idx;
+
+	qidx = vq - vb->queues;
+
+	vq_kick_disable(vq);
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_BALLOON_MAXSEGS, NULL);
+		if (n <= 0) {
+			WPRINTF(("virtio_balloon: bad chain on queue %d\n",
+				qidx));
+			/* the next kick is the guest's only way back */
+			vq_kick_enable(vq);
+			break;
+		}
+
+		/* deflated pages come back when the guest touches them */
+		if (qidx == VIRTIO_BALLOON_INFLATEQ)
+			virtio_balloon_inflate(vb, iov, n);
+		else if (qidx == VIRTIO_BALLOON_REPORTQ)
+			virtio_balloon_report(vb, iov, n);
+
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+}
+
+static int
+virtio_balloon_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_balloon *vb = vdev;
+	void *ptr;
+
+	/* our caller has already verified offset and size */
+	ptr = (uint8_t *)&vb->cfg + offset;
+	memcpy(retval, ptr, size);
+	return 0;
+}
+
+static int
+virtio_balloon_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	struct virtio_balloon *vb = vdev;
+
+	if (offset != offsetof(struct virtio_balloon_config, actual) ||
+	    size != sizeof(vb->cfg.actual)) {
+		DPRINTF(("virtio_balloon: write to readonly reg %d\n\r",
+			offset));
+		return -1;
+	}
+
+	vb->cfg.actual = value;
+	return 0;
+}
+
+#define	VIRTIO_BALLOON_PAGES_PER_MB	(1024 * 1024 / VIRTIO_BALLOON_PAGE_SIZE)
+
+static void
+virtio_balloon_monitor_dump(int fd, void *arg)
+{
+	struct virtio_balloon *vb = arg;
+
+	dprintf(fd, "target_mb %u\nactual_mb %u\nreported_mb %lu\n",
+		vb->cfg.num_pages / VIRTIO_BALLOON_PAGES_PER_MB,
+		vb->cfg.actual / VIRTIO_BALLOON_PAGES_PER_MB,
+		vb->reported >> 20);
+}
+
+/* "balloon <MB>": set the target, then show the state */
+static void
+virtio_balloon_monitor_cmd(int fd, void *arg, char *args)
+{
+	struct virtio_balloon *vb = arg;
+	unsigned long mb;
+	char *endp;
+
+	if (args != NULL && args[strspn(args, " \t")] != '\0') {
+		mb = strtoul(args, &endp, 10);
+		endp += strspn(endp, " \t");
+		if (endp == args || *endp != '\0') {
+			dprintf(fd, "error: expected a size in MB\n");
+			return;
+		}
+		vb->cfg.num_pages = mb * VIRTIO_BALLOON_PAGES_PER_MB;
+		virtio_config_changed(&vb->base);
+	}
+	virtio_balloon_monitor_dump(fd, vb);
+}
+
+static int
+virtio_balloon_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *vb;
+	pthread_mutexattr_t attr;
+	char *opt;
+	int i, rc;
+
+	while (opts != NULL && (opt = strsep(&opts, ",")) != NULL) {
+		if (strncmp(opt, "sock=", 5) == 0)
+			WPRINTF(("virtio_balloon: sock= is gone, use the "
+				 "monitor's balloon command\n"));
+		else
+			WPRINTF(("virtio_balloon: unknown option '%s'\n", opt));
+	}
+
+	vb = calloc(1, sizeof(struct virtio_balloon));
+	if (!vb) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		return -1;
+	}
+
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	if (fbsdrun_virtio_msix()) {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_DEFAULT);
+		if (rc)
+			DPRINTF(("virtio_msix: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	} else {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		if (rc)
+			DPRINTF(("virtio_intx: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	}
+	rc = pthread_mutex_init(&vb->mtx, &attr);
+	if (rc)
+		DPRINTF(("mutex init failed with error %d!\n", rc));
+
+	virtio_linkup(&vb->base, &virtio_balloon_ops, vb, dev, vb->queues);
+	vb->base.mtx = &vb->mtx;
+
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++)
+		vb->queues[i].qsize = VIRTIO_BALLOON_RINGSZ;
+
+	/* initialize config space */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_MEMORY);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vb->base, fbsdrun_virtio_msix())) {
+		free(vb);
+		return -1;
+	}
+
+	virtio_set_io_bar(&vb->base, 0);
+
+	monitor_register("balloon", virtio_balloon_monitor_dump, vb);
+	monitor_register_cmd("balloon", virtio_balloon_monitor_cmd, vb);
+
+	return 0;
+}
+
+static void
+virtio_balloon_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *vb;
+
+	vb = dev->arg;
+	if (vb == NULL) {
+		DPRINTF(("%s: balloon is NULL\n", __func__));
+		return;
+	}
+
+	monitor_unregister(vb);
+
+	DPRINTF(("%s: free struct virtio_balloon!\n", __func__));
+	free(vb);
+}
+
+struct pci_vdev_ops pci_ops_virtio_balloon = {
+	.class_name	= "virtio-balloon",
+	.vdev_init	= virtio_balloon_init,
+	.vdev_deinit	= virtio_balloon_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_balloon);
@@ -47,8 +47,17 @@
 #include "pci_core.h"
 #include "virtio.h"
 #include "block_if.h"
+#include "virtio_kernel.h"
+#include "vhost_user.h"
+#include "vmmapi.h"			/* for vmctx */
+#include "monitor.h"
 
 #define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_VHOST_RINGSZ	256	/* the target queues as deep as that */
+#define VIRTIO_BLK_MAXQ		16
+#define VIRTIO_BLK_BATCH	16	/* chains fetched per vq_getchains() */
+#define VIRTIO_BLK_BATCH_IOV	(2 * (BLOCKIF_IOV_MAX + 2))
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS	(1 << 22)	/* 2GB per request */
 
 #define VIRTIO_BLK_S_OK	0
 #define VIRTIO_BLK_S_IOERR	1
@@ -57,10 +66,16 @@
 #define	VIRTIO_BLK_BLK_ID_BYTES	20
 
 /* Capability bits */
+#define	VIRTIO_BLK_F_SIZE_MAX	(1 << 1)	/* Maximum segment size */
 #define	VIRTIO_BLK_F_SEG_MAX	(1 << 2)	/* Maximum request segments */
+#define	VIRTIO_BLK_F_GEOMETRY	(1 << 4)	/* Legacy geometry */
+#define	VIRTIO_BLK_F_RO		(1 << 5)	/* Disk is read-only */
 #define	VIRTIO_BLK_F_BLK_SIZE	(1 << 6)	/* cfg block size valid */
 #define	VIRTIO_BLK_F_FLUSH	(1 << 9)	/* Cache flush support */
 #define	VIRTIO_BLK_F_TOPOLOGY	(1 << 10)	/* Optimal I/O alignment */
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple virtqueues */
+#define	VIRTIO_BLK_F_DISCARD	(1 << 13)	/* Discard supported */
+#define	VIRTIO_BLK_F_WRITE_ZEROES	(1 << 14)	/* Write zeroes supported */
 
 /*
  * Host capabilities
@@ -70,8 +85,19 @@
 	VIRTIO_BLK_F_BLK_SIZE |						    \
 	VIRTIO_BLK_F_FLUSH    |						    \
 	VIRTIO_BLK_F_TOPOLOGY |						    \
+	VIRTIO_RING_F_EVENT_IDX |					    \
 	VIRTIO_RING_F_INDIRECT_DESC)	/* indirect descriptors */
 
+/*
+ * What a vhost-user target may offer; config writes are not passed on
+ */
+#define VIRTIO_BLK_S_VHOSTCAPS      \
+	(VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX |			    \
+	VIRTIO_BLK_F_GEOMETRY | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE |   \
+	VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_TOPOLOGY | VIRTIO_BLK_F_MQ |	    \
+	VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES |		    \
+	VIRTIO_RING_F_EVENT_IDX | VIRTIO_RING_F_INDIRECT_DESC)
+
 /*
  * Config space "registers"
  */
@@ -92,6 +118,15 @@ struct virtio_blk_config {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t	writeback;
+	uint8_t	unused0;
+	uint16_t num_queues;
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t discard_sector_alignment;
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_seg;
+	uint8_t write_zeroes_may_unmap;
+	uint8_t unused1[3];
 } __attribute__((packed));
 
 /*
@@ -103,24 +138,55 @@ struct virtio_blk_hdr {
 #define	VBH_OP_FLUSH		4
 #define	VBH_OP_FLUSH_OUT	5
 #define	VBH_OP_IDENT		8
+#define	VBH_OP_DISCARD		11
+#define	VBH_OP_WRITE_ZEROES	13
 #define	VBH_FLAG_BARRIER	0x80000000	/* OR'ed into type */
 	uint32_t type;
 	uint32_t ioprio;
 	uint64_t sector;
 } __attribute__((packed));
 
+/*
+ * Payload of a discard or write zeroes request; we accept one segment
+ */
+struct virtio_blk_discard_write_zeroes {
+	uint64_t sector;
+	uint32_t num_sectors;
+	uint32_t flags;
+} __attribute__((packed));
+
 /*
  * Debug printf
  */
 static int virtio_blk_debug;
+MONITOR_DEBUG(virtio_blk, virtio_blk_debug);
 #define DPRINTF(params) do { if (virtio_blk_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
 struct virtio_blk_ioreq {
 	struct blockif_req req;
-	struct virtio_blk *blk;
+	struct virtio_blk_queue *q;
 	uint8_t *status;
 	uint16_t idx;
+	int readop;		/* data goes into the guest buffers */
+	struct virtio_blk_ioreq *done_next;
+};
+
+/*
+ * Per-virtqueue state. Each queue submits to its own blockif context
+ * and completes under its own lock, so queues never contend.
+ *
+ * Completing workers don't wait for that lock: they push the request
+ * on the lock-free done list, and whoever holds or next gets mtx
+ * hands everything on it back to the guest at once.
+ */
+struct virtio_blk_queue {
+	struct virtio_blk *blk;
+	struct virtio_vq_info *vq;
+	struct blockif_ctxt *bc;
+	pthread_mutex_t mtx;
+	struct virtio_blk_ioreq *done;	/* completed, newest first */
+	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 };
 
 /*
@@ -129,21 +195,40 @@ struct virtio_blk_ioreq {
 struct virtio_blk {
 	struct virtio_base base;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	struct virtio_ops ops;		/* nvq and caps depend on nq */
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAXQ];
+	struct virtio_blk_queue *queues;
+	int nq;
 	struct virtio_blk_config cfg;
-	struct blockif_ctxt *bc;
+	struct blockif_ctxt *bc;	/* queue 0's context */
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+	struct vhost_user *vhost;	/* vhostuser:<path> target */
+
+	/* VBS-K variables */
+	struct {
+		enum VBS_K_STATUS status;
+		int fd;
+		struct vbs_dev_info dev;
+		struct vbs_vqs_info vqs;
+	} vbs_k;
 };
 
 static void virtio_blk_reset(void *);
 static void virtio_blk_notify(void *, struct virtio_vq_info *);
 static int virtio_blk_cfgread(void *, int, int, uint32_t *);
 static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
+static void virtio_blk_k_no_notify(void *, struct virtio_vq_info *);
+static void virtio_blk_k_set_status(void *, uint64_t);
+
+/* VBS-K interface functions */
+static int virtio_blk_kernel_init(struct virtio_blk *);
+static int virtio_blk_kernel_start(struct virtio_blk *);
+static int virtio_blk_kernel_stop(struct virtio_blk *);
+static int virtio_blk_kernel_reset(struct virtio_blk *);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* we support 1 virtqueue, unless mq=N */
 	sizeof(struct virtio_blk_config), /* config reg size */
 	virtio_blk_reset,	/* reset */
 	virtio_blk_notify,	/* device-wide qnotify */
@@ -154,20 +239,101 @@ static struct virtio_ops virtio_blk_ops = {
 	VIRTIO_BLK_S_HOSTCAPS,	/* our capabilities */
 };
 
+/* VBS-K virtio_ops: the kernel worker owns the rings */
+static struct virtio_ops virtio_blk_ops_k = {
+	"virtio_blk",		/* our name */
+	1,			/* we support 1 virtqueue, unless mq=N */
+	sizeof(struct virtio_blk_config), /* config reg size */
+	virtio_blk_reset,	/* reset */
+	virtio_blk_k_no_notify,	/* device-wide qnotify */
+	virtio_blk_cfgread,	/* read PCI config */
+	virtio_blk_cfgwrite,	/* write PCI config */
+	NULL,			/* apply negotiated features */
+	virtio_blk_k_set_status, /* called on guest set status */
+	VIRTIO_BLK_S_HOSTCAPS & ~VIRTIO_RING_F_EVENT_IDX, /* our capabilities */
+};
+
 static void
 virtio_blk_reset(void *vdev)
 {
 	struct virtio_blk *blk = vdev;
+	int i;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	for (i = 0; i < blk->nq; i++)
+		pthread_mutex_lock(&blk->queues[i].mtx);
+	/* the target has to let go of the rings before they're reset */
+	if (blk->vhost != NULL && vhost_user_stop(blk->vhost) < 0)
+		WPRINTF(("virtio_blk: vhost-user target lost\n"));
 	virtio_reset_dev(&blk->base);
+	for (i = 0; i < blk->nq; i++) {
+		/* the rings these belong to are gone */
+		__atomic_store_n(&blk->queues[i].done, NULL,
+				 __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&blk->queues[i].mtx);
+	}
+
+	if (blk->vbs_k.status == VIRTIO_DEV_STARTED) {
+		DPRINTF(("virtio_blk: VBS-K reset requested!\n"));
+		virtio_blk_kernel_stop(blk);
+		virtio_blk_kernel_reset(blk);
+		/* restarted on the next DRIVER_OK */
+		blk->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+	}
+}
+
+/*
+ * Return every request on the done list to the guest with a single
+ * used index update and at most one interrupt.  Called with q->mtx.
+ */
+static void
+virtio_blk_publish(struct virtio_blk_queue *q)
+{
+	struct virtio_blk_ioreq *io;
+	uint16_t idx[VIRTIO_BLK_RINGSZ];
+	uint32_t len[VIRTIO_BLK_RINGSZ];
+	int i, n;
+
+	io = __atomic_exchange_n(&q->done, NULL, __ATOMIC_ACQUIRE);
+	for (n = 0; io != NULL && n < VIRTIO_BLK_RINGSZ; n++) {
+		/* the list is newest first: fill from the end */
+		idx[VIRTIO_BLK_RINGSZ - 1 - n] = io->idx;
+		io = io->done_next;
+	}
+	if (n == 0 || !vq_ring_ready(q->vq))
+		return;
+
+	/* We wrote 1 byte (our status) to host. */
+	for (i = 0; i < n; i++)
+		len[i] = 1;
+	vq_relchains(q->vq, &idx[VIRTIO_BLK_RINGSZ - n], len, n);
+	vq_endchains(q->vq, 0);
+}
+
+/*
+ * Publish completions unless q->mtx is busy, in which case its owner
+ * does so when it lets go: every path that unlocks q->mtx ends here.
+ */
+static void
+virtio_blk_complete(struct virtio_blk_queue *q)
+{
+	/* order our unlock or push before looking at the list */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&q->done, __ATOMIC_RELAXED) != NULL &&
+	       pthread_mutex_trylock(&q->mtx) == 0) {
+		virtio_blk_publish(q);
+		pthread_mutex_unlock(&q->mtx);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
 }
 
 static void
 virtio_blk_done(struct blockif_req *br, int err)
 {
 	struct virtio_blk_ioreq *io = br->param;
-	struct virtio_blk *blk = io->blk;
+	struct virtio_blk_queue *q = io->q;
+	struct vmctx *ctx = q->blk->base.dev->vmctx;
+	int i;
 
 	/* convert errno into a virtio block error return */
 	if (err == EOPNOTSUPP || err == ENOSYS)
@@ -178,28 +344,57 @@ virtio_blk_done(struct blockif_req *br, int err)
 		*io->status = VIRTIO_BLK_S_OK;
 
 	/*
-	 * Return the descriptor back to the host.
-	 * We wrote 1 byte (our status) to host.
+	 * The used length only counts the status byte, so the chain walk
+	 * in vq_relchains() won't reach the data: mark it here.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, 0);
-	pthread_mutex_unlock(&blk->mtx);
+	if (ctx->dirty_on) {
+		if (io->readop)
+			for (i = 0; i < io->req.iovcnt; i++)
+				vm_dirty_mark(ctx, io->req.iov[i].iov_base,
+					      io->req.iov[i].iov_len);
+		vm_dirty_mark(ctx, io->status, 1);
+	}
+
+	/* Return the descriptor back to the host. */
+	io->done_next = __atomic_load_n(&q->done, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&q->done, &io->done_next, io, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	virtio_blk_complete(q);
+}
+
+/*
+ * Turn the single segment of a discard or write zeroes request into
+ * the byte range blockif_delete()/blockif_write_zeroes() expect.
+ */
+static int
+virtio_blk_get_range(struct virtio_blk_ioreq *io, struct iovec *iov, int n)
+{
+	struct virtio_blk_discard_write_zeroes seg;
+
+	if (n != 2 || iov[1].iov_len != sizeof(seg))
+		return -1;
+
+	memcpy(&seg, iov[1].iov_base, sizeof(seg));
+	if (seg.num_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS)
+		return -1;
+
+	io->req.iovcnt = 0;
+	io->req.offset = seg.sector * DEV_BSIZE;
+	io->req.resid = (ssize_t)seg.num_sectors * DEV_BSIZE;
+	return 0;
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_proc(struct virtio_blk_queue *q, uint16_t idx, struct iovec *iov,
+		int n, uint16_t *flags)
 {
 	struct virtio_blk_hdr *vbh;
 	struct virtio_blk_ioreq *io;
-	int i, n;
+	int i;
 	int err;
 	ssize_t iolen;
 	int writeop, type;
-	struct iovec iov[BLOCKIF_IOV_MAX + 2];
-	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
-
-	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
 
 	/*
 	 * The first descriptor will be the read-only fixed header,
@@ -211,13 +406,14 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 */
 	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
 
-	io = &blk->ios[idx];
+	io = &q->ios[idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
 	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
 	vbh = iov[0].iov_base;
-	memcpy(&io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
+	memcpy(io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
 	io->req.iovcnt = n - 2;
 	io->req.offset = vbh->sector * DEV_BSIZE;
+	io->req.prio = vbh->ioprio >> BLOCKIF_PRIO_SHIFT;
 	io->status = iov[--n].iov_base;
 	assert(iov[n].iov_len == 1);
 	assert(flags[n] & VRING_DESC_F_WRITE);
@@ -228,7 +424,9 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 * we don't advertise the capability.
 	 */
 	type = vbh->type & ~VBH_FLAG_BARRIER;
-	writeop = (type == VBH_OP_WRITE);
+	writeop = (type == VBH_OP_WRITE || type == VBH_OP_DISCARD ||
+		   type == VBH_OP_WRITE_ZEROES);
+	io->readop = (type == VBH_OP_READ || type == VBH_OP_IDENT);
 
 	iolen = 0;
 	for (i = 1; i < n; i++) {
@@ -249,21 +447,32 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 
 	switch (type) {
 	case VBH_OP_READ:
-		err = blockif_read(blk->bc, &io->req);
+		err = blockif_read(q->bc, &io->req);
 		break;
 	case VBH_OP_WRITE:
-		err = blockif_write(blk->bc, &io->req);
+		err = blockif_write(q->bc, &io->req);
 		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
-		err = blockif_flush(blk->bc, &io->req);
+		err = blockif_flush(q->bc, &io->req);
+		break;
+	case VBH_OP_DISCARD:
+	case VBH_OP_WRITE_ZEROES:
+		if (virtio_blk_get_range(io, iov, n)) {
+			virtio_blk_done(&io->req, EINVAL);
+			return;
+		}
+		if (type == VBH_OP_DISCARD)
+			err = blockif_delete(q->bc, &io->req);
+		else
+			err = blockif_write_zeroes(q->bc, &io->req);
 		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
 		/* S/n equal to buffer is not zero-terminated. */
 		memset(iov[1].iov_base, 0, iov[1].iov_len);
-		strncpy(iov[1].iov_base, blk->ident,
-		    MIN(iov[1].iov_len, sizeof(blk->ident)));
+		strncpy(iov[1].iov_base, q->blk->ident,
+		    MIN(iov[1].iov_len, sizeof(q->blk->ident)));
 		virtio_blk_done(&io->req, 0);
 		return;
 	default:
@@ -277,21 +486,511 @@ static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	struct virtio_blk_queue *q = &blk->queues[vq->num];
+	struct iovec iov[VIRTIO_BLK_BATCH_IOV];
+	uint16_t flags[VIRTIO_BLK_BATCH_IOV];
+	uint16_t idx[VIRTIO_BLK_BATCH];
+	int n[VIRTIO_BLK_BATCH];
+	int i, nchains, seg;
 
-	while (vq_has_descs(vq))
-		virtio_blk_proc(blk, vq);
+	/* submit everything the guest queued with this kick at once */
+	pthread_mutex_lock(&q->mtx);
+	blockif_plug(q->bc);
+	vq_kick_disable(vq);
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
+		nchains = vq_getchains(vq, idx, iov, VIRTIO_BLK_BATCH_IOV,
+		    flags, n, VIRTIO_BLK_BATCH);
+		assert(nchains >= 1);
+		for (i = 0, seg = 0; i < nchains; seg += n[i++])
+			virtio_blk_proc(q, idx[i], &iov[seg], n[i],
+			    &flags[seg]);
+	}
+	blockif_unplug(q->bc);
+	pthread_mutex_unlock(&q->mtx);
+	virtio_blk_complete(q);
+}
+
+static void
+virtio_blk_k_no_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	WPRINTF(("virtio_blk: VBS-K mode! Should not reach here!!\n"));
+}
+
+/*
+ * VBS-K couldn't take the rings: serve them here from now on, as if
+ * VBS-K had never been asked for, starting with the requests the guest
+ * queued already.
+ */
+static void
+virtio_blk_k_fallback(struct virtio_blk *blk)
+{
+	int i;
+
+	WPRINTF(("virtio_blk: VBS-K failed to start, falling back to VBS-U\n"));
+	virtio_blk_kernel_reset(blk);
+	blk->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
+	blk->ops.qnotify = virtio_blk_notify;
+	blk->ops.set_status = NULL;
+
+	for (i = 0; i < blk->nq; i++) {
+		if (vq_ring_ready(&blk->vqs[i]))
+			virtio_blk_notify(blk, &blk->vqs[i]);
+	}
+}
+
+/*
+ * Once the guest driver is ready, hand the rings, MSI-X vectors and
+ * image fd of every queue to VBS-K. From then on requests are served
+ * in the kernel; we only see config space accesses.
+ */
+static void
+virtio_blk_k_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_blk *blk = vdev;
+	struct vbs_backend_info backend;
+	struct msix_table_entry *mte;
+	struct virtio_vq_info *vq;
+	int nvq, rc, i;
+
+	if (blk->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS ||
+	    !(status & VIRTIO_CR_STATUS_DRIVER_OK))
+		return;
+
+	nvq = blk->base.vops->nvq;
+
+	strncpy(blk->vbs_k.dev.name, blk->base.vops->name, VBS_NAME_LEN);
+	blk->vbs_k.dev.vmid = blk->base.dev->vmctx->vmid;
+	blk->vbs_k.dev.nvq = nvq;
+	blk->vbs_k.dev.negotiated_features = blk->base.negotiated_caps;
+	/* let VBS-K handle the kick register */
+	blk->vbs_k.dev.pio_range_start = blk->base.dev->bar[0].addr +
+					 VIRTIO_CR_QNOTIFY;
+	blk->vbs_k.dev.pio_range_len = 2;
+
+	blk->vbs_k.vqs.nvq = nvq;
+	for (i = 0; i < nvq; i++) {
+		vq = &blk->vqs[i];
+		blk->vbs_k.vqs.vqs[i].qsize = vq->qsize;
+		blk->vbs_k.vqs.vqs[i].pfn = vq->pfn;
+		blk->vbs_k.vqs.vqs[i].msix_idx = vq->msix_idx;
+		if (vq->msix_idx != VIRTIO_MSI_NO_VECTOR) {
+			mte = &blk->base.dev->msix.table[vq->msix_idx];
+			blk->vbs_k.vqs.vqs[i].msix_addr = mte->addr;
+			blk->vbs_k.vqs.vqs[i].msix_data = mte->msg_data;
+		}
+
+		backend.idx = i;
+		backend.fd = blockif_fd(blk->queues[i].bc);
+		rc = vbs_kernel_set_backend(blk->vbs_k.fd, &backend);
+		if (rc < 0) {
+			WPRINTF(("virtio_blk: VBS-K set backend %d failed\n",
+				 i));
+			virtio_blk_k_fallback(blk);
+			return;
+		}
+	}
+
+	rc = virtio_blk_kernel_start(blk);
+	if (rc < 0) {
+		WPRINTF(("virtio_blk_kernel_start() failed\n"));
+		virtio_blk_k_fallback(blk);
+	} else {
+		blk->vbs_k.status = VIRTIO_DEV_STARTED;
+	}
+}
+
+/*
+ * Called in virtio_blk_init() once the image is open, and only for
+ * images VBS-K can read directly; anything else stays in blockif.
+ */
+static int
+virtio_blk_kernel_init(struct virtio_blk *blk)
+{
+	int i;
+
+	if (blk->nq > VBS_MAX_VQ_CNT) {
+		WPRINTF(("virtio_blk: VBS-K takes at most %d queues\n",
+			 VBS_MAX_VQ_CNT));
+		return -VIRTIO_ERROR_GENERAL;
+	}
+	for (i = 0; i < blk->nq; i++) {
+		if (blockif_fd(blk->queues[i].bc) < 0) {
+			WPRINTF(("virtio_blk: VBS-K needs a raw image\n"));
+			return -VIRTIO_ERROR_GENERAL;
+		}
+	}
+
+	blk->vbs_k.fd = open("/dev/vbs_blk", O_RDWR);
+	if (blk->vbs_k.fd < 0) {
+		WPRINTF(("Failed to open /dev/vbs_blk!\n"));
+		return -VIRTIO_ERROR_FD_OPEN_FAILED;
+	}
+	DPRINTF(("Open /dev/vbs_blk success!\n"));
+
+	memset(&blk->vbs_k.dev, 0, sizeof(struct vbs_dev_info));
+	memset(&blk->vbs_k.vqs, 0, sizeof(struct vbs_vqs_info));
+
+	return VIRTIO_SUCCESS;
+}
+
+static int
+virtio_blk_kernel_start(struct virtio_blk *blk)
+{
+	if (vbs_kernel_start(blk->vbs_k.fd,
+			     &blk->vbs_k.dev,
+			     &blk->vbs_k.vqs) < 0) {
+		WPRINTF(("Failed in vbs_k_start!\n"));
+		return -VIRTIO_ERROR_START;
+	}
+
+	DPRINTF(("vbs_k_started!\n"));
+	return VIRTIO_SUCCESS;
+}
+
+static int
+virtio_blk_kernel_stop(struct virtio_blk *blk)
+{
+	return vbs_kernel_stop(blk->vbs_k.fd);
+}
+
+static int
+virtio_blk_kernel_reset(struct virtio_blk *blk)
+{
+	memset(&blk->vbs_k.dev, 0, sizeof(struct vbs_dev_info));
+	memset(&blk->vbs_k.vqs, 0, sizeof(struct vbs_vqs_info));
+
+	return vbs_kernel_reset(blk->vbs_k.fd);
+}
+
+/*
+ * Pull the virtio-blk only "mq=N" option out of opts, which are
+ * otherwise handed to blockif_open() unchanged.
+ */
+static int
+virtio_blk_parse_mq(char *opts)
+{
+	char *cp, *end;
+	int nq = 1;
+
+	for (cp = strchr(opts, ','); cp != NULL; cp = strchr(cp + 1, ',')) {
+		if (strncmp(cp + 1, "mq=", 3))
+			continue;
+		nq = strtol(cp + 4, &end, 10);
+		if (end == cp + 4 || (*end != ',' && *end != '\0') ||
+		    nq < 1 || nq > VIRTIO_BLK_MAXQ)
+			return -1;
+		memmove(cp, end, strlen(end) + 1);
+		break;
+	}
+	return nq;
+}
+
+/*
+ * Likewise for "coalesce=<max>:<usec>", which applies to every queue.
+ */
+static int
+virtio_blk_parse_coalesce(char *opts, int *max, int *usec)
+{
+	char val[32], *cp, *end;
+	size_t len;
+
+	*max = *usec = 0;
+	for (cp = strchr(opts, ','); cp != NULL; cp = strchr(cp + 1, ',')) {
+		if (strncmp(cp + 1, "coalesce=", 9))
+			continue;
+		end = cp + 10 + strcspn(cp + 10, ",");
+		len = end - (cp + 10);
+		if (len >= sizeof(val))
+			return -1;
+		memcpy(val, cp + 10, len);
+		val[len] = '\0';
+		memmove(cp, end, strlen(end) + 1);
+		return virtio_parse_coalesce(val, max, usec);
+	}
+	return 0;
+}
+
+/*
+ * And "poll=<usec>[@<cpu>]", which has the iothread poll the queues.
+ */
+static int
+virtio_blk_parse_poll(char *opts, int *usec, int *cpu)
+{
+	char val[32], *cp, *end;
+	size_t len;
+
+	*usec = 0;
+	for (cp = strchr(opts, ','); cp != NULL; cp = strchr(cp + 1, ',')) {
+		if (strncmp(cp + 1, "poll=", 5))
+			continue;
+		end = cp + 6 + strcspn(cp + 6, ",");
+		len = end - (cp + 6);
+		if (len >= sizeof(val))
+			return -1;
+		memcpy(val, cp + 6, len);
+		val[len] = '\0';
+		memmove(cp, end, strlen(end) + 1);
+		return virtio_parse_poll(val, usec, cpu);
+	}
+	return 0;
+}
+
+/*
+ * And "kernel=on", which asks for the VBS-K data path.
+ */
+static int
+virtio_blk_parse_kernel(char *opts)
+{
+	char *cp, *end;
+
+	for (cp = strchr(opts, ','); cp != NULL; cp = strchr(cp + 1, ',')) {
+		end = cp + 1 + strcspn(cp + 1, ",");
+		if (end - (cp + 1) != 9 || strncmp(cp + 1, "kernel=on", 9))
+			continue;
+		memmove(cp, end, strlen(end) + 1);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * And for "iothread[=<id>]": returns 1 and the id if it is there.
+ */
+static int
+virtio_blk_parse_iothread(char *opts, int *id)
+{
+	char val[32], *cp, *end;
+	size_t len;
+	int rc;
+
+	for (cp = strchr(opts, ','); cp != NULL; cp = strchr(cp + 1, ',')) {
+		if (strncmp(cp + 1, "iothread", 8))
+			continue;
+		end = cp + 1 + strcspn(cp + 1, ",");
+		len = end - (cp + 1);
+		if (len >= sizeof(val))
+			return -1;
+		memcpy(val, cp + 1, len);
+		val[len] = '\0';
+		rc = virtio_parse_iothread(val, id);
+		if (rc == 0)
+			continue;
+		memmove(cp, end, strlen(end) + 1);
+		return rc;
+	}
+	return 0;
+}
+
+static void
+virtio_blk_close_queues(struct virtio_blk *blk)
+{
+	int i;
+
+	for (i = 0; i < blk->nq; i++) {
+		if (blk->queues[i].bc != NULL)
+			blockif_close(blk->queues[i].bc);
+		pthread_mutex_destroy(&blk->queues[i].mtx);
+	}
+	free(blk->queues);
+}
+
+/*
+ * Backing files opened by virtio_blk_prepare(), one per queue, for
+ * virtio_blk_init() to take over.
+ */
+struct virtio_blk_prep {
+	int	nq;
+	struct blockif_ctxt *bc[VIRTIO_BLK_MAXQ];
+};
+
+static void
+virtio_blk_make_ident(char *bident, size_t len, struct pci_vdev *dev,
+		      int nq, int i)
+{
+	if (nq == 1)
+		snprintf(bident, len, "%d:%d", dev->slot, dev->func);
+	else
+		snprintf(bident, len, "%d:%d:%d", dev->slot, dev->func, i);
+}
+
+/*
+ * Open the backing files ahead of init; this is the slow part and it
+ * runs alongside the other devices.  Bad options are left for
+ * virtio_blk_init() to report, and so is a file that won't open.
+ */
+static int
+virtio_blk_prepare(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	char bident[sizeof("XX:X:XX")];
+	struct virtio_blk_prep *prep;
+	char *xopts;
+	int i, nq, max, usec, id;
+
+	if (opts == NULL || !strncmp(opts, "vhostuser:", 10))
+		return 0;
+	xopts = strdup(opts);
+	if (!xopts)
+		return 0;
+
+	/* strip our own options exactly as virtio_blk_init() will */
+	nq = virtio_blk_parse_mq(xopts);
+	if (nq < 0 || virtio_blk_parse_coalesce(xopts, &max, &usec) ||
+	    virtio_blk_parse_iothread(xopts, &id) < 0) {
+		free(xopts);
+		return 0;
+	}
+	virtio_blk_parse_kernel(xopts);
+
+	prep = calloc(1, sizeof(struct virtio_blk_prep));
+	if (prep) {
+		for (i = 0; i < nq; i++) {
+			virtio_blk_make_ident(bident, sizeof(bident), dev,
+					      nq, i);
+			prep->bc[i] = blockif_open(xopts, bident);
+			if (prep->bc[i] == NULL)
+				break;
+		}
+		prep->nq = i;
+		dev->prep = prep;
+	}
+	free(xopts);
+	return 0;
+}
+
+static void
+virtio_blk_unprepare(struct vmctx *ctx, struct pci_vdev *dev)
+{
+	struct virtio_blk_prep *prep = dev->prep;
+	int i;
+
+	for (i = 0; i < prep->nq; i++)
+		if (prep->bc[i] != NULL)
+			blockif_close(prep->bc[i]);
+	free(prep);
+	dev->prep = NULL;
+}
+
+/*
+ * vhostuser:<path>: an external target, such as SPDK, serves the queues
+ * and keeps the disk's config; see vhost_user.c. We relay the config
+ * read at init and handle the device lifecycle.
+ */
+static void
+virtio_blk_vhost_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_blk *blk = vdev;
+
+	vhost_user_kick(blk->vhost, vq);
+}
+
+static void
+virtio_blk_vhost_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_blk *blk = vdev;
+	int i;
+
+	if (!(status & VIRTIO_CR_STATUS_DRIVER_OK) || blk->vhost->started)
+		return;
+	if (vhost_user_start(blk->vhost, blk->base.negotiated_caps) < 0)
+		goto lost;
+	for (i = 0; i < blk->nq; i++)
+		if (vhost_user_enable(blk->vhost, i, 1) < 0)
+			goto lost;
+	return;
+
+lost:
+	WPRINTF(("virtio_blk: vhost-user target lost\n"));
+}
+
+static int
+virtio_blk_vhost_init(struct virtio_blk *blk, struct vmctx *ctx,
+		      struct pci_vdev *dev, char *opts)
+{
+	struct virtio_blk_queue *q;
+	char *path;
+	int i, nq;
+
+	path = strndup(opts, strcspn(opts, ","));
+	if (path == NULL)
+		return -1;
+	blk->vhost = vhost_user_open(ctx, path, VHOST_USER_PROTOCOL_F_MQ |
+				     VHOST_USER_PROTOCOL_F_CONFIG);
+	if (blk->vhost == NULL)
+		goto fail;
+	if (vhost_user_get_config(blk->vhost, &blk->cfg,
+				  sizeof(blk->cfg)) < 0) {
+		WPRINTF(("virtio_blk: no config space from %s\n", path));
+		goto fail;
+	}
+
+	nq = (blk->vhost->features & VIRTIO_BLK_F_MQ) ?
+	     blk->cfg.num_queues : 1;
+	if (blk->nq > nq) {
+		WPRINTF(("virtio_blk: %s serves %d queues\n", path, nq));
+		blk->nq = nq > 0 ? nq : 1;
+	}
+	blk->cfg.num_queues = blk->nq;
+
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = blk->nq;
+	blk->ops.qnotify = virtio_blk_vhost_notify;
+	blk->ops.set_status = virtio_blk_vhost_set_status;
+	blk->ops.hv_caps = blk->vhost->features & VIRTIO_BLK_S_VHOSTCAPS;
+	if (blk->nq == 1)
+		blk->ops.hv_caps &= ~VIRTIO_BLK_F_MQ;
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs);
+	blk->base.mtx = &blk->mtx;
+
+	for (i = 0; i < blk->nq; i++) {
+		q = &blk->queues[i];
+		pthread_mutex_init(&q->mtx, NULL);
+		q->blk = blk;
+		q->vq = &blk->vqs[i];
+		q->vq->qsize = VIRTIO_BLK_VHOST_RINGSZ;
+	}
+	if (vhost_user_init_queues(blk->vhost, blk->vqs, blk->nq, NULL) < 0) {
+		WPRINTF(("virtio_blk: no eventfds for %s\n", path));
+		goto fail;
+	}
+
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_BLOCK);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_STORAGE);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BLOCK);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&blk->base, fbsdrun_virtio_msix()))
+		goto fail;
+	virtio_set_io_bar(&blk->base, 0);
+
+	/* kicks go to the target and its interrupts to us on eventfds */
+	blk->base.flags |= VIRTIO_USE_IOEVENTFD | VIRTIO_USE_IRQFD;
+	free(path);
+	return 0;
+
+fail:
+	if (blk->vhost != NULL) {
+		vhost_user_close(blk->vhost);
+		blk->vhost = NULL;
+	}
+	free(path);
+	return -1;
 }
 
 static int
 virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	char bident[sizeof("XX:X:X")];
+	struct virtio_blk_prep *prep = dev->prep;
+	char bident[sizeof("XX:X:XX")];
 	struct blockif_ctxt *bctxt;
+	struct virtio_blk_queue *q;
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct virtio_blk *blk;
 	off_t size;
-	int i, sectsz, sts, sto;
+	int i, j, nq, sectsz, sts, sto;
+	int coal_max, coal_usec, iothread, iothread_id, kernel;
+	int poll_usec, poll_cpu;
 	pthread_mutexattr_t attr;
 	int rc;
 
@@ -300,35 +999,46 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 
-	/*
-	 * The supplied backing file has to exist
-	 */
-	snprintf(bident, sizeof(bident), "%d:%d", dev->slot, dev->func);
-	bctxt = blockif_open(opts, bident);
-	if (bctxt == NULL) {
-		perror("Could not open backing file");
+	nq = virtio_blk_parse_mq(opts);
+	if (nq < 0) {
+		printf("virtio-block: mq must be 1 to %d\n", VIRTIO_BLK_MAXQ);
 		return -1;
 	}
-
-	size = blockif_size(bctxt);
-	sectsz = blockif_sectsz(bctxt);
-	blockif_psectsz(bctxt, &sts, &sto);
+	if (virtio_blk_parse_coalesce(opts, &coal_max, &coal_usec)) {
+		printf("virtio-block: coalesce must be <max>:<usec>\n");
+		return -1;
+	}
+	iothread = virtio_blk_parse_iothread(opts, &iothread_id);
+	if (iothread < 0) {
+		printf("virtio-block: iothread id must be 0 to %d\n",
+		       VIRTIO_IOTHREAD_MAX - 1);
+		return -1;
+	}
+	if (virtio_blk_parse_poll(opts, &poll_usec, &poll_cpu)) {
+		printf("virtio-block: poll must be <usec>[@<cpu>]\n");
+		return -1;
+	}
+	/* polling needs an iothread, so give it its own by default */
+	if (poll_usec && !iothread) {
+		iothread = 1;
+		iothread_id = -1;
+	}
+	kernel = virtio_blk_parse_kernel(opts);
 
 	blk = calloc(1, sizeof(struct virtio_blk));
 	if (!blk) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
 		return -1;
 	}
-
-	blk->bc = bctxt;
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
-		struct virtio_blk_ioreq *io = &blk->ios[i];
-
-		io->req.callback = virtio_blk_done;
-		io->req.param = io;
-		io->blk = blk;
-		io->idx = i;
+	blk->queues = calloc(nq, sizeof(struct virtio_blk_queue));
+	if (!blk->queues) {
+		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		free(blk);
+		return -1;
 	}
+	blk->nq = nq;
+	blk->vbs_k.status = VIRTIO_DEV_INITIAL;
+	blk->vbs_k.fd = -1;
 
 	/* init mutex attribute properly to avoid deadlock */
 	rc = pthread_mutexattr_init(&attr);
@@ -344,12 +1054,108 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
 					"error %d!\n", rc));
 
+	if (strncmp(opts, "vhostuser:", 10) == 0) {
+		if (kernel || iothread)
+			WPRINTF(("virtio_blk: kernel, iothread and poll "
+				"don't apply to vhostuser\n"));
+		if (virtio_blk_vhost_init(blk, ctx, dev, opts + 10) < 0) {
+			free(blk->queues);
+			free(blk);
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 * The supplied backing file has to exist. Every queue gets its
+	 * own blockif context on it, and so its own workers.
+	 */
+	for (i = 0; i < nq; i++) {
+		q = &blk->queues[i];
+		pthread_mutex_init(&q->mtx, &attr);
+		if (prep != NULL && i < prep->nq && prep->bc[i] != NULL) {
+			q->bc = prep->bc[i];
+			prep->bc[i] = NULL;
+		} else {
+			virtio_blk_make_ident(bident, sizeof(bident), dev,
+					      nq, i);
+			q->bc = blockif_open(opts, bident);
+		}
+		if (q->bc == NULL) {
+			perror("Could not open backing file");
+			blk->nq = i + 1;
+			virtio_blk_close_queues(blk);
+			free(blk);
+			return -1;
+		}
+	}
+	bctxt = blk->bc = blk->queues[0].bc;
+	if (nq > 1 && blockif_private(bctxt)) {
+		WPRINTF(("virtio_blk: mq=%d doesn't work with qcow2, "
+			 "readahead= or throttling\n", nq));
+		virtio_blk_close_queues(blk);
+		free(blk);
+		return -1;
+	}
+
+	size = blockif_size(bctxt);
+	sectsz = blockif_sectsz(bctxt);
+	blockif_psectsz(bctxt, &sts, &sto);
+
+	/* fall back to VBS-U if the kernel can't take this image */
+	if (kernel) {
+		WPRINTF(("virtio_blk: VBS-K initializing...\n"));
+		rc = virtio_blk_kernel_init(blk);
+		if (rc < 0) {
+			WPRINTF(("virtio_blk: VBS-K init failed, error %d!\n",
+				 rc));
+			blk->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
+		} else
+			blk->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+	}
+
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
+	if (blk->vbs_k.status == VIRTIO_DEV_INIT_SUCCESS)
+		blk->ops = virtio_blk_ops_k;
+	else
+		blk->ops = virtio_blk_ops;
+	blk->ops.nvq = nq;
+	if (nq > 1)
+		blk->ops.hv_caps |= VIRTIO_BLK_F_MQ;
+	if (!blockif_is_ro(bctxt)) {
+		blk->ops.hv_caps |= VIRTIO_BLK_F_WRITE_ZEROES;
+		if (blockif_candelete(bctxt))
+			blk->ops.hv_caps |= VIRTIO_BLK_F_DISCARD;
+	}
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs);
 	blk->base.mtx = &blk->mtx;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	for (i = 0; i < nq; i++) {
+		q = &blk->queues[i];
+		q->blk = blk;
+		q->vq = &blk->vqs[i];
+		for (j = 0; j < VIRTIO_BLK_RINGSZ; j++) {
+			struct virtio_blk_ioreq *io = &q->ios[j];
+
+			io->req.iov = io->req.iov_buf;
+			io->req.callback = virtio_blk_done;
+			io->req.param = io;
+			io->q = q;
+			io->idx = j;
+		}
+
+		/*
+		 * Never let the guest have more requests in flight than
+		 * the backend was opened to accept; the ring size is a
+		 * power of 2.
+		 */
+		q->vq->qsize = VIRTIO_BLK_RINGSZ;
+		while (q->vq->qsize > 1 &&
+		       q->vq->qsize > blockif_queuesz(q->bc))
+			q->vq->qsize >>= 1;
+		vq_set_coalesce(q->vq, coal_max, coal_usec);
+		/* q->vq->vq_notify = we have no per-queue notify */
+	}
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -376,6 +1182,13 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.topology.opt_io_size = 0;
 	blk->cfg.writeback = 0;
+	blk->cfg.num_queues = nq;
+	blk->cfg.max_discard_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+	blk->cfg.max_discard_seg = 1;
+	blk->cfg.discard_sector_alignment = MAX(sts, sectsz) / DEV_BSIZE;
+	blk->cfg.max_write_zeroes_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+	blk->cfg.max_write_zeroes_seg = 1;
+	blk->cfg.write_zeroes_may_unmap = 0;
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -389,25 +1202,55 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	if (virtio_interrupt_init(&blk->base, fbsdrun_virtio_msix())) {
-		blockif_close(blk->bc);
+		if (blk->vbs_k.fd >= 0)
+			close(blk->vbs_k.fd);
+		virtio_blk_close_queues(blk);
 		free(blk);
 		return -1;
 	}
 	virtio_set_io_bar(&blk->base, 0);
+
+	/* VBS-K kicks and interrupts never reach us */
+	if (blk->vbs_k.status == VIRTIO_DEV_INIT_SUCCESS)
+		return 0;
+
+	/* completions come from blockif workers, inject them via irqfd */
+	blk->base.flags |= VIRTIO_USE_IRQFD;
+
+	/* take request submission off the vcpu's exit path */
+	if (iothread && virtio_iothread_attach(&blk->base, iothread_id))
+		WPRINTF(("virtio_blk: no iothread, notify runs inline\n"));
+	else if (poll_usec &&
+		 virtio_iothread_set_poll(&blk->base, poll_usec, poll_cpu))
+		WPRINTF(("virtio_blk: can't pin the iothread to CPU %d\n",
+			 poll_cpu));
 	return 0;
 }
 
 static void
 virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk;
 
 	if (dev->arg) {
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
-		bctxt = blk->bc;
-		blockif_close(bctxt);
+		virtio_iothread_detach(&blk->base);
+		if (blk->vhost != NULL) {
+			vhost_user_stop(blk->vhost);
+			vhost_user_close(blk->vhost);
+			blk->vhost = NULL;
+		}
+		if (blk->vbs_k.status == VIRTIO_DEV_STARTED) {
+			DPRINTF(("%s: deinit virtio_blk_k!\n", __func__));
+			virtio_blk_kernel_stop(blk);
+			virtio_blk_kernel_reset(blk);
+		}
+		if (blk->vbs_k.fd >= 0) {
+			close(blk->vbs_k.fd);
+			blk->vbs_k.fd = -1;
+		}
+		virtio_blk_close_queues(blk);
 		free(blk);
 	}
 }
@@ -435,7 +1278,12 @@ struct pci_vdev_ops pci_ops_virtio_blk = {
 	.class_name	= "virtio-blk",
 	.vdev_init	= virtio_blk_init,
 	.vdev_deinit	= virtio_blk_deinit,
+	.vdev_prepare	= virtio_blk_prepare,
+	.vdev_unprepare	= virtio_blk_unprepare,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64,
+	.vdev_update_bar_map = virtio_pci_update_bar_map
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_blk);
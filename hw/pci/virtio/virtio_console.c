@@ -33,6 +33,7 @@
 #include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <err.h>
 #include <errno.h>
@@ -52,10 +53,15 @@
 #include "pci_core.h"
 #include "virtio.h"
 #include "mevent.h"
+#include "tty_writer.h"
+#include "monitor.h"
 
 #define	VIRTIO_CONSOLE_RINGSZ	64
 #define	VIRTIO_CONSOLE_MAXPORTS	16
 #define	VIRTIO_CONSOLE_MAXQ	(VIRTIO_CONSOLE_MAXPORTS * 2 + 2)
+#define	VIRTIO_CONSOLE_RX_CHAINS	32	/* rx chains per readv() */
+#define	VIRTIO_CONSOLE_RX_IOV		64
+#define	VIRTIO_CONSOLE_RXBUF	65536	/* held back while the ring is full */
 
 #define	VIRTIO_CONSOLE_DEVICE_READY	0
 #define	VIRTIO_CONSOLE_DEVICE_ADD	1
@@ -72,9 +78,11 @@
 #define	VIRTIO_CONSOLE_S_HOSTCAPS	\
 	(VIRTIO_CONSOLE_F_SIZE |	\
 	VIRTIO_CONSOLE_F_MULTIPORT |	\
-	VIRTIO_CONSOLE_F_EMERG_WRITE)
+	VIRTIO_CONSOLE_F_EMERG_WRITE |	\
+	VIRTIO_RING_F_EVENT_IDX)
 
 static int virtio_console_debug;
+MONITOR_DEBUG(virtio_console, virtio_console_debug);
 #define DPRINTF(params) do {		\
 	if (virtio_console_debug)	\
 		printf params;		\
@@ -117,6 +125,13 @@ struct virtio_console_backend {
 	bool				open;
 	enum virtio_console_be_type	be_type;
 	int				pts_fd;	/* only valid for PTY */
+	char				*rxbuf;	/* read, but no rx buffers */
+	size_t				rxoff;
+	size_t				rxlen;
+	bool				rx_paused; /* evp off, rxbuf full */
+	struct tty_writer		*out;	/* NULL for FILE */
+	int				spipe[2]; /* splice tx pipe, or -1 */
+	uint64_t			dropped; /* tx bytes, target full */
 };
 
 struct virtio_console {
@@ -130,6 +145,7 @@ struct virtio_console {
 	struct virtio_console_port	control_port;
 	struct virtio_console_port	ports[VIRTIO_CONSOLE_MAXPORTS];
 	struct virtio_console_config	*config;
+	char				mname[PI_NAMESZ + 5];
 };
 
 struct virtio_console_config {
@@ -156,6 +172,11 @@ static void virtio_console_notify_tx(void *, struct virtio_vq_info *);
 static int virtio_console_cfgread(void *, int, int, uint32_t *);
 static int virtio_console_cfgwrite(void *, int, int, uint32_t);
 static void virtio_console_neg_features(void *, uint64_t);
+static int virtio_console_rx(struct virtio_console_backend *,
+			     struct virtio_vq_info *);
+static void virtio_console_reset_backend(struct virtio_console_backend *);
+static void virtio_console_backend_write(struct virtio_console_port *, void *,
+					 struct iovec *, int);
 static void virtio_console_control_send(struct virtio_console *,
 	struct virtio_console_control *, const void *, size_t);
 static void virtio_console_announce_port(struct virtio_console_port *);
@@ -393,7 +414,7 @@ virtio_console_notify_tx(void *vdev, struct virtio_vq_info *vq)
 	console = vdev;
 	port = virtio_console_vq_to_port(console, vq);
 
-	while (vq_has_descs(vq)) {
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
 		vq_getchain(vq, &idx, iov, 1, flags);
 		if (port != NULL)
 			port->cb(port, port->arg, iov, 1);
@@ -411,14 +432,48 @@ virtio_console_notify_rx(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_console *console;
 	struct virtio_console_port *port;
+	struct virtio_console_backend *be;
 
 	console = vdev;
 	port = virtio_console_vq_to_port(console, vq);
 
 	if (!port->rx_ready) {
 		port->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_kick_disable(vq);
+		return;
+	}
+
+	/* the guest posted buffers for data we held back */
+	be = port->cb == virtio_console_backend_write ? port->arg : NULL;
+	if (be == NULL || !be->open || be->rxlen == 0)
+		return;
+	vq_kick_disable(vq);
+	if (virtio_console_rx(be, vq) == 0) {
+		virtio_console_reset_backend(be);
+		WPRINTF(("vtcon: be read failed and close! errno = %d\n",
+			errno));
 	}
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_console_splice_close(struct virtio_console_backend *be)
+{
+	if (be->spipe[0] >= 0) {
+		close(be->spipe[0]);
+		close(be->spipe[1]);
+	}
+	be->spipe[0] = be->spipe[1] = -1;
+}
+
+static int
+virtio_console_splice_pipe(struct virtio_console_backend *be)
+{
+	if (pipe2(be->spipe, O_CLOEXEC) < 0) {
+		be->spipe[0] = be->spipe[1] = -1;
+		return -1;
+	}
+	return 0;
 }
 
 static void
@@ -427,6 +482,11 @@ virtio_console_reset_backend(struct virtio_console_backend *be)
 	if (!be)
 		return;
 
+	virtio_console_splice_close(be);
+
+	tty_writer_close(be->out);
+	be->out = NULL;
+
 	if (be->fd != STDIN_FILENO)
 		mevent_delete_close(be->evp);
 	else
@@ -442,6 +502,121 @@ virtio_console_reset_backend(struct virtio_console_backend *be)
 	be->open = false;
 }
 
+/*
+ * Fill the guest's rx buffers, several chains per readv(), from the
+ * data held back in rxbuf first and then from the backend.  What
+ * finds the ring full is held back.
+ *
+ * Returns 0 if the backend hit EOF or failed, 1 otherwise.
+ */
+static int
+virtio_console_rx_fill(struct virtio_console_backend *be,
+		       struct virtio_vq_info *vq)
+{
+	struct iovec iov[VIRTIO_CONSOLE_RX_IOV];
+	uint16_t idx[VIRTIO_CONSOLE_RX_CHAINS];
+	uint32_t used[VIRTIO_CONSOLE_RX_CHAINS];
+	int n[VIRTIO_CONSOLE_RX_CHAINS];
+	int i, j, k, nchains, niov;
+	ssize_t len;
+	size_t clen;
+
+	for (;;) {
+		while (vq_has_descs(vq)) {
+			nchains = vq_getchains(vq, idx, iov,
+			    VIRTIO_CONSOLE_RX_IOV, NULL, n,
+			    VIRTIO_CONSOLE_RX_CHAINS);
+			if (nchains <= 0)
+				return 1;
+			n[0] = MIN(n[0], VIRTIO_CONSOLE_RX_IOV);
+			for (k = 0, niov = 0; k < nchains; k++)
+				niov += n[k];
+
+			if (be->rxlen > 0) {
+				len = 0;
+				for (i = 0; i < niov && be->rxlen > 0; i++) {
+					clen = MIN(iov[i].iov_len, be->rxlen);
+					memcpy(iov[i].iov_base,
+					       be->rxbuf + be->rxoff, clen);
+					be->rxoff += clen;
+					be->rxlen -= clen;
+					len += clen;
+				}
+			} else {
+				len = readv(be->fd, iov, niov);
+				if (len <= 0) {
+					while (nchains--)
+						vq_retchain(vq);
+					if (len == -1 && errno == EAGAIN)
+						return 1;
+					return 0;
+				}
+			}
+
+			/*
+			 * Hand out what was read, chain by chain; the first
+			 * always goes, so empty buffers can't stall us.
+			 */
+			for (k = 0, i = 0; k < nchains && (len > 0 || k == 0);
+			     i += n[k++]) {
+				for (clen = 0, j = i; j < i + n[k]; j++)
+					clen += iov[j].iov_len;
+				used[k] = MIN((size_t)len, clen);
+				len -= used[k];
+			}
+			vq_relchains(vq, idx, used, k);
+			while (nchains-- > k)
+				vq_retchain(vq);
+		}
+
+		/* the ring is full: hold back what we can */
+		if (be->rxbuf == NULL) {
+			be->rxbuf = malloc(VIRTIO_CONSOLE_RXBUF);
+			if (be->rxbuf == NULL)
+				return 1;
+		}
+		if (be->rxoff > 0) {
+			memmove(be->rxbuf, be->rxbuf + be->rxoff, be->rxlen);
+			be->rxoff = 0;
+		}
+		if (be->rxlen < VIRTIO_CONSOLE_RXBUF) {
+			len = read(be->fd, be->rxbuf + be->rxlen,
+				   VIRTIO_CONSOLE_RXBUF - be->rxlen);
+			if (len == 0 || (len < 0 && errno != EAGAIN))
+				return 0;
+			if (len > 0)
+				be->rxlen += len;
+		}
+
+		/* have the guest kick once it posts buffers for it */
+		if (be->rxlen == 0 || !vq_kick_enable(vq))
+			return 1;
+		vq_kick_disable(vq);
+	}
+}
+
+/*
+ * Once rxbuf is full the backend isn't read until the guest posts
+ * more buffers and notify_rx makes room.
+ */
+static int
+virtio_console_rx(struct virtio_console_backend *be, struct virtio_vq_info *vq)
+{
+	int ok;
+
+	ok = virtio_console_rx_fill(be, vq);
+	if (be->evp != NULL) {
+		if (be->rxlen == VIRTIO_CONSOLE_RXBUF && !be->rx_paused) {
+			mevent_disable(be->evp);
+			be->rx_paused = true;
+		} else if (be->rxlen < VIRTIO_CONSOLE_RXBUF && be->rx_paused) {
+			mevent_enable(be->evp);
+			be->rx_paused = false;
+		}
+	}
+	return ok;
+}
+
 static void
 virtio_console_backend_read(int fd __attribute__((unused)),
 			    enum ev_type t __attribute__((unused)),
@@ -449,54 +624,123 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 {
 	struct virtio_console_port *port;
 	struct virtio_console_backend *be = arg;
+	struct virtio_base *base;
 	struct virtio_vq_info *vq;
-	struct iovec iov;
 	static char dummybuf[2048];
-	int len, n;
-	uint16_t idx;
+	int len, ok;
 
 	port = be->port;
 	vq = virtio_console_port_to_vq(port, true);
 
+	/* nobody is listening in the guest; drain, we are edge-triggered */
 	if (!be->open || !port->rx_ready) {
-		len = read(be->fd, dummybuf, sizeof(dummybuf));
+		do {
+			len = read(be->fd, dummybuf, sizeof(dummybuf));
+		} while (len > 0);
 		if (len == 0)
 			goto close;
 		return;
 	}
 
-	if (!vq_has_descs(vq)) {
-		len = read(be->fd, dummybuf, sizeof(dummybuf));
-		vq_endchains(vq, 1);
-		if (len == 0)
-			goto close;
+	/* notify_rx drains rxbuf from the vcpu or iothread side */
+	base = &port->console->base;
+	VIRTIO_BASE_LOCK(base);
+	ok = virtio_console_rx(be, vq);
+	vq_endchains(vq, 1);
+	VIRTIO_BASE_UNLOCK(base);
+	if (ok)
 		return;
-	}
 
-	do {
-		n = vq_getchain(vq, &idx, &iov, 1, NULL);
-		len = readv(be->fd, &iov, n);
-		if (len <= 0) {
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
+close:
+	virtio_console_reset_backend(be);
+	WPRINTF(("vtcon: be read failed and close! errno = %d\n", errno));
+}
+
+static size_t
+virtio_console_iov_len(const struct iovec *iov, int niov)
+{
+	size_t len = 0;
 
-			/* no data available */
-			if (len == -1 && errno == EAGAIN)
-				return;
+	while (niov-- > 0)
+		len += (iov++)->iov_len;
+	return len;
+}
 
-			/* any other errors */
-			goto close;
+/*
+ * Move guest data to the port's target through a pipe: vmsplice() only
+ * references the guest pages, and splice() hands them on. The target
+ * has to copy them out before splice() returns, as a tty does, since
+ * the chain goes back to the guest right after; a target that can't
+ * take it all gets the rest dropped, as a full writev() target does.
+ */
+static int
+virtio_console_splice_write(struct virtio_console_backend *be,
+			    struct iovec *iov, int niov)
+{
+	ssize_t n, left, ret;
+
+	for (;;) {
+		while (niov > 0 && iov->iov_len == 0) {
+			iov++;
+			niov--;
 		}
+		if (niov == 0)
+			return 0;
 
-		vq_relchain(vq, idx, len);
-	} while (vq_has_descs(vq));
+		n = vmsplice(be->spipe[1], iov, niov, 0);
+		if (n <= 0)
+			return -1;
+		for (left = n; left > 0; left -= ret) {
+			ret = splice(be->spipe[0], NULL, be->fd, NULL, left,
+				     SPLICE_F_MOVE);
+			if (ret < 0 && errno == EAGAIN) {
+				__atomic_fetch_add(&be->dropped, left +
+					virtio_console_iov_len(iov, niov) - n,
+					__ATOMIC_RELAXED);
+				virtio_console_splice_close(be);
+				return virtio_console_splice_pipe(be);
+			}
+			if (ret <= 0)
+				return -1;
+		}
 
-	vq_endchains(vq, 1);
+		/* the pipe may have taken less than all of it */
+		while (niov > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (n > 0) {
+			iov->iov_base = (void *)((uintptr_t)iov->iov_base + n);
+			iov->iov_len -= n;
+		}
+	}
+}
 
-close:
-	virtio_console_reset_backend(be);
-	WPRINTF(("vtcon: be read failed and close! len = %d, errno = %d\n",
-		len, errno));
+/*
+ * Only for a character device, which copies the data out of the pipe
+ * within splice(). A pipe or socket target would keep referencing the
+ * guest pages until its reader got to them, long after the chain has
+ * gone back to the guest, and into a regular file the kernel copies
+ * the pages just as writev() does. Returns 1 for a target that keeps
+ * using writev().
+ */
+static int
+virtio_console_splice_open(struct virtio_console_backend *be)
+{
+	struct stat st;
+	int flags;
+
+	if (fstat(be->fd, &st) < 0)
+		return -1;
+	if (!S_ISCHR(st.st_mode))
+		return 1;
+
+	/* splice() refuses O_APPEND, which means nothing here anyway */
+	flags = fcntl(be->fd, F_GETFL);
+	if (flags < 0 || fcntl(be->fd, F_SETFL, flags & ~O_APPEND) < 0)
+		return -1;
+	return virtio_console_splice_pipe(be);
 }
 
 static void
@@ -511,14 +755,41 @@ virtio_console_backend_write(struct virtio_console_port *port, void *arg,
 	if (be->fd == -1)
 		return;
 
+	if (be->spipe[0] >= 0) {
+		if (virtio_console_splice_write(be, iov, niov) < 0) {
+			virtio_console_reset_backend(be);
+			WPRINTF(("vtcon: be splice failed! errno = %d\n",
+				errno));
+		}
+		return;
+	}
+
+	if (be->out) {
+		/* held back while the other end stalls, dropped once full */
+		if (tty_writer_writev(be->out, iov, niov) < 0) {
+			virtio_console_reset_backend(be);
+			WPRINTF(("vtcon: be write failed! errno = %d\n",
+				errno));
+		}
+		return;
+	}
+
 	ret = writev(be->fd, iov, niov);
+	if (ret > 0 && (size_t)ret < virtio_console_iov_len(iov, niov))
+		__atomic_fetch_add(&be->dropped,
+				   virtio_console_iov_len(iov, niov) - ret,
+				   __ATOMIC_RELAXED);
 	if (ret <= 0) {
 		/* backend cannot receive more data. For example when pts is
 		 * not connected to any client, its tty buffer will become full.
 		 * In this case we just drop data from guest hvc console.
 		 */
-		if (ret == -1 && errno == EAGAIN)
+		if (ret == -1 && errno == EAGAIN) {
+			__atomic_fetch_add(&be->dropped,
+					   virtio_console_iov_len(iov, niov),
+					   __ATOMIC_RELAXED);
 			return;
+		}
 
 		virtio_console_reset_backend(be);
 		WPRINTF(("vtcon: be write failed! errno = %d\n", errno));
@@ -666,6 +937,7 @@ virtio_console_add_backend(struct virtio_console *console,
 		error = -1;
 		goto out;
 	}
+	be->spipe[0] = be->spipe[1] = -1;
 
 	fd = virtio_console_open_backend(path, be_type);
 	if (fd < 0) {
@@ -691,13 +963,16 @@ virtio_console_add_backend(struct virtio_console *console,
 	}
 
 	if (virtio_console_backend_can_read(be_type)) {
-		be->evp = mevent_add(fd, EVF_READ,
+		be->evp = mevent_add_flags(fd, EVF_READ, MEVENT_F_EDGE,
 			virtio_console_backend_read, be);
 		if (be->evp == NULL) {
 			WPRINTF(("vtcon: mevent_add failed\n"));
 			error = -1;
 			goto out;
 		}
+
+		/* regular files can't be polled, they stay synchronous */
+		be->out = tty_writer_open(fd);
 	}
 
 	virtio_console_open_port(be->port, true);
@@ -706,6 +981,7 @@ virtio_console_add_backend(struct virtio_console *console,
 out:
 	if (error != 0) {
 		if (be) {
+			tty_writer_close(be->out);
 			if (be->evp)
 				mevent_delete(be->evp);
 			if (be->port) {
@@ -744,11 +1020,30 @@ virtio_console_close_backend(struct virtio_console_backend *be)
 		break;
 	}
 
+	virtio_console_splice_close(be);
+	tty_writer_close(be->out);
+	be->out = NULL;
 	be->fd = -1;
 	be->open = false;
 	memset(be->port, 0, sizeof(*be->port));
 }
 
+static void
+virtio_console_monitor_dump(int fd, void *arg)
+{
+	struct virtio_console *console = arg;
+	struct virtio_console_backend *be;
+	int i;
+
+	for (i = 0; i < console->nports; i++) {
+		be = console->ports[i].arg;
+		if (!console->ports[i].enabled || be == NULL)
+			continue;
+		dprintf(fd, "%s tx_dropped %lu\n", console->ports[i].name,
+			__atomic_load_n(&be->dropped, __ATOMIC_RELAXED));
+	}
+}
+
 static void
 virtio_console_close_all(struct virtio_console *console)
 {
@@ -765,6 +1060,7 @@ virtio_console_close_all(struct virtio_console *console)
 		be = (struct virtio_console_backend *)port->arg;
 		if (be) {
 			virtio_console_close_backend(be);
+			free(be->rxbuf);
 			free(be);
 		}
 	}
@@ -794,7 +1090,9 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pthread_mutexattr_t attr;
 	enum virtio_console_be_type be_type;
 	bool is_console = false;
-	int rc;
+	int rc, iothread, iothread_id;
+	bool splice_tx = false;
+	struct virtio_console_backend *be;
 
 	if (!opts) {
 		WPRINTF(("vtcon: invalid opts\n"));
@@ -868,9 +1166,31 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	console->control_port.enabled = true;
 
 	/* virtio-console,[@]stdio|tty|pty|file:portname[=portpath]
-	 * [,[@]stdio|tty|pty|file:portname[=portpath]]
+	 * [,[@]stdio|tty|pty|file:portname[=portpath]][,iothread[=id]]
+	 * [,splice]
 	 */
+	iothread = 0;
 	while ((opt = strsep(&opts, ",")) != NULL) {
+		rc = virtio_parse_iothread(opt, &iothread_id);
+		if (rc < 0) {
+			WPRINTF(("vtcon: iothread id must be 0 to %d\n",
+				VIRTIO_IOTHREAD_MAX - 1));
+			return -1;
+		}
+		if (rc > 0) {
+			iothread = 1;
+			continue;
+		}
+
+		/*
+		 * file ports on a char device write guest data with
+		 * vmsplice()/splice()
+		 */
+		if (strcmp(opt, "splice") == 0) {
+			splice_tx = true;
+			continue;
+		}
+
 		backend = strsep(&opt, ":");
 
 		if (backend == NULL) {
@@ -910,6 +1230,27 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		}
 	}
 
+	for (i = 0; splice_tx && i < console->nports; i++) {
+		be = console->ports[i].arg;
+		if (!console->ports[i].enabled || be == NULL ||
+		    be->be_type != VIRTIO_CONSOLE_BE_FILE)
+			continue;
+		rc = virtio_console_splice_open(be);
+		if (rc > 0)
+			WPRINTF(("vtcon: %s isn't a char device, splice "
+				 "stays off\n",
+				 console->ports[i].name));
+		else if (rc < 0)
+			WPRINTF(("vtcon: no splice for %s, errno = %d\n",
+				console->ports[i].name, errno));
+	}
+
+	/* backend writes can block: keep them off the vcpu's exit path */
+	if (iothread && virtio_iothread_attach(&console->base, iothread_id))
+		WPRINTF(("vtcon: no iothread, notify runs inline\n"));
+
+	snprintf(console->mname, sizeof(console->mname), "%s.con", dev->name);
+	monitor_register(console->mname, virtio_console_monitor_dump, console);
 	return 0;
 }
 
@@ -920,6 +1261,8 @@ virtio_console_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	console = (struct virtio_console *)dev->arg;
 	if (console) {
+		monitor_unregister(console);
+		virtio_iothread_detach(&console->base);
 		virtio_console_close_all(console);
 		if (console->config)
 			free(console->config);
@@ -932,6 +1275,8 @@ struct pci_vdev_ops pci_ops_virtio_console = {
 	.vdev_init	= virtio_console_init,
 	.vdev_deinit	= virtio_console_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_console);
@@ -0,0 +1,1032 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * virtio-fs device emulation: a host directory exported read-only to
+ * the guest over the FUSE protocol.
+ *
+ * Every inode the guest has looked up is held as an O_PATH fd, and the
+ * guest's nodeid is an index into that table, so a nodeid from the
+ * guest is only ever bounds checked, never dereferenced.  Lookups never
+ * follow symlinks (the guest kernel walks them itself, through us), and
+ * names with a '/' or "." and ".." are refused, so the guest can't get
+ * above the export.  Files are opened by reopening the inode's fd
+ * through /proc/self/fd; only regular files and directories can be.
+ *
+ * READ data goes straight from the host file into guest buffers.  The
+ * guest sees the host's page cache contents, so one copy is shared by
+ * every VM exporting the same tree.
+ *
+ * There is no DAX window.  The hypervisor maps guest memory by host
+ * physical address (IC_SET_MEMSEG), and a host file's page cache pages
+ * have no stable physical address the DM could hand it, so a shared
+ * memory region could not be backed by the files it is meant to show.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/fuse.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "monitor.h"
+
+#define	VIRTIO_FS_RINGSZ	128
+#define	VIRTIO_FS_MAX_PAGES	128		/* per READ */
+#define	VIRTIO_FS_MAXSEGS	(VIRTIO_FS_MAX_PAGES + 8)
+#define	VIRTIO_FS_INBUF		(8 * 1024)	/* headers, args, names */
+#define	VIRTIO_FS_OUTBUF	(VIRTIO_FS_MAX_PAGES * 4096)
+#define	VIRTIO_FS_HASHSZ	1024
+#define	VIRTIO_FS_TAGSZ		36
+
+#define	VIRTIO_FS_HIPRIO	0	/* FORGET and INTERRUPT */
+#define	VIRTIO_FS_REQUEST	1
+#define	VIRTIO_FS_NVQ		2
+
+struct virtio_fs_config {
+	char		tag[VIRTIO_FS_TAGSZ];
+	uint32_t	num_request_queues;
+} __attribute__((packed));
+
+struct fs_inode {
+	LIST_ENTRY(fs_inode) link;
+	int		fd;		/* O_PATH */
+	dev_t		dev;
+	ino_t		ino;
+	uint64_t	nlookup;
+	uint64_t	generation;
+	uint32_t	idx;		/* nodeid - 1 */
+};
+
+struct fs_handle {
+	int		fd;		/* -1 if unused */
+	DIR		*dir;
+};
+
+struct virtio_fs {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_FS_NVQ];
+	pthread_mutex_t mtx;
+	struct virtio_fs_config cfg;
+	char		*path;
+	double		timeout;	/* attr/entry cache, seconds */
+	int		keep_cache;
+
+	struct fs_inode	**inodes;	/* by nodeid - 1 */
+	uint32_t	ninodes;
+	uint32_t	*freeino;
+	uint32_t	nfreeino;
+	uint64_t	generation;
+	LIST_HEAD(, fs_inode) hash[VIRTIO_FS_HASHSZ];
+
+	struct fs_handle *handles;
+	uint32_t	nhandles;
+
+	uint8_t		inbuf[VIRTIO_FS_INBUF];
+	uint8_t		*outbuf;
+	int		direct;		/* reply data already in guest memory */
+
+	uint64_t	requests;
+	uint64_t	errors;
+	uint64_t	read_bytes;
+	char		mname[PI_NAMESZ + 4];
+};
+
+static int virtio_fs_debug;
+MONITOR_DEBUG(virtio_fs, virtio_fs_debug);
+#define DPRINTF(params) do { if (virtio_fs_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_fs_reset(void *);
+static void virtio_fs_notify(void *, struct virtio_vq_info *);
+static int virtio_fs_cfgread(void *, int, int, uint32_t *);
+static int virtio_fs_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_fs_ops = {
+	"virtio_fs",			/* our name */
+	VIRTIO_FS_NVQ,			/* hiprio and one request queue */
+	sizeof(struct virtio_fs_config), /* config reg size */
+	virtio_fs_reset,		/* reset */
+	virtio_fs_notify,		/* device-wide qnotify */
+	virtio_fs_cfgread,		/* read virtio config */
+	virtio_fs_cfgwrite,		/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX,
+					/* our capabilities */
+};
+
+static size_t
+fs_iov_get(struct iovec *iov, int n, void *buf, size_t len)
+{
+	size_t done = 0, chunk;
+	int i;
+
+	for (i = 0; i < n && done < len; i++) {
+		chunk = MIN(iov[i].iov_len, len - done);
+		memcpy((uint8_t *)buf + done, iov[i].iov_base, chunk);
+		done += chunk;
+	}
+	return done;
+}
+
+static void
+fs_iov_put(struct iovec *iov, int n, size_t off, const void *buf, size_t len)
+{
+	size_t chunk;
+	int i;
+
+	for (i = 0; i < n && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		chunk = MIN(iov[i].iov_len - off, len);
+		memcpy((uint8_t *)iov[i].iov_base + off, buf, chunk);
+		buf = (const uint8_t *)buf + chunk;
+		len -= chunk;
+		off = 0;
+	}
+}
+
+/* out[] = len bytes of iov[] from off on; returns the entries used */
+static int
+fs_iov_slice(struct iovec *iov, int n, size_t off, size_t len,
+	     struct iovec *out)
+{
+	int i, nout = 0;
+
+	for (i = 0; i < n && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		out[nout].iov_base = (uint8_t *)iov[i].iov_base + off;
+		out[nout].iov_len = MIN(iov[i].iov_len - off, len);
+		len -= out[nout].iov_len;
+		off = 0;
+		nout++;
+	}
+	return nout;
+}
+
+static inline int
+fs_hash(dev_t dev, ino_t ino)
+{
+	return (ino ^ (dev * 31)) & (VIRTIO_FS_HASHSZ - 1);
+}
+
+static struct fs_inode *
+fs_inode_get(struct virtio_fs *fs, uint64_t nodeid)
+{
+	if (nodeid == 0 || nodeid > fs->ninodes)
+		return NULL;
+	return fs->inodes[nodeid - 1];
+}
+
+static struct fs_inode *
+fs_inode_new(struct virtio_fs *fs, int fd, struct stat *st)
+{
+	struct fs_inode *ino, **inodes;
+	uint32_t *freeino, i, n;
+
+	ino = calloc(1, sizeof(*ino));
+	if (ino == NULL)
+		return NULL;
+
+	if (fs->nfreeino > 0) {
+		ino->idx = fs->freeino[--fs->nfreeino];
+	} else {
+		n = fs->ninodes ? fs->ninodes * 2 : 64;
+		inodes = realloc(fs->inodes, n * sizeof(*inodes));
+		if (inodes != NULL)
+			fs->inodes = inodes;
+		freeino = realloc(fs->freeino, n * sizeof(*freeino));
+		if (freeino != NULL)
+			fs->freeino = freeino;
+		if (inodes == NULL || freeino == NULL) {
+			free(ino);
+			return NULL;
+		}
+		/* the new slots are handed out from the bottom up */
+		for (i = n - 1; i > fs->ninodes; i--) {
+			fs->inodes[i] = NULL;
+			fs->freeino[fs->nfreeino++] = i;
+		}
+		ino->idx = fs->ninodes;
+		fs->ninodes = n;
+	}
+
+	ino->fd = fd;
+	ino->dev = st->st_dev;
+	ino->ino = st->st_ino;
+	ino->generation = ++fs->generation;
+	fs->inodes[ino->idx] = ino;
+	LIST_INSERT_HEAD(&fs->hash[fs_hash(ino->dev, ino->ino)], ino, link);
+	return ino;
+}
+
+static void
+fs_inode_put(struct virtio_fs *fs, struct fs_inode *ino, uint64_t n)
+{
+	/* the root is not the guest's to forget */
+	if (ino->idx == 0)
+		return;
+	ino->nlookup -= MIN(n, ino->nlookup);
+	if (ino->nlookup > 0)
+		return;
+	LIST_REMOVE(ino, link);
+	fs->inodes[ino->idx] = NULL;
+	fs->freeino[fs->nfreeino++] = ino->idx;
+	close(ino->fd);
+	free(ino);
+}
+
+static int
+fs_handle_new(struct virtio_fs *fs, int fd, DIR *dir, uint64_t *fh)
+{
+	struct fs_handle *h;
+	uint32_t i, n;
+
+	for (i = 0; i < fs->nhandles; i++)
+		if (fs->handles[i].fd < 0)
+			break;
+	if (i == fs->nhandles) {
+		n = fs->nhandles ? fs->nhandles * 2 : 64;
+		h = realloc(fs->handles, n * sizeof(*h));
+		if (h == NULL)
+			return -ENOMEM;
+		fs->handles = h;
+		for (; fs->nhandles < n; fs->nhandles++)
+			fs->handles[fs->nhandles].fd = -1;
+	}
+	fs->handles[i].fd = fd;
+	fs->handles[i].dir = dir;
+	*fh = i;
+	return 0;
+}
+
+static struct fs_handle *
+fs_handle_get(struct virtio_fs *fs, uint64_t fh)
+{
+	if (fh >= fs->nhandles || fs->handles[fh].fd < 0)
+		return NULL;
+	return &fs->handles[fh];
+}
+
+static void
+fs_handle_put(struct fs_handle *h)
+{
+	if (h->dir != NULL)
+		closedir(h->dir);	/* closes fd too */
+	else
+		close(h->fd);
+	h->fd = -1;
+	h->dir = NULL;
+}
+
+/* drop everything the guest holds but the root */
+static void
+fs_forget_all(struct virtio_fs *fs)
+{
+	uint32_t i;
+
+	for (i = 0; i < fs->nhandles; i++)
+		if (fs->handles[i].fd >= 0)
+			fs_handle_put(&fs->handles[i]);
+	for (i = 1; i < fs->ninodes; i++)
+		if (fs->inodes[i] != NULL)
+			fs_inode_put(fs, fs->inodes[i], UINT64_MAX);
+}
+
+static void
+fs_fill_attr(struct fuse_attr *attr, struct stat *st)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = st->st_ino;
+	attr->size = st->st_size;
+	attr->blocks = st->st_blocks;
+	attr->atime = st->st_atim.tv_sec;
+	attr->mtime = st->st_mtim.tv_sec;
+	attr->ctime = st->st_ctim.tv_sec;
+	attr->atimensec = st->st_atim.tv_nsec;
+	attr->mtimensec = st->st_mtim.tv_nsec;
+	attr->ctimensec = st->st_ctim.tv_nsec;
+	attr->mode = st->st_mode;
+	attr->nlink = st->st_nlink;
+	attr->uid = st->st_uid;
+	attr->gid = st->st_gid;
+	attr->rdev = st->st_rdev;
+	attr->blksize = st->st_blksize;
+}
+
+static void
+fs_timeout(struct virtio_fs *fs, uint64_t *sec, uint32_t *nsec)
+{
+	*sec = (uint64_t)fs->timeout;
+	*nsec = (fs->timeout - *sec) * 1000000000.0;
+}
+
+static int
+fs_stat(struct fs_inode *ino, struct stat *st)
+{
+	if (fstatat(ino->fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	return 0;
+}
+
+/* the argument must hold a struct of this type */
+#define	FS_ARG(type, arg, arglen)	\
+	((arglen) >= sizeof(type) ? (type *)(arg) : NULL)
+
+static ssize_t
+fs_op_init(struct virtio_fs *fs, void *arg, size_t arglen)
+{
+	struct fuse_init_in in;
+	struct fuse_init_out *out = (void *)fs->outbuf;
+	uint32_t want;
+
+	/* older guests send the 16 byte 7.x header only */
+	if (arglen < offsetof(struct fuse_init_in, flags2))
+		return -EINVAL;
+	memset(&in, 0, sizeof(in));
+	memcpy(&in, arg, MIN(arglen, sizeof(in)));
+	if (in.major < 7)
+		return -EPROTO;
+
+	fs_forget_all(fs);
+	want = FUSE_ASYNC_READ | FUSE_MAX_PAGES | FUSE_PARALLEL_DIROPS;
+#ifdef FUSE_CACHE_SYMLINKS
+	want |= FUSE_CACHE_SYMLINKS;
+#endif
+	memset(out, 0, sizeof(*out));
+	out->major = FUSE_KERNEL_VERSION;
+	out->minor = FUSE_KERNEL_MINOR_VERSION;
+	out->max_readahead = in.max_readahead;
+	out->flags = in.flags & want;
+	out->max_background = 64;
+	out->congestion_threshold = 48;
+	out->max_write = VIRTIO_FS_OUTBUF;
+	out->time_gran = 1;
+	out->max_pages = VIRTIO_FS_MAX_PAGES;
+	DPRINTF(("virtio_fs: init %u.%u flags 0x%x\n", in.major, in.minor,
+		 out->flags));
+	return sizeof(*out);
+}
+
+static ssize_t
+fs_op_lookup(struct virtio_fs *fs, struct fs_inode *parent, char *name,
+	     size_t namelen)
+{
+	struct fuse_entry_out *out = (void *)fs->outbuf;
+	struct fs_inode *ino;
+	struct stat st;
+	int fd;
+
+	if (memchr(name, '\0', namelen) == NULL)
+		return -EINVAL;
+	if (name[0] == '\0' || strchr(name, '/') != NULL ||
+	    strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return -EPERM;
+
+	fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+		close(fd);
+		return -errno;
+	}
+
+	LIST_FOREACH(ino, &fs->hash[fs_hash(st.st_dev, st.st_ino)], link)
+		if (ino->dev == st.st_dev && ino->ino == st.st_ino)
+			break;
+	if (ino != NULL) {
+		close(fd);
+	} else if ((ino = fs_inode_new(fs, fd, &st)) == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	ino->nlookup++;
+
+	memset(out, 0, sizeof(*out));
+	out->nodeid = ino->idx + 1;
+	out->generation = ino->generation;
+	fs_timeout(fs, &out->entry_valid, &out->entry_valid_nsec);
+	fs_timeout(fs, &out->attr_valid, &out->attr_valid_nsec);
+	fs_fill_attr(&out->attr, &st);
+	return sizeof(*out);
+}
+
+static void
+fs_op_forget(struct virtio_fs *fs, uint64_t nodeid, uint64_t nlookup)
+{
+	struct fs_inode *ino = fs_inode_get(fs, nodeid);
+
+	if (ino != NULL)
+		fs_inode_put(fs, ino, nlookup);
+}
+
+static ssize_t
+fs_op_getattr(struct virtio_fs *fs, struct fs_inode *ino)
+{
+	struct fuse_attr_out *out = (void *)fs->outbuf;
+	struct stat st;
+	int rc;
+
+	rc = fs_stat(ino, &st);
+	if (rc)
+		return rc;
+	memset(out, 0, sizeof(*out));
+	fs_timeout(fs, &out->attr_valid, &out->attr_valid_nsec);
+	fs_fill_attr(&out->attr, &st);
+	return sizeof(*out);
+}
+
+static ssize_t
+fs_op_readlink(struct virtio_fs *fs, struct fs_inode *ino, size_t room)
+{
+	ssize_t len;
+
+	len = readlinkat(ino->fd, "", (char *)fs->outbuf,
+			 MIN(room, VIRTIO_FS_OUTBUF));
+	return len < 0 ? -errno : len;
+}
+
+static ssize_t
+fs_op_open(struct virtio_fs *fs, struct fs_inode *ino, void *arg,
+	   size_t arglen, int dir)
+{
+	struct fuse_open_in *in = FS_ARG(struct fuse_open_in, arg, arglen);
+	struct fuse_open_out *out = (void *)fs->outbuf;
+	char proc[32];
+	struct stat st;
+	DIR *dp = NULL;
+	uint64_t fh;
+	int fd, rc;
+
+	if (in == NULL)
+		return -EINVAL;
+	if ((in->flags & O_ACCMODE) != O_RDONLY ||
+	    (in->flags & (O_CREAT | O_TRUNC | O_APPEND)))
+		return -EROFS;
+	rc = fs_stat(ino, &st);
+	if (rc)
+		return rc;
+	if (dir ? !S_ISDIR(st.st_mode) : !S_ISREG(st.st_mode))
+		return dir ? -ENOTDIR : -EACCES;
+
+	/* the type was checked on the O_PATH fd, this link goes to it */
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", ino->fd);
+	fd = open(proc, O_RDONLY | O_CLOEXEC | (dir ? O_DIRECTORY : 0));
+	if (fd < 0)
+		return -errno;
+	if (dir && (dp = fdopendir(fd)) == NULL) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+	rc = fs_handle_new(fs, fd, dp, &fh);
+	if (rc) {
+		if (dp != NULL)
+			closedir(dp);
+		else
+			close(fd);
+		return rc;
+	}
+
+	memset(out, 0, sizeof(*out));
+	out->fh = fh;
+	if (!dir && fs->keep_cache)
+		out->open_flags = FOPEN_KEEP_CACHE;
+	return sizeof(*out);
+}
+
+static ssize_t
+fs_op_read(struct virtio_fs *fs, void *arg, size_t arglen,
+	   struct iovec *out, int nout, size_t room)
+{
+	struct fuse_read_in *in = FS_ARG(struct fuse_read_in, arg, arglen);
+	struct iovec data[VIRTIO_FS_MAXSEGS];
+	struct fs_handle *h;
+	ssize_t len;
+	int nd;
+
+	if (in == NULL || (h = fs_handle_get(fs, in->fh)) == NULL ||
+	    h->dir != NULL)
+		return -EBADF;
+	nd = fs_iov_slice(out, nout, sizeof(struct fuse_out_header),
+			  MIN(in->size, room), data);
+	len = preadv(h->fd, data, nd, in->offset);
+	if (len < 0)
+		return -errno;
+	fs->read_bytes += len;
+	fs->direct = 1;
+	return len;
+}
+
+static ssize_t
+fs_op_readdir(struct virtio_fs *fs, void *arg, size_t arglen, size_t room)
+{
+	struct fuse_read_in *in = FS_ARG(struct fuse_read_in, arg, arglen);
+	struct fuse_dirent *fde;
+	struct fs_handle *h;
+	struct dirent *de;
+	size_t len = 0, namelen, reclen;
+	long pos;
+
+	if (in == NULL || (h = fs_handle_get(fs, in->fh)) == NULL ||
+	    h->dir == NULL)
+		return -EBADF;
+	room = MIN(MIN(in->size, room), VIRTIO_FS_OUTBUF);
+
+	/* offsets handed out are telldir() cookies */
+	if (in->offset == 0)
+		rewinddir(h->dir);
+	else
+		seekdir(h->dir, in->offset);
+
+	for (;;) {
+		pos = telldir(h->dir);
+		errno = 0;
+		de = readdir(h->dir);
+		if (de == NULL) {
+			if (errno && len == 0)
+				return -errno;
+			break;
+		}
+		namelen = strlen(de->d_name);
+		reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+		if (len + reclen > room) {
+			seekdir(h->dir, pos);
+			break;
+		}
+		fde = (struct fuse_dirent *)(fs->outbuf + len);
+		fde->ino = de->d_ino;
+		fde->off = telldir(h->dir);
+		fde->namelen = namelen;
+		fde->type = de->d_type;
+		memcpy(fde->name, de->d_name, namelen);
+		memset(fde->name + namelen, 0,
+		       reclen - FUSE_NAME_OFFSET - namelen);
+		len += reclen;
+	}
+	return len;
+}
+
+static ssize_t
+fs_op_release(struct virtio_fs *fs, void *arg, size_t arglen)
+{
+	struct fuse_release_in *in = FS_ARG(struct fuse_release_in, arg,
+					    arglen);
+	struct fs_handle *h;
+
+	if (in == NULL || (h = fs_handle_get(fs, in->fh)) == NULL)
+		return -EBADF;
+	fs_handle_put(h);
+	return 0;
+}
+
+static ssize_t
+fs_op_statfs(struct virtio_fs *fs, struct fs_inode *ino)
+{
+	struct fuse_statfs_out *out = (void *)fs->outbuf;
+	struct statvfs sv;
+
+	if (fstatvfs(ino->fd, &sv))
+		return -errno;
+	memset(out, 0, sizeof(*out));
+	out->st.blocks = sv.f_blocks;
+	out->st.bfree = sv.f_bfree;
+	out->st.bavail = sv.f_bavail;
+	out->st.files = sv.f_files;
+	out->st.ffree = sv.f_ffree;
+	out->st.bsize = sv.f_bsize;
+	out->st.namelen = sv.f_namemax;
+	out->st.frsize = sv.f_frsize;
+	return sizeof(*out);
+}
+
+static ssize_t
+fs_op_access(struct virtio_fs *fs, void *arg, size_t arglen)
+{
+	struct fuse_access_in *in = FS_ARG(struct fuse_access_in, arg, arglen);
+
+	if (in == NULL)
+		return -EINVAL;
+	/* the guest mounts with default_permissions and checks the rest */
+	return (in->mask & W_OK) ? -EROFS : 0;
+}
+
+/*
+ * Handle one request.  Returns the reply payload length, built in
+ * outbuf (or put in guest memory if direct is set), or -errno.
+ */
+static ssize_t
+fs_dispatch(struct virtio_fs *fs, struct fuse_in_header *ih, void *arg,
+	    size_t arglen, struct iovec *out, int nout, size_t room)
+{
+	struct fuse_batch_forget_in *bf;
+	struct fuse_forget_one *one;
+	struct fs_inode *ino;
+	uint32_t i;
+
+	switch (ih->opcode) {
+	case FUSE_INIT:
+		return fs_op_init(fs, arg, arglen);
+	case FUSE_DESTROY:
+		fs_forget_all(fs);
+		return 0;
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+		return fs_op_release(fs, arg, arglen);
+	case FUSE_READ:
+		return fs_op_read(fs, arg, arglen, out, nout, room);
+	case FUSE_READDIR:
+		return fs_op_readdir(fs, arg, arglen, room);
+	case FUSE_FLUSH:
+	case FUSE_FSYNC:
+	case FUSE_FSYNCDIR:
+		return 0;
+	case FUSE_ACCESS:
+		return fs_op_access(fs, arg, arglen);
+	case FUSE_BATCH_FORGET:
+		bf = FS_ARG(struct fuse_batch_forget_in, arg, arglen);
+		if (bf == NULL)
+			return 0;
+		one = (struct fuse_forget_one *)(bf + 1);
+		for (i = 0; i < bf->count &&
+		     (uint8_t *)(one + i + 1) <= (uint8_t *)arg + arglen; i++)
+			fs_op_forget(fs, one[i].nodeid, one[i].nlookup);
+		return 0;
+	case FUSE_SETATTR:
+	case FUSE_SYMLINK:
+	case FUSE_MKNOD:
+	case FUSE_MKDIR:
+	case FUSE_UNLINK:
+	case FUSE_RMDIR:
+	case FUSE_RENAME:
+	case FUSE_RENAME2:
+	case FUSE_LINK:
+	case FUSE_WRITE:
+	case FUSE_CREATE:
+	case FUSE_SETXATTR:
+	case FUSE_REMOVEXATTR:
+	case FUSE_FALLOCATE:
+	case FUSE_COPY_FILE_RANGE:
+		return -EROFS;
+	}
+
+	/* the rest act on an inode */
+	ino = fs_inode_get(fs, ih->nodeid);
+	if (ino == NULL)
+		return -ENOENT;
+
+	switch (ih->opcode) {
+	case FUSE_LOOKUP:
+		return fs_op_lookup(fs, ino, arg, arglen);
+	case FUSE_FORGET:
+		fs_op_forget(fs, ih->nodeid,
+			     arglen >= sizeof(struct fuse_forget_in) ?
+			     ((struct fuse_forget_in *)arg)->nlookup : 0);
+		return 0;
+	case FUSE_GETATTR:
+		return fs_op_getattr(fs, ino);
+	case FUSE_READLINK:
+		return fs_op_readlink(fs, ino, room);
+	case FUSE_OPEN:
+		return fs_op_open(fs, ino, arg, arglen, 0);
+	case FUSE_OPENDIR:
+		return fs_op_open(fs, ino, arg, arglen, 1);
+	case FUSE_STATFS:
+		return fs_op_statfs(fs, ino);
+	default:
+		/* xattrs, locks, ioctl, ...: ENOSYS has the guest stop asking */
+		DPRINTF(("virtio_fs: opcode %u not supported\n", ih->opcode));
+		return -ENOSYS;
+	}
+}
+
+/* returns the bytes written to the chain */
+static uint32_t
+virtio_fs_request(struct virtio_fs *fs, struct iovec *iov, uint16_t *flags,
+		  int n)
+{
+	struct iovec in[VIRTIO_FS_MAXSEGS], out[VIRTIO_FS_MAXSEGS];
+	struct fuse_in_header *ih = (void *)fs->inbuf;
+	struct fuse_out_header oh;
+	size_t inlen, room;
+	ssize_t rc;
+	int i, nin = 0, nout = 0;
+
+	for (i = 0; i < n; i++) {
+		if (flags[i] & VRING_DESC_F_WRITE)
+			out[nout++] = iov[i];
+		else
+			in[nin++] = iov[i];
+	}
+	inlen = fs_iov_get(in, nin, fs->inbuf, sizeof(fs->inbuf));
+	if (inlen < sizeof(*ih))
+		return 0;
+	inlen = MIN(inlen, ih->len);
+	if (inlen < sizeof(*ih))
+		return 0;
+
+	fs->requests++;
+	fs->direct = 0;
+	room = 0;
+	for (i = 0; i < nout; i++)
+		room += out[i].iov_len;
+	room = room > sizeof(oh) ? room - sizeof(oh) : 0;
+
+	rc = fs_dispatch(fs, ih, ih + 1, inlen - sizeof(*ih), out, nout, room);
+
+	/* these get no reply */
+	if (ih->opcode == FUSE_FORGET || ih->opcode == FUSE_BATCH_FORGET ||
+	    ih->opcode == FUSE_INTERRUPT || nout == 0)
+		return 0;
+
+	if (rc > (ssize_t)room)
+		rc = -EIO;
+	memset(&oh, 0, sizeof(oh));
+	oh.unique = ih->unique;
+	if (rc < 0) {
+		fs->errors++;
+		oh.error = rc;
+		rc = 0;
+	} else if (!fs->direct) {
+		fs_iov_put(out, nout, sizeof(oh), fs->outbuf, rc);
+	}
+	oh.len = sizeof(oh) + rc;
+	fs_iov_put(out, nout, 0, &oh, sizeof(oh));
+	return oh.len;
+}
+
+static void
+virtio_fs_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_fs *fs = vdev;
+	struct iovec iov[VIRTIO_FS_MAXSEGS];
+	uint16_t flags[VIRTIO_FS_MAXSEGS];
+	uint16_t idx;
+	int n;
+
+	vq_kick_disable(vq);
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_FS_MAXSEGS, flags);
+		if (n <= 0) {
+			vq_kick_enable(vq);
+			break;
+		}
+		if (n > VIRTIO_FS_MAXSEGS) {
+			WPRINTF(("virtio_fs: chain of %d descriptors\n", n));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+		vq_relchain(vq, idx, virtio_fs_request(fs, iov, flags, n));
+	}
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_fs_reset(void *vdev)
+{
+	struct virtio_fs *fs = vdev;
+
+	DPRINTF(("virtio_fs: device reset requested\n"));
+	fs_forget_all(fs);
+	virtio_reset_dev(&fs->base);
+}
+
+static int
+virtio_fs_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_fs *fs = vdev;
+
+	if (offset < 0 || offset + size > sizeof(fs->cfg))
+		return -1;
+	memcpy(retval, (uint8_t *)&fs->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_fs_cfgwrite(void *vdev, int offset, int size, uint32_t val)
+{
+	WPRINTF(("virtio_fs: write to read-only config reg %d\n", offset));
+	return 0;
+}
+
+static void
+virtio_fs_monitor_dump(int fd, void *arg)
+{
+	struct virtio_fs *fs = arg;
+	uint32_t i, handles = 0;
+
+	pthread_mutex_lock(&fs->mtx);
+	for (i = 0; i < fs->nhandles; i++)
+		handles += fs->handles[i].fd >= 0;
+	dprintf(fd, "inodes %u\n", fs->ninodes - fs->nfreeino);
+	dprintf(fd, "handles %u\n", handles);
+	dprintf(fd, "requests %lu\n", fs->requests);
+	dprintf(fd, "errors %lu\n", fs->errors);
+	dprintf(fd, "read_bytes %lu\n", fs->read_bytes);
+	pthread_mutex_unlock(&fs->mtx);
+}
+
+static int
+virtio_fs_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_fs *fs;
+	struct fs_inode *root;
+	pthread_mutexattr_t attr;
+	struct stat st;
+	char *opt, *val, *tag = NULL, *path = NULL;
+	double timeout = 1.0;
+	int i, fd, rc, keep_cache = 0, iothread_id = -1;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		rc = virtio_parse_iothread(opt, &iothread_id);
+		if (rc < 0) {
+			WPRINTF(("virtio_fs: iothread id must be 0 to %d\n",
+				 VIRTIO_IOTHREAD_MAX - 1));
+			return -1;
+		}
+		if (rc > 0)
+			continue;
+		val = opt;
+		opt = strsep(&val, "=");
+		if (val == NULL)
+			continue;
+		if (strcmp(opt, "tag") == 0)
+			tag = val;
+		else if (strcmp(opt, "path") == 0)
+			path = val;
+		else if (strcmp(opt, "timeout") == 0)
+			timeout = strtod(val, NULL);
+		else if (strcmp(opt, "cache") == 0)
+			keep_cache = strcmp(val, "always") == 0;
+	}
+	if (tag == NULL || path == NULL || strlen(tag) >= VIRTIO_FS_TAGSZ ||
+	    timeout < 0) {
+		WPRINTF(("virtio_fs: needs tag=<tag>,path=<dir>\n"));
+		return -1;
+	}
+
+	fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		WPRINTF(("virtio_fs: cannot open %s: %s\n", path,
+			 strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	fs = calloc(1, sizeof(struct virtio_fs));
+	if (!fs) {
+		WPRINTF(("virtio_fs: calloc returns NULL\n"));
+		close(fd);
+		return -1;
+	}
+	fs->outbuf = malloc(VIRTIO_FS_OUTBUF);
+	fs->path = strdup(path);
+	for (i = 0; i < VIRTIO_FS_HASHSZ; i++)
+		LIST_INIT(&fs->hash[i]);
+	root = fs->outbuf && fs->path ? fs_inode_new(fs, fd, &st) : NULL;
+	if (root == NULL) {
+		close(fd);
+		goto fail;
+	}
+	root->nlookup = 1;
+	fs->timeout = timeout;
+	fs->keep_cache = keep_cache;
+	strncpy(fs->cfg.tag, tag, sizeof(fs->cfg.tag));
+	fs->cfg.num_request_queues = VIRTIO_FS_NVQ - 1;
+
+	/* init mutex attribute properly */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	if (fbsdrun_virtio_msix()) {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_DEFAULT);
+		if (rc)
+			DPRINTF(("virtio_msix: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	} else {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		if (rc)
+			DPRINTF(("virtio_intx: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	}
+	rc = pthread_mutex_init(&fs->mtx, &attr);
+	if (rc)
+		DPRINTF(("mutex init failed with error %d!\n", rc));
+
+	virtio_linkup(&fs->base, &virtio_fs_ops, fs, dev, fs->queues);
+	fs->base.mtx = &fs->mtx;
+	for (i = 0; i < VIRTIO_FS_NVQ; i++)
+		fs->queues[i].qsize = VIRTIO_FS_RINGSZ;
+
+	/* initialize config space */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_FS);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_STORAGE);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_STORAGE_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_FS);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&fs->base, fbsdrun_virtio_msix()))
+		goto fail;
+	virtio_set_io_bar(&fs->base, 0);
+
+	/* requests block on host file systems: keep them off the vcpus */
+	if (virtio_iothread_attach(&fs->base, iothread_id))
+		WPRINTF(("virtio_fs: no iothread, notify runs inline\n"));
+
+	snprintf(fs->mname, sizeof(fs->mname), "%s.fs", dev->name);
+	monitor_register(fs->mname, virtio_fs_monitor_dump, fs);
+	return 0;
+
+fail:
+	if (fs->ninodes > 0 && fs->inodes[0] != NULL) {
+		close(fs->inodes[0]->fd);
+		free(fs->inodes[0]);
+	}
+	free(fs->inodes);
+	free(fs->freeino);
+	free(fs->outbuf);
+	free(fs->path);
+	free(fs);
+	return -1;
+}
+
+static void
+virtio_fs_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_fs *fs = dev->arg;
+
+	if (fs == NULL)
+		return;
+
+	virtio_iothread_detach(&fs->base);
+	monitor_unregister(fs);
+	fs_forget_all(fs);
+	close(fs->inodes[0]->fd);
+	free(fs->inodes[0]);
+	free(fs->inodes);
+	free(fs->freeino);
+	free(fs->handles);
+	free(fs->outbuf);
+	free(fs->path);
+	free(fs);
+}
+
+struct pci_vdev_ops pci_ops_virtio_fs = {
+	.class_name	= "virtio-fs",
+	.vdev_init	= virtio_fs_init,
+	.vdev_deinit	= virtio_fs_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_fs);
@@ -47,6 +47,7 @@
 #include "virtio.h"
 #include "virtio_kernel.h"
 #include "vmmapi.h"
+#include "monitor.h"
 
 /*
  * Size of queue was chosen experimentaly in a way
@@ -62,6 +63,7 @@
 const char *hyper_dmabuf_vbs_dev_path = "/dev/vbs_hyper_dmabuf";
 
 static int virtio_hyper_dmabuf_debug;
+MONITOR_DEBUG(virtio_hyper_dmabuf, virtio_hyper_dmabuf_debug);
 #define DPRINTF(...)\
 do {\
 	if (virtio_hyper_dmabuf_debug)\
@@ -380,6 +382,8 @@ struct pci_vdev_ops pci_ops_virtio_hyper_dmabuf = {
 	.vdev_init	= virtio_hyper_dmabuf_init,
 	.vdev_deinit	= virtio_hyper_dmabuf_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_hyper_dmabuf);
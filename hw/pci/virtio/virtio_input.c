@@ -0,0 +1,585 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * virtio-input device emulation: the console keyboard and pointer as
+ * one evdev device with keys, an absolute X/Y pointer and a wheel.
+ *
+ * Each console event becomes a report of evdev events ending in a
+ * SYN_REPORT.  A report is put in eventq buffers in one go and the
+ * guest gets one interrupt for it, instead of the byte-at-a-time port
+ * I/O of PS/2 or an xHCI transfer per USB mouse report.  When the
+ * guest is short of buffers the rest waits here and goes out when it
+ * posts more.
+ *
+ * virtio-input only exists on the virtio 1.0 transport, so the device
+ * is modern only: no I/O BAR, registers in a memory BAR.
+ */
+
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/input.h>
+#include <linux/virtio_input.h>
+
+#include "dm.h"
+#include "types.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "console.h"
+#include "gc.h"
+#include "monitor.h"
+
+#define	VIRTIO_INPUT_RINGSZ	64
+#define	VIRTIO_INPUT_EVENTQ	0
+#define	VIRTIO_INPUT_STATUSQ	1	/* LEDs from the guest, ignored */
+#define	VIRTIO_INPUT_NVQ	2
+
+#define	VIRTIO_INPUT_MAXEV	256	/* held while the guest catches up */
+#define	VIRTIO_INPUT_REPORT	8	/* most events one report makes */
+#define	VIRTIO_INPUT_ABS_MAX	0x7fff
+#define	VIRTIO_INPUT_CONSOLE_PRI 20	/* above PS/2 and the USB mouse */
+
+struct virtio_input {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_INPUT_NVQ];
+	pthread_mutex_t mtx;
+	struct virtio_input_config cfg;
+	struct virtio_input_event ev[VIRTIO_INPUT_MAXEV];
+	int		nev;		/* pending in ev[] */
+	uint8_t		buttons;	/* console button mask last seen */
+	uint8_t		keys[KEY_CNT / 8];	/* what the guest has down */
+	uint8_t		keybits[KEY_CNT / 8];	/* what we can send */
+	uint64_t	events;
+	uint64_t	reports;
+	uint64_t	dropped;
+	char		mname[PI_NAMESZ + 8];
+};
+
+static int virtio_input_debug;
+MONITOR_DEBUG(virtio_input, virtio_input_debug);
+#define DPRINTF(params) do { if (virtio_input_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_input_reset(void *);
+static void virtio_input_notify(void *, struct virtio_vq_info *);
+static int virtio_input_cfgread(void *, int, int, uint32_t *);
+static int virtio_input_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_input_ops = {
+	"virtio_input",			/* our name */
+	VIRTIO_INPUT_NVQ,		/* eventq and statusq */
+	sizeof(struct virtio_input_config), /* config reg size */
+	virtio_input_reset,		/* reset */
+	virtio_input_notify,		/* device-wide qnotify */
+	virtio_input_cfgread,		/* read virtio config */
+	virtio_input_cfgwrite,		/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_RING_F_EVENT_IDX,	/* our capabilities */
+};
+
+/*
+ * Console keysyms to evdev key codes.  Like ps2kbd, printable ASCII
+ * maps to the key it is on and shift is a key of its own; upper case
+ * letters are folded before the lookup.
+ */
+static const uint16_t virtio_input_ascii[128] = {
+	[' '] = KEY_SPACE,	['!'] = KEY_1,		['"'] = KEY_APOSTROPHE,
+	['#'] = KEY_3,		['$'] = KEY_4,		['%'] = KEY_5,
+	['&'] = KEY_7,		['\''] = KEY_APOSTROPHE, ['('] = KEY_9,
+	[')'] = KEY_0,		['*'] = KEY_8,		['+'] = KEY_EQUAL,
+	[','] = KEY_COMMA,	['-'] = KEY_MINUS,	['.'] = KEY_DOT,
+	['/'] = KEY_SLASH,	['0'] = KEY_0,		['1'] = KEY_1,
+	['2'] = KEY_2,		['3'] = KEY_3,		['4'] = KEY_4,
+	['5'] = KEY_5,		['6'] = KEY_6,		['7'] = KEY_7,
+	['8'] = KEY_8,		['9'] = KEY_9,		[':'] = KEY_SEMICOLON,
+	[';'] = KEY_SEMICOLON,	['<'] = KEY_COMMA,	['='] = KEY_EQUAL,
+	['>'] = KEY_DOT,	['?'] = KEY_SLASH,	['@'] = KEY_2,
+	['['] = KEY_LEFTBRACE,	['\\'] = KEY_BACKSLASH,	[']'] = KEY_RIGHTBRACE,
+	['^'] = KEY_6,		['_'] = KEY_MINUS,	['`'] = KEY_GRAVE,
+	['a'] = KEY_A,		['b'] = KEY_B,		['c'] = KEY_C,
+	['d'] = KEY_D,		['e'] = KEY_E,		['f'] = KEY_F,
+	['g'] = KEY_G,		['h'] = KEY_H,		['i'] = KEY_I,
+	['j'] = KEY_J,		['k'] = KEY_K,		['l'] = KEY_L,
+	['m'] = KEY_M,		['n'] = KEY_N,		['o'] = KEY_O,
+	['p'] = KEY_P,		['q'] = KEY_Q,		['r'] = KEY_R,
+	['s'] = KEY_S,		['t'] = KEY_T,		['u'] = KEY_U,
+	['v'] = KEY_V,		['w'] = KEY_W,		['x'] = KEY_X,
+	['y'] = KEY_Y,		['z'] = KEY_Z,		['{'] = KEY_LEFTBRACE,
+	['|'] = KEY_BACKSLASH,	['}'] = KEY_RIGHTBRACE,	['~'] = KEY_GRAVE,
+};
+
+static const struct {
+	uint32_t	keysym;
+	uint16_t	code;
+} virtio_input_keysyms[] = {
+	{ 0xff08, KEY_BACKSPACE },	{ 0xff09, KEY_TAB },
+	{ 0xff0d, KEY_ENTER },		{ 0xff13, KEY_PAUSE },
+	{ 0xff14, KEY_SCROLLLOCK },	{ 0xff1b, KEY_ESC },
+	{ 0xff50, KEY_HOME },		{ 0xff51, KEY_LEFT },
+	{ 0xff52, KEY_UP },		{ 0xff53, KEY_RIGHT },
+	{ 0xff54, KEY_DOWN },		{ 0xff55, KEY_PAGEUP },
+	{ 0xff56, KEY_PAGEDOWN },	{ 0xff57, KEY_END },
+	{ 0xff61, KEY_SYSRQ },		{ 0xff63, KEY_INSERT },
+	{ 0xff67, KEY_COMPOSE },	{ 0xff7f, KEY_NUMLOCK },
+	{ 0xff8d, KEY_KPENTER },	{ 0xffaa, KEY_KPASTERISK },
+	{ 0xffab, KEY_KPPLUS },		{ 0xffad, KEY_KPMINUS },
+	{ 0xffae, KEY_KPDOT },		{ 0xffaf, KEY_KPSLASH },
+	{ 0xffb0, KEY_KP0 },		{ 0xffb1, KEY_KP1 },
+	{ 0xffb2, KEY_KP2 },		{ 0xffb3, KEY_KP3 },
+	{ 0xffb4, KEY_KP4 },		{ 0xffb5, KEY_KP5 },
+	{ 0xffb6, KEY_KP6 },		{ 0xffb7, KEY_KP7 },
+	{ 0xffb8, KEY_KP8 },		{ 0xffb9, KEY_KP9 },
+	{ 0xffbe, KEY_F1 },		{ 0xffbf, KEY_F2 },
+	{ 0xffc0, KEY_F3 },		{ 0xffc1, KEY_F4 },
+	{ 0xffc2, KEY_F5 },		{ 0xffc3, KEY_F6 },
+	{ 0xffc4, KEY_F7 },		{ 0xffc5, KEY_F8 },
+	{ 0xffc6, KEY_F9 },		{ 0xffc7, KEY_F10 },
+	{ 0xffc8, KEY_F11 },		{ 0xffc9, KEY_F12 },
+	{ 0xffe1, KEY_LEFTSHIFT },	{ 0xffe2, KEY_RIGHTSHIFT },
+	{ 0xffe3, KEY_LEFTCTRL },	{ 0xffe4, KEY_RIGHTCTRL },
+	{ 0xffe5, KEY_CAPSLOCK },	{ 0xffe7, KEY_LEFTMETA },
+	{ 0xffe8, KEY_RIGHTMETA },	{ 0xffe9, KEY_LEFTALT },
+	{ 0xffea, KEY_RIGHTALT },	{ 0xfe03, KEY_RIGHTALT },
+	{ 0xffeb, KEY_LEFTMETA },	{ 0xffec, KEY_RIGHTMETA },
+	{ 0xffff, KEY_DELETE },
+};
+
+static const uint16_t virtio_input_buttons[] = {
+	BTN_LEFT, BTN_MIDDLE, BTN_RIGHT		/* console mask bits 0-2 */
+};
+
+static uint16_t
+virtio_input_keycode(uint32_t keysym)
+{
+	int i;
+
+	if (keysym >= 'A' && keysym <= 'Z')
+		keysym += 'a' - 'A';
+	if (keysym < 128)
+		return virtio_input_ascii[keysym];
+	for (i = 0; i < ARRAY_SIZE(virtio_input_keysyms); i++)
+		if (virtio_input_keysyms[i].keysym == keysym)
+			return virtio_input_keysyms[i].code;
+	return 0;
+}
+
+static inline void
+virtio_input_setbit(uint8_t *map, int bit)
+{
+	map[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline int
+virtio_input_testbit(const uint8_t *map, int bit)
+{
+	return map[bit / 8] & (1 << (bit % 8));
+}
+
+static void
+virtio_input_bitmap(struct virtio_input *vi, const uint8_t *map, int len)
+{
+	while (len > 0 && map[len - 1] == 0)
+		len--;
+	memcpy(vi->cfg.u.bitmap, map, len);
+	vi->cfg.size = len;
+}
+
+/*
+ * The guest writes select and subsel, then reads size and the union
+ * for the answer; size 0 means "no such thing".
+ */
+static void
+virtio_input_select(struct virtio_input *vi)
+{
+	struct virtio_input_config *cfg = &vi->cfg;
+	uint8_t bits[sizeof(cfg->u.bitmap)];
+
+	cfg->size = 0;
+	memset(&cfg->u, 0, sizeof(cfg->u));
+	memset(bits, 0, sizeof(bits));
+
+	switch (cfg->select) {
+	case VIRTIO_INPUT_CFG_ID_NAME:
+		if (cfg->subsel != 0)
+			break;
+		cfg->size = snprintf(cfg->u.string, sizeof(cfg->u.string),
+				     "ACRN Virtio Input");
+		break;
+	case VIRTIO_INPUT_CFG_ID_DEVIDS:
+		if (cfg->subsel != 0)
+			break;
+		cfg->u.ids.bustype = BUS_VIRTUAL;
+		cfg->u.ids.vendor = VIRTIO_VENDOR;
+		cfg->u.ids.product = VIRTIO_TYPE_INPUT;
+		cfg->u.ids.version = 1;
+		cfg->size = sizeof(cfg->u.ids);
+		break;
+	case VIRTIO_INPUT_CFG_EV_BITS:
+		switch (cfg->subsel) {
+		case EV_KEY:
+			virtio_input_bitmap(vi, vi->keybits,
+					    sizeof(vi->keybits));
+			break;
+		case EV_REL:
+			virtio_input_setbit(bits, REL_WHEEL);
+			virtio_input_bitmap(vi, bits, sizeof(bits));
+			break;
+		case EV_ABS:
+			virtio_input_setbit(bits, ABS_X);
+			virtio_input_setbit(bits, ABS_Y);
+			virtio_input_bitmap(vi, bits, sizeof(bits));
+			break;
+		}
+		break;
+	case VIRTIO_INPUT_CFG_ABS_INFO:
+		if (cfg->subsel != ABS_X && cfg->subsel != ABS_Y)
+			break;
+		cfg->u.abs.min = 0;
+		cfg->u.abs.max = VIRTIO_INPUT_ABS_MAX;
+		cfg->size = sizeof(cfg->u.abs);
+		break;
+	}
+}
+
+static int
+virtio_input_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_input *vi = vdev;
+
+	if (offset < 0 || offset + size > sizeof(vi->cfg))
+		return -1;
+	memcpy(retval, (uint8_t *)&vi->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_input_cfgwrite(void *vdev, int offset, int size, uint32_t val)
+{
+	struct virtio_input *vi = vdev;
+
+	/* only select and subsel are writable */
+	if (offset > offsetof(struct virtio_input_config, subsel) ||
+	    offset + size > offsetof(struct virtio_input_config, size))
+		return -1;
+	memcpy((uint8_t *)&vi->cfg + offset, &val, size);
+	virtio_input_select(vi);
+	return 0;
+}
+
+/*
+ * Move pending events into eventq buffers, one event per buffer as
+ * the spec has it, and interrupt once for the lot.  Called with the
+ * device lock held.
+ */
+static void
+virtio_input_flush(struct virtio_input *vi)
+{
+	struct virtio_vq_info *vq = &vi->queues[VIRTIO_INPUT_EVENTQ];
+	uint16_t idx[VIRTIO_INPUT_RINGSZ];
+	uint32_t iolen[VIRTIO_INPUT_RINGSZ];
+	struct iovec iov;
+	int n = 0, sent = 0;
+
+	while (sent < vi->nev && vq_has_descs(vq)) {
+		iolen[n] = 0;
+		if (vq_getchain(vq, &idx[n], &iov, 1, NULL) < 1)
+			break;
+		if (iov.iov_base != NULL &&
+		    iov.iov_len >= sizeof(struct virtio_input_event)) {
+			memcpy(iov.iov_base, &vi->ev[sent++],
+			       sizeof(struct virtio_input_event));
+			iolen[n] = sizeof(struct virtio_input_event);
+		}
+		if (++n == VIRTIO_INPUT_RINGSZ) {
+			vq_relchains(vq, idx, iolen, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		vq_relchains(vq, idx, iolen, n);
+
+	if (sent > 0) {
+		vi->nev -= sent;
+		memmove(vi->ev, vi->ev + sent,
+			vi->nev * sizeof(struct virtio_input_event));
+		vi->events += sent;
+		vq_endchains(vq, vi->nev > 0);
+	}
+}
+
+static void
+virtio_input_push(struct virtio_input *vi, uint16_t type, uint16_t code,
+		  uint32_t value)
+{
+	struct virtio_input_event *ev = &vi->ev[vi->nev++];
+
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+/*
+ * Start a report, or say why not.  Events are only kept once the
+ * driver is up, and a report that doesn't fit whole is dropped.
+ */
+static int
+virtio_input_begin(struct virtio_input *vi)
+{
+	if (!(vi->base.status & VIRTIO_CR_STATUS_DRIVER_OK) ||
+	    !vq_ring_ready(&vi->queues[VIRTIO_INPUT_EVENTQ]))
+		return -1;
+	if (vi->nev + VIRTIO_INPUT_REPORT > VIRTIO_INPUT_MAXEV) {
+		vi->dropped++;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+virtio_input_end(struct virtio_input *vi)
+{
+	virtio_input_push(vi, EV_SYN, SYN_REPORT, 0);
+	vi->reports++;
+	virtio_input_flush(vi);
+}
+
+static void
+virtio_input_kbd_event(int down, uint32_t keysym, void *arg)
+{
+	struct virtio_input *vi = arg;
+	uint16_t code;
+	int value;
+
+	code = virtio_input_keycode(keysym);
+	if (code == 0) {
+		DPRINTF(("virtio_input: unhandled keysym 0x%x\n", keysym));
+		return;
+	}
+
+	pthread_mutex_lock(&vi->mtx);
+	if (virtio_input_begin(vi) == 0) {
+		/* the console repeats a held key with more downs */
+		value = down ? 1 : 0;
+		if (down && virtio_input_testbit(vi->keys, code))
+			value = 2;
+		else if (down)
+			virtio_input_setbit(vi->keys, code);
+		else
+			vi->keys[code / 8] &= ~(1 << (code % 8));
+		virtio_input_push(vi, EV_KEY, code, value);
+		virtio_input_end(vi);
+	}
+	pthread_mutex_unlock(&vi->mtx);
+}
+
+static void
+virtio_input_ptr_event(uint8_t mask, int x, int y, void *arg)
+{
+	struct virtio_input *vi = arg;
+	struct gfx_ctx_image *gc;
+	uint8_t changed;
+	int i;
+
+	gc = console_get_image();
+	if (gc == NULL || gc->width <= 0 || gc->height <= 0)
+		return;		/* not ready */
+
+	/* scale coords to the axis range */
+	x = (int64_t)VIRTIO_INPUT_ABS_MAX * MIN(MAX(x, 0), gc->width - 1) /
+	    (gc->width - 1 ? gc->width - 1 : 1);
+	y = (int64_t)VIRTIO_INPUT_ABS_MAX * MIN(MAX(y, 0), gc->height - 1) /
+	    (gc->height - 1 ? gc->height - 1 : 1);
+
+	pthread_mutex_lock(&vi->mtx);
+	if (virtio_input_begin(vi) == 0) {
+		virtio_input_push(vi, EV_ABS, ABS_X, x);
+		virtio_input_push(vi, EV_ABS, ABS_Y, y);
+
+		changed = mask ^ vi->buttons;
+		for (i = 0; i < ARRAY_SIZE(virtio_input_buttons); i++)
+			if (changed & (1 << i))
+				virtio_input_push(vi, EV_KEY,
+						  virtio_input_buttons[i],
+						  (mask >> i) & 1);
+		/* the wheel comes as presses of buttons 3 (up) and 4 */
+		if (changed & mask & 0x08)
+			virtio_input_push(vi, EV_REL, REL_WHEEL, 1);
+		else if (changed & mask & 0x10)
+			virtio_input_push(vi, EV_REL, REL_WHEEL, -1);
+		vi->buttons = mask;
+		virtio_input_end(vi);
+	}
+	pthread_mutex_unlock(&vi->mtx);
+}
+
+static void
+virtio_input_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_input *vi = vdev;
+	struct iovec iov;
+	uint16_t idx;
+
+	if (vq->num == VIRTIO_INPUT_EVENTQ) {
+		/* more buffers: send what was waiting for them */
+		virtio_input_flush(vi);
+		return;
+	}
+
+	while (vq_has_descs(vq)) {
+		if (vq_getchain(vq, &idx, &iov, 1, NULL) < 1)
+			break;
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_input_reset(void *vdev)
+{
+	struct virtio_input *vi = vdev;
+
+	DPRINTF(("virtio_input: device reset requested\n"));
+	vi->nev = 0;
+	vi->buttons = 0;
+	memset(vi->keys, 0, sizeof(vi->keys));
+	virtio_reset_dev(&vi->base);
+}
+
+static void
+virtio_input_monitor_dump(int fd, void *arg)
+{
+	struct virtio_input *vi = arg;
+
+	pthread_mutex_lock(&vi->mtx);
+	dprintf(fd, "pending %d\n", vi->nev);
+	dprintf(fd, "events %lu\n", vi->events);
+	dprintf(fd, "reports %lu\n", vi->reports);
+	dprintf(fd, "dropped %lu\n", vi->dropped);
+	pthread_mutex_unlock(&vi->mtx);
+}
+
+static int
+virtio_input_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_input *vi;
+	pthread_mutexattr_t attr;
+	int i, rc;
+
+	vi = calloc(1, sizeof(struct virtio_input));
+	if (!vi) {
+		WPRINTF(("virtio_input: calloc returns NULL\n"));
+		return -1;
+	}
+
+	for (i = 0; i < 128; i++)
+		if (virtio_input_ascii[i])
+			virtio_input_setbit(vi->keybits, virtio_input_ascii[i]);
+	for (i = 0; i < ARRAY_SIZE(virtio_input_keysyms); i++)
+		virtio_input_setbit(vi->keybits, virtio_input_keysyms[i].code);
+	for (i = 0; i < ARRAY_SIZE(virtio_input_buttons); i++)
+		virtio_input_setbit(vi->keybits, virtio_input_buttons[i]);
+
+	/* init mutex attribute properly */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	if (fbsdrun_virtio_msix()) {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_DEFAULT);
+		if (rc)
+			DPRINTF(("virtio_msix: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	} else {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		if (rc)
+			DPRINTF(("virtio_intx: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	}
+	rc = pthread_mutex_init(&vi->mtx, &attr);
+	if (rc)
+		DPRINTF(("mutex init failed with error %d!\n", rc));
+
+	virtio_linkup(&vi->base, &virtio_input_ops, vi, dev, vi->queues);
+	vi->base.mtx = &vi->mtx;
+	for (i = 0; i < VIRTIO_INPUT_NVQ; i++)
+		vi->queues[i].qsize = VIRTIO_INPUT_RINGSZ;
+
+	/* initialize config space */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_INPUT);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_REVID, 1);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_INPUTDEV);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_INPUTDEV_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_INPUT);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vi->base, fbsdrun_virtio_msix()) ||
+	    virtio_set_modern_bar(&vi->base, 2)) {
+		pthread_mutex_destroy(&vi->mtx);
+		free(vi);
+		return -1;
+	}
+
+	console_kbd_register(virtio_input_kbd_event, vi,
+			     VIRTIO_INPUT_CONSOLE_PRI);
+	console_ptr_register(virtio_input_ptr_event, vi,
+			     VIRTIO_INPUT_CONSOLE_PRI);
+
+	snprintf(vi->mname, sizeof(vi->mname), "%s.input", dev->name);
+	monitor_register(vi->mname, virtio_input_monitor_dump, vi);
+	return 0;
+}
+
+static void
+virtio_input_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_input *vi = dev->arg;
+
+	if (vi == NULL)
+		return;
+
+	console_kbd_unregister(vi);
+	console_ptr_unregister(vi);
+	monitor_unregister(vi);
+	pthread_mutex_destroy(&vi->mtx);
+	free(vi);
+}
+
+struct pci_vdev_ops pci_ops_virtio_input = {
+	.class_name	= "virtio-input",
+	.vdev_init	= virtio_input_init,
+	.vdev_deinit	= virtio_input_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_input);
@@ -34,8 +34,10 @@
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include "virtio_kernel.h"
+#include "monitor.h"
 
 static int virtio_kernel_debug;
+MONITOR_DEBUG(virtio_kernel, virtio_kernel_debug);
 #define DPRINTF(params) do { if (virtio_kernel_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
@@ -96,6 +98,25 @@ vbs_kernel_start(int fd, struct vbs_dev_info *dev, struct vbs_vqs_info *vqs)
 	return VIRTIO_SUCCESS;
 }
 
+int
+vbs_kernel_set_backend(int fd, struct vbs_backend_info *backend)
+{
+	int ret;
+
+	if (fd < 0) {
+		WPRINTF(("%s: fd < 0\n", __func__));
+		return -VIRTIO_ERROR_FD_OPEN_FAILED;
+	}
+
+	ret = ioctl(fd, VBS_K_SET_BACKEND, backend);
+	if (ret < 0) {
+		WPRINTF(("vbs_kernel_set_backend failed: ret %d\n", ret));
+		return ret;
+	}
+
+	return VIRTIO_SUCCESS;
+}
+
 int
 vbs_kernel_stop(int fd)
 {
@@ -31,6 +31,9 @@
 #include <sys/select.h>
 #include <sys/uio.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <net/ethernet.h>
 #ifndef NETMAP_WITH_LIBS
 #define NETMAP_WITH_LIBS
@@ -53,12 +56,31 @@
 #include "pci_core.h"
 #include "mevent.h"
 #include "virtio.h"
+#include "virtio_kernel.h"
+#include "vhost_user.h"
+#include "vmmapi.h"			/* for vmctx */
 #include "netmap_user.h"
+#include "monitor.h"
+#include "dm_trace.h"
+#include "net_offload.h"
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
 
 #define VIRTIO_NET_RINGSZ	1024
+#define VIRTIO_NET_CTL_RINGSZ	64
 #define VIRTIO_NET_MAXSEGS	256
+#define VIRTIO_NET_TX_BATCH	32	/* chains fetched per vq_getchains() */
+#define VIRTIO_NET_RX_MAXLEN	(ETHER_MAX_LEN + 4)	/* room for a vlan tag */
+#define VIRTIO_NET_RX_MAXGSO	(65535 + ETHER_HDR_LEN + 4)
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -82,11 +104,44 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple RX/TX queue pairs */
+#define	VIRTIO_NET_F_CTRL_MAC_ADDR \
+				(1 << 23) /* set MAC through control queue */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
 	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_RING_F_INDIRECT_DESC)
 
+/*
+ * Receive filtering through the control queue, only offered when the
+ * device model reads the tap itself
+ */
+#define VIRTIO_NET_S_RXFILTER      \
+	(VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_CTRL_RX | \
+	VIRTIO_NET_F_CTRL_VLAN | VIRTIO_NET_F_CTRL_MAC_ADDR)
+
+/*
+ * Offloads, only offered when the tap backend carries the virtio-net
+ * header (IFF_VNET_HDR)
+ */
+#define VIRTIO_NET_S_OFFLOADS      \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+	VIRTIO_NET_F_HOST_ECN | VIRTIO_NET_F_GUEST_CSUM | \
+	VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | \
+	VIRTIO_NET_F_GUEST_ECN)
+
+/*
+ * Transmit offloads done in software by net_offload_tx(), offered with
+ * "swoffload" for backends without the header
+ */
+#define VIRTIO_NET_S_SWOFFLOADS    \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+	VIRTIO_NET_F_HOST_ECN)
+
+#define VIRTIO_NET_F_GUEST_GSO	\
+	(VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | \
+	VIRTIO_NET_F_GUEST_UFO)
+
 /* is address mcast/bcast? */
 #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01)
 
@@ -96,16 +151,66 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions. Queue pair n uses queue 2n for RX and 2n + 1 for
+ * TX. With VIRTIO_NET_F_CTRL_VQ the control queue follows the last pair.
+ */
+#define VIRTIO_NET_RXQ(n)	((n) * 2)
+#define VIRTIO_NET_TXQ(n)	((n) * 2 + 1)
+#define VIRTIO_NET_QPAIR(q)	((q) / 2)
+
+#define VIRTIO_NET_MAXQP	8
+#define VIRTIO_NET_MAXQ		(VIRTIO_NET_MAXQP * 2 + 1)
+
+/*
+ * Control queue commands
  */
-#define VIRTIO_NET_RXQ	0
-#define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK			0
+#define VIRTIO_NET_ERR			1
+
+#define VIRTIO_NET_CTRL_RX		0
+#define VIRTIO_NET_CTRL_RX_PROMISC	0
+#define VIRTIO_NET_CTRL_RX_ALLMULTI	1
+
+#define VIRTIO_NET_CTRL_MAC		1
+#define VIRTIO_NET_CTRL_MAC_TABLE_SET	0
+#define VIRTIO_NET_CTRL_MAC_ADDR_SET	1
+
+#define VIRTIO_NET_CTRL_VLAN		2
+#define VIRTIO_NET_CTRL_VLAN_ADD	0
+#define VIRTIO_NET_CTRL_VLAN_DEL	1
+
+#define VIRTIO_NET_CTRL_MQ		4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+
+#define VIRTIO_NET_CTL_MAXSEGS		8
 
-#define VIRTIO_NET_MAXQ	3
+/*
+ * Receive filter set by the guest. With more addresses than fit in a
+ * table, all frames of that kind are let through.
+ */
+#define VIRTIO_NET_MAC_ENTRIES	64
+#define VIRTIO_NET_MAX_VLANS	4096
+
+struct virtio_net_rxfilter {
+	int		promisc;
+	int		allmulti;
+	int		uni_overflow;
+	int		multi_overflow;
+	int		nuni;
+	int		nmulti;
+	uint8_t		uni[VIRTIO_NET_MAC_ENTRIES][ETHER_ADDR_LEN];
+	uint8_t		multi[VIRTIO_NET_MAC_ENTRIES][ETHER_ADDR_LEN];
+	uint32_t	vlans[VIRTIO_NET_MAX_VLANS / 32];
+};
 
 /*
  * Fixed network header size
@@ -124,22 +229,70 @@ struct virtio_net_rxhdr {
  * Debug printf
  */
 static int virtio_net_debug;
+MONITOR_DEBUG(virtio_net, virtio_net_debug);
 #define DPRINTF(params) do { if (virtio_net_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
+struct virtio_net;
+
+/*
+ * Per queue-pair struct. Every pair has its own tap queue, RX event
+ * and TX thread, so pairs are processed independently.
+ */
+struct virtio_net_qpair {
+	struct virtio_net *net;
+	int		idx;
+	struct virtio_vq_info *rxq;
+	struct virtio_vq_info *txq;
+
+	int		tapfd;
+	struct mevent	*mevp;
+	struct mevent_loop *evloop;	/* own rx thread, pairs after the 1st */
+	char		evname[20];
+
+	int		rx_ready;
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+	int		rx_backlog;	/* tap frames left for lack of buffers */
+	int		rx_parked;	/* tap event off until an rx kick */
+
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+
+	/* tap frames, each counter written only by its rx or tx thread */
+	uint64_t	rx_packets;
+	uint64_t	rx_drops;
+	uint64_t	tx_packets;
+	uint64_t	tx_drops;
+	uint64_t	rx_filtered;	/* frames the guest filter refused */
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_ops ops;		/* nvq and caps depend on max_pairs */
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
 	struct nm_desc	*nmd;
-
-	int		rx_ready;
+	struct virtio_net_xsk *xsk;
+	uint32_t	xdp_queue;	/* host NIC queue the socket binds */
+	char		*xsks_map;	/* bpffs path of the XSKMAP */
+	struct vhost_user *vhost;	/* vhostuser:<path> backend */
+
+	struct virtio_net_qpair qpairs[VIRTIO_NET_MAXQP];
+	int		max_pairs;	/* queue pairs offered */
+	int		curr_pairs;	/* queue pairs enabled by the guest */
+	int		tx_affinity;	/* pin pair n tx to cpu + n, or -1 */
+	int		ev_cpu;		/* evcpu=<cpu>: first rx loop cpu */
+	struct mevent_loop *evloop;
+	int		coal_max;	/* coalesce=<max>:<usec> */
+	int		coal_usec;
+	uint64_t	poll_ns;	/* tx threads poll before sleeping */
 
 	volatile int	resetting;	/* set and checked outside lock */
 	volatile int	closing;	/* stop the tx i/o thread */
@@ -147,23 +300,31 @@ struct virtio_net {
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
+	struct virtio_net_rxfilter rxf;	/* set from the control queue */
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
+	int		vnet_hdr;	/* tap reads/writes the virtio header */
+	int		sw_offload;	/* swoffload: tx offloads done here */
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	void (*virtio_net_rx)(struct virtio_net_qpair *qp);
+	void (*virtio_net_tx)(struct virtio_net_qpair *qp, struct iovec *iov,
 			     int iovcnt, int len);
+	void (*virtio_net_tx_flush)(struct virtio_net_qpair *qp);
+
+	/* VBS-K variables */
+	struct {
+		enum VBS_K_STATUS status;
+		int fd;
+		struct vbs_dev_info dev;
+		struct vbs_vqs_info vqs;
+	} vbs_k;
 };
 
 static void virtio_net_reset(void *);
 static void virtio_net_tx_stop(struct virtio_net *);
+static void virtio_net_vhost_enable(struct virtio_net *);
+static void virtio_net_vhost_stop(struct virtio_net *);
 /* static void virtio_net_notify(void *, struct virtio_vq_info *); */
 static int virtio_net_cfgread(void *, int, int, uint32_t *);
 static int virtio_net_cfgwrite(void *, int, int, uint32_t);
@@ -171,7 +332,7 @@ static void virtio_net_neg_features(void *, uint64_t);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	2,				/* one rx/tx pair, adjusted per device */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -179,9 +340,32 @@ static struct virtio_ops virtio_net_ops = {
 	virtio_net_cfgwrite,		/* write PCI config */
 	virtio_net_neg_features,	/* apply negotiated features */
 	NULL,				/* called on guest set status */
+	VIRTIO_NET_S_HOSTCAPS |		/* our capabilities */
+	VIRTIO_RING_F_EVENT_IDX,
+};
+
+/* VBS-K virtio_ops */
+static void virtio_net_k_no_notify(void *, struct virtio_vq_info *);
+static void virtio_net_k_set_status(void *, uint64_t);
+static struct virtio_ops virtio_net_ops_k = {
+	"vtnet",			/* our name */
+	2,				/* we support 2 virtqueues */
+	sizeof(struct virtio_net_config), /* config reg size */
+	virtio_net_reset,		/* reset */
+	virtio_net_k_no_notify,		/* device-wide qnotify */
+	virtio_net_cfgread,		/* read PCI config */
+	virtio_net_cfgwrite,		/* write PCI config */
+	virtio_net_neg_features,	/* apply negotiated features */
+	virtio_net_k_set_status,	/* called on guest set status */
 	VIRTIO_NET_S_HOSTCAPS,		/* our capabilities */
 };
 
+/* VBS-K interface functions */
+static int virtio_net_kernel_init(struct virtio_net *);
+static int virtio_net_kernel_start(struct virtio_net *);
+static int virtio_net_kernel_stop(struct virtio_net *);
+static int virtio_net_kernel_reset(struct virtio_net *);
+
 static struct ether_addr *
 ether_aton(const char *a, struct ether_addr *e)
 {
@@ -204,36 +388,153 @@ ether_aton(const char *a, struct ether_addr *e)
  * If the transmit thread is active then stall until it is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_txwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	while (qp->tx_in_progress) {
+		pthread_mutex_unlock(&qp->tx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	while (qp->rx_in_progress) {
+		pthread_mutex_unlock(&qp->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&qp->rx_mtx);
+	}
+	pthread_mutex_unlock(&qp->rx_mtx);
+}
+
+/*
+ * Tell the tap which header size and receive offloads the guest
+ * negotiated, so it only hands us frames the guest can take.
+ */
+static void
+virtio_net_tap_offload(struct virtio_net *net)
+{
+	unsigned int offload = 0;
+	int i;
+
+	if (!net->vnet_hdr)
+		return;
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM)
+		offload |= TUN_F_CSUM;
+	if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+		offload |= TUN_F_TSO4;
+	if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+		offload |= TUN_F_TSO6;
+	if (net->features & VIRTIO_NET_F_GUEST_ECN)
+		offload |= TUN_F_TSO_ECN;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		if (net->qpairs[i].tapfd < 0)
+			continue;
+		if (ioctl(net->qpairs[i].tapfd, TUNSETVNETHDRSZ,
+			  &net->rx_vhdrlen) < 0 ||
+		    ioctl(net->qpairs[i].tapfd, TUNSETOFFLOAD, offload) < 0)
+			WPRINTF(("vtnet: failed to set tap offloads\n"));
+	}
+}
+
+/*
+ * Attach the tap queues of the first npairs pairs and detach the rest,
+ * so the host only steers flows to queues the guest is servicing.
+ */
+static void
+virtio_net_tap_set_pairs(struct virtio_net *net, int npairs)
+{
+	struct ifreq ifr;
+	int i;
+
+	net->curr_pairs = npairs;
+	if (net->max_pairs == 1)
+		return;
+	if (net->vhost != NULL) {
+		virtio_net_vhost_enable(net);
+		return;
+	}
+
+	for (i = 0; i < net->max_pairs; i++) {
+		if (net->qpairs[i].tapfd < 0)
+			continue;
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = i < npairs ? IFF_ATTACH_QUEUE :
+				IFF_DETACH_QUEUE;
+		if (ioctl(net->qpairs[i].tapfd, TUNSETQUEUE, &ifr) < 0)
+			WPRINTF(("vtnet: failed to %s tap queue %d\n",
+				i < npairs ? "attach" : "detach", i));
+	}
+}
+
+/*
+ * Mirror the guest's unicast and multicast filter into the tap, so the
+ * kernel drops frames the guest has no interest in before they are
+ * copied to us. The in-kernel filter holds few exact addresses and
+ * turns itself off when the unicast ones don't fit, in which case
+ * virtio_net_rx_accept() is left to do all of the work.
+ */
+static void
+virtio_net_tap_filter(struct virtio_net *net)
+{
+	static const uint8_t bcast[ETHER_ADDR_LEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	struct virtio_net_rxfilter *f = &net->rxf;
+	uint16_t buf[(sizeof(struct tun_filter) +
+		(VIRTIO_NET_MAC_ENTRIES * 2 + 2) * ETHER_ADDR_LEN) / 2];
+	struct tun_filter *flt = (struct tun_filter *)buf;
+	int n;
+
+	if (!(net->ops.hv_caps & VIRTIO_NET_F_CTRL_RX) ||
+	    net->qpairs[0].tapfd < 0)
+		return;
+
+	flt->flags = 0;
+	n = 0;
+	if ((net->features & VIRTIO_NET_F_CTRL_RX) && !f->promisc &&
+	    !f->uni_overflow) {
+		memcpy(flt->addr[n++], net->config.mac, ETHER_ADDR_LEN);
+		memcpy(flt->addr[n], f->uni, f->nuni * ETHER_ADDR_LEN);
+		n += f->nuni;
+		if (f->allmulti || f->multi_overflow)
+			flt->flags = TUN_FLT_ALLMULTI;
+		else {
+			memcpy(flt->addr[n++], bcast, ETHER_ADDR_LEN);
+			memcpy(flt->addr[n], f->multi,
+			       f->nmulti * ETHER_ADDR_LEN);
+			n += f->nmulti;
+		}
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+	flt->count = n;
+
+	/* the filter belongs to the tun device, shared by all queues */
+	if (ioctl(net->qpairs[0].tapfd, TUNSETTXFILTER, flt) < 0)
+		DPRINTF(("vtnet: tap filter not set: %s\n\r",
+			strerror(errno)));
+}
+
+static void
+virtio_net_rxfilter_reset(struct virtio_net *net)
+{
+	memset(&net->rxf, 0, sizeof(net->rxf));
+	net->rxf.promisc = 1;
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -243,45 +544,74 @@ virtio_net_reset(void *vdev)
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->max_pairs; i++) {
+		virtio_net_txwait(&net->qpairs[i]);
+		virtio_net_rxwait(&net->qpairs[i]);
+		net->qpairs[i].rx_ready = 0;
+		net->qpairs[i].rx_backlog = 0;
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->features = 0;
+	virtio_net_rxfilter_reset(net);
+
+	/* the backend has to let go of the rings before they're reset */
+	if (net->vhost != NULL)
+		virtio_net_vhost_stop(net);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
+	virtio_net_tap_offload(net);
+	virtio_net_tap_filter(net);
+
+	if (net->vbs_k.status == VIRTIO_DEV_STARTED) {
+		DPRINTF(("vtnet: VBS-K reset requested!\n"));
+		virtio_net_kernel_stop(net);
+		virtio_net_kernel_reset(net);
+		/* restarted on the next DRIVER_OK */
+		net->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+	}
+
+	/* the guest starts over with a single queue pair */
+	virtio_net_tap_set_pairs(net, 1);
 
 	net->resetting = 0;
 	net->closing = 0;
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Send signal to tx I/O threads and wait till they exit
  */
 static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
 	void *jval;
+	int i;
 
-	net->closing = 1;
+	/* no tx threads when the data path is in VBS-K */
+	if ((net->vbs_k.status != VIRTIO_DEV_INITIAL &&
+	    net->vbs_k.status != VIRTIO_DEV_INIT_FAILED) || net->vhost != NULL)
+		return;
 
-	pthread_cond_broadcast(&net->tx_cond);
+	net->closing = 1;
 
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->max_pairs; i++) {
+		pthread_cond_broadcast(&net->qpairs[i].tx_cond);
+		pthread_join(net->qpairs[i].tx_tid, &jval);
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_qpair *qp, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 
-	if (net->tapfd == -1)
+	if (qp->tapfd == -1)
 		return;
 
 	/*
@@ -294,7 +624,28 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	(void) writev(net->tapfd, iov, iovcnt);
+	if (writev(qp->tapfd, iov, iovcnt) < 0)
+		qp->tx_drops++;
+	else
+		qp->tx_packets++;
+	DM_TRACE2(tap_tx, qp->idx, len);
+}
+
+static void
+virtio_net_tap_dump(int fd, void *arg)
+{
+	struct pci_vdev *dev = arg;
+	struct virtio_net *net = dev->arg;
+	struct virtio_net_qpair *qp;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qpairs[i];
+		dprintf(fd, "pair %d rx_packets %lu rx_drops %lu "
+			"rx_filtered %lu tx_packets %lu tx_drops %lu\n", i,
+			qp->rx_packets, qp->rx_drops, qp->rx_filtered,
+			qp->tx_packets, qp->tx_drops);
+	}
 }
 
 /*
@@ -327,93 +678,278 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
+/*
+ * Gather rx chains back to back into iov. Without merged rx buffers a
+ * frame has to fit in one chain; with them, keep going until there is
+ * room for a full sized frame and its header. Returns the number of
+ * chains, whose heads and lengths are stored in idx[] and len[].
+ */
+static int
+virtio_net_rx_getchains(struct virtio_net *net, struct virtio_vq_info *vq,
+			struct iovec *iov, int *niov, uint16_t *idx,
+			uint32_t *len)
+{
+	int nchains, total, maxlen, n, i;
+
+	maxlen = net->rx_vhdrlen + ((net->features & VIRTIO_NET_F_GUEST_GSO) ?
+		 VIRTIO_NET_RX_MAXGSO : VIRTIO_NET_RX_MAXLEN);
+	nchains = total = *niov = 0;
+	do {
+		n = vq_getchain(vq, &idx[nchains], &iov[*niov],
+				VIRTIO_NET_MAXSEGS - *niov, NULL);
+		if (n <= 0)
+			break;
+		if (n > VIRTIO_NET_MAXSEGS - *niov) {
+			if (nchains == 0) {
+				/* no frame could ever use it; hand it back */
+				vq_relchain(vq, idx[0], 0);
+				break;
+			}
+			/* out of iovecs, leave it for the next frame */
+			vq_retchain(vq);
+			break;
+		}
+
+		len[nchains] = 0;
+		for (i = 0; i < n; i++)
+			len[nchains] += iov[*niov + i].iov_len;
+		total += len[nchains];
+		*niov += n;
+		nchains++;
+	} while (net->rx_merge && total < maxlen &&
+		 *niov < VIRTIO_NET_MAXSEGS && vq_has_descs(vq));
+
+	return nchains;
+}
+
+/*
+ * Hand the chains that hold a received frame of tlen bytes (header
+ * included) back to the guest in one go, and requeue the leftovers.
+ */
+static void
+virtio_net_rx_relchains(struct virtio_net *net, struct virtio_vq_info *vq,
+			void *vrx, uint16_t *idx, uint32_t *len, int nchains,
+			int tlen)
+{
+	int i;
+
+	for (i = 0; i < nchains && (i == 0 || tlen > 0); i++) {
+		if (tlen < (int)len[i])
+			len[i] = tlen > 0 ? tlen : 0;
+		tlen -= len[i];
+	}
+
+	/*
+	 * Unless the tap filled in the offload fields, the only valid
+	 * field in the rx packet header is the number of buffers if
+	 * merged rx bufs were negotiated.
+	 */
+	if (!net->vnet_hdr)
+		memset(vrx, 0, net->rx_vhdrlen);
+
+	if (net->rx_merge) {
+		struct virtio_net_rxhdr *vrxh;
+
+		vrxh = vrx;
+		vrxh->vrh_bufs = i;
+	}
+
+	vq_relchains(vq, idx, len, i);
+	for (; i < nchains; i++)
+		vq_retchain(vq);
+}
+
+/*
+ * Does the guest want a frame of len bytes, starting off bytes into
+ * iov? Only consulted once it negotiated CTRL_RX or CTRL_VLAN. The
+ * filter is updated from the control queue without taking the rx
+ * side's locks; a frame racing with an update goes either way.
+ */
+static int
+virtio_net_rx_accept(struct virtio_net *net, struct iovec *iov, int n,
+		     size_t off, int len)
+{
+	struct virtio_net_rxfilter *f = &net->rxf;
+	uint8_t eh[ETHER_HDR_LEN + 4], *p;
+	size_t copied, chunk;
+	uint16_t vid;
+	int i;
+
+	if (len < ETHER_HDR_LEN)
+		return 1;
+	for (i = 0, copied = 0; i < n && copied < sizeof(eh); i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		chunk = iov[i].iov_len - off;
+		if (chunk > sizeof(eh) - copied)
+			chunk = sizeof(eh) - copied;
+		memcpy(&eh[copied], (uint8_t *)iov[i].iov_base + off, chunk);
+		copied += chunk;
+		off = 0;
+	}
+	if (copied < sizeof(eh))
+		memset(&eh[copied], 0, sizeof(eh) - copied);
+
+	if ((net->features & VIRTIO_NET_F_CTRL_VLAN) &&
+	    len >= ETHER_HDR_LEN + 4 &&
+	    eh[12] == 0x81 && eh[13] == 0x00) {
+		vid = ((eh[14] << 8) | eh[15]) & (VIRTIO_NET_MAX_VLANS - 1);
+		if (!(f->vlans[vid / 32] & (1U << (vid % 32))))
+			return 0;
+	}
+
+	if (!(net->features & VIRTIO_NET_F_CTRL_RX) || f->promisc)
+		return 1;
+
+	if (ETHER_IS_MULTICAST(eh)) {
+		if (f->allmulti || f->multi_overflow)
+			return 1;
+		for (p = eh; p < &eh[ETHER_ADDR_LEN] && *p == 0xff; p++)
+			;
+		if (p == &eh[ETHER_ADDR_LEN])
+			return 1;	/* broadcast */
+		for (i = 0; i < f->nmulti; i++)
+			if (!memcmp(eh, f->multi[i], ETHER_ADDR_LEN))
+				return 1;
+		return 0;
+	}
+
+	if (f->uni_overflow || !memcmp(eh, net->config.mac, ETHER_ADDR_LEN))
+		return 1;
+	for (i = 0; i < f->nuni; i++)
+		if (!memcmp(eh, f->uni[i], ETHER_ADDR_LEN))
+			return 1;
+	return 0;
+}
+
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx(struct virtio_net_qpair *qp)
 {
+	struct virtio_net *net = qp->net;
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
 	struct virtio_vq_info *vq;
 	void *vrx;
-	int len, n;
-	uint16_t idx;
+	int len, n, nchains;
+	uint16_t idx[VIRTIO_NET_MAXSEGS];
+	uint32_t clen[VIRTIO_NET_MAXSEGS];
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	assert(net->tapfd != -1);
+	assert(qp->tapfd != -1);
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
-		 * Drop the packet and try later.
+		 * Rather than reading and dropping the frames here, stop
+		 * watching the tap and let the kernel queue or drop them
+		 * until the guest kicks the rx queue.
 		 */
-		(void) read(net->tapfd, dummybuf, sizeof(dummybuf));
+		if (!qp->rx_parked) {
+			mevent_disable(qp->mevp);
+			qp->rx_parked = 1;
+		}
 		return;
 	}
 
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = qp->rxq;
+	qp->rx_backlog = 0;
+again:
 	if (!vq_has_descs(vq)) {
 		/*
-		 * Drop the packet and try later.  Interrupt on
-		 * empty, if that's negotiated.
+		 * Leave the frames in the tap and have the guest kick
+		 * once it posts buffers; no new edge would come for them.
+		 * Interrupt on empty, if that's negotiated.
 		 */
-		(void) read(net->tapfd, dummybuf, sizeof(dummybuf));
+		qp->rx_backlog = 1;
+		if (vq_kick_enable(vq)) {
+			vq_kick_disable(vq);
+			qp->rx_backlog = 0;
+			goto again;
+		}
 		vq_endchains(vq, 1);
 		return;
 	}
 
 	do {
 		/*
-		 * Get descriptor chain.
+		 * Get descriptor chains, enough for a whole frame.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+		nchains = virtio_net_rx_getchains(net, vq, iov, &n, idx, clen);
+		if (nchains == 0) {
+			/*
+			 * A chain we can't take would stay at the head of
+			 * the ring; leave the frames to the next rx event
+			 * rather than spin on it.
+			 */
+			WPRINTF(("vtnet: bad rx chain, driver confused?\n"));
+			vq_endchains(vq, 1);
+			return;
+		}
 
 		/*
 		 * Get a pointer to the rx header, and use the
 		 * data immediately following it for the packet buffer.
 		 */
 		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
-
-		len = readv(net->tapfd, riov, n);
+		if (net->vnet_hdr) {
+			/* the tap writes the header along with the frame */
+			len = readv(qp->tapfd, iov, n);
+			if (len >= 0)
+				len -= net->rx_vhdrlen;
+		} else {
+			riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+			len = readv(qp->tapfd, riov, n);
+		}
 
 		if (len < 0 && errno == EWOULDBLOCK) {
 			/*
 			 * No more packets, but still some avail ring
 			 * entries.  Interrupt if needed/appropriate.
 			 */
-			vq_retchain(vq);
+			while (nchains--)
+				vq_retchain(vq);
 			vq_endchains(vq, 0);
 			return;
 		}
 
 		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * A frame the guest filtered out leaves its buffers
+		 * posted, as if it never came.
 		 */
-		memset(vrx, 0, net->rx_vhdrlen);
-
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
-
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+		if (len >= 0 && (net->features &
+		    (VIRTIO_NET_F_CTRL_RX | VIRTIO_NET_F_CTRL_VLAN)) &&
+		    !virtio_net_rx_accept(net, net->vnet_hdr ? iov : riov, n,
+					  net->vnet_hdr ? net->rx_vhdrlen : 0,
+					  len)) {
+			qp->rx_filtered++;
+			while (nchains--)
+				vq_retchain(vq);
+			continue;
 		}
+		if (len >= 0)
+			qp->rx_packets++;
+		DM_TRACE2(tap_rx, qp->idx, len);
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release the chains this frame used and handle more
+		 * frames; the interrupt is deferred until the batch is
+		 * drained.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		virtio_net_rx_relchains(net, vq, vrx, idx, clen, nchains,
+					len + net->rx_vhdrlen);
 	} while (vq_has_descs(vq));
 
-	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
-	vq_endchains(vq, 1);
+	/* the ring filled up; the tap may still hold frames */
+	goto again;
 }
 
 static inline int
@@ -503,9 +1039,10 @@ virtio_net_netmap_readv(struct nm_desc *nmd, struct iovec *iov, int iovcnt)
  * Called to send a buffer chain out to the vale port
  */
 static void
-virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
-		    int len)
+virtio_net_netmap_tx(struct virtio_net_qpair *qp, struct iovec *iov,
+		    int iovcnt, int len)
 {
+	struct virtio_net *net = qp->net;
 	static char pad[60]; /* all zero bytes */
 
 	if (net->nmd == NULL)
@@ -525,13 +1062,15 @@ virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 }
 
 static void
-virtio_net_netmap_rx(struct virtio_net *net)
+virtio_net_netmap_rx(struct virtio_net_qpair *qp)
 {
+	struct virtio_net *net = qp->net;
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
 	struct virtio_vq_info *vq;
 	void *vrx;
-	int len, n;
-	uint16_t idx;
+	int len, n, nchains;
+	uint16_t idx[VIRTIO_NET_MAXSEGS];
+	uint32_t clen[VIRTIO_NET_MAXSEGS];
 
 	/*
 	 * Should never be called without a valid netmap descriptor
@@ -542,7 +1081,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
@@ -553,7 +1092,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = qp->rxq;
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
@@ -566,10 +1105,11 @@ virtio_net_netmap_rx(struct virtio_net *net)
 
 	do {
 		/*
-		 * Get descriptor chain.
+		 * Get descriptor chains, enough for a whole frame.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+		nchains = virtio_net_rx_getchains(net, vq, iov, &n, idx, clen);
+		if (nchains == 0)
+			break;
 
 		/*
 		 * Get a pointer to the rx header, and use the
@@ -585,175 +1125,645 @@ virtio_net_netmap_rx(struct virtio_net *net)
 			 * No more packets, but still some avail ring
 			 * entries.  Interrupt if needed/appropriate.
 			 */
-			vq_retchain(vq);
+			while (nchains--)
+				vq_retchain(vq);
 			vq_endchains(vq, 0);
 			return;
 		}
 
 		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
-		 */
-		memset(vrx, 0, net->rx_vhdrlen);
-
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
-
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
-		}
-
-		/*
-		 * Release this chain and handle more chains.
+		 * Release the chains this frame used and handle more
+		 * frames; the interrupt is deferred until the batch is
+		 * drained.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		virtio_net_rx_relchains(net, vq, vrx, idx, clen, nchains,
+					len + net->rx_vhdrlen);
 	} while (vq_has_descs(vq));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
 }
 
-static void
-virtio_net_rx_callback(int fd, enum ev_type type, void *param)
-{
-	struct virtio_net *net = param;
+/*
+ * AF_XDP backend. One socket is bound to a single queue of a host
+ * NIC. Its UMEM is split into two halves: one half feeds the fill/rx
+ * rings, the other holds frames for the tx/completion rings. Ring
+ * indices are published once per batch rather than once per frame.
+ *
+ * A redirecting XDP program has to be attached to the NIC beforehand,
+ * with its XSKMAP pinned in bpffs; the xsks_map= option names the pin
+ * and we insert our socket at the index of the queue we bind to.
+ */
+#define VIRTIO_NET_XDP_FRAMES		4096
+#define VIRTIO_NET_XDP_FRAMESZ		2048
+#define VIRTIO_NET_XDP_RINGSZ		(VIRTIO_NET_XDP_FRAMES / 2)
+
+struct virtio_net_xdp_ring {
+	volatile uint32_t *producer;
+	volatile uint32_t *consumer;
+	void		*ring;
+	uint32_t	mask;
+	uint32_t	cached_prod;
+	uint32_t	cached_cons;
+	void		*map;
+	size_t		maplen;
+};
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+struct virtio_net_xsk {
+	int		fd;
+	void		*umem;
+	struct virtio_net_xdp_ring rx;
+	struct virtio_net_xdp_ring tx;
+	struct virtio_net_xdp_ring fill;
+	struct virtio_net_xdp_ring comp;
+	uint64_t	tx_frames[VIRTIO_NET_XDP_RINGSZ];	/* free list */
+	int		tx_nfree;
+	int		tx_pending;
+};
 
+static void
+virtio_net_xdp_rx_flush(struct virtio_net_xsk *xsk)
+{
+	__atomic_store_n(xsk->rx.consumer, xsk->rx.cached_cons,
+			 __ATOMIC_RELEASE);
+	__atomic_store_n(xsk->fill.producer, xsk->fill.cached_prod,
+			 __ATOMIC_RELEASE);
 }
 
-static void
-virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
+/*
+ * Copy the next received frame into iov and recycle its UMEM frame to
+ * the fill ring. Returns the frame length, or 0 if there is none.
+ */
+static int
+virtio_net_xdp_readv(struct virtio_net_xsk *xsk, struct iovec *iov,
+		     int iovcnt)
 {
-	struct virtio_net *net = vdev;
+	struct xdp_desc *desc;
+	uint8_t *buf;
+	size_t left, n;
+	int i, len = 0;
+
+	if (xsk->rx.cached_cons == xsk->rx.cached_prod) {
+		xsk->rx.cached_prod = __atomic_load_n(xsk->rx.producer,
+						      __ATOMIC_ACQUIRE);
+		if (xsk->rx.cached_cons == xsk->rx.cached_prod)
+			return 0;
+	}
 
-	/*
-	 * A qnotify means that the rx process can now begin
-	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	desc = &((struct xdp_desc *)xsk->rx.ring)[xsk->rx.cached_cons++ &
+						   xsk->rx.mask];
+	buf = (uint8_t *)xsk->umem + desc->addr;
+	left = desc->len;
+
+	for (i = 0; i < iovcnt && left > 0; i++) {
+		n = iov[i].iov_len < left ? iov[i].iov_len : left;
+		memcpy(iov[i].iov_base, buf + len, n);
+		len += n;
+		left -= n;
 	}
+
+	((uint64_t *)xsk->fill.ring)[xsk->fill.cached_prod++ &
+				     xsk->fill.mask] =
+		desc->addr & ~((uint64_t)VIRTIO_NET_XDP_FRAMESZ - 1);
+
+	return len;
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_xdp_drop(struct virtio_net_xsk *xsk)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
-	int plen, tlen;
-	uint16_t idx;
-
-	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
-	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
-	}
+	struct iovec iov = { dummybuf, sizeof(dummybuf) };
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
-
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	while (virtio_net_xdp_readv(xsk, &iov, 1) > 0)
+		;
+	virtio_net_xdp_rx_flush(xsk);
 }
 
 static void
-virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
+virtio_net_xdp_tx_flush(struct virtio_net_qpair *qp)
 {
-	struct virtio_net *net = vdev;
+	struct virtio_net_xsk *xsk = qp->net->xsk;
 
-	/*
-	 * Any ring entries to process?
-	 */
-	if (!vq_has_descs(vq))
+	if (xsk == NULL || xsk->tx_pending == 0)
 		return;
 
-	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	__atomic_store_n(xsk->tx.producer, xsk->tx.cached_prod,
+			 __ATOMIC_RELEASE);
+	xsk->tx_pending = 0;
+
+	/* copy mode only transmits when kicked */
+	(void) sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
 }
 
 /*
- * Thread which will handle processing of TX desc
+ * Called from the tx thread to queue a buffer chain on the AF_XDP
+ * socket; the batch is kicked by virtio_net_xdp_tx_flush().
  */
-static void *
-virtio_net_tx_thread(void *param)
+static void
+virtio_net_xdp_tx(struct virtio_net_qpair *qp, struct iovec *iov, int iovcnt,
+		  int len)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq;
-	int error;
+	struct virtio_net_xsk *xsk = qp->net->xsk;
+	struct xdp_desc *desc;
+	uint32_t prod;
+	uint64_t addr;
+	uint8_t *buf;
+	int i, off;
+
+	if (xsk == NULL || len > VIRTIO_NET_XDP_FRAMESZ)
+		return;
 
-	vq = &net->queues[VIRTIO_NET_TXQ];
+	/* reclaim frames the kernel is done with */
+	prod = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE);
+	while (xsk->comp.cached_cons != prod)
+		xsk->tx_frames[xsk->tx_nfree++] =
+			((uint64_t *)xsk->comp.ring)[xsk->comp.cached_cons++ &
+						     xsk->comp.mask];
+	__atomic_store_n(xsk->comp.consumer, xsk->comp.cached_cons,
+			 __ATOMIC_RELEASE);
+
+	if (xsk->tx_nfree == 0) {
+		/* push out what we have and drop this one */
+		virtio_net_xdp_tx_flush(qp);
+		return;
+	}
 
-	/*
-	 * Let us wait till the tx queue pointers get initialised &
+	addr = xsk->tx_frames[--xsk->tx_nfree];
+	buf = (uint8_t *)xsk->umem + addr;
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	desc = &((struct xdp_desc *)xsk->tx.ring)[xsk->tx.cached_prod++ &
+						   xsk->tx.mask];
+	desc->addr = addr;
+	desc->len = len;
+	desc->options = 0;
+	xsk->tx_pending++;
+}
+
+static void
+virtio_net_xdp_rx(struct virtio_net_qpair *qp)
+{
+	struct virtio_net *net = qp->net;
+	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_vq_info *vq;
+	void *vrx;
+	int len, n, nchains;
+	uint16_t idx[VIRTIO_NET_MAXSEGS];
+	uint32_t clen[VIRTIO_NET_MAXSEGS];
+
+	/*
+	 * Should never be called without a valid socket
+	 */
+	assert(net->xsk != NULL);
+
+	/*
+	 * But, will be called when the rx ring hasn't yet
+	 * been set up or the guest is resetting the device.
+	 */
+	if (!qp->rx_ready || net->resetting) {
+		/*
+		 * Drop the packets and try later.
+		 */
+		virtio_net_xdp_drop(net->xsk);
+		return;
+	}
+
+	/*
+	 * Check for available rx buffers
+	 */
+	vq = qp->rxq;
+	if (!vq_has_descs(vq)) {
+		/*
+		 * Drop the packets and try later.  Interrupt on
+		 * empty, if that's negotiated.
+		 */
+		virtio_net_xdp_drop(net->xsk);
+		vq_endchains(vq, 1);
+		return;
+	}
+
+	do {
+		nchains = virtio_net_rx_getchains(net, vq, iov, &n, idx, clen);
+		if (nchains == 0)
+			break;
+
+		vrx = iov[0].iov_base;
+		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+
+		len = virtio_net_xdp_readv(net->xsk, riov, n);
+
+		if (len == 0) {
+			/*
+			 * No more packets, but still some avail ring
+			 * entries.  Interrupt if needed/appropriate.
+			 */
+			while (nchains--)
+				vq_retchain(vq);
+			virtio_net_xdp_rx_flush(net->xsk);
+			vq_endchains(vq, 0);
+			return;
+		}
+
+		virtio_net_rx_relchains(net, vq, vrx, idx, clen, nchains,
+					len + net->rx_vhdrlen);
+	} while (vq_has_descs(vq));
+
+	virtio_net_xdp_rx_flush(net->xsk);
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+{
+	struct virtio_net_qpair *qp = param;
+
+	pthread_mutex_lock(&qp->rx_mtx);
+	qp->rx_in_progress = 1;
+	qp->net->virtio_net_rx(qp);
+	qp->rx_in_progress = 0;
+	pthread_mutex_unlock(&qp->rx_mtx);
+
+}
+
+static void
+virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qpairs[VIRTIO_NET_QPAIR(vq->num)];
+	int parked;
+
+	/*
+	 * A qnotify means that the rx process can now begin
+	 */
+	if (qp->rx_ready == 0) {
+		qp->rx_ready = 1;
+		vq_kick_disable(vq);
+	}
+
+	/* under rx_mtx, so a tap event in flight parks before or sees it */
+	pthread_mutex_lock(&qp->rx_mtx);
+	parked = qp->rx_parked;
+	qp->rx_parked = 0;
+	pthread_mutex_unlock(&qp->rx_mtx);
+	if (parked) {
+		mevent_enable(qp->mevp);
+		qp->rx_backlog = 1;
+	}
+
+	/* the guest posted buffers for frames left in the tap */
+	if (qp->rx_backlog) {
+		vq_kick_disable(vq);
+		virtio_net_rx_callback(qp->tapfd, EVF_READ, qp);
+	}
+}
+
+static void
+virtio_net_sw_xmit(void *arg, struct iovec *iov, int iovcnt, int len)
+{
+	struct virtio_net_qpair *qp = arg;
+
+	qp->net->virtio_net_tx(qp, iov, iovcnt, len);
+}
+
+/*
+ * Send one chain of descriptors and return its transfer length.
+ */
+static uint32_t
+virtio_net_proctx(struct virtio_net_qpair *qp, struct iovec *iov, int n)
+{
+	struct net_offload_hdr vh;
+	int i;
+	int plen, tlen;
+
+	/*
+	 * The first descriptor is really the header
+	 * descriptor, so we need to sum up two lengths:
+	 * packet length and transfer length.
+	 */
+	assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+	plen = 0;
+	tlen = iov[0].iov_len;
+	for (i = 1; i < n; i++) {
+		plen += iov[i].iov_len;
+		tlen += iov[i].iov_len;
+	}
+
+	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
+	if (qp->net->vnet_hdr)
+		/* let the tap apply the guest's offload requests */
+		qp->net->virtio_net_tx(qp, iov, n, plen);
+	else if (qp->net->features & VIRTIO_NET_F_CSUM) {
+		/* only negotiated with swoffload: do them ourselves */
+		memset(&vh, 0, sizeof(vh));
+		memcpy(&vh, iov[0].iov_base, MIN(sizeof(vh), iov[0].iov_len));
+		if (net_offload_tx(&vh, &iov[1], n - 1, plen,
+				   virtio_net_sw_xmit, qp) < 0)
+			qp->tx_drops++;
+	} else
+		qp->net->virtio_net_tx(qp, &iov[1], n - 1, plen);
+
+	return tlen;
+}
+
+static void
+virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qpairs[VIRTIO_NET_QPAIR(vq->num)];
+
+	/*
+	 * Any ring entries to process?
+	 */
+	if (!vq_has_descs(vq))
+		return;
+
+	/* Signal the tx thread for processing */
+	pthread_mutex_lock(&qp->tx_mtx);
+	vq_kick_disable(vq);
+	if (qp->tx_in_progress == 0)
+		pthread_cond_signal(&qp->tx_cond);
+	pthread_mutex_unlock(&qp->tx_mtx);
+}
+
+/*
+ * Called with tx_mtx held and kicks off: spin on avail->idx for up to
+ * poll_ns, saving the guest a kick for a queue that is busy in bursts.
+ * Returns 1 once chains are there, with tx_mtx held again.
+ */
+static int
+virtio_net_tx_poll(struct virtio_net_qpair *qp)
+{
+	struct virtio_net *net = qp->net;
+	struct timespec ts;
+	uint64_t now, deadline;
+	int found;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	deadline = ts.tv_sec * 1000000000UL + ts.tv_nsec + net->poll_ns;
+	pthread_mutex_unlock(&qp->tx_mtx);
+	do {
+		found = vq_has_descs(qp->txq);
+		if (found || net->resetting || net->closing)
+			break;
+		__builtin_ia32_pause();
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	} while (now < deadline);
+	pthread_mutex_lock(&qp->tx_mtx);
+	return found;
+}
+
+/*
+ * Thread which will handle processing of TX desc for one queue pair
+ */
+static void *
+virtio_net_tx_thread(void *param)
+{
+	struct virtio_net_qpair *qp = param;
+	struct virtio_net *net = qp->net;
+	struct virtio_vq_info *vq;
+	struct iovec iov[VIRTIO_NET_MAXSEGS];
+	uint16_t idx[VIRTIO_NET_TX_BATCH];
+	uint32_t tlen[VIRTIO_NET_TX_BATCH];
+	int n[VIRTIO_NET_TX_BATCH];
+	int error, i, nchains, seg;
+
+	vq = qp->txq;
+
+	/*
+	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
-	error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	error = pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 	assert(error == 0);
+	if (net->closing) {
+		pthread_mutex_unlock(&qp->tx_mtx);
+		return NULL;
+	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
 		while (net->resetting || !vq_has_descs(vq)) {
-			vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
-			/* memory barrier */
-			mb();
-			if (!net->resetting && vq_has_descs(vq))
+			if (net->poll_ns && !net->resetting &&
+			    virtio_net_tx_poll(qp))
+				break;
+			if (vq_kick_enable(vq) && !net->resetting)
 				break;
 
-			net->tx_in_progress = 0;
-			error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
-			assert(error == 0);
+			qp->tx_in_progress = 0;
+			/* the wakeup may have come while polling */
+			if (!net->closing) {
+				error = pthread_cond_wait(&qp->tx_cond,
+							  &qp->tx_mtx);
+				assert(error == 0);
+			}
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
+				pthread_mutex_unlock(&qp->tx_mtx);
 				return NULL;
 			}
 		}
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		vq_kick_disable(vq);
+		qp->tx_in_progress = 1;
+		pthread_mutex_unlock(&qp->tx_mtx);
 
 		do {
 			/*
-			 * Run through entries, placing them into
-			 * iovecs and sending when an end-of-packet
-			 * is found
+			 * Run through entries a burst at a time, sending
+			 * each chain as a packet, then hand the whole
+			 * burst back with one update of the used index.
 			 */
-			virtio_net_proctx(net, vq);
+			nchains = vq_getchains(vq, idx, iov,
+			    VIRTIO_NET_MAXSEGS, NULL, n, VIRTIO_NET_TX_BATCH);
+			assert(nchains >= 1);
+			for (i = 0, seg = 0; i < nchains; seg += n[i++])
+				tlen[i] = virtio_net_proctx(qp, &iov[seg],
+				    n[i]);
+			vq_relchains(vq, idx, tlen, nchains);
 		} while (vq_has_descs(vq));
 
+		if (net->virtio_net_tx_flush)
+			net->virtio_net_tx_flush(qp);
+
 		/*
 		 * Generate an interrupt if needed.
 		 */
 		vq_endchains(vq, 1);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
 }
 
-#ifdef notyet
+/*
+ * Copy len bytes from offset off of a control request, whose readable
+ * part may be split across segments any which way. Returns the number
+ * of bytes copied.
+ */
+static size_t
+virtio_net_ctrl_read(struct iovec *iov, int n, size_t off, void *buf,
+		     size_t len)
+{
+	size_t copied, chunk;
+	int i;
+
+	for (i = 0, copied = 0; i < n && copied < len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		chunk = iov[i].iov_len - off;
+		if (chunk > len - copied)
+			chunk = len - copied;
+		memcpy((uint8_t *)buf + copied, (uint8_t *)iov[i].iov_base + off,
+		       chunk);
+		copied += chunk;
+		off = 0;
+	}
+	return copied;
+}
+
+/*
+ * MAC_TABLE_SET: a unicast then a multicast table, each a 32-bit entry
+ * count followed by the addresses. Nothing changes if it's truncated.
+ */
+static int
+virtio_net_ctrl_mac_table(struct virtio_net *net, struct iovec *iov, int n)
+{
+	struct virtio_net_rxfilter *f = &net->rxf;
+	uint8_t macs[2][VIRTIO_NET_MAC_ENTRIES][ETHER_ADDR_LEN];
+	uint32_t entries[2];
+	size_t off, len;
+	int i;
+
+	off = sizeof(struct virtio_net_ctrl_hdr);
+	for (i = 0; i < 2; i++) {
+		if (virtio_net_ctrl_read(iov, n, off, &entries[i],
+					 sizeof(entries[i])) !=
+		    sizeof(entries[i]))
+			return -1;
+		off += sizeof(entries[i]);
+		len = (size_t)entries[i] * ETHER_ADDR_LEN;
+		if (entries[i] <= VIRTIO_NET_MAC_ENTRIES &&
+		    virtio_net_ctrl_read(iov, n, off, macs[i], len) != len)
+			return -1;
+		off += len;
+	}
+
+	f->uni_overflow = entries[0] > VIRTIO_NET_MAC_ENTRIES;
+	f->nuni = f->uni_overflow ? 0 : entries[0];
+	memcpy(f->uni, macs[0], f->nuni * ETHER_ADDR_LEN);
+	f->multi_overflow = entries[1] > VIRTIO_NET_MAC_ENTRIES;
+	f->nmulti = f->multi_overflow ? 0 : entries[1];
+	memcpy(f->multi, macs[1], f->nmulti * ETHER_ADDR_LEN);
+	return 0;
+}
+
+static uint8_t
+virtio_net_ctrl_cmd(struct virtio_net *net, struct iovec *iov, int n)
+{
+	struct virtio_net_rxfilter *f = &net->rxf;
+	struct virtio_net_ctrl_hdr hdr;
+	uint8_t mac[ETHER_ADDR_LEN], on;
+	uint16_t val;
+	size_t off;
+
+	if (virtio_net_ctrl_read(iov, n, 0, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return VIRTIO_NET_ERR;
+	off = sizeof(hdr);
+
+	switch (hdr.class) {
+	case VIRTIO_NET_CTRL_RX:
+		if (!(net->features & VIRTIO_NET_F_CTRL_RX) ||
+		    virtio_net_ctrl_read(iov, n, off, &on, 1) != 1)
+			break;
+		if (hdr.cmd == VIRTIO_NET_CTRL_RX_PROMISC)
+			f->promisc = !!on;
+		else if (hdr.cmd == VIRTIO_NET_CTRL_RX_ALLMULTI)
+			f->allmulti = !!on;
+		else
+			break;
+		virtio_net_tap_filter(net);
+		return VIRTIO_NET_OK;
+
+	case VIRTIO_NET_CTRL_MAC:
+		if (hdr.cmd == VIRTIO_NET_CTRL_MAC_TABLE_SET &&
+		    (net->features & VIRTIO_NET_F_CTRL_RX)) {
+			if (virtio_net_ctrl_mac_table(net, iov, n) < 0)
+				break;
+		} else if (hdr.cmd == VIRTIO_NET_CTRL_MAC_ADDR_SET &&
+		    (net->features & VIRTIO_NET_F_CTRL_MAC_ADDR)) {
+			if (virtio_net_ctrl_read(iov, n, off, mac,
+						 sizeof(mac)) != sizeof(mac))
+				break;
+			memcpy(net->config.mac, mac, sizeof(mac));
+		} else
+			break;
+		virtio_net_tap_filter(net);
+		return VIRTIO_NET_OK;
+
+	case VIRTIO_NET_CTRL_VLAN:
+		if (!(net->features & VIRTIO_NET_F_CTRL_VLAN) ||
+		    virtio_net_ctrl_read(iov, n, off, &val, sizeof(val)) !=
+		    sizeof(val) || val >= VIRTIO_NET_MAX_VLANS)
+			break;
+		if (hdr.cmd == VIRTIO_NET_CTRL_VLAN_ADD)
+			f->vlans[val / 32] |= 1U << (val % 32);
+		else if (hdr.cmd == VIRTIO_NET_CTRL_VLAN_DEL)
+			f->vlans[val / 32] &= ~(1U << (val % 32));
+		else
+			break;
+		return VIRTIO_NET_OK;
+
+	case VIRTIO_NET_CTRL_MQ:
+		if (hdr.cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+		    virtio_net_ctrl_read(iov, n, off, &val, sizeof(val)) !=
+		    sizeof(val) || val < 1 || val > net->max_pairs)
+			break;
+		DPRINTF(("vtnet: %d queue pairs\n\r", val));
+		virtio_net_tap_set_pairs(net, val);
+		return VIRTIO_NET_OK;
+	}
+
+	DPRINTF(("vtnet: control %d:%d failed\n\r", hdr.class, hdr.cmd));
+	return VIRTIO_NET_ERR;
+}
+
+/*
+ * Control queue: queue pairs in use (MQ), and the receive filter
+ * (RX, MAC and VLAN classes). Each request is the command followed by
+ * a one byte ack the device writes.
+ */
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = vdev;
+	struct iovec iov[VIRTIO_NET_CTL_MAXSEGS];
+	uint8_t *ack;
+	uint16_t idx;
+	int n;
+
+	/* drain the ring, then have the guest kick for the next request */
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_CTL_MAXSEGS, NULL);
+		if (n < 2 || n > VIRTIO_NET_CTL_MAXSEGS ||
+		    iov[n - 1].iov_len < sizeof(*ack)) {
+			WPRINTF(("vtnet: malformed control request\n"));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		ack = iov[n - 1].iov_base;
+		*ack = virtio_net_ctrl_cmd(net, iov, n - 1);
+		vq_relchain(vq, idx, sizeof(*ack));
+	}
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -780,10 +1790,15 @@ virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
 	return 0;
 }
 
+/*
+ * Open a tap queue. Extra IFF_* flags the tun driver doesn't support
+ * are dropped from *flags, so the caller knows what it got.
+ */
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, int *flags)
 {
 	int tunfd, rc;
+	unsigned int features;
 	struct ifreq ifr;
 
 #define PATH_NET_TUN "/dev/net/tun"
@@ -793,8 +1808,13 @@ virtio_net_tap_open(char *devname)
 		return -1;
 	}
 
+	if (ioctl(tunfd, TUNGETFEATURES, &features) == 0)
+		*flags &= features;
+	else
+		*flags &= IFF_MULTI_QUEUE;
+
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | *flags;
 
 	if (*devname)
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -810,11 +1830,34 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Each tap queue after the first gets an rx thread of its own, so that
+ * receive work spreads over host cpus like transmit does. With evcpu=
+ * pair n runs on cpu + n. Failing that, it shares the device loop.
+ */
+static struct mevent_loop *
+virtio_net_rx_loop(struct virtio_net *net, struct virtio_net_qpair *qp)
+{
+	if (qp->idx == 0 || net->evloop == NULL)
+		return net->evloop;
+
+	snprintf(qp->evname, sizeof(qp->evname), "vtnet-rx%d", qp->idx);
+	qp->evloop = mevent_loop_create(qp->evname, net->ev_cpu >= 0 ?
+					net->ev_cpu + qp->idx : -1);
+	if (qp->evloop == NULL) {
+		WPRINTF(("vtnet: no rx thread for queue %d\n", qp->idx));
+		return net->evloop;
+	}
+	return qp->evloop;
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
 	char tbuf[80 + 5];	/* room for "acrn_" prefix */
 	char *tbuf_ptr;
+	struct virtio_net_qpair *qp;
+	int i, flags, opt = 1;
 
 	tbuf_ptr = tbuf;
 
@@ -827,32 +1870,64 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
-	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
-
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * Open one tap queue per queue pair. The first open names the
+	 * interface, the others attach to it. Offer fewer pairs if the
+	 * host runs out of queues.
 	 */
-	int opt = 1;
+	flags = IFF_VNET_HDR;
+	if (net->max_pairs > 1)
+		flags |= IFF_MULTI_QUEUE;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qpairs[i];
+		qp->tapfd = virtio_net_tap_open(tbuf, &flags);
+		if (qp->tapfd == -1) {
+			WPRINTF(("open of tap device %s queue %d failed\n",
+				tbuf, i));
+			break;
+		}
+		DPRINTF(("open of tap device %s queue %d success!\n",
+			tbuf, i));
+
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		if (ioctl(qp->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			close(qp->tapfd);
+			qp->tapfd = -1;
+			break;
+		}
+
+		/* in VBS-K mode the kernel reads the tap itself */
+		if (net->vbs_k.status == VIRTIO_DEV_INIT_SUCCESS)
+			continue;
 
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+		qp->mevp = mevent_add_on(virtio_net_rx_loop(net, qp),
+					 qp->tapfd, EVF_READ, MEVENT_F_EDGE,
+					 virtio_net_rx_callback, qp);
+		if (qp->mevp == NULL) {
+			WPRINTF(("Could not register event\n"));
+			mevent_loop_destroy(qp->evloop);
+			qp->evloop = NULL;
+			close(qp->tapfd);
+			qp->tapfd = -1;
+			break;
+		}
 	}
 
-	net->mevp = mevent_add(net->tapfd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
-		WPRINTF(("Could not register event\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (i > 0 && i < net->max_pairs) {
+		WPRINTF(("vtnet: only %d queue pairs available\n", i));
+		net->max_pairs = i;
 	}
+
+	net->vnet_hdr = (i > 0 && (flags & IFF_VNET_HDR));
+	virtio_net_tap_offload(net);
+
+	/* the guest starts with a single queue pair */
+	virtio_net_tap_set_pairs(net, 1);
 }
 
 static void
@@ -861,34 +1936,497 @@ virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
 	net->virtio_net_rx = virtio_net_netmap_rx;
 	net->virtio_net_tx = virtio_net_netmap_tx;
 
+	/* vale ports are driven through a single queue pair */
+	if (net->max_pairs > 1) {
+		WPRINTF(("vtnet: mq is not supported on %s\n", ifname));
+		net->max_pairs = 1;
+	}
+
 	net->nmd = nm_open(ifname, NULL, 0, 0);
 	if (net->nmd == NULL) {
 		WPRINTF(("open of netmap device %s failed\n", ifname));
 		return;
 	}
 
-	net->mevp = mevent_add(net->nmd->fd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
+	net->qpairs[0].mevp = mevent_add_on(net->evloop, net->nmd->fd,
+			       EVF_READ, 0, virtio_net_rx_callback,
+			       &net->qpairs[0]);
+	if (net->qpairs[0].mevp == NULL) {
 		WPRINTF(("Could not register event\n"));
 		nm_close(net->nmd);
 		net->nmd = NULL;
 	}
 }
 
+/* Spawn the TX thread of a pair, pinned if tx_affinity is set */
+static void
+virtio_net_tx_start(struct virtio_net *net, struct virtio_net_qpair *qp)
+{
+	char tname[32];		/* any slot, func and pair number */
+	cpu_set_t cpuset;
+
+	pthread_create(&qp->tx_tid, NULL, virtio_net_tx_thread, (void *)qp);
+	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d",
+		 net->base.dev->slot, net->base.dev->func, qp->idx);
+	pthread_setname_np(qp->tx_tid, tname);
+
+	if (net->tx_affinity >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(net->tx_affinity + qp->idx, &cpuset);
+		if (pthread_setaffinity_np(qp->tx_tid, sizeof(cpuset),
+					   &cpuset))
+			WPRINTF(("vtnet: failed to pin tx%d to cpu %d\n",
+				qp->idx, net->tx_affinity + qp->idx));
+	}
+}
+
+/* VBS-K interface function implementations */
+static void
+virtio_net_k_no_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	WPRINTF(("vtnet: VBS-K mode! Should not reach here!!\n"));
+}
+
+/*
+ * VBS-K couldn't take the rings: serve them here from now on, as if
+ * VBS-K had never been asked for. The tap gets polled and the pairs
+ * their TX threads, which pick up whatever the guest queued already.
+ */
+static void
+virtio_net_k_fallback(struct virtio_net *net)
+{
+	struct virtio_net_qpair *qp;
+	int i;
+
+	WPRINTF(("vtnet: VBS-K failed to start, falling back to VBS-U\n"));
+	virtio_net_kernel_reset(net);
+	net->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
+	net->ops.qnotify = NULL;
+	net->ops.set_status = NULL;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qpairs[i];
+		if (qp->tapfd >= 0 && qp->mevp == NULL) {
+			qp->mevp = mevent_add_on(virtio_net_rx_loop(net, qp),
+						 qp->tapfd, EVF_READ,
+						 MEVENT_F_EDGE,
+						 virtio_net_rx_callback, qp);
+			if (qp->mevp == NULL)
+				WPRINTF(("vtnet: no rx events for queue %d\n",
+					 i));
+		}
+		virtio_net_tx_start(net, qp);
+		virtio_net_ping_txq(net, qp->txq);
+	}
+}
+
+/*
+ * Once the guest driver is ready, hand the rings, MSI-X vectors and
+ * tap fd to VBS-K. From then on kicks and interrupts are handled in
+ * the kernel; we only see config space accesses.
+ */
+static void
+virtio_net_k_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_net *net = vdev;
+	struct vbs_backend_info backend;
+	struct msix_table_entry *mte;
+	struct virtio_vq_info *vq;
+	int nvq, rc, i;
+
+	if (net->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS ||
+	    !(status & VIRTIO_CR_STATUS_DRIVER_OK))
+		return;
+
+	nvq = net->base.vops->nvq;
+
+	strncpy(net->vbs_k.dev.name, net->base.vops->name, VBS_NAME_LEN);
+	net->vbs_k.dev.vmid = net->base.dev->vmctx->vmid;
+	net->vbs_k.dev.nvq = nvq;
+	net->vbs_k.dev.negotiated_features = net->base.negotiated_caps;
+	/* let VBS-K handle the kick register */
+	net->vbs_k.dev.pio_range_start = net->base.dev->bar[0].addr +
+					 VIRTIO_CR_QNOTIFY;
+	net->vbs_k.dev.pio_range_len = 2;
+
+	net->vbs_k.vqs.nvq = nvq;
+	for (i = 0; i < nvq; i++) {
+		vq = &net->queues[i];
+		net->vbs_k.vqs.vqs[i].qsize = vq->qsize;
+		net->vbs_k.vqs.vqs[i].pfn = vq->pfn;
+		net->vbs_k.vqs.vqs[i].msix_idx = vq->msix_idx;
+		if (vq->msix_idx != VIRTIO_MSI_NO_VECTOR) {
+			mte = &net->base.dev->msix.table[vq->msix_idx];
+			net->vbs_k.vqs.vqs[i].msix_addr = mte->addr;
+			net->vbs_k.vqs.vqs[i].msix_data = mte->msg_data;
+		}
+
+		backend.idx = i;
+		backend.fd = net->qpairs[VIRTIO_NET_QPAIR(i)].tapfd;
+		rc = vbs_kernel_set_backend(net->vbs_k.fd, &backend);
+		if (rc < 0) {
+			WPRINTF(("vtnet: VBS-K set backend %d failed\n", i));
+			virtio_net_k_fallback(net);
+			return;
+		}
+	}
+
+	rc = virtio_net_kernel_start(net);
+	if (rc < 0) {
+		WPRINTF(("virtio_net_kernel_start() failed\n"));
+		virtio_net_k_fallback(net);
+	} else {
+		net->vbs_k.status = VIRTIO_DEV_STARTED;
+	}
+}
+
+/*
+ * Called in virtio_net_init(), before the tap is opened, so the tap
+ * setup knows whether to poll it in user space.
+ */
+static int
+virtio_net_kernel_init(struct virtio_net *net)
+{
+	net->vbs_k.fd = open("/dev/vbs_net", O_RDWR);
+	if (net->vbs_k.fd < 0) {
+		WPRINTF(("Failed to open /dev/vbs_net!\n"));
+		return -VIRTIO_ERROR_FD_OPEN_FAILED;
+	}
+	DPRINTF(("Open /dev/vbs_net success!\n"));
+
+	memset(&net->vbs_k.dev, 0, sizeof(struct vbs_dev_info));
+	memset(&net->vbs_k.vqs, 0, sizeof(struct vbs_vqs_info));
+
+	return VIRTIO_SUCCESS;
+}
+
+static int
+virtio_net_kernel_start(struct virtio_net *net)
+{
+	if (vbs_kernel_start(net->vbs_k.fd,
+			     &net->vbs_k.dev,
+			     &net->vbs_k.vqs) < 0) {
+		WPRINTF(("Failed in vbs_k_start!\n"));
+		return -VIRTIO_ERROR_START;
+	}
+
+	DPRINTF(("vbs_k_started!\n"));
+	return VIRTIO_SUCCESS;
+}
+
+static int
+virtio_net_kernel_stop(struct virtio_net *net)
+{
+	return vbs_kernel_stop(net->vbs_k.fd);
+}
+
+static int
+virtio_net_kernel_reset(struct virtio_net *net)
+{
+	memset(&net->vbs_k.dev, 0, sizeof(struct vbs_dev_info));
+	memset(&net->vbs_k.vqs, 0, sizeof(struct vbs_vqs_info));
+
+	return vbs_kernel_reset(net->vbs_k.fd);
+}
+
+static int
+virtio_net_xdp_map_ring(struct virtio_net_xsk *xsk,
+			struct virtio_net_xdp_ring *r,
+			struct xdp_ring_offset *off, uint32_t nents,
+			size_t desc_size, off_t pgoff)
+{
+	r->maplen = off->desc + nents * desc_size;
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return -1;
+	}
+
+	r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+	r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+	r->ring = (uint8_t *)r->map + off->desc;
+	r->mask = nents - 1;
+	r->cached_prod = *r->producer;
+	r->cached_cons = *r->consumer;
+	return 0;
+}
+
+/*
+ * Insert the socket into the XSKMAP pinned at path, at index queue.
+ */
+static int
+virtio_net_xdp_map_update(const char *path, uint32_t queue, int fd)
+{
+	union bpf_attr attr;
+	int map_fd, rc;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (uint64_t)(uintptr_t)path;
+	map_fd = syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+	if (map_fd < 0)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uint64_t)(uintptr_t)&queue;
+	attr.value = (uint64_t)(uintptr_t)&fd;
+	rc = syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr));
+
+	close(map_fd);
+	return rc;
+}
+
+static void
+virtio_net_xdp_close(struct virtio_net_xsk *xsk)
+{
+	struct virtio_net_xdp_ring *rings[] = {
+		&xsk->rx, &xsk->tx, &xsk->fill, &xsk->comp
+	};
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (rings[i]->map)
+			munmap(rings[i]->map, rings[i]->maplen);
+	if (xsk->fd >= 0)
+		close(xsk->fd);
+	if (xsk->umem)
+		munmap(xsk->umem, VIRTIO_NET_XDP_FRAMES *
+		       VIRTIO_NET_XDP_FRAMESZ);
+	free(xsk);
+}
+
+static struct virtio_net_xsk *
+virtio_net_xdp_open(const char *ifname, uint32_t queue, const char *xsks_map)
+{
+	struct virtio_net_xsk *xsk;
+	struct xdp_umem_reg ureg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen;
+	int ringsz = VIRTIO_NET_XDP_RINGSZ;
+	unsigned int ifindex;
+	int i;
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		WPRINTF(("vtnet: no such interface %s\n", ifname));
+		return NULL;
+	}
+
+	xsk = calloc(1, sizeof(struct virtio_net_xsk));
+	if (!xsk)
+		return NULL;
+
+	xsk->umem = mmap(NULL, VIRTIO_NET_XDP_FRAMES * VIRTIO_NET_XDP_FRAMESZ,
+			 PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		xsk->umem = NULL;
+		goto fail;
+	}
+
+	xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (xsk->fd < 0)
+		goto fail;
+
+	memset(&ureg, 0, sizeof(ureg));
+	ureg.addr = (uint64_t)(uintptr_t)xsk->umem;
+	ureg.len = VIRTIO_NET_XDP_FRAMES * VIRTIO_NET_XDP_FRAMESZ;
+	ureg.chunk_size = VIRTIO_NET_XDP_FRAMESZ;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &ureg, sizeof(ureg)) ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ringsz,
+		       sizeof(ringsz)) ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringsz,
+		       sizeof(ringsz)) ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ringsz,
+		       sizeof(ringsz)) ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ringsz,
+		       sizeof(ringsz)))
+		goto fail;
+
+	optlen = sizeof(off);
+	if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+		goto fail;
+
+	if (virtio_net_xdp_map_ring(xsk, &xsk->rx, &off.rx, ringsz,
+			sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) ||
+	    virtio_net_xdp_map_ring(xsk, &xsk->tx, &off.tx, ringsz,
+			sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) ||
+	    virtio_net_xdp_map_ring(xsk, &xsk->fill, &off.fr, ringsz,
+			sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) ||
+	    virtio_net_xdp_map_ring(xsk, &xsk->comp, &off.cr, ringsz,
+			sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING))
+		goto fail;
+
+	/* first half of the UMEM receives, second half transmits */
+	for (i = 0; i < VIRTIO_NET_XDP_RINGSZ; i++) {
+		((uint64_t *)xsk->fill.ring)[xsk->fill.cached_prod++ &
+					     xsk->fill.mask] =
+			(uint64_t)i * VIRTIO_NET_XDP_FRAMESZ;
+		xsk->tx_frames[i] = (uint64_t)(i + VIRTIO_NET_XDP_RINGSZ) *
+				    VIRTIO_NET_XDP_FRAMESZ;
+	}
+	xsk->tx_nfree = VIRTIO_NET_XDP_RINGSZ;
+	__atomic_store_n(xsk->fill.producer, xsk->fill.cached_prod,
+			 __ATOMIC_RELEASE);
+
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)))
+		goto fail;
+
+	if (xsks_map && virtio_net_xdp_map_update(xsks_map, queue, xsk->fd)) {
+		WPRINTF(("vtnet: failed to add socket to %s\n", xsks_map));
+		goto fail;
+	}
+
+	return xsk;
+
+fail:
+	WPRINTF(("vtnet: AF_XDP setup on %s queue %u failed: %s\n",
+		ifname, queue, strerror(errno)));
+	virtio_net_xdp_close(xsk);
+	return NULL;
+}
+
+static void
+virtio_net_xdp_setup(struct virtio_net *net, char *devname)
+{
+	net->virtio_net_rx = virtio_net_xdp_rx;
+	net->virtio_net_tx = virtio_net_xdp_tx;
+	net->virtio_net_tx_flush = virtio_net_xdp_tx_flush;
+
+	/* one socket, bound to one NIC queue */
+	if (net->max_pairs > 1) {
+		WPRINTF(("vtnet: mq is not supported on %s\n", devname));
+		net->max_pairs = 1;
+	}
+
+	net->xsk = virtio_net_xdp_open(devname, net->xdp_queue,
+				       net->xsks_map);
+	if (net->xsk == NULL)
+		return;
+
+	net->qpairs[0].mevp = mevent_add_on(net->evloop, net->xsk->fd,
+			       EVF_READ, 0, virtio_net_rx_callback,
+			       &net->qpairs[0]);
+	if (net->qpairs[0].mevp == NULL) {
+		WPRINTF(("Could not register event\n"));
+		virtio_net_xdp_close(net->xsk);
+		net->xsk = NULL;
+	}
+}
+
+/*
+ * vhost-user backend: another process, such as an OVS-DPDK switch,
+ * services the data queues; see vhost_user.c. The config space and
+ * the control queue stay here.
+ */
+
+/* No reconnect; the guest has to live without the link */
+static void
+virtio_net_vhost_lost(struct virtio_net *net)
+{
+	WPRINTF(("vtnet: vhost-user backend lost, link down\n"));
+	net->config.status = 0;
+	if (net->features & VIRTIO_NET_F_STATUS)
+		virtio_config_changed(&net->base);
+}
+
+/* the rings of the queue pairs the guest uses */
+static void
+virtio_net_vhost_enable(struct virtio_net *net)
+{
+	int npairs, i;
+
+	npairs = net->curr_pairs > 0 ? net->curr_pairs : 1;
+	for (i = 0; i < net->max_pairs * 2; i++) {
+		if (vhost_user_enable(net->vhost, i,
+		    VIRTIO_NET_QPAIR(i) < npairs) < 0) {
+			virtio_net_vhost_lost(net);
+			return;
+		}
+	}
+}
+
+static void
+virtio_net_vhost_stop(struct virtio_net *net)
+{
+	if (vhost_user_stop(net->vhost) < 0)
+		virtio_net_vhost_lost(net);
+}
+
+static void
+virtio_net_vhost_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_net *net = vdev;
+
+	if (!(status & VIRTIO_CR_STATUS_DRIVER_OK) || net->vhost->started)
+		return;
+	if (vhost_user_start(net->vhost, net->features) < 0) {
+		virtio_net_vhost_lost(net);
+		return;
+	}
+	virtio_net_vhost_enable(net);
+}
+
+static void
+virtio_net_vhost_kick(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = vdev;
+
+	vhost_user_kick(net->vhost, vq);
+}
+
+static void
+virtio_net_vhost_setup(struct virtio_net *net, struct vmctx *ctx,
+		       char *path)
+{
+	struct vhost_user *vu;
+	uint64_t npairs;
+
+	vu = vhost_user_open(ctx, path, VHOST_USER_PROTOCOL_F_MQ);
+	if (vu == NULL)
+		return;
+
+	/* GET_QUEUE_NUM counts queue pairs */
+	if (vhost_user_get_queue_num(vu, &npairs) < 0)
+		goto fail;
+	if (npairs < net->max_pairs) {
+		WPRINTF(("vtnet: vhost-user backend has %lu queue pairs\n",
+			npairs));
+		net->max_pairs = npairs > 0 ? npairs : 1;
+	}
+
+	if (vhost_user_init_queues(vu, net->queues, net->max_pairs * 2,
+				   net->evloop) < 0)
+		goto fail;
+
+	net->vhost = vu;
+	return;
+
+fail:
+	WPRINTF(("vtnet: vhost-user setup on %s failed\n", path));
+	vhost_user_close(vu);
+}
+
 static int
 virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	MD5_CTX mdctx;
 	unsigned char digest[16];
 	char nstr[80];
-	char tname[MAXCOMLEN + 1];
+	char mname[PI_NAMESZ + 4];
 	struct virtio_net *net;
 	char *devname;
-	char *vtopts;
-	int mac_provided;
+	char *vtopts, *opt;
+	struct virtio_net_qpair *qp;
+	int mac_provided, poll_usec, poll_cpu;
 	pthread_mutexattr_t attr;
-	int rc;
+	int rc, i, nvq;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -910,25 +2448,24 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_net: pthread_mutex_init failed with "
 			"error %d!\n", rc));
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
-	net->base.mtx = &net->mtx;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
-
 	/*
-	 * Attempt to open the tap device and read the MAC address
-	 * if specified
+	 * Attempt to open the tap device and read the MAC address,
+	 * number of queue pairs and TX thread affinity if specified
 	 */
 	mac_provided = 0;
-	net->tapfd = -1;
 	net->nmd = NULL;
+	net->max_pairs = 1;
+	net->tx_affinity = -1;
+	net->ev_cpu = -1;
+	net->rx_merge = 1;
+	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->vbs_k.status = VIRTIO_DEV_INITIAL;
+	net->vbs_k.fd = -1;
+	for (i = 0; i < VIRTIO_NET_MAXQP; i++) {
+		net->qpairs[i].net = net;
+		net->qpairs[i].idx = i;
+		net->qpairs[i].tapfd = -1;
+	}
 	if (opts != NULL) {
 		int err;
 
@@ -940,17 +2477,97 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 		(void) strsep(&vtopts, ",");
 
-		if (vtopts != NULL) {
-			err = virtio_net_parsemac(vtopts, net->config.mac);
-			if (err != 0) {
-				free(devname);
-				return err;
+		while ((opt = strsep(&vtopts, ",")) != NULL) {
+			if (!strncmp(opt, "mq=", 3)) {
+				net->max_pairs = atoi(opt + 3);
+				if (net->max_pairs < 1 ||
+				    net->max_pairs > VIRTIO_NET_MAXQP) {
+					fprintf(stderr, "Invalid mq %s, "
+						"1 to %d queue pairs\n",
+						opt + 3, VIRTIO_NET_MAXQP);
+					free(devname);
+					return -1;
+				}
+			} else if (!strncmp(opt, "affinity=", 9)) {
+				net->tx_affinity = atoi(opt + 9);
+			} else if (!strncmp(opt, "evcpu=", 6)) {
+				net->ev_cpu = atoi(opt + 6);
+			} else if (!strncmp(opt, "queue=", 6)) {
+				net->xdp_queue = atoi(opt + 6);
+			} else if (!strncmp(opt, "coalesce=", 9)) {
+				if (virtio_parse_coalesce(opt + 9,
+				    &net->coal_max, &net->coal_usec)) {
+					fprintf(stderr, "Invalid coalesce %s, "
+						"<max>:<usec>\n", opt + 9);
+					free(devname);
+					return -1;
+				}
+			} else if (!strncmp(opt, "poll=", 5)) {
+				if (virtio_parse_poll(opt + 5, &poll_usec,
+						      &poll_cpu)) {
+					fprintf(stderr, "Invalid poll %s, "
+						"<usec>[@<cpu>]\n", opt + 5);
+					free(devname);
+					return -1;
+				}
+				net->poll_ns = poll_usec * 1000UL;
+				if (poll_cpu >= 0)
+					net->tx_affinity = poll_cpu;
+			} else if (!strncmp(opt, "xsks_map=", 9)) {
+				net->xsks_map = strdup(opt + 9);
+			} else if (!strcmp(opt, "kernel=on")) {
+				net->vbs_k.status = VIRTIO_DEV_PRE_INIT;
+			} else if (!strcmp(opt, "swoffload")) {
+				net->sw_offload = 1;
+			} else {
+				err = virtio_net_parsemac(opt, net->config.mac);
+				if (err != 0) {
+					free(devname);
+					return err;
+				}
+				mac_provided = 1;
 			}
-			mac_provided = 1;
+		}
+
+		/*
+		 * VBS-K drives a single pair of tap queues; fall back to
+		 * VBS-U (user space) for anything else.
+		 */
+		if (net->vbs_k.status == VIRTIO_DEV_PRE_INIT) {
+			WPRINTF(("virtio_net: VBS-K initializing...\n"));
+			if (strncmp(devname, "tap", 3) &&
+			    strncmp(devname, "vmnet", 5)) {
+				WPRINTF(("virtio_net: VBS-K needs a tap\n"));
+				rc = -VIRTIO_ERROR_GENERAL;
+			} else if (net->max_pairs > 1) {
+				WPRINTF(("virtio_net: VBS-K can't do mq\n"));
+				rc = -VIRTIO_ERROR_GENERAL;
+			} else
+				rc = virtio_net_kernel_init(net);
+			if (rc < 0) {
+				WPRINTF(("virtio_net: VBS-K init failed, "
+					"error %d!\n", rc));
+				net->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
+			} else
+				net->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+		}
+
+		/* with mq the first pair's rx thread is the device loop */
+		if (net->ev_cpu >= 0 || net->max_pairs > 1) {
+			net->evloop = mevent_loop_create("vtnet-ev",
+							 net->ev_cpu);
+			if (net->evloop == NULL)
+				WPRINTF(("virtio_net: no event loop on cpu %d,"
+					" using the default loop\n",
+					net->ev_cpu));
 		}
 
 		if (strncmp(devname, "vale", 4) == 0)
 			virtio_net_netmap_setup(net, devname);
+		if (strncmp(devname, "xdp:", 4) == 0)
+			virtio_net_xdp_setup(net, devname + 4);
+		if (strncmp(devname, "vhostuser:", 10) == 0)
+			virtio_net_vhost_setup(net, ctx, devname + 10);
 		if (strncmp(devname, "tap", 3) == 0 ||
 		    strncmp(devname, "vmnet", 5) == 0)
 			virtio_net_tap_setup(net, devname);
@@ -986,8 +2603,68 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	/* Link is up if we managed to open tap device or vale port. */
-	net->config.status = (opts == NULL || net->tapfd >= 0 ||
-			      net->nmd != NULL);
+	net->config.status = (opts == NULL || net->qpairs[0].tapfd >= 0 ||
+			      net->nmd != NULL || net->xsk != NULL ||
+			      net->vhost != NULL);
+
+	/*
+	 * Queue pairs come first, then the control queue. It's offered
+	 * for more than one pair, and for receive filtering when frames
+	 * from the tap go through us rather than VBS-K.
+	 */
+	if (net->vbs_k.status == VIRTIO_DEV_INIT_SUCCESS)
+		net->ops = virtio_net_ops_k;
+	else
+		net->ops = virtio_net_ops;
+	if (net->vnet_hdr)
+		net->ops.hv_caps |= VIRTIO_NET_S_OFFLOADS;
+	else if (net->sw_offload && net->vhost == NULL &&
+		 net->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS)
+		net->ops.hv_caps |= VIRTIO_NET_S_SWOFFLOADS;
+	if (net->vhost != NULL) {
+		/* the rings are the backend's, config space is ours */
+		net->ops.hv_caps = (net->ops.hv_caps | VIRTIO_NET_S_OFFLOADS) &
+			(net->vhost->features | VIRTIO_NET_F_MAC |
+			 VIRTIO_NET_F_STATUS);
+		net->ops.set_status = virtio_net_vhost_set_status;
+	}
+	if (net->virtio_net_rx == virtio_net_tap_rx &&
+	    net->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS)
+		net->ops.hv_caps |= VIRTIO_NET_S_RXFILTER;
+	if (net->max_pairs > 1)
+		net->ops.hv_caps |= VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+	nvq = net->max_pairs * 2;
+	if (net->ops.hv_caps & VIRTIO_NET_F_CTRL_VQ)
+		nvq++;
+	virtio_net_rxfilter_reset(net);
+	net->ops.nvq = nvq;
+	net->config.max_virtqueue_pairs = net->max_pairs;
+
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues);
+	net->base.mtx = &net->mtx;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qpairs[i];
+		qp->rxq = &net->queues[VIRTIO_NET_RXQ(i)];
+		qp->txq = &net->queues[VIRTIO_NET_TXQ(i)];
+		qp->rxq->qsize = VIRTIO_NET_RINGSZ;
+		qp->rxq->notify = virtio_net_ping_rxq;
+		qp->txq->qsize = VIRTIO_NET_RINGSZ;
+		qp->txq->notify = virtio_net_ping_txq;
+		if (net->vhost != NULL)
+			qp->rxq->notify = qp->txq->notify =
+				virtio_net_vhost_kick;
+		vq_set_coalesce(qp->rxq, net->coal_max, net->coal_usec);
+		vq_set_coalesce(qp->txq, net->coal_max, net->coal_usec);
+	}
+	if (net->ops.hv_caps & VIRTIO_NET_F_CTRL_VQ) {
+		net->queues[nvq - 1].qsize = VIRTIO_NET_CTL_RINGSZ;
+		net->queues[nvq - 1].notify = virtio_net_ping_ctlq;
+	}
+	if (net->virtio_net_rx == virtio_net_tap_rx) {
+		snprintf(mname, sizeof(mname), "%s.tap", dev->name);
+		monitor_register(mname, virtio_net_tap_dump, dev);
+	}
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, fbsdrun_virtio_msix())) {
@@ -1002,24 +2679,31 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	net->resetting = 0;
 	net->closing = 0;
 
-	net->rx_merge = 1;
-	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
+	/*
+	 * Let VHM signal TX/RX kicks and take interrupts on eventfds
+	 * instead of trapping to us and issuing an ioctl per MSI.
+	 * Not for VBS-K, which owns the kick register and the data path.
+	 */
+	if (net->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS)
+		net->base.flags |= VIRTIO_USE_IOEVENTFD | VIRTIO_USE_IRQFD;
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Initialize tx semaphores & spawn one TX processing thread
+	 * per queue pair, optionally pinned to consecutive host cpus.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qpairs[i];
+		qp->rx_in_progress = 0;
+		pthread_mutex_init(&qp->rx_mtx, NULL);
+
+		qp->tx_in_progress = 0;
+		pthread_mutex_init(&qp->tx_mtx, NULL);
+		pthread_cond_init(&qp->tx_cond, NULL);
+		if (net->vbs_k.status == VIRTIO_DEV_INIT_SUCCESS ||
+		    net->vhost != NULL)
+			continue;
+		virtio_net_tx_start(net, qp);
+	}
 
 	return 0;
 }
@@ -1037,6 +2721,7 @@ virtio_net_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 		 */
 		ptr = &net->config.mac[offset];
 		memcpy(ptr, &value, size);
+		virtio_net_tap_filter(net);
 	} else {
 		/* silently ignore other writes */
 		DPRINTF(("vtnet: write to readonly reg %d\n\r", offset));
@@ -1068,23 +2753,66 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 		/* non-merge rx header is 2 bytes shorter */
 		net->rx_vhdrlen -= 2;
 	}
+
+	virtio_net_tap_offload(net);
 }
 
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	struct virtio_net_qpair *qp;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
 		virtio_net_tx_stop(net);
 
-		if (net->tapfd >= 0) {
-			close(net->tapfd);
-			net->tapfd = -1;
-		} else
-			fprintf(stderr, "net->tapfd is -1!\n");
+		/* the private loops outlive the guest; take our fds off them */
+		if (net->evloop != NULL) {
+			for (i = 0; i < net->max_pairs; i++) {
+				qp = &net->qpairs[i];
+				if (qp->mevp != NULL)
+					mevent_delete(qp->mevp);
+				qp->mevp = NULL;
+				mevent_loop_destroy(qp->evloop);
+				qp->evloop = NULL;
+			}
+			mevent_loop_destroy(net->evloop);
+			net->evloop = NULL;
+		}
+
+		if (net->vbs_k.status == VIRTIO_DEV_STARTED) {
+			DPRINTF(("%s: deinit virtio_net_k!\n", __func__));
+			virtio_net_kernel_stop(net);
+			virtio_net_kernel_reset(net);
+		}
+		if (net->vbs_k.fd >= 0) {
+			close(net->vbs_k.fd);
+			net->vbs_k.fd = -1;
+		}
+
+		for (i = 0; i < net->max_pairs; i++) {
+			if (net->qpairs[i].tapfd >= 0) {
+				close(net->qpairs[i].tapfd);
+				net->qpairs[i].tapfd = -1;
+			} else if (net->xsk == NULL && net->vhost == NULL)
+				fprintf(stderr, "net->tapfd is -1!\n");
+		}
+
+		if (net->xsk) {
+			if (net->qpairs[0].mevp != NULL)
+				mevent_delete(net->qpairs[0].mevp);
+			virtio_net_xdp_close(net->xsk);
+			net->xsk = NULL;
+		}
+		if (net->vhost) {
+			virtio_net_vhost_stop(net);
+			vhost_user_close(net->vhost);
+			net->vhost = NULL;
+		}
+		free(net->xsks_map);
 
 		free(net);
 
@@ -1098,6 +2826,9 @@ struct pci_vdev_ops pci_ops_virtio_net = {
 	.vdev_init	= virtio_net_init,
 	.vdev_deinit	= virtio_net_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64,
+	.vdev_update_bar_map = virtio_pci_update_bar_map
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_net);
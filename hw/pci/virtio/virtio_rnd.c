@@ -28,12 +28,15 @@
 /*
  * virtio entropy device emulation.
  * Randomness is sourced from /dev/random which does not block
- * once it has been seeded at bootup.
+ * once it has been seeded at bootup, or, with pool=on, from an
+ * in-DM AES-256-CTR generator keyed from getrandom() that fills
+ * a batch of chains per notify.
  */
 
 #include <sys/cdefs.h>
 #include <sys/param.h>
 #include <sys/uio.h>
+#include <sys/random.h>
 #include <err.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -43,14 +46,36 @@
 #include <assert.h>
 #include <pthread.h>
 #include <sysexits.h>
+#include <openssl/evp.h>
 
 #include "dm.h"
 #include "pci_core.h"
 #include "virtio.h"
 #include "virtio_kernel.h"
+#include "mevent.h"
 #include "vmmapi.h"			/* for vmctx */
+#include "monitor.h"
 
 #define VIRTIO_RND_RINGSZ	64
+#define VIRTIO_RND_BATCH	16	/* chains fetched per vq_getchains() */
+#define VIRTIO_RND_BATCH_IOV	64
+
+#define VIRTIO_RND_POOLSZ	4096
+#define VIRTIO_RND_KEYSZ	48	/* AES-256 key + CTR iv */
+#define VIRTIO_RND_RESEED	(1 << 20)	/* output between reseeds */
+
+/*
+ * Generator state. Every refill ends by overwriting the key with fresh
+ * keystream, and handed out bytes are wiped, so a later dump of the
+ * state says nothing about what the guest already got.
+ */
+struct virtio_rnd_pool {
+	EVP_CIPHER_CTX *ctx;
+	uint8_t key[VIRTIO_RND_KEYSZ];
+	uint8_t buf[VIRTIO_RND_POOLSZ];
+	int avail;		/* unread bytes at the end of buf */
+	size_t out;		/* bytes made since the last reseed */
+};
 
 /*
  * Per-device struct
@@ -62,6 +87,8 @@ struct virtio_rnd {
 	pthread_mutex_t mtx;
 	uint64_t cfg;
 	int fd;
+	struct virtio_rnd_pool *pool;	/* NULL: read /dev/random */
+	struct mevent *evp;		/* armed while /dev/random is dry */
 	/* VBS-K variables */
 	struct {
 		enum VBS_K_STATUS status;
@@ -72,6 +99,7 @@ struct virtio_rnd {
 };
 
 static int virtio_rnd_debug;
+MONITOR_DEBUG(virtio_rnd, virtio_rnd_debug);
 #define DPRINTF(params) do { if (virtio_rnd_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
@@ -102,7 +130,7 @@ static struct virtio_ops virtio_rnd_ops = {
 	NULL,			/* write virtio config */
 	NULL,			/* apply negotiated features */
 	NULL,			/* called on guest set status */
-	0,			/* our capabilities */
+	VIRTIO_RING_F_EVENT_IDX, /* our capabilities */
 };
 
 /* VBS-K virtio_ops */
@@ -302,6 +330,127 @@ virtio_rnd_reset(void *base)
 	}
 }
 
+static int
+virtio_rnd_pool_refill(struct virtio_rnd_pool *pool)
+{
+	static const uint8_t zero[VIRTIO_RND_POOLSZ];
+	uint8_t seed[VIRTIO_RND_KEYSZ];
+	int len, i;
+
+	/* mix in fresh kernel entropy now and then; keep going without */
+	if (pool->out >= VIRTIO_RND_RESEED &&
+	    getrandom(seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed)) {
+		for (i = 0; i < VIRTIO_RND_KEYSZ; i++)
+			pool->key[i] ^= seed[i];
+		memset(seed, 0, sizeof(seed));
+		pool->out = 0;
+	}
+
+	if (EVP_EncryptInit_ex(pool->ctx, EVP_aes_256_ctr(), NULL,
+			       pool->key, pool->key + 32) != 1 ||
+	    EVP_EncryptUpdate(pool->ctx, pool->buf, &len, zero,
+			      VIRTIO_RND_POOLSZ) != 1 ||
+	    len != VIRTIO_RND_POOLSZ ||
+	    EVP_EncryptUpdate(pool->ctx, pool->key, &len, zero,
+			      VIRTIO_RND_KEYSZ) != 1 ||
+	    len != VIRTIO_RND_KEYSZ) {
+		pool->avail = 0;
+		return -1;
+	}
+
+	pool->avail = VIRTIO_RND_POOLSZ;
+	pool->out += VIRTIO_RND_POOLSZ;
+	return 0;
+}
+
+static size_t
+virtio_rnd_pool_fill(struct virtio_rnd_pool *pool, uint8_t *dst, size_t len)
+{
+	uint8_t *src;
+	size_t done, n;
+
+	for (done = 0; done < len; done += n) {
+		if (pool->avail == 0 && virtio_rnd_pool_refill(pool) != 0)
+			break;
+		n = MIN(len - done, (size_t)pool->avail);
+		src = pool->buf + VIRTIO_RND_POOLSZ - pool->avail;
+		memcpy(dst + done, src, n);
+		memset(src, 0, n);
+		pool->avail -= n;
+	}
+
+	return done;
+}
+
+static struct virtio_rnd_pool *
+virtio_rnd_pool_create(void)
+{
+	struct virtio_rnd_pool *pool;
+
+	pool = calloc(1, sizeof(struct virtio_rnd_pool));
+	if (!pool)
+		return NULL;
+
+	pool->ctx = EVP_CIPHER_CTX_new();
+	if (!pool->ctx)
+		goto fail;
+
+	if (getrandom(pool->key, sizeof(pool->key), 0) !=
+	    sizeof(pool->key) || virtio_rnd_pool_refill(pool) != 0) {
+		EVP_CIPHER_CTX_free(pool->ctx);
+		goto fail;
+	}
+
+	return pool;
+
+fail:
+	memset(pool, 0, sizeof(*pool));
+	free(pool);
+	return NULL;
+}
+
+static void
+virtio_rnd_pool_destroy(struct virtio_rnd_pool *pool)
+{
+	EVP_CIPHER_CTX_free(pool->ctx);
+	memset(pool, 0, sizeof(*pool));
+	free(pool);
+}
+
+static void
+virtio_rnd_pool_notify(struct virtio_rnd *rnd, struct virtio_vq_info *vq)
+{
+	struct iovec iov[VIRTIO_RND_BATCH_IOV];
+	uint16_t idx[VIRTIO_RND_BATCH];
+	uint32_t iolen[VIRTIO_RND_BATCH];
+	int n[VIRTIO_RND_BATCH];
+	int i, j, k, nchains;
+
+	vq_kick_disable(vq);
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
+		nchains = vq_getchains(vq, idx, iov, VIRTIO_RND_BATCH_IOV,
+				       NULL, n, VIRTIO_RND_BATCH);
+		if (nchains <= 0) {
+			vq_kick_enable(vq);
+			break;
+		}
+		n[0] = MIN(n[0], VIRTIO_RND_BATCH_IOV);
+
+		for (k = 0, i = 0; k < nchains; i += n[k++]) {
+			iolen[k] = 0;
+			for (j = i; j < i + n[k]; j++)
+				iolen[k] += virtio_rnd_pool_fill(rnd->pool,
+					iov[j].iov_base, iov[j].iov_len);
+		}
+
+		DPRINTF(("%s: %d chains\r\n", __func__, nchains));
+		vq_relchains(vq, idx, iolen, nchains);
+	}
+	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
+}
+
+static void virtio_rnd_readable(int fd, enum ev_type t, void *arg);
+
 static void
 virtio_rnd_notify(void *base, struct virtio_vq_info *vq)
 {
@@ -312,20 +461,38 @@ virtio_rnd_notify(void *base, struct virtio_vq_info *vq)
 
 	rnd = base;
 
+	if (rnd->pool) {
+		virtio_rnd_pool_notify(rnd, vq);
+		return;
+	}
+
 	if (rnd->fd < 0) {
 		vq_endchains(vq, 0);
 		return;
 	}
 
-	while (vq_has_descs(vq)) {
+	vq_kick_disable(vq);
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
 		vq_getchain(vq, &idx, &iov, 1, NULL);
 
 		len = read(rnd->fd, iov.iov_base, iov.iov_len);
 
 		DPRINTF(("%s: %d\r\n", __func__, len));
 
-		/* Catastrophe if unable to read from /dev/random */
-		assert(len > 0);
+		/*
+		 * /dev/random is non-blocking: if it has nothing right
+		 * now, leave the chain and come back once it's readable.
+		 * The guest has nothing left to kick for, so that's all
+		 * that brings us back, short of it adding more buffers.
+		 */
+		if (len <= 0) {
+			vq_retchain(vq);
+			vq_kick_enable(vq);
+			if (rnd->evp == NULL)
+				rnd->evp = mevent_add(rnd->fd, EVF_READ,
+						      virtio_rnd_readable, rnd);
+			break;
+		}
 
 		/*
 		 * Release this chain and handle more
@@ -335,6 +502,22 @@ virtio_rnd_notify(void *base, struct virtio_vq_info *vq)
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
 }
 
+static void
+virtio_rnd_readable(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_rnd *rnd = arg;
+
+	pthread_mutex_lock(&rnd->mtx);
+	if (rnd->evp != NULL) {
+		mevent_delete(rnd->evp);
+		rnd->evp = NULL;
+		/* unless the guest reset the device meanwhile */
+		if (vq_ring_ready(&rnd->vq))
+			virtio_rnd_notify(rnd, &rnd->vq);
+	}
+	pthread_mutex_unlock(&rnd->mtx);
+}
+
 static int
 virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -347,14 +530,23 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *opt;
 	char *vbs_k_opt = NULL;
 	enum VBS_K_STATUS kstat = VIRTIO_DEV_INITIAL;
+	int use_pool = 0;
 
 	while ((opt = strsep(&opts, ",")) != NULL) {
-		/* vbs_k_opt should be kernel=on */
+		/* vbs_k_opt should be kernel=on|auto, or pool=on */
 		vbs_k_opt = strsep(&opt, "=");
 		DPRINTF(("vbs_k_opt is %s\n", vbs_k_opt));
-		if (opt != NULL) {
-			if (strncmp(opt, "on", 2) == 0)
-				kstat = VIRTIO_DEV_PRE_INIT;
+		if (opt == NULL)
+			continue;
+		if (strcmp(vbs_k_opt, "pool") == 0) {
+			use_pool = strncmp(opt, "on", 2) == 0;
+			continue;
+		}
+		/* auto: VBS-K whenever the host has it, VBS-U otherwise */
+		if (strncmp(opt, "on", 2) == 0 ||
+		    (strncmp(opt, "auto", 4) == 0 &&
+		     access("/dev/vbs_rng", R_OK | W_OK) == 0)) {
+			kstat = VIRTIO_DEV_PRE_INIT;
 			WPRINTF(("virtio_rnd: VBS-K initializing..."));
 		}
 	}
@@ -423,6 +615,13 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	rnd->base.mtx = &rnd->mtx;
 
+	if (use_pool && rnd->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS) {
+		rnd->pool = virtio_rnd_pool_create();
+		if (!rnd->pool)
+			WPRINTF(("virtio_rnd: no entropy pool, "
+				 "using /dev/random\n"));
+	}
+
 	rnd->vq.qsize = VIRTIO_RND_RINGSZ;
 
 	/* keep /dev/random opened while emulating */
@@ -436,6 +635,8 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	if (virtio_interrupt_init(&rnd->base, fbsdrun_virtio_msix())) {
+		if (rnd->pool)
+			virtio_rnd_pool_destroy(rnd->pool);
 		if (rnd)
 			free(rnd);
 		return -1;
@@ -467,6 +668,11 @@ virtio_rnd_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		rnd->vbs_k.fd = -1;
 	}
 
+	if (rnd->pool)
+		virtio_rnd_pool_destroy(rnd->pool);
+	if (rnd->evp)
+		mevent_delete(rnd->evp);
+
 	DPRINTF(("%s: free struct virtio_rnd!\n", __func__));
 	free(rnd);
 }
@@ -477,6 +683,8 @@ struct pci_vdev_ops pci_ops_virtio_rnd = {
 	.vdev_init	= virtio_rnd_init,
 	.vdev_deinit	= virtio_rnd_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_rnd);
@@ -0,0 +1,1176 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * virtio socket device emulation (stream sockets only).
+ *
+ * Every guest connection is backed by a host AF_UNIX stream socket:
+ *
+ *  - a guest connect() to host port P connects to "<path>_P";
+ *  - a host process connects to <path> and writes "CONNECT <port>\n";
+ *    once the guest accepts it reads back "OK <host port>\n", and
+ *    the socket carries the stream from then on.
+ *
+ * Guest to host data is written to the socket straight from the tx
+ * buffers and only copied into the connection's buffer when the socket
+ * can't take it; that buffer is the credit we give the guest.  Host to
+ * guest data is read from the socket straight into rx buffers, and only
+ * as far as the guest's credit goes.  Connections with something to
+ * send to the guest wait on rxq and are served round robin.
+ *
+ * Everything runs under the device mutex.  The socket callbacks get the
+ * device, not the connection, and look the fd up, so a connection freed
+ * on a vcpu thread is never used by an event already pulled by mevent.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "mevent.h"
+#include "monitor.h"
+
+#define	VSOCK_RINGSZ		256
+#define	VSOCK_MAXSEGS		32
+#define	VSOCK_HOST_CID		2
+#define	VSOCK_BUF_ALLOC		(64 * 1024)	/* guest to host, per conn */
+#define	VSOCK_HASHSZ		256
+#define	VSOCK_RST_MAX		32
+#define	VSOCK_PORT_BASE		(1U << 30)	/* host ports we hand out */
+
+#define	VSOCK_RXQ		0
+#define	VSOCK_TXQ		1
+#define	VSOCK_EVQ		2
+#define	VSOCK_NVQ		3
+
+#define	VIRTIO_VSOCK_TYPE_STREAM	1
+
+#define	VIRTIO_VSOCK_OP_INVALID		0
+#define	VIRTIO_VSOCK_OP_REQUEST		1
+#define	VIRTIO_VSOCK_OP_RESPONSE	2
+#define	VIRTIO_VSOCK_OP_RST		3
+#define	VIRTIO_VSOCK_OP_SHUTDOWN	4
+#define	VIRTIO_VSOCK_OP_RW		5
+#define	VIRTIO_VSOCK_OP_CREDIT_UPDATE	6
+#define	VIRTIO_VSOCK_OP_CREDIT_REQUEST	7
+
+#define	VIRTIO_VSOCK_SHUTDOWN_RCV	1
+#define	VIRTIO_VSOCK_SHUTDOWN_SEND	2
+#define	VIRTIO_VSOCK_SHUTDOWN_MASK	3
+
+struct virtio_vsock_config {
+	uint64_t	guest_cid;
+} __attribute__((packed));
+
+struct virtio_vsock_hdr {
+	uint64_t	src_cid;
+	uint64_t	dst_cid;
+	uint32_t	src_port;
+	uint32_t	dst_port;
+	uint32_t	len;
+	uint16_t	type;
+	uint16_t	op;
+	uint32_t	flags;
+	uint32_t	buf_alloc;
+	uint32_t	fwd_cnt;
+} __attribute__((packed));
+
+/* control packets a connection owes the guest, in the order sent */
+#define	VSOCK_PEND_RST		0x01
+#define	VSOCK_PEND_REQUEST	0x02
+#define	VSOCK_PEND_RESPONSE	0x04
+#define	VSOCK_PEND_CREDIT	0x08
+
+enum vsock_state {
+	VSOCK_HANDSHAKE,	/* host side, reading "CONNECT <port>" */
+	VSOCK_CONNECTING,	/* host side, REQUEST sent to the guest */
+	VSOCK_ESTABLISHED,
+};
+
+struct vsock_conn {
+	LIST_ENTRY(vsock_conn) hlink;
+	TAILQ_ENTRY(vsock_conn) rxlink;
+	int		hashed;
+	int		on_rxq;
+	enum vsock_state state;
+	int		fd;
+	int		wfd;	/* dup of fd, for the EVF_WRITE event */
+	struct mevent	*rev;
+	struct mevent	*wev;
+	uint32_t	guest_port;
+	uint32_t	host_port;
+	int		pending;	/* VSOCK_PEND_* */
+	int		dead;		/* freed once the RST is sent */
+	int		rx_ready;	/* socket may have data for the guest */
+	uint32_t	shut;		/* SHUTDOWN flags from the guest */
+	int		shut_wr;	/* shutdown(SHUT_WR) done */
+
+	/* host to guest */
+	uint32_t	peer_buf_alloc;
+	uint32_t	peer_fwd_cnt;
+	uint32_t	rx_cnt;
+
+	/* guest to host */
+	uint32_t	recv_cnt;	/* RW bytes taken from the guest */
+	uint32_t	fwd_cnt;	/* of those, written to the socket */
+	uint32_t	fwd_sent;	/* fwd_cnt the guest was last told */
+	uint8_t		*txbuf;
+	uint32_t	txhead;
+	uint32_t	txlen;
+
+	char		line[32];
+	int		linelen;
+};
+
+struct virtio_vsock {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VSOCK_NVQ];
+	pthread_mutex_t mtx;
+	struct virtio_vsock_config cfg;
+	char		*path;
+	int		lfd;
+	struct mevent	*lev;
+	LIST_HEAD(, vsock_conn) hash[VSOCK_HASHSZ];
+	TAILQ_HEAD(, vsock_conn) rxq;
+	struct vsock_conn **fdmap;
+	int		nfdmap;
+	struct virtio_vsock_hdr rst[VSOCK_RST_MAX];
+	int		nrst;
+	uint32_t	next_port;
+	int		nconns;
+	uint64_t	rx_pkts;
+	uint64_t	tx_pkts;
+	char		mname[PI_NAMESZ + 6];
+};
+
+static int virtio_vsock_debug;
+MONITOR_DEBUG(virtio_vsock, virtio_vsock_debug);
+#define DPRINTF(params) do { if (virtio_vsock_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_vsock_reset(void *);
+static int virtio_vsock_cfgread(void *, int, int, uint32_t *);
+static int virtio_vsock_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_vsock_ops = {
+	"vsock",			/* our name */
+	VSOCK_NVQ,			/* we support 3 virtqueues */
+	sizeof(struct virtio_vsock_config), /* config reg size */
+	virtio_vsock_reset,		/* reset */
+	NULL,				/* device-wide qnotify */
+	virtio_vsock_cfgread,		/* read virtio config */
+	virtio_vsock_cfgwrite,		/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_RING_F_EVENT_IDX,	/* our capabilities */
+};
+
+static void vsock_rx_kick(struct virtio_vsock *vs);
+
+static size_t
+vsock_iov_len(struct iovec *iov, int n)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static size_t
+vsock_iov_get(struct iovec *iov, int n, void *buf, size_t len)
+{
+	size_t done = 0, chunk;
+	int i;
+
+	for (i = 0; i < n && done < len; i++) {
+		chunk = MIN(iov[i].iov_len, len - done);
+		memcpy((uint8_t *)buf + done, iov[i].iov_base, chunk);
+		done += chunk;
+	}
+	return done;
+}
+
+static void
+vsock_iov_put(struct iovec *iov, int n, const void *buf, size_t len)
+{
+	size_t done = 0, chunk;
+	int i;
+
+	for (i = 0; i < n && done < len; i++) {
+		chunk = MIN(iov[i].iov_len, len - done);
+		memcpy(iov[i].iov_base, (const uint8_t *)buf + done, chunk);
+		done += chunk;
+	}
+}
+
+/*
+ * Point out[] at len bytes of iov[] starting off bytes in; returns the
+ * number of entries used.
+ */
+static int
+vsock_iov_slice(struct iovec *iov, int n, size_t off, size_t len,
+		struct iovec *out)
+{
+	int i, nout = 0;
+
+	for (i = 0; i < n && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		out[nout].iov_base = (uint8_t *)iov[i].iov_base + off;
+		out[nout].iov_len = MIN(iov[i].iov_len - off, len);
+		len -= out[nout].iov_len;
+		off = 0;
+		nout++;
+	}
+	return nout;
+}
+
+static inline int
+vsock_hash(uint32_t guest_port, uint32_t host_port)
+{
+	return (guest_port ^ (host_port * 31)) & (VSOCK_HASHSZ - 1);
+}
+
+static struct vsock_conn *
+vsock_lookup(struct virtio_vsock *vs, uint32_t guest_port, uint32_t host_port)
+{
+	struct vsock_conn *conn;
+
+	LIST_FOREACH(conn, &vs->hash[vsock_hash(guest_port, host_port)],
+		     hlink) {
+		if (conn->guest_port == guest_port &&
+		    conn->host_port == host_port)
+			return conn;
+	}
+	return NULL;
+}
+
+static void
+vsock_hash_insert(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	LIST_INSERT_HEAD(&vs->hash[vsock_hash(conn->guest_port,
+		conn->host_port)], conn, hlink);
+	conn->hashed = 1;
+}
+
+static int
+vsock_fdmap_set(struct virtio_vsock *vs, int fd, struct vsock_conn *conn)
+{
+	struct vsock_conn **map;
+	int n;
+
+	if (fd >= vs->nfdmap) {
+		n = roundup2(fd + 1, 64);
+		map = realloc(vs->fdmap, n * sizeof(*map));
+		if (map == NULL)
+			return -1;
+		memset(map + vs->nfdmap, 0,
+		       (n - vs->nfdmap) * sizeof(*map));
+		vs->fdmap = map;
+		vs->nfdmap = n;
+	}
+	vs->fdmap[fd] = conn;
+	return 0;
+}
+
+static struct vsock_conn *
+vsock_fdmap_get(struct virtio_vsock *vs, int fd)
+{
+	return (fd >= 0 && fd < vs->nfdmap) ? vs->fdmap[fd] : NULL;
+}
+
+static void
+vsock_rxq_add(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	if (!conn->on_rxq) {
+		TAILQ_INSERT_TAIL(&vs->rxq, conn, rxlink);
+		conn->on_rxq = 1;
+	}
+}
+
+static void
+vsock_post(struct virtio_vsock *vs, struct vsock_conn *conn, int pend)
+{
+	conn->pending |= pend;
+	vsock_rxq_add(vs, conn);
+}
+
+static uint32_t
+vsock_credit(struct vsock_conn *conn)
+{
+	uint32_t inflight = conn->rx_cnt - conn->peer_fwd_cnt;
+
+	return inflight < conn->peer_buf_alloc ?
+		conn->peer_buf_alloc - inflight : 0;
+}
+
+static int
+vsock_rx_wants(struct vsock_conn *conn)
+{
+	return conn->pending ||
+		(conn->rx_ready && conn->state == VSOCK_ESTABLISHED &&
+		 vsock_credit(conn) > 0);
+}
+
+static void vsock_sock_read(int fd, enum ev_type t, void *arg);
+static void vsock_sock_write(int fd, enum ev_type t, void *arg);
+
+static struct vsock_conn *
+vsock_conn_alloc(struct virtio_vsock *vs, int fd, enum vsock_state state)
+{
+	struct vsock_conn *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	if (conn == NULL)
+		goto fail;
+	conn->fd = fd;
+	conn->state = state;
+	conn->wfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (conn->wfd < 0)
+		goto fail;
+	if (vsock_fdmap_set(vs, fd, conn) || vsock_fdmap_set(vs, conn->wfd, conn))
+		goto fail;
+
+	/* the same fd can't be on epoll twice, hence the dup for writes */
+	conn->rev = mevent_add(fd, EVF_READ, vsock_sock_read, vs);
+	conn->wev = mevent_add(conn->wfd, EVF_WRITE, vsock_sock_write, vs);
+	if (conn->rev == NULL || conn->wev == NULL)
+		goto fail;
+	mevent_disable(conn->wev);
+	vs->nconns++;
+	return conn;
+
+fail:
+	WPRINTF(("vsock: cannot set up a connection\n"));
+	if (conn != NULL) {
+		vsock_fdmap_set(vs, fd, NULL);
+		if (conn->rev != NULL)
+			mevent_delete(conn->rev);
+		if (conn->wfd >= 0) {
+			vsock_fdmap_set(vs, conn->wfd, NULL);
+			if (conn->wev != NULL)
+				mevent_delete_close(conn->wev);
+			else
+				close(conn->wfd);
+		}
+		free(conn);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void
+vsock_conn_free(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	DPRINTF(("vsock: close %u:%u\n", conn->guest_port, conn->host_port));
+	if (conn->hashed)
+		LIST_REMOVE(conn, hlink);
+	if (conn->on_rxq)
+		TAILQ_REMOVE(&vs->rxq, conn, rxlink);
+	vs->fdmap[conn->fd] = NULL;
+	vs->fdmap[conn->wfd] = NULL;
+	/* mevent closes the fds once they are off epoll */
+	mevent_delete_close(conn->rev);
+	mevent_delete_close(conn->wev);
+	free(conn->txbuf);
+	free(conn);
+	vs->nconns--;
+}
+
+/*
+ * Drop the connection, telling the guest unless it never heard of it.
+ */
+static void
+vsock_conn_reset(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	if (conn->state == VSOCK_HANDSHAKE) {
+		vsock_conn_free(vs, conn);
+		return;
+	}
+	conn->dead = 1;
+	conn->rx_ready = 0;
+	mevent_disable(conn->rev);
+	mevent_disable(conn->wev);
+	conn->pending = 0;
+	vsock_post(vs, conn, VSOCK_PEND_RST);
+}
+
+/* answer a packet that has no connection with a RST */
+static void
+vsock_rst_reply(struct virtio_vsock *vs, struct virtio_vsock_hdr *in)
+{
+	struct virtio_vsock_hdr *hdr;
+
+	if (in->op == VIRTIO_VSOCK_OP_RST || vs->nrst == VSOCK_RST_MAX)
+		return;
+	hdr = &vs->rst[vs->nrst++];
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->src_cid = VSOCK_HOST_CID;
+	hdr->dst_cid = vs->cfg.guest_cid;
+	hdr->src_port = in->dst_port;
+	hdr->dst_port = in->src_port;
+	hdr->type = VIRTIO_VSOCK_TYPE_STREAM;
+	hdr->op = VIRTIO_VSOCK_OP_RST;
+}
+
+static void
+vsock_hdr_init(struct virtio_vsock *vs, struct vsock_conn *conn,
+	       struct virtio_vsock_hdr *hdr, uint16_t op, uint32_t len)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->src_cid = VSOCK_HOST_CID;
+	hdr->dst_cid = vs->cfg.guest_cid;
+	hdr->src_port = conn->host_port;
+	hdr->dst_port = conn->guest_port;
+	hdr->len = len;
+	hdr->type = VIRTIO_VSOCK_TYPE_STREAM;
+	hdr->op = op;
+	hdr->buf_alloc = VSOCK_BUF_ALLOC;
+	hdr->fwd_cnt = conn->fwd_cnt;
+	conn->fwd_sent = conn->fwd_cnt;
+}
+
+/*
+ * Fill one rx chain for conn.  Returns the bytes written, or 0 if conn
+ * had nothing to send right now.
+ */
+static uint32_t
+vsock_rx_conn(struct virtio_vsock *vs, struct vsock_conn *conn,
+	      struct iovec *iov, int n)
+{
+	static const struct {
+		int pend;
+		uint16_t op;
+	} ctl[] = {
+		{ VSOCK_PEND_RST,	VIRTIO_VSOCK_OP_RST },
+		{ VSOCK_PEND_REQUEST,	VIRTIO_VSOCK_OP_REQUEST },
+		{ VSOCK_PEND_RESPONSE,	VIRTIO_VSOCK_OP_RESPONSE },
+		{ VSOCK_PEND_CREDIT,	VIRTIO_VSOCK_OP_CREDIT_UPDATE },
+	};
+	struct virtio_vsock_hdr hdr;
+	struct iovec data[VSOCK_MAXSEGS];
+	size_t room;
+	ssize_t len;
+	int i, nd;
+
+	for (i = 0; i < ARRAY_SIZE(ctl); i++) {
+		if ((conn->pending & ctl[i].pend) == 0)
+			continue;
+		conn->pending &= ~ctl[i].pend;
+		vsock_hdr_init(vs, conn, &hdr, ctl[i].op, 0);
+		vsock_iov_put(iov, n, &hdr, sizeof(hdr));
+		return sizeof(hdr);
+	}
+
+	if (!conn->rx_ready || conn->state != VSOCK_ESTABLISHED)
+		return 0;
+	room = MIN(vsock_iov_len(iov, n) - sizeof(hdr), vsock_credit(conn));
+	if (room == 0)
+		return 0;
+
+	nd = vsock_iov_slice(iov, n, sizeof(hdr), room, data);
+	len = readv(conn->fd, data, nd);
+	if (len > 0) {
+		vsock_hdr_init(vs, conn, &hdr, VIRTIO_VSOCK_OP_RW, len);
+		vsock_iov_put(iov, n, &hdr, sizeof(hdr));
+		conn->rx_cnt += len;
+		return sizeof(hdr) + len;
+	}
+	conn->rx_ready = 0;
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		mevent_enable(conn->rev);
+		return 0;
+	}
+
+	if (len < 0) {
+		vsock_conn_reset(vs, conn);
+		return 0;
+	}
+
+	/* EOF: the host end sends no more; the guest closes when done */
+	DPRINTF(("vsock: host end of %u:%u shut down\n", conn->guest_port,
+		 conn->host_port));
+	vsock_hdr_init(vs, conn, &hdr, VIRTIO_VSOCK_OP_SHUTDOWN, 0);
+	hdr.flags = VIRTIO_VSOCK_SHUTDOWN_SEND;
+	vsock_iov_put(iov, n, &hdr, sizeof(hdr));
+	return sizeof(hdr);
+}
+
+static void
+vsock_rx_kick(struct virtio_vsock *vs)
+{
+	struct virtio_vq_info *vq = &vs->queues[VSOCK_RXQ];
+	struct iovec iov[VSOCK_MAXSEGS];
+	struct vsock_conn *conn;
+	uint32_t len;
+	uint16_t idx;
+	int n, posted = 0;
+
+	while (vs->nrst > 0 || !TAILQ_EMPTY(&vs->rxq)) {
+		/* out of buffers: have the guest kick when it posts more */
+		if (!vq_has_descs(vq) && !vq_kick_enable(vq))
+			break;
+		n = vq_getchain(vq, &idx, iov, VSOCK_MAXSEGS, NULL);
+		if (n <= 0)
+			break;
+		n = MIN(n, VSOCK_MAXSEGS);
+		if (vsock_iov_len(iov, n) < sizeof(struct virtio_vsock_hdr)) {
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		len = 0;
+		if (vs->nrst > 0) {
+			len = sizeof(struct virtio_vsock_hdr);
+			vsock_iov_put(iov, n, &vs->rst[--vs->nrst], len);
+		}
+		while (len == 0 && (conn = TAILQ_FIRST(&vs->rxq)) != NULL) {
+			len = vsock_rx_conn(vs, conn, iov, n);
+			TAILQ_REMOVE(&vs->rxq, conn, rxlink);
+			conn->on_rxq = 0;
+			if (conn->dead && !(conn->pending & VSOCK_PEND_RST))
+				vsock_conn_free(vs, conn);
+			else if (vsock_rx_wants(conn))
+				vsock_rxq_add(vs, conn);
+		}
+		if (len == 0) {
+			vq_retchain(vq);
+			break;
+		}
+		vq_relchain(vq, idx, len);
+		posted++;
+	}
+	vs->rx_pkts += posted;
+	if (posted)
+		vq_endchains(vq, 0);
+}
+
+/* tell the guest about freed buffer space before it runs dry */
+static void
+vsock_credit_check(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	uint32_t seen_free;
+
+	seen_free = VSOCK_BUF_ALLOC - (conn->recv_cnt - conn->fwd_sent);
+	if (conn->fwd_cnt != conn->fwd_sent && seen_free < VSOCK_BUF_ALLOC / 2)
+		vsock_post(vs, conn, VSOCK_PEND_CREDIT);
+}
+
+/* act on guest SHUTDOWN flags once everything before them is out */
+static void
+vsock_conn_shut(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	if (conn->shut & VIRTIO_VSOCK_SHUTDOWN_RCV) {
+		conn->rx_ready = 0;
+		mevent_disable(conn->rev);
+	}
+	if (conn->txlen > 0)
+		return;
+	if ((conn->shut & VIRTIO_VSOCK_SHUTDOWN_SEND) && !conn->shut_wr) {
+		shutdown(conn->fd, SHUT_WR);
+		conn->shut_wr = 1;
+	}
+	if (conn->shut == VIRTIO_VSOCK_SHUTDOWN_MASK)
+		vsock_conn_reset(vs, conn);
+}
+
+static int
+vsock_conn_flush(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	struct iovec iov[2];
+	uint32_t first;
+	ssize_t len;
+
+	while (conn->txlen > 0) {
+		first = MIN(conn->txlen, VSOCK_BUF_ALLOC - conn->txhead);
+		iov[0].iov_base = conn->txbuf + conn->txhead;
+		iov[0].iov_len = first;
+		iov[1].iov_base = conn->txbuf;
+		iov[1].iov_len = conn->txlen - first;
+		len = writev(conn->fd, iov, iov[1].iov_len ? 2 : 1);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		conn->txhead = (conn->txhead + len) % VSOCK_BUF_ALLOC;
+		conn->txlen -= len;
+		conn->fwd_cnt += len;
+	}
+	if (conn->txlen > 0)
+		mevent_enable(conn->wev);
+	else
+		mevent_disable(conn->wev);
+	return 0;
+}
+
+/* forward guest RW data, keeping what the socket won't take yet */
+static int
+vsock_conn_tx(struct virtio_vsock *vs, struct vsock_conn *conn,
+	      struct iovec *iov, int n)
+{
+	size_t len = vsock_iov_len(iov, n), done = 0, chunk;
+	uint32_t tail;
+	ssize_t w;
+	int i;
+
+	if (len > VSOCK_BUF_ALLOC - conn->txlen) {
+		WPRINTF(("vsock: guest overran its credit on %u:%u\n",
+			 conn->guest_port, conn->host_port));
+		return -1;
+	}
+	conn->recv_cnt += len;
+
+	if (conn->txlen == 0) {
+		w = writev(conn->fd, iov, n);
+		if (w < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			w = 0;
+		}
+		conn->fwd_cnt += w;
+		done = w;
+		if (done == len)
+			return 0;
+	}
+
+	if (conn->txbuf == NULL) {
+		conn->txbuf = malloc(VSOCK_BUF_ALLOC);
+		if (conn->txbuf == NULL)
+			return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (done >= iov[i].iov_len) {
+			done -= iov[i].iov_len;
+			continue;
+		}
+		while (done < iov[i].iov_len) {
+			tail = (conn->txhead + conn->txlen) % VSOCK_BUF_ALLOC;
+			chunk = MIN(iov[i].iov_len - done,
+				    VSOCK_BUF_ALLOC - tail);
+			memcpy(conn->txbuf + tail,
+			       (uint8_t *)iov[i].iov_base + done, chunk);
+			conn->txlen += chunk;
+			done += chunk;
+		}
+		done = 0;
+	}
+	return vsock_conn_flush(vs, conn);
+}
+
+static struct vsock_conn *
+vsock_connect(struct virtio_vsock *vs, struct virtio_vsock_hdr *hdr)
+{
+	struct sockaddr_un addr;
+	struct vsock_conn *conn;
+	int fd;
+
+	if (vs->path == NULL)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u",
+		     vs->path, hdr->dst_port) >= sizeof(addr.sun_path))
+		return NULL;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		DPRINTF(("vsock: connect %s: %s\n", addr.sun_path,
+			 strerror(errno)));
+		close(fd);
+		return NULL;
+	}
+
+	conn = vsock_conn_alloc(vs, fd, VSOCK_ESTABLISHED);
+	if (conn == NULL)
+		return NULL;
+	conn->guest_port = hdr->src_port;
+	conn->host_port = hdr->dst_port;
+	conn->peer_buf_alloc = hdr->buf_alloc;
+	conn->peer_fwd_cnt = hdr->fwd_cnt;
+	vsock_hash_insert(vs, conn);
+	vsock_post(vs, conn, VSOCK_PEND_RESPONSE);
+	DPRINTF(("vsock: guest connect %u:%u\n", conn->guest_port,
+		 conn->host_port));
+	return conn;
+}
+
+static void
+vsock_tx_pkt(struct virtio_vsock *vs, struct iovec *iov, int n)
+{
+	struct virtio_vsock_hdr hdr;
+	struct iovec data[VSOCK_MAXSEGS];
+	struct vsock_conn *conn;
+	char line[32];
+	int nd, len;
+
+	if (vsock_iov_get(iov, n, &hdr, sizeof(hdr)) < sizeof(hdr))
+		return;
+	if (hdr.type != VIRTIO_VSOCK_TYPE_STREAM ||
+	    hdr.src_cid != vs->cfg.guest_cid ||
+	    hdr.dst_cid != VSOCK_HOST_CID) {
+		vsock_rst_reply(vs, &hdr);
+		return;
+	}
+
+	conn = vsock_lookup(vs, hdr.src_port, hdr.dst_port);
+	if (hdr.op == VIRTIO_VSOCK_OP_REQUEST) {
+		if (conn != NULL || vsock_connect(vs, &hdr) == NULL)
+			vsock_rst_reply(vs, &hdr);
+		return;
+	}
+	if (conn == NULL) {
+		vsock_rst_reply(vs, &hdr);
+		return;
+	}
+	if (hdr.op == VIRTIO_VSOCK_OP_RST) {
+		vsock_conn_free(vs, conn);
+		return;
+	}
+	if (conn->dead)
+		return;
+
+	conn->peer_buf_alloc = hdr.buf_alloc;
+	conn->peer_fwd_cnt = hdr.fwd_cnt;
+
+	switch (hdr.op) {
+	case VIRTIO_VSOCK_OP_RESPONSE:
+		if (conn->state != VSOCK_CONNECTING) {
+			vsock_conn_reset(vs, conn);
+			return;
+		}
+		conn->state = VSOCK_ESTABLISHED;
+		len = snprintf(line, sizeof(line), "OK %u\n", conn->host_port);
+		if (write(conn->fd, line, len) != len) {
+			vsock_conn_reset(vs, conn);
+			return;
+		}
+		conn->rx_ready = 1;
+		break;
+	case VIRTIO_VSOCK_OP_RW:
+		if (conn->state != VSOCK_ESTABLISHED ||
+		    (conn->shut & VIRTIO_VSOCK_SHUTDOWN_SEND)) {
+			vsock_conn_reset(vs, conn);
+			return;
+		}
+		nd = vsock_iov_slice(iov, n, sizeof(hdr), hdr.len, data);
+		if (vsock_conn_tx(vs, conn, data, nd) < 0) {
+			vsock_conn_reset(vs, conn);
+			return;
+		}
+		vsock_credit_check(vs, conn);
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+		vsock_post(vs, conn, VSOCK_PEND_CREDIT);
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+		break;
+	case VIRTIO_VSOCK_OP_SHUTDOWN:
+		conn->shut |= hdr.flags & VIRTIO_VSOCK_SHUTDOWN_MASK;
+		vsock_conn_shut(vs, conn);
+		return;
+	default:
+		vsock_conn_reset(vs, conn);
+		return;
+	}
+
+	/* the packet may have brought credit for a stalled connection */
+	if (vsock_rx_wants(conn))
+		vsock_rxq_add(vs, conn);
+}
+
+static void
+virtio_vsock_notify_tx(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_vsock *vs = vdev;
+	struct iovec iov[VSOCK_MAXSEGS];
+	uint16_t idx;
+	int n;
+
+	vq_kick_disable(vq);
+	while (vq_has_descs(vq) || vq_kick_enable(vq)) {
+		n = vq_getchain(vq, &idx, iov, VSOCK_MAXSEGS, NULL);
+		if (n <= 0) {
+			vq_kick_enable(vq);
+			break;
+		}
+		vsock_tx_pkt(vs, iov, MIN(n, VSOCK_MAXSEGS));
+		vq_relchain(vq, idx, 0);
+		vs->tx_pkts++;
+	}
+	vq_endchains(vq, 1);
+	vsock_rx_kick(vs);
+}
+
+static void
+virtio_vsock_notify_rx(void *vdev, struct virtio_vq_info *vq)
+{
+	vsock_rx_kick(vdev);
+}
+
+/* the event queue only carries transport resets, and we never send one */
+static void
+virtio_vsock_notify_ev(void *vdev, struct virtio_vq_info *vq)
+{
+}
+
+/* read "CONNECT <port>\n" a byte at a time: data may follow it */
+static void
+vsock_handshake(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	unsigned long port;
+	char *end, c;
+	ssize_t len;
+
+	for (;;) {
+		len = read(conn->fd, &c, 1);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (len <= 0 || conn->linelen == sizeof(conn->line) - 1)
+			goto fail;
+		if (c == '\n')
+			break;
+		conn->line[conn->linelen++] = c;
+	}
+	conn->line[conn->linelen] = '\0';
+	if (strncmp(conn->line, "CONNECT ", 8) != 0)
+		goto fail;
+	port = strtoul(conn->line + 8, &end, 10);
+	if (end == conn->line + 8 || (*end != '\0' && *end != '\r') ||
+	    port > UINT32_MAX)
+		goto fail;
+
+	conn->guest_port = port;
+	do {
+		conn->host_port = vs->next_port++;
+		if (vs->next_port == 0)
+			vs->next_port = VSOCK_PORT_BASE;
+	} while (vsock_lookup(vs, conn->guest_port, conn->host_port) != NULL);
+	vsock_hash_insert(vs, conn);
+
+	/* nothing more is read until the guest accepts */
+	conn->state = VSOCK_CONNECTING;
+	mevent_disable(conn->rev);
+	vsock_post(vs, conn, VSOCK_PEND_REQUEST);
+	DPRINTF(("vsock: host connect %u:%u\n", conn->guest_port,
+		 conn->host_port));
+	return;
+
+fail:
+	vsock_conn_free(vs, conn);
+}
+
+static void
+vsock_sock_read(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	struct vsock_conn *conn;
+
+	pthread_mutex_lock(&vs->mtx);
+	conn = vsock_fdmap_get(vs, fd);
+	if (conn == NULL || conn->fd != fd || conn->dead)
+		goto out;
+	if (conn->state == VSOCK_HANDSHAKE) {
+		vsock_handshake(vs, conn);
+	} else if (conn->state == VSOCK_ESTABLISHED) {
+		/* level triggered: quiet until a read comes up empty */
+		mevent_disable(conn->rev);
+		conn->rx_ready = 1;
+		if (vsock_rx_wants(conn))
+			vsock_rxq_add(vs, conn);
+	}
+	vsock_rx_kick(vs);
+out:
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void
+vsock_sock_write(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	struct vsock_conn *conn;
+
+	pthread_mutex_lock(&vs->mtx);
+	conn = vsock_fdmap_get(vs, fd);
+	if (conn == NULL || conn->wfd != fd || conn->dead)
+		goto out;
+	if (vsock_conn_flush(vs, conn) < 0) {
+		vsock_conn_reset(vs, conn);
+	} else {
+		vsock_credit_check(vs, conn);
+		vsock_conn_shut(vs, conn);
+	}
+	vsock_rx_kick(vs);
+out:
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void
+vsock_accept(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	int s;
+
+	pthread_mutex_lock(&vs->mtx);
+	while ((s = unix_accept(fd)) >= 0)
+		vsock_conn_alloc(vs, s, VSOCK_HANDSHAKE);
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void
+vsock_close_all(struct virtio_vsock *vs)
+{
+	int i;
+
+	for (i = 0; i < vs->nfdmap; i++)
+		if (vs->fdmap[i] != NULL)
+			vsock_conn_free(vs, vs->fdmap[i]);
+	vs->nrst = 0;
+}
+
+static void
+virtio_vsock_reset(void *vdev)
+{
+	struct virtio_vsock *vs = vdev;
+
+	DPRINTF(("vsock: device reset requested\n"));
+	vsock_close_all(vs);
+	virtio_reset_dev(&vs->base);
+}
+
+static int
+virtio_vsock_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_vsock *vs = vdev;
+
+	if (offset < 0 || offset + size > sizeof(vs->cfg))
+		return -1;
+	memcpy(retval, (uint8_t *)&vs->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_vsock_cfgwrite(void *vdev, int offset, int size, uint32_t val)
+{
+	WPRINTF(("vsock: write to read-only config reg %d\n", offset));
+	return 0;
+}
+
+static void
+virtio_vsock_monitor_dump(int fd, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+
+	pthread_mutex_lock(&vs->mtx);
+	dprintf(fd, "conns %d\n", vs->nconns);
+	dprintf(fd, "rx_pkts %lu\n", vs->rx_pkts);
+	dprintf(fd, "tx_pkts %lu\n", vs->tx_pkts);
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static int
+vsock_listen(struct virtio_vsock *vs)
+{
+	struct sockaddr_un addr;
+
+	/* leave room for the "_<port>" suffix of host connections */
+	if (strlen(vs->path) + 12 > sizeof(addr.sun_path)) {
+		WPRINTF(("vsock: path %s too long\n", vs->path));
+		return -1;
+	}
+
+	vs->lfd = unix_listen(vs->path, 64);
+	if (vs->lfd < 0) {
+		WPRINTF(("vsock: cannot listen on %s: %s\n", vs->path,
+			 strerror(errno)));
+		return -1;
+	}
+	vs->lev = mevent_add(vs->lfd, EVF_READ, vsock_accept, vs);
+	if (vs->lev == NULL) {
+		close(vs->lfd);
+		vs->lfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+virtio_vsock_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vs;
+	pthread_mutexattr_t attr;
+	char *opt, *val, *end;
+	uint64_t cid = 0;
+	char *path = NULL;
+	int i, rc;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		val = opt;
+		opt = strsep(&val, "=");
+		if (val == NULL)
+			continue;
+		if (strcmp(opt, "cid") == 0) {
+			cid = strtoull(val, &end, 0);
+			if (*end != '\0')
+				cid = 0;
+		} else if (strcmp(opt, "path") == 0) {
+			path = val;
+		}
+	}
+	/* 0-2 are reserved, and the top of the range means "any" */
+	if (cid <= VSOCK_HOST_CID || cid >= UINT32_MAX) {
+		WPRINTF(("vsock: needs cid=<n>, 3 or more\n"));
+		return -1;
+	}
+
+	vs = calloc(1, sizeof(struct virtio_vsock));
+	if (!vs) {
+		WPRINTF(("vsock: calloc returns NULL\n"));
+		return -1;
+	}
+	vs->cfg.guest_cid = cid;
+	vs->lfd = -1;
+	vs->next_port = VSOCK_PORT_BASE;
+	for (i = 0; i < VSOCK_HASHSZ; i++)
+		LIST_INIT(&vs->hash[i]);
+	TAILQ_INIT(&vs->rxq);
+
+	/* init mutex attribute properly */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	if (fbsdrun_virtio_msix()) {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_DEFAULT);
+		if (rc)
+			DPRINTF(("virtio_msix: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	} else {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		if (rc)
+			DPRINTF(("virtio_intx: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	}
+	rc = pthread_mutex_init(&vs->mtx, &attr);
+	if (rc)
+		DPRINTF(("mutex init failed with error %d!\n", rc));
+
+	virtio_linkup(&vs->base, &virtio_vsock_ops, vs, dev, vs->queues);
+	vs->base.mtx = &vs->mtx;
+
+	for (i = 0; i < VSOCK_NVQ; i++)
+		vs->queues[i].qsize = VSOCK_RINGSZ;
+	vs->queues[VSOCK_RXQ].notify = virtio_vsock_notify_rx;
+	vs->queues[VSOCK_TXQ].notify = virtio_vsock_notify_tx;
+	vs->queues[VSOCK_EVQ].notify = virtio_vsock_notify_ev;
+
+	if (path != NULL) {
+		vs->path = strdup(path);
+		if (vs->path == NULL || vsock_listen(vs) < 0)
+			goto fail;
+	}
+
+	/* initialize config space */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_SIMPLECOMM);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_SIMPLECOMM_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vs->base, fbsdrun_virtio_msix()))
+		goto fail;
+	virtio_set_io_bar(&vs->base, 0);
+
+	snprintf(vs->mname, sizeof(vs->mname), "%s.conns", dev->name);
+	monitor_register(vs->mname, virtio_vsock_monitor_dump, vs);
+	return 0;
+
+fail:
+	if (vs->lev != NULL) {
+		mevent_delete_close(vs->lev);
+		unlink(vs->path);
+	}
+	free(vs->path);
+	free(vs);
+	return -1;
+}
+
+static void
+virtio_vsock_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vs = dev->arg;
+
+	if (vs == NULL)
+		return;
+
+	monitor_unregister(vs);
+	pthread_mutex_lock(&vs->mtx);
+	if (vs->lev != NULL) {
+		mevent_delete_close(vs->lev);
+		unlink(vs->path);
+	}
+	vsock_close_all(vs);
+	pthread_mutex_unlock(&vs->mtx);
+
+	free(vs->fdmap);
+	free(vs->path);
+	free(vs);
+}
+
+struct pci_vdev_ops pci_ops_virtio_vsock = {
+	.class_name	= "virtio-vsock",
+	.vdev_init	= virtio_vsock_init,
+	.vdev_deinit	= virtio_vsock_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+	.vdev_barwrite64 = virtio_pci_write64,
+	.vdev_barread64	= virtio_pci_read64
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_vsock);
@@ -46,6 +46,7 @@
 #include "vmmapi.h"
 #include "mevent.h"
 #include "pci_core.h"
+#include "timer.h"
 
 #define WDT_REG_BAR_SIZE		0x10
 
@@ -71,7 +72,6 @@
 #define ESB_UNLOCK1	0x80   /* Step 1 to unlock reset registers  */
 #define ESB_UNLOCK2	0x86   /* Step 2 to unlock reset registers  */
 
-#define WDT_TIMER_SIG			0x55AA
 #define DEFAULT_MAX_TIMER_VAL		0x000FFFFF
 
 /* for debug */
@@ -91,7 +91,7 @@ struct info_wdt {
 	bool wdt_enabled;   /* If true, watchdog is enabled. */
 
 	bool timer_created;
-	timer_t wdt_timerid;
+	struct acrn_timer timer;
 
 	uint32_t timer1_val;
 	uint32_t timer2_val;
@@ -110,10 +110,10 @@ static void start_wdt_timer(void);
  * action to guest OS
  */
 static void
-wdt_expired_thread(union sigval v)
+wdt_expired_handler(void *arg, uint64_t nexp)
 {
-	DPRINTF("wdt timer out! id=0x%x, stage=%d, reboot=%d\n",
-		v.sival_int, wdt_state.stage, wdt_state.reboot_enabled);
+	DPRINTF("wdt timer out! stage=%d, reboot=%d\n",
+		wdt_state.stage, wdt_state.reboot_enabled);
 
 	if (wdt_state.stage == 1) {
 		wdt_state.stage = 2;
@@ -142,32 +142,13 @@ stop_wdt_timer()
 		return;
 
 	memset(&timer_val, 0, sizeof(struct itimerspec));
-	timer_settime(wdt_state.wdt_timerid, 0, &timer_val, NULL);
-}
-
-static void
-reset_wdt_timer(int seconds)
-{
-	struct itimerspec timer_val;
-
-	DPRINTF("%s: time=%d\n", __func__, seconds);
-	memset(&timer_val, 0, sizeof(struct itimerspec));
-	timer_settime(wdt_state.wdt_timerid, 0, &timer_val, NULL);
-
-	timer_val.it_value.tv_sec = seconds;
-	if (timer_settime(wdt_state.wdt_timerid, 0, &timer_val, NULL) == -1) {
-		perror("timer_settime failed.\n");
-		timer_delete(wdt_state.wdt_timerid);
-		wdt_state.timer_created = 0;
-		exit(-1);
-	}
+	acrn_timer_settime(&wdt_state.timer, &timer_val);
 }
 
 static void
 start_wdt_timer(void)
 {
 	int seconds;
-	struct sigevent sig_evt;
 	struct itimerspec timer_val;
 
 	if (!wdt_state.wdt_enabled)
@@ -180,32 +161,18 @@ start_wdt_timer(void)
 
 	DPRINTF("%s: created=%d, time=%d\n", __func__,
 			wdt_state.timer_created, seconds);
-	memset(&sig_evt, 0, sizeof(struct sigevent));
-	if (wdt_state.timer_created) {
-		reset_wdt_timer(seconds);
-		return;
-	}
-
-	sig_evt.sigev_value.sival_int = WDT_TIMER_SIG;
-	sig_evt.sigev_notify = SIGEV_THREAD;
-	sig_evt.sigev_notify_function = wdt_expired_thread;
-
-	if (timer_create(CLOCK_REALTIME, &sig_evt,
-		&wdt_state.wdt_timerid) == -1) {
-		perror("timer_create failed.\n");
-		exit(-1);
+	if (!wdt_state.timer_created) {
+		if (acrn_timer_init(&wdt_state.timer, wdt_expired_handler,
+				    NULL) != 0) {
+			perror("acrn_timer_init failed.\n");
+			exit(-1);
+		}
+		wdt_state.timer_created = true;
 	}
 
 	memset(&timer_val, 0, sizeof(struct itimerspec));
 	timer_val.it_value.tv_sec = seconds;
-
-	if (timer_settime(wdt_state.wdt_timerid, 0, &timer_val, NULL) == -1) {
-		perror("timer_settime failed.\n");
-		timer_delete(wdt_state.wdt_timerid);
-		exit(-1);
-	}
-
-	wdt_state.timer_created = true;
+	acrn_timer_settime(&wdt_state.timer, &timer_val);
 }
 
 static int
@@ -344,7 +311,8 @@ pci_wdt_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 static void
 pci_wdt_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	stop_wdt_timer();
+	if (wdt_state.timer_created)
+		acrn_timer_deinit(&wdt_state.timer);
 	memset(&wdt_state, 0, sizeof(wdt_state));
 }
 
@@ -40,6 +40,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include "usb.h"
 #include "usbdi.h"
@@ -48,8 +49,11 @@
 #include "pci_core.h"
 #include "xhci.h"
 #include "usb_core.h"
+#include "timer.h"
+#include "monitor.h"
 
 static int xhci_debug;
+MONITOR_DEBUG(xhci, xhci_debug);
 #define	DPRINTF(params) do { if (xhci_debug) printf params; } while (0)
 #define	WPRINTF(params) (printf params)
 #define	XHCI_NAME		"xhci"
@@ -66,6 +70,7 @@ static int xhci_debug;
 #define	XHCI_HCCPRAMS2		0x1C	/* offset of HCCPARAMS2 register */
 #define	XHCI_PORTREGS_START	0x400
 #define	XHCI_DOORBELL_MAX	256
+#define	XHCI_DB_QUEUE		256	/* queued doorbells, power of 2 */
 #define	XHCI_STREAMS_MAX	1	/* 4-15 in XHCI spec */
 
 /* caplength and hci-version registers */
@@ -212,6 +217,13 @@ struct pci_xhci_rtsregs {
 
 struct pci_xhci_vdev;
 
+/* a doorbell waiting for the transfer worker; slot 0 is the command ring */
+struct pci_xhci_db {
+	uint32_t	slot;
+	uint32_t	epid;
+	uint32_t	streamid;
+};
+
 /*
  * USB device emulation container.
  * This is referenced from usb_hci->dev; 1 pci_xhci_dev_emu for each
@@ -256,6 +268,28 @@ struct pci_xhci_vdev {
 
 	int		usb2_port_start;
 	int		usb3_port_start;
+
+	/*
+	 * Doorbells are queued here and run by xfer_tid in the order the
+	 * guest rang them, so the vcpu doesn't walk command or transfer
+	 * rings.  Interrupts raised while the worker drains the queue are
+	 * folded into one.
+	 */
+	struct pci_xhci_db db_queue[XHCI_DB_QUEUE];
+	uint32_t	db_head;
+	uint32_t	db_tail;
+	pthread_cond_t	db_cond;
+	pthread_cond_t	db_space;	/* the queue was full */
+	pthread_t	xfer_tid;
+	int		xfer_worker;
+	int		intr_batch;	/* nesting of intr_hold() */
+	int		intr_pending;
+
+	/* IMOD: no interrupt within IMODI of the last one */
+	struct acrn_timer imod_timer;
+	uint64_t	imod_last;	/* CLOCK_MONOTONIC ns */
+	int		imod_armed;
+	int		imod_ok;	/* imod_timer usable */
 };
 
 /* portregs and devices arrays are set up to start from idx=1 */
@@ -335,6 +369,7 @@ pci_xhci_reset(struct pci_xhci_vdev *xdev)
 	xdev->rtsregs.er_enq_idx = 0;
 	xdev->rtsregs.er_events_cnt = 0;
 	xdev->rtsregs.event_pcs = 1;
+	xdev->db_head = xdev->db_tail = 0;
 
 	for (i = 1; i <= XHCI_MAX_SLOTS; i++)
 		pci_xhci_reset_slot(xdev, i);
@@ -399,6 +434,7 @@ pci_xhci_usbcmd_write(struct pci_xhci_vdev *xdev, uint32_t cmd)
 	if (cmd & XHCI_CMD_HCRST) {
 		/* reset controller */
 		pci_xhci_reset(xdev);
+		pthread_cond_broadcast(&xdev->db_space);
 		cmd &= ~XHCI_CMD_HCRST;
 	}
 
@@ -584,6 +620,91 @@ pci_xhci_trb_next(struct pci_xhci_vdev *xdev,
 	return next;
 }
 
+static uint64_t
+pci_xhci_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+pci_xhci_signal(struct pci_xhci_vdev *xdev)
+{
+	if (pci_msi_enabled(xdev->dev))
+		pci_generate_msi(xdev->dev, 0);
+	else
+		pci_lintr_assert(xdev->dev);
+}
+
+/*
+ * Signal the interrupter, unless the last interrupt is less than IMODI
+ * ago; then imod_timer signals it when the interval is up.
+ */
+static void
+pci_xhci_moderate(struct pci_xhci_vdev *xdev)
+{
+	struct itimerspec ts;
+	uint64_t ival, now;
+
+	ival = XHCI_IMOD_IVAL_GET(xdev->rtsregs.intrreg.imod) * 250ULL;
+	if (ival == 0 || !xdev->imod_ok) {
+		pci_xhci_signal(xdev);
+		return;
+	}
+	if (xdev->imod_armed)
+		return;
+
+	now = pci_xhci_now();
+	if (now - xdev->imod_last < ival) {
+		memset(&ts, 0, sizeof(ts));
+		ts.it_value.tv_nsec = ival - (now - xdev->imod_last);
+		if (acrn_timer_settime(&xdev->imod_timer, &ts) == 0) {
+			xdev->imod_armed = 1;
+			return;
+		}
+	}
+	xdev->imod_last = now;
+	pci_xhci_signal(xdev);
+}
+
+static void
+pci_xhci_imod_timeout(void *arg, uint64_t nexp)
+{
+	struct pci_xhci_vdev *xdev = arg;
+
+	pthread_mutex_lock(&xdev->mtx);
+	xdev->imod_armed = 0;
+	/* still wanted: not yet acknowledged, and not masked meanwhile */
+	if ((xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_PEND) &&
+	    (xdev->opregs.usbcmd & XHCI_CMD_INTE) &&
+	    (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_ENA)) {
+		xdev->imod_last = pci_xhci_now();
+		pci_xhci_signal(xdev);
+	}
+	pthread_mutex_unlock(&xdev->mtx);
+}
+
+/*
+ * Hold back interrupts over a pass that may queue several events; the
+ * release signals once if any were asserted.
+ */
+static void
+pci_xhci_intr_hold(struct pci_xhci_vdev *xdev)
+{
+	xdev->intr_batch++;
+}
+
+static void
+pci_xhci_intr_release(struct pci_xhci_vdev *xdev)
+{
+	if (--xdev->intr_batch == 0 && xdev->intr_pending) {
+		xdev->intr_pending = 0;
+		pci_xhci_assert_interrupt(xdev);
+	}
+}
+
 static void
 pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
 {
@@ -592,14 +713,16 @@ pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
 	xdev->rtsregs.intrreg.iman |= XHCI_IMAN_INTR_PEND;
 	xdev->opregs.usbsts |= XHCI_STS_EINT;
 
+	/* signalled once for the whole batch */
+	if (xdev->intr_batch) {
+		xdev->intr_pending = 1;
+		return;
+	}
+
 	/* only trigger interrupt if permitted */
 	if ((xdev->opregs.usbcmd & XHCI_CMD_INTE) &&
-	    (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_ENA)) {
-		if (pci_msi_enabled(xdev->dev))
-			pci_generate_msi(xdev->dev, 0);
-		else
-			pci_lintr_assert(xdev->dev);
-	}
+	    (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_ENA))
+		pci_xhci_moderate(xdev);
 }
 
 static void
@@ -1282,7 +1405,8 @@ pci_xhci_cmd_set_tr(struct pci_xhci_vdev *xdev,
 		devep->ep_tr = XHCI_GADDR(xdev, devep->ep_ringaddr);
 
 		DPRINTF(("pci_xhci set_tr first TRB:\r\n"));
-		pci_xhci_dump_trb(devep->ep_tr);
+		if (xhci_debug)
+			pci_xhci_dump_trb(devep->ep_tr);
 	}
 	ep_ctx->dwEpCtx0 = (ep_ctx->dwEpCtx0 & ~0x7) | XHCI_ST_EPCTX_STOPPED;
 
@@ -1381,6 +1505,7 @@ pci_xhci_complete_commands(struct pci_xhci_vdev *xdev)
 
 	error = 0;
 	xdev->opregs.crcr |= XHCI_CRCR_LO_CRR;
+	pci_xhci_intr_hold(xdev);
 
 	trb = xdev->opregs.cr_p;
 	ccs = xdev->opregs.crcr & XHCI_CRCR_LO_RCS;
@@ -1499,6 +1624,7 @@ pci_xhci_complete_commands(struct pci_xhci_vdev *xdev)
 
 	xdev->opregs.crcr = crcr | (xdev->opregs.crcr & XHCI_CRCR_LO_CA) | ccs;
 	xdev->opregs.crcr &= ~XHCI_CRCR_LO_CRR;
+	pci_xhci_intr_release(xdev);
 	return error;
 }
 
@@ -1747,7 +1873,8 @@ retry:
 	setup_trb = NULL;
 
 	while (1) {
-		pci_xhci_dump_trb(trb);
+		if (xhci_debug)
+			pci_xhci_dump_trb(trb);
 
 		trbflags = trb->dwTrb3;
 
@@ -1967,10 +2094,14 @@ pci_xhci_device_doorbell(struct pci_xhci_vdev *xdev,
 	if (ep_ctx->qwEpCtx2 == 0)
 		return;
 
-	/* handle pending transfers */
+	/*
+	 * handle pending transfers; once they are done, carry on with any
+	 * TRBs the guest queued behind them meanwhile
+	 */
 	if (devep->ep_xfer->ndata > 0) {
 		pci_xhci_try_usb_xfer(xdev, dev, devep, ep_ctx, slot, epid);
-		return;
+		if (devep->ep_xfer->ndata > 0)
+			return;
 	}
 
 	/* get next trb work item */
@@ -2001,6 +2132,83 @@ pci_xhci_device_doorbell(struct pci_xhci_vdev *xdev,
 				 ringaddr, ccs, streamid);
 }
 
+/* with xdev->mtx held */
+static void
+pci_xhci_run_doorbell(struct pci_xhci_vdev *xdev, uint32_t slot,
+		      uint32_t epid, uint32_t streamid)
+{
+	if (XHCI_HALTED(xdev))
+		return;
+	if (slot == 0)
+		pci_xhci_complete_commands(xdev);
+	else if (xdev->portregs != NULL)
+		pci_xhci_device_doorbell(xdev, slot, epid, streamid);
+}
+
+/*
+ * Transfer worker: runs queued doorbells with xdev->mtx held, as the
+ * vcpu did, and raises one interrupt after each batch.
+ */
+static void *
+pci_xhci_xfer_thr(void *arg)
+{
+	struct pci_xhci_vdev *xdev = arg;
+	struct pci_xhci_db db;
+
+	pthread_mutex_lock(&xdev->mtx);
+	for (;;) {
+		while (xdev->db_head == xdev->db_tail && xdev->xfer_worker)
+			pthread_cond_wait(&xdev->db_cond, &xdev->mtx);
+		if (!xdev->xfer_worker)
+			break;
+
+		pci_xhci_intr_hold(xdev);
+		while (xdev->db_head != xdev->db_tail) {
+			db = xdev->db_queue[xdev->db_head++ &
+					    (XHCI_DB_QUEUE - 1)];
+			pci_xhci_run_doorbell(xdev, db.slot, db.epid,
+					      db.streamid);
+		}
+		pci_xhci_intr_release(xdev);
+		pthread_cond_broadcast(&xdev->db_space);
+	}
+	pthread_mutex_unlock(&xdev->mtx);
+	return NULL;
+}
+
+/* with xdev->mtx held */
+static void
+pci_xhci_queue_doorbell(struct pci_xhci_vdev *xdev, uint32_t slot,
+			uint32_t epid, uint32_t streamid)
+{
+	struct pci_xhci_db *db;
+
+	/* a full queue waits for the worker, to keep the guest's order */
+	while (xdev->xfer_worker &&
+	       xdev->db_tail - xdev->db_head == XHCI_DB_QUEUE)
+		pthread_cond_wait(&xdev->db_space, &xdev->mtx);
+	if (!xdev->xfer_worker) {
+		pci_xhci_run_doorbell(xdev, slot, epid, streamid);
+		return;
+	}
+
+	/* the guest rang this one already */
+	if (xdev->db_tail != xdev->db_head) {
+		db = &xdev->db_queue[(xdev->db_tail - 1) &
+				     (XHCI_DB_QUEUE - 1)];
+		if (db->slot == slot && db->epid == epid &&
+		    db->streamid == streamid)
+			return;
+	}
+
+	db = &xdev->db_queue[xdev->db_tail & (XHCI_DB_QUEUE - 1)];
+	db->slot = slot;
+	db->epid = epid;
+	db->streamid = streamid;
+	xdev->db_tail++;
+	pthread_cond_signal(&xdev->db_cond);
+}
+
 static void
 pci_xhci_dbregs_write(struct pci_xhci_vdev *xdev,
 		      uint64_t offset,
@@ -2018,11 +2226,11 @@ pci_xhci_dbregs_write(struct pci_xhci_vdev *xdev,
 	}
 
 	if (offset == 0)
-		pci_xhci_complete_commands(xdev);
+		pci_xhci_queue_doorbell(xdev, 0, 0, 0);
 	else if (xdev->portregs != NULL)
-		pci_xhci_device_doorbell(xdev, offset,
-					 XHCI_DB_TARGET_GET(value),
-					 XHCI_DB_SID_GET(value));
+		pci_xhci_queue_doorbell(xdev, offset,
+					XHCI_DB_TARGET_GET(value),
+					XHCI_DB_SID_GET(value));
 }
 
 static void
@@ -2257,6 +2465,23 @@ pci_xhci_hostop_write(struct pci_xhci_vdev *xdev,
 	}
 }
 
+/* Called with xdev->mtx */
+static void
+pci_xhci_reg_write(struct pci_xhci_vdev *xdev, uint64_t offset,
+		   uint64_t value)
+{
+	if (offset < XHCI_CAPLEN)	/* read only registers */
+		WPRINTF(("pci_xhci: write RO-CAPs offset %ld\r\n", offset));
+	else if (offset < xdev->dboff)
+		pci_xhci_hostop_write(xdev, offset, value);
+	else if (offset < xdev->rtsoff)
+		pci_xhci_dbregs_write(xdev, offset, value);
+	else if (offset < xdev->regsend)
+		pci_xhci_rtsregs_write(xdev, offset, value);
+	else
+		WPRINTF(("pci_xhci: write invalid offset %ld\r\n", offset));
+}
+
 static void
 pci_xhci_write(struct vmctx *ctx,
 	       int vcpu,
@@ -2273,17 +2498,32 @@ pci_xhci_write(struct vmctx *ctx,
 	assert(baridx == 0);
 
 	pthread_mutex_lock(&xdev->mtx);
-	if (offset < XHCI_CAPLEN)	/* read only registers */
-		WPRINTF(("pci_xhci: write RO-CAPs offset %ld\r\n", offset));
-	else if (offset < xdev->dboff)
-		pci_xhci_hostop_write(xdev, offset, value);
-	else if (offset < xdev->rtsoff)
-		pci_xhci_dbregs_write(xdev, offset, value);
-	else if (offset < xdev->regsend)
-		pci_xhci_rtsregs_write(xdev, offset, value);
-	else
-		WPRINTF(("pci_xhci: write invalid offset %ld\r\n", offset));
+	pci_xhci_reg_write(xdev, offset, value);
+	pthread_mutex_unlock(&xdev->mtx);
+}
+
+/*
+ * 64-bit registers (CRCR, DCBAAP, ERSTBA, ERDP) written as one access:
+ * both halves under a single lock, so no other vCPU or the device
+ * itself sees the register half updated.
+ */
+static void
+pci_xhci_write64(struct vmctx *ctx,
+		 int vcpu,
+		 struct pci_vdev *dev,
+		 int baridx,
+		 uint64_t offset,
+		 uint64_t value)
+{
+	struct pci_xhci_vdev *xdev;
+
+	xdev = dev->arg;
+
+	assert(baridx == 0);
 
+	pthread_mutex_lock(&xdev->mtx);
+	pci_xhci_reg_write(xdev, offset, value & 0xFFFFFFFF);
+	pci_xhci_reg_write(xdev, offset + 4, value >> 32);
 	pthread_mutex_unlock(&xdev->mtx);
 }
 
@@ -2481,22 +2721,12 @@ pci_xhci_xecp_read(struct pci_xhci_vdev *xdev, uint64_t offset)
 	return value;
 }
 
-static uint64_t
-pci_xhci_read(struct vmctx *ctx,
-	      int vcpu,
-	      struct pci_vdev *dev,
-	      int baridx,
-	      uint64_t offset,
-	      int size)
+/* Called with xdev->mtx */
+static uint32_t
+pci_xhci_reg_read(struct pci_xhci_vdev *xdev, uint64_t offset)
 {
-	struct pci_xhci_vdev *xdev;
 	uint32_t	value;
 
-	xdev = dev->arg;
-
-	assert(baridx == 0);
-
-	pthread_mutex_lock(&xdev->mtx);
 	if (offset < XHCI_CAPLEN)
 		value = pci_xhci_hostcap_read(xdev, offset);
 	else if (offset < xdev->dboff)
@@ -2512,6 +2742,26 @@ pci_xhci_read(struct vmctx *ctx,
 		WPRINTF(("pci_xhci: read invalid offset %ld\r\n", offset));
 	}
 
+	return value;
+}
+
+static uint64_t
+pci_xhci_read(struct vmctx *ctx,
+	      int vcpu,
+	      struct pci_vdev *dev,
+	      int baridx,
+	      uint64_t offset,
+	      int size)
+{
+	struct pci_xhci_vdev *xdev;
+	uint32_t	value;
+
+	xdev = dev->arg;
+
+	assert(baridx == 0);
+
+	pthread_mutex_lock(&xdev->mtx);
+	value = pci_xhci_reg_read(xdev, offset);
 	pthread_mutex_unlock(&xdev->mtx);
 
 	switch (size) {
@@ -2529,6 +2779,28 @@ pci_xhci_read(struct vmctx *ctx,
 	return value;
 }
 
+static uint64_t
+pci_xhci_read64(struct vmctx *ctx,
+		int vcpu,
+		struct pci_vdev *dev,
+		int baridx,
+		uint64_t offset)
+{
+	struct pci_xhci_vdev *xdev;
+	uint64_t	value;
+
+	xdev = dev->arg;
+
+	assert(baridx == 0);
+
+	pthread_mutex_lock(&xdev->mtx);
+	value = pci_xhci_reg_read(xdev, offset);
+	value |= (uint64_t)pci_xhci_reg_read(xdev, offset + 4) << 32;
+	pthread_mutex_unlock(&xdev->mtx);
+
+	return value;
+}
+
 static void
 pci_xhci_reset_port(struct pci_xhci_vdev *xdev, int portn, int warm)
 {
@@ -2617,11 +2889,13 @@ pci_xhci_dev_intr(struct usb_hci *hci, int epctx)
 	dev = hci->dev;
 	xdev = dev->xdev;
 
+	pthread_mutex_lock(&xdev->mtx);
+
 	/* check if device is ready; OS has to initialise it */
 	if (xdev->rtsregs.erstba_p == NULL ||
 	    (xdev->opregs.usbcmd & XHCI_CMD_RS) == 0 ||
 	    dev->dev_ctx == NULL)
-		return 0;
+		goto done;
 
 	p = XHCI_PORTREG_PTR(xdev, hci->hci_port);
 
@@ -2630,7 +2904,7 @@ pci_xhci_dev_intr(struct usb_hci *hci, int epctx)
 		p->portsc &= ~XHCI_PS_PLS_MASK;
 		p->portsc |= XHCI_PS_PLS_SET(UPS_PORT_LS_RESUME);
 		if ((p->portsc & XHCI_PS_PLC) != 0)
-			return 0;
+			goto done;
 
 		p->portsc |= XHCI_PS_PLC;
 
@@ -2647,14 +2921,15 @@ pci_xhci_dev_intr(struct usb_hci *hci, int epctx)
 	if ((ep_ctx->dwEpCtx0 & 0x7) == XHCI_ST_EPCTX_DISABLED) {
 		DPRINTF(("xhci device interrupt on disabled endpoint %d\r\n",
 			 epid));
-		return 0;
+		goto done;
 	}
 
 	DPRINTF(("xhci device interrupt on endpoint %d\r\n", epid));
 
-	pci_xhci_device_doorbell(xdev, hci->hci_port, epid, 0);
+	pci_xhci_queue_doorbell(xdev, hci->hci_port, epid, 0);
 
 done:
+	pthread_mutex_unlock(&xdev->mtx);
 	return error;
 }
 
@@ -2782,12 +3057,14 @@ portsfinal:
 	xdev->portregs =
 		calloc(XHCI_MAX_DEVS, sizeof(struct pci_xhci_portregs));
 
-	if (xdev->ndevices > 0) {
-		/* port and slot numbering start from 1 */
+	/* port and slot numbering start from 1, see pci_xhci_deinit() */
+	if (xdev->devices != NULL) {
 		xdev->devices--;
 		xdev->portregs--;
 		xdev->slots--;
+	}
 
+	if (xdev->ndevices > 0) {
 		for (i = 1; i <= XHCI_MAX_DEVS; i++)
 			pci_xhci_init_port(xdev, i);
 	} else {
@@ -2900,6 +3177,17 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_lintr_request(dev);
 
 	pthread_mutex_init(&xdev->mtx, NULL);
+	pthread_cond_init(&xdev->db_cond, NULL);
+	pthread_cond_init(&xdev->db_space, NULL);
+	xdev->imod_ok = (acrn_timer_init(&xdev->imod_timer,
+					 pci_xhci_imod_timeout, xdev) == 0);
+	if (pthread_create(&xdev->xfer_tid, NULL, pci_xhci_xfer_thr,
+			   xdev) == 0) {
+		xdev->xfer_worker = 1;
+		pthread_setname_np(xdev->xfer_tid, "xhci-xfer");
+	} else
+		WPRINTF(("pci_xhci: no transfer worker, doorbells run "
+			 "inline\r\n"));
 
 done:
 	if (error)
@@ -2908,10 +3196,68 @@ done:
 	return error;
 }
 
+static void
+pci_xhci_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct pci_xhci_vdev *xdev = dev->arg;
+	struct pci_xhci_dev_emu *de;
+	int i, j;
+
+	if (xdev == NULL)
+		return;
+
+	/* what is still queued goes with the controller */
+	if (xdev->xfer_worker) {
+		pthread_mutex_lock(&xdev->mtx);
+		xdev->xfer_worker = 0;
+		pthread_cond_signal(&xdev->db_cond);
+		pthread_cond_broadcast(&xdev->db_space);
+		pthread_mutex_unlock(&xdev->mtx);
+		pthread_join(xdev->xfer_tid, NULL);
+	}
+
+	/* with opts, the arrays are indexed from 1 */
+	if (xdev->devices != NULL) {
+		for (i = 1; i <= XHCI_MAX_DEVS; i++) {
+			de = XHCI_DEVINST_PTR(xdev, i);
+			if (de == NULL)
+				continue;
+			if (de->dev_ue->ue_remove != NULL)
+				de->dev_ue->ue_remove(de->dev_instance);
+			for (j = 0; j < XHCI_MAX_ENDPOINTS; j++) {
+				free(de->eps[j].ep_sctx_trbs);
+				free(de->eps[j].ep_xfer);
+			}
+			free(de);
+		}
+		xdev->devices++;
+		xdev->slots++;
+		xdev->portregs++;
+	}
+
+	/* nothing is left to raise an interrupt and re-arm it */
+	if (xdev->imod_ok)
+		acrn_timer_deinit(&xdev->imod_timer);
+
+	free(xdev->devices);
+	free(xdev->slots);
+	free(xdev->portregs);
+
+	pthread_cond_destroy(&xdev->db_space);
+	pthread_cond_destroy(&xdev->db_cond);
+	pthread_mutex_destroy(&xdev->mtx);
+	free(xdev);
+	dev->arg = NULL;
+	xhci_in_use = 0;
+}
+
 struct pci_vdev_ops pci_ops_xhci = {
 	.class_name	= "xhci",
 	.vdev_init	= pci_xhci_init,
+	.vdev_deinit	= pci_xhci_deinit,
 	.vdev_barwrite	= pci_xhci_write,
-	.vdev_barread	= pci_xhci_read
+	.vdev_barread	= pci_xhci_read,
+	.vdev_barwrite64 = pci_xhci_write64,
+	.vdev_barread64	= pci_xhci_read64
 };
 DEFINE_PCI_DEVTYPE(pci_ops_xhci);
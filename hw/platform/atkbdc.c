@@ -514,7 +514,7 @@ atkbdc_init(struct vmctx *ctx)
 	iop.handler = atkbdc_sts_ctl_handler;
 	iop.arg = base;
 
-	error = register_inout(&iop);
+	error = register_inout(ctx, &iop);
 	assert(error == 0);
 
 	bzero(&iop, sizeof(struct inout_port));
@@ -525,7 +525,7 @@ atkbdc_init(struct vmctx *ctx)
 	iop.handler = atkbdc_data_handler;
 	iop.arg = base;
 
-	error = register_inout(&iop);
+	error = register_inout(ctx, &iop);
 	assert(error == 0);
 
 	pci_irq_reserve(KBD_DEV_IRQ);
@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Shared read cache for read-only images.
+ *
+ * The segment is named after the image's device, inode and mtime, so
+ * every DM booting from the same unchanged image maps the same one
+ * and a replaced image starts a fresh cache. It is a set associative
+ * table of BCACHE_BLOCK sized blocks, BCACHE_WAYS per set, with a
+ * robust process-shared mutex and a clock hand per set; a miss is
+ * read into the caller's buffer outside the lock and copied in after.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_cache.h"
+#include "monitor.h"
+
+static int bcache_debug;
+MONITOR_DEBUG(bcache, bcache_debug);
+#define DPRINTF(params) do { if (bcache_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+#define BCACHE_MAGIC	0xbcac4e01
+#define BCACHE_WAYS	8
+#define BCACHE_WAIT_US	(5 * 1000 * 1000)	/* for another DM's setup */
+
+struct bcache_set {
+	pthread_mutex_t	mtx;
+	uint32_t	hand;
+	uint8_t		ref[BCACHE_WAYS];
+	uint64_t	tag[BCACHE_WAYS];	/* block number + 1, 0 = empty */
+};
+
+struct bcache_hdr {
+	volatile uint32_t magic;	/* set once the segment is ready */
+	uint32_t	nsets;
+	uint64_t	size;		/* of the whole segment */
+	uint64_t	data;		/* offset of the first block */
+	struct bcache_set sets[];
+};
+
+struct bcache {
+	struct bcache_hdr *hdr;
+	size_t		size;
+	uint8_t		*data;
+};
+
+static size_t
+bcache_layout(uint32_t nsets, size_t *data)
+{
+	size_t hdr;
+
+	hdr = sizeof(struct bcache_hdr) + nsets * sizeof(struct bcache_set);
+	*data = roundup(hdr, BCACHE_BLOCK);
+	return *data + (size_t)nsets * BCACHE_WAYS * BCACHE_BLOCK;
+}
+
+static int
+bcache_init(struct bcache_hdr *hdr, uint32_t nsets, size_t size,
+	    size_t data)
+{
+	pthread_mutexattr_t attr;
+	uint32_t i;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (i = 0; i < nsets; i++) {
+		if (pthread_mutex_init(&hdr->sets[i].mtx, &attr))
+			return -1;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	hdr->nsets = nsets;
+	hdr->size = size;
+	hdr->data = data;
+	__atomic_store_n(&hdr->magic, BCACHE_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Map the cache for the image open on fd, creating it with room for
+ * about size bytes of data if no other DM has yet.
+ */
+struct bcache *
+bcache_open(int fd, size_t size)
+{
+	char name[NAME_MAX];
+	struct bcache *bc;
+	struct stat sbuf;
+	struct bcache_hdr *hdr;
+	size_t data, total;
+	uint32_t nsets;
+	int shm, waited, created;
+	void *p;
+
+	if (fstat(fd, &sbuf) < 0)
+		return NULL;
+	snprintf(name, sizeof(name), "/acrn-bcache-%lx-%lx-%lx",
+		 (unsigned long)sbuf.st_dev, (unsigned long)sbuf.st_ino,
+		 (unsigned long)sbuf.st_mtime);
+
+	nsets = MAX(size / (BCACHE_WAYS * BCACHE_BLOCK), 1);
+	total = bcache_layout(nsets, &data);
+
+	created = 1;
+	shm = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (shm < 0 && errno == EEXIST) {
+		created = 0;
+		shm = shm_open(name, O_RDWR, 0600);
+	}
+	if (shm < 0) {
+		WPRINTF(("bcache: can't open %s, %d\n", name, errno));
+		return NULL;
+	}
+
+	if (!created) {
+		/* wait for the creator to size it, then use its geometry */
+		for (waited = 0; waited < BCACHE_WAIT_US; waited += 1000) {
+			if (fstat(shm, &sbuf) == 0 &&
+			    sbuf.st_size >= (off_t)sizeof(*hdr))
+				break;
+			usleep(1000);
+		}
+		total = sbuf.st_size;
+	} else if (ftruncate(shm, total) < 0) {
+		WPRINTF(("bcache: can't size %s, %d\n", name, errno));
+		close(shm);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	close(shm);
+	if (p == MAP_FAILED) {
+		if (created)
+			shm_unlink(name);
+		return NULL;
+	}
+	hdr = p;
+
+	if (created) {
+		if (bcache_init(hdr, nsets, total, data) < 0) {
+			munmap(p, total);
+			shm_unlink(name);
+			return NULL;
+		}
+	} else {
+		for (waited = 0; waited < BCACHE_WAIT_US; waited += 1000) {
+			if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) ==
+			    BCACHE_MAGIC)
+				break;
+			usleep(1000);
+		}
+		if (hdr->magic != BCACHE_MAGIC || hdr->size != total ||
+		    bcache_layout(hdr->nsets, &data) != total ||
+		    hdr->data != data) {
+			WPRINTF(("bcache: %s is not usable\n", name));
+			munmap(p, total);
+			return NULL;
+		}
+	}
+
+	bc = calloc(1, sizeof(struct bcache));
+	if (bc == NULL) {
+		munmap(p, total);
+		return NULL;
+	}
+	bc->hdr = hdr;
+	bc->size = total;
+	bc->data = (uint8_t *)p + hdr->data;
+	DPRINTF(("bcache: %s, %u sets\n", name, hdr->nsets));
+	return bc;
+}
+
+void
+bcache_close(struct bcache *bc)
+{
+	munmap(bc->hdr, bc->size);
+	free(bc);
+}
+
+static struct bcache_set *
+bcache_lock(struct bcache *bc, uint64_t block, uint32_t *setp)
+{
+	struct bcache_set *set;
+	uint32_t s;
+
+	/* spread neighbouring blocks over different sets */
+	s = (uint32_t)((block * 0x9e3779b97f4a7c15ULL) >> 32) %
+	    bc->hdr->nsets;
+	set = &bc->hdr->sets[s];
+	if (pthread_mutex_lock(&set->mtx) == EOWNERDEAD) {
+		/* its owner died mid-update, so trust none of it */
+		memset(set->tag, 0, sizeof(set->tag));
+		pthread_mutex_consistent(&set->mtx);
+	}
+	*setp = s;
+	return set;
+}
+
+static uint8_t *
+bcache_slot(struct bcache *bc, uint32_t set, int way)
+{
+	return bc->data + ((size_t)set * BCACHE_WAYS + way) * BCACHE_BLOCK;
+}
+
+/* Copy len bytes from src into iov, starting skip bytes in */
+static void
+bcache_copyout(const struct iovec *iov, int iovcnt, size_t skip,
+	       const uint8_t *src, size_t len)
+{
+	size_t l;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		l = MIN(iov[i].iov_len - skip, len);
+		memcpy((uint8_t *)iov[i].iov_base + skip, src, l);
+		src += l;
+		len -= l;
+		skip = 0;
+	}
+}
+
+static int
+bcache_lookup(struct bcache *bc, uint64_t block, const struct iovec *iov,
+	      int iovcnt, size_t skip, size_t boff, size_t len)
+{
+	struct bcache_set *set;
+	uint32_t s;
+	int way;
+
+	set = bcache_lock(bc, block, &s);
+	for (way = 0; way < BCACHE_WAYS; way++) {
+		if (set->tag[way] == block + 1)
+			break;
+	}
+	if (way < BCACHE_WAYS) {
+		set->ref[way] = 1;
+		bcache_copyout(iov, iovcnt, skip, bcache_slot(bc, s, way) + boff,
+			       len);
+	}
+	pthread_mutex_unlock(&set->mtx);
+	return way < BCACHE_WAYS;
+}
+
+static void
+bcache_insert(struct bcache *bc, uint64_t block, const uint8_t *buf)
+{
+	struct bcache_set *set;
+	uint32_t s;
+	int way;
+
+	set = bcache_lock(bc, block, &s);
+	for (way = 0; way < BCACHE_WAYS; way++) {
+		if (set->tag[way] == block + 1)
+			goto out;	/* someone else got there first */
+	}
+
+	/* clock: take the first way not referenced since the last pass */
+	for (;;) {
+		way = set->hand;
+		set->hand = (set->hand + 1) % BCACHE_WAYS;
+		if (set->tag[way] == 0 || !set->ref[way])
+			break;
+		set->ref[way] = 0;
+	}
+
+	set->tag[way] = 0;
+	memcpy(bcache_slot(bc, s, way), buf, BCACHE_BLOCK);
+	set->tag[way] = block + 1;
+	set->ref[way] = 1;
+out:
+	pthread_mutex_unlock(&set->mtx);
+}
+
+/*
+ * preadv() through the cache. buf must hold BCACHE_BLOCK bytes and meet
+ * any O_DIRECT alignment fd needs.
+ */
+ssize_t
+bcache_preadv(struct bcache *bc, int fd, const struct iovec *iov, int iovcnt,
+	      off_t offset, void *buf)
+{
+	uint64_t block;
+	size_t total, done, boff, len, got;
+	ssize_t n;
+	int i;
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	for (done = 0; done < total; done += len) {
+		block = (offset + done) / BCACHE_BLOCK;
+		boff = (offset + done) % BCACHE_BLOCK;
+		len = MIN(BCACHE_BLOCK - boff, total - done);
+
+		if (bcache_lookup(bc, block, iov, iovcnt, done, boff, len))
+			continue;
+
+		for (got = 0; got < BCACHE_BLOCK; got += n) {
+			n = pread(fd, (uint8_t *)buf + got, BCACHE_BLOCK - got,
+				  block * BCACHE_BLOCK + got);
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n < 0)
+				return -1;
+			if (n == 0)
+				break;
+		}
+		/* the image may end inside this block */
+		memset((uint8_t *)buf + got, 0, BCACHE_BLOCK - got);
+		bcache_insert(bc, block, buf);
+		bcache_copyout(iov, iovcnt, done, (uint8_t *)buf + boff, len);
+	}
+
+	return total;
+}
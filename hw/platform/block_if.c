@@ -31,7 +31,13 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/aio_abi.h>
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
@@ -40,13 +46,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <signal.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dm.h"
+#include "vmmapi.h"
+#include "exitprof.h"
+#include "monitor.h"
+#include "dm_trace.h"
 #include "mevent.h"
 #include "block_if.h"
+#include "block_qcow2.h"
+#include "block_cache.h"
+#include "block_readahead.h"
+#include "timer.h"
 #include "ahci.h"
 
 /*
@@ -63,13 +77,29 @@
 
 #define BLOCKIF_SIG	0xb109b109
 
+/* defaults, overridable per drive with workers= and queue= */
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 
+#define BLOCKIF_NUMTHR_MAX	64
+#define BLOCKIF_MAXREQ_MAX	1024
+#define BLOCKIF_AIO_EVENTS	64	/* reaped per io_getevents() */
+#define BLOCKIF_MERGE_IOV	256	/* iovecs in one merged request */
+#define BLOCKIF_HIST		24	/* log2(usec) latency buckets */
+#define BLOCKIF_URING_CANCEL	1	/* user_data of cancel SQEs */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+
 /*
  * Debug printf
  */
 static int block_if_debug;
+MONITOR_DEBUG(block_if, block_if_debug);
 #define DPRINTF(params) do { if (block_if_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
@@ -77,7 +107,19 @@ enum blockop {
 	BOP_READ,
 	BOP_WRITE,
 	BOP_FLUSH,
-	BOP_DELETE
+	BOP_DELETE,
+	BOP_WRITE_ZEROES,
+	BOP_MAX
+};
+
+static const char * const blockop_name[BOP_MAX] = {
+	"read", "write", "flush", "delete", "write_zeroes"
+};
+
+enum blockif_engine {
+	BLOCKIF_ENGINE_THREAD,	/* worker threads doing synchronous I/O */
+	BLOCKIF_ENGINE_URING,	/* io_uring, one completion thread */
+	BLOCKIF_ENGINE_AIO,	/* native AIO, reaped from mevent */
 };
 
 enum blockstat {
@@ -85,7 +127,8 @@ enum blockstat {
 	BST_BLOCK,
 	BST_PEND,
 	BST_BUSY,
-	BST_DONE
+	BST_DONE,
+	BST_THROTTLED
 };
 
 struct blockif_elem {
@@ -95,6 +138,83 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	struct iocb	     iocb;	/* BLOCKIF_ENGINE_AIO only */
+	struct blockif_elem  *mnext;	/* merged behind this one */
+	uint64_t	     t_enq;	/* ns, when queued */
+	uint64_t	     t_start;	/* ns, when handed to the backend */
+	ssize_t		     bytes;	/* requested */
+};
+
+/*
+ * Updated with atomics, so the monitor can read them at any time.
+ * Latencies are split into waiting in pendq (wait) and time spent in
+ * the backend (svc), bucket n counting [2^n, 2^(n+1)) microseconds.
+ */
+struct blockif_stats {
+	uint64_t	ops[BOP_MAX];
+	uint64_t	bytes[BOP_MAX];
+	uint64_t	errors;
+	uint32_t	inflight;
+	uint32_t	max_inflight;
+	uint64_t	lat_total[BLOCKIF_HIST];
+	uint64_t	lat_wait[BLOCKIF_HIST];
+	uint64_t	lat_svc[BLOCKIF_HIST];
+};
+
+/*
+ * Token buckets, one per limit. Levels are kept in billionths of an
+ * op or byte, so refilling is rate * elapsed ns; a request is let go
+ * once its buckets aren't in debt, and may take them below zero.
+ */
+enum {
+	BLOCKIF_TB_IOPS_RD,
+	BLOCKIF_TB_IOPS_WR,
+	BLOCKIF_TB_BPS_RD,
+	BLOCKIF_TB_BPS_WR,
+	BLOCKIF_TB_MAX
+};
+
+struct blockif_bucket {
+	uint64_t	rate;		/* per second, 0 for no limit */
+	int64_t		level;
+	int64_t		burst;
+};
+
+struct blockif_throttle {
+	struct blockif_bucket	tb[BLOCKIF_TB_MAX];
+	uint64_t		last;		/* ns, of the last refill */
+	int			prio;		/* for BLOCKIF_PRIO_NONE */
+	struct acrn_timer	timer;
+	uint64_t		delayed;	/* requests held back */
+	/* held back requests, BE first and IDLE after */
+	TAILQ_HEAD(, blockif_elem) q[2];
+};
+
+struct blockif_uring {
+	int			fd;
+	volatile unsigned int	*sq_tail;
+	unsigned int		sq_tail_local;	/* includes unsubmitted SQEs */
+	unsigned int		sq_mask;
+	struct io_uring_sqe	*sqes;
+	volatile unsigned int	*cq_head;
+	volatile unsigned int	*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+	unsigned int		to_submit;
+	void			*sq_ring;
+	void			*cq_ring;
+	size_t			sq_ring_sz;
+	size_t			cq_ring_sz;
+	size_t			sqes_sz;
+	pthread_t		tid;
+};
+
+struct blockif_aio {
+	aio_context_t		ctx;
+	int			efd;
+	struct mevent		*mevp;
+	struct iocb		**pend;		/* not yet submitted */
+	int			npend;
 };
 
 struct blockif_ctxt {
@@ -102,7 +222,15 @@ struct blockif_ctxt {
 	int			fd;
 	int			isblk;
 	int			isgeom;
+	int			align;		/* O_DIRECT buffer alignment */
 	int			candelete;
+	struct qcow2		*qcow;		/* NULL for raw images */
+	struct bcache		*cache;		/* shared read cache, or NULL */
+	struct bra		*ra;		/* readahead, or NULL */
+	struct blockif_throttle	*thr;		/* QoS limits, or NULL */
+
+	char			ident[16];
+	struct blockif_stats	stats;
 	int			rdonly;
 	off_t			size;
 	int			sub_file_assign;
@@ -112,27 +240,87 @@ struct blockif_ctxt {
 	int			psectsz;
 	int			psectoff;
 	int			closing;
-	pthread_t		btid[BLOCKIF_NUMTHR];
+	pthread_t		btid[BLOCKIF_NUMTHR_MAX];
+	int			nthr;
+	cpu_set_t		cpuset;		/* worker affinity */
+	int			pinned;
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
 
+	/* flush group commit, see blockif_sync() */
+	pthread_mutex_t		flush_mtx;
+	pthread_cond_t		flush_cond;
+	uint64_t		flush_started;
+	uint64_t		flush_done;
+	uint64_t		flush_errgen;	/* last flush that failed */
+	int			flush_err;
+	int			flush_busy;
+
+	enum blockif_engine	engine;
+	struct blockif_uring	ring;
+	struct blockif_aio	aio;
+	int			plugged;
+
 	/* Request elements and free/pending/busy queues */
 	TAILQ_HEAD(, blockif_elem) freeq;
 	TAILQ_HEAD(, blockif_elem) pendq;
 	TAILQ_HEAD(, blockif_elem) busyq;
-	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+	struct blockif_elem	*reqs;
+	int			nreq;
 };
 
-static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
-struct blockif_sig_elem {
-	pthread_mutex_t			mtx;
-	pthread_cond_t			cond;
-	int				pending;
-	struct blockif_sig_elem		*next;
-};
+static inline uint64_t
+blockif_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+blockif_hist(uint64_t *hist, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int b = 0;
+
+	if (us > 1)
+		b = 63 - __builtin_clzll(us);
+	__atomic_fetch_add(&hist[MIN(b, BLOCKIF_HIST - 1)], 1,
+			   __ATOMIC_RELAXED);
+}
 
-static struct blockif_sig_elem *blockif_bse_head;
+/* Mark be queued, with bc->mtx held */
+static inline void
+blockif_account_start(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_stats *st = &bc->stats;
+	uint32_t n;
+
+	be->t_enq = be->t_start = blockif_now();
+	be->bytes = be->req->resid;
+	n = __atomic_add_fetch(&st->inflight, 1, __ATOMIC_RELAXED);
+	if (n > st->max_inflight)
+		__atomic_store_n(&st->max_inflight, n, __ATOMIC_RELAXED);
+}
+
+/* Account a finished request; be->req is only valid until its callback */
+static inline void
+blockif_account(struct blockif_ctxt *bc, struct blockif_elem *be, int err)
+{
+	struct blockif_stats *st = &bc->stats;
+	uint64_t now = blockif_now();
+
+	__atomic_fetch_add(&st->ops[be->op], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->bytes[be->op], be->bytes - be->req->resid,
+			   __ATOMIC_RELAXED);
+	if (err)
+		__atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+	blockif_hist(st->lat_total, now - be->t_enq);
+	blockif_hist(st->lat_wait, be->t_start - be->t_enq);
+	blockif_hist(st->lat_svc, now - be->t_start);
+}
 
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
@@ -148,10 +336,12 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	TAILQ_REMOVE(&bc->freeq, be, link);
 	be->req = breq;
 	be->op = op;
+	blockif_account_start(bc, be);
 	switch (op) {
 	case BOP_READ:
 	case BOP_WRITE:
 	case BOP_DELETE:
+	case BOP_WRITE_ZEROES:
 		off = breq->offset;
 		for (i = 0; i < breq->iovcnt; i++)
 			off += breq->iov[i].iov_len;
@@ -176,9 +366,72 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	else
 		be->status = BST_BLOCK;
 	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	DM_TRACE4(blockif_enqueue, (const char *)bc->ident, op, breq->offset,
+		  be->status == BST_PEND);
 	return (be->status == BST_PEND);
 }
 
+/*
+ * Images are opened O_DIRECT, so a request can only go straight to
+ * preadv/pwritev when every guest buffer is sector aligned; the rest
+ * are bounced by blockif_proc().
+ */
+static int
+blockif_aligned(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	uintptr_t mask = bc->align - 1;
+	int i;
+
+	for (i = 0; i < br->iovcnt; i++) {
+		if (((uintptr_t)br->iov[i].iov_base & mask) ||
+		    (br->iov[i].iov_len & mask))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Pull pending requests that continue where be ends, in the same
+ * direction, onto be's merge chain so blockif_proc() can issue them
+ * as one preadv/pwritev. A request queued right behind be is usually
+ * BST_BLOCK on it, and is safe to take since it is issued in order.
+ */
+static void
+blockif_merge(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem *be)
+{
+	struct blockif_elem *last, *tbe;
+	int iovcnt;
+
+	if ((be->op != BOP_READ && be->op != BOP_WRITE) || bc->qcow ||
+	    (be->op == BOP_READ && (bc->cache || bc->ra)) ||
+	    (be->op == BOP_WRITE && bc->rdonly) ||
+	    !blockif_aligned(bc, be->req))
+		return;
+
+	last = be;
+	iovcnt = be->req->iovcnt;
+	for (;;) {
+		TAILQ_FOREACH(tbe, &bc->pendq, link) {
+			if (tbe->op == be->op &&
+			    tbe->req->offset == last->block &&
+			    iovcnt + tbe->req->iovcnt <= BLOCKIF_MERGE_IOV &&
+			    blockif_aligned(bc, tbe->req))
+				break;
+		}
+		if (tbe == NULL)
+			break;
+
+		TAILQ_REMOVE(&bc->pendq, tbe, link);
+		tbe->status = BST_BUSY;
+		tbe->tid = t;
+		tbe->t_start = blockif_now();
+		TAILQ_INSERT_TAIL(&bc->busyq, tbe, link);
+		iovcnt += tbe->req->iovcnt;
+		last->mnext = tbe;
+		last = tbe;
+	}
+}
+
 static int
 blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 {
@@ -194,7 +447,9 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 	TAILQ_REMOVE(&bc->pendq, be, link);
 	be->status = BST_BUSY;
 	be->tid = t;
+	be->t_start = blockif_now();
 	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	blockif_merge(bc, t, be);
 	*bep = be;
 	return 1;
 }
@@ -204,6 +459,8 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
 	struct blockif_elem *tbe;
 
+	DM_TRACE3(blockif_complete, (const char *)bc->ident, be->op,
+		  be->block);
 	if (be->status == BST_DONE || be->status == BST_BUSY)
 		TAILQ_REMOVE(&bc->busyq, be, link);
 	else
@@ -215,23 +472,176 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 	be->tid = 0;
 	be->status = BST_FREE;
 	be->req = NULL;
+	__atomic_sub_fetch(&bc->stats.inflight, 1, __ATOMIC_RELAXED);
 	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
 }
 
+/* Issue a merge chain as one request and split the result back up */
+static void
+blockif_proc_merged(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct iovec iov[BLOCKIF_MERGE_IOV];
+	struct blockif_elem *tbe;
+	struct blockif_req *br;
+	ssize_t len, clen, total;
+	int iovcnt, err;
+
+	iovcnt = 0;
+	total = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->mnext) {
+		br = tbe->req;
+		memcpy(&iov[iovcnt], br->iov, br->iovcnt * sizeof(iov[0]));
+		iovcnt += br->iovcnt;
+		total += br->resid;
+	}
+
+	br = be->req;
+	if (be->op == BOP_READ)
+		len = preadv(bc->fd, iov, iovcnt,
+			     br->offset + bc->sub_file_start_lba);
+	else
+		len = pwritev(bc->fd, iov, iovcnt,
+			      br->offset + bc->sub_file_start_lba);
+	err = (len < 0) ? errno : 0;
+	if (be->op == BOP_WRITE && bc->ra)
+		bra_invalidate(bc->ra, br->offset + bc->sub_file_start_lba,
+			       total);
+
+	for (tbe = be; tbe != NULL; tbe = tbe->mnext) {
+		br = tbe->req;
+		if (!err) {
+			clen = MIN(len, br->resid);
+			br->resid -= clen;
+			len -= clen;
+		}
+		blockif_account(bc, tbe, err);
+		tbe->status = BST_DONE;
+
+		(*br->callback)(br, err);
+	}
+}
+
+/*
+ * Deallocate (BOP_DELETE) or zero (BOP_WRITE_ZEROES) a range. Block
+ * devices use the discard/zeroout ioctls; image files get a hole
+ * punched, or a zeroed range, which falls back to a hole where the
+ * filesystem can't zero in place. Returns an errno.
+ */
+static int
+blockif_discard(struct blockif_ctxt *bc, enum blockop op, off_t off,
+		off_t len)
+{
+	uint64_t arg[2];
+
+	if (bc->isblk) {
+		arg[0] = off;
+		arg[1] = len;
+		if (ioctl(bc->fd, (op == BOP_DELETE) ? BLKDISCARD : BLKZEROOUT,
+			  arg))
+			return errno;
+		return 0;
+	}
+
+	if (op == BOP_WRITE_ZEROES &&
+	    fallocate(bc->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		      off, len) == 0)
+		return 0;
+	if (fallocate(bc->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len))
+		return errno;
+	return 0;
+}
+
+/*
+ * Flushes from several workers share one fdatasync().  A flush that
+ * arrives while another is in flight can't rely on it, as that one may
+ * have started before the writes the new flush covers completed, so it
+ * waits for the next generation, which a single leader runs on behalf
+ * of everyone queued behind it.
+ *
+ * fdatasync() is enough here: the image size and block allocation it
+ * still writes back are all a guest needs to read its data back.
+ */
+static int
+blockif_sync(struct blockif_ctxt *bc)
+{
+	uint64_t target, gen;
+	int err;
+
+	pthread_mutex_lock(&bc->flush_mtx);
+	target = bc->flush_started + 1;
+	while (bc->flush_done < target) {
+		if (bc->flush_busy) {
+			pthread_cond_wait(&bc->flush_cond, &bc->flush_mtx);
+			continue;
+		}
+		bc->flush_busy = 1;
+		gen = ++bc->flush_started;
+		pthread_mutex_unlock(&bc->flush_mtx);
+
+		err = fdatasync(bc->fd) ? errno : 0;
+
+		pthread_mutex_lock(&bc->flush_mtx);
+		if (err) {
+			bc->flush_errgen = gen;
+			bc->flush_err = err;
+		}
+		bc->flush_done = gen;
+		bc->flush_busy = 0;
+		pthread_cond_broadcast(&bc->flush_cond);
+	}
+	err = (bc->flush_errgen >= target) ? bc->flush_err : 0;
+	pthread_mutex_unlock(&bc->flush_mtx);
+
+	return err;
+}
+
 static void
 blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 {
 	struct blockif_req *br;
-	off_t arg[2];
-	ssize_t clen, len, off, boff, voff;
+	ssize_t clen, len, off, boff, voff, nbytes;
 	int i, err;
 
+	if (be->mnext != NULL) {
+		blockif_proc_merged(bc, be);
+		return;
+	}
+
 	br = be->req;
-	if (br->iovcnt <= 1)
+	nbytes = br->resid;
+	if (blockif_aligned(bc, br) && !(bc->cache && be->op == BOP_READ))
 		buf = NULL;
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
+		if (bc->cache && buf) {
+			len = bcache_preadv(bc->cache, bc->fd, br->iov,
+					    br->iovcnt, br->offset +
+					    bc->sub_file_start_lba, buf);
+			if (len < 0)
+				err = errno;
+			else
+				br->resid -= len;
+			break;
+		}
+		if (bc->ra) {
+			len = bra_preadv(bc->ra, br->iov, br->iovcnt,
+					 br->offset + bc->sub_file_start_lba);
+			if (len > 0) {
+				br->resid -= len;
+				break;
+			}
+		}
+		if (bc->qcow) {
+			len = qcow2_readv(bc->qcow, br->iov, br->iovcnt,
+					  br->offset);
+			if (len < 0)
+				err = errno;
+			else
+				br->resid -= len;
+			break;
+		}
 		if (buf == NULL) {
 			len = preadv(bc->fd, br->iov, br->iovcnt,
 				     br->offset + bc->sub_file_start_lba);
@@ -273,6 +683,15 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 			err = EROFS;
 			break;
 		}
+		if (bc->qcow) {
+			len = qcow2_writev(bc->qcow, br->iov, br->iovcnt,
+					   br->offset);
+			if (len < 0)
+				err = errno;
+			else
+				br->resid -= len;
+			break;
+		}
 		if (buf == NULL) {
 			len = pwritev(bc->fd, br->iov, br->iovcnt,
 				      br->offset + bc->sub_file_start_lba);
@@ -310,31 +729,36 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 		}
 		break;
 	case BOP_FLUSH:
-		if (fsync(bc->fd))
-			err = errno;
+		err = blockif_sync(bc);
 		break;
 	case BOP_DELETE:
-		/* only used by AHCI */
-		if (!bc->candelete)
+	case BOP_WRITE_ZEROES:
+		if ((be->op == BOP_DELETE && !bc->candelete) || bc->qcow)
 			err = EOPNOTSUPP;
 		else if (bc->rdonly)
 			err = EROFS;
-		else if (bc->isblk) {
-			arg[0] = br->offset;
-			arg[1] = br->resid;
-			if (ioctl(bc->fd, BLKDISCARD, arg))
-				err = errno;
-			else
-				br->resid = 0;
-		}
+		else if (br->offset < 0 || br->resid < 0 ||
+			 br->offset + br->resid > bc->size)
+			err = EINVAL;
 		else
-			err = EOPNOTSUPP;
+			err = blockif_discard(bc, be->op, br->offset +
+					      bc->sub_file_start_lba,
+					      br->resid);
+		if (!err)
+			br->resid = 0;
 		break;
 	default:
 		err = EINVAL;
 		break;
 	}
 
+	/* even a failed write may have changed some of the image */
+	if (bc->ra && (be->op == BOP_WRITE || be->op == BOP_DELETE ||
+		       be->op == BOP_WRITE_ZEROES))
+		bra_invalidate(bc->ra, br->offset + bc->sub_file_start_lba,
+			       nbytes);
+
+	blockif_account(bc, be, err);
 	be->status = BST_DONE;
 
 	(*br->callback)(br, err);
@@ -344,14 +768,13 @@ static void *
 blockif_thr(void *arg)
 {
 	struct blockif_ctxt *bc;
-	struct blockif_elem *be;
+	struct blockif_elem *be, *next;
 	pthread_t t;
 	uint8_t *buf;
+	uint64_t start = 0;
 
 	bc = arg;
-	if (bc->isgeom)
-		buf = malloc(MAXPHYS);
-	else
+	if (posix_memalign((void **)&buf, bc->align, MAXPHYS))
 		buf = NULL;
 	t = pthread_self();
 
@@ -359,55 +782,500 @@ blockif_thr(void *arg)
 	for (;;) {
 		while (blockif_dequeue(bc, t, &be)) {
 			pthread_mutex_unlock(&bc->mtx);
+			if (exitprof_enabled)
+				start = exitprof_rdtsc();
 			blockif_proc(bc, be, buf);
+			if (exitprof_enabled)
+				exitprof_probe(EXITPROF_BLOCKIF_PROC,
+					       exitprof_rdtsc() - start);
 			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
+			for (; be != NULL; be = next) {
+				next = be->mnext;
+				be->mnext = NULL;
+				blockif_complete(bc, be);
+			}
 		}
 		/* Check ctxt status here to see if exit requested */
 		if (bc->closing)
 			break;
 		pthread_cond_wait(&bc->cond, &bc->mtx);
 	}
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bc->mtx);
+
+	if (buf)
+		free(buf);
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * io_uring engine. Reads, writes and flushes are turned into SQEs
+ * straight from blockif_request() and a single thread reaps the
+ * completions; anything else still goes through the worker thread.
+ * While the context is plugged (see blockif_plug()), SQEs are only
+ * queued and the whole batch is handed to the kernel on unplug.
+ */
+static inline int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	       unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/* Called with bc->mtx held */
+static void
+blockif_uring_submit(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ring = &bc->ring;
+	int ret;
+
+	if (ring->to_submit == 0)
+		return;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+	do {
+		ret = io_uring_enter(ring->fd, ring->to_submit, 0, 0);
+		if (ret > 0)
+			ring->to_submit -= ret;
+	} while ((ret > 0 && ring->to_submit > 0) ||
+		 (ret < 0 && (errno == EINTR || errno == EAGAIN)));
+
+	if (ret < 0)
+		WPRINTF(("blockif: io_uring submit failed %d\n", errno));
+}
+
+static void
+blockif_uring_prep(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_uring *ring = &bc->ring;
+	struct blockif_req *br = be->req;
+	struct io_uring_sqe *sqe;
+
+	sqe = &ring->sqes[ring->sq_tail_local++ & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = bc->fd;
+	sqe->user_data = (uintptr_t)be;
+	switch (be->op) {
+	case BOP_READ:
+	case BOP_WRITE:
+		sqe->opcode = (be->op == BOP_READ) ? IORING_OP_READV :
+			      IORING_OP_WRITEV;
+		sqe->addr = (uintptr_t)br->iov;
+		sqe->len = br->iovcnt;
+		sqe->off = br->offset + bc->sub_file_start_lba;
+		break;
+	default:
+		/* a flush covers every write queued before it */
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->flags = IOSQE_IO_DRAIN;
+		break;
+	}
+	ring->to_submit++;
+}
+
+/*
+ * Ask the kernel to cancel an SQE, if there is room for one more. Called
+ * with bc->mtx held.
+ */
+static void
+blockif_uring_cancel(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_uring *ring = &bc->ring;
+	struct io_uring_sqe *sqe;
+
+	if (ring->to_submit > ring->sq_mask)
+		return;
+
+	sqe = &ring->sqes[ring->sq_tail_local++ & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t)be;
+	sqe->user_data = BLOCKIF_URING_CANCEL;
+	ring->to_submit++;
+	blockif_uring_submit(bc);
+}
+
+static void *
+blockif_uring_thr(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_uring *ring = &bc->ring;
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int res, err, done = 0;
+
+	while (!done) {
+		if (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR) {
+			WPRINTF(("blockif: io_uring wait failed %d\n", errno));
+			break;
+		}
+
+		vm_intr_batch_begin();
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail,
+					       __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & ring->cq_mask];
+			be = (struct blockif_elem *)(uintptr_t)cqe->user_data;
+			res = cqe->res;
+			__atomic_store_n(ring->cq_head, ++head,
+					 __ATOMIC_RELEASE);
+
+			/* the NOP queued by blockif_close() */
+			if (be == NULL) {
+				done = 1;
+				continue;
+			}
+
+			/*
+			 * The target completes on its own, maybe ECANCELED.
+			 * The CQE may be reused once cq_head moves, so only
+			 * what was loaded before counts.
+			 */
+			if (be == (struct blockif_elem *)BLOCKIF_URING_CANCEL)
+				continue;
+
+			br = be->req;
+			err = 0;
+			if (res < 0)
+				err = -res;
+			else if (be->op != BOP_FLUSH)
+				br->resid -= res;
+			blockif_account(bc, be, err);
+			be->status = BST_DONE;
+
+			(*br->callback)(br, err);
+
+			pthread_mutex_lock(&bc->mtx);
+			blockif_complete(bc, be);
+			pthread_mutex_unlock(&bc->mtx);
+		}
+		vm_intr_batch_end();
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void
+blockif_uring_deinit(struct blockif_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	if (ring->cq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	ring->fd = -1;
+}
+
+static int
+blockif_uring_init(struct blockif_uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int *sq_array;
+	unsigned int i;
+	uint8_t *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	ring->sq_ring = (sq == MAP_FAILED) ? NULL : sq;
+	ring->cq_ring = (cq == MAP_FAILED) ? NULL : cq;
+	if (ring->sqes == MAP_FAILED)
+		ring->sqes = NULL;
+	if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+		blockif_uring_deinit(ring);
+		return -1;
+	}
+
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_tail_local = *ring->sq_tail;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* SQE n always sits in slot n, so the index array is fixed */
+	sq_array = (unsigned int *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	return 0;
+}
+
+/*
+ * Linux native AIO engine, for kernels without io_uring. Reads and
+ * writes become iocbs submitted with io_submit(); completions signal
+ * an eventfd that is reaped from the mevent loop. Flushes are left to
+ * the worker thread, as few filesystems implement IOCB_CMD_FDSYNC.
+ */
+static inline int
+io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int
+io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int
+io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int
+io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+	     struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events,
+		       timeout);
+}
+
+static inline int
+io_cancel(aio_context_t ctx, struct iocb *iocb, struct io_event *result)
+{
+	return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+/* Called with bc->mtx held */
+static void
+blockif_aio_submit(struct blockif_ctxt *bc)
+{
+	struct blockif_aio *aio = &bc->aio;
+	struct blockif_elem *be;
+	int i, ret;
+
+	i = 0;
+	while (i < aio->npend) {
+		ret = io_submit(aio->ctx, aio->npend - i, &aio->pend[i]);
+		if (ret > 0) {
+			i += ret;
+			continue;
+		}
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+
+		/*
+		 * The iocb at pend[i] was refused (e.g. an unaligned
+		 * buffer under O_DIRECT): let a worker do it, which
+		 * either succeeds or reports the real error.
+		 */
+		be = (struct blockif_elem *)(uintptr_t)aio->pend[i]->aio_data;
+		TAILQ_REMOVE(&bc->busyq, be, link);
+		be->status = BST_PEND;
+		TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+		pthread_cond_signal(&bc->cond);
+		i++;
+	}
+	aio->npend = 0;
+}
+
+static void
+blockif_aio_prep(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *br = be->req;
+	struct iocb *iocb = &be->iocb;
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data = (uintptr_t)be;
+	iocb->aio_lio_opcode = (be->op == BOP_READ) ? IOCB_CMD_PREADV :
+			       IOCB_CMD_PWRITEV;
+	iocb->aio_fildes = bc->fd;
+	iocb->aio_buf = (uintptr_t)br->iov;
+	iocb->aio_nbytes = br->iovcnt;
+	iocb->aio_offset = br->offset + bc->sub_file_start_lba;
+	iocb->aio_flags = IOCB_FLAG_RESFD;
+	iocb->aio_resfd = bc->aio.efd;
+
+	bc->aio.pend[bc->aio.npend++] = iocb;
+}
+
+static void
+blockif_aio_reap(int fd, enum ev_type type, void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct io_event events[BLOCKIF_AIO_EVENTS];
+	struct timespec ts = { 0, 0 };
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	uint64_t cnt;
+	int i, n, err;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	vm_intr_batch_begin();
+	do {
+		n = io_getevents(bc->aio.ctx, 0, BLOCKIF_AIO_EVENTS, events,
+				 &ts);
+		for (i = 0; i < n; i++) {
+			be = (struct blockif_elem *)(uintptr_t)events[i].data;
+			br = be->req;
+			err = 0;
+			if ((int64_t)events[i].res < 0)
+				err = -(int64_t)events[i].res;
+			else
+				br->resid -= events[i].res;
+			blockif_account(bc, be, err);
+			be->status = BST_DONE;
+
+			(*br->callback)(br, err);
+
+			pthread_mutex_lock(&bc->mtx);
+			blockif_complete(bc, be);
+			pthread_mutex_unlock(&bc->mtx);
+		}
+	} while (n == BLOCKIF_AIO_EVENTS || (n < 0 && errno == EINTR));
+	vm_intr_batch_end();
+}
+
+static int
+blockif_aio_init(struct blockif_ctxt *bc)
+{
+	struct blockif_aio *aio = &bc->aio;
+
+	aio->ctx = 0;
+	aio->npend = 0;
+	aio->pend = calloc(bc->nreq, sizeof(struct iocb *));
+	if (aio->pend == NULL)
+		return -1;
+
+	aio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (aio->efd < 0)
+		goto fail;
+
+	if (io_setup(bc->nreq, &aio->ctx) < 0) {
+		close(aio->efd);
+		goto fail;
+	}
+
+	aio->mevp = mevent_add(aio->efd, EVF_READ, blockif_aio_reap, bc);
+	if (aio->mevp == NULL) {
+		io_destroy(aio->ctx);
+		close(aio->efd);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	aio->efd = -1;
+	free(aio->pend);
+	aio->pend = NULL;
+	return -1;
+}
+
+static void
+blockif_aio_deinit(struct blockif_ctxt *bc)
+{
+	/* io_destroy() waits for the iocbs still in flight */
+	io_destroy(bc->aio.ctx);
+	mevent_delete_close(bc->aio.mevp);
+	bc->aio.efd = -1;
+	free(bc->aio.pend);
+}
+
+static int
+blockif_async_can(struct blockif_ctxt *bc, struct blockif_req *breq,
+		  enum blockop op)
+{
+	switch (op) {
+	case BOP_READ:
+		/* misaligned buffers need the worker's bounce buffer */
+		return bc->engine != BLOCKIF_ENGINE_THREAD && !bc->cache &&
+		       blockif_aligned(bc, breq);
+	case BOP_WRITE:
+		/* let the worker fail it with EROFS */
+		return bc->engine != BLOCKIF_ENGINE_THREAD && !bc->rdonly &&
+		       blockif_aligned(bc, breq);
+	case BOP_FLUSH:
+		return bc->engine == BLOCKIF_ENGINE_URING;
+	default:
+		return 0;
+	}
+}
 
-	if (buf)
-		free(buf);
-	pthread_exit(NULL);
-	return NULL;
+/* Called with bc->mtx held */
+static void
+blockif_async_submit(struct blockif_ctxt *bc)
+{
+	if (bc->engine == BLOCKIF_ENGINE_URING)
+		blockif_uring_submit(bc);
+	else if (bc->engine == BLOCKIF_ENGINE_AIO)
+		blockif_aio_submit(bc);
 }
 
+/* Called with bc->mtx held and a free element available */
 static void
-blockif_sigcont_handler(int signal)
+blockif_async_queue(struct blockif_ctxt *bc, struct blockif_req *breq,
+		    enum blockop op)
 {
-	struct blockif_sig_elem *bse;
+	struct blockif_elem *be;
 
-	WPRINTF(("block_if sigcont handler!\n"));
+	be = TAILQ_FIRST(&bc->freeq);
+	assert(be != NULL);
+	assert(be->status == BST_FREE);
+	TAILQ_REMOVE(&bc->freeq, be, link);
+	be->req = breq;
+	be->op = op;
+	be->block = -1;
+	blockif_account_start(bc, be);
+	be->status = BST_BUSY;
+	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
 
-	for (;;) {
-		/*
-		 * Process the entire list even if not intended for
-		 * this thread.
-		 */
-		do {
-			bse = blockif_bse_head;
-			if (bse == NULL)
-				return;
-		} while (!__sync_bool_compare_and_swap(
-					(uintptr_t *)&blockif_bse_head,
-					(uintptr_t)bse,
-					(uintptr_t)bse->next));
+	if (bc->engine == BLOCKIF_ENGINE_URING)
+		blockif_uring_prep(bc, be);
+	else
+		blockif_aio_prep(bc, be);
 
-		pthread_mutex_lock(&bse->mtx);
-		bse->pending = 0;
-		pthread_cond_signal(&bse->cond);
-		pthread_mutex_unlock(&bse->mtx);
-	}
+	if (!bc->plugged)
+		blockif_async_submit(bc);
 }
 
 static void
-blockif_init(void)
+blockif_pin(struct blockif_ctxt *bc, pthread_t tid)
 {
-	signal(SIGCONT, blockif_sigcont_handler);
+	int err;
+
+	if (!bc->pinned)
+		return;
+
+	err = pthread_setaffinity_np(tid, sizeof(cpu_set_t), &bc->cpuset);
+	if (err)
+		WPRINTF(("blockif: failed to set thread affinity, %d\n", err));
 }
 
 /*
@@ -456,26 +1324,283 @@ sub_file_unlock(struct blockif_ctxt *bc)
 	}
 }
 
+/* The counters, as monitor source "blockif.<ident>". */
+static void
+blockif_monitor_dump(int fd, void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_stats *st = &bc->stats;
+	int i, last;
+
+	dprintf(fd, "device %s\n", bc->ident);
+	dprintf(fd, "inflight %u max %u\n",
+		__atomic_load_n(&st->inflight, __ATOMIC_RELAXED),
+		__atomic_load_n(&st->max_inflight, __ATOMIC_RELAXED));
+	for (i = 0; i < BOP_MAX; i++)
+		dprintf(fd, "%s ops %lu bytes %lu\n", blockop_name[i],
+			__atomic_load_n(&st->ops[i], __ATOMIC_RELAXED),
+			__atomic_load_n(&st->bytes[i], __ATOMIC_RELAXED));
+	dprintf(fd, "errors %lu\n",
+		__atomic_load_n(&st->errors, __ATOMIC_RELAXED));
+	if (bc->thr)
+		dprintf(fd, "throttled %lu\n",
+			__atomic_load_n(&bc->thr->delayed, __ATOMIC_RELAXED));
+
+	for (last = BLOCKIF_HIST - 1; last > 0; last--) {
+		if (st->lat_total[last])
+			break;
+	}
+	dprintf(fd, "latency_us total wait svc\n");
+	for (i = 0; i <= last; i++)
+		dprintf(fd, "<%lu %lu %lu %lu\n", 1UL << (i + 1),
+			__atomic_load_n(&st->lat_total[i], __ATOMIC_RELAXED),
+			__atomic_load_n(&st->lat_wait[i], __ATOMIC_RELAXED),
+			__atomic_load_n(&st->lat_svc[i], __ATOMIC_RELAXED));
+}
+
+/* A block device supports discard if its queue has a non-zero limit */
+static int
+blockif_probe_discard(struct stat *sbuf)
+{
+	char path[64];
+	unsigned long long max = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path),
+		 "/sys/dev/block/%u:%u/queue/discard_max_bytes",
+		 major(sbuf->st_rdev), minor(sbuf->st_rdev));
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%llu", &max) != 1)
+		max = 0;
+	fclose(fp);
+	return max != 0;
+}
+
+/* Called with bc->mtx held and a free element available */
+static void
+blockif_dispatch(struct blockif_ctxt *bc, struct blockif_req *breq,
+		 enum blockop op)
+{
+	/*
+	 * Enqueue and inform the block i/o thread
+	 * that there is work available
+	 */
+	if (blockif_async_can(bc, breq, op))
+		blockif_async_queue(bc, breq, op);
+	else if (blockif_enqueue(bc, breq, op))
+		pthread_cond_signal(&bc->cond);
+}
+
+static void
+blockif_tb_refill(struct blockif_throttle *thr, uint64_t now)
+{
+	struct blockif_bucket *tb;
+	uint64_t dt, need;
+	int i;
+
+	dt = now - thr->last;
+	thr->last = now;
+	for (i = 0; i < BLOCKIF_TB_MAX; i++) {
+		tb = &thr->tb[i];
+		if (tb->rate == 0)
+			continue;
+		/* checked first, as rate * dt may not fit */
+		need = tb->burst - tb->level;
+		if (dt >= howmany(need, tb->rate))
+			tb->level = tb->burst;
+		else
+			tb->level += tb->rate * dt;
+	}
+}
+
+/* The IOPS and bandwidth buckets an op is charged to */
+static int
+blockif_tb_index(enum blockop op)
+{
+	return (op == BOP_READ) ? BLOCKIF_TB_IOPS_RD : BLOCKIF_TB_IOPS_WR;
+}
+
+/* ns until the buckets of op are out of debt, 0 if they are now */
+static uint64_t
+blockif_tb_wait(struct blockif_throttle *thr, enum blockop op)
+{
+	struct blockif_bucket *tb;
+	uint64_t wait, w;
+	int i;
+
+	wait = 0;
+	for (i = blockif_tb_index(op); i < BLOCKIF_TB_MAX; i += 2) {
+		tb = &thr->tb[i];
+		if (tb->rate == 0 || tb->level >= 0)
+			continue;
+		w = howmany((uint64_t)-tb->level, tb->rate);
+		wait = MAX(wait, w);
+	}
+	return wait;
+}
+
+static void
+blockif_tb_charge(struct blockif_throttle *thr, enum blockop op,
+		  ssize_t bytes)
+{
+	int i;
+
+	i = blockif_tb_index(op);
+	if (thr->tb[i].rate)
+		thr->tb[i].level -= 1000000000LL;
+	/* a discard moves no data */
+	if (thr->tb[i + 2].rate && op != BOP_DELETE)
+		thr->tb[i + 2].level -= bytes * 1000000000LL;
+}
+
+/* Called with bc->mtx held: let out what the buckets allow, in order */
+static void
+blockif_throttle_release(struct blockif_ctxt *bc)
+{
+	struct blockif_throttle *thr = bc->thr;
+	struct blockif_elem *be;
+	struct itimerspec its;
+	uint64_t t_enq, wait;
+	int q;
+
+	blockif_tb_refill(thr, blockif_now());
+	for (;;) {
+		q = TAILQ_EMPTY(&thr->q[0]) ? 1 : 0;
+		be = TAILQ_FIRST(&thr->q[q]);
+		if (be == NULL)
+			return;
+		wait = blockif_tb_wait(thr, be->op);
+		if (wait)
+			break;
+
+		/* hand the element back for blockif_dispatch() to take */
+		TAILQ_REMOVE(&thr->q[q], be, link);
+		be->status = BST_FREE;
+		TAILQ_INSERT_HEAD(&bc->freeq, be, link);
+		t_enq = be->t_enq;
+		blockif_tb_charge(thr, be->op, be->req->resid);
+		blockif_dispatch(bc, be->req, be->op);
+		/* count the time held back as waiting */
+		be->t_enq = t_enq;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = wait / 1000000000UL;
+	its.it_value.tv_nsec = wait % 1000000000UL;
+	acrn_timer_settime(&thr->timer, &its);
+}
+
+static void
+blockif_throttle_timer(void *arg, uint64_t nexp)
+{
+	struct blockif_ctxt *bc = arg;
+
+	pthread_mutex_lock(&bc->mtx);
+	blockif_throttle_release(bc);
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+/*
+ * Called with bc->mtx held and a free element available: charge the
+ * request and return 0 for the caller to dispatch it, or hold it back
+ * behind those already waiting and return 1.
+ */
+static int
+blockif_throttle(struct blockif_ctxt *bc, struct blockif_req *breq,
+		 enum blockop op)
+{
+	struct blockif_throttle *thr = bc->thr;
+	struct blockif_elem *be;
+	int prio, q;
+
+	prio = breq->prio;
+	if (prio == BLOCKIF_PRIO_NONE || thr->prio == BLOCKIF_PRIO_RT)
+		prio = thr->prio;
+
+	/* a flush only covers writes that have already completed */
+	if (op == BOP_FLUSH)
+		return 0;
+
+	blockif_tb_refill(thr, blockif_now());
+	q = (prio == BLOCKIF_PRIO_IDLE) ? 1 : 0;
+	if (prio == BLOCKIF_PRIO_RT ||
+	    (TAILQ_EMPTY(&thr->q[0]) && (q == 0 || TAILQ_EMPTY(&thr->q[1])) &&
+	     blockif_tb_wait(thr, op) == 0)) {
+		blockif_tb_charge(thr, op, breq->resid);
+		return 0;
+	}
+
+	be = TAILQ_FIRST(&bc->freeq);
+	assert(be->status == BST_FREE);
+	TAILQ_REMOVE(&bc->freeq, be, link);
+	be->req = breq;
+	be->op = op;
+	be->status = BST_THROTTLED;
+	be->t_enq = blockif_now();
+	TAILQ_INSERT_TAIL(&thr->q[q], be, link);
+	__atomic_fetch_add(&thr->delayed, 1, __ATOMIC_RELAXED);
+
+	/* the first one held back starts the timer */
+	if (TAILQ_FIRST(&thr->q[0]) == be ||
+	    (TAILQ_EMPTY(&thr->q[0]) && TAILQ_FIRST(&thr->q[1]) == be))
+		blockif_throttle_release(bc);
+	return 1;
+}
+
+static int
+blockif_throttle_init(struct blockif_ctxt *bc, const uint64_t *limit,
+		      long burst_ms, int prio)
+{
+	struct blockif_throttle *thr;
+	int i;
+
+	thr = calloc(1, sizeof(struct blockif_throttle));
+	if (thr == NULL)
+		return -1;
+	if (acrn_timer_init(&thr->timer, blockif_throttle_timer, bc) < 0) {
+		free(thr);
+		return -1;
+	}
+
+	for (i = 0; i < BLOCKIF_TB_MAX; i++) {
+		thr->tb[i].rate = limit[i];
+		thr->tb[i].burst = limit[i] * burst_ms * 1000000UL;
+		thr->tb[i].level = thr->tb[i].burst;
+	}
+	thr->last = blockif_now();
+	thr->prio = (prio == BLOCKIF_PRIO_NONE) ? BLOCKIF_PRIO_BE : prio;
+	TAILQ_INIT(&thr->q[0]);
+	TAILQ_INIT(&thr->q[1]);
+	bc->thr = thr;
+	return 0;
+}
 
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
 {
-	char tname[MAXCOMLEN + 1];
+	char tname[MAXCOMLEN + 1], mname[32];
 	/* char name[MAXPATHLEN]; */
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
-	int extra, fd, i, sectsz;
+	int extra, fd, i, sectsz, dsectsz;
 	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
 	long sz;
 	long long b;
 	int err_code = -1;
 	off_t sub_file_start_lba, sub_file_size;
 	int sub_file_assign;
-
-	pthread_once(&blockif_once, blockif_init);
+	enum blockif_engine engine;
+	int nthr, nreq, cpu_lo, cpu_hi;
+	struct qcow2 *qc = NULL;
+	long cache_mb, ra_kb;
+	uint64_t limit[BLOCKIF_TB_MAX];
+	long burst_ms;
+	int prio;
 
 	fd = -1;
 	ssopt = 0;
@@ -483,6 +1608,15 @@ blockif_open(const char *optstr, const char *ident)
 	sync = 0;
 	ro = 0;
 	sub_file_assign = 0;
+	engine = BLOCKIF_ENGINE_THREAD;
+	nthr = BLOCKIF_NUMTHR;
+	nreq = BLOCKIF_MAXREQ;
+	cpu_lo = cpu_hi = -1;
+	cache_mb = 0;
+	ra_kb = 0;
+	memset(limit, 0, sizeof(limit));
+	burst_ms = 100;
+	prio = BLOCKIF_PRIO_NONE;
 
 	/*
 	 * The first element in the optstring is always a pathname.
@@ -510,12 +1644,92 @@ blockif_open(const char *optstr, const char *ident)
 		else if (sscanf(cp, "range=%ld/%ld", &sub_file_start_lba,
 				&sub_file_size) == 2)
 			sub_file_assign = 1;
-		else {
+		else if (!strcmp(cp, "engine=thread"))
+			engine = BLOCKIF_ENGINE_THREAD;
+		else if (!strcmp(cp, "engine=io_uring"))
+			engine = BLOCKIF_ENGINE_URING;
+		else if (!strcmp(cp, "engine=aio"))
+			engine = BLOCKIF_ENGINE_AIO;
+		else if (sscanf(cp, "workers=%d", &nthr) == 1) {
+			if (nthr < 1 || nthr > BLOCKIF_NUMTHR_MAX) {
+				fprintf(stderr, "Invalid worker count %d\n",
+					nthr);
+				goto err;
+			}
+		} else if (sscanf(cp, "queue=%d", &nreq) == 1) {
+			if (nreq < 1 || nreq >= BLOCKIF_MAXREQ_MAX) {
+				fprintf(stderr, "Invalid queue depth %d\n",
+					nreq);
+				goto err;
+			}
+			/* one element is kept back, see blockif_queuesz() */
+			nreq++;
+		} else if (!strncmp(cp, "stats=", 6)) {
+			WPRINTF(("blockif: stats= is gone, see monitor "
+				 "source blockif.%s\n", ident));
+		} else if (sscanf(cp, "cache=%ld", &cache_mb) == 1) {
+			if (cache_mb <= 0) {
+				fprintf(stderr, "Invalid cache size %ld\n",
+					cache_mb);
+				goto err;
+			}
+		} else if (sscanf(cp, "iops=%lu", &limit[0]) == 1) {
+			limit[BLOCKIF_TB_IOPS_WR] = limit[0];
+		} else if (sscanf(cp, "bps=%lu", &limit[2]) == 1) {
+			limit[BLOCKIF_TB_BPS_WR] = limit[2];
+		} else if (sscanf(cp, "iops_rd=%lu",
+				  &limit[BLOCKIF_TB_IOPS_RD]) == 1 ||
+			   sscanf(cp, "iops_wr=%lu",
+				  &limit[BLOCKIF_TB_IOPS_WR]) == 1 ||
+			   sscanf(cp, "bps_rd=%lu",
+				  &limit[BLOCKIF_TB_BPS_RD]) == 1 ||
+			   sscanf(cp, "bps_wr=%lu",
+				  &limit[BLOCKIF_TB_BPS_WR]) == 1) {
+			;
+		} else if (sscanf(cp, "burst=%ld", &burst_ms) == 1) {
+			if (burst_ms <= 0 || burst_ms > 10000) {
+				fprintf(stderr, "Invalid burst %ld ms\n",
+					burst_ms);
+				goto err;
+			}
+		} else if (!strcmp(cp, "prio=rt")) {
+			prio = BLOCKIF_PRIO_RT;
+		} else if (!strcmp(cp, "prio=be")) {
+			prio = BLOCKIF_PRIO_BE;
+		} else if (!strcmp(cp, "prio=idle")) {
+			prio = BLOCKIF_PRIO_IDLE;
+		} else if (sscanf(cp, "readahead=%ld", &ra_kb) == 1) {
+			if (ra_kb <= 0) {
+				fprintf(stderr, "Invalid readahead size %ld\n",
+					ra_kb);
+				goto err;
+			}
+		} else if (sscanf(cp, "affinity=%d-%d", &cpu_lo,
+				  &cpu_hi) == 2 ||
+			   sscanf(cp, "affinity=%d", &cpu_lo) == 1) {
+			if (cpu_hi < 0)
+				cpu_hi = cpu_lo;
+			if (cpu_lo < 0 || cpu_hi < cpu_lo ||
+			    cpu_hi >= CPU_SETSIZE) {
+				fprintf(stderr, "Invalid affinity \"%s\"\n",
+					cp + 9);
+				goto err;
+			}
+		} else {
 			fprintf(stderr, "Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
 	}
 
+	for (i = 0; i < BLOCKIF_TB_MAX; i++) {
+		/* a full bucket is kept in billionths */
+		if (limit[i] > INT64_MAX / (burst_ms * 1000000UL)) {
+			fprintf(stderr, "Throttle limit %lu is too high\n",
+				limit[i]);
+			goto err;
+		}
+	}
+
 	/* enforce a write-through policy by default */
 	nocache = 1;
 	sync = 1;
@@ -543,11 +1757,35 @@ blockif_open(const char *optstr, const char *ident)
 		goto err;
 	}
 
+	/*
+	 * qcow2 metadata is read and written in small pieces, so the
+	 * image is reopened without O_DIRECT, and always driven by the
+	 * worker threads.
+	 */
+	if (S_ISREG(sbuf.st_mode) && qcow2_probe(nopt)) {
+		if (sub_file_assign) {
+			fprintf(stderr, "range is not supported on qcow2\n");
+			goto err;
+		}
+		close(fd);
+		fd = -1;
+		qc = qcow2_open(nopt, ro, extra & ~O_DIRECT);
+		if (qc == NULL) {
+			fprintf(stderr, "Could not open qcow2 image %s\n",
+				nopt);
+			goto err;
+		}
+		fd = qcow2_fd(qc);
+		if (engine != BLOCKIF_ENGINE_THREAD)
+			WPRINTF(("blockif: qcow2 needs the thread engine\n"));
+		engine = BLOCKIF_ENGINE_THREAD;
+	}
+
 	/*
 	 * Deal with raw devices
 	 */
 	size = sbuf.st_size;
-	sectsz = DEV_BSIZE;
+	dsectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
 	candelete = geom = 0;
 
@@ -570,9 +1808,14 @@ blockif_open(const char *optstr, const char *ident)
 		}
 		DPRINTF(("block partition size is 0x%lx\n", size));
 
-		/* get sector size, 512 on Linux */
-		sectsz = DEV_BSIZE;
-		DPRINTF(("block partition sector size is 0x%x\n", sectsz));
+		/* get logical sector size, 4096 on a 4Kn disk */
+		err_code = ioctl(fd, BLKSSZGET, &dsectsz);
+		if (err_code || dsectsz < DEV_BSIZE || !powerof2(dsectsz)) {
+			fprintf(stderr, "error %d getting sectsz!\n",
+				err_code);
+			dsectsz = DEV_BSIZE;
+		}
+		DPRINTF(("block partition sector size is 0x%x\n", dsectsz));
 
 		/* get physical sector size */
 		err_code = ioctl(fd, BLKPBSZGET, &psectsz);
@@ -584,8 +1827,17 @@ blockif_open(const char *optstr, const char *ident)
 		DPRINTF(("block partition physical sector size is 0x%lx\n",
 			 psectsz));
 
-	} else
+		candelete = blockif_probe_discard(&sbuf);
+	} else {
 		psectsz = sbuf.st_blksize;
+		/* holes can be punched in image files on most filesystems */
+		candelete = S_ISREG(sbuf.st_mode);
+	}
+	if (ro || qc)
+		candelete = 0;
+	sectsz = dsectsz;
+	if (qc)
+		size = qcow2_size(qc);
 
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
@@ -602,7 +1854,7 @@ blockif_open(const char *optstr, const char *ident)
 		 * Validate that the emulated sector size complies with this
 		 * requirement.
 		 */
-		if (S_ISCHR(sbuf.st_mode)) {
+		if (S_ISCHR(sbuf.st_mode) || S_ISBLK(sbuf.st_mode)) {
 			if (ssopt < sectsz || (ssopt % sectsz) != 0) {
 				fprintf(stderr,
 				"Sector size %d incompatible with underlying device sector size %d\n",
@@ -622,6 +1874,14 @@ blockif_open(const char *optstr, const char *ident)
 		goto err;
 	}
 
+	bc->nreq = nreq;
+	bc->reqs = calloc(nreq, sizeof(struct blockif_elem));
+	if (bc->reqs == NULL) {
+		perror("calloc");
+		free(bc);
+		goto err;
+	}
+
 	if (sub_file_assign) {
 		DPRINTF(("sector size is %d\n", sectsz));
 		bc->sub_file_assign = 1;
@@ -645,7 +1905,23 @@ blockif_open(const char *optstr, const char *ident)
 	bc->fd = fd;
 	bc->isblk = S_ISBLK(sbuf.st_mode);
 	bc->isgeom = geom;
+	/* O_DIRECT wants buffers, lengths and offsets in device sectors */
+	bc->align = dsectsz;
 	bc->candelete = candelete;
+	bc->qcow = qc;
+	snprintf(bc->ident, sizeof(bc->ident), "%s", ident);
+
+	/*
+	 * Only an image nobody writes can be cached across processes:
+	 * this DM has it read-only, and the deployment promises the rest.
+	 */
+	if (cache_mb > 0 && (!ro || qc))
+		WPRINTF(("blockif: cache= needs a read-only raw image\n"));
+	else if (cache_mb > 0) {
+		bc->cache = bcache_open(fd, (size_t)cache_mb << 20);
+		if (bc->cache == NULL)
+			WPRINTF(("blockif: running without the read cache\n"));
+	}
 	bc->rdonly = ro;
 	bc->size = size;
 	bc->sectsz = sectsz;
@@ -653,23 +1929,85 @@ blockif_open(const char *optstr, const char *ident)
 	bc->psectoff = psectoff;
 	pthread_mutex_init(&bc->mtx, NULL);
 	pthread_cond_init(&bc->cond, NULL);
+	pthread_mutex_init(&bc->flush_mtx, NULL);
+	pthread_cond_init(&bc->flush_cond, NULL);
 	TAILQ_INIT(&bc->freeq);
 	TAILQ_INIT(&bc->pendq);
 	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+	for (i = 0; i < bc->nreq; i++) {
 		bc->reqs[i].status = BST_FREE;
 		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
+	bc->engine = engine;
+	bc->ring.fd = -1;
+	if (engine == BLOCKIF_ENGINE_URING &&
+	    blockif_uring_init(&bc->ring, bc->nreq) < 0) {
+		WPRINTF(("blockif: io_uring unavailable, using threads\n"));
+		bc->engine = BLOCKIF_ENGINE_THREAD;
+	}
+	bc->aio.efd = -1;
+	if (engine == BLOCKIF_ENGINE_AIO && blockif_aio_init(bc) < 0) {
+		WPRINTF(("blockif: native aio unavailable, using threads\n"));
+		bc->engine = BLOCKIF_ENGINE_THREAD;
+	}
+
+	/*
+	 * Raw images are read O_DIRECT, which leaves readahead to us; a
+	 * qcow2 image goes through the page cache and only needs a hint.
+	 */
+	if (ra_kb > 0 && qc)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	else if (ra_kb > 0 && (bc->engine != BLOCKIF_ENGINE_THREAD ||
+			       bc->cache))
+		WPRINTF(("blockif: readahead= needs engine=thread, "
+			 "without cache=\n"));
+	else if (ra_kb > 0) {
+		snprintf(tname, sizeof(tname), "blk-%s-ra", ident);
+		bc->ra = bra_open(fd, bc->sub_file_start_lba + size,
+				  (size_t)ra_kb << 10, bc->align, tname);
+	}
+
+	for (i = 0; i < BLOCKIF_TB_MAX; i++) {
+		if (limit[i])
+			break;
+	}
+	if (i < BLOCKIF_TB_MAX && blockif_throttle_init(bc, limit, burst_ms,
+							 prio) < 0)
+		WPRINTF(("blockif: running without throttling\n"));
+
+	/* one worker is left for requests the async engines can't take */
+	bc->nthr = (bc->engine == BLOCKIF_ENGINE_THREAD) ? nthr : 1;
+
+	CPU_ZERO(&bc->cpuset);
+	if (cpu_lo >= 0) {
+		for (i = cpu_lo; i <= cpu_hi; i++)
+			CPU_SET(i, &bc->cpuset);
+		bc->pinned = 1;
+	}
+
+	for (i = 0; i < bc->nthr; i++) {
 		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
 		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
 		pthread_setname_np(bc->btid[i], tname);
+		blockif_pin(bc, bc->btid[i]);
+	}
+
+	if (bc->engine == BLOCKIF_ENGINE_URING) {
+		pthread_create(&bc->ring.tid, NULL, blockif_uring_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-uring", ident);
+		pthread_setname_np(bc->ring.tid, tname);
+		blockif_pin(bc, bc->ring.tid);
 	}
 
+	snprintf(mname, sizeof(mname), "blockif.%s", ident);
+	monitor_register(mname, blockif_monitor_dump, bc);
+
 	return bc;
 err:
-	if (fd >= 0)
+	if (qc)
+		qcow2_close(qc);
+	else if (fd >= 0)
 		close(fd);
 	return NULL;
 }
@@ -684,12 +2022,10 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 
 	pthread_mutex_lock(&bc->mtx);
 	if (!TAILQ_EMPTY(&bc->freeq)) {
-		/*
-		 * Enqueue and inform the block i/o thread
-		 * that there is work available
-		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		/* the throttle timer is gone once closing is set */
+		if (bc->thr == NULL || bc->closing ||
+		    !blockif_throttle(bc, breq, op))
+			blockif_dispatch(bc, breq, op);
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -704,6 +2040,39 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 	return err;
 }
 
+/*
+ * Hold back submission of the requests that follow until the matching
+ * blockif_unplug(), so that a burst can be submitted in one go. Only
+ * the async engines batch; for the thread engine these do nothing.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+
+	if (bc->engine == BLOCKIF_ENGINE_THREAD)
+		return;
+
+	pthread_mutex_lock(&bc->mtx);
+	bc->plugged++;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+
+	if (bc->engine == BLOCKIF_ENGINE_THREAD)
+		return;
+
+	pthread_mutex_lock(&bc->mtx);
+	assert(bc->plugged > 0);
+	if (--bc->plugged == 0)
+		blockif_async_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+}
+
 int
 blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
@@ -732,14 +2101,41 @@ blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DELETE);
 }
 
+int
+blockif_write_zeroes(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	return blockif_request(bc, breq, BOP_WRITE_ZEROES);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
 	struct blockif_elem *be;
+	struct io_event ev;
+	int i;
 
 	assert(bc->magic == BLOCKIF_SIG);
 
 	pthread_mutex_lock(&bc->mtx);
+	/*
+	 * Check requests held back by the throttle, which never started.
+	 */
+	for (i = 0; bc->thr != NULL && i < 2; i++) {
+		TAILQ_FOREACH(be, &bc->thr->q[i], link) {
+			if (be->req == breq)
+				break;
+		}
+		if (be != NULL) {
+			TAILQ_REMOVE(&bc->thr->q[i], be, link);
+			be->status = BST_FREE;
+			be->req = NULL;
+			TAILQ_INSERT_TAIL(&bc->freeq, be, link);
+			pthread_mutex_unlock(&bc->mtx);
+			return 0;
+		}
+	}
+
 	/*
 	 * Check pending requests.
 	 */
@@ -773,45 +2169,44 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 	}
 
 	/*
-	 * Interrupt the processing thread to force it return
-	 * prematurely via it's normal callback path.
+	 * Requests owned by an async engine have no thread to interrupt:
+	 * ask the kernel to cancel them. Their callback still runs when
+	 * the kernel is done with them, with ECANCELED if it got there
+	 * first.
 	 */
-	while (be->status == BST_BUSY) {
-		struct blockif_sig_elem bse, *old_head;
-
-		pthread_mutex_init(&bse.mtx, NULL);
-		pthread_cond_init(&bse.cond, NULL);
-
-		bse.pending = 1;
-
-		do {
-			old_head = blockif_bse_head;
-			bse.next = old_head;
-		} while (!__sync_bool_compare_and_swap((uintptr_t *)&
-							blockif_bse_head,
-					    (uintptr_t)old_head,
-					    (uintptr_t)&bse));
-
-		pthread_kill(be->tid, SIGCONT);
-
-		pthread_mutex_lock(&bse.mtx);
-		while (bse.pending)
-			pthread_cond_wait(&bse.cond, &bse.mtx);
-		pthread_mutex_unlock(&bse.mtx);
+	if (be->tid == 0) {
+		if (bc->engine == BLOCKIF_ENGINE_URING)
+			blockif_uring_cancel(bc, be);
+		else if (bc->engine == BLOCKIF_ENGINE_AIO &&
+			 io_cancel(bc->aio.ctx, &be->iocb, &ev) == 0) {
+			/*
+			 * Old kernels hand the result back here rather
+			 * than queueing an event: it is done, no callback.
+			 */
+			blockif_account(bc, be, ECANCELED);
+			be->status = BST_DONE;
+			blockif_complete(bc, be);
+			pthread_mutex_unlock(&bc->mtx);
+			return 0;
+		}
+		pthread_mutex_unlock(&bc->mtx);
+		return -EBUSY;
 	}
 
-	pthread_mutex_unlock(&bc->mtx);
-
 	/*
-	 * The processing thread has been interrupted.  Since it's not
-	 * clear if the callback has been invoked yet, return EBUSY.
+	 * A worker's preadv/pwritev on a disk or image file can't be cut
+	 * short. Don't wait for it either: the request completes through
+	 * its callback as usual once it's over, so a port reset doesn't
+	 * sit here for the I/O to finish.
 	 */
+	pthread_mutex_unlock(&bc->mtx);
 	return -EBUSY;
 }
 
 int
 blockif_close(struct blockif_ctxt *bc)
 {
+	struct blockif_elem *be;
 	void *jval;
 	int i;
 
@@ -819,22 +2214,67 @@ blockif_close(struct blockif_ctxt *bc)
 	sub_file_unlock(bc);
 
 	/*
-	 * Stop the block i/o thread
+	 * Stop the throttle first, then let out what it still holds so
+	 * that the engines complete it before they are stopped.
 	 */
+	if (bc->thr)
+		acrn_timer_deinit(&bc->thr->timer);
 	pthread_mutex_lock(&bc->mtx);
+	for (i = 0; bc->thr != NULL && i < 2; i++) {
+		while ((be = TAILQ_FIRST(&bc->thr->q[i])) != NULL) {
+			TAILQ_REMOVE(&bc->thr->q[i], be, link);
+			be->status = BST_FREE;
+			TAILQ_INSERT_HEAD(&bc->freeq, be, link);
+			blockif_dispatch(bc, be->req, be->op);
+		}
+	}
+
+	/*
+	 * Stop the block i/o thread
+	 */
 	bc->closing = 1;
 	pthread_mutex_unlock(&bc->mtx);
 	pthread_cond_broadcast(&bc->cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+	for (i = 0; i < bc->nthr; i++)
 		pthread_join(bc->btid[i], &jval);
 
+	if (bc->engine == BLOCKIF_ENGINE_URING) {
+		struct io_uring_sqe *sqe;
+
+		/* a NOP without an element tells the reaper to exit */
+		pthread_mutex_lock(&bc->mtx);
+		bc->plugged = 0;
+		sqe = &bc->ring.sqes[bc->ring.sq_tail_local++ &
+				     bc->ring.sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_NOP;
+		sqe->flags = IOSQE_IO_DRAIN;
+		bc->ring.to_submit++;
+		blockif_uring_submit(bc);
+		pthread_mutex_unlock(&bc->mtx);
+
+		pthread_join(bc->ring.tid, &jval);
+		blockif_uring_deinit(&bc->ring);
+	} else if (bc->engine == BLOCKIF_ENGINE_AIO)
+		blockif_aio_deinit(bc);
+
 	/* XXX Cancel queued i/o's ??? */
 
 	/*
 	 * Release resources
 	 */
 	bc->magic = 0;
-	close(bc->fd);
+	monitor_unregister(bc);
+	if (bc->cache)
+		bcache_close(bc->cache);
+	if (bc->ra)
+		bra_close(bc->ra);
+	free(bc->thr);
+	if (bc->qcow)
+		qcow2_close(bc->qcow);
+	else
+		close(bc->fd);
+	free(bc->reqs);
 	free(bc);
 
 	return 0;
@@ -918,7 +2358,7 @@ int
 blockif_queuesz(struct blockif_ctxt *bc)
 {
 	assert(bc->magic == BLOCKIF_SIG);
-	return (BLOCKIF_MAXREQ - 1);
+	return (bc->nreq - 1);
 }
 
 int
@@ -934,3 +2374,31 @@ blockif_candelete(struct blockif_ctxt *bc)
 	assert(bc->magic == BLOCKIF_SIG);
 	return bc->candelete;
 }
+
+/*
+ * Nonzero if the context keeps state about the image that another
+ * context on the same file would not see: qcow2 metadata, readahead
+ * buffers or a throttle budget. Such an image can't be split across
+ * several contexts.
+ */
+int
+blockif_private(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	return bc->qcow != NULL || bc->ra != NULL || bc->thr != NULL;
+}
+
+/*
+ * The image fd, for a consumer that drives it directly; -1 if requests
+ * can't bypass blockif: qcow2, the read cache, readahead or a sub-file
+ * range.
+ */
+int
+blockif_fd(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	if (bc->qcow != NULL || bc->cache != NULL || bc->ra != NULL ||
+	    bc->sub_file_assign)
+		return -1;
+	return bc->fd;
+}
@@ -0,0 +1,846 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * qcow2 image driver used by block_if.
+ *
+ * Guest reads walk the L1/L2 cluster map; clusters never written read
+ * through to the backing file, or as zeroes. Writes to such clusters
+ * allocate a new one at the end of the image, filling the rest of it
+ * from the backing file first, then link it into the map. New clusters
+ * are always added with a refcount of 1, which keeps the image valid
+ * for qemu-img as long as it has no internal snapshots; images that do
+ * can only be opened read-only.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_qcow2.h"
+#include "monitor.h"
+
+static int qcow2_debug;
+MONITOR_DEBUG(qcow2, qcow2_debug);
+#define DPRINTF(params) do { if (qcow2_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+#define QCOW2_MAGIC		0x514649fb	/* "QFI\xfb" */
+#define QCOW2_MIN_CLUSTER_BITS	9
+#define QCOW2_MAX_CLUSTER_BITS	21
+#define QCOW2_AUTOCLEAR_OFFSET	88	/* of autoclear_features */
+#define QCOW2_MAX_BACKING	8	/* longest backing file chain */
+#define QCOW2_L2_CACHE		32	/* L2 tables kept in memory */
+#define QCOW2_IOV_MAX		64
+
+#define QCOW2_OFLAG_COPIED	(1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	(1ULL << 0)	/* v3: reads as zeroes */
+#define QCOW2_OFFSET_MASK	0x00fffffffffffe00ULL
+
+struct qcow2_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t backing_file_offset;
+	uint32_t backing_file_size;
+	uint32_t cluster_bits;
+	uint64_t size;
+	uint32_t crypt_method;
+	uint32_t l1_size;
+	uint64_t l1_table_offset;
+	uint64_t refcount_table_offset;
+	uint32_t refcount_table_clusters;
+	uint32_t nb_snapshots;
+	uint64_t snapshots_offset;
+	/* version 3 only */
+	uint64_t incompatible_features;
+	uint64_t compatible_features;
+	uint64_t autoclear_features;
+	uint32_t refcount_order;
+	uint32_t header_length;
+} __attribute__((packed));
+
+struct qcow2_l2 {
+	uint64_t	offset;		/* of the table in the image, 0 if free */
+	uint64_t	lru;
+	uint64_t	*table;		/* big endian, as on disk */
+};
+
+struct qcow2 {
+	int		fd;
+	int		ro;
+	pthread_mutex_t	mtx;		/* metadata, and all writes */
+	uint32_t	cluster_bits;
+	uint64_t	cluster_size;
+	uint32_t	l2_bits;	/* log2 of entries per L2 table */
+	uint64_t	size;		/* guest visible */
+
+	uint64_t	*l1;		/* big endian, as on disk */
+	uint32_t	l1_size;
+	uint64_t	l1_offset;
+
+	uint64_t	*rct;		/* refcount table, big endian */
+	uint64_t	rct_size;
+	uint64_t	rct_offset;
+	uint32_t	rb_bits;	/* log2 of refcounts per block */
+	uint64_t	file_end;	/* where the next cluster goes */
+
+	struct qcow2_l2	l2[QCOW2_L2_CACHE];
+	uint64_t	lru;
+	uint8_t		*cbuf;		/* one cluster, for copy-on-write */
+
+	struct qcow2	*backing;	/* qcow2 backing file, or */
+	int		backing_fd;	/* raw backing file, or -1 */
+};
+
+static struct qcow2 *qcow2_open_chain(const char *path, int ro, int flags,
+				      int depth);
+
+static int
+qcow2_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0) {
+			/* past the end of the file reads as zeroes */
+			memset(buf, 0, len);
+			break;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+qcow2_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0)
+			return -EIO;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Point dst at the bytes [skip, skip + len) of src */
+static int
+qcow2_iov_slice(const struct iovec *src, int cnt, size_t skip, size_t len,
+		struct iovec *dst)
+{
+	size_t l;
+	int i, n = 0;
+
+	for (i = 0; i < cnt && len > 0; i++) {
+		if (skip >= src[i].iov_len) {
+			skip -= src[i].iov_len;
+			continue;
+		}
+		l = MIN(src[i].iov_len - skip, len);
+		dst[n].iov_base = (uint8_t *)src[i].iov_base + skip;
+		dst[n].iov_len = l;
+		n++;
+		len -= l;
+		skip = 0;
+	}
+	return n;
+}
+
+static void
+qcow2_iov_zero(const struct iovec *iov, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+}
+
+static void
+qcow2_iov_copy(const struct iovec *iov, int cnt, uint8_t *buf)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+}
+
+static int
+qcow2_preadv(int fd, const struct iovec *iov, int cnt, size_t len, off_t off)
+{
+	struct iovec rest[QCOW2_IOV_MAX];
+	size_t done = 0;
+	ssize_t n;
+	int rcnt;
+
+	rcnt = qcow2_iov_slice(iov, cnt, 0, len, rest);
+	while (done < len) {
+		n = preadv(fd, rest, rcnt, off + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0) {
+			qcow2_iov_zero(rest, rcnt);
+			break;
+		}
+		done += n;
+		rcnt = qcow2_iov_slice(iov, cnt, done, len - done, rest);
+	}
+	return 0;
+}
+
+static int
+qcow2_pwritev(int fd, const struct iovec *iov, int cnt, size_t len, off_t off)
+{
+	struct iovec rest[QCOW2_IOV_MAX];
+	size_t done = 0;
+	ssize_t n;
+	int rcnt;
+
+	rcnt = qcow2_iov_slice(iov, cnt, 0, len, rest);
+	while (done < len) {
+		n = pwritev(fd, rest, rcnt, off + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0)
+			return -EIO;
+		done += n;
+		rcnt = qcow2_iov_slice(iov, cnt, done, len - done, rest);
+	}
+	return 0;
+}
+
+/*
+ * Find the cached L2 table at offset, or evict the least recently used
+ * one for it. With load set the table is read in, otherwise zeroed.
+ */
+static uint64_t *
+qcow2_l2_get(struct qcow2 *qc, uint64_t offset, int load, int *err)
+{
+	struct qcow2_l2 *l2, *victim = NULL;
+	int i;
+
+	for (i = 0; i < QCOW2_L2_CACHE; i++) {
+		l2 = &qc->l2[i];
+		if (l2->offset == offset) {
+			l2->lru = ++qc->lru;
+			return l2->table;
+		}
+		if (victim == NULL || l2->lru < victim->lru)
+			victim = l2;
+	}
+
+	if (victim->table == NULL) {
+		victim->table = malloc(qc->cluster_size);
+		if (victim->table == NULL) {
+			*err = -ENOMEM;
+			return NULL;
+		}
+	}
+
+	victim->offset = 0;
+	if (load)
+		*err = qcow2_pread(qc->fd, victim->table, qc->cluster_size,
+				   offset);
+	else {
+		memset(victim->table, 0, qc->cluster_size);
+		*err = 0;
+	}
+	if (*err)
+		return NULL;
+
+	victim->offset = offset;
+	victim->lru = ++qc->lru;
+	return victim->table;
+}
+
+/* Called with qc->mtx held. Returns 0, or the L2 entry of offset */
+static int
+qcow2_lookup(struct qcow2 *qc, uint64_t offset, uint64_t *entry)
+{
+	uint64_t l1i, l2i, l2off, *table;
+	int err;
+
+	*entry = 0;
+	l1i = offset >> (qc->cluster_bits + qc->l2_bits);
+	l2i = (offset >> qc->cluster_bits) & ((1ULL << qc->l2_bits) - 1);
+	if (l1i >= qc->l1_size)
+		return 0;
+
+	l2off = be64toh(qc->l1[l1i]) & QCOW2_OFFSET_MASK;
+	if (l2off == 0)
+		return 0;
+
+	table = qcow2_l2_get(qc, l2off, 1, &err);
+	if (table == NULL)
+		return err;
+
+	*entry = be64toh(table[l2i]);
+	return 0;
+}
+
+/* Set the refcount of the (new) cluster at offset to 1 */
+static int
+qcow2_set_refcount(struct qcow2 *qc, uint64_t offset)
+{
+	uint64_t cluster, idx, rb, self;
+	uint16_t one = htobe16(1);
+	uint16_t *block;
+	int err;
+
+	cluster = offset >> qc->cluster_bits;
+	idx = cluster >> qc->rb_bits;
+	if (idx >= qc->rct_size)
+		return -ENOSPC;	/* growing the refcount table isn't done */
+
+	rb = be64toh(qc->rct[idx]) & QCOW2_OFFSET_MASK;
+	if (rb == 0) {
+		rb = qc->file_end;
+		qc->file_end += qc->cluster_size;
+		self = rb >> qc->cluster_bits;
+
+		block = calloc(1, qc->cluster_size);
+		if (block == NULL)
+			return -ENOMEM;
+		/* the new refcount block usually covers itself */
+		if ((self >> qc->rb_bits) == idx)
+			block[self & ((1ULL << qc->rb_bits) - 1)] = one;
+		err = qcow2_pwrite(qc->fd, block, qc->cluster_size, rb);
+		free(block);
+		if (err)
+			return err;
+
+		qc->rct[idx] = htobe64(rb);
+		err = qcow2_pwrite(qc->fd, &qc->rct[idx], sizeof(uint64_t),
+				   qc->rct_offset + idx * sizeof(uint64_t));
+		if (err)
+			return err;
+
+		if ((self >> qc->rb_bits) != idx) {
+			err = qcow2_set_refcount(qc, rb);
+			if (err)
+				return err;
+		}
+	}
+
+	return qcow2_pwrite(qc->fd, &one, sizeof(one), rb +
+			    (cluster & ((1ULL << qc->rb_bits) - 1)) *
+			    sizeof(one));
+}
+
+static int
+qcow2_alloc_cluster(struct qcow2 *qc, uint64_t *offset)
+{
+	*offset = qc->file_end;
+	qc->file_end += qc->cluster_size;
+	return qcow2_set_refcount(qc, *offset);
+}
+
+/*
+ * Read the unallocated guest range at offset from the backing file,
+ * or as zeroes without one.
+ */
+static int
+qcow2_read_backing(struct qcow2 *qc, const struct iovec *iov, int cnt,
+		   size_t len, uint64_t offset)
+{
+	if (qc->backing != NULL) {
+		if (qcow2_readv(qc->backing, iov, cnt, offset) < 0)
+			return -errno;
+		return 0;
+	}
+	if (qc->backing_fd >= 0)
+		return qcow2_preadv(qc->backing_fd, iov, cnt, len, offset);
+
+	qcow2_iov_zero(iov, cnt);
+	return 0;
+}
+
+ssize_t
+qcow2_readv(struct qcow2 *qc, const struct iovec *iov, int iovcnt,
+	    off_t offset)
+{
+	struct iovec slice[QCOW2_IOV_MAX];
+	uint64_t off, coff, entry, host;
+	size_t total, done, len;
+	int i, n, err;
+
+	if (iovcnt > QCOW2_IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	/* one cluster at a time, each may live somewhere else */
+	for (done = 0; done < total; done += len) {
+		off = offset + done;
+		coff = off & (qc->cluster_size - 1);
+		len = MIN(qc->cluster_size - coff, total - done);
+		n = qcow2_iov_slice(iov, iovcnt, done, len, slice);
+
+		if (off >= qc->size) {
+			qcow2_iov_zero(slice, n);
+			continue;
+		}
+
+		pthread_mutex_lock(&qc->mtx);
+		err = qcow2_lookup(qc, off, &entry);
+		pthread_mutex_unlock(&qc->mtx);
+		host = entry & QCOW2_OFFSET_MASK;
+
+		if (err == 0 && (entry & QCOW2_OFLAG_COMPRESSED))
+			err = -EOPNOTSUPP;
+		else if (err == 0 && (entry & QCOW2_OFLAG_ZERO))
+			qcow2_iov_zero(slice, n);
+		else if (err == 0 && host != 0)
+			err = qcow2_preadv(qc->fd, slice, n, len, host + coff);
+		else if (err == 0)
+			err = qcow2_read_backing(qc, slice, n, len, off);
+
+		if (err) {
+			errno = -err;
+			return -1;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Called with qc->mtx held. Return the L2 table, allocating an empty
+ * one, that maps the guest offset.
+ */
+static uint64_t *
+qcow2_l2_for_write(struct qcow2 *qc, uint64_t offset, uint64_t *l2offp,
+		   int *err)
+{
+	uint64_t l1i, l2off, *table;
+
+	l1i = offset >> (qc->cluster_bits + qc->l2_bits);
+	if (l1i >= qc->l1_size) {
+		*err = -EINVAL;
+		return NULL;
+	}
+
+	l2off = be64toh(qc->l1[l1i]) & QCOW2_OFFSET_MASK;
+	if (l2off != 0) {
+		*l2offp = l2off;
+		return qcow2_l2_get(qc, l2off, 1, err);
+	}
+
+	/* the new table must be on disk before the L1 points at it */
+	*err = qcow2_alloc_cluster(qc, &l2off);
+	if (*err)
+		return NULL;
+	table = qcow2_l2_get(qc, l2off, 0, err);
+	if (table == NULL)
+		return NULL;
+	*err = qcow2_pwrite(qc->fd, table, qc->cluster_size, l2off);
+	if (*err)
+		return NULL;
+
+	qc->l1[l1i] = htobe64(l2off | QCOW2_OFLAG_COPIED);
+	*err = qcow2_pwrite(qc->fd, &qc->l1[l1i], sizeof(uint64_t),
+			    qc->l1_offset + l1i * sizeof(uint64_t));
+	if (*err)
+		return NULL;
+
+	*l2offp = l2off;
+	return table;
+}
+
+/* Called with qc->mtx held, for a range within one cluster */
+static int
+qcow2_write_cluster(struct qcow2 *qc, const struct iovec *iov, int cnt,
+		    size_t len, uint64_t offset)
+{
+	struct iovec base;
+	uint64_t coff, l2i, l2off, entry, host, *table;
+	int err;
+
+	coff = offset & (qc->cluster_size - 1);
+	l2i = (offset >> qc->cluster_bits) & ((1ULL << qc->l2_bits) - 1);
+
+	table = qcow2_l2_for_write(qc, offset, &l2off, &err);
+	if (table == NULL)
+		return err;
+
+	entry = be64toh(table[l2i]);
+	host = entry & QCOW2_OFFSET_MASK;
+	if (entry & QCOW2_OFLAG_COMPRESSED)
+		return -EOPNOTSUPP;
+
+	/* without snapshots, every allocated cluster is ours alone */
+	if (host != 0 && !(entry & QCOW2_OFLAG_ZERO))
+		return qcow2_pwritev(qc->fd, iov, cnt, len, host + coff);
+
+	/* the data must be on disk before the L2 entry points at it */
+	err = qcow2_alloc_cluster(qc, &host);
+	if (err)
+		return err;
+
+	if (len == qc->cluster_size)
+		err = qcow2_pwritev(qc->fd, iov, cnt, len, host);
+	else {
+		if (entry & QCOW2_OFLAG_ZERO)
+			memset(qc->cbuf, 0, qc->cluster_size);
+		else {
+			base.iov_base = qc->cbuf;
+			base.iov_len = qc->cluster_size;
+			err = qcow2_read_backing(qc, &base, 1, qc->cluster_size,
+						 offset - coff);
+			if (err)
+				return err;
+		}
+		qcow2_iov_copy(iov, cnt, qc->cbuf + coff);
+		err = qcow2_pwrite(qc->fd, qc->cbuf, qc->cluster_size, host);
+	}
+	if (err)
+		return err;
+
+	table[l2i] = htobe64(host | QCOW2_OFLAG_COPIED);
+	return qcow2_pwrite(qc->fd, &table[l2i], sizeof(uint64_t),
+			    l2off + l2i * sizeof(uint64_t));
+}
+
+ssize_t
+qcow2_writev(struct qcow2 *qc, const struct iovec *iov, int iovcnt,
+	     off_t offset)
+{
+	struct iovec slice[QCOW2_IOV_MAX];
+	uint64_t coff;
+	size_t total, done, len;
+	int i, n, err;
+
+	if (qc->ro) {
+		errno = EROFS;
+		return -1;
+	}
+	if (iovcnt > QCOW2_IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (offset < 0 || offset + total > qc->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = 0;
+	pthread_mutex_lock(&qc->mtx);
+	for (done = 0; done < total && err == 0; done += len) {
+		coff = (offset + done) & (qc->cluster_size - 1);
+		len = MIN(qc->cluster_size - coff, total - done);
+		n = qcow2_iov_slice(iov, iovcnt, done, len, slice);
+		err = qcow2_write_cluster(qc, slice, n, len, offset + done);
+	}
+	pthread_mutex_unlock(&qc->mtx);
+
+	if (err) {
+		errno = -err;
+		return -1;
+	}
+	return total;
+}
+
+int
+qcow2_probe(const char *path)
+{
+	uint32_t magic;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ret = (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	       be32toh(magic) == QCOW2_MAGIC);
+	close(fd);
+	return ret;
+}
+
+static int
+qcow2_read_header(struct qcow2 *qc, struct qcow2_header *h)
+{
+	int err;
+
+	memset(h, 0, sizeof(*h));
+	err = qcow2_pread(qc->fd, h, sizeof(*h), 0);
+	if (err)
+		return err;
+
+	h->magic = be32toh(h->magic);
+	h->version = be32toh(h->version);
+	h->backing_file_offset = be64toh(h->backing_file_offset);
+	h->backing_file_size = be32toh(h->backing_file_size);
+	h->cluster_bits = be32toh(h->cluster_bits);
+	h->size = be64toh(h->size);
+	h->crypt_method = be32toh(h->crypt_method);
+	h->l1_size = be32toh(h->l1_size);
+	h->l1_table_offset = be64toh(h->l1_table_offset);
+	h->refcount_table_offset = be64toh(h->refcount_table_offset);
+	h->refcount_table_clusters = be32toh(h->refcount_table_clusters);
+	h->nb_snapshots = be32toh(h->nb_snapshots);
+	if (h->version < 3) {
+		/* these didn't exist yet */
+		h->incompatible_features = 0;
+		h->autoclear_features = 0;
+		h->refcount_order = 4;
+	} else {
+		h->incompatible_features = be64toh(h->incompatible_features);
+		h->autoclear_features = be64toh(h->autoclear_features);
+		h->refcount_order = be32toh(h->refcount_order);
+	}
+
+	if (h->magic != QCOW2_MAGIC || (h->version != 2 && h->version != 3)) {
+		WPRINTF(("qcow2: unsupported version %u\n", h->version));
+		return -EINVAL;
+	}
+	if (h->cluster_bits < QCOW2_MIN_CLUSTER_BITS ||
+	    h->cluster_bits > QCOW2_MAX_CLUSTER_BITS) {
+		WPRINTF(("qcow2: bad cluster size 2^%u\n", h->cluster_bits));
+		return -EINVAL;
+	}
+	if (h->crypt_method != 0 || h->incompatible_features != 0 ||
+	    h->refcount_order != 4) {
+		WPRINTF(("qcow2: encrypted, dirty or unusual image\n"));
+		return -EINVAL;
+	}
+	if (h->nb_snapshots != 0 && !qc->ro) {
+		WPRINTF(("qcow2: images with snapshots can only be read\n"));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+qcow2_open_backing(struct qcow2 *qc, const char *path,
+		   struct qcow2_header *h, int flags, int depth)
+{
+	char name[PATH_MAX], full[PATH_MAX];
+	const char *slash;
+	int err;
+
+	if (h->backing_file_offset == 0 || h->backing_file_size == 0)
+		return 0;
+	if (h->backing_file_size >= sizeof(name) ||
+	    depth + 1 >= QCOW2_MAX_BACKING)
+		return -EINVAL;
+
+	err = qcow2_pread(qc->fd, name, h->backing_file_size,
+			  h->backing_file_offset);
+	if (err)
+		return err;
+	name[h->backing_file_size] = '\0';
+
+	/* relative names are relative to the image referring to them */
+	slash = strrchr(path, '/');
+	if (name[0] != '/' && slash != NULL) {
+		if (snprintf(full, sizeof(full), "%.*s/%s",
+			     (int)(slash - path), path, name) >=
+		    (int)sizeof(full))
+			return -ENAMETOOLONG;
+	} else
+		strcpy(full, name);
+
+	DPRINTF(("qcow2: %s is backed by %s\n", path, full));
+	if (qcow2_probe(full)) {
+		qc->backing = qcow2_open_chain(full, 1, flags, depth + 1);
+		if (qc->backing == NULL)
+			return -EINVAL;
+	} else {
+		qc->backing_fd = open(full, O_RDONLY | flags);
+		if (qc->backing_fd < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+static struct qcow2 *
+qcow2_open_chain(const char *path, int ro, int flags, int depth)
+{
+	struct qcow2_header h;
+	struct qcow2 *qc;
+	struct stat sbuf;
+	uint64_t zero = 0, l2_span;
+	size_t sz;
+	int err;
+
+	qc = calloc(1, sizeof(struct qcow2));
+	if (qc == NULL)
+		return NULL;
+	qc->backing_fd = -1;
+	qc->ro = ro;
+	pthread_mutex_init(&qc->mtx, NULL);
+
+	qc->fd = open(path, (ro ? O_RDONLY : O_RDWR) | flags);
+	if (qc->fd < 0 || fstat(qc->fd, &sbuf) < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = qcow2_read_header(qc, &h);
+	if (err)
+		goto fail;
+
+	qc->cluster_bits = h.cluster_bits;
+	qc->cluster_size = 1ULL << h.cluster_bits;
+	qc->l2_bits = h.cluster_bits - 3;
+	qc->rb_bits = h.cluster_bits - 1;	/* 16 bit refcounts */
+	qc->size = h.size;
+	qc->l1_size = h.l1_size;
+	qc->l1_offset = h.l1_table_offset;
+	qc->rct_offset = h.refcount_table_offset;
+	qc->rct_size = (uint64_t)h.refcount_table_clusters *
+		       qc->cluster_size / sizeof(uint64_t);
+	qc->file_end = roundup(sbuf.st_size, qc->cluster_size);
+
+	l2_span = qc->cluster_size << qc->l2_bits;
+	if ((uint64_t)qc->l1_size < howmany(qc->size, l2_span)) {
+		WPRINTF(("qcow2: L1 table too small for the image\n"));
+		err = -EINVAL;
+		goto fail;
+	}
+
+	err = -ENOMEM;
+	sz = (size_t)qc->l1_size * sizeof(uint64_t);
+	qc->l1 = malloc(MAX(sz, 1));
+	qc->rct = malloc(qc->rct_size * sizeof(uint64_t));
+	qc->cbuf = malloc(qc->cluster_size);
+	if (qc->l1 == NULL || qc->rct == NULL || qc->cbuf == NULL)
+		goto fail;
+
+	err = qcow2_pread(qc->fd, qc->l1, sz, qc->l1_offset);
+	if (err)
+		goto fail;
+	err = qcow2_pread(qc->fd, qc->rct, qc->rct_size * sizeof(uint64_t),
+			  qc->rct_offset);
+	if (err)
+		goto fail;
+
+	/* features we don't know about have to be dropped once we write */
+	if (!ro && h.autoclear_features != 0) {
+		err = qcow2_pwrite(qc->fd, &zero, sizeof(zero),
+				   QCOW2_AUTOCLEAR_OFFSET);
+		if (err)
+			goto fail;
+	}
+
+	err = qcow2_open_backing(qc, path, &h, flags, depth);
+	if (err)
+		goto fail;
+
+	return qc;
+
+fail:
+	WPRINTF(("qcow2: can't open %s, error %d\n", path, -err));
+	qcow2_close(qc);
+	return NULL;
+}
+
+struct qcow2 *
+qcow2_open(const char *path, int ro, int flags)
+{
+	return qcow2_open_chain(path, ro, flags, 0);
+}
+
+void
+qcow2_close(struct qcow2 *qc)
+{
+	int i;
+
+	if (qc->backing != NULL)
+		qcow2_close(qc->backing);
+	if (qc->backing_fd >= 0)
+		close(qc->backing_fd);
+	for (i = 0; i < QCOW2_L2_CACHE; i++)
+		free(qc->l2[i].table);
+	free(qc->l1);
+	free(qc->rct);
+	free(qc->cbuf);
+	if (qc->fd >= 0)
+		close(qc->fd);
+	pthread_mutex_destroy(&qc->mtx);
+	free(qc);
+}
+
+int
+qcow2_fd(struct qcow2 *qc)
+{
+	return qc->fd;
+}
+
+off_t
+qcow2_size(struct qcow2 *qc)
+{
+	return qc->size;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Readahead for raw images.
+ *
+ * Guests read ahead in requests far smaller than an eMMC wants, and
+ * under O_DIRECT each one pays the full device latency. A few streams
+ * are tracked by where the next sequential read would start; once a
+ * stream has been hit BRA_TRIGGER times in a row, a helper thread
+ * reads BRA_CHUNK sized pieces ahead of it into a bounded set of
+ * slots. A read that the slots fully cover is copied out, waiting for
+ * a piece not read yet, as the device is better left to the helper
+ * than asked twice; a slot is dropped once read to its end.
+ * Writes invalidate what they overlap, and a slot overwritten while
+ * its read is in flight is thrown away when that read finishes.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_readahead.h"
+#include "monitor.h"
+
+static int bra_debug;
+MONITOR_DEBUG(readahead, bra_debug);
+#define DPRINTF(params) do { if (bra_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+#define BRA_STREAMS	4
+#define BRA_TRIGGER	2	/* sequential reads before reading ahead */
+#define BRA_MINSLOTS	2
+#define BRA_MAXSLOTS	256
+
+enum bra_state {
+	BRA_EMPTY,
+	BRA_QUEUED,		/* waiting for the helper */
+	BRA_LOADING,		/* being read by the helper */
+	BRA_VALID
+};
+
+struct bra_slot {
+	enum bra_state	state;
+	int		stale;		/* written to while loading */
+	off_t		off;
+	size_t		len;		/* the image may end early */
+	uint64_t	used;		/* tick of the last fill or hit */
+	uint8_t		*buf;
+};
+
+struct bra_stream {
+	off_t		next;		/* where a sequential read starts */
+	off_t		ahead;		/* first byte not yet queued */
+	int		seq;
+	uint64_t	used;
+};
+
+struct bra {
+	int			fd;
+	off_t			end;
+	size_t			align;
+	size_t			window;	/* read ahead of each stream */
+	pthread_mutex_t		mtx;
+	pthread_cond_t		work;	/* a slot was queued */
+	pthread_cond_t		done;	/* a slot left BRA_LOADING */
+	pthread_t		tid;
+	int			closing;
+	uint64_t		tick;
+	struct bra_stream	streams[BRA_STREAMS];
+	int			nslots;
+	struct bra_slot		*slots;
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		loads;
+};
+
+static void *
+bra_thr(void *arg)
+{
+	struct bra *ra = arg;
+	struct bra_slot *s;
+	ssize_t n;
+	int i;
+
+	pthread_mutex_lock(&ra->mtx);
+	while (!ra->closing) {
+		/* oldest first, which is the order streams asked */
+		s = NULL;
+		for (i = 0; i < ra->nslots; i++) {
+			if (ra->slots[i].state == BRA_QUEUED &&
+			    (s == NULL || ra->slots[i].used < s->used))
+				s = &ra->slots[i];
+		}
+		if (s == NULL) {
+			pthread_cond_wait(&ra->work, &ra->mtx);
+			continue;
+		}
+
+		s->state = BRA_LOADING;
+		s->stale = 0;
+		pthread_mutex_unlock(&ra->mtx);
+		do {
+			n = pread(ra->fd, s->buf, s->len, s->off);
+		} while (n < 0 && errno == EINTR);
+		pthread_mutex_lock(&ra->mtx);
+
+		if (n <= 0 || s->stale) {
+			s->state = BRA_EMPTY;
+		} else {
+			s->state = BRA_VALID;
+			s->len = n;
+			s->used = ++ra->tick;
+			ra->loads++;
+		}
+		pthread_cond_broadcast(&ra->done);
+	}
+	pthread_mutex_unlock(&ra->mtx);
+	return NULL;
+}
+
+/*
+ * Set up readahead for the image open on fd, in about size bytes of
+ * buffers; nothing at or past end is read.
+ */
+struct bra *
+bra_open(int fd, off_t end, size_t size, size_t align, const char *name)
+{
+	struct bra *ra;
+	int i, n;
+
+	n = size / BRA_CHUNK;
+	n = MAX(MIN(n, BRA_MAXSLOTS), BRA_MINSLOTS);
+
+	ra = calloc(1, sizeof(struct bra));
+	if (ra == NULL)
+		return NULL;
+	ra->slots = calloc(n, sizeof(struct bra_slot));
+	if (ra->slots == NULL)
+		goto fail;
+	for (ra->nslots = 0; ra->nslots < n; ra->nslots++) {
+		if (posix_memalign((void **)&ra->slots[ra->nslots].buf,
+				   MAX(align, 4096), BRA_CHUNK))
+			goto fail;
+	}
+
+	ra->fd = fd;
+	ra->end = end;
+	ra->align = align;
+	/* leave room for a second stream */
+	ra->window = MAX(n / 2, 1) * BRA_CHUNK;
+	pthread_mutex_init(&ra->mtx, NULL);
+	pthread_cond_init(&ra->work, NULL);
+	pthread_cond_init(&ra->done, NULL);
+	if (pthread_create(&ra->tid, NULL, bra_thr, ra))
+		goto fail;
+	pthread_setname_np(ra->tid, name);
+
+	DPRINTF(("readahead: %s, %d slots, %zu window\n", name, n,
+		 ra->window));
+	return ra;
+
+fail:
+	WPRINTF(("readahead: can't set up %s\n", name));
+	if (ra->slots) {
+		for (i = 0; i < ra->nslots; i++)
+			free(ra->slots[i].buf);
+		free(ra->slots);
+	}
+	free(ra);
+	return NULL;
+}
+
+void
+bra_close(struct bra *ra)
+{
+	int i;
+
+	pthread_mutex_lock(&ra->mtx);
+	ra->closing = 1;
+	pthread_cond_signal(&ra->work);
+	pthread_mutex_unlock(&ra->mtx);
+	pthread_join(ra->tid, NULL);
+
+	DPRINTF(("readahead: %lu hits, %lu misses, %lu loads\n",
+		 ra->hits, ra->misses, ra->loads));
+	for (i = 0; i < ra->nslots; i++)
+		free(ra->slots[i].buf);
+	free(ra->slots);
+	pthread_cond_destroy(&ra->done);
+	pthread_cond_destroy(&ra->work);
+	pthread_mutex_destroy(&ra->mtx);
+	free(ra);
+}
+
+static struct bra_slot *
+bra_find(struct bra *ra, off_t off)
+{
+	struct bra_slot *s;
+	int i;
+
+	for (i = 0; i < ra->nslots; i++) {
+		s = &ra->slots[i];
+		if (s->state != BRA_EMPTY && off >= s->off &&
+		    off < s->off + (off_t)s->len)
+			return s;
+	}
+	return NULL;
+}
+
+/* An empty slot, else the least recently used one with data */
+static struct bra_slot *
+bra_victim(struct bra *ra)
+{
+	struct bra_slot *s, *v;
+	int i;
+
+	v = NULL;
+	for (i = 0; i < ra->nslots; i++) {
+		s = &ra->slots[i];
+		if (s->state == BRA_EMPTY)
+			return s;
+		if (s->state == BRA_VALID && (v == NULL || s->used < v->used))
+			v = s;
+	}
+	return v;
+}
+
+/* Copy len bytes from src into iov, starting skip bytes in */
+static void
+bra_copyout(const struct iovec *iov, int iovcnt, size_t skip,
+	    const uint8_t *src, size_t len)
+{
+	size_t l;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		l = MIN(iov[i].iov_len - skip, len);
+		memcpy((uint8_t *)iov[i].iov_base + skip, src, l);
+		src += l;
+		len -= l;
+		skip = 0;
+	}
+}
+
+/*
+ * Called with ra->mtx held: note a read and queue readahead behind it.
+ * A miss inside a stream means a hole, e.g. from a write, which the
+ * stream goes back and fills.
+ */
+static void
+bra_stream(struct bra *ra, off_t off, size_t len, int hit)
+{
+	struct bra_stream *st, *lru;
+	struct bra_slot *s;
+	int i, queued;
+
+	lru = &ra->streams[0];
+	for (i = 0; i < BRA_STREAMS; i++) {
+		st = &ra->streams[i];
+		if (st->seq && st->next == off)
+			break;
+		if (st->used < lru->used)
+			lru = st;
+	}
+	if (i == BRA_STREAMS) {
+		st = lru;
+		st->seq = 0;
+	}
+	st->seq++;
+	st->next = off + len;
+	st->used = ++ra->tick;
+	if (st->seq < BRA_TRIGGER)
+		return;
+
+	if (st->ahead < st->next || !hit)
+		st->ahead = st->next - st->next % ra->align;
+	queued = 0;
+	while (st->ahead < st->next + (off_t)ra->window &&
+	       st->ahead < ra->end) {
+		s = bra_find(ra, st->ahead);
+		if (s != NULL) {
+			st->ahead = s->off + s->len;
+			continue;
+		}
+		s = bra_victim(ra);
+		if (s == NULL)
+			break;
+		s->state = BRA_QUEUED;
+		s->off = st->ahead;
+		s->len = MIN(BRA_CHUNK, ra->end - st->ahead);
+		s->used = ++ra->tick;
+		st->ahead += s->len;
+		queued = 1;
+	}
+	if (queued)
+		pthread_cond_signal(&ra->work);
+}
+
+/*
+ * Serve a read from the readahead slots. Returns the bytes copied,
+ * or 0 when the slots don't hold all of it and the caller has to read
+ * it itself.
+ */
+ssize_t
+bra_preadv(struct bra *ra, const struct iovec *iov, int iovcnt,
+	   off_t offset)
+{
+	struct bra_slot *s;
+	size_t total, done, len;
+	int i, hit;
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	pthread_mutex_lock(&ra->mtx);
+	hit = 1;
+	for (done = 0; done < total; done += len) {
+		s = bra_find(ra, offset + done);
+		if (s == NULL) {
+			hit = 0;
+			break;
+		}
+		if (s->state != BRA_VALID) {
+			/* slots may move meanwhile, so look again */
+			pthread_cond_wait(&ra->done, &ra->mtx);
+			len = 0;
+			done = 0;
+			continue;
+		}
+		len = MIN(s->off + s->len - (offset + done), total - done);
+	}
+
+	if (hit) {
+		for (done = 0; done < total; done += len) {
+			s = bra_find(ra, offset + done);
+			len = MIN(s->off + s->len - (offset + done),
+				  total - done);
+			bra_copyout(iov, iovcnt, done,
+				    s->buf + (offset + done - s->off), len);
+			if (offset + done + len == s->off + s->len)
+				s->state = BRA_EMPTY;
+			else
+				s->used = ++ra->tick;
+		}
+		ra->hits++;
+	} else
+		ra->misses++;
+
+	bra_stream(ra, offset, total, hit);
+	pthread_mutex_unlock(&ra->mtx);
+	return hit ? (ssize_t)total : 0;
+}
+
+/* Drop whatever overlaps a write, now complete, of len bytes at offset */
+void
+bra_invalidate(struct bra *ra, off_t offset, size_t len)
+{
+	struct bra_slot *s;
+	int i;
+
+	pthread_mutex_lock(&ra->mtx);
+	for (i = 0; i < ra->nslots; i++) {
+		s = &ra->slots[i];
+		if (s->state == BRA_EMPTY || s->off >= offset + (off_t)len ||
+		    offset >= s->off + (off_t)s->len)
+			continue;
+		if (s->state == BRA_LOADING)
+			s->stale = 1;
+		else
+			s->state = BRA_EMPTY;
+	}
+	pthread_mutex_unlock(&ra->mtx);
+}
@@ -41,6 +41,7 @@
 #include "inout.h"
 #include "mc146818rtc.h"
 #include "rtc.h"
+#include "timer.h"
 
 /* #define DEBUG_RTC */
 #ifdef DEBUG_RTC
@@ -75,12 +76,16 @@ struct rtcdev {
 struct vrtc {
 	struct vmctx *vm;
 	pthread_mutex_t	mtx;
-	timer_t		periodic_timer_id;  /*periodic timer id*/
-	timer_t		update_timer_id;    /*update timer id*/
+	struct acrn_timer periodic_timer;   /*periodic interrupt timer*/
+	struct acrn_timer update_timer;     /*1s update timer*/
+	time_t		period;		    /* periodic timer armed at, or 0 */
+	bool		update_armed;
 	u_int		addr;               /* RTC register to read or write */
 	time_t		base_uptime;
 	time_t		base_rtctime;
 	struct rtcdev	rtcdev;
+	struct acrn_pio_shadow_page *shadow;	/* NULL if not supported */
+	time_t		shadow_until;	/* date/time in the shadow page until */
 };
 
 /*
@@ -128,6 +133,13 @@ struct clktime {
 #define	pintr_enabled(rtc)	(((rtc)->rtcdev.reg_b & RTCSB_PINTR) != 0)
 #define	uintr_enabled(rtc)	(((rtc)->rtcdev.reg_b & RTCSB_UINTR) != 0)
 
+#define	rtc_time_field(off)	(((off) < 10 && ((off) & 1) == 0) || \
+				 (off) == 7 || (off) == 9 || \
+				 (off) == RTC_CENTURY)
+
+/* how long date/time reads stay off the data port after one exits */
+#define	VRTC_SHADOW_HOLD	10
+
 /*--------------------------------------------------------------------*
  * Generic routines to convert between a POSIX date
  * (seconds since 1/1/1970) and yr/mo/day/hr/min/sec
@@ -183,6 +195,8 @@ u_char const bin2bcd_data[] = {
 };
 
 static void vrtc_set_reg_c(struct vrtc *vrtc, uint8_t newval);
+static void vrtc_shadow_update(struct vrtc *vrtc);
+static void vrtc_timers_update(struct vrtc *vrtc);
 
 static int rtc_flag_broken_time = 1;
 
@@ -567,30 +581,18 @@ fail:
 	return VRTC_BROKEN_TIME;
 }
 
-static timer_t
-vrtc_create_timer(struct vrtc *vrtc, time_t sec, time_t nsec, void (*cb)())
+static void
+vrtc_start_timer(struct acrn_timer *timer, time_t sec, time_t nsec)
 {
-	timer_t timerid;
-	struct sigevent sigevt;
 	struct itimerspec ts;
 
-	memset(&sigevt, 0, sizeof(struct sigevent));
-	memset(&ts, 0, sizeof(struct itimerspec));
-
-	sigevt.sigev_value.sival_ptr = vrtc;
-	sigevt.sigev_notify = SIGEV_THREAD;
-	sigevt.sigev_notify_function = cb;
-
-	assert(timer_create(CLOCK_REALTIME, &sigevt, &timerid) == 0);
 	/*setting the interval time*/
 	ts.it_interval.tv_sec = sec;
 	ts.it_interval.tv_nsec = nsec;
 	/*set the delay time it will be started when timer_setting*/
 	ts.it_value.tv_sec = sec;
 	ts.it_value.tv_nsec = nsec;
-	assert(timer_settime(timerid, 0, &ts, NULL) == 0);
-
-	return timerid;
+	assert(acrn_timer_settime(timer, &ts) == 0);
 }
 
 static int
@@ -670,7 +672,7 @@ vrtc_time_update(struct vrtc *vrtc, time_t newtime, time_t newbase)
 }
 
 static void
-vrtc_periodic_timer(void *arg)
+vrtc_periodic_timer(void *arg, uint64_t nexp)
 {
 	struct vrtc *vrtc = arg;
 
@@ -683,21 +685,60 @@ vrtc_periodic_timer(void *arg)
 }
 
 static void
-vrtc_update_timer(void *arg)
+vrtc_update_timer(void *arg, uint64_t nexp)
 {
 	struct vrtc *vrtc = arg;
 	time_t basetime;
 	time_t curtime;
 
 	pthread_mutex_lock(&vrtc->mtx);
-	if (aintr_enabled(vrtc) || uintr_enabled(vrtc)) {
-		curtime = vrtc_curtime(vrtc, &basetime);
-		vrtc_time_update(vrtc, curtime, basetime);
+	curtime = vrtc_curtime(vrtc, &basetime);
+	vrtc_time_update(vrtc, curtime, basetime);
+
+	/*
+	 * Reads answered from the shadow page see time advance from here,
+	 * until the guest has left the RTC alone for a while and they go
+	 * back to exiting.
+	 */
+	if (vrtc->shadow_until) {
+		if (time(NULL) >= vrtc->shadow_until)
+			vrtc->shadow_until = 0;
+		secs_to_rtc(curtime, vrtc, 0);
+		vrtc_shadow_update(vrtc);
 	}
 
+	vrtc_timers_update(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 }
 
+/*
+ * Run the timers only for what needs them: the periodic timer while
+ * the periodic interrupt is enabled, and the 1s timer while the alarm
+ * or update interrupt is, or the shadow page holds the date/time.
+ * Otherwise nothing ticks; the date/time fields are worked out from
+ * the base time when the guest reads them.
+ */
+static void
+vrtc_timers_update(struct vrtc *vrtc)
+{
+	time_t period = 0;
+	bool update;
+
+	if (pintr_enabled(vrtc) && divider_enabled(vrtc->rtcdev.reg_a))
+		period = vrtc_freq(vrtc);
+	if (period != vrtc->period) {
+		vrtc->period = period;
+		vrtc_start_timer(&vrtc->periodic_timer, 0, period);
+	}
+
+	update = update_enabled(vrtc) && (aintr_enabled(vrtc) ||
+		 uintr_enabled(vrtc) || vrtc->shadow_until);
+	if (update != vrtc->update_armed) {
+		vrtc->update_armed = update;
+		vrtc_start_timer(&vrtc->update_timer, update ? 1 : 0, 0);
+	}
+}
+
 static void
 vrtc_set_reg_c(struct vrtc *vrtc, uint8_t newval)
 {
@@ -743,14 +784,13 @@ static int
 vrtc_set_reg_b(struct vrtc *vrtc, uint8_t newval)
 {
 	struct rtcdev *rtc;
-	time_t oldfreq, newfreq, basetime;
+	time_t basetime;
 	time_t curtime, rtctime;
 	int error;
 	uint8_t oldval, changed;
 
 	rtc = &vrtc->rtcdev;
 	oldval = rtc->reg_b;
-	oldfreq = vrtc_freq(vrtc);
 
 	rtc->reg_b = newval;
 	changed = oldval ^ newval;
@@ -796,25 +836,9 @@ vrtc_set_reg_b(struct vrtc *vrtc, uint8_t newval)
 		vrtc_set_reg_c(vrtc, vrtc->rtcdev.reg_c);
 
 	/*
-	 * Change the callout frequency if it has changed.
+	 * Start, stop or change the rate of the timers.
 	 */
-	newfreq = vrtc_freq(vrtc);
-
-	if (pintr_enabled(vrtc) && newfreq != oldfreq) {
-		/*stop the previous timer*/
-		if (vrtc->periodic_timer_id > 0) {
-			assert(timer_delete(vrtc->periodic_timer_id) == 0);
-			vrtc->periodic_timer_id = 0;
-		}
-
-		/*create the new periodic timer*/
-		vrtc->periodic_timer_id =
-		    vrtc_create_timer(vrtc, 0, newfreq, vrtc_periodic_timer);
-		assert(vrtc->periodic_timer_id > 0);
-
-	} else {
-		/*Nothing to do*/
-	}
+	vrtc_timers_update(vrtc);
 
 	/*
 	 * The side effect of bits that control the RTC date/time format
@@ -826,12 +850,10 @@ vrtc_set_reg_b(struct vrtc *vrtc, uint8_t newval)
 static void
 vrtc_set_reg_a(struct vrtc *vrtc, uint8_t newval)
 {
-	time_t oldfreq, newfreq;
 	uint8_t oldval, changed;
 
 	newval &= ~RTCSA_TUP;
 	oldval = vrtc->rtcdev.reg_a;
-	oldfreq = vrtc_freq(vrtc);
 
 	if (divider_enabled(oldval) && !divider_enabled(newval)) {
 		RTC_DEBUG("RTC divider held in reset at %#lx/%#lx",
@@ -860,22 +882,7 @@ vrtc_set_reg_a(struct vrtc *vrtc, uint8_t newval)
 	/*
 	 * Side effect of changes to rate select and divider enable bits.
 	 */
-	newfreq = vrtc_freq(vrtc);
-
-	if (pintr_enabled(vrtc) && newfreq != oldfreq) {
-		/*stop the previous timer*/
-		if (vrtc->periodic_timer_id > 0) {
-			assert(timer_delete(vrtc->periodic_timer_id) == 0);
-			vrtc->periodic_timer_id = 0;
-		}
-
-		/*create the new periodic timer*/
-		vrtc->periodic_timer_id =
-		     vrtc_create_timer(vrtc, 0, newfreq, vrtc_periodic_timer);
-		assert(vrtc->periodic_timer_id > 0);
-	} else {
-		/*Nothing to do*/
-	}
+	vrtc_timers_update(vrtc);
 }
 
 int
@@ -927,6 +934,7 @@ vrtc_nvram_write(struct vrtc *vrtc, int offset, uint8_t value)
 	ptr = (uint8_t *)(&vrtc->rtcdev);
 	ptr[offset] = value;
 	RTC_DEBUG("RTC nvram write %#x to offset %#x", value, offset);
+	vrtc_shadow_update(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 
 	return 0;
@@ -948,6 +956,7 @@ vrtc_addr_handler(struct vmctx *ctx, int vcpu, int in, int port,
 
 	pthread_mutex_lock(&vrtc->mtx);
 	vrtc->addr = *eax & 0x7f;
+	vrtc_shadow_update(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 
 	return 0;
@@ -1002,6 +1011,12 @@ vrtc_data_handler(struct vmctx *ctx, int vcpu, int in, int port,
 			*eax = *((uint8_t *)rtc + offset);
 		}
 		RTC_DEBUG("Read value %#x from RTC offset %#x\n", *eax, offset);
+
+		/* answer the next date/time reads from the shadow page */
+		if (vrtc->shadow && rtc_time_field(offset)) {
+			vrtc->shadow_until = time(NULL) + VRTC_SHADOW_HOLD;
+			vrtc_timers_update(vrtc);
+		}
 	} else {
 		switch (offset) {
 		case 10:
@@ -1041,13 +1056,80 @@ vrtc_data_handler(struct vmctx *ctx, int vcpu, int in, int port,
 			if (curtime == VRTC_BROKEN_TIME && rtc_flag_broken_time)
 				error = -1;
 		}
+		vrtc_timers_update(vrtc);
 	}
 
+	vrtc_shadow_update(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 
 	return error;
 }
 
+/*
+ * Mirror the register file into the shadow page, with vrtc->mtx held.
+ * The hypervisor retries or forwards a read that races with this.
+ * While the RTC is counting, the date/time fields are only readable
+ * there as long as the 1s timer keeps them current.
+ */
+static void
+vrtc_shadow_update(struct vrtc *vrtc)
+{
+	struct acrn_pio_shadow_page *sp = vrtc->shadow;
+	int i;
+
+	if (sp == NULL)
+		return;
+
+	__atomic_store_n(&sp->seq, sp->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	sp->index = vrtc->addr;
+	memcpy(sp->regs, &vrtc->rtcdev, sizeof(struct rtcdev));
+	for (i = 0; i < sizeof(struct rtcdev); i++) {
+		if (!rtc_time_field(i) || !update_enabled(vrtc))
+			continue;
+		if (vrtc->shadow_until)
+			sp->readable[i / 8] |= 1 << (i % 8);
+		else
+			sp->readable[i / 8] &= ~(1 << (i % 8));
+	}
+	__atomic_store_n(&sp->seq, sp->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Let the hypervisor answer reads of the data port from a shared page.
+ * Only reg_c is left out, since reading it clears the interrupt flags.
+ * Date/time reads exit too unless one did in the last
+ * VRTC_SHADOW_HOLD seconds, so a guest polling the clock is answered
+ * from the page and an idle one costs no timer.  Every write still
+ * exits to vrtc_data_handler().
+ */
+static void
+vrtc_shadow_init(struct vrtc *vrtc)
+{
+	struct acrn_pio_shadow_page *sp;
+	struct acrn_pio_shadow args;
+	int i;
+
+	if (posix_memalign((void **)&sp, 4096, 4096) != 0)
+		return;
+	memset(sp, 0, 4096);
+
+	for (i = 0; i < sizeof(struct rtcdev); i++) {
+		if (i != RTC_INTR && !rtc_time_field(i))
+			sp->readable[i / 8] |= 1 << (i % 8);
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.index_port = IO_RTC;
+	args.data_port = IO_RTC + 1;
+	args.page = (uint64_t)sp;
+	if (vm_pio_shadow(vrtc->vm, &args) != 0) {
+		free(sp);
+		return;
+	}
+	vrtc->shadow = sp;
+}
+
 int
 vrtc_set_time(struct vrtc *vrtc, time_t secs)
 {
@@ -1055,6 +1137,11 @@ vrtc_set_time(struct vrtc *vrtc, time_t secs)
 
 	pthread_mutex_lock(&vrtc->mtx);
 	error = vrtc_time_update(vrtc, secs, time(NULL));
+	if (vrtc->shadow) {
+		secs_to_rtc(vrtc->base_rtctime, vrtc, 0);
+		vrtc_shadow_update(vrtc);
+	}
+	vrtc_timers_update(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 
 	if (error)
@@ -1087,6 +1174,7 @@ vrtc_reset(struct vrtc *vrtc)
 	rtc = &vrtc->rtcdev;
 	vrtc_set_reg_b(vrtc, rtc->reg_b & ~(RTCSB_ALL_INTRS | RTCSB_SQWE));
 	vrtc_set_reg_c(vrtc, 0);
+	vrtc_shadow_update(vrtc);
 
 	pthread_mutex_unlock(&vrtc->mtx);
 }
@@ -1106,10 +1194,12 @@ vrtc_init(struct vmctx *ctx, int local_time)
 
 	pthread_mutex_init(&vrtc->mtx, NULL);
 
-	/*create update interrupt timer(1s)*/
-	vrtc->update_timer_id =
-		vrtc_create_timer(vrtc, 1, 0, vrtc_update_timer);
-	assert(vrtc->update_timer_id > 0);
+	assert(acrn_timer_init(&vrtc->periodic_timer, vrtc_periodic_timer,
+			       vrtc) == 0);
+
+	/*create update interrupt timer(1s), armed on demand*/
+	assert(acrn_timer_init(&vrtc->update_timer, vrtc_update_timer,
+			       vrtc) == 0);
 
 	memset(&rtc_addr, 0, sizeof(struct inout_port));
 	memset(&rtc_data, 0, sizeof(struct inout_port));
@@ -1120,7 +1210,7 @@ vrtc_init(struct vmctx *ctx, int local_time)
 	rtc_addr.flags = IOPORT_F_INOUT;
 	rtc_addr.handler = vrtc_addr_handler;
 	rtc_addr.arg = vrtc;
-	assert(register_inout(&rtc_addr) == 0);
+	assert(register_inout(ctx, &rtc_addr) == 0);
 
 	/*register io port handler for rtc data*/
 	rtc_data.name = "rtc";
@@ -1129,7 +1219,7 @@ vrtc_init(struct vmctx *ctx, int local_time)
 	rtc_data.flags = IOPORT_F_INOUT;
 	rtc_data.handler = vrtc_data_handler;
 	rtc_data.arg = vrtc;
-	assert(register_inout(&rtc_data) == 0);
+	assert(register_inout(ctx, &rtc_data) == 0);
 
 	/* Allow dividers o keep time but disable everything else */
 	rtc = &vrtc->rtcdev;
@@ -1147,10 +1237,13 @@ vrtc_init(struct vmctx *ctx, int local_time)
 	/*curtime = 0;*/
 	curtime = time(NULL);
 
+	vrtc_shadow_init(vrtc);
+
 	pthread_mutex_lock(&vrtc->mtx);
 	vrtc->base_rtctime = VRTC_BROKEN_TIME;
 	vrtc_time_update(vrtc, curtime, time(NULL));
 	secs_to_rtc(curtime, vrtc, 0);
+	vrtc_shadow_update(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 
 	return vrtc;
@@ -1159,5 +1252,18 @@ vrtc_init(struct vmctx *ctx, int local_time)
 void
 vrtc_cleanup(struct vrtc *vrtc)
 {
+	struct acrn_pio_shadow args;
+
+	acrn_timer_deinit(&vrtc->periodic_timer);
+	acrn_timer_deinit(&vrtc->update_timer);
+
+	if (vrtc->shadow) {
+		memset(&args, 0, sizeof(args));
+		args.index_port = IO_RTC;
+		args.data_port = IO_RTC + 1;
+		args.flags = ACRN_PIO_SHADOW_FLAG_DEASSIGN;
+		vm_pio_shadow(vrtc->vm, &args);
+		free(vrtc->shadow);
+	}
 	free(vrtc);
 }
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Buffered, non-blocking writer for character backends.
+ *
+ * Writes go straight to the fd only when they are large and nothing is
+ * queued; everything else is appended to a ring that an EVF_WRITE
+ * mevent drains, so a guest writing its console a byte at a time costs
+ * a syscall per burst rather than per byte, and output for a stalled
+ * pty waits in the ring instead of being dropped until the ring fills.
+ *
+ * The fd is dup()ed because epoll can only watch each descriptor once
+ * and the backend's read side is already on the mevent loop.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mevent.h"
+#include "tty_writer.h"
+
+#define TTY_WRITER_DIRECT	256	/* writes this big try the fd first */
+
+struct tty_writer {
+	pthread_mutex_t	mtx;
+	int		fd;		/* dup of the backend fd */
+	struct mevent	*evp;
+	bool		draining;	/* evp enabled */
+	int		error;		/* reported by the next write */
+	size_t		head;		/* free running ring indices */
+	size_t		tail;
+	size_t		size;
+	char		*buf;
+};
+
+static size_t
+tty_writer_queued(struct tty_writer *tw)
+{
+	return tw->tail - tw->head;
+}
+
+static size_t
+tty_writer_put(struct tty_writer *tw, const char *p, size_t len)
+{
+	size_t off, n, done;
+
+	len = MIN(len, tw->size - tty_writer_queued(tw));
+	for (done = 0; done < len; done += n) {
+		off = tw->tail % tw->size;
+		n = MIN(len - done, tw->size - off);
+		memcpy(tw->buf + off, p + done, n);
+		tw->tail += n;
+	}
+	return len;
+}
+
+/* Write out as much of the ring as the fd takes.  Called with mtx. */
+static void
+tty_writer_flush(struct tty_writer *tw)
+{
+	struct iovec iov[2];
+	size_t off, len;
+	ssize_t n;
+	int cnt;
+
+	while ((len = tty_writer_queued(tw)) > 0) {
+		off = tw->head % tw->size;
+		iov[0].iov_base = tw->buf + off;
+		iov[0].iov_len = MIN(len, tw->size - off);
+		iov[1].iov_base = tw->buf;
+		iov[1].iov_len = len - iov[0].iov_len;
+		cnt = iov[1].iov_len ? 2 : 1;
+
+		n = writev(tw->fd, iov, cnt);
+		if (n > 0) {
+			tw->head += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno != EAGAIN) {
+			/* nothing queued can go out any more */
+			tw->error = errno;
+			tw->head = tw->tail;
+		}
+		break;
+	}
+}
+
+static void
+tty_writer_drain(int fd, enum ev_type t, void *arg)
+{
+	struct tty_writer *tw = arg;
+
+	pthread_mutex_lock(&tw->mtx);
+	tty_writer_flush(tw);
+	if (tty_writer_queued(tw) == 0 && tw->draining) {
+		mevent_disable(tw->evp);
+		tw->draining = false;
+	}
+	pthread_mutex_unlock(&tw->mtx);
+}
+
+/* size 0 picks TTY_WRITER_SIZE */
+struct tty_writer *
+tty_writer_open_size(int fd, size_t size)
+{
+	struct tty_writer *tw;
+
+	tw = calloc(1, sizeof(*tw));
+	if (tw == NULL)
+		return NULL;
+
+	tw->size = size ? size : TTY_WRITER_SIZE;
+	tw->buf = malloc(tw->size);
+	if (tw->buf == NULL) {
+		free(tw);
+		return NULL;
+	}
+
+	tw->fd = dup(fd);
+	if (tw->fd < 0) {
+		free(tw->buf);
+		free(tw);
+		return NULL;
+	}
+
+	tw->evp = mevent_add(tw->fd, EVF_WRITE, tty_writer_drain, tw);
+	if (tw->evp == NULL) {
+		close(tw->fd);
+		free(tw->buf);
+		free(tw);
+		return NULL;
+	}
+	/* only watched while something is queued */
+	mevent_disable(tw->evp);
+	pthread_mutex_init(&tw->mtx, NULL);
+	return tw;
+}
+
+void
+tty_writer_close(struct tty_writer *tw)
+{
+	if (tw == NULL)
+		return;
+
+	/* last chance for what's queued */
+	pthread_mutex_lock(&tw->mtx);
+	tty_writer_flush(tw);
+	pthread_mutex_unlock(&tw->mtx);
+
+	mevent_delete_close(tw->evp);
+	pthread_mutex_destroy(&tw->mtx);
+	free(tw->buf);
+	free(tw);
+}
+
+struct tty_writer *
+tty_writer_open(int fd)
+{
+	return tty_writer_open_size(fd, 0);
+}
+
+/*
+ * Returns the number of bytes written or queued, which is less than
+ * asked for only if the ring is full, or -1 with errno set if the fd
+ * has failed.
+ */
+ssize_t
+tty_writer_writev(struct tty_writer *tw, const struct iovec *iov, int iovcnt)
+{
+	size_t total, skip, n;
+	ssize_t done;
+	int i, err;
+
+	for (total = 0, i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	pthread_mutex_lock(&tw->mtx);
+	if (tw->error) {
+		err = tw->error;
+		tw->error = 0;
+		pthread_mutex_unlock(&tw->mtx);
+		errno = err;
+		return -1;
+	}
+
+	done = 0;
+	if (tty_writer_queued(tw) == 0 && total >= TTY_WRITER_DIRECT) {
+		done = writev(tw->fd, iov, iovcnt);
+		if (done < 0 && errno != EAGAIN && errno != EINTR) {
+			err = errno;
+			pthread_mutex_unlock(&tw->mtx);
+			errno = err;
+			return -1;
+		}
+		if (done < 0)
+			done = 0;
+	}
+
+	/* queue the rest, in order */
+	for (skip = done, i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		n = tty_writer_put(tw, (char *)iov[i].iov_base + skip,
+				   iov[i].iov_len - skip);
+		done += n;
+		if (n < iov[i].iov_len - skip)
+			break;
+		skip = 0;
+	}
+
+	if (tty_writer_queued(tw) > 0 && !tw->draining) {
+		mevent_enable(tw->evp);
+		tw->draining = true;
+	}
+	pthread_mutex_unlock(&tw->mtx);
+
+	return done;
+}
+
+ssize_t
+tty_writer_write(struct tty_writer *tw, const void *buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return tty_writer_writev(tw, &iov, 1);
+}
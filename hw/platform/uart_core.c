@@ -28,6 +28,7 @@
  */
 
 #include <sys/cdefs.h>
+#include <sys/param.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -42,6 +43,7 @@
 
 #include "types.h"
 #include "mevent.h"
+#include "tty_writer.h"
 #include "uart_core.h"
 #include "ns16550.h"
 #include "dm.h"
@@ -65,7 +67,10 @@
 #define REG_SCR		com_scr
 #endif
 
-#define	FIFOSZ	256
+#define	FIFOSZ	256		/* default rx ring, rxbuf= overrides */
+#define	FIFOSZ_MIN	16
+#define	FIFOSZ_MAX	(64 * 1024)
+#define	TXBUF_MAX	(1024 * 1024)
 
 static struct termios tio_stdio_orig;
 
@@ -81,16 +86,18 @@ static struct {
 #define	UART_NLDEVS	(ARRAY_SIZE(uart_lres))
 
 struct fifo {
-	uint8_t	buf[FIFOSZ];
+	uint8_t	*buf;
 	int	rindex;		/* index to read from */
 	int	windex;		/* index to write to */
 	int	num;		/* number of characters in the fifo */
 	int	size;		/* size of the fifo */
+	int	cap;		/* allocated size of buf */
 };
 
 struct ttyfd {
 	bool	opened;
 	int	fd;		/* tty device file descriptor */
+	struct tty_writer *out;	/* buffered output, NULL writes directly */
 	struct termios tio_orig, tio_new;    /* I/O Terminals */
 };
 
@@ -113,6 +120,7 @@ struct uart_vdev {
 
 	struct ttyfd tty;
 	bool	thre_int_pending;	/* THRE interrupt pending */
+	bool	intr_asserted;		/* level last sent to the frontend */
 
 	void	*arg;
 	uart_intr_func_t intr_assert;
@@ -143,44 +151,43 @@ ttyopen(struct ttyfd *tf)
 	}
 }
 
-static int
-ttyread(struct ttyfd *tf)
+/* discard whatever input is pending */
+static void
+ttyflush(struct ttyfd *tf)
 {
-	unsigned char rb;
+	char flushbuf[256];
 
-	if (read(tf->fd, &rb, 1) == 1)
-		return rb;
-	else
-		return -1;
+	while (read(tf->fd, flushbuf, sizeof(flushbuf)) ==
+	       sizeof(flushbuf))
+		;
 }
 
 static void
 ttywrite(struct ttyfd *tf, unsigned char wb)
 {
-	(void)write(tf->fd, &wb, 1);
+	if (tf->out)
+		(void)tty_writer_write(tf->out, &wb, 1);
+	else
+		(void)write(tf->fd, &wb, 1);
 }
 
 static void
 rxfifo_reset(struct uart_vdev *uart, int size)
 {
-	char flushbuf[32];
 	struct fifo *fifo;
-	ssize_t nread;
 	int error;
 
 	fifo = &uart->rxfifo;
-	bzero(fifo, sizeof(struct fifo));
-	fifo->size = size;
+	fifo->rindex = 0;
+	fifo->windex = 0;
+	fifo->num = 0;
+	fifo->size = MIN(size, fifo->cap);
 
 	if (uart->tty.opened) {
 		/*
 		 * Flush any unread input from the tty buffer.
 		 */
-		while (1) {
-			nread = read(uart->tty.fd, flushbuf, sizeof(flushbuf));
-			if (nread != sizeof(flushbuf))
-				break;
-		}
+		ttyflush(&uart->tty);
 
 		/*
 		 * Enable mevent to trigger when new characters are available
@@ -259,12 +266,42 @@ rxfifo_numchars(struct uart_vdev *uart)
 	return fifo->num;
 }
 
+/*
+ * Read as much input as the fifo has room for, a contiguous run of the
+ * ring per read(2), instead of a byte at a time.
+ */
 static void
-uart_opentty(struct uart_vdev *uart)
+rxfifo_fill(struct uart_vdev *uart)
+{
+	struct fifo *fifo;
+	ssize_t n;
+	int len, error;
+
+	fifo = &uart->rxfifo;
+	while (fifo->num < fifo->size) {
+		len = MIN(fifo->size - fifo->num, fifo->size - fifo->windex);
+		n = read(uart->tty.fd, fifo->buf + fifo->windex, len);
+		if (n <= 0)
+			return;
+
+		fifo->windex = (fifo->windex + n) % fifo->size;
+		fifo->num += n;
+		if (n < len)
+			return;
+	}
+
+	/* Disable mevent callback if the FIFO is full. */
+	error = mevent_disable(uart->mev);
+	assert(error == 0);
+}
+
+static void
+uart_opentty(struct uart_vdev *uart, size_t txsz)
 {
 	ttyopen(&uart->tty);
 	uart->mev = mevent_add(uart->tty.fd, EVF_READ, uart_drain, uart);
 	assert(uart->mev != NULL);
+	uart->tty.out = tty_writer_open_size(uart->tty.fd, txsz);
 }
 
 static uint8_t
@@ -346,17 +383,25 @@ uart_toggle_intr(struct uart_vdev *uart)
 
 	intr_reason = uart_intr_reason(uart);
 
-	if (intr_reason == IIR_NOPEND)
-		(*uart->intr_deassert)(uart->arg);
-	else
+	/*
+	 * Only signal transitions: every register access lands here and
+	 * the LPC frontend turns each assert into an edge.
+	 */
+	if (intr_reason == IIR_NOPEND) {
+		if (uart->intr_asserted) {
+			uart->intr_asserted = false;
+			(*uart->intr_deassert)(uart->arg);
+		}
+	} else if (!uart->intr_asserted) {
+		uart->intr_asserted = true;
 		(*uart->intr_assert)(uart->arg);
+	}
 }
 
 static void
 uart_drain(int fd, enum ev_type ev, void *arg)
 {
 	struct uart_vdev *uart;
-	int ch;
 
 	uart = arg;
 
@@ -371,11 +416,9 @@ uart_drain(int fd, enum ev_type ev, void *arg)
 	pthread_mutex_lock(&uart->mtx);
 
 	if ((uart->mcr & MCR_LOOPBACK) != 0) {
-		(void) ttyread(&uart->tty);
+		ttyflush(&uart->tty);
 	} else {
-		while ((ch = ttyread(&uart->tty)) != -1)
-			rxfifo_putchar(uart, ch);
-
+		rxfifo_fill(uart);
 		uart_toggle_intr(uart);
 	}
 
@@ -414,6 +457,8 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 			ttywrite(&uart->tty, value);
 		} /* else drop on floor */
 		uart->thre_int_pending = true;
+		/* a THR write restarts the THRE interrupt: raise a new edge */
+		uart->intr_asserted = false;
 		break;
 	case REG_IER:
 		/*
@@ -428,7 +473,8 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 		 * the FIFO contents are reset.
 		 */
 		if ((uart->fcr & FCR_ENABLE) ^ (value & FCR_ENABLE)) {
-			fifosz = (value & FCR_ENABLE) ? FIFOSZ : 1;
+			fifosz = (value & FCR_ENABLE) ?
+				uart->rxfifo.cap : 1;
 			rxfifo_reset(uart, fifosz);
 		}
 
@@ -440,7 +486,7 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 			uart->fcr = 0;
 		} else {
 			if ((value & FCR_RCV_RST) != 0)
-				rxfifo_reset(uart, FIFOSZ);
+				rxfifo_reset(uart, uart->rxfifo.cap);
 
 			uart->fcr = value &
 				(FCR_ENABLE | FCR_DMA | FCR_RX_MASK);
@@ -620,6 +666,10 @@ uart_init(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 
 	pthread_mutex_init(&uart->mtx, NULL);
 
+	uart->rxfifo.buf = malloc(FIFOSZ);
+	assert(uart->rxfifo.buf != NULL);
+	uart->rxfifo.cap = FIFOSZ;
+
 	uart_reset(uart);
 
 	return uart;
@@ -629,10 +679,12 @@ void
 uart_deinit(struct uart_vdev *uart)
 {
 	if (uart) {
+		tty_writer_close(uart->tty.out);
 		if (uart->tty.opened && uart->tty.fd == STDIN_FILENO) {
 			ttyclose();
 			stdio_in_use = false;
 		}
+		free(uart->rxfifo.buf);
 		free(uart);
 	}
 }
@@ -655,16 +707,70 @@ uart_tty_backend(struct uart_vdev *uart, const char *opts)
 	return retval;
 }
 
+/*
+ * <backend>[,rxbuf=<bytes>][,txbuf=<bytes>]: the rx and tx ring sizes
+ * default to FIFOSZ and TTY_WRITER_SIZE.
+ */
+static int
+uart_parse_opts(struct uart_vdev *uart, char *opts, size_t *txsz)
+{
+	uint8_t *buf;
+	char *opt, *val;
+	long sz;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		val = opt;
+		opt = strsep(&val, "=");
+		if (val == NULL)
+			return -1;
+		sz = strtol(val, NULL, 0);
+		if (sz < FIFOSZ_MIN || sz > TXBUF_MAX)
+			return -1;
+
+		if (strcmp(opt, "txbuf") == 0) {
+			*txsz = sz;
+		} else if (strcmp(opt, "rxbuf") == 0 && sz <= FIFOSZ_MAX) {
+			buf = realloc(uart->rxfifo.buf, sz);
+			if (buf == NULL)
+				return -1;
+			uart->rxfifo.buf = buf;
+			uart->rxfifo.cap = sz;
+			rxfifo_reset(uart, 1);
+		} else
+			return -1;
+	}
+
+	return 0;
+}
+
 int
-uart_set_backend(struct uart_vdev *uart, const char *opts)
+uart_set_backend(struct uart_vdev *uart, const char *backend)
 {
+	char *cpy, *opts;
+	size_t txsz;
 	int retval;
 
 	retval = -1;
+	txsz = 0;
 
-	if (opts == NULL)
+	if (backend == NULL)
 		return 0;
 
+	cpy = strdup(backend);
+	if (cpy == NULL)
+		return -1;
+	opts = strchr(cpy, ',');
+	if (opts != NULL) {
+		*opts++ = '\0';
+		if (uart_parse_opts(uart, opts, &txsz) != 0) {
+			fprintf(stderr, "uart: invalid options \"%s\"\n",
+				backend);
+			free(cpy);
+			return -1;
+		}
+	}
+	opts = cpy;
+
 	if (strcmp("stdio", opts) == 0) {
 		if (!stdio_in_use) {
 			uart->tty.fd = STDIN_FILENO;
@@ -681,7 +787,8 @@ uart_set_backend(struct uart_vdev *uart, const char *opts)
 		retval = fcntl(uart->tty.fd, F_SETFL, O_NONBLOCK);
 
 	if (retval == 0)
-		uart_opentty(uart);
+		uart_opentty(uart, txsz);
 
+	free(cpy);
 	return retval;
 }
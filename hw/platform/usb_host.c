@@ -0,0 +1,753 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * USB host device passthrough.
+ *
+ * A physical device is opened through libusb and its endpoints are driven
+ * directly on the guest buffers the xHCI hands down: bulk and interrupt
+ * TRBs become asynchronous libusb transfers, control requests are issued
+ * synchronously from the xHCI transfer worker.
+ *
+ *   -s <slot>,xhci,usb-host=<bus>-<port>[.<port>...]
+ *   -s <slot>,xhci,usb3-host=<vid>:<pid>
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <libusb-1.0/libusb.h>
+
+#include "types.h"
+#include "usb.h"
+#include "usbdi.h"
+#include "usb_core.h"
+#include "monitor.h"
+
+static int uhost_debug;
+MONITOR_DEBUG(uhost, uhost_debug);
+#define	DPRINTF(params) do { if (uhost_debug) printf params; } while (0)
+#define	WPRINTF(params) (printf params)
+
+#define	UHOST_MAX_EPS		32	/* indexed like xHCI epid */
+#define	UHOST_MAX_PORTS		7	/* USB 3 tier limit */
+#define	UHOST_CTRL_TIMEOUT	500	/* ms */
+
+#define	UHOST_EP_IDX(num, dir_in)	((((num) & 0xf) << 1) | \
+					 ((dir_in) ? 1 : 0))
+
+enum {
+	UHOST_XFER_IDLE,
+	UHOST_XFER_BUSY,
+	UHOST_XFER_DONE
+};
+
+struct uhost_ep;
+
+/* one libusb transfer per hci xfer block slot */
+struct uhost_xfer {
+	struct libusb_transfer *xfr;
+	struct uhost_ep	*ep;
+	void		*buf;		/* guest buffer it runs on */
+	int		state;
+	int		status;
+	int		actual;
+};
+
+struct uhost_ep {
+	struct uhost_dev *dev;
+	uint8_t		addr;
+	uint8_t		type;		/* LIBUSB_TRANSFER_TYPE_* */
+	int		halted;
+	struct uhost_xfer x[USB_MAX_XFER_BLOCKS];
+};
+
+struct uhost_dev {
+	struct usb_hci	*hci;
+	libusb_device_handle *handle;
+	int		usbver;
+	int		nifaces;
+
+	pthread_mutex_t	mtx;		/* transfer state below */
+	pthread_cond_t	cond;
+	int		inflight;
+	int		stopping;
+
+	pthread_t	notify_tid;
+	pthread_cond_t	notify_cond;
+	uint32_t	notify;		/* endpoints with results */
+	int		quit;		/* notify thread exits */
+
+	struct uhost_ep	eps[UHOST_MAX_EPS];
+};
+
+static libusb_context *uhost_ctx;
+static pthread_once_t uhost_once = PTHREAD_ONCE_INIT;
+static pthread_t uhost_tid;
+
+static void *
+uhost_event_thr(void *arg)
+{
+	for (;;)
+		libusb_handle_events(uhost_ctx);
+
+	return NULL;
+}
+
+static void
+uhost_global_init(void)
+{
+	if (libusb_init(&uhost_ctx) != 0) {
+		WPRINTF(("usb_host: libusb init failed\r\n"));
+		uhost_ctx = NULL;
+		return;
+	}
+
+	if (pthread_create(&uhost_tid, NULL, uhost_event_thr, NULL) != 0) {
+		WPRINTF(("usb_host: cannot start event thread\r\n"));
+		libusb_exit(uhost_ctx);
+		uhost_ctx = NULL;
+		return;
+	}
+	pthread_setname_np(uhost_tid, "usb-host");
+}
+
+/*
+ * Results are handed to the hci from a thread of our own: hci_intr takes
+ * the controller lock, which the xHCI worker holds across synchronous
+ * control transfers that need the libusb event thread to complete.
+ */
+static void *
+uhost_notify_thr(void *arg)
+{
+	struct uhost_dev *dev = arg;
+	uint32_t pending;
+	int i;
+
+	pthread_mutex_lock(&dev->mtx);
+	for (;;) {
+		while (dev->notify == 0 && !dev->quit)
+			pthread_cond_wait(&dev->notify_cond, &dev->mtx);
+		if (dev->quit)
+			break;
+
+		pending = dev->notify;
+		dev->notify = 0;
+		pthread_mutex_unlock(&dev->mtx);
+
+		for (i = 0; i < UHOST_MAX_EPS; i++)
+			if (pending & (1U << i))
+				dev->hci->hci_intr(dev->hci, dev->eps[i].addr);
+
+		pthread_mutex_lock(&dev->mtx);
+	}
+	pthread_mutex_unlock(&dev->mtx);
+
+	return NULL;
+}
+
+static void LIBUSB_CALL
+uhost_xfer_cb(struct libusb_transfer *xfr)
+{
+	struct uhost_xfer *ux = xfr->user_data;
+	struct uhost_ep *ep = ux->ep;
+	struct uhost_dev *dev = ep->dev;
+
+	pthread_mutex_lock(&dev->mtx);
+	ux->status = xfr->status;
+	ux->actual = xfr->actual_length;
+	ux->state = UHOST_XFER_DONE;
+	dev->inflight--;
+	if (!dev->stopping) {
+		dev->notify |= 1U << (ep - dev->eps);
+		pthread_cond_signal(&dev->notify_cond);
+	}
+	pthread_cond_broadcast(&dev->cond);
+	pthread_mutex_unlock(&dev->mtx);
+}
+
+/* with dev->mtx held */
+static int
+uhost_submit(struct uhost_dev *dev, struct uhost_ep *ep,
+	     struct uhost_xfer *ux, struct usb_data_xfer_block *blk)
+{
+	if (ux->xfr == NULL) {
+		ux->xfr = libusb_alloc_transfer(0);
+		if (ux->xfr == NULL)
+			return -1;
+	}
+
+	if (ep->type == LIBUSB_TRANSFER_TYPE_BULK)
+		libusb_fill_bulk_transfer(ux->xfr, dev->handle, ep->addr,
+					  blk->buf, blk->blen, uhost_xfer_cb,
+					  ux, 0);
+	else
+		libusb_fill_interrupt_transfer(ux->xfr, dev->handle, ep->addr,
+					       blk->buf, blk->blen,
+					       uhost_xfer_cb, ux, 0);
+
+	if (libusb_submit_transfer(ux->xfr) != 0)
+		return -1;
+
+	ux->buf = blk->buf;
+	ux->state = UHOST_XFER_BUSY;
+	dev->inflight++;
+	return 0;
+}
+
+/* with dev->mtx held; cancels everything in flight and waits for it */
+static void
+uhost_cancel_all(struct uhost_dev *dev)
+{
+	struct uhost_ep *ep;
+	int i, j;
+
+	dev->stopping = 1;
+	for (i = 0; i < UHOST_MAX_EPS; i++) {
+		ep = &dev->eps[i];
+		for (j = 0; j < USB_MAX_XFER_BLOCKS; j++)
+			if (ep->x[j].state == UHOST_XFER_BUSY)
+				libusb_cancel_transfer(ep->x[j].xfr);
+	}
+
+	while (dev->inflight > 0)
+		pthread_cond_wait(&dev->cond, &dev->mtx);
+
+	for (i = 0; i < UHOST_MAX_EPS; i++)
+		for (j = 0; j < USB_MAX_XFER_BLOCKS; j++)
+			dev->eps[i].x[j].state = UHOST_XFER_IDLE;
+	dev->stopping = 0;
+}
+
+/* learn the endpoint types of the active configuration, all alt settings */
+static void
+uhost_scan_eps(struct uhost_dev *dev)
+{
+	struct libusb_config_descriptor *cfg;
+	const struct libusb_interface_descriptor *alt;
+	const struct libusb_endpoint_descriptor *epd;
+	int i, j, k;
+
+	dev->nifaces = 0;
+	for (i = 0; i < UHOST_MAX_EPS; i++)
+		dev->eps[i].type = LIBUSB_TRANSFER_TYPE_CONTROL;
+
+	if (libusb_get_active_config_descriptor(
+			libusb_get_device(dev->handle), &cfg) != 0)
+		return;
+
+	dev->nifaces = cfg->bNumInterfaces;
+	for (i = 0; i < cfg->bNumInterfaces; i++) {
+		for (j = 0; j < cfg->interface[i].num_altsetting; j++) {
+			alt = &cfg->interface[i].altsetting[j];
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				epd = &alt->endpoint[k];
+				dev->eps[UHOST_EP_IDX(epd->bEndpointAddress,
+					epd->bEndpointAddress & UE_DIR_IN)].type =
+					epd->bmAttributes & UE_XFERTYPE;
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(cfg);
+}
+
+static void
+uhost_claim(struct uhost_dev *dev)
+{
+	int i, rc;
+
+	for (i = 0; i < dev->nifaces; i++) {
+		rc = libusb_claim_interface(dev->handle, i);
+		if (rc != 0)
+			WPRINTF(("usb_host: cannot claim interface %d: %s\r\n",
+				 i, libusb_error_name(rc)));
+	}
+}
+
+static void
+uhost_release(struct uhost_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nifaces; i++)
+		libusb_release_interface(dev->handle, i);
+}
+
+static int
+uhost_set_config(struct uhost_dev *dev, int config)
+{
+	int rc;
+
+	pthread_mutex_lock(&dev->mtx);
+	uhost_cancel_all(dev);
+	pthread_mutex_unlock(&dev->mtx);
+
+	uhost_release(dev);
+	rc = libusb_set_configuration(dev->handle, config);
+	uhost_scan_eps(dev);
+	uhost_claim(dev);
+
+	return rc;
+}
+
+static libusb_device_handle *
+uhost_open(const char *opt)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *handle;
+	libusb_device **list;
+	uint8_t path[UHOST_MAX_PORTS], ports[UHOST_MAX_PORTS];
+	unsigned int vid, pid;
+	unsigned long bus;
+	const char *s;
+	char *end;
+	int byid, depth, n, rc;
+	ssize_t cnt, i;
+
+	depth = 0;
+	bus = 0;
+	if (sscanf(opt, "%x:%x", &vid, &pid) == 2)
+		byid = 1;
+	else {
+		/* <bus>-<port>[.<port>...], as in sysfs */
+		byid = 0;
+		bus = strtoul(opt, &end, 10);
+		if (end == opt || *end != '-')
+			return NULL;
+		for (s = end; *s == '-' || *s == '.'; s = end) {
+			if (depth == UHOST_MAX_PORTS)
+				return NULL;
+			path[depth++] = strtoul(s + 1, &end, 10);
+			if (end == s + 1)
+				return NULL;
+		}
+		if (*s != '\0')
+			return NULL;
+	}
+
+	cnt = libusb_get_device_list(uhost_ctx, &list);
+	if (cnt < 0)
+		return NULL;
+
+	handle = NULL;
+	for (i = 0; i < cnt && handle == NULL; i++) {
+		if (byid) {
+			if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+			    desc.idVendor != vid || desc.idProduct != pid)
+				continue;
+		} else {
+			n = libusb_get_port_numbers(list[i], ports,
+						    UHOST_MAX_PORTS);
+			if (libusb_get_bus_number(list[i]) != bus ||
+			    n != depth || memcmp(ports, path, n) != 0)
+				continue;
+		}
+
+		rc = libusb_open(list[i], &handle);
+		if (rc != 0) {
+			WPRINTF(("usb_host: cannot open %s: %s\r\n", opt,
+				 libusb_error_name(rc)));
+			handle = NULL;
+		}
+	}
+
+	libusb_free_device_list(list, 1);
+	return handle;
+}
+
+static void *
+uhost_init(struct usb_hci *hci, char *opt, int usbver)
+{
+	struct uhost_dev *dev;
+	libusb_device_handle *handle;
+	char tname[16];
+	int speed, i, j;
+
+	pthread_once(&uhost_once, uhost_global_init);
+	if (uhost_ctx == NULL)
+		return NULL;
+
+	handle = uhost_open(opt);
+	if (handle == NULL) {
+		WPRINTF(("usb_host: no host device \"%s\"\r\n", opt));
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(struct uhost_dev));
+	if (!dev) {
+		WPRINTF(("usb_host: %s:%d fail to allocate memory\n",
+			__func__, __LINE__));
+		libusb_close(handle);
+		return NULL;
+	}
+
+	dev->hci = hci;
+	dev->handle = handle;
+	dev->usbver = usbver;
+	pthread_mutex_init(&dev->mtx, NULL);
+	pthread_cond_init(&dev->cond, NULL);
+	pthread_cond_init(&dev->notify_cond, NULL);
+
+	for (i = 0; i < UHOST_MAX_EPS; i++) {
+		dev->eps[i].dev = dev;
+		dev->eps[i].addr = (i >> 1) | ((i & 1) ? UE_DIR_IN : 0);
+		for (j = 0; j < USB_MAX_XFER_BLOCKS; j++)
+			dev->eps[i].x[j].ep = &dev->eps[i];
+	}
+
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	uhost_scan_eps(dev);
+	uhost_claim(dev);
+
+	speed = libusb_get_device_speed(libusb_get_device(handle));
+	if ((usbver == 3) != (speed >= LIBUSB_SPEED_SUPER))
+		WPRINTF(("usb_host: %s runs at libusb speed %d on a USB %d "
+			 "port\r\n", opt, speed, usbver));
+
+	if (pthread_create(&dev->notify_tid, NULL, uhost_notify_thr,
+			   dev) != 0) {
+		WPRINTF(("usb_host: cannot start notify thread\r\n"));
+		uhost_release(dev);
+		libusb_close(handle);
+		free(dev);
+		return NULL;
+	}
+	snprintf(tname, sizeof(tname), "usb-host-%d", hci->hci_port);
+	pthread_setname_np(dev->notify_tid, tname);
+
+	DPRINTF(("usb_host: %s on port %d, %d interfaces\r\n", opt,
+		 hci->hci_port, dev->nifaces));
+	return dev;
+}
+
+static void *
+uhost2_init(struct usb_hci *hci, char *opt)
+{
+	return uhost_init(hci, opt, 2);
+}
+
+static void *
+uhost3_init(struct usb_hci *hci, char *opt)
+{
+	return uhost_init(hci, opt, 3);
+}
+
+#define	UREQ(x, y)	((x) | ((y) << 8))
+
+/* called from the xHCI transfer worker, with no uhost lock held */
+static int
+uhost_request(void *scarg, struct usb_data_xfer *xfer)
+{
+	struct uhost_dev *dev;
+	struct usb_data_xfer_block *data;
+	struct usb_device_request *ureq;
+	uint16_t value;
+	uint16_t index;
+	uint16_t len;
+	int	i, idx, rc;
+	int	err;
+
+	dev = scarg;
+	data = NULL;
+
+	assert(xfer != NULL && xfer->head >= 0);
+
+	idx = xfer->head;
+	for (i = 0; i < xfer->ndata; i++) {
+		xfer->data[idx].bdone = 0;
+		if (data == NULL && xfer->data[idx].buf != NULL)
+			data = &xfer->data[idx];
+
+		xfer->data[idx].processed = 1;
+		idx = (idx + 1) % USB_MAX_XFER_BLOCKS;
+	}
+
+	ureq = xfer->ureq;
+	if (!ureq || dev->handle == NULL)
+		return USB_ERR_NORMAL_COMPLETION;
+
+	value = ureq->wValue;
+	index = ureq->wIndex;
+	len = ureq->wLength;
+	if (data == NULL)
+		len = 0;
+	else if (len > data->blen)
+		len = data->blen;
+
+	DPRINTF(("%s: port %d, type 0x%x, req 0x%x, "
+		 "val 0x%x, idx 0x%x, len %u\r\n", __func__,
+		 dev->hci->hci_port, ureq->bmRequestType,
+		 ureq->bRequest, value, index, len));
+
+	switch (UREQ(ureq->bRequest, ureq->bmRequestType)) {
+	case UREQ(UR_SET_CONFIG, UT_WRITE_DEVICE):
+		rc = uhost_set_config(dev, value & 0xff);
+		break;
+
+	case UREQ(UR_SET_INTERFACE, UT_WRITE_INTERFACE):
+		rc = libusb_set_interface_alt_setting(dev->handle, index,
+						      value);
+		break;
+
+	case UREQ(UR_CLEAR_FEATURE, UT_WRITE_ENDPOINT):
+		if (value == UF_ENDPOINT_HALT) {
+			rc = libusb_clear_halt(dev->handle, index & 0xff);
+			pthread_mutex_lock(&dev->mtx);
+			dev->eps[UHOST_EP_IDX(index, index & UE_DIR_IN)].halted
+				= 0;
+			pthread_mutex_unlock(&dev->mtx);
+			break;
+		}
+		/* FALLTHROUGH */
+
+	default:
+		rc = libusb_control_transfer(dev->handle, ureq->bmRequestType,
+					     ureq->bRequest, value, index,
+					     data ? data->buf : NULL, len,
+					     UHOST_CTRL_TIMEOUT);
+		break;
+	}
+
+	if (rc == LIBUSB_ERROR_PIPE)
+		return USB_ERR_STALLED;
+	if (rc < 0) {
+		DPRINTF(("usb_host: control request failed: %s\r\n",
+			 libusb_error_name(rc)));
+		return USB_ERR_IOERROR;
+	}
+
+	err = USB_ERR_NORMAL_COMPLETION;
+	if (data) {
+		data->bdone = rc;
+		data->blen -= rc;
+		if ((ureq->bmRequestType & UT_READ) && data->blen > 0)
+			err = USB_ERR_SHORT_XFER;
+	}
+
+	return err;
+}
+
+static int
+uhost_data(void *scarg, struct usb_data_xfer *xfer, int dir, int epctx)
+{
+	struct uhost_dev *dev;
+	struct usb_data_xfer_block *blk;
+	struct uhost_xfer *ux;
+	struct uhost_ep *ep;
+	int	i, idx, pending;
+	int	err;
+
+	assert(xfer != NULL && xfer->head >= 0);
+
+	dev = scarg;
+	if (epctx <= 0 || epctx >= UHOST_MAX_EPS / 2)
+		return USB_ERR_INVAL;
+	ep = &dev->eps[UHOST_EP_IDX(epctx, dir)];
+
+	DPRINTF(("usb_host data - DIR=%s|EP=%d, ndata %d\r\n",
+		 dir ? "IN" : "OUT", epctx, xfer->ndata));
+
+	err = USB_ERR_NORMAL_COMPLETION;
+	pending = 0;
+
+	pthread_mutex_lock(&dev->mtx);
+
+	/* isochronous is not supported */
+	if (dev->handle == NULL ||
+	    (ep->type != LIBUSB_TRANSFER_TYPE_BULK &&
+	     ep->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)) {
+		USB_DATA_SET_ERRCODE(&xfer->data[xfer->head], USB_STALL);
+		err = USB_ERR_STALLED;
+		goto done;
+	}
+
+	USB_DATA_SET_ERRCODE(&xfer->data[xfer->head], USB_ACK);
+
+	idx = xfer->head;
+	for (i = 0; i < xfer->ndata;
+	     i++, idx = (idx + 1) % USB_MAX_XFER_BLOCKS) {
+		blk = &xfer->data[idx];
+		ux = &ep->x[idx];
+
+		if (blk->processed & 0xff)
+			continue;
+
+		if (blk->buf == NULL || blk->blen == 0) {
+			blk->processed = 1;
+			continue;
+		}
+
+		if (ux->state == UHOST_XFER_BUSY) {
+			pending++;
+			continue;
+		}
+
+		if (ux->state == UHOST_XFER_DONE && ux->buf == blk->buf) {
+			ux->state = UHOST_XFER_IDLE;
+			blk->processed = 1;
+			if (ux->status == LIBUSB_TRANSFER_COMPLETED) {
+				blk->bdone += ux->actual;
+				blk->blen -= ux->actual;
+				if (blk->blen > 0 &&
+				    err == USB_ERR_NORMAL_COMPLETION)
+					err = USB_ERR_SHORT_XFER;
+			} else if (ux->status == LIBUSB_TRANSFER_STALL) {
+				ep->halted = 1;
+				USB_DATA_SET_ERRCODE(blk, USB_STALL);
+				err = USB_ERR_STALLED;
+			} else
+				err = USB_ERR_IOERROR;
+			continue;
+		}
+
+		/* new block: run the transfer straight on the guest buffer */
+		if (uhost_submit(dev, ep, ux, blk) != 0) {
+			blk->processed = 1;
+			err = USB_ERR_IOERROR;
+			continue;
+		}
+		pending++;
+	}
+
+	if (pending > 0) {
+		USB_DATA_SET_ERRCODE(&xfer->data[xfer->head], USB_NAK);
+		err = USB_ERR_CANCELLED;
+	}
+
+done:
+	pthread_mutex_unlock(&dev->mtx);
+	return err;
+}
+
+/*
+ * Address Device and Reset Endpoint land here; only endpoints that
+ * stalled need the host side halt cleared, in-flight transfers on the
+ * others are left alone.
+ */
+static int
+uhost_reset(void *scarg)
+{
+	struct uhost_dev *dev;
+	uint32_t halted;
+	int i;
+
+	dev = scarg;
+	halted = 0;
+
+	pthread_mutex_lock(&dev->mtx);
+	for (i = 0; i < UHOST_MAX_EPS; i++) {
+		if (dev->eps[i].halted)
+			halted |= 1U << i;
+		dev->eps[i].halted = 0;
+	}
+	pthread_mutex_unlock(&dev->mtx);
+
+	/* synchronous, so never under dev->mtx */
+	for (i = 0; i < UHOST_MAX_EPS; i++)
+		if ((halted & (1U << i)) && dev->handle != NULL)
+			libusb_clear_halt(dev->handle, dev->eps[i].addr);
+
+	return 0;
+}
+
+static int
+uhost_stop(void *scarg)
+{
+	struct uhost_dev *dev;
+
+	dev = scarg;
+
+	pthread_mutex_lock(&dev->mtx);
+	uhost_cancel_all(dev);
+	pthread_mutex_unlock(&dev->mtx);
+
+	return 0;
+}
+
+static int
+uhost_remove(void *scarg)
+{
+	struct uhost_dev *dev;
+	int i, j;
+
+	dev = scarg;
+
+	pthread_mutex_lock(&dev->mtx);
+	uhost_cancel_all(dev);
+	dev->quit = 1;
+	pthread_cond_signal(&dev->notify_cond);
+	pthread_mutex_unlock(&dev->mtx);
+
+	/* it may be in hci_intr() right now, so wait for it */
+	pthread_join(dev->notify_tid, NULL);
+
+	uhost_release(dev);
+	libusb_close(dev->handle);
+
+	for (i = 0; i < UHOST_MAX_EPS; i++)
+		for (j = 0; j < USB_MAX_XFER_BLOCKS; j++)
+			libusb_free_transfer(dev->eps[i].x[j].xfr);
+	pthread_cond_destroy(&dev->notify_cond);
+	pthread_cond_destroy(&dev->cond);
+	pthread_mutex_destroy(&dev->mtx);
+	free(dev);
+	return 0;
+}
+
+struct usb_devemu ue_host = {
+	.ue_emu =	"usb-host",
+	.ue_usbver =	2,
+	.ue_usbspeed =	USB_SPEED_HIGH,
+	.ue_init =	uhost2_init,
+	.ue_request =	uhost_request,
+	.ue_data =	uhost_data,
+	.ue_reset =	uhost_reset,
+	.ue_remove =	uhost_remove,
+	.ue_stop =	uhost_stop
+};
+USB_EMUL_SET(ue_host);
+
+struct usb_devemu ue_host3 = {
+	.ue_emu =	"usb3-host",
+	.ue_usbver =	3,
+	.ue_usbspeed =	USB_SPEED_SUPER,
+	.ue_init =	uhost3_init,
+	.ue_request =	uhost_request,
+	.ue_data =	uhost_data,
+	.ue_reset =	uhost_reset,
+	.ue_remove =	uhost_remove,
+	.ue_stop =	uhost_stop
+};
+USB_EMUL_SET(ue_host3);
@@ -38,8 +38,10 @@
 #include "usb_core.h"
 #include "console.h"
 #include "gc.h"
+#include "monitor.h"
 
 static int umouse_debug;
+MONITOR_DEBUG(umouse, umouse_debug);
 #define	DPRINTF(params) do { if (umouse_debug) printf params; } while (0)
 #define	WPRINTF(params) (printf params)
 
@@ -40,14 +40,32 @@
 #include <sys/unistd.h>
 
 #define BLOCKIF_IOV_MAX		33	/* not practical to be IOV_MAX */
+#define BLOCKIF_IOV_EXT_MAX	1024	/* longest caller array, IOV_MAX */
 
+/*
+ * Request classes for throttling, numbered like the class in the top
+ * bits of a Linux ioprio. RT requests are never held back; IDLE ones
+ * are only let through while no BE request waits.
+ */
+#define BLOCKIF_PRIO_NONE	0	/* the disk's own class */
+#define BLOCKIF_PRIO_RT		1
+#define BLOCKIF_PRIO_BE		2
+#define BLOCKIF_PRIO_IDLE	3
+#define BLOCKIF_PRIO_SHIFT	13
+
+/*
+ * iov points at iov_buf unless the caller supplies a longer array of
+ * up to BLOCKIF_IOV_EXT_MAX entries; it must be set before submitting.
+ */
 struct blockif_req {
-	struct iovec	iov[BLOCKIF_IOV_MAX];
+	struct iovec	*iov;
 	int		iovcnt;
 	off_t		offset;
 	ssize_t		resid;
+	int		prio;		/* BLOCKIF_PRIO_* */
 	void		(*callback)(struct blockif_req *req, int err);
 	void		*param;
+	struct iovec	iov_buf[BLOCKIF_IOV_MAX];
 };
 
 struct blockif_ctxt;
@@ -60,10 +78,15 @@ void	blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off);
 int	blockif_queuesz(struct blockif_ctxt *bc);
 int	blockif_is_ro(struct blockif_ctxt *bc);
 int	blockif_candelete(struct blockif_ctxt *bc);
+int	blockif_fd(struct blockif_ctxt *bc);
+int	blockif_private(struct blockif_ctxt *bc);
+void	blockif_plug(struct blockif_ctxt *bc);
+void	blockif_unplug(struct blockif_ctxt *bc);
 int	blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq);
+int	blockif_write_zeroes(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_close(struct blockif_ctxt *bc);
 
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * qcow2 image support for block_if: a sparse, copy-on-write image that
+ * may be layered on a read-only backing file. Only the uncompressed,
+ * unencrypted subset without internal snapshot handling is supported.
+ */
+
+#ifndef _BLOCK_QCOW2_H_
+#define _BLOCK_QCOW2_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct qcow2;
+
+int	qcow2_probe(const char *path);
+struct qcow2 *qcow2_open(const char *path, int ro, int flags);
+void	qcow2_close(struct qcow2 *qc);
+int	qcow2_fd(struct qcow2 *qc);
+off_t	qcow2_size(struct qcow2 *qc);
+ssize_t	qcow2_readv(struct qcow2 *qc, const struct iovec *iov, int iovcnt,
+		    off_t offset);
+ssize_t	qcow2_writev(struct qcow2 *qc, const struct iovec *iov, int iovcnt,
+		     off_t offset);
+
+#endif /* _BLOCK_QCOW2_H_ */
@@ -38,6 +38,8 @@ typedef void (*ptr_event_func_t)(uint8_t mask, int x, int y, void *arg);
 void	console_init(int w, int h, void *fbaddr);
 
 void	console_set_fbaddr(void *fbaddr);
+int	console_import_dmabuf(int fd, int w, int h, int stride);
+void	console_mark_dirty(int x, int y, int w, int h);
 
 struct gfx_ctx_image *console_get_image(void);
 
@@ -45,9 +47,11 @@ void	console_fb_register(fb_render_func_t render_cb, void *arg);
 void	console_refresh(void);
 
 void	console_kbd_register(kbd_event_func_t event_cb, void *arg, int pri);
+void	console_kbd_unregister(void *arg);
 void	console_key_event(int down, uint32_t keysym);
 
 void	console_ptr_register(ptr_event_func_t event_cb, void *arg, int pri);
+void	console_ptr_unregister(void *arg);
 void	console_ptr_event(uint8_t button, int x, int y);
 
 #endif /* _CONSOLE_H_ */
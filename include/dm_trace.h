@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Static tracepoints on the I/O paths, as USDT probes in provider
+ * "acrn_dm" when the build finds <sys/sdt.h>, e.g.
+ * "bpftrace -e 'usdt:./acrn-dm:acrn_dm:vq_endchains { ... }'".
+ * A probe that nothing is attached to is a single nop; without
+ * <sys/sdt.h> the macros are empty and their arguments unevaluated.
+ */
+
+#ifndef _DM_TRACE_H_
+#define _DM_TRACE_H_
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define	DM_TRACE1(name, a)		DTRACE_PROBE1(acrn_dm, name, a)
+#define	DM_TRACE2(name, a, b)		DTRACE_PROBE2(acrn_dm, name, a, b)
+#define	DM_TRACE3(name, a, b, c)	DTRACE_PROBE3(acrn_dm, name, a, b, c)
+#define	DM_TRACE4(name, a, b, c, d)	DTRACE_PROBE4(acrn_dm, name, a, b, c, d)
+#else
+#define	DM_TRACE1(name, a)		do { } while (0)
+#define	DM_TRACE2(name, a, b)		do { } while (0)
+#define	DM_TRACE3(name, a, b, c)	do { } while (0)
+#define	DM_TRACE4(name, a, b, c, d)	do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * VM exit profiler: TSC time spent in handle_vmexit(), per vCPU, as log2
+ * histograms by exit type plus totals by device (port, MMIO page or PCI
+ * function).  Hot paths that do not run inside an exit are timed by
+ * the probes below.
+ */
+
+#ifndef _EXITPROF_H_
+#define _EXITPROF_H_
+
+#include "types.h"
+
+struct vhm_request;
+
+enum exitprof_probe {
+	EXITPROF_VQ_GETCHAIN,		/* one descriptor chain parsed */
+	EXITPROF_BLOCKIF_PROC,		/* one request on a blockif worker */
+	EXITPROF_MEVENT,		/* one mevent callback */
+	EXITPROF_NPROBE
+};
+
+extern int exitprof_enabled;
+
+static inline uint64_t
+exitprof_rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+int	exitprof_init(void);
+void	exitprof_record(int vcpu, struct vhm_request *req, uint64_t cycles);
+void	exitprof_probe(enum exitprof_probe probe, uint64_t cycles);
+
+#endif
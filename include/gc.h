@@ -37,12 +37,31 @@ struct gfx_ctx_image {
 	int		vgamode;
 	int		width;
 	int		height;
+	int		stride;		/* pixels per line of data */
 	uint32_t	*data;
 };
 
+/* area of the image changed since the renderer last looked */
+struct gfx_ctx_rect {
+	int		x;
+	int		y;
+	int		width;
+	int		height;
+};
+
 struct gfx_ctx *gc_init(int width, int height, void *fbaddr);
 void gc_set_fbaddr(struct gfx_ctx *gc, void *fbaddr);
 void gc_resize(struct gfx_ctx *gc, int width, int height);
 struct gfx_ctx_image *gc_get_image(struct gfx_ctx *gc);
 
+int gc_import_dmabuf(struct gfx_ctx *gc, int fd, int width, int height,
+		     int stride);
+void gc_mark_dirty(struct gfx_ctx *gc, int x, int y, int width, int height);
+int gc_get_dirty(struct gfx_ctx *gc, struct gfx_ctx_rect *rects, int max);
+int gc_enable_double_buffer(struct gfx_ctx *gc);
+uint32_t *gc_get_drawbuf(struct gfx_ctx *gc);
+void gc_swap(struct gfx_ctx *gc);
+void gc_begin_access(struct gfx_ctx *gc);
+void gc_end_access(struct gfx_ctx *gc);
+
 #endif /* _GC_H_ */
@@ -70,11 +70,12 @@ struct inout_port {
 	};								\
 	DATA_SET(inout_port_set, __CONCAT(__inout_port, __LINE__))
 
-void	init_inout(void);
+void	init_inout(struct vmctx *ctx);
 int	emulate_inout(struct vmctx *ctx, int *pvcpu, struct pio_request *req,
 		      int strict);
-int	register_inout(struct inout_port *iop);
-int	unregister_inout(struct inout_port *iop);
-void	init_bvmcons(void);
+int	register_inout(struct vmctx *ctx, struct inout_port *iop);
+int	unregister_inout(struct vmctx *ctx, struct inout_port *iop);
+int	inout_stats_init(struct vmctx *ctx);
+void	init_bvmcons(struct vmctx *ctx);
 
 #endif	/* _INOUT_H_ */
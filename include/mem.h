@@ -49,7 +49,8 @@ struct mem_range {
 #define	MEM_F_IMMUTABLE		0x4	/* mem_range cannot be unregistered */
 
 void	init_mem(void);
-int	emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req);
+int	emulate_mem(struct vmctx *ctx, int vcpu,
+		    struct mmio_request *mmio_req);
 int	register_mem(struct mem_range *memp);
 int	register_mem_fallback(struct mem_range *memp);
 int	unregister_mem(struct mem_range *memp);
@@ -32,16 +32,31 @@
 enum ev_type {
 	EVF_READ,
 	EVF_WRITE,
-	EVF_TIMER,		/* Not supported yet */
+	EVF_TIMER,		/* timerfd, drained before dispatch */
 	EVF_SIGNAL		/* Not supported yet */
 };
 
+/*
+ * mevent_add_flags() flags. MEVENT_F_EDGE registers the fd edge-triggered:
+ * the callback must consume everything available (until EAGAIN) or it
+ * is not called again until more data arrives.
+ */
+#define	MEVENT_F_EDGE	0x1
+
 char *vmname;
 struct mevent;
+struct mevent_loop;
 
 struct mevent *mevent_add(int fd, enum ev_type type,
 			  void (*func)(int, enum ev_type, void *),
 			  void *param);
+struct mevent *mevent_add_flags(int fd, enum ev_type type, int flags,
+				void (*func)(int, enum ev_type, void *),
+				void *param);
+struct mevent *mevent_add_on(struct mevent_loop *loop, int fd,
+			     enum ev_type type, int flags,
+			     void (*func)(int, enum ev_type, void *),
+			     void *param);
 int	mevent_enable(struct mevent *evp);
 int	mevent_disable(struct mevent *evp);
 int	mevent_delete(struct mevent *evp);
@@ -50,6 +65,9 @@ void	mevent_notify(void);
 
 void	mevent_dispatch(void);
 
+struct mevent_loop *mevent_loop_create(const char *name, int cpu);
+void	mevent_loop_destroy(struct mevent_loop *loop);
+
 #define list_foreach_safe(var, head, field, tvar)	\
 for ((var) = LIST_FIRST((head));			\
 	(var) && ((tvar) = LIST_NEXT((var), field), 1);\
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Runtime monitor: a unix socket serving counters and commands
+ * registered by any subsystem, and the DPRINTF switches of the files
+ * that declare them.
+ */
+
+#ifndef _MONITOR_H_
+#define _MONITOR_H_
+
+#include "types.h"
+
+/* print "key value..." lines for one source */
+typedef void (*monitor_dump_t)(int fd, void *arg);
+
+/* run a command; args is the rest of its line, or NULL */
+typedef void (*monitor_cmd_t)(int fd, void *arg, char *args);
+
+struct monitor_debug {
+	const char	*name;
+	int		*flag;
+};
+
+/* let the monitor flip a file's "static int xxx_debug" at runtime */
+#define	MONITOR_DEBUG(name, flag)					\
+	static struct monitor_debug __CONCAT(__monitor_debug_, name) =	\
+		{ #name, &(flag) };					\
+	DATA_SET(monitor_debug_set, __CONCAT(__monitor_debug_, name))
+
+int	monitor_init(const char *path);
+int	monitor_register(const char *name, monitor_dump_t dump, void *arg);
+int	monitor_register_cmd(const char *name, monitor_cmd_t fn, void *arg);
+void	monitor_unregister(void *arg);
+
+int	unix_listen(const char *path, int backlog);
+int	unix_accept(int fd);
+
+#endif
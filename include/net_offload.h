@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Software transmit checksum and TCP segmentation, for network backends
+ * that can't take frames with offloads pending.
+ */
+
+#ifndef _NET_OFFLOAD_H_
+#define _NET_OFFLOAD_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define NET_OFFLOAD_MAXSEGS	256	/* iovecs in one frame */
+#define NET_OFFLOAD_HDRMAX	256	/* headers rewritten per segment */
+
+/* The leading fields of a virtio-net header */
+struct net_offload_hdr {
+	uint8_t		flags;
+	uint8_t		gso_type;
+	uint16_t	hdr_len;
+	uint16_t	gso_size;
+	uint16_t	csum_start;
+	uint16_t	csum_offset;
+} __attribute__((packed));
+
+#define NET_OFFLOAD_F_NEEDS_CSUM	1
+
+#define NET_OFFLOAD_GSO_NONE		0
+#define NET_OFFLOAD_GSO_TCPV4		1
+#define NET_OFFLOAD_GSO_TCPV6		4
+#define NET_OFFLOAD_GSO_ECN		0x80
+
+typedef void (net_offload_xmit_t)(void *arg, struct iovec *iov, int iovcnt,
+				  int len);
+
+uint32_t	net_csum_add(uint32_t sum, const void *buf, size_t len);
+uint16_t	net_csum_fold(uint32_t sum);
+int	net_offload_tx(const struct net_offload_hdr *vh, struct iovec *iov,
+		       int iovcnt, int len, net_offload_xmit_t *xmit,
+		       void *arg);
+
+#endif /* _NET_OFFLOAD_H_ */
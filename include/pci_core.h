@@ -40,6 +40,7 @@
 struct vmctx;
 struct pci_vdev;
 struct memory_region;
+struct vm_snapshot;
 
 struct pci_vdev_ops {
 	char	*class_name;		/* Name of device class */
@@ -52,6 +53,27 @@ struct pci_vdev_ops {
 	void	(*vdev_deinit)(struct vmctx *, struct pci_vdev *,
 			char *opts);
 
+	/*
+	 * Optional slow backend setup (opening images, host devices),
+	 * run on its own thread concurrently with the other devices'
+	 * before any vdev_init.  It must not touch shared DM state or
+	 * modify opts; whatever it leaves in dev->prep is for vdev_init
+	 * to take, and vdev_unprepare releases what is left afterwards.
+	 */
+	int	(*vdev_prepare)(struct vmctx *, struct pci_vdev *,
+				char *opts);
+	void	(*vdev_unprepare)(struct vmctx *, struct pci_vdev *);
+
+	/*
+	 * Optional device state for a snapshot (see snapshot.h), on top
+	 * of the config space header the PCI core checks for every
+	 * device. vdev_restore runs after vdev_init, with the same opts.
+	 */
+	int	(*vdev_save)(struct vmctx *, struct pci_vdev *,
+			     struct vm_snapshot *);
+	int	(*vdev_restore)(struct vmctx *, struct pci_vdev *,
+				struct vm_snapshot *);
+
 	/* ACPI DSDT enumeration */
 	void	(*vdev_write_dsdt)(struct pci_vdev *);
 
@@ -73,6 +95,22 @@ struct pci_vdev_ops {
 	uint64_t  (*vdev_barread)(struct vmctx *ctx, int vcpu,
 				struct pci_vdev *pi, int baridx,
 				uint64_t offset, int size);
+
+	/*
+	 * Optional 8-byte BAR accesses, in one call; without them these
+	 * are split into two 4-byte ones.
+	 */
+	void	(*vdev_barwrite64)(struct vmctx *ctx, int vcpu,
+				   struct pci_vdev *pi, int baridx,
+				   uint64_t offset, uint64_t value);
+	uint64_t  (*vdev_barread64)(struct vmctx *ctx, int vcpu,
+				  struct pci_vdev *pi, int baridx,
+				  uint64_t offset);
+
+	/* Optional: the guest moved BAR baridx away from orig_addr */
+	void	(*vdev_update_bar_map)(struct vmctx *ctx,
+				       struct pci_vdev *pi, int baridx,
+				       uint64_t orig_addr);
 };
 
 /*
@@ -125,6 +163,8 @@ struct pci_vdev {
 	int	bar_getsize;
 	int	prevcap;
 	int	capend;
+	int	ext_cfg;	/* extended config space is the device's */
+	void	*prep;		/* vdev_prepare state until vdev_init */
 
 	struct {
 		int8_t	pin;
@@ -132,6 +172,8 @@ struct pci_vdev {
 		int		pirq_pin;
 		int		ioapic_irq;
 		pthread_mutex_t	lock;
+		int		line;	/* level last sent to the vPIC/vIOAPIC */
+		int		hold;	/* BAR accesses deferring line changes */
 	} lintr;
 
 	struct {
@@ -151,10 +193,20 @@ struct pci_vdev {
 		int	pba_size;
 		int	function_mask;
 		struct msix_table_entry *table;	/* allocated at runtime */
+		uint64_t *pba;		/* emulated pending bits */
 		void	*pba_page;
 		int	pba_page_offset;
 	} msix;
 
+	/*
+	 * What each I/O BAR registers as its inout handler arg, so that
+	 * a port access goes straight to its BAR.
+	 */
+	struct pci_iobar {
+		struct pci_vdev	*dev;
+		int		idx;
+	} iobar[PCI_BARMAX + 1];
+
 	void	*arg;		/* devemu-private data */
 
 	uint8_t	cfgdata[PCI_REGMAX + 1];
@@ -220,6 +272,8 @@ typedef void (*pci_lintr_cb)(int b, int s, int pin, int pirq_pin,
 
 int	init_pci(struct vmctx *ctx);
 void	deinit_pci(struct vmctx *ctx);
+int	pci_snapshot_save(struct vmctx *ctx, struct vm_snapshot *s);
+int	pci_snapshot_restore(struct vmctx *ctx, struct vm_snapshot *s);
 void	msicap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
 			int bytes, uint32_t val);
 void	msixcap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
@@ -230,6 +284,8 @@ int	pci_emul_alloc_bar(struct pci_vdev *pdi, int idx,
 int	pci_emul_alloc_pbar(struct pci_vdev *pdi, int idx,
 			    uint64_t hostbase, enum pcibar_type type,
 			    uint64_t size);
+int	pci_emul_add_capability(struct pci_vdev *dev, u_char *capdata,
+				int caplen);
 int	pci_emul_add_msicap(struct pci_vdev *pi, int msgnum);
 int	pci_emul_add_pciecap(struct pci_vdev *pi, int pcie_device_type);
 void	pci_generate_msi(struct pci_vdev *pi, int msgnum);
@@ -79,6 +79,8 @@
 #define IC_DEASSERT_IRQLINE            _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x01)
 #define IC_PULSE_IRQLINE               _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x02)
 #define IC_INJECT_MSI                  _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x03)
+#define IC_SET_IRQFD                   _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x04)
+#define IC_INJECT_MSI_BATCH            _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x05)
 
 /* DM ioreq management */
 #define IC_ID_IOREQ_BASE                0x30UL
@@ -87,11 +89,16 @@
 #define IC_CREATE_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x02)
 #define IC_ATTACH_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x03)
 #define IC_DESTROY_IOREQ_CLIENT         _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x04)
+#define IC_SET_IOEVENTFD                _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x05)
+#define IC_NOTIFY_REQUEST_FINISH_BATCH  _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x06)
+#define IC_SET_PIO_SHADOW               _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x07)
 
 /* Guest memory management */
 #define IC_ID_MEM_BASE                  0x40UL
 #define IC_ALLOC_MEMSEG                 _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x00)
 #define IC_SET_MEMSEG                   _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x01)
+#define IC_SET_MEMSEG_VMA               _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x02)
+#define IC_DIRTY_LOG                    _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x03)
 
 /* PCI assignment*/
 #define IC_ID_PCI_BASE                  0x50UL
@@ -100,6 +107,7 @@
 #define IC_VM_PCI_MSIX_REMAP           _IC_ID(IC_ID, IC_ID_PCI_BASE + 0x02)
 #define IC_SET_PTDEV_INTR_INFO         _IC_ID(IC_ID, IC_ID_PCI_BASE + 0x03)
 #define IC_RESET_PTDEV_INTR_INFO       _IC_ID(IC_ID, IC_ID_PCI_BASE + 0x04)
+#define IC_VM_PCI_MSIX_REMAP_BATCH     _IC_ID(IC_ID, IC_ID_PCI_BASE + 0x05)
 
 /**
  * struct vm_memseg - memory segment info for guest
@@ -133,6 +141,34 @@ struct vm_memmap {
 	uint32_t prot;	/* RWX */
 };
 
+/**
+ * struct vm_memmap_vma - EPT mapping of DM-allocated guest memory
+ *
+ * @type: memory mapping type, only VM_SYSMEM
+ * @flags: VM_MEMMAP_VMA_F_* flags
+ * @gpa: guest physical start address of memory mapping
+ * @vma_base: DM virtual address of the pages backing the range
+ * @len: the length of memory range mapped
+ * @prot: memory mapping attribute
+ *
+ * VHM pins the pages currently backing [vma_base, vma_base + len) and
+ * maps them at @gpa, keeping them pinned until the VM is destroyed.
+ *
+ * With VM_MEMMAP_VMA_F_LAZY nothing is pinned: VHM resolves EPT
+ * violations in the range by faulting in the DM page on demand and drops
+ * the EPT entry again when the DM releases that page (MADV_REMOVE).
+ */
+#define VM_MEMMAP_VMA_F_LAZY	0x1
+
+struct vm_memmap_vma {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t gpa;
+	uint64_t vma_base;
+	uint64_t len;
+	uint32_t prot;
+};
+
 /**
  * struct ic_ptdev_irq - pass thru device irq data structure
  */
@@ -184,6 +220,144 @@ struct ioreq_notify {
        uint32_t vcpu;
 };
 
+/**
+ * struct acrn_vm_pci_msix_remap_batch - remap several MSI/MSI-X vectors
+ *
+ * @count: number of entries at @remaps
+ * @remaps: user address of an array of struct acrn_vm_pci_msix_remap,
+ *	    each updated as by IC_VM_PCI_MSIX_REMAP
+ */
+struct acrn_vm_pci_msix_remap_batch {
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t remaps;
+};
+
+/**
+ * struct acrn_dirty_log - log guest writes to a range of guest memory
+ *
+ * @op: ACRN_DIRTY_LOG_START, _GET or _STOP
+ * @gpa: start of the range, page aligned
+ * @size: size of the range in bytes
+ * @bitmap: for _GET, user address of a bitmap with a bit per 4K page of
+ *	    the range; bits of pages written since the last _GET are set,
+ *	    the others are left alone, and the log is cleared
+ */
+struct acrn_dirty_log {
+#define ACRN_DIRTY_LOG_START	0
+#define ACRN_DIRTY_LOG_GET	1
+#define ACRN_DIRTY_LOG_STOP	2
+	uint32_t op;
+	uint32_t reserved;
+	uint64_t gpa;
+	uint64_t size;
+	uint64_t bitmap;
+};
+
+/**
+ * struct acrn_msi_batch - inject several MSIs with one call
+ *
+ * @count: number of entries at @msis
+ * @msis: user address of an array of struct acrn_msi_entry, each
+ *	  injected as by IC_INJECT_MSI, in array order
+ */
+struct acrn_msi_batch {
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t msis;
+};
+
+/**
+ * struct ioreq_notify_batch - notify hypervisor several ioreqs are handled
+ *
+ * @client_id: client id to identify ioreq client
+ * @vcpu_mask: bit n set if the ioreq submitted by vcpu n is handled
+ */
+struct ioreq_notify_batch {
+	int32_t client_id;
+	uint32_t reserved;
+	uint64_t vcpu_mask;
+};
+
+/**
+ * struct acrn_ioeventfd - bind a guest I/O write to an eventfd
+ *
+ * Once bound, a guest write to @addr is completed by VHM itself and
+ * signalled on @fd, without waking up the ioreq client.
+ *
+ * @fd: eventfd to signal
+ * @flags: ACRN_IOEVENTFD_FLAG_*
+ * @addr: guest PIO port or MMIO address
+ * @len: access size in bytes
+ * @data: value the guest must write to match (DATAMATCH only)
+ */
+struct acrn_ioeventfd {
+#define ACRN_IOEVENTFD_FLAG_PIO		0x01
+#define ACRN_IOEVENTFD_FLAG_DATAMATCH	0x02
+#define ACRN_IOEVENTFD_FLAG_DEASSIGN	0x04
+	int32_t fd;
+	uint32_t flags;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t data;
+};
+
+/**
+ * struct acrn_pio_shadow_page - register file shared with the hypervisor
+ *
+ * Layout of the page registered with IC_SET_PIO_SHADOW for an
+ * index/data port pair. A guest read of the data port while @seq is even
+ * and bit @index of @readable is set is answered from @regs[@index]
+ * without an exit to the DM; everything else, including all writes, is
+ * forwarded as usual. The DM makes @seq odd while it updates the page.
+ *
+ * @seq: update sequence, odd while the DM is writing
+ * @index: register selected through the index port
+ * @readable: bitmap of registers whose reads have no side effects
+ * @regs: current register values
+ */
+struct acrn_pio_shadow_page {
+	uint32_t seq;
+	uint8_t index;
+	uint8_t reserved[3];
+	uint8_t readable[32];
+	uint8_t regs[256];
+};
+
+/**
+ * struct acrn_pio_shadow - answer data port reads from a shared page
+ *
+ * @index_port: guest PIO port selecting the register
+ * @data_port: guest PIO port reading the register
+ * @flags: ACRN_PIO_SHADOW_FLAG_*
+ * @page: user address of a page-aligned struct acrn_pio_shadow_page
+ */
+struct acrn_pio_shadow {
+#define ACRN_PIO_SHADOW_FLAG_DEASSIGN	0x01
+	uint16_t index_port;
+	uint16_t data_port;
+	uint32_t flags;
+	uint64_t page;
+};
+
+/**
+ * struct acrn_irqfd - bind an MSI to an eventfd
+ *
+ * Once bound, every write to @fd injects @msi into the guest from the
+ * kernel side, which may coalesce back-to-back signals.
+ *
+ * @fd: eventfd to watch
+ * @flags: ACRN_IRQFD_FLAG_*
+ * @msi: MSI address/data pair to inject
+ */
+struct acrn_irqfd {
+#define ACRN_IRQFD_FLAG_DEASSIGN	0x01
+	int32_t fd;
+	uint32_t flags;
+	struct acrn_msi_entry msi;
+};
+
 /**
  * struct api_version - data structure to track VHM API version
  *
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Boot-ready VM snapshots. -o saves one once the VM is set up: the
+ * kernel, ramdisk, ACPI and the other guest tables are in guest RAM and
+ * every device is initialized, but no vCPU has run yet. -R starts a VM
+ * from it, mapping guest RAM back copy-on-write from the file and
+ * skipping sw_load and the table builders.
+ *
+ * A guest that has run can't be snapshotted: its vCPU registers, LAPIC
+ * and vIOAPIC state live in the hypervisor, and the VHM interface has
+ * no call to read or load them. A restored VM's vCPUs therefore start
+ * from reset, as on a cold boot, and the devices are restored to the
+ * state they had at that point.
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "types.h"
+
+struct vmctx;
+
+/* device state: appended by vdev_save, consumed in order by vdev_restore */
+struct vm_snapshot {
+	uint8_t	*buf;
+	size_t	len;		/* bytes in buf */
+	size_t	size;		/* allocated */
+	size_t	off;		/* read position */
+};
+
+int	snapshot_write(struct vm_snapshot *s, const void *data, size_t len);
+int	snapshot_read(struct vm_snapshot *s, void *data, size_t len);
+
+int	snapshot_save(struct vmctx *ctx, const char *path, int ncpus);
+int	snapshot_open(struct vmctx *ctx, const char *path, size_t *memsize,
+		      int *ncpus);
+int	snapshot_restore_devices(struct vmctx *ctx);
+
+#endif
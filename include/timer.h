@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Timer service: a hierarchical timer wheel driven by a single timerfd
+ * on the mevent loop. Callbacks run on the mevent thread.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <sys/queue.h>
+#include <time.h>
+
+#include "types.h"
+
+struct acrn_timer {
+	/* called with the number of expirations since the last call */
+	void	(*callback)(void *, uint64_t);
+	void	*callback_param;
+
+	/* private to the timer service */
+	uint64_t deadline;	/* CLOCK_MONOTONIC ns */
+	uint64_t period;	/* ns, 0 for one-shot */
+	uint64_t expires;	/* wheel tick */
+	int	level;		/* wheel level, -1 if not queued */
+	int	slot;
+	LIST_ENTRY(acrn_timer) list;
+};
+
+int	acrn_timer_init(struct acrn_timer *timer,
+			void (*cb)(void *, uint64_t), void *param);
+void	acrn_timer_deinit(struct acrn_timer *timer);
+int	acrn_timer_settime(struct acrn_timer *timer,
+			   const struct itimerspec *new_value);
+
+#endif /* _TIMER_H_ */
@@ -62,10 +62,17 @@ struct vbs_dev_info {
 	uint64_t pio_range_len;	/* PIO bar address initialized by guest OS */
 };
 
+struct vbs_backend_info {
+	uint32_t idx;		/* virtqueue index */
+	int32_t fd;		/* host fd backing this virtqueue, e.g. tap */
+};
+
 /* reuse vhost ioctl index */
 #define VBS_K_IOCTL	0xAF
 
 #define VBS_K_SET_DEV _IOW(VBS_K_IOCTL, 0x00, struct vbs_dev_info)
 #define VBS_K_SET_VQ _IOW(VBS_K_IOCTL, 0x01, struct vbs_vqs_info)
+/* same number as VHOST_NET_SET_BACKEND */
+#define VBS_K_SET_BACKEND _IOW(VBS_K_IOCTL, 0x30, struct vbs_backend_info)
 
 #endif /* _VBS_COMMON_IF_H_ */
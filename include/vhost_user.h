@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Master side of the vhost-user protocol: a backend in another process
+ * services the virtqueues of a device out of shared guest memory.
+ */
+
+#ifndef _VHOST_USER_H_
+#define _VHOST_USER_H_
+
+#include <stdint.h>
+
+struct vmctx;
+struct mevent;
+struct mevent_loop;
+struct virtio_vq_info;
+
+#define VHOST_USER_F_PROTOCOL_FEATURES	(1ULL << 30)
+
+#define VHOST_USER_PROTOCOL_F_MQ	(1ULL << 0)
+#define VHOST_USER_PROTOCOL_F_CONFIG	(1ULL << 9)
+
+#define VHOST_USER_MAXQ			16
+
+struct vhost_user {
+	int		fd;		/* socket to the backend, -1 if lost */
+	uint64_t	features;	/* offered by the backend */
+	uint64_t	protocol;	/* protocol features in use */
+	int		started;	/* the backend owns the rings */
+	struct vmctx	*ctx;
+
+	/*
+	 * Kicks go to the eventfd VHM signals for QNOTIFY if there is
+	 * one, else they are relayed by vhost_user_kick(). Interrupts
+	 * come back on callfd and go through vq_interrupt().
+	 */
+	struct virtio_vq_info *queues;
+	int		nvq;
+	int		kick[VHOST_USER_MAXQ];
+	int		kickfd[VHOST_USER_MAXQ];
+	int		callfd[VHOST_USER_MAXQ];
+	struct mevent	*callev[VHOST_USER_MAXQ];
+};
+
+struct vhost_user *vhost_user_open(struct vmctx *ctx, const char *path,
+				   uint64_t protocol);
+void vhost_user_close(struct vhost_user *vu);
+
+/* setup, before the device is linked up */
+int vhost_user_get_queue_num(struct vhost_user *vu, uint64_t *num);
+int vhost_user_get_config(struct vhost_user *vu, void *cfg, uint32_t size);
+int vhost_user_init_queues(struct vhost_user *vu,
+			   struct virtio_vq_info *queues, int nvq,
+			   struct mevent_loop *loop);
+
+/* handing the rings over on DRIVER_OK, and taking them back on reset */
+int vhost_user_start(struct vhost_user *vu, uint64_t features);
+int vhost_user_enable(struct vhost_user *vu, int idx, int enable);
+int vhost_user_stop(struct vhost_user *vu);
+
+/* a guest kick the backend didn't get directly */
+void vhost_user_kick(struct vhost_user *vu, struct virtio_vq_info *vq);
+
+#endif
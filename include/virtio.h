@@ -215,6 +215,9 @@ struct vring_used {
 #define	VIRTIO_TYPE_RPMSG	7
 #define	VIRTIO_TYPE_SCSI	8
 #define	VIRTIO_TYPE_9P		9
+#define	VIRTIO_TYPE_INPUT	18
+#define	VIRTIO_TYPE_VSOCK	19
+#define	VIRTIO_TYPE_FS		26
 
 /*
  * ACRN virtio device types
@@ -236,8 +239,12 @@ struct vring_used {
 #define	VIRTIO_VENDOR		0x1AF4
 #define	VIRTIO_DEV_NET		0x1000
 #define	VIRTIO_DEV_BLOCK	0x1001
+#define	VIRTIO_DEV_BALLOON	0x1002
 #define	VIRTIO_DEV_CONSOLE	0x1003
 #define	VIRTIO_DEV_RANDOM	0x1005
+#define	VIRTIO_DEV_VSOCK	0x1012
+#define	VIRTIO_DEV_FS		0x101a	/* no transitional id assigned */
+#define	VIRTIO_DEV_INPUT	0x1052	/* modern only */
 
 /*
  * ACRN virtio device IDs
@@ -284,6 +291,8 @@ struct vring_used {
 				/* guest OS driver is loaded */
 #define	VIRTIO_CR_STATUS_DRIVER_OK	0x04
 				/* guest OS driver ready */
+#define	VIRTIO_CR_STATUS_FEATURES_OK	0x08
+				/* feature negotiation done (modern) */
 #define	VIRTIO_CR_STATUS_FAILED		0x80
 				/* guest has given up on this dev */
 
@@ -299,6 +308,61 @@ struct vring_used {
 
 #define VIRTIO_MSI_NO_VECTOR	0xFFFF
 
+/*
+ * Virtio 1.0 ("modern") PCI transport.  The registers are in a memory
+ * BAR instead of the I/O BAR, found through vendor capabilities.  We
+ * put the four structures one page apart: the common configuration
+ * (the modern version of the registers above), the ISR byte, the
+ * device-specific config and the notify doorbells, one per queue.
+ */
+#define	VIRTIO_PCI_CAP_COMMON_CFG	1
+#define	VIRTIO_PCI_CAP_NOTIFY_CFG	2
+#define	VIRTIO_PCI_CAP_ISR_CFG		3
+#define	VIRTIO_PCI_CAP_DEVICE_CFG	4
+
+#define	VIRTIO_MODERN_COMMON		0x0000
+#define	VIRTIO_MODERN_ISR		0x1000
+#define	VIRTIO_MODERN_DEVICE		0x2000
+#define	VIRTIO_MODERN_NOTIFY		0x3000
+#define	VIRTIO_MODERN_BARSZ		0x4000
+#define	VIRTIO_MODERN_NOTIFY_MUL	4	/* bytes between doorbells */
+
+#define	VIRTIO_COMMON_DFSELECT		0
+#define	VIRTIO_COMMON_DF		4
+#define	VIRTIO_COMMON_GFSELECT		8
+#define	VIRTIO_COMMON_GF		12
+#define	VIRTIO_COMMON_MSIX		16
+#define	VIRTIO_COMMON_NUMQ		18
+#define	VIRTIO_COMMON_STATUS		20
+#define	VIRTIO_COMMON_CFGGEN		21
+#define	VIRTIO_COMMON_Q_SELECT		22
+#define	VIRTIO_COMMON_Q_SIZE		24
+#define	VIRTIO_COMMON_Q_MSIX		26
+#define	VIRTIO_COMMON_Q_ENABLE		28
+#define	VIRTIO_COMMON_Q_NOFF		30
+#define	VIRTIO_COMMON_Q_DESCLO		32
+#define	VIRTIO_COMMON_Q_DESCHI		36
+#define	VIRTIO_COMMON_Q_AVAILLO		40
+#define	VIRTIO_COMMON_Q_AVAILHI		44
+#define	VIRTIO_COMMON_Q_USEDLO		48
+#define	VIRTIO_COMMON_Q_USEDHI		52
+
+struct virtio_pci_cap {
+	uint8_t		cap_vndr;	/* PCIY_VENDOR */
+	uint8_t		cap_next;
+	uint8_t		cap_len;
+	uint8_t		cfg_type;	/* VIRTIO_PCI_CAP_* */
+	uint8_t		bar;
+	uint8_t		padding[3];
+	uint32_t	offset;		/* within the BAR */
+	uint32_t	length;
+} __attribute__((packed));
+
+struct virtio_pci_notify_cap {
+	struct virtio_pci_cap cap;
+	uint32_t	notify_off_multiplier;
+} __attribute__((packed));
+
 /*
  * Feature flags.
  * Note: bits 0 through 23 are reserved to each device type.
@@ -306,6 +370,7 @@ struct vring_used {
 #define	VIRTIO_F_NOTIFY_ON_EMPTY	(1 << 24)
 #define	VIRTIO_RING_F_INDIRECT_DESC	(1 << 28)
 #define	VIRTIO_RING_F_EVENT_IDX		(1 << 29)
+#define	VIRTIO_F_VERSION_1		(1ULL << 32)	/* modern only */
 
 /* From section 2.3, "Virtqueue Configuration", of the virtio specification */
 /**
@@ -367,7 +432,10 @@ struct virtio_vq_info;
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
+#define	VIRTIO_USE_IOEVENTFD	0x04	/* deliver QNOTIFY via eventfd */
+#define	VIRTIO_USE_IRQFD	0x10	/* inject MSI-X via irqfd */
 #define	VIRTIO_BROKED		0x08	/* ??? */
+#define	VIRTIO_USE_MODERN	0x20	/* modern registers in modern_bar */
 
 /**
  * @brief Base component to any virtio device
@@ -377,12 +445,16 @@ struct virtio_base {
 	int	flags;			/**< VIRTIO_* flags from above */
 	pthread_mutex_t *mtx;		/**< POSIX mutex, if any */
 	struct pci_vdev *dev;		/**< PCI device instance */
-	uint32_t negotiated_caps;	/**< negotiated capabilities */
+	uint64_t negotiated_caps;	/**< negotiated capabilities */
 	struct virtio_vq_info *queues;	/**< one per nvq */
 	int	curq;			/**< current queue */
 	uint8_t	status;			/**< value from last status write */
 	uint8_t	isr;			/**< ISR flags, if not MSI-X */
 	uint16_t msix_cfg_idx;		/**< MSI-X vector for config event */
+	struct virtio_iothread *iothread; /**< runs notify, if not NULL */
+	int	modern_bar;		/**< BAR of the modern registers */
+	uint32_t dfselect;		/**< modern device feature select */
+	uint32_t gfselect;		/**< modern driver feature select */
 };
 
 #define	VIRTIO_BASE_LOCK(vb)					\
@@ -451,10 +523,15 @@ struct virtio_vq_info {
 
 	uint16_t flags;		/**< flags (see above) */
 	uint16_t last_avail;	/**< a recent value of avail->idx */
+	uint16_t avail_idx;	/**< avail->idx when last read */
+	uint16_t used_idx;	/**< used->idx; only we write it */
 	uint16_t save_used;	/**< saved used->idx; see vq_endchains */
 	uint16_t msix_idx;	/**< MSI-X index, or VIRTIO_MSI_NO_VECTOR */
 
 	uint32_t pfn;		/**< PFN of virt queue (not shifted!) */
+	uint64_t gpa_desc;	/**< modern: guest address of desc */
+	uint64_t gpa_avail;	/**< modern: guest address of avail */
+	uint64_t gpa_used;	/**< modern: guest address of used */
 
 	volatile struct virtio_desc *desc;
 				/**< descriptor array */
@@ -463,6 +540,32 @@ struct virtio_vq_info {
 	volatile struct vring_used *used;
 				/**< the "used" ring */
 
+	char	*gpa_base;	/**< host address of guest physical 0 */
+	uint64_t lowmem_end;	/**< end of guest lowmem */
+	uint64_t highmem_end;	/**< end of guest highmem, 0 if none */
+
+	int	ioeventfd;	/**< eventfd bound to QNOTIFY, or -1 */
+	struct mevent *ioevent;	/**< mevent watching ioeventfd */
+
+	int	irqfd;		/**< eventfd bound to the MSI-X vector, or -1 */
+	uint64_t irqfd_addr;	/**< MSI address irqfd is bound to */
+	uint32_t irqfd_data;	/**< MSI data irqfd is bound to */
+
+	uint64_t kicks;		/**< guest notifications, for the monitor */
+	uint64_t intrs;		/**< interrupts sent, for the monitor */
+
+	uint16_t coal_max;	/**< interrupt after this many used, 0 = off */
+	uint16_t coal_idx;	/**< used->idx at the last vq_endchains */
+	uint32_t coal_usec;	/**< ... or this long after holding one back */
+	int	coal_armed;	/**< an interrupt is being held back */
+	int	coal_fd;	/**< timerfd for coal_usec, or -1 */
+	struct mevent *coal_ev;	/**< mevent watching coal_fd */
+	pthread_mutex_t coal_mtx; /**< vq_endchains vs. the timer */
+
+	struct virtio_vq_info *iot_next; /**< next kicked queue on iothread */
+	int	iot_queued;	/**< on the iothread's list */
+	struct virtio_vq_info *iot_poll_next; /**< next polled queue */
+	int	iot_polled;	/**< kicks off, the iothread polls it */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -488,6 +591,8 @@ vq_ring_ready(struct virtio_vq_info *vq)
  * @brief Are there "available" descriptors?
  *
  * This does not count how many, just returns 1 if there is any.
+ * The guest's avail->idx is only read again once everything seen
+ * the last time it was read has been consumed.
  *
  * @param vq Pointer to struct virtio_vq_info.
  *
@@ -496,10 +601,28 @@ vq_ring_ready(struct virtio_vq_info *vq)
 static inline int
 vq_has_descs(struct virtio_vq_info *vq)
 {
-	return (vq_ring_ready(vq) && vq->last_avail !=
-	    vq->avail->idx);
+	if (!vq_ring_ready(vq))
+		return 0;
+	if (vq->last_avail != vq->avail_idx)
+		return 1;
+	vq->avail_idx = vq->avail->idx;
+	return vq->last_avail != vq->avail_idx;
 }
 
+/**
+ * @brief Deliver an MSI-X interrupt on the given virtqueue via irqfd.
+ *
+ * The irqfd is (re)bound whenever the MSI-X table entry of the queue's
+ * vector changes, so only the first interrupt after a change costs an
+ * ioctl.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return 0 if handled, non-zero to fall back to pci_generate_msix().
+ */
+int vq_irqfd_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq);
+
 /**
  * @brief Deliver an interrupt to guest on the given virtqueue.
  *
@@ -513,9 +636,11 @@ vq_has_descs(struct virtio_vq_info *vq)
 static inline void
 vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
 {
-	if (pci_msix_enabled(vb->dev))
-		pci_generate_msix(vb->dev, vq->msix_idx);
-	else {
+	__atomic_add_fetch(&vq->intrs, 1, __ATOMIC_RELAXED);
+	if (pci_msix_enabled(vb->dev)) {
+		if (vq_irqfd_interrupt(vb, vq) != 0)
+			pci_generate_msix(vb->dev, vq->msix_idx);
+	} else {
 		VIRTIO_BASE_LOCK(vb);
 		vb->isr |= VIRTIO_CR_ISR_QUEUES;
 		pci_generate_msi(vb->dev, 0);
@@ -524,7 +649,97 @@ vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
 	}
 }
 
+/**
+ * @brief Notify the guest that the device-specific config has changed.
+ *
+ * @param vb Pointer to struct virtio_base.
+ *
+ * @return NULL
+ */
+static inline void
+virtio_config_changed(struct virtio_base *vb)
+{
+	if (pci_msix_enabled(vb->dev)) {
+		if (vb->msix_cfg_idx != VIRTIO_MSI_NO_VECTOR)
+			pci_generate_msix(vb->dev, vb->msix_cfg_idx);
+	} else {
+		VIRTIO_BASE_LOCK(vb);
+		vb->isr |= VIRTIO_CR_ISR_CONF_CHANGED;
+		pci_generate_msi(vb->dev, 0);
+		pci_lintr_assert(vb->dev);
+		VIRTIO_BASE_UNLOCK(vb);
+	}
+}
+
 struct iovec;
+struct virtio_iothread;
+
+#define	VIRTIO_IOTHREAD_MAX	8	/**< shared iothreads, iothread=0..7 */
+
+/**
+ * @brief Run a device's queue notify handlers on an I/O thread.
+ *
+ * A kick then only queues the virtqueue for the thread, which calls
+ * the handler with the base lock held, as the kick path would have.
+ * Call after virtio_linkup().
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param id Shared iothread 0..VIRTIO_IOTHREAD_MAX-1, or -1 for one
+ * of the device's own.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int virtio_iothread_attach(struct virtio_base *vb, int id);
+
+/**
+ * @brief Stop running a device's notify handlers on its iothread.
+ *
+ * Drops its kicked queues and waits for a handler already running.
+ *
+ * @param vb Pointer to struct virtio_base.
+ *
+ * @return N/A
+ */
+void virtio_iothread_detach(struct virtio_base *vb);
+
+/**
+ * @brief Busy-poll the queues of a device's iothread before sleeping.
+ *
+ * Once a queue's handler has run, the iothread keeps the guest from
+ * kicking it and watches avail->idx instead, for usec after the last
+ * chain it found; only then does it let the guest kick again and
+ * sleep.  With several devices on one iothread the longest timeout
+ * wins.  Call after virtio_iothread_attach().
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param usec Idle time before kicks are turned back on.
+ * @param cpu Host CPU to pin the iothread to, or -1.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int virtio_iothread_set_poll(struct virtio_base *vb, int usec, int cpu);
+
+/**
+ * @brief Parse the "<usec>[@<cpu>]" value of a "poll=" option.
+ *
+ * @param val Value.
+ * @param usec Returned idle timeout, 1 to 1000000.
+ * @param cpu Returned host CPU, -1 if not given.
+ *
+ * @return 0 on success, -1 if val is malformed.
+ */
+int virtio_parse_poll(const char *val, int *usec, int *cpu);
+
+/**
+ * @brief Parse an "iothread[=<id>]" device option.
+ *
+ * @param opt Option.
+ * @param id Returned iothread id, -1 for the device's own thread.
+ *
+ * @return 1 if opt is a valid iothread option, 0 if it is not an
+ * iothread option, -1 if it is malformed.
+ */
+int virtio_parse_iothread(const char *opt, int *id);
 
 /**
  * @brief Link a virtio_base to its constants, the virtio device,
@@ -591,6 +806,21 @@ void virtio_reset_dev(struct virtio_base *vb);
  */
 void virtio_set_io_bar(struct virtio_base *vb, int barnum);
 
+/**
+ * @brief Set a memory BAR for the virtio 1.0 registers.
+ *
+ * Adds the vendor capabilities that point the guest at them.  A device
+ * can have both this and the I/O BAR (transitional) or only this one
+ * (modern only, e.g. virtio-input).  VIRTIO_F_VERSION_1 is offered on
+ * the modern registers only.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param barnum Which BAR[0..5] to use.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int virtio_set_modern_bar(struct virtio_base *vb, int barnum);
+
 /**
  * @brief Walk through the chain of descriptors involved in a request
  * and put them into a given iov[] array.
@@ -607,6 +837,27 @@ void virtio_set_io_bar(struct virtio_base *vb, int barnum);
 int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		struct iovec *iov, int n_iov, uint16_t *flags);
 
+/**
+ * @brief Fetch a batch of request chains with a single read of the
+ * available index.
+ *
+ * Chains are packed back to back into iov[] and flags[].  A chain
+ * that doesn't fit in what is left of iov[] stays in the ring.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Array of nchains available ring positions.
+ * @param iov Pointer to iov[] array prepared by caller.
+ * @param n_iov Size of iov[] array.
+ * @param flags Pointer to a uint16_t array of size n_iov, or NULL.
+ * @param n Array of nchains, set to the descriptor count of each chain.
+ * @param nchains Maximum number of chains to fetch.
+ *
+ * @return number of chains, or -1 if the first chain is invalid.
+ */
+int vq_getchains(struct virtio_vq_info *vq, uint16_t *idx,
+		 struct iovec *iov, int n_iov, uint16_t *flags,
+		 int *n, int nchains);
+
 /**
  * @brief Return the currently-first request chain back to the
  * available ring.
@@ -629,6 +880,22 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Return several request chains to the guest at once.
+ *
+ * The used index is only advanced after all entries are written, so
+ * the guest never sees part of the set (e.g. merged rx buffers).
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Array of available ring positions, returned by vq_getchain().
+ * @param iolen Array of data bytes to be returned for each chain.
+ * @param n Number of chains.
+ *
+ * @return N/A
+ */
+void vq_relchains(struct virtio_vq_info *vq, uint16_t *idx, uint32_t *iolen,
+		  int n);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -642,6 +909,59 @@ void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
  */
 void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
 
+/**
+ * @brief Coalesce the interrupts of a queue.
+ *
+ * An interrupt vq_endchains() would send is held back until max used
+ * entries have built up, or for at most usec microseconds.  Call after
+ * virtio_linkup(); the policy takes effect when the guest sets the
+ * queue up.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param max Used entries per interrupt, 0 or 1 to disable.
+ * @param usec Maximum delay of an interrupt.
+ *
+ * @return 0 on success, -1 if max or usec are out of range.
+ */
+int vq_set_coalesce(struct virtio_vq_info *vq, int max, int usec);
+
+/**
+ * @brief Parse the value of a "coalesce=<max>:<usec>" device option.
+ *
+ * @param val Option value.
+ * @param max Returned used entries per interrupt.
+ * @param usec Returned maximum delay in microseconds.
+ *
+ * @return 0 on success, -1 on malformed value.
+ */
+int virtio_parse_coalesce(const char *val, int *max, int *usec);
+
+/**
+ * @brief Ask the guest to stop kicking this queue.
+ *
+ * Without EVENT_IDX this sets VRING_USED_F_NO_NOTIFY.  With it,
+ * nothing needs doing: avail_event is left behind the guest, which
+ * then won't kick until vq_kick_enable() moves it up again.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return N/A
+ */
+void vq_kick_disable(struct virtio_vq_info *vq);
+
+/**
+ * @brief Ask the guest to kick this queue again once it adds
+ * a chain, and recheck for chains added in the meantime.
+ *
+ * Every kick-driven queue of a device offering VIRTIO_RING_F_EVENT_IDX
+ * must call this once it has drained the ring, or kicks stop.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return 1 if chains are available (keep going), 0 otherwise.
+ */
+int vq_kick_enable(struct virtio_vq_info *vq);
+
 /**
  * @brief Handle PCI configuration space reads.
  *
@@ -678,6 +998,54 @@ uint64_t virtio_pci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
  */
 void virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		      int baridx, uint64_t offset, int size, uint64_t value);
+
+/**
+ * @brief Handle 8-byte BAR reads.
+ *
+ * MSI-X table entries are read in one go, anything else as two 4-byte
+ * reads through virtio_pci_read().
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param vcpu VCPU ID.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param baridx Which BAR[0..5] to use.
+ * @param offset Register offset in bytes within a BAR region.
+ *
+ * @return register value.
+ */
+uint64_t virtio_pci_read64(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+			   int baridx, uint64_t offset);
+
+/**
+ * @brief Handle 8-byte BAR writes.
+ *
+ * MSI-X table entries are written in one go, so the vector is never
+ * seen half updated; anything else as two 4-byte writes.
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param vcpu VCPU ID.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param baridx Which BAR[0..5] to use.
+ * @param offset Register offset in bytes within a BAR region.
+ * @param value Data value to be written into register.
+ *
+ * @return N/A
+ */
+void virtio_pci_write64(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+			int baridx, uint64_t offset, uint64_t value);
+
+/**
+ * @brief Follow a BAR0 move with the QNOTIFY ioeventfds.
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param baridx Which BAR[0..5] moved.
+ * @param orig_addr Address the BAR decoded before.
+ *
+ * @return N/A
+ */
+void virtio_pci_update_bar_map(struct vmctx *ctx, struct pci_vdev *dev,
+			       int baridx, uint64_t orig_addr);
 /**
  * @}
  */
@@ -63,4 +63,7 @@ int vbs_kernel_start(int fd, struct vbs_dev_info *dev,
 		     struct vbs_vqs_info *vqs);
 int vbs_kernel_stop(int fd);
 
+/* VBS-K backend fd for devices driven by a host fd */
+int vbs_kernel_set_backend(int fd, struct vbs_backend_info *backend);
+
 #endif
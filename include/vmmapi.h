@@ -39,7 +39,13 @@
 #define	VMMAPI_VERSION	0103	/* 2 digit major followed by 2 digit minor */
 
 struct iovec;
+struct inout_stats;
 
+/*
+ * Per-VM state.  The MMIO range trees (mem.c), pci_businfo (pci/core.c)
+ * and the main loop are process-wide, so the device model runs one VM
+ * per process.
+ */
 struct vmctx {
 	int     fd;
 	int     vmid;
@@ -50,8 +56,18 @@ struct vmctx {
 	size_t  highmem;
 	char    *mmap_lowmem;
 	char    *mmap_highmem;
+	int	lowmem_fd;	/* memfd backing each segment, or -1 */
+	int	highmem_fd;
 	char    *baseaddr;
 	char    *name;
+	uint64_t *dirty_log;	/* see vm_dirty_log_start() */
+	int	dirty_on;	/* DM writes are being logged */
+	int	dirty_hv;	/* VHM logs the guest's own writes too */
+	struct vhm_request *ioreq_buf;	/* shared I/O request page */
+	struct inout_handler *ioports;	/* see init_inout() */
+	struct inout_stats *ioport_stats; /* see inout_stats_init() */
+	int	snap_fd;	/* snapshot guest RAM is mapped from, or -1 */
+	off_t	snap_memoff;	/* lowmem's offset in it, highmem follows */
 };
 
 /*
@@ -69,6 +85,9 @@ enum vm_mmap_style {
  */
 #define	VM_MEM_F_INCORE	0x01	/* include guest memory in core file */
 #define	VM_MEM_F_WIRED	0x02	/* guest memory is wired */
+#define	VM_MEM_F_HUGE_2M	0x04	/* back guest memory with 2MB hugetlb */
+#define	VM_MEM_F_HUGE_1G	0x08	/* back guest memory with 1GB hugetlb */
+#define	VM_MEM_F_LAZY	0x10	/* populate guest memory on first touch */
 
 #define	VM_MEMMAP_F_WIRED	0x01
 #define	VM_MEMMAP_F_IOMMU	0x02
@@ -102,13 +121,25 @@ int	vm_create_ioreq_client(struct vmctx *ctx);
 int	vm_destroy_ioreq_client(struct vmctx *ctx);
 int	vm_attach_ioreq_client(struct vmctx *ctx);
 int	vm_notify_request_done(struct vmctx *ctx, int vcpu);
+int	vm_notify_request_done_batch(struct vmctx *ctx, uint64_t vcpu_mask);
+int	vm_ioeventfd(struct vmctx *ctx, struct acrn_ioeventfd *args);
+int	vm_pio_shadow(struct vmctx *ctx, struct acrn_pio_shadow *args);
 void	vm_set_suspend_mode(enum vm_suspend_how how);
 int	vm_get_suspend_mode(void);
 void	vm_destroy(struct vmctx *ctx);
 int	vm_parse_memsize(const char *optarg, size_t *memsize);
 int	vm_setup_memory(struct vmctx *ctx, size_t len, enum vm_mmap_style s);
 void	vm_unsetup_memory(struct vmctx *ctx);
+int	vm_discard_memory(struct vmctx *ctx, void *hva, size_t len);
+int	vm_snapshot_memory(struct vmctx *ctx, int fd, off_t off);
+void	vm_restore_memory(struct vmctx *ctx, int fd, off_t off);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
+int	dm_gpa_copy_in(struct vmctx *ctx, vm_paddr_t gaddr, void *buf,
+		       size_t len);
+int	dm_gpa_copy_out(struct vmctx *ctx, vm_paddr_t gaddr, const void *buf,
+			size_t len);
+int	dm_gpa_to_iov(struct vmctx *ctx, vm_paddr_t gaddr, size_t len,
+		      struct iovec *iov, int niov);
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 void	vm_set_lowmem_limit(struct vmctx *ctx, uint32_t limit);
 void	vm_set_memflags(struct vmctx *ctx, int flags);
@@ -118,7 +149,27 @@ size_t	vm_get_highmem_size(struct vmctx *ctx);
 int	vm_run(struct vmctx *ctx);
 int	vm_suspend(struct vmctx *ctx, enum vm_suspend_how how);
 int	vm_apicid2vcpu(struct vmctx *ctx, int apicid);
+int	vm_dirty_log_start(struct vmctx *ctx);
+void	vm_dirty_log_stop(struct vmctx *ctx);
+size_t	vm_dirty_log_words(struct vmctx *ctx);
+int	vm_dirty_log_get(struct vmctx *ctx, uint64_t *bitmap);
+void	vm_dirty_mark_range(struct vmctx *ctx, void *hva, size_t len);
+
+/*
+ * Backends call this after writing guest memory they reached through
+ * paddr_guest2host(); it costs a test unless a dirty log is running.
+ */
+static inline void
+vm_dirty_mark(struct vmctx *ctx, void *hva, size_t len)
+{
+	if (ctx->dirty_on && len > 0)
+		vm_dirty_mark_range(ctx, hva, len);
+}
+
 int	vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg);
+void	vm_intr_batch_begin(void);
+void	vm_intr_batch_end(void);
+int	vm_irqfd(struct vmctx *ctx, struct acrn_irqfd *args);
 int	vm_ioapic_assert_irq(struct vmctx *ctx, int irq);
 int	vm_ioapic_deassert_irq(struct vmctx *ctx, int irq);
 int	vm_ioapic_pincount(struct vmctx *ctx, int *pincount);
@@ -131,6 +182,9 @@ int	vm_map_ptdev_mmio(struct vmctx *ctx, int bus, int slot, int func,
 			  vm_paddr_t gpa, size_t len, vm_paddr_t hpa);
 int	vm_setup_ptdev_msi(struct vmctx *ctx,
 			   struct acrn_vm_pci_msix_remap *msi_remap);
+int	vm_setup_ptdev_msi_batch(struct vmctx *ctx,
+				 struct acrn_vm_pci_msix_remap *remaps,
+				 int count);
 int	vm_set_ptdev_msix_info(struct vmctx *ctx, struct ic_ptdev_irq *ptirq);
 int	vm_reset_ptdev_msix_info(struct vmctx *ctx, uint16_t virt_bdf,
 	int vector_count);